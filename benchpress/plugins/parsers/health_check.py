@@ -111,8 +111,17 @@ class HealthCheckParser(Parser):
 
     def parse_sleepbench(self, line, idx):
         metrics = self.metrics
+        if line.startswith("wakeup overshoot p"):
+            # e.g. "wakeup overshoot p99: 61440 ns"
+            percentile = line.split()[2].rstrip(":")
+            metrics["sleepbench"][f"overshoot {percentile} ns"] = float(
+                line.split()[3]
+            )
         if "calls per second" in line:
             metrics["sleepbench"]["calls per second"] = float(line.split()[0])
+            # Only the last run of a sweep is followed by the CPU utilization
+            if idx + 1 >= len(self.stdout) or "," not in self.stdout[idx + 1]:
+                return
             cpu_line = self.stdout[idx + 1]
             metrics["sleepbench"]["usr%"] = float(cpu_line.split(",")[0])
             metrics["sleepbench"]["nice%"] = float(cpu_line.split(",")[1])
@@ -48,7 +48,8 @@ fi
 dnf install -y bc ninja-build flex bison git texinfo binutils-devel \
     libsodium-devel libunwind-devel bzip2-devel double-conversion-devel \
     libzstd-devel lz4-devel xz-devel snappy-devel libtool bzip2 openssl-devel \
-    zlib-devel libdwarf libdwarf-devel libaio-devel libatomic patch jq
+    zlib-devel libdwarf libdwarf-devel libaio-devel libatomic patch jq \
+    liburing-devel
 
 # Creates feedsim directory under benchmarks/
 mkdir -p "${BENCHPRESS_ROOT}/benchmarks/feedsim"
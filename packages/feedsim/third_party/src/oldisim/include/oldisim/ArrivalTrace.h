@@ -0,0 +1,114 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_ARRIVAL_TRACE_H
+#define OLDISIM_ARRIVAL_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace oldisim {
+
+/**
+ * One recorded request arrival. timestamp_ns is relative to the start of
+ * the trace.
+ */
+struct TraceRecord {
+  uint64_t timestamp_ns;
+  uint32_t type;
+  uint32_t payload_length;
+};
+
+/**
+ * A read-only sequence of request arrivals in timestamp order.
+ *
+ * Binary traces start with an 8 byte "OLDTRACE" magic and a 64-bit version,
+ * followed by TraceRecords in host byte order until the end of the file;
+ * they are memory-mapped. CSV traces have one "timestamp_ns,type,
+ * payload_length" line per arrival, with an optional header line, and are
+ * parsed into memory. Records out of timestamp order are fatal.
+ */
+class ArrivalTrace {
+ public:
+  /**
+   * Load the trace at path, picking the format from the magic. Failing to
+   * read or parse it is fatal.
+   */
+  static std::shared_ptr<const ArrivalTrace> Open(const std::string& path);
+  ~ArrivalTrace();
+  ArrivalTrace(const ArrivalTrace&) = delete;
+  ArrivalTrace& operator=(const ArrivalTrace&) = delete;
+
+  size_t size() const { return num_records_; }
+  const TraceRecord& operator[](size_t i) const { return records_[i]; }
+
+  /**
+   * Time from the first arrival of one pass to the first arrival of the
+   * next when the trace is looped: its span plus one mean inter-arrival gap
+   */
+  uint64_t period_ns() const;
+
+ private:
+  ArrivalTrace();
+
+  const TraceRecord* records_;
+  size_t num_records_;
+  // Backing storage, either a mapping or parsed CSV records
+  void* mapping_;
+  size_t mapping_length_;
+  std::vector<TraceRecord> parsed_records_;
+};
+
+/**
+ * Records request arrivals from any number of threads into a binary trace
+ * that ArrivalTrace can replay. Timestamps are taken relative to the
+ * construction of the recorder. Records are buffered and appended to the
+ * file as they come, so a trace cut short by a crash is still readable up
+ * to the last full record.
+ */
+class ArrivalTraceRecorder {
+ public:
+  /**
+   * Create or truncate the trace at path. Failing to open it is fatal.
+   */
+  explicit ArrivalTraceRecorder(const std::string& path);
+  ~ArrivalTraceRecorder();
+  ArrivalTraceRecorder(const ArrivalTraceRecorder&) = delete;
+  ArrivalTraceRecorder& operator=(const ArrivalTraceRecorder&) = delete;
+
+  /**
+   * Record a request of the given type that is sent at time_ns, as returned
+   * by GetTimeAccurateNano
+   */
+  void Record(uint64_t time_ns, uint32_t type, uint32_t payload_length);
+
+  /**
+   * Write out the remaining records and close the file
+   */
+  void Close();
+
+ private:
+  std::mutex lock_;
+  FILE* file_;
+  uint64_t start_time_ns_;
+  uint64_t last_timestamp_ns_;
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_ARRIVAL_TRACE_H
@@ -0,0 +1,68 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_CACHE_ALIGNED_H
+#define OLDISIM_CACHE_ALIGNED_H
+
+#include <stdlib.h>
+
+#include <cstddef>
+
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+static const size_t kCacheLineSize = 64;
+
+/**
+ * Allocator for containers whose storage is written by one thread while
+ * other threads write nearby data. Every allocation starts on a cache line
+ * and is padded to a whole number of lines, so it never shares a line with
+ * another allocation.
+ */
+template <typename T>
+struct CacheAlignedAllocator {
+  typedef T value_type;
+
+  CacheAlignedAllocator() {}
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    size_t size = (n * sizeof(T) + kCacheLineSize - 1) / kCacheLineSize *
+                  kCacheLineSize;
+    void* p;
+    if (posix_memalign(&p, kCacheLineSize, size) != 0) {
+      DIE("Could not allocate %zu cache-aligned bytes", size);
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t n) { free(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T>&,
+                const CacheAlignedAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T>&,
+                const CacheAlignedAllocator<U>&) {
+  return false;
+}
+}  // namespace oldisim
+
+#endif  // OLDISIM_CACHE_ALIGNED_H
@@ -16,11 +16,14 @@
 #define OLDISIM_CALLBACKS_H
 
 #include <functional>
+#include <map>
 #include <memory>
+#include <string>
 
 namespace oldisim {
 
 class ChildConnection;
+class ChildConnectionStats;
 class FanoutManager;
 class NodeThread;
 class ParentConnection;
@@ -32,6 +35,11 @@ typedef std::function<void(NodeThread&, ParentConnection&)> AcceptCallback;
 
 typedef std::function<void(NodeThread&)> LeafNodeThreadStartupCallback;
 typedef std::function<void(NodeThread&, QueryContext&)> LeafNodeQueryCallback;
+typedef std::function<std::map<std::string, double>()> MonitoringStatsCallback;
+// Applies an update of the monitoring config endpoint, by key, and returns
+// an empty string, or leaves the configuration as it was and returns why
+typedef std::function<std::string(const std::map<std::string, std::string>&)>
+    MonitoringConfigCallback;
 
 typedef std::function<void(NodeThread&, FanoutManager&)>
     ParentNodeThreadStartupCallback;
@@ -44,6 +52,8 @@ typedef std::function<void(NodeThread&, ResponseContext&)>
     DriverNodeResponseCallback;
 typedef std::function<void(NodeThread&, TestDriver&)>
     DriverNodeMakeRequestCallback;
+typedef std::function<void(const ChildConnectionStats&)>
+    DriverNodeStatsWindowCallback;
 }  // namespace oldisim
 
 #endif  // OLDISIM_CALLBACKS_H
@@ -45,6 +45,21 @@ class ChildConnection {
 
   void IssueRequest(uint32_t type, uint64_t request_id, const void* payload,
                     uint32_t length);
+  /**
+   * Issue a request whose latency is measured from start_time instead of the
+   * moment it is written out, e.g. the time an open-loop schedule intended
+   * to send it.
+   */
+  void IssueRequest(uint32_t type, uint64_t request_id, const void* payload,
+                    uint32_t length, uint64_t start_time);
+  /**
+   * Issue a request that carries a scheduling class for the child: its
+   * priority, lower values being more urgent, and deadline_us, the time
+   * budget left for the request as it leaves this node or 0 for none.
+   */
+  void IssueRequest(uint32_t type, uint64_t request_id, const void* payload,
+                    uint32_t length, uint64_t start_time, uint32_t priority,
+                    uint32_t deadline_us);
   void Reset();
 
   void set_priority(int pri);
@@ -16,52 +16,103 @@
 #include <inttypes.h>
 
 #include <algorithm>
-#include <map>
 #include <set>
 #include <vector>
 
 #include "oldisim/Log.h"
-#include "oldisim/LogHistogramSampler.h"
+#include "oldisim/HdrHistogram.h"
 #include "oldisim/Query.h"
 #include "oldisim/Response.h"
+#include "oldisim/Seqlock.h"
+#include "oldisim/TypeIndexedArray.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
 
+/**
+ * Requests sent to one child and the replies to them, by request type. A
+ * single thread logs into each object; like LeafNodeStats, other threads
+ * read consistent copies with Snapshot() while it does.
+ */
 class ChildConnectionStats {
  public:
-  explicit ChildConnectionStats(const std::set<uint32_t>& query_types) {
-    const int kHistogramBins = 1000;
-    for (auto type : query_types) {
-      // query_samplers_.emplace(type, std::unique_ptr<LogHistogramSampler>(new
-      // LogHistogramSampler(kHistogramBins)));
-      query_samplers_.insert(
-          std::make_pair(type, LogHistogramSampler(kHistogramBins)));
-      query_processing_time_samplers_.insert(
-          std::make_pair(type, LogHistogramSampler(kHistogramBins)));
-      tx_bytes_[type] = 0;
-      rx_bytes_[type] = 0;
-      query_counts_[type] = 0;
-      dropped_requests_[type] = 0;
-    }
+  static const int kHistogramSignificantDigits = 2;
+
+  explicit ChildConnectionStats(const std::set<uint32_t>& query_types)
+      : query_samplers_(query_types, HdrHistogram(kHistogramSignificantDigits)),
+        query_processing_time_samplers_(
+            query_types, HdrHistogram(kHistogramSignificantDigits)),
+        query_network_time_samplers_(
+            query_types, HdrHistogram(kHistogramSignificantDigits)),
+        query_queue_time_samplers_(
+            query_types, HdrHistogram(kHistogramSignificantDigits)),
+        query_service_time_samplers_(
+            query_types, HdrHistogram(kHistogramSignificantDigits)),
+        tx_bytes_(query_types, 0),
+        rx_bytes_(query_types, 0),
+        query_counts_(query_types, 0),
+        dropped_requests_(query_types, 0),
+        late_requests_(query_types, 0),
+        schedule_slip_ns_(query_types, 0),
+        hedged_requests_(query_types, 0),
+        hedge_wins_(query_types, 0),
+        abandoned_requests_(query_types, 0),
+        rejected_requests_(query_types, 0),
+        expired_requests_(query_types, 0),
+        queued_requests_(query_types, 0),
+        queue_wait_ns_(query_types, 0),
+        throttled_requests_(query_types, 0),
+        credit_window_(0) {
     start_time_ = GetTimeAccurateNano();
   }
 
   uint64_t start_time_;
   uint64_t end_time_;
-  std::map<uint32_t, LogHistogramSampler> query_samplers_;
-  std::map<uint32_t, LogHistogramSampler> query_processing_time_samplers_;
-  std::map<uint32_t, uint64_t> tx_bytes_;
-  std::map<uint32_t, uint64_t> rx_bytes_;
-  std::map<uint32_t, uint64_t> query_counts_;
-  std::map<uint32_t, uint64_t> dropped_requests_;
+  TypeIndexedArray<HdrHistogram> query_samplers_;
+  TypeIndexedArray<HdrHistogram> query_processing_time_samplers_;
+  // Latency split into the time outside the child, the time queries waited
+  // at the child before their handler started, and the rest of the
+  // processing time
+  TypeIndexedArray<HdrHistogram> query_network_time_samplers_;
+  TypeIndexedArray<HdrHistogram> query_queue_time_samplers_;
+  TypeIndexedArray<HdrHistogram> query_service_time_samplers_;
+  TypeIndexedArray<uint64_t> tx_bytes_;
+  TypeIndexedArray<uint64_t> rx_bytes_;
+  TypeIndexedArray<uint64_t> query_counts_;
+  TypeIndexedArray<uint64_t> dropped_requests_;
+  // Open-loop requests that went out later than their scheduled time, and
+  // the total time they spent waiting past it
+  TypeIndexedArray<uint64_t> late_requests_;
+  TypeIndexedArray<uint64_t> schedule_slip_ns_;
+  // Backup requests sent by a hedging FanoutManager, and how many of them
+  // replied before the original request
+  TypeIndexedArray<uint64_t> hedged_requests_;
+  TypeIndexedArray<uint64_t> hedge_wins_;
+  // Requests left unanswered when their fanout completed on a quorum
+  TypeIndexedArray<uint64_t> abandoned_requests_;
+  // Requests the child shed instead of answering, by ResponseStatus. Their
+  // responses are not sampled into the latency histograms.
+  TypeIndexedArray<uint64_t> rejected_requests_;
+  TypeIndexedArray<uint64_t> expired_requests_;
+  // Requests a FanoutManager held back because the credit window of the
+  // child was full, the total time they waited before going out, and the
+  // requests it failed instead of holding back
+  TypeIndexedArray<uint64_t> queued_requests_;
+  TypeIndexedArray<uint64_t> queue_wait_ns_;
+  TypeIndexedArray<uint64_t> throttled_requests_;
+  // Requests a thread may have outstanding to the child, 0 for no limit.
+  // Accumulating keeps the largest window rather than a sum, so that totals
+  // over time still show the configured window.
+  uint64_t credit_window_;
 
   void LogRequest(const Query& request) {
     assert(tx_bytes_.count(request.GetType()) > 0);
     assert(query_counts_.count(request.GetType()) > 0);
 
+    seqlock_.BeginWrite();
     tx_bytes_.at(request.GetType()) += request.GetQueryPacketSize();
     query_counts_.at(request.GetType())++;
+    seqlock_.EndWrite();
   }
 
   void LogResponse(const Query& originating_request, const Response& response) {
@@ -70,16 +121,111 @@ class ChildConnectionStats {
                originating_request.GetType()) > 0);
     assert(tx_bytes_.count(response.GetType()) > 0);
 
-    query_samplers_.at(originating_request.GetType())
-        .sample(originating_request.Time());
-    query_processing_time_samplers_.at(originating_request.GetType())
-        .sample(response.GetProcessingTime());
+    seqlock_.BeginWrite();
     rx_bytes_.at(response.GetType()) += response.GetResponsePacketSize();
+    if (response.GetStatus() == ResponseStatus::kRejected) {
+      rejected_requests_.at(response.GetType())++;
+    } else if (response.GetStatus() == ResponseStatus::kExpired) {
+      expired_requests_.at(response.GetType())++;
+    } else {
+      uint32_t type = originating_request.GetType();
+      uint64_t latency = originating_request.Time();
+      uint64_t processing_time = response.GetProcessingTime();
+      uint64_t queue_time = std::min(response.GetQueueTime(), processing_time);
+      query_samplers_.at(type).sample(latency);
+      query_processing_time_samplers_.at(type).sample(processing_time);
+      query_network_time_samplers_.at(type).sample(
+          latency > processing_time ? latency - processing_time : 0);
+      query_queue_time_samplers_.at(type).sample(queue_time);
+      query_service_time_samplers_.at(type).sample(processing_time -
+                                                   queue_time);
+    }
+    seqlock_.EndWrite();
   }
 
   void LogDroppedRequest(uint32_t request_type) {
     assert(dropped_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
     dropped_requests_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogScheduleSlip(uint32_t request_type, uint64_t slip_ns) {
+    assert(late_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    late_requests_.at(request_type)++;
+    schedule_slip_ns_.at(request_type) += slip_ns;
+    seqlock_.EndWrite();
+  }
+
+  void LogHedgedRequest(uint32_t request_type) {
+    assert(hedged_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    hedged_requests_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogHedgeWin(uint32_t request_type) {
+    assert(hedge_wins_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    hedge_wins_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogAbandonedRequest(uint32_t request_type) {
+    assert(abandoned_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    abandoned_requests_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogQueuedRequest(uint32_t request_type) {
+    assert(queued_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    queued_requests_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogQueueWait(uint32_t request_type, uint64_t wait_ns) {
+    assert(queue_wait_ns_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    queue_wait_ns_.at(request_type) += wait_ns;
+    seqlock_.EndWrite();
+  }
+
+  void LogThrottledRequest(uint32_t request_type) {
+    assert(throttled_requests_.count(request_type) > 0);
+    seqlock_.BeginWrite();
+    throttled_requests_.at(request_type)++;
+    seqlock_.EndWrite();
+  }
+
+  void SetCreditWindow(uint64_t window) {
+    seqlock_.BeginWrite();
+    credit_window_ = window;
+    seqlock_.EndWrite();
+  }
+
+  /**
+   * Reserve the full range of every histogram. Must be called by the
+   * logging thread before other threads take snapshots.
+   */
+  void ReserveForSnapshots() {
+    for (auto sampler : query_samplers_) {
+      sampler.second.ReserveFullRange();
+      query_processing_time_samplers_.at(sampler.first).ReserveFullRange();
+      query_network_time_samplers_.at(sampler.first).ReserveFullRange();
+      query_queue_time_samplers_.at(sampler.first).ReserveFullRange();
+      query_service_time_samplers_.at(sampler.first).ReserveFullRange();
+    }
+  }
+
+  /**
+   * Copy the totals into copy, which must have the same query types.
+   * Safe to call from any thread while the owning thread logs.
+   */
+  void Snapshot(ChildConnectionStats* copy) const {
+    seqlock_.Read([this, copy]() { *copy = *this; });
   }
 
   void Accumulate(const ChildConnectionStats& cs) {
@@ -90,6 +236,8 @@ class ChildConnectionStats {
     assert(cs.rx_bytes_.size() == rx_bytes_.size());
     assert(cs.query_counts_.size() == query_counts_.size());
     assert(cs.dropped_requests_.size() == dropped_requests_.size());
+    assert(cs.late_requests_.size() == late_requests_.size());
+    assert(cs.hedged_requests_.size() == hedged_requests_.size());
 
     for (const auto& sampler : cs.query_samplers_) {
       query_samplers_.at(sampler.first).accumulate(sampler.second);
@@ -98,6 +246,12 @@ class ChildConnectionStats {
     for (const auto& sampler : cs.query_processing_time_samplers_) {
       query_processing_time_samplers_.at(sampler.first)
           .accumulate(sampler.second);
+      query_network_time_samplers_.at(sampler.first)
+          .accumulate(cs.query_network_time_samplers_.at(sampler.first));
+      query_queue_time_samplers_.at(sampler.first)
+          .accumulate(cs.query_queue_time_samplers_.at(sampler.first));
+      query_service_time_samplers_.at(sampler.first)
+          .accumulate(cs.query_service_time_samplers_.at(sampler.first));
     }
 
     for (const auto& stat : cs.tx_bytes_) {
@@ -115,18 +269,110 @@ class ChildConnectionStats {
     for (const auto& stat : cs.dropped_requests_) {
       dropped_requests_[stat.first] += stat.second;
     }
+
+    for (const auto& stat : cs.late_requests_) {
+      late_requests_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.schedule_slip_ns_) {
+      schedule_slip_ns_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.hedged_requests_) {
+      hedged_requests_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.hedge_wins_) {
+      hedge_wins_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.abandoned_requests_) {
+      abandoned_requests_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.rejected_requests_) {
+      rejected_requests_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.expired_requests_) {
+      expired_requests_[stat.first] += stat.second;
+    }
+
+    for (const auto& stat : cs.queued_requests_) {
+      queued_requests_[stat.first] += stat.second;
+      queue_wait_ns_[stat.first] += cs.queue_wait_ns_[stat.first];
+      throttled_requests_[stat.first] += cs.throttled_requests_[stat.first];
+    }
+
+    credit_window_ = std::max(credit_window_, cs.credit_window_);
+  }
+
+  /**
+   * Take away an earlier snapshot of the same totals, leaving what was
+   * logged since
+   */
+  void Subtract(const ChildConnectionStats& earlier) {
+    for (const auto& sampler : earlier.query_samplers_) {
+      query_samplers_.at(sampler.first).Subtract(sampler.second);
+    }
+
+    for (const auto& sampler : earlier.query_processing_time_samplers_) {
+      query_processing_time_samplers_.at(sampler.first)
+          .Subtract(sampler.second);
+      query_network_time_samplers_.at(sampler.first)
+          .Subtract(earlier.query_network_time_samplers_.at(sampler.first));
+      query_queue_time_samplers_.at(sampler.first)
+          .Subtract(earlier.query_queue_time_samplers_.at(sampler.first));
+      query_service_time_samplers_.at(sampler.first)
+          .Subtract(earlier.query_service_time_samplers_.at(sampler.first));
+    }
+
+    for (const auto& stat : earlier.tx_bytes_) {
+      tx_bytes_[stat.first] -= stat.second;
+      rx_bytes_[stat.first] -= earlier.rx_bytes_[stat.first];
+      query_counts_[stat.first] -= earlier.query_counts_[stat.first];
+      dropped_requests_[stat.first] -= earlier.dropped_requests_[stat.first];
+      late_requests_[stat.first] -= earlier.late_requests_[stat.first];
+      schedule_slip_ns_[stat.first] -= earlier.schedule_slip_ns_[stat.first];
+      hedged_requests_[stat.first] -= earlier.hedged_requests_[stat.first];
+      hedge_wins_[stat.first] -= earlier.hedge_wins_[stat.first];
+      abandoned_requests_[stat.first] -=
+          earlier.abandoned_requests_[stat.first];
+      rejected_requests_[stat.first] -= earlier.rejected_requests_[stat.first];
+      expired_requests_[stat.first] -= earlier.expired_requests_[stat.first];
+      queued_requests_[stat.first] -= earlier.queued_requests_[stat.first];
+      queue_wait_ns_[stat.first] -= earlier.queue_wait_ns_[stat.first];
+      throttled_requests_[stat.first] -=
+          earlier.throttled_requests_[stat.first];
+    }
   }
 
   void Reset() {
     for (const auto& stat : query_samplers_) {
       query_samplers_.at(stat.first).Reset();
       query_processing_time_samplers_.at(stat.first).Reset();
+      query_network_time_samplers_.at(stat.first).Reset();
+      query_queue_time_samplers_.at(stat.first).Reset();
+      query_service_time_samplers_.at(stat.first).Reset();
       tx_bytes_[stat.first] = 0;
       rx_bytes_[stat.first] = 0;
       query_counts_[stat.first] = 0;
       dropped_requests_[stat.first] = 0;
+      late_requests_[stat.first] = 0;
+      schedule_slip_ns_[stat.first] = 0;
+      hedged_requests_[stat.first] = 0;
+      hedge_wins_[stat.first] = 0;
+      abandoned_requests_[stat.first] = 0;
+      rejected_requests_[stat.first] = 0;
+      expired_requests_[stat.first] = 0;
+      queued_requests_[stat.first] = 0;
+      queue_wait_ns_[stat.first] = 0;
+      throttled_requests_[stat.first] = 0;
     }
     start_time_ = GetTimeAccurateNano();
   }
+
+ private:
+  Seqlock seqlock_;
 };
 }  // namespace oldisim
@@ -0,0 +1,69 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_CONNECTION_SPREADING_H
+#define OLDISIM_CONNECTION_SPREADING_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace oldisim {
+
+/**
+ * How TCP connections to child nodes are spread over the network. Every
+ * connection to a child goes to the next of the addresses its name
+ * resolves to, IPv4 or IPv6, so a child with an address per NIC gets its
+ * connections spread over its NICs.
+ */
+struct ConnectionSpreadOptions {
+  // Numeric local addresses connections are bound to in turn, one per NIC
+  // to spread over. Each connection takes the next one of its target's
+  // family; the kernel picks the source by route if there is none.
+  std::vector<std::string> source_addresses;
+  // Pick the source port of every connection so that the replies to it
+  // hash onto the receive queue of the local NIC with the fewest
+  // connections so far. The queue is predicted with the Toeplitz key and
+  // indirection table of the NIC, or the default key spread evenly over
+  // its queues if the NIC does not report them.
+  bool rss_source_ports = false;
+};
+
+/**
+ * Spread the connections made from now on as options say. Call it before
+ * starting any parent node server or driver. Unusable source addresses are
+ * fatal.
+ */
+void SetConnectionSpreading(const ConnectionSpreadOptions& options);
+const ConnectionSpreadOptions& GetConnectionSpreading();
+
+struct RssQueueConnections {
+  // Local network interface
+  std::string interface;
+  // Whether the queues were predicted from the key and indirection table
+  // the NIC reported, rather than assumed
+  bool from_device;
+  // Connections made whose replies hash onto each receive queue
+  std::vector<uint64_t> connections;
+};
+
+/**
+ * The receive queues the TCP connections made so far land on, for every
+ * local interface they were made from
+ */
+std::vector<RssQueueConnections> GetRssQueueConnections();
+}  // namespace oldisim
+
+#endif  // OLDISIM_CONNECTION_SPREADING_H
@@ -0,0 +1,61 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_DRIVER_COORDINATOR_H
+#define OLDISIM_DRIVER_COORDINATOR_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+namespace oldisim {
+
+/**
+ * Runs one load test across several DriverNodes, each of which has been
+ * pointed at the coordinator with DriverNode::SetCoordinator.
+ *
+ * The coordinator holds every driver at registration until num_drivers have
+ * registered and then releases them together. While the test runs it merges
+ * the stats windows streamed by the drivers into a live global summary, and
+ * once every driver has reported its totals it prints one report, in the
+ * same format as a single DriverNode, with histograms merged bucket by
+ * bucket rather than percentiles averaged across drivers.
+ */
+class DriverCoordinator {
+ public:
+  DriverCoordinator(uint16_t port, int num_drivers);
+  ~DriverCoordinator();
+  DriverCoordinator(const DriverCoordinator&) = delete;
+  DriverCoordinator& operator=(const DriverCoordinator&) = delete;
+
+  /**
+   * Write the merged latency distributions to path, as
+   * DriverNode::SetHistogramOutputFile does for a single driver.
+   */
+  void SetHistogramOutputFile(const std::string& path);
+
+  /**
+   * Serve the drivers until all of them are done or ctrl-c, then print
+   * the merged report.
+   */
+  void Run();
+
+ private:
+  struct DriverCoordinatorImpl;
+  std::unique_ptr<DriverCoordinatorImpl> impl_;
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_DRIVER_COORDINATOR_H
@@ -19,6 +19,8 @@
 #include <string>
 
 #include "oldisim/Callbacks.h"
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
 
 namespace oldisim {
 
@@ -27,7 +29,9 @@ class NodeThread;
 
 class DriverNode {
  public:
-  DriverNode(const std::string& hostname, uint16_t port);
+  DriverNode(const std::string& hostname, uint16_t port,
+             Transport transport = Transport::kTcp,
+             Framing framing = Framing::kFixed);
   ~DriverNode();
   void Run(uint32_t num_threads, bool thread_pinning,
            uint32_t num_connections_per_thread, uint32_t max_connection_depth);
@@ -68,6 +72,93 @@ class DriverNode {
    */
   void EnableMonitoring(uint16_t port);
 
+  /**
+   * Accept authenticated configuration updates at /config when monitoring
+   * is enabled: a POST with the header "Authorization: Bearer <token>" and
+   * a form encoded body of key=value pairs is handed to callback, on the
+   * main thread, and answered with whatever it returned. The callback must
+   * publish the update so that the driver threads pick it up atomically.
+   */
+  void SetMonitoringConfigCallback(const std::string& token,
+                                   const MonitoringConfigCallback& callback);
+
+  /**
+   * Sample the energy counters and effective CPU frequency of this host
+   * over the measure phase, or the whole run without phases. The end of run
+   * summary and the /power monitoring URL report them as queries per joule
+   * and average frequency.
+   */
+  void EnablePowerTelemetry();
+
+  /**
+   * Write the end-of-run latency distribution of each request type to path
+   * in HdrHistogram percentile text format, with values in milliseconds.
+   * With several request types, the type is appended as ".<type>".
+   */
+  void SetHistogramOutputFile(const std::string& path);
+
+  /**
+   * Record the arrival time, type and size of every request sent during the
+   * run to path as a binary trace, which TestDriver::SetTraceSchedule can
+   * replay through ArrivalTrace::Open. Must be called before Run().
+   */
+  void SetTraceRecordFile(const std::string& path);
+
+  /**
+   * Append the counters and latency histograms of every stats window of
+   * the run to path as a StatsLog. Must be called before Run().
+   */
+  void SetStatsLogFile(const std::string& path);
+
+  /**
+   * Set the driver up for tens of thousands of connections, to model the
+   * fan-in of a mid-tier. Connections keep no bufferevent: every thread
+   * receives into one buffer shared by its connections, and a connection
+   * only allocates buffers of its own to hold a partial response or data
+   * its socket would not take yet, so idle connections cost little memory
+   * and cache. Requests go to the ready connections in turn, in constant
+   * time, so that all of them carry load. The open file limit is raised to
+   * fit the connections. Needs plain TCP through the libevent I/O engine.
+   * Must be called before Run().
+   */
+  void EnableHighConnectionCount();
+
+  /**
+   * Run as one of several drivers under a DriverCoordinator listening at
+   * hostname:port. The driver registers before sending any load, waits for
+   * the coordinator to release all drivers at once, streams every stats
+   * window to it and reports its totals at the end of the run. Must be
+   * called before Run().
+   */
+  void SetCoordinator(const std::string& hostname, uint16_t port);
+
+  /**
+   * Set the callback to run with the stats of all threads over each one
+   * second window of the run. It runs on the thread that called Run(), which
+   * makes it safe to call Shutdown() from it.
+   */
+  void SetStatsWindowCallback(const DriverNodeStatsWindowCallback& callback);
+
+  /**
+   * Split the run into phases of whole stats windows. The first
+   * warmup_seconds are left out of the final report, the next
+   * measure_seconds make it up and the load then keeps going for
+   * cooldown_seconds before the run ends on its own. A measure_seconds of 0
+   * measures until Shutdown(). Must be called before Run().
+   */
+  void SetMeasurementPhases(int warmup_seconds, int measure_seconds,
+                            int cooldown_seconds);
+
+  /**
+   * Extend the warmup until the QPS and the mean latency over the last
+   * num_windows stats windows each have a coefficient of variation of at
+   * most max_cv, or until max_warmup_seconds have passed without that (0
+   * waits forever). The steady windows are the first ones measured. Must be
+   * called before Run().
+   */
+  void SetSteadyStateDetection(int num_windows, double max_cv,
+                               int max_warmup_seconds);
+
  private:
   struct DriverNodeImpl;
   struct DriverNodeThread;
@@ -0,0 +1,57 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_EVENT_LOOP_H
+#define OLDISIM_EVENT_LOOP_H
+
+#include <stdint.h>
+
+namespace oldisim {
+
+/**
+ * How node threads wait for events. kInterrupt blocks in epoll until the
+ * kernel wakes the thread. kBusyPoll spins on non-blocking passes over the
+ * event loop so no request waits for a wakeup, and only blocks in epoll
+ * after it has been idle for a while.
+ */
+enum class EventLoopMode {
+  kInterrupt,
+  kBusyPoll,
+};
+
+struct BusyPollOptions {
+  // How long a thread keeps spinning after its last event before it blocks
+  // in epoll until the next one. 0 spins for as long as the thread runs.
+  uint32_t idle_backoff_us = 1000;
+  // SO_BUSY_POLL on TCP connection sockets, so reads spin on the device
+  // queue instead of waiting for its interrupt. 0 leaves the socket alone.
+  // Going above net.core.busy_read needs CAP_NET_ADMIN.
+  uint32_t socket_busy_poll_us = 50;
+  // SO_PREFER_BUSY_POLL on the same sockets, which lets busy polling defer
+  // the device interrupt (Linux 5.11 and later)
+  bool prefer_busy_poll = true;
+};
+
+/**
+ * Select how node threads started from now on run their event loops, and
+ * how connections created from now on set up their sockets. Call it before
+ * starting any node server or driver.
+ */
+void SetEventLoopMode(EventLoopMode mode,
+                      const BusyPollOptions& options = BusyPollOptions());
+EventLoopMode GetEventLoopMode();
+const BusyPollOptions& GetBusyPollOptions();
+}  // namespace oldisim
+
+#endif  // OLDISIM_EVENT_LOOP_H
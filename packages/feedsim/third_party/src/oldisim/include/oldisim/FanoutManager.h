@@ -17,17 +17,21 @@
 #define OLDISIM_FAN_OUT_MANAGER_H
 
 #include <netdb.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <memory>
 #include <functional>
 #include <vector>
 
+#include "oldisim/Response.h"
+
 namespace oldisim {
 
 class ChildConnection;
 class ParentNodeServer;
 class QueryContext;
+struct FanoutReplyTrackerInternal;
 
 struct FanoutRequest {
   uint32_t child_node_id;
@@ -38,6 +42,8 @@ struct FanoutRequest {
 
 struct FanoutReply {
   bool timed_out;
+  // Whether the child answered or shed the request, valid unless timed_out
+  ResponseStatus status;
   uint32_t child_node_id;
   uint32_t request_type;
   std::unique_ptr<uint8_t[]> reply_data;
@@ -45,31 +51,130 @@ struct FanoutReply {
   float latency_ms;
 };
 
+/**
+ * Reply slots of a fanout, indexed like the requests that were sent. Up to
+ * kInlineReplies slots are stored inline; wider fanouts use a heap array
+ * that is kept around when the owning tracker is reused.
+ */
+class FanoutReplyList {
+  friend FanoutReplyTrackerInternal;
+
+ public:
+  static constexpr int kInlineReplies = 16;
+
+  FanoutReplyList() : spill_capacity_(0), data_(inline_), size_(0) {}
+  FanoutReplyList(const FanoutReplyList& that) = delete;
+
+  FanoutReply& operator[](size_t index) { return data_[index]; }
+  const FanoutReply& operator[](size_t index) const { return data_[index]; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  FanoutReply* begin() { return data_; }
+  FanoutReply* end() { return data_ + size_; }
+  const FanoutReply* begin() const { return data_; }
+  const FanoutReply* end() const { return data_ + size_; }
+
+ private:
+  FanoutReply inline_[kInlineReplies];
+  std::unique_ptr<FanoutReply[]> spill_;
+  size_t spill_capacity_;
+  FanoutReply* data_;
+  size_t size_;
+
+  // Resize to num_replies slots, each reset to an empty timed-out reply
+  void Reset(size_t num_replies);
+};
+
+/**
+ * Policies for duplicating fanout requests to cut tail latency. kHedged
+ * sends a backup copy on another connection to the same child once a
+ * request has been outstanding for longer than a recent reply latency
+ * percentile. kTied sends both copies right away. In both cases the first
+ * reply is kept and the other one is ignored when it arrives.
+ */
+enum class HedgePolicy { kNone, kHedged, kTied };
+
+/**
+ * Policies for choosing a connection to a child node, and for choosing a
+ * child node in SelectChildNode. kLeastOutstanding takes the one with the
+ * fewest requests outstanding, kPowerOfTwoChoices the less loaded of two
+ * random picks, and kLatencyEwma the lowest product of outstanding
+ * requests and an exponentially weighted average of reply latency.
+ */
+enum class ConnectionPolicy {
+  kRoundRobin,
+  kLeastOutstanding,
+  kPowerOfTwoChoices,
+  kLatencyEwma
+};
+
+/**
+ * What to do with a request to a child whose credit window is full, see
+ * FanoutManager::SetCreditWindow. kQueue holds the request back in the
+ * parent until a reply from the child frees a credit. kFailFast completes
+ * it right away with ResponseStatus::kRejected, as if the child had turned
+ * it away.
+ */
+enum class OverflowPolicy { kQueue, kFailFast };
+
 struct FanoutReplyTracker {
   uint64_t starting_request_id;
   int num_requests;
   int num_replies_received;
-  std::vector<FanoutReply> replies;
+  FanoutReplyList replies;
   bool closed;  // Marked as such when timed out or when all replies received
   uint64_t start_time;
 };
 
 class FanoutManager {
   friend ParentNodeServer;
+  friend FanoutReplyTrackerInternal;
 
  public:
   // Methods to create child connections, used by user programs
   void MakeChildConnection(uint32_t child_node_id);
   void MakeChildConnections(uint32_t child_node_id, int num);
 
-  // Methods to perform fanout queries
+  // Methods to perform fanout queries. The callback runs once all replies
+  // are in, once quorum replies are in if quorum is positive, or once
+  // timeout_ms runs out if it is positive. Replies still outstanding at that
+  // point are left with timed_out set, and ignored if they arrive later.
+  // Timeouts are rounded up to NodeThread::kTimerTickNs.
+  // Requests inherit the priority and the remaining deadline budget of the
+  // originating query.
   typedef std::function<void(QueryContext&, const FanoutReplyTracker&)>
       FanoutDoneCallback;
   void Fanout(QueryContext&& originating_query, const FanoutRequest* requests,
               int num_requests, const FanoutDoneCallback& callback,
-              double timeout_ms = 0.0);
+              double timeout_ms = 0.0, int quorum = 0);
   void FanoutAll(QueryContext&& originating_query, const FanoutRequest& request,
-                 const FanoutDoneCallback& callback, double timeout_ms = 0.0);
+                 const FanoutDoneCallback& callback, double timeout_ms = 0.0,
+                 int quorum = 0);
+
+  // Choose connections to each child node according to policy
+  void SetConnectionPolicy(ConnectionPolicy policy);
+
+  // Pick one of the child nodes according to the connection policy, e.g.
+  // to load balance single-child requests across equivalent children
+  uint32_t SelectChildNode();
+
+  // Duplicate requests according to policy. For kHedged, the backup goes
+  // out after the hedge_percentile of recent reply latencies, and never
+  // sooner than min_delay_ms
+  void SetHedgePolicy(HedgePolicy policy, double hedge_percentile = 95.0,
+                      double min_delay_ms = 0.0);
+
+  // Allow at most window requests outstanding to each child node, over all
+  // of its connections, so that a slow child cannot make requests pile up
+  // in the output buffers; 0 allows any number. Requests past the window
+  // are handled according to overflow. With kQueue at most max_queued
+  // requests wait per child, 0 for no limit, and the rest fail fast. Hedges
+  // are not sent to a child without a free credit. A fanout whose requests
+  // all fail fast completes before Fanout returns.
+  void SetCreditWindow(int window,
+                       OverflowPolicy overflow = OverflowPolicy::kQueue,
+                       int max_queued = 0);
 
  private:
   struct FanoutManagerImpl;
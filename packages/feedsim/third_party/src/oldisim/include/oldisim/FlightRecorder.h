@@ -0,0 +1,112 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_FLIGHT_RECORDER_H
+#define OLDISIM_FLIGHT_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace oldisim {
+
+const int kMaxFlightStages = 8;
+
+/**
+ * When a query finished a stage of the application, as an offset from its
+ * arrival, and the CPU that finished it
+ */
+struct FlightStage {
+  uint32_t end_ns;
+  int16_t cpu;
+  uint8_t stage;
+};
+
+/**
+ * What a query did on its way through a node, filled in as it goes. Thread
+ * numbers are those of the node threads, -1 where a query did not pass
+ * through one: a query served right away was not queued.
+ */
+struct FlightTrace {
+  int16_t queue_thread;
+  int16_t dequeue_thread;
+  int16_t dequeue_cpu;
+  uint8_t num_stages;
+  FlightStage stages[kMaxFlightStages];
+};
+
+/**
+ * The trace of an answered query, kept by the flight recorder. Offsets are
+ * from arrival_time, on the GetTimeAccurateNano clock, and saturate at
+ * about 4 seconds.
+ */
+struct FlightRecord {
+  uint64_t request_id;
+  uint64_t arrival_time;
+  uint32_t type;
+  uint32_t dequeue_ns;
+  uint32_t response_ns;
+  // Kernel thread id and CPU of the thread that sent the response
+  int32_t response_tid;
+  int16_t response_cpu;
+  // ResponseStatus of the response
+  uint8_t status;
+  FlightTrace trace;
+};
+
+struct FlightRecorderOptions {
+  // Only queries that took at least this long to answer are recorded
+  uint64_t threshold_us = 0;
+  // Records each responding thread keeps, the oldest overwritten first
+  size_t records_per_thread = 4096;
+  // Where SIGUSR1 dumps the records of a node server
+  std::string dump_path = "flight_recorder.json";
+  // Stage names for the dump, by stage number
+  std::vector<std::string> stage_names;
+};
+
+/**
+ * Record the trace of every query answered from now on that took at least
+ * the threshold. Every responding thread writes its records into a ring of
+ * its own without locks; queries below the threshold cost a comparison,
+ * and with the recorder disabled marking stages costs a load. Call it
+ * before starting any node server.
+ */
+void EnableFlightRecorder(const FlightRecorderOptions& options);
+bool IsFlightRecorderEnabled();
+const FlightRecorderOptions& GetFlightRecorderOptions();
+
+/**
+ * Record of a query answered by the calling thread, if it took at least
+ * the threshold
+ */
+void RecordFlight(const FlightRecord& record);
+
+/**
+ * The records currently kept by all threads, including exited ones, oldest
+ * first. Safe from any thread while the rings are written.
+ */
+std::vector<FlightRecord> GetFlightRecords();
+
+/**
+ * Write records as a JSON object, with times in microseconds
+ */
+void WriteFlightRecordsJson(const std::vector<FlightRecord>& records,
+                            std::ostream& output);
+}  // namespace oldisim
+
+#endif  // OLDISIM_FLIGHT_RECORDER_H
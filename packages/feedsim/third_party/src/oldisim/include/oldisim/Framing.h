@@ -0,0 +1,41 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_FRAMING_H
+#define OLDISIM_FRAMING_H
+
+namespace oldisim {
+
+/**
+ * How queries and responses are laid out on a connection to a child node.
+ *
+ * kFixed uses fixed-size big-endian packet headers and is understood by
+ * every node server. With kCompact, the connection first sends a hello and
+ * switches to compact frames once the child acknowledges it: little-endian
+ * varint header fields, with the start time, priority, deadline, processing
+ * and queue time and status only present when they are set. The connection
+ * keeps the start time of its queries instead of sending it.
+ * kCompactBatched also pipelines the queries issued during one event loop
+ * iteration into a single batch frame. Only node servers that know the
+ * hello may be told to use compact framing; every node server answers fixed
+ * frames.
+ */
+enum class Framing {
+  kFixed,
+  kCompact,
+  kCompactBatched,
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_FRAMING_H
@@ -0,0 +1,485 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_HDRHISTOGRAM_H
+#define OLDISIM_HDRHISTOGRAM_H
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace oldisim {
+
+/**
+ * Log-linear histogram in the style of HdrHistogram.
+ *
+ * Values are integers (nanoseconds for latencies) tracked with a relative
+ * error of at most 10^-significant_digits. Each power-of-two range above
+ * the first is split linearly into sub-buckets, so the bucket of a value is
+ * found with a count-leading-zeros and two shifts instead of a log().
+ *
+ * Only the range of buckets that actually received samples is allocated,
+ * so per-window snapshots stay small. A histogram has a single writer;
+ * counts from different threads are combined with accumulate(), and
+ * windows are cut out of running totals with Subtract().
+ */
+class HdrHistogram {
+ public:
+  static constexpr int64_t kDefaultHighestTrackableValue =
+      3600LL * 1000000000LL;  // 1 hour in nanoseconds
+
+  HdrHistogram() = delete;
+  explicit HdrHistogram(
+      int significant_digits,
+      int64_t highest_trackable_value = kDefaultHighestTrackableValue)
+      : significant_digits_(significant_digits),
+        highest_trackable_value_(highest_trackable_value),
+        counts_offset_(0),
+        total_count_(0),
+        sum_(0),
+        sum_sq_(0),
+        min_(std::numeric_limits<int64_t>::max()),
+        max_(0) {
+    assert(significant_digits >= 1 && significant_digits <= 5);
+    assert(highest_trackable_value >= 2);
+
+    // Smallest power of two sub-bucket count that resolves 2 * 10^digits
+    int64_t single_unit_resolution = 2;
+    for (int i = 0; i < significant_digits; i++) {
+      single_unit_resolution *= 10;
+    }
+    int sub_bucket_count_magnitude = 0;
+    while ((1LL << sub_bucket_count_magnitude) < single_unit_resolution) {
+      sub_bucket_count_magnitude++;
+    }
+    sub_bucket_half_count_magnitude_ =
+        std::max(sub_bucket_count_magnitude, 1) - 1;
+    sub_bucket_half_count_ = 1LL << sub_bucket_half_count_magnitude_;
+    sub_bucket_mask_ = (sub_bucket_half_count_ << 1) - 1;
+    counts_len_ = CountsIndex(highest_trackable_value_) + 1;
+  }
+
+  void sample(double s) {
+    assert(s >= 0);
+    int64_t value = s < 0 ? 0 : static_cast<int64_t>(s + 0.5);
+    value = std::min(value, highest_trackable_value_);
+
+    EnsureIndex(CountsIndex(value));
+    counts_[CountsIndex(value) - counts_offset_]++;
+
+    total_count_++;
+    sum_ += s;
+    sum_sq_ += s * s;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  double average() const {
+    if (total() == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return sum_ / total();
+  }
+
+  double stddev() const {
+    if (total() == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return sqrt(std::max(0.0, sum_sq_ / total() - pow(sum_ / total(), 2.0)));
+  }
+
+  double minimum() const {
+    if (total() == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return static_cast<double>(min_);
+  }
+
+  double maximum() const {
+    if (total() == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return static_cast<double>(max_);
+  }
+
+  /**
+   * Value below which nth percent of the samples fall, reported as the
+   * highest value equivalent to the bucket the percentile lands in
+   */
+  double get_nth(double nth) const {
+    if (total() == 0) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    nth = std::min(std::max(nth, 0.0), 100.0);
+    uint64_t target = static_cast<uint64_t>(nth / 100 * total_count_ + 0.5);
+    target = std::max<uint64_t>(target, 1);
+
+    uint64_t n = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+      n += counts_[i];
+      if (n >= target) {
+        int32_t index = counts_offset_ + static_cast<int32_t>(i);
+        return static_cast<double>(
+            std::min(HighestEquivalentValue(ValueAtIndex(index)), max_));
+      }
+    }
+
+    return static_cast<double>(max_);
+  }
+
+  uint64_t total() const { return total_count_; }
+
+  double sum() const { return sum_; }
+
+  /**
+   * Number of samples whose bucket lies entirely at or below value
+   */
+  uint64_t count_at_or_below(double value) const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+      int32_t index = counts_offset_ + static_cast<int32_t>(i);
+      if (std::min(HighestEquivalentValue(ValueAtIndex(index)), max_) >
+          value) {
+        break;
+      }
+      n += counts_[i];
+    }
+    return n;
+  }
+
+  void accumulate(const HdrHistogram& h) {
+    assert(significant_digits_ == h.significant_digits_);
+    assert(highest_trackable_value_ == h.highest_trackable_value_);
+
+    if (h.total_count_ == 0) {
+      return;
+    }
+    EnsureIndex(h.counts_offset_);
+    EnsureIndex(h.counts_offset_ + static_cast<int32_t>(h.counts_.size()) - 1);
+    for (size_t i = 0; i < h.counts_.size(); i++) {
+      counts_[h.counts_offset_ - counts_offset_ + i] += h.counts_[i];
+    }
+
+    total_count_ += h.total_count_;
+    sum_ += h.sum_;
+    sum_sq_ += h.sum_sq_;
+    min_ = std::min(min_, h.min_);
+    max_ = std::max(max_, h.max_);
+  }
+
+  /**
+   * Remove the samples of an earlier copy of this histogram, leaving those
+   * recorded since. The minimum and maximum are narrowed to the buckets
+   * that still hold samples.
+   */
+  void Subtract(const HdrHistogram& earlier) {
+    assert(significant_digits_ == earlier.significant_digits_);
+    assert(highest_trackable_value_ == earlier.highest_trackable_value_);
+
+    if (earlier.total_count_ > 0) {
+      assert(earlier.counts_offset_ >= counts_offset_);
+      assert(earlier.counts_offset_ + earlier.counts_.size() <=
+             counts_offset_ + counts_.size());
+      for (size_t i = 0; i < earlier.counts_.size(); i++) {
+        counts_[earlier.counts_offset_ - counts_offset_ + i] -=
+            earlier.counts_[i];
+      }
+      total_count_ -= earlier.total_count_;
+      sum_ -= earlier.sum_;
+      sum_sq_ -= earlier.sum_sq_;
+    }
+
+    if (total_count_ == 0) {
+      Reset();
+      return;
+    }
+    size_t first = 0;
+    while (counts_[first] == 0) {
+      first++;
+    }
+    size_t last = counts_.size() - 1;
+    while (counts_[last] == 0) {
+      last--;
+    }
+    min_ = std::max(min_,
+                    ValueAtIndex(counts_offset_ + static_cast<int32_t>(first)));
+    max_ = std::min(max_, HighestEquivalentValue(ValueAtIndex(
+                              counts_offset_ + static_cast<int32_t>(last))));
+  }
+
+  /**
+   * Reserve room for every bucket so that the counts are never reallocated
+   * as new values come in. This lets another thread copy the histogram
+   * under a Seqlock while it is being written.
+   */
+  void ReserveFullRange() { counts_.reserve(counts_len_); }
+
+  void Reset() {
+    // Keep the allocated range, later windows tend to see similar values
+    std::fill(counts_.begin(), counts_.end(), 0);
+    total_count_ = 0;
+    sum_ = 0;
+    sum_sq_ = 0;
+    min_ = std::numeric_limits<int64_t>::max();
+    max_ = 0;
+  }
+
+  /**
+   * Write the histogram as one line of text that Decode() reads back
+   * exactly, e.g. to merge histograms recorded in different processes.
+   * Only buckets that hold samples are written.
+   */
+  void Encode(std::ostream& os) const {
+    std::streamsize precision = os.precision(17);
+    os << significant_digits_ << ' ' << highest_trackable_value_ << ' '
+       << total_count_ << ' ' << sum_ << ' ' << sum_sq_ << ' ' << min_ << ' '
+       << max_ << ' '
+       << std::count_if(counts_.begin(), counts_.end(),
+                        [](uint64_t count) { return count > 0; });
+    for (size_t i = 0; i < counts_.size(); i++) {
+      if (counts_[i] > 0) {
+        os << ' ' << counts_offset_ + static_cast<int32_t>(i) << ' '
+           << counts_[i];
+      }
+    }
+    os << '\n';
+    os.precision(precision);
+  }
+
+  /**
+   * Replace the contents with a histogram written by Encode(). Returns
+   * false, leaving the histogram empty, if the input is malformed or was
+   * recorded with a different precision or range.
+   */
+  bool Decode(std::istream& is) {
+    Reset();
+    int significant_digits;
+    int64_t highest_trackable_value;
+    size_t num_buckets;
+    uint64_t total_count;
+    if (!(is >> significant_digits >> highest_trackable_value >> total_count >>
+          sum_ >> sum_sq_ >> min_ >> max_ >> num_buckets) ||
+        significant_digits != significant_digits_ ||
+        highest_trackable_value != highest_trackable_value_) {
+      Reset();
+      return false;
+    }
+    uint64_t bucket_total = 0;
+    for (size_t i = 0; i < num_buckets; i++) {
+      int32_t index;
+      uint64_t count;
+      if (!(is >> index >> count) || index < 0 || index >= counts_len_) {
+        Reset();
+        return false;
+      }
+      EnsureIndex(index);
+      counts_[index - counts_offset_] += count;
+      bucket_total += count;
+    }
+    if (bucket_total != total_count) {
+      Reset();
+      return false;
+    }
+    total_count_ = total_count;
+    return true;
+  }
+
+  int significant_digits() const { return significant_digits_; }
+  int64_t highest_trackable_value() const { return highest_trackable_value_; }
+
+  /**
+   * The state Encode() writes, for binary formats: the totals, and the index
+   * and count of every bucket that holds samples in index order
+   */
+  struct Buckets {
+    uint64_t total_count;
+    double sum;
+    double sum_sq;
+    int64_t min;
+    int64_t max;
+    std::vector<std::pair<int32_t, uint64_t>> counts;
+  };
+
+  Buckets GetBuckets() const {
+    Buckets buckets = {total_count_, sum_, sum_sq_, min_, max_, {}};
+    for (size_t i = 0; i < counts_.size(); i++) {
+      if (counts_[i] > 0) {
+        buckets.counts.emplace_back(counts_offset_ + static_cast<int32_t>(i),
+                                    counts_[i]);
+      }
+    }
+    return buckets;
+  }
+
+  /**
+   * Replace the contents with buckets from GetBuckets() of a histogram of
+   * the same precision and range. Returns false, leaving the histogram
+   * empty, if they are out of range or do not add up to their total.
+   */
+  bool SetBuckets(const Buckets& buckets) {
+    Reset();
+    uint64_t bucket_total = 0;
+    for (const auto& bucket : buckets.counts) {
+      if (bucket.first < 0 || bucket.first >= counts_len_) {
+        Reset();
+        return false;
+      }
+      EnsureIndex(bucket.first);
+      counts_[bucket.first - counts_offset_] += bucket.second;
+      bucket_total += bucket.second;
+    }
+    if (bucket_total != buckets.total_count) {
+      Reset();
+      return false;
+    }
+    total_count_ = buckets.total_count;
+    sum_ = buckets.sum;
+    sum_sq_ = buckets.sum_sq;
+    min_ = buckets.min;
+    max_ = buckets.max;
+    return true;
+  }
+
+  /**
+   * Write the percentile distribution in the standard HdrHistogram text
+   * format. Values are divided by value_scale (e.g. 1e6 for ns to ms).
+   */
+  void OutputPercentileDistribution(std::ostream& os, double value_scale,
+                                    int ticks_per_half_distance = 5) const {
+    char line[128];
+    snprintf(line, sizeof(line), "%12s %14s %10s %14s\n\n", "Value",
+             "Percentile", "TotalCount", "1/(1-Percentile)");
+    os << line;
+
+    if (total_count_ > 0) {
+      double next_percentile = 0;
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < counts_.size(); i++) {
+        if (counts_[i] == 0) {
+          continue;
+        }
+        cumulative += counts_[i];
+        const int32_t index = counts_offset_ + static_cast<int32_t>(i);
+        const double value =
+            std::min(HighestEquivalentValue(ValueAtIndex(index)), max_) /
+            value_scale;
+        const double current_percentile = 100.0 * cumulative / total_count_;
+        while (current_percentile >= next_percentile) {
+          snprintf(line, sizeof(line), "%12.3f %2.12f %10" PRIu64 " %14.2f\n",
+                   value, next_percentile / 100, cumulative,
+                   1 / (1 - next_percentile / 100));
+          os << line;
+
+          // Report ticks_per_half_distance percentiles every time the
+          // distance to 100% halves
+          const double half_distance = pow(
+              2, floor(log2(100 / (100 - next_percentile))) + 1);
+          next_percentile += 100 / (half_distance * ticks_per_half_distance);
+          if (cumulative == total_count_) {
+            break;
+          }
+        }
+      }
+      snprintf(line, sizeof(line), "%12.3f %2.12f %10" PRIu64 "\n",
+               max_ / value_scale, 1.0, total_count_);
+      os << line;
+    }
+
+    snprintf(line, sizeof(line),
+             "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+             total_count_ > 0 ? average() / value_scale : 0.0,
+             total_count_ > 0 ? stddev() / value_scale : 0.0);
+    os << line;
+    snprintf(line, sizeof(line),
+             "#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n",
+             total_count_ > 0 ? max_ / value_scale : 0.0, total_count_);
+    os << line;
+    snprintf(line, sizeof(line), "#[Buckets = %12d, SubBuckets     = %12d]\n",
+             static_cast<int>(counts_len_ / sub_bucket_half_count_) - 1,
+             static_cast<int>(sub_bucket_half_count_ * 2));
+    os << line;
+  }
+
+ private:
+  int significant_digits_;
+  int64_t highest_trackable_value_;
+  int sub_bucket_half_count_magnitude_;
+  int64_t sub_bucket_half_count_;
+  int64_t sub_bucket_mask_;
+  int32_t counts_len_;
+
+  // counts_[i] holds the count of bucket index counts_offset_ + i
+  std::vector<uint64_t> counts_;
+  int32_t counts_offset_;
+
+  uint64_t total_count_;
+  double sum_;
+  double sum_sq_;
+  int64_t min_;
+  int64_t max_;
+
+  int32_t CountsIndex(int64_t value) const {
+    const int pow2ceiling = 64 - __builtin_clzll(value | sub_bucket_mask_);
+    const int bucket_index =
+        pow2ceiling - (sub_bucket_half_count_magnitude_ + 1);
+    const int64_t sub_bucket_index = value >> bucket_index;
+    return static_cast<int32_t>(
+        ((static_cast<int64_t>(bucket_index) + 1)
+         << sub_bucket_half_count_magnitude_) +
+        (sub_bucket_index - sub_bucket_half_count_));
+  }
+
+  int64_t ValueAtIndex(int32_t index) const {
+    int bucket_index = (index >> sub_bucket_half_count_magnitude_) - 1;
+    int64_t sub_bucket_index =
+        (index & (sub_bucket_half_count_ - 1)) + sub_bucket_half_count_;
+    if (bucket_index < 0) {
+      sub_bucket_index -= sub_bucket_half_count_;
+      bucket_index = 0;
+    }
+    return sub_bucket_index << bucket_index;
+  }
+
+  int64_t HighestEquivalentValue(int64_t value) const {
+    const int pow2ceiling = 64 - __builtin_clzll(value | sub_bucket_mask_);
+    const int bucket_index =
+        pow2ceiling - (sub_bucket_half_count_magnitude_ + 1);
+    const int64_t lowest = (value >> bucket_index) << bucket_index;
+    return lowest + (1LL << bucket_index) - 1;
+  }
+
+  void EnsureIndex(int32_t index) {
+    if (counts_.empty()) {
+      counts_offset_ = index;
+      counts_.resize(1, 0);
+    } else if (index < counts_offset_) {
+      counts_.insert(counts_.begin(), counts_offset_ - index, 0);
+      counts_offset_ = index;
+    } else if (index >= counts_offset_ + static_cast<int32_t>(counts_.size())) {
+      counts_.resize(index - counts_offset_ + 1, 0);
+    }
+  }
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_HDRHISTOGRAM_H
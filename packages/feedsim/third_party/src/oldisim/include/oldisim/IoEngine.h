@@ -0,0 +1,47 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_IO_ENGINE_H
+#define OLDISIM_IO_ENGINE_H
+
+namespace oldisim {
+
+/**
+ * How connections move bytes between their buffers and the socket.
+ * kLibevent uses socket bufferevents driven by epoll. kIoUring keeps the
+ * bufferevent interface, but each node thread receives with multishot recv
+ * into a ring of provided buffers and sends with batched sendmsg, all
+ * through one io_uring per thread. The wire protocol is the same for both.
+ */
+enum class IoEngine {
+  kLibevent,
+  kIoUring,
+};
+
+/**
+ * Select the engine for connections created from now on. Call it before
+ * starting any node server or driver. Selecting kIoUring when it is not
+ * supported is fatal.
+ */
+void SetIoEngine(IoEngine engine);
+IoEngine GetIoEngine();
+
+/**
+ * Whether oldisim was built with liburing and the running kernel can set up
+ * the rings the io_uring engine needs
+ */
+bool IsIoUringSupported();
+}  // namespace oldisim
+
+#endif  // OLDISIM_IO_ENGINE_H
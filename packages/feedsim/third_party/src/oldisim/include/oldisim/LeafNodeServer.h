@@ -17,7 +17,9 @@
 
 #include <inttypes.h>
 
+#include <map>
 #include <memory>
+#include <string>
 
 #include "oldisim/Callbacks.h"
 
@@ -28,6 +30,24 @@ class ParentConnection;
 class QueryContext;
 class LeafNodeServerThread;
 
+/**
+ * Order in which a load-balanced leaf serves the queries it has queued.
+ * kFifo serves a thread's own queries newest first and lets idle threads
+ * steal the oldest. kPriority serves lower QueryContext::priority values
+ * first, and kEarliestDeadline the query due first, with queries without a
+ * deadline last; both break ties by priority, then by arrival, and let
+ * idle threads steal the most urgent queries. kWeightedFair queues each
+ * request type on its own and shares the queries served among the types
+ * with queries queued in proportion to their weights, start-time fair
+ * queueing style, serving each type oldest first.
+ */
+enum class QueueDiscipline {
+  kFifo,
+  kPriority,
+  kEarliestDeadline,
+  kWeightedFair,
+};
+
 class LeafNodeServer {
  public:
   explicit LeafNodeServer(uint16_t port);
@@ -36,9 +56,78 @@ class LeafNodeServer {
   /* Set various configuration parameters for the leaf node server */
   void SetNumThreads(uint32_t num_threads);
   void SetThreadPinning(bool use_thread_pinning);
+  /**
+   * When thread pinning is enabled, spread the event loop threads evenly
+   * across NUMA nodes instead of walking the affinity mask in CPU order.
+   * NodeThread::get_numa_node() then reports the node of each thread.
+   */
+  void SetThreadNumaPlacement(bool use_numa_placement);
+  /**
+   * Let every event loop thread listen on a socket of its own, bound to
+   * the port with SO_REUSEPORT, instead of having the main thread accept
+   * all connections and hand them to the threads in turn. The kernel then
+   * spreads connections across the threads. With use_cpu_steering, a BPF
+   * program sends each connection to the thread pinned to the CPU that
+   * received it, falling back to the kernel's hash if the program cannot
+   * be attached.
+   */
+  void SetReusePortListeners(bool use_reuse_port, bool use_cpu_steering);
   void SetThreadLoadBalancing(bool use_thread_lb);
   void SetThreadLoadBalancingParams(int lb_process_connections_batch_size,
                                     int lb_process_request_batch_size);
+  /**
+   * Instead of fixed batch sizes, let each load-balanced thread pick how
+   * many queued requests it serves per wakeup. The batch doubles, up to
+   * max_request_batch_size, while another full batch is queued and fits in
+   * batch_budget_us of observed service time, is halved as soon as a batch
+   * overruns the budget and shrinks by one whenever the queue runs dry.
+   * Idle peers are asked to steal once per batch. Larger batches save
+   * wakeups, the budget bounds how long the thread's connections wait
+   * behind a batch. Overrides and is overridden by
+   * SetThreadLoadBalancingParams.
+   */
+  void SetAdaptiveBatching(int max_request_batch_size,
+                           uint32_t batch_budget_us);
+  /**
+   * Set the order in which queued queries are served with thread load
+   * balancing. Whatever the discipline, a query whose deadline has passed
+   * by the time it is served is answered with an empty kExpired response
+   * instead of being handed to its query callback, and is counted as
+   * expired.
+   */
+  void SetQueueDiscipline(QueueDiscipline discipline);
+  /**
+   * Set the weight of a request type under QueueDiscipline::kWeightedFair.
+   * Types without one weigh 1.
+   */
+  void SetQueueWeight(uint32_t type, double weight);
+  /**
+   * Shed load when a load-balanced thread falls behind, answering the
+   * queries it turns away with an empty kRejected response. A query that
+   * finds max_queued_requests queries queued on its thread is rejected on
+   * arrival. Queries are also shed as they are dequeued, CoDel style: once
+   * queries have waited longer than sojourn_target_us for a whole
+   * sojourn_interval_us, the thread rejects one, then more at gaps of
+   * sojourn_interval_us / sqrt(rejections so far), until one has waited
+   * less than the target. 0 disables either limit.
+   */
+  void SetAdmissionControl(uint32_t max_queued_requests,
+                           uint32_t sojourn_target_us,
+                           uint32_t sojourn_interval_us);
+  /**
+   * Cork responses on each connection so that responses completing close
+   * together go out in one writev. They are flushed at the end of the event
+   * loop iteration for a budget of 0, otherwise at most flush_budget_us
+   * after the first corked response. A negative budget turns corking off.
+   */
+  void SetResponseCorking(int flush_budget_us);
+  /**
+   * Hand query payloads that span several receive buffers to the query
+   * callback as segments instead of linearizing them first. QueryContext's
+   * payload is then nullptr for such queries; see
+   * QueryContext::GetContiguousPayload.
+   */
+  void SetSegmentedPayloads(bool use_segmented_payloads);
 
   void Run();
   void Shutdown();
@@ -73,6 +162,46 @@ class LeafNodeServer {
    */
   void EnableMonitoring(uint16_t port);
 
+  /**
+   * Set a callback that reports workload-specific stats, served as a flat
+   * JSON object at /server_stats when monitoring is enabled. It runs on the
+   * main thread, so it must only read state that is safe to share.
+   */
+  void SetMonitoringStatsCallback(const MonitoringStatsCallback& callback);
+
+  /**
+   * Accept authenticated configuration updates at /config when monitoring
+   * is enabled: a POST with the header "Authorization: Bearer <token>" and
+   * a form encoded body of key=value pairs is handed to callback, on the
+   * main thread, and answered with whatever it returned. The callback must
+   * publish the update so that the node threads pick it up atomically.
+   */
+  void SetMonitoringConfigCallback(const std::string& token,
+                                   const MonitoringConfigCallback& callback);
+
+  /**
+   * QPS, latency and the other stats of /child_stats for every request
+   * type over the last stats window, empty before the first one ends or
+   * without monitoring. Must be called on the main thread, as the
+   * monitoring stats callback is.
+   */
+  std::map<uint32_t, std::map<std::string, double>> GetLastWindowStats()
+      const;
+
+  /**
+   * Sample the energy counters and effective CPU frequency of this host
+   * while the server runs. They are printed as queries per joule and
+   * average frequency at shutdown and served at /power when monitoring is
+   * enabled.
+   */
+  void EnablePowerTelemetry();
+
+  /**
+   * Append the counters and latency histograms of every stats window to
+   * path as a StatsLog while the server runs. Must be called before Run().
+   */
+  void SetStatsLogFile(const std::string& path);
+
  private:
   struct LeafNodeServerImpl;
   struct LeafNodeServerThread;
@@ -16,51 +16,99 @@
 #include <assert.h>
 #include <stdint.h>
 
-#include <map>
 #include <set>
 
 #include "oldisim/Log.h"
-#include "oldisim/LogHistogramSampler.h"
+#include "oldisim/HdrHistogram.h"
 #include "oldisim/QueryContext.h"
 #include "oldisim/Response.h"
+#include "oldisim/Seqlock.h"
+#include "oldisim/TypeIndexedArray.h"
 
 namespace oldisim {
 
+/**
+ * Running totals of the queries a thread served, by request type. The
+ * thread logs into its own object; other threads take consistent copies
+ * with Snapshot() while it does, and cut windows out of consecutive copies
+ * with Subtract(), so the serving thread never copies or resets anything.
+ */
 class LeafNodeStats {
  public:
-  explicit LeafNodeStats(const std::set<uint32_t>& query_types) {
-    const int kHistogramBins = 200;
-    for (auto type : query_types) {
-      tx_bytes_[type] = 0;
-      rx_bytes_[type] = 0;
-      query_counts_[type] = 0;
-      response_counts_[type] = 0;
-      processing_time_samplers_.insert(
-          std::make_pair(type, LogHistogramSampler(kHistogramBins)));
-    }
+  static const int kHistogramSignificantDigits = 2;
+
+  explicit LeafNodeStats(const std::set<uint32_t>& query_types)
+      : tx_bytes_(query_types, 0),
+        rx_bytes_(query_types, 0),
+        query_counts_(query_types, 0),
+        response_counts_(query_types, 0),
+        expired_counts_(query_types, 0),
+        rejected_counts_(query_types, 0),
+        processing_time_samplers_(query_types,
+                                  HdrHistogram(kHistogramSignificantDigits)) {
   }
 
-  std::map<uint32_t, uint64_t> tx_bytes_;
-  std::map<uint32_t, uint64_t> rx_bytes_;
-  std::map<uint32_t, uint64_t> query_counts_;
-  std::map<uint32_t, uint64_t> response_counts_;
-  std::map<uint32_t, LogHistogramSampler> processing_time_samplers_;
+  TypeIndexedArray<uint64_t> tx_bytes_;
+  TypeIndexedArray<uint64_t> rx_bytes_;
+  TypeIndexedArray<uint64_t> query_counts_;
+  TypeIndexedArray<uint64_t> response_counts_;
+  // Queries dropped because their deadline passed before they were served
+  TypeIndexedArray<uint64_t> expired_counts_;
+  // Queries turned away by admission control
+  TypeIndexedArray<uint64_t> rejected_counts_;
+  TypeIndexedArray<HdrHistogram> processing_time_samplers_;
 
   void LogQuery(const QueryContext& query) {
     assert(rx_bytes_.count(query.type) > 0);
     assert(query_counts_.count(query.type) > 0);
+    seqlock_.BeginWrite();
     rx_bytes_.at(query.type) += query.packet_length;
     query_counts_.at(query.type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogExpiredQuery(const QueryContext& query) {
+    assert(expired_counts_.count(query.type) > 0);
+    seqlock_.BeginWrite();
+    expired_counts_.at(query.type)++;
+    seqlock_.EndWrite();
+  }
+
+  void LogRejectedQuery(const QueryContext& query) {
+    assert(rejected_counts_.count(query.type) > 0);
+    seqlock_.BeginWrite();
+    rejected_counts_.at(query.type)++;
+    seqlock_.EndWrite();
   }
 
   void LogResponse(const Response& response) {
     assert(tx_bytes_.count(response.GetType()) > 0);
     assert(response_counts_.count(response.GetType()) > 0);
     assert(processing_time_samplers_.count(response.GetType()) > 0);
+    seqlock_.BeginWrite();
     tx_bytes_.at(response.GetType()) += response.GetResponsePacketSize();
     response_counts_.at(response.GetType())++;
     processing_time_samplers_.at(response.GetType())
         .sample(response.GetProcessingTime());
+    seqlock_.EndWrite();
+  }
+
+  /**
+   * Reserve the full range of every histogram. Must be called by the
+   * logging thread before other threads take snapshots.
+   */
+  void ReserveForSnapshots() {
+    for (auto sampler : processing_time_samplers_) {
+      sampler.second.ReserveFullRange();
+    }
+  }
+
+  /**
+   * Copy the totals into copy, which must have the same query types.
+   * Safe to call from any thread while the owning thread logs.
+   */
+  void Snapshot(LeafNodeStats* copy) const {
+    seqlock_.Read([this, copy]() { *copy = *this; });
   }
 
   void Accumulate(const LeafNodeStats& cs) {
@@ -70,35 +118,82 @@ class LeafNodeStats {
     assert(cs.processing_time_samplers_.size() ==
            processing_time_samplers_.size());
 
-    for (auto& stat : cs.tx_bytes_) {
+    for (const auto& stat : cs.tx_bytes_) {
       tx_bytes_.at(stat.first) += stat.second;
     }
 
-    for (auto& stat : cs.rx_bytes_) {
+    for (const auto& stat : cs.rx_bytes_) {
       rx_bytes_.at(stat.first) += stat.second;
     }
 
-    for (auto& stat : cs.query_counts_) {
+    for (const auto& stat : cs.query_counts_) {
       query_counts_.at(stat.first) += stat.second;
     }
 
-    for (auto& stat : cs.response_counts_) {
+    for (const auto& stat : cs.response_counts_) {
       response_counts_.at(stat.first) += stat.second;
     }
 
+    for (const auto& stat : cs.expired_counts_) {
+      expired_counts_.at(stat.first) += stat.second;
+    }
+
+    for (const auto& stat : cs.rejected_counts_) {
+      rejected_counts_.at(stat.first) += stat.second;
+    }
+
     for (const auto& sampler : cs.processing_time_samplers_) {
       processing_time_samplers_.at(sampler.first).accumulate(sampler.second);
     }
   }
 
+  /**
+   * Take away an earlier snapshot of the same totals, leaving what was
+   * logged since
+   */
+  void Subtract(const LeafNodeStats& earlier) {
+    for (const auto& stat : earlier.tx_bytes_) {
+      tx_bytes_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& stat : earlier.rx_bytes_) {
+      rx_bytes_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& stat : earlier.query_counts_) {
+      query_counts_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& stat : earlier.response_counts_) {
+      response_counts_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& stat : earlier.expired_counts_) {
+      expired_counts_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& stat : earlier.rejected_counts_) {
+      rejected_counts_.at(stat.first) -= stat.second;
+    }
+
+    for (const auto& sampler : earlier.processing_time_samplers_) {
+      processing_time_samplers_.at(sampler.first).Subtract(sampler.second);
+    }
+  }
+
   void Reset() {
-    for (auto& stat : tx_bytes_) {
+    for (auto stat : tx_bytes_) {
       tx_bytes_[stat.first] = 0;
       rx_bytes_[stat.first] = 0;
       query_counts_[stat.first] = 0;
       response_counts_[stat.first] = 0;
+      expired_counts_[stat.first] = 0;
+      rejected_counts_[stat.first] = 0;
       processing_time_samplers_.at(stat.first).Reset();
     }
   }
+
+ private:
+  Seqlock seqlock_;
 };
 }  // namespace oldisim
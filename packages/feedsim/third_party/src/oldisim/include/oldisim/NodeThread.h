@@ -16,8 +16,10 @@
 #define OLDISIM_NODE_THREAD_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <event2/event.h>
 
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -35,9 +37,28 @@ class NodeThread {
 
  public:
   int get_thread_num() const;
+  int get_numa_node() const;
   pthread_t get_pthread() const;
   event_base* get_event_base() const;
 
+  /**
+   * Run closure on this thread's event loop. May be called from any thread,
+   * e.g. by an executor to hand a finished asynchronous request back to the
+   * thread that owns its connection and stats.
+   */
+  void RunInLoop(std::function<void()> closure) const;
+
+  /**
+   * Run closure on this thread's event loop once delay_ns have passed. The
+   * timer lives on a timer wheel of the thread's event loop, so a closure
+   * scheduled from the thread itself costs no cross-thread wakeup at all.
+   * May be called from any thread; other threads hand the timer over with
+   * RunInLoop. The resolution is kTimerTickNs.
+   */
+  void RunAfter(uint64_t delay_ns, std::function<void()> closure) const;
+
+  static const uint64_t kTimerTickNs = 100000;
+
  private:
   struct NodeThreadImpl;
   std::unique_ptr<NodeThreadImpl> impl_;
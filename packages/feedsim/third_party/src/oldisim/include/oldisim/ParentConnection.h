@@ -16,6 +16,7 @@
 #define OLDISIM_PARENT_CONNECTION_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <event2/event.h>
 
 #include <functional>
@@ -23,19 +24,23 @@
 #include <set>
 #include <unordered_map>
 
+#include "oldisim/Response.h"
+
 namespace oldisim {
 
 class ConnectionUtil;
 class QueryContext;
 class ParentConnectionStats;
-class Response;
 
 /**
  * This classes represents one part of a bi-directional connection between
  * two nodes in the fanout tree. Specifically, this class is owned by the
  * child node in the tree and represents the connection established to the child
  * node by the parent node of the tree. This class allows the child to
- * send replies to requests sent to the child by the parent node.
+ * send replies to requests sent to the child by the parent node. Replies
+ * sent from threads other than the one serving the connection, as with
+ * thread load balancing, are handed over to that thread and sent in the
+ * order they completed, which need not be the order of the requests.
  */
 class ParentConnection {
   friend QueryContext;
@@ -47,7 +52,22 @@ class ParentConnection {
   void SendResponse(uint32_t response_type, uint64_t query_id,
                     uint64_t start_time, uint64_t processing_time,
                     const void* data, uint32_t data_length,
-                    std::function<void(const Response&)> logger = nullptr);
+                    std::function<void(const Response&)> logger = nullptr,
+                    ResponseStatus status = ResponseStatus::kOk,
+                    uint64_t queue_time = 0);
+
+  /**
+   * Send a response whose payload is the concatenation of segments without
+   * copying it. The segments must stay valid until release is called, which
+   * happens once libevent has written or discarded all of them, possibly
+   * from another thread.
+   */
+  void SendResponse(uint32_t response_type, uint64_t query_id,
+                    uint64_t start_time, uint64_t processing_time,
+                    const iovec* segments, int num_segments,
+                    std::function<void()> release,
+                    std::function<void(const Response&)> logger = nullptr,
+                    uint64_t queue_time = 0);
 
  private:
   struct ParentConnectionImpl;
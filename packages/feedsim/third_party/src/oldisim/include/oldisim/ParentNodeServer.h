@@ -21,6 +21,8 @@
 #include <string>
 
 #include "oldisim/Callbacks.h"
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
 
 namespace oldisim {
 
@@ -52,6 +54,15 @@ class ParentNodeServer {
    */
   void SetAcceptCallback(const AcceptCallback& callback);
 
+  /**
+   * Let every event loop thread listen on a socket of its own, bound to
+   * the port with SO_REUSEPORT, instead of having the main thread accept
+   * all connections and hand them to the threads in turn. With
+   * use_cpu_steering, a BPF program sends each connection to the thread
+   * pinned to the CPU that received it. Must be called before Run.
+   */
+  void SetReusePortListeners(bool use_reuse_port, bool use_cpu_steering);
+
   /**
    * Set the callback to run after an incoming query is received from a parent.
    * It will run in the context of the event thread that is responsible
@@ -70,8 +81,12 @@ class ParentNodeServer {
   /**
    * Add a hostname:port as a child node that requests can be sent to.
    * Note that it is up to the thread to create the actual connections.
+   * A child on this host can be reached over one of the local transports.
+   * Compact framing must only be used with children that support it.
    */
-  void AddChildNode(std::string hostname, uint16_t port);
+  void AddChildNode(std::string hostname, uint16_t port,
+                    Transport transport = Transport::kTcp,
+                    Framing framing = Framing::kFixed);
 
   /**
    * Enable remote statistics monitoring at a given port.
@@ -80,6 +95,29 @@ class ParentNodeServer {
    */
   void EnableMonitoring(uint16_t port);
 
+  /**
+   * Set a callback that reports workload-specific stats, served as a flat
+   * JSON object at /server_stats when monitoring is enabled. It runs on the
+   * main thread, so it must only read state that is safe to share.
+   */
+  void SetMonitoringStatsCallback(const MonitoringStatsCallback& callback);
+
+  /**
+   * Accept authenticated configuration updates at /config when monitoring
+   * is enabled: a POST with the header "Authorization: Bearer <token>" and
+   * a form encoded body of key=value pairs is handed to callback, on the
+   * main thread, and answered with whatever it returned. The callback must
+   * publish the update so that the node threads pick it up atomically.
+   */
+  void SetMonitoringConfigCallback(const std::string& token,
+                                   const MonitoringConfigCallback& callback);
+
+  /**
+   * Append the counters and latency histograms of every stats window to
+   * path as a StatsLog while the server runs. Must be called before Run().
+   */
+  void SetStatsLogFile(const std::string& path);
+
  private:
   struct ParentNodeServerImpl;
   struct ParentNodeServerThread;
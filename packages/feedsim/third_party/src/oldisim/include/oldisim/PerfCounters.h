@@ -0,0 +1,106 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_PERF_COUNTERS_H
+#define OLDISIM_PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#include <array>
+
+namespace oldisim {
+
+/**
+ * Hardware events counted by a PerfCounterGroup
+ */
+enum class PerfCounter {
+  kCycles,
+  kInstructions,
+  kL1ICacheMisses,
+  kLLCMisses,
+  kBranchMisses,
+  kDTLBMisses,
+};
+
+static const int kNumPerfCounters =
+    static_cast<int>(PerfCounter::kDTLBMisses) + 1;
+
+/**
+ * A reading of every counter of a group, or the difference of two readings
+ */
+struct PerfCounterValues {
+  std::array<uint64_t, kNumPerfCounters> counts;
+
+  PerfCounterValues() { counts.fill(0); }
+
+  uint64_t operator[](PerfCounter counter) const {
+    return counts[static_cast<int>(counter)];
+  }
+
+  PerfCounterValues& operator+=(const PerfCounterValues& that) {
+    for (int i = 0; i < kNumPerfCounters; i++) {
+      counts[i] += that.counts[i];
+    }
+    return *this;
+  }
+
+  PerfCounterValues& operator-=(const PerfCounterValues& that) {
+    for (int i = 0; i < kNumPerfCounters; i++) {
+      counts[i] -= that.counts[i];
+    }
+    return *this;
+  }
+};
+
+/**
+ * Hardware performance counters of the calling thread, opened with
+ * perf_event_open as one group so that all counters cover the same
+ * intervals. Only user-space events are counted, which perf_event_paranoid
+ * allows up to level 2. Counters the PMU does not support are left out of
+ * the group and read as 0; if the cycle counter itself cannot be opened,
+ * e.g. in a VM without a virtual PMU, the group is disabled and every
+ * reading is 0.
+ *
+ * A group only counts the thread that created it, so it must be both
+ * created and read on that thread.
+ */
+class PerfCounterGroup {
+ public:
+  PerfCounterGroup();
+  ~PerfCounterGroup();
+  PerfCounterGroup(const PerfCounterGroup&) = delete;
+  PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+  bool enabled() const { return fds_[0] >= 0; }
+  bool counter_enabled(PerfCounter counter) const {
+    return fds_[static_cast<int>(counter)] >= 0;
+  }
+
+  /**
+   * Current counts since the group was created, with a single read() call
+   */
+  PerfCounterValues Read() const;
+
+  /**
+   * Short snake_case name of a counter, e.g. for stats keys
+   */
+  static const char* CounterName(PerfCounter counter);
+
+ private:
+  std::array<int, kNumPerfCounters> fds_;
+  std::array<uint64_t, kNumPerfCounters> ids_;
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_PERF_COUNTERS_H
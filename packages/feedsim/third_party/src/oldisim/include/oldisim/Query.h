@@ -25,6 +25,8 @@ struct __attribute__((__packed__)) QueryPacketHeader {
   uint64_t request_id;
   uint64_t start_time;
   uint32_t payload_length;  // does not include header length
+  uint32_t priority;        // lower values are served first
+  uint32_t deadline_us;     // time budget left when sent, 0 for none
 };
 
 /**
@@ -36,11 +38,13 @@ class Query {
  public:
   uint64_t end_time_;
   QueryPacketHeader query_header_;
+  // Bytes the header takes on the wire, less with compact framing
+  uint32_t header_length_ = sizeof(QueryPacketHeader);
 
   uint64_t Time() const { return (end_time_ - query_header_.start_time); }
 
   uint32_t GetQueryPacketSize() const {
-    return query_header_.payload_length + sizeof(query_header_);
+    return query_header_.payload_length + header_length_;
   }
 
   uint32_t GetPayloadLength() const { return query_header_.payload_length; }
@@ -51,12 +55,18 @@ class Query {
 
   uint64_t GetStartTime() const { return query_header_.start_time; }
 
+  uint32_t GetPriority() const { return query_header_.priority; }
+
+  uint32_t GetDeadlineUs() const { return query_header_.deadline_us; }
+
   QueryPacketHeader GetHeaderNetworkOrder() const {
     QueryPacketHeader header = query_header_;
     header.type = htobe32(header.type);
     header.request_id = htobe64(header.request_id);
     header.start_time = htobe64(header.start_time);
     header.payload_length = htobe32(header.payload_length);
+    header.priority = htobe32(header.priority);
+    header.deadline_us = htobe32(header.deadline_us);
 
     return header;
   }
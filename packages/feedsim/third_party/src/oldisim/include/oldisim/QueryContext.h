@@ -15,9 +15,13 @@
 #ifndef OLDISIM_QUERY_CONTEXT_H
 #define OLDISIM_QUERY_CONTEXT_H
 
+#include <sys/uio.h>
+
 #include <functional>
 #include <memory>
+#include <vector>
 
+#include "oldisim/FlightRecorder.h"
 #include "oldisim/ParentConnection.h"
 
 namespace oldisim {
@@ -40,10 +44,64 @@ class QueryContext {
   const uint64_t request_id;
   const uint64_t start_time;
   const uint64_t received_time;
+  // When the query reached this node, from the same clock: the kernel
+  // receive timestamp with SetKernelRxTimestamps, received_time otherwise.
+  // Processing and queueing times reported back count from it.
+  const uint64_t arrival_time;
   const uint32_t payload_length;
   const uint32_t packet_length;
+  // Scheduling class the sender gave the query. Lower priorities are more
+  // urgent; deadline is the time by which the query is due, from the same
+  // clock as received_time, or 0 if it has none.
+  const uint32_t priority;
+  const uint64_t deadline;
+  /**
+   * The payload as contiguous bytes. It is nullptr when the server hands out
+   * segmented payloads and the payload spans several receive buffers; use
+   * payload_segments() or GetContiguousPayload() instead.
+   */
   void* const payload;
+  /**
+   * Where the payload sits in the receive buffer, in order. Like payload,
+   * the segments are only valid until the query callback returns unless the
+   * context is moved.
+   */
+  const iovec* payload_segments() const { return segments; }
+  int num_payload_segments() const { return num_segments; }
+  /**
+   * Returns payload, or a copy of the segments in the connection's reusable
+   * receive buffer if the payload is not contiguous.
+   */
+  const void* GetContiguousPayload();
+  /**
+   * Whether the query has a deadline that has passed
+   */
+  bool IsExpired() const;
+  /**
+   * The time budget left in microseconds, to hand on to requests made on
+   * behalf of this query: 0 if it has no deadline, and at least 1 if it has
+   * one, even an expired one.
+   */
+  uint32_t GetRemainingBudgetUs() const;
   void SendResponse(const void* data, uint32_t data_length);
+  /**
+   * Send a response made of several segments without copying them. See
+   * ParentConnection::SendResponse for the lifetime of the segments.
+   */
+  void SendResponse(const iovec* segments, int num_segments,
+                    std::function<void()> release);
+  /**
+   * Shed the query: answer it with an empty response of the given status,
+   * which must not be kOk, instead of a reply
+   */
+  void SendRejection(ResponseStatus status);
+  /**
+   * Note for the flight recorder that the query is done with an application
+   * stage, numbered as in FlightRecorderOptions::stage_names. Does nothing
+   * unless the recorder is enabled or once kMaxFlightStages are marked. Not
+   * to be called from several threads at once.
+   */
+  void MarkStage(uint8_t stage);
 
  private:
   ParentConnection& connection;
@@ -51,11 +109,25 @@ class QueryContext {
   bool is_active;
   bool is_payload_heap;
   std::function<void(const Response&)> logger;
+  // When the query callback was handed the query, received_time until then
+  uint64_t dequeue_time;
+  const iovec* segments;
+  int num_segments;
+  // Describes the heap copy of a moved context
+  iovec heap_segment;
+  std::vector<char>* linear_buffer;
+  FlightTrace trace;
+
+  // Hand the trace of the answered query to the flight recorder
+  void LogFlight(ResponseStatus status, uint64_t processing_time);
 
   QueryContext(ParentConnection& _connection, uint32_t _type,
                uint64_t _request_id, uint64_t start_time,
                uint32_t _payload_length, uint32_t _packet_length,
-               void* _payload, bool _is_payload_heap);
+               uint32_t _priority, uint32_t deadline_us, void* _payload,
+               bool _is_payload_heap, const iovec* _segments,
+               int _num_segments, std::vector<char>* _linear_buffer,
+               uint64_t _arrival_time = 0);
 };
 }  // namespace oldisim
 
@@ -24,21 +24,39 @@
 
 namespace oldisim {
 
+/**
+ * Outcome of a query. Only kOk responses carry what the query callback
+ * replied; the others have an empty payload and tell the sender that the
+ * child shed the query without processing it.
+ */
+enum class ResponseStatus : uint32_t {
+  kOk = 0,
+  kRejected = 1,  // turned away by admission control
+  kExpired = 2,   // its deadline passed before it was served
+};
+
 struct __attribute__((__packed__)) ResponsePacketHeader {
   uint32_t type;
   uint64_t request_id;
   uint64_t start_time;
+  // From the query arriving at the child to its response being sent, and
+  // the part of that the query waited before its handler started
   uint64_t processing_time;
+  uint64_t queue_time;
   uint32_t payload_length;  // does not include header length
+  uint32_t status;          // a ResponseStatus
 
   ResponsePacketHeader(uint32_t _type, uint64_t _request_id,
                        uint64_t _start_time, uint64_t _processing_time,
-                       uint32_t _payload_length)
+                       uint32_t _payload_length, ResponseStatus _status,
+                       uint64_t _queue_time = 0)
       : type(_type),
         request_id(_request_id),
         start_time(_start_time),
         processing_time(_processing_time),
-        payload_length(_payload_length) {}
+        queue_time(_queue_time),
+        payload_length(_payload_length),
+        status(static_cast<uint32_t>(_status)) {}
 };
 
 /**
@@ -50,14 +68,22 @@ class Response {
  public:
   ResponsePacketHeader response_header_;
   const void* payload_;  // only used to store received response
+  // Bytes the header takes on the wire, less with compact framing
+  uint32_t header_length_;
 
-  Response() : response_header_(0, 0, 0, 0, 0), payload_(nullptr) {}
+  Response()
+      : response_header_(0, 0, 0, 0, 0, ResponseStatus::kOk),
+        payload_(nullptr),
+        header_length_(sizeof(ResponsePacketHeader)) {}
 
   Response(uint32_t type, uint64_t request_id, uint64_t start_time,
-           uint64_t processing_time, uint32_t payload_length)
+           uint64_t processing_time, uint32_t payload_length,
+           ResponseStatus status = ResponseStatus::kOk,
+           uint64_t queue_time = 0)
       : response_header_(type, request_id, start_time, processing_time,
-                         payload_length),
-        payload_(nullptr) {}
+                         payload_length, status, queue_time),
+        payload_(nullptr),
+        header_length_(sizeof(ResponsePacketHeader)) {}
 
   ResponsePacketHeader GetHeaderNetworkOrder() const {
     ResponsePacketHeader header = response_header_;
@@ -65,7 +91,9 @@ class Response {
     header.request_id = htobe64(header.request_id);
     header.start_time = htobe64(header.start_time);
     header.processing_time = htobe64(header.processing_time);
+    header.queue_time = htobe64(header.queue_time);
     header.payload_length = htobe32(header.payload_length);
+    header.status = htobe32(header.status);
 
     return header;
   }
@@ -77,13 +105,15 @@ class Response {
     result_header.request_id = be64toh(header->request_id);
     result_header.start_time = be64toh(header->start_time);
     result_header.processing_time = be64toh(header->processing_time);
+    result_header.queue_time = be64toh(header->queue_time);
     result_header.payload_length = be32toh(header->payload_length);
+    result_header.status = be32toh(header->status);
 
     return result;
   }
 
   uint32_t GetResponsePacketSize() const {
-    return response_header_.payload_length + sizeof(response_header_);
+    return response_header_.payload_length + header_length_;
   }
 
   uint32_t GetPayloadLength() const { return response_header_.payload_length; }
@@ -98,6 +128,12 @@ class Response {
     return response_header_.processing_time;
   }
 
+  uint64_t GetQueueTime() const { return response_header_.queue_time; }
+
+  ResponseStatus GetStatus() const {
+    return static_cast<ResponseStatus>(response_header_.status);
+  }
+
   Query RebuildOriginatingQuery() const {
     Query originating_query;
     originating_query.query_header_.type = response_header_.type;
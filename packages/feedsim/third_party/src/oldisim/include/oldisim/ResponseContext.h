@@ -16,8 +16,12 @@
 #define OLDISIM_RESPONSE_CONTEXT_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <memory>
+#include <vector>
+
+#include "oldisim/Response.h"
 
 namespace oldisim {
 
@@ -31,16 +35,36 @@ class ResponseContext {
   uint64_t request_id;
   uint32_t payload_length;
   uint32_t packet_length;
+  /**
+   * nullptr when the connection hands out segmented payloads and the payload
+   * spans several receive buffers; see GetContiguousPayload()
+   */
   const void* payload;
+  // Where the payload sits in the receive buffer, in order
+  const iovec* payload_segments;
+  int num_payload_segments;
   bool timed_out;
+  // Whether the child answered or shed the request
+  ResponseStatus status;
   uint64_t request_timestamp;
   uint64_t response_timestamp;
 
+  /**
+   * Returns payload, filling it in with a copy of the segments in the
+   * connection's reusable receive buffer if the payload is not contiguous.
+   */
+  const void* GetContiguousPayload();
+
  private:
+  std::vector<char>* linear_buffer;
+
   ResponseContext(uint32_t _type, uint64_t _request_id,
                   uint32_t _payload_length, uint32_t _packet_length,
-                  const void* _payload, bool _timed_out,
-                  uint64_t _request_timestamp, uint64_t _response_timestamp);
+                  const void* _payload, const iovec* _payload_segments,
+                  int _num_payload_segments, bool _timed_out,
+                  ResponseStatus _status, uint64_t _request_timestamp,
+                  uint64_t _response_timestamp,
+                  std::vector<char>* _linear_buffer);
 };
 }  // namespace oldisim
 
@@ -0,0 +1,83 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_SEQLOCK_H
+#define OLDISIM_SEQLOCK_H
+
+#include <sched.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "oldisim/CacheAligned.h"
+
+namespace oldisim {
+
+/**
+ * Sequence lock for data that has a single writer thread and is read by
+ * others. The writer brackets every update with BeginWrite() and
+ * EndWrite(), two uncontended stores that never wait for readers. Readers
+ * copy the data in Read() and retry whenever a write overlapped the copy.
+ *
+ * The writer must not reallocate anything while it is protected, since a
+ * reader may be in the middle of copying it. The sequence number sits on a
+ * cache line of its own so that the writer does not contend with the
+ * neighbours of the lock.
+ */
+class Seqlock {
+ public:
+  Seqlock() : sequence_(1) {}
+  // A copy of the protected data is a separate object with its own lock
+  Seqlock(const Seqlock& that) : sequence_(1) {}
+  Seqlock& operator=(const Seqlock& that) { return *this; }
+
+  void BeginWrite() {
+    sequence_[0].store(sequence_[0].load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void EndWrite() {
+    sequence_[0].store(sequence_[0].load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+  }
+
+  /**
+   * Call copy until it runs without a write in progress or in between.
+   * Yields between attempts, as the writer may be descheduled mid-write
+   * on a busy machine.
+   */
+  template <typename CopyFunction>
+  void Read(const CopyFunction& copy) const {
+    while (true) {
+      uint64_t sequence = sequence_[0].load(std::memory_order_acquire);
+      if (sequence % 2 == 0) {
+        copy();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_[0].load(std::memory_order_relaxed) == sequence) {
+          return;
+        }
+      }
+      sched_yield();
+    }
+  }
+
+ private:
+  std::vector<std::atomic<uint64_t>,
+              CacheAlignedAllocator<std::atomic<uint64_t>>> sequence_;
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_SEQLOCK_H
@@ -0,0 +1,162 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_STATS_LOG_H
+#define OLDISIM_STATS_LOG_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "oldisim/HdrHistogram.h"
+
+namespace oldisim {
+
+/**
+ * The counters and latency histograms of a node over one stats window, or
+ * over several merged. Times are relative to the start of the log.
+ */
+struct StatsLogWindow {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  std::map<std::string, uint64_t> counters;
+  std::map<std::string, HdrHistogram> histograms;
+
+  double duration() const { return (end_ns - start_ns) / 1e9; }
+
+  /**
+   * Add the counts of other and widen the window to cover it
+   */
+  void Accumulate(const StatsLogWindow& other);
+};
+
+/**
+ * A read-only stats log written by StatsLogWriter, memory-mapped.
+ *
+ * Logs start with a header holding an 8 byte "OLDSTATS" magic, a 64-bit
+ * version, the length of the log committed so far, the wall clock time the
+ * log started at and the kind of node that wrote it. Records follow, each
+ * a 32-bit type and a 32-bit length: name records give a series name an id
+ * the first time it is used, and window records hold the id and value of
+ * every counter and the non-empty buckets of every histogram of a window,
+ * mostly as LEB128 varints. Fixed-size fields are in host byte order. The
+ * log can be read while it is being written; records past the committed
+ * length are ignored.
+ */
+class StatsLog {
+ public:
+  /**
+   * Load the log at path. Failing to read it or a malformed record is
+   * fatal.
+   */
+  static std::shared_ptr<const StatsLog> Open(const std::string& path);
+  ~StatsLog();
+  StatsLog(const StatsLog&) = delete;
+  StatsLog& operator=(const StatsLog&) = delete;
+
+  const std::string& node() const { return node_; }
+  uint64_t start_realtime_ns() const { return start_realtime_ns_; }
+
+  size_t size() const { return windows_.size(); }
+  StatsLogWindow operator[](size_t i) const;
+
+  /**
+   * All windows that end after from_ns and no later than to_ns, merged
+   */
+  StatsLogWindow Merge(uint64_t from_ns, uint64_t to_ns) const;
+
+ private:
+  StatsLog();
+
+  struct Series {
+    std::string name;
+    bool is_histogram;
+  };
+
+  std::string node_;
+  uint64_t start_realtime_ns_;
+  std::unordered_map<uint32_t, Series> series_;
+  // Offset and length of each window record, in order
+  std::vector<std::pair<size_t, size_t>> windows_;
+  std::vector<uint64_t> window_ends_;
+  void* mapping_;
+  size_t mapping_length_;
+};
+
+/**
+ * Appends stats windows to a memory-mapped stats log that StatsLog reads.
+ * The file grows in large steps as windows come in and is cut to the data
+ * written when closed, so a log cut short by a crash is still readable up
+ * to the last complete window. A single thread writes each log.
+ */
+class StatsLogWriter {
+ public:
+  /**
+   * Create or truncate the log at path for a node of the given kind, e.g.
+   * "driver". Failing to open it is fatal.
+   */
+  StatsLogWriter(const std::string& path, const std::string& node);
+  ~StatsLogWriter();
+  StatsLogWriter(const StatsLogWriter&) = delete;
+  StatsLogWriter& operator=(const StatsLogWriter&) = delete;
+
+  /**
+   * Add a series to the window being built
+   */
+  void AddCounter(const std::string& name, uint64_t value);
+  void AddHistogram(const std::string& name, const HdrHistogram& histogram);
+
+  /**
+   * Append the window built so far, spanning start_ns to end_ns as returned
+   * by GetTimeAccurateNano, and start a new one
+   */
+  void WriteWindow(uint64_t start_ns, uint64_t end_ns);
+
+  /**
+   * End of the last window written, or the time the log was created
+   */
+  uint64_t last_window_end_ns() const { return last_window_end_ns_; }
+
+  /**
+   * Cut the file to the windows written and close it
+   */
+  void Close();
+
+ private:
+  void Append(const std::string& record);
+  uint32_t SeriesId(const std::string& name, bool is_histogram);
+
+  std::string path_;
+  int fd_;
+  char* mapping_;
+  size_t capacity_;
+  size_t length_;
+  uint64_t start_time_ns_;
+  uint64_t last_window_end_ns_;
+  std::map<std::string, uint32_t> series_ids_;
+  // Name records of series first used in the window being built, and its
+  // entries
+  std::string pending_names_;
+  std::string pending_counters_;
+  std::string pending_histograms_;
+  uint32_t num_pending_counters_;
+  uint32_t num_pending_histograms_;
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_STATS_LOG_H
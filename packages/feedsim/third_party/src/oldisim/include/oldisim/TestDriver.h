@@ -23,8 +23,18 @@
 
 namespace oldisim {
 
+class ArrivalTrace;
 class ChildConnectionStats;
 class DriverNode;
+struct TraceRecord;
+
+/**
+ * Inter-arrival distribution of an open-loop request schedule
+ */
+enum class ArrivalProcess {
+  kConstant,
+  kPoisson,
+};
 
 class TestDriver {
   friend DriverNode;
@@ -33,6 +43,54 @@ class TestDriver {
   void Start();
   void SendRequest(uint32_t type, const void* payload, uint32_t payload_length,
                    uint64_t next_request_delay_us);
+  /**
+   * Send a request with a priority and a deadline, see
+   * ChildConnection::IssueRequest. In open-loop mode the deadline counts
+   * from the scheduled send time, so schedule slip uses up the budget.
+   */
+  void SendRequest(uint32_t type, const void* payload, uint32_t payload_length,
+                   uint64_t next_request_delay_us, uint32_t priority,
+                   uint32_t deadline_us);
+
+  /**
+   * Switch the driver to open-loop load generation at requests_per_sec.
+   * Arrival times are precomputed from the given process, so a slow service
+   * cannot slow down the offered load. Arrivals that find every connection
+   * at max depth wait in a backlog and keep their scheduled time; latency is
+   * measured from that time, and the extra wait is logged as schedule slip.
+   * In this mode the next_request_delay_us argument of SendRequest is
+   * ignored. Must be called before Start(), e.g. from the thread startup
+   * callback.
+   */
+  void SetOpenLoopSchedule(ArrivalProcess process, double requests_per_sec,
+                           uint64_t seed);
+
+  /**
+   * Change the rate of an open-loop schedule while the driver runs, keeping
+   * the shape of its inter-arrival gaps. Must be called from the driver's
+   * own thread, e.g. from the make request callback.
+   */
+  void SetOpenLoopRate(double requests_per_sec);
+
+  /**
+   * Switch the driver to replaying the arrivals of a recorded trace, on the
+   * same open-loop machinery as SetOpenLoopSchedule. The driver takes every
+   * num_threads-th record starting at thread_index, so that the threads of
+   * a driver node together replay the whole trace. Gaps between arrivals
+   * are divided by speedup. When the trace runs out it starts over if loop
+   * is set, and otherwise the driver stops sending. Must be called before
+   * Start().
+   */
+  void SetTraceSchedule(std::shared_ptr<const ArrivalTrace> trace,
+                        uint32_t thread_index, uint32_t num_threads,
+                        double speedup, bool loop);
+
+  /**
+   * The trace record of the request being made, valid inside the make
+   * request callback of a driver replaying a trace and nullptr otherwise
+   */
+  const TraceRecord* GetCurrentTraceRecord() const;
+
   const ChildConnectionStats& GetConnectionStats() const;
 
  private:
@@ -0,0 +1,34 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_TIMESTAMPING_H
+#define OLDISIM_TIMESTAMPING_H
+
+namespace oldisim {
+
+/**
+ * Have the kernel timestamp data as it arrives on TCP connections with
+ * software SO_TIMESTAMPING, and take the arrival of queries and responses
+ * from those timestamps instead of from when the event loop gets to them.
+ * The time a query waits in the socket buffer and for its node thread then
+ * counts as queueing at the node serving it, not as network time at the
+ * node that sent it. Costs a peek at every socket read, and only applies
+ * to the libevent I/O engine. Call it before starting any node server or
+ * driver.
+ */
+void SetKernelRxTimestamps(bool enabled);
+bool GetKernelRxTimestamps();
+}  // namespace oldisim
+
+#endif  // OLDISIM_TIMESTAMPING_H
@@ -0,0 +1,88 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_TLS_H
+#define OLDISIM_TLS_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace oldisim {
+
+/**
+ * Where the records of a TLS connection are encrypted once its handshake is
+ * done. kKernel hands the session keys to kernel TLS, so the connection's
+ * data path is a plain socket to the selected I/O engine and the NIC
+ * encrypts if its driver offers TLS offload. Connections whose kernel,
+ * OpenSSL or cipher suite cannot take both directions fall back to
+ * encrypting in user space what the kernel did not take. kUserSpace always
+ * encrypts in user space with OpenSSL.
+ */
+enum class TlsOffload {
+  kKernel,
+  kUserSpace,
+};
+
+struct TlsOptions {
+  // PEM certificate chain and private key node servers present. Each
+  // process generates a self-signed certificate if they are empty.
+  std::string certificate_file;
+  std::string private_key_file;
+  // PEM CA bundle connections verify the node server against; they do not
+  // verify it if empty
+  std::string ca_file;
+  // TLS 1.3 cipher suites to offer, in OpenSSL's colon-separated notation.
+  // Kernel TLS supports the AES-GCM suites and, on newer kernels,
+  // ChaCha20-Poly1305.
+  std::string ciphersuites = "TLS_AES_128_GCM_SHA256";
+  TlsOffload offload = TlsOffload::kKernel;
+};
+
+/**
+ * Run TLS 1.3 over every TCP connection made or accepted from now on. Both
+ * ends must enable it; local transports are not encrypted. The handshake
+ * is done on the thread making the connection, blocking it for a round
+ * trip. Call it before starting any node server or driver. Enabling TLS
+ * when it is not supported or with unusable options is fatal.
+ */
+void EnableTls(const TlsOptions& options);
+bool IsTlsEnabled();
+
+/**
+ * Whether oldisim was built with OpenSSL
+ */
+bool IsTlsSupported();
+
+struct TlsStats {
+  uint64_t handshakes;
+  uint64_t handshake_failures;
+  // Handshaken connections encrypted by the kernel both ways, by the kernel
+  // only when sending, and in user space
+  uint64_t kernel_connections;
+  uint64_t kernel_send_connections;
+  uint64_t user_space_connections;
+  // Kernel TLS connections of the host currently offloaded to a NIC, from
+  // /proc/net/tls_stat
+  uint64_t device_send_connections;
+  uint64_t device_receive_connections;
+};
+
+/**
+ * Counts over the connections this process made or accepted
+ */
+TlsStats GetTlsStats();
+}  // namespace oldisim
+
+#endif  // OLDISIM_TLS_H
@@ -0,0 +1,49 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_TOPOLOGY_H
+#define OLDISIM_TOPOLOGY_H
+
+#include <pthread.h>
+
+#include <vector>
+
+namespace oldisim {
+
+struct NumaNodeCpus {
+  int node;               // NUMA node id as numbered by the kernel
+  std::vector<int> cpus;  // CPUs of the node in the process affinity mask
+};
+
+/**
+ * Read the NUMA topology from sysfs, restricted to the CPUs this process
+ * is allowed to run on. Nodes without any allowed CPU are omitted. If sysfs
+ * does not expose NUMA information, a single node 0 with all allowed CPUs
+ * is returned.
+ */
+std::vector<NumaNodeCpus> GetNumaTopology();
+
+/**
+ * Restrict the calling thread to the given CPUs. Returns 0 on success or
+ * an errno value on failure; an empty list leaves the affinity unchanged.
+ */
+int PinCurrentThreadToCpus(const std::vector<int>& cpus);
+
+/**
+ * The CPU thread is pinned to, or -1 if it may run on more than one
+ */
+int GetPinnedCpu(pthread_t thread);
+}  // namespace oldisim
+
+#endif  // OLDISIM_TOPOLOGY_H
@@ -0,0 +1,38 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_TRANSPORT_H
+#define OLDISIM_TRANSPORT_H
+
+namespace oldisim {
+
+/**
+ * How a connection reaches its child node.
+ *
+ * kTcp connects to hostname:port over TCP. The two local transports only
+ * reach a child on the same host and ignore the hostname: kUnix connects to
+ * the AF_UNIX stream socket every node server listens on next to its TCP
+ * port, and kSharedMemory uses that socket only to hand over a pair of
+ * single-producer single-consumer rings in shared memory, with an eventfd
+ * per side to wake up the reader. All transports carry the same wire
+ * protocol and are accepted by every node server.
+ */
+enum class Transport {
+  kTcp,
+  kUnix,
+  kSharedMemory,
+};
+}  // namespace oldisim
+
+#endif  // OLDISIM_TRANSPORT_H
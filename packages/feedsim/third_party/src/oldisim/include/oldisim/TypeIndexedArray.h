@@ -0,0 +1,124 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OLDISIM_TYPE_INDEXED_ARRAY_H
+#define OLDISIM_TYPE_INDEXED_ARRAY_H
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "oldisim/CacheAligned.h"
+
+namespace oldisim {
+
+/**
+ * Values keyed by a fixed set of request types, kept in one flat array so
+ * that finding the value of a type is two indexed loads rather than a walk
+ * down a tree. Iterates in type order like a std::map, yielding
+ * (type, value) pairs. The values are cache-aligned, so stats of different
+ * threads never share a line.
+ */
+template <typename T>
+class TypeIndexedArray {
+ public:
+  template <typename Value>
+  class Iterator {
+   public:
+    Iterator(const uint32_t* type, Value* value) : type_(type), value_(value) {}
+
+    std::pair<uint32_t, Value&> operator*() const {
+      return std::pair<uint32_t, Value&>(*type_, *value_);
+    }
+
+    Iterator& operator++() {
+      type_++;
+      value_++;
+      return *this;
+    }
+
+    bool operator==(const Iterator& that) const {
+      return value_ == that.value_;
+    }
+
+    bool operator!=(const Iterator& that) const {
+      return value_ != that.value_;
+    }
+
+   private:
+    const uint32_t* type_;
+    Value* value_;
+  };
+
+  typedef Iterator<T> iterator;
+  typedef Iterator<const T> const_iterator;
+
+  TypeIndexedArray(const std::set<uint32_t>& types, const T& initial_value)
+      : types_(types.begin(), types.end()),
+        values_(types.size(), initial_value) {
+    slots_.resize(types.empty() ? 0 : *types.rbegin() + 1, kNoSlot);
+    for (size_t i = 0; i < types_.size(); i++) {
+      slots_[types_[i]] = static_cast<int32_t>(i);
+    }
+  }
+
+  size_t size() const { return types_.size(); }
+
+  size_t count(uint32_t type) const {
+    return type < slots_.size() && slots_[type] != kNoSlot ? 1 : 0;
+  }
+
+  T& at(uint32_t type) {
+    assert(count(type) > 0);
+    return values_[slots_[type]];
+  }
+
+  const T& at(uint32_t type) const {
+    assert(count(type) > 0);
+    return values_[slots_[type]];
+  }
+
+  T& operator[](uint32_t type) { return at(type); }
+  const T& operator[](uint32_t type) const { return at(type); }
+
+  iterator begin() { return iterator(types_.data(), values_.data()); }
+  iterator end() {
+    return iterator(types_.data() + types_.size(),
+                    values_.data() + values_.size());
+  }
+  const_iterator begin() const {
+    return const_iterator(types_.data(), values_.data());
+  }
+  const_iterator end() const {
+    return const_iterator(types_.data() + types_.size(),
+                          values_.data() + values_.size());
+  }
+
+ private:
+  static const int32_t kNoSlot = -1;
+
+  std::vector<uint32_t> types_;
+  // Position in values_ of each type, kNoSlot for the gaps between types
+  std::vector<int32_t> slots_;
+  std::vector<T, CacheAlignedAllocator<T>> values_;
+};
+
+template <typename T>
+const int32_t TypeIndexedArray<T>::kNoSlot;
+}  // namespace oldisim
+
+#endif  // OLDISIM_TYPE_INDEXED_ARRAY_H
@@ -106,6 +106,23 @@ inline double GetTime() {
   return TvToDouble(&tv);
 }
 
+// Port of an IPv4 or IPv6 socket address
+inline uint16_t GetAddressPort(const sockaddr *address) {
+  if (address->sa_family == AF_INET6) {
+    return be16toh(((const struct sockaddr_in6 *)address)->sin6_port);
+  }
+  return be16toh(((const struct sockaddr_in *)address)->sin_port);
+}
+
+inline void SetAddressPort(sockaddr *address, uint16_t port) {
+  if (address->sa_family == AF_INET6) {
+    ((struct sockaddr_in6 *)address)->sin6_port = htobe16(port);
+  } else {
+    ((struct sockaddr_in *)address)->sin_port = htobe16(port);
+  }
+}
+
+// Resolve hostname to all of its IPv4 and IPv6 addresses, each with port
 inline addrinfo *ResolveHost(std::string hostname, uint16_t port) {
   addrinfo hints;
   addrinfo *result = nullptr;
@@ -114,45 +131,171 @@ inline addrinfo *ResolveHost(std::string hostname, uint16_t port) {
   // Set to resolve IP address
   std::memset(&hints, 0, sizeof(hints));
   hints.ai_socktype = SOCK_STREAM;
-  hints.ai_family = AF_INET;
+  hints.ai_family = AF_UNSPEC;
 
   // Resolve
   if ((err = getaddrinfo(hostname.c_str(), NULL, &hints, &result)) != 0) {
-    DIE("Could not resolve %s, got error %d\n", hostname.c_str(), err);
+    DIE("Could not resolve %s: %s\n", hostname.c_str(), gai_strerror(err));
   }
 
-  // Set port in ai_addr, treat as IPv4
-  ((struct sockaddr_in *)(result->ai_addr))->sin_port = htobe16(port);
+  // Set port in every ai_addr
+  for (addrinfo *rp = result; rp != nullptr; rp = rp->ai_next) {
+    SetAddressPort(rp->ai_addr, port);
+  }
 
   return result;
 }
 
+// One step of the splitmix64 sequence at *state
+inline uint64_t SplitMix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Seed of stream number stream, e.g. a thread or a request, of a run seeded
+// with seed. Neighboring streams and seeds get unrelated values, so a run
+// can hand its threads seed, seed + 1, ... without their streams overlapping
+inline uint64_t DeriveSeed(uint64_t seed, uint64_t stream) {
+  uint64_t state = seed ^ SplitMix64(&stream);
+  return SplitMix64(&state);
+}
+
+struct Xor128State {
+  uint64_t x = 123456789;
+  uint64_t y = 362436069;
+  uint64_t z = 521288629;
+  uint64_t w = 88675123;
+};
+
+inline Xor128State &ThreadXor128State() {
+  thread_local static Xor128State state;
+  return state;
+}
+
 // Fast random number-generator
 // Not cryptographically-safe
 inline uint64_t xor128() {
-  thread_local static uint64_t x = 123456789;
-  thread_local static uint64_t y = 362436069;
-  thread_local static uint64_t z = 521288629;
-  thread_local static uint64_t w = 88675123;
+  Xor128State &s = ThreadXor128State();
   uint64_t t;
-  t = x ^ (x << 11);
-  x = y;
-  y = z;
-  z = w;
-  return w = w ^ (w >> 19) ^ (t ^ (t >> 8));
+  t = s.x ^ (s.x << 11);
+  s.x = s.y;
+  s.y = s.z;
+  s.z = s.w;
+  return s.w = s.w ^ (s.w >> 19) ^ (t ^ (t >> 8));
 }
 
+// Four interleaved xoshiro256** generators for bulk random data. Every step
+// advances all lanes with the same shifts, rotates and multiplies, so the
+// lane loops compile to vector instructions. Not cryptographically-safe
+class Xoshiro256x4 {
+ public:
+  static const int kLanes = 4;
+
+  explicit Xoshiro256x4(uint64_t seed) {
+    // Seed the lanes from a splitmix64 sequence so none starts all-zero
+    for (int lane = 0; lane < kLanes; lane++) {
+      s0_[lane] = SplitMix64(&seed);
+      s1_[lane] = SplitMix64(&seed);
+      s2_[lane] = SplitMix64(&seed);
+      s3_[lane] = SplitMix64(&seed);
+    }
+  }
+
+  // Writes one 64-bit random word to each of out[0..kLanes)
+  void Next(uint64_t *out) {
+    for (int lane = 0; lane < kLanes; lane++) {
+      out[lane] = Rotl(s1_[lane] * 5, 7) * 9;
+    }
+    for (int lane = 0; lane < kLanes; lane++) {
+      const uint64_t t = s1_[lane] << 17;
+      s2_[lane] ^= s0_[lane];
+      s3_[lane] ^= s1_[lane];
+      s1_[lane] ^= s2_[lane];
+      s0_[lane] ^= s3_[lane];
+      s2_[lane] ^= t;
+      s3_[lane] = Rotl(s3_[lane], 45);
+    }
+  }
+
+  void Fill(uint64_t *out, size_t num_words) {
+    size_t i = 0;
+    for (; i + kLanes <= num_words; i += kLanes) {
+      Next(out + i);
+    }
+    if (i < num_words) {
+      uint64_t tail[kLanes];
+      Next(tail);
+      std::copy(tail, tail + (num_words - i), out + i);
+    }
+  }
+
+ private:
+  static uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t s0_[kLanes];
+  uint64_t s1_[kLanes];
+  uint64_t s2_[kLanes];
+  uint64_t s3_[kLanes];
+};
+
+// The calling thread's bulk generator. Like xor128(), every thread starts
+// from the same state
+inline Xoshiro256x4 &ThreadRandom() {
+  thread_local static Xoshiro256x4 rng(88675123);
+  return rng;
+}
+
+// Restarts the calling thread's xor128() and ThreadRandom() streams from
+// seed instead of the state every thread starts from
+inline void SeedThreadRandom(uint64_t seed) {
+  Xor128State &s = ThreadXor128State();
+  s.x = SplitMix64(&seed);
+  s.y = SplitMix64(&seed);
+  s.z = SplitMix64(&seed);
+  // An all-zero state would only ever yield zeros
+  s.w = SplitMix64(&seed) | 1;
+  ThreadRandom() = Xoshiro256x4(seed);
+}
+
+// Fills length bytes from [0-9A-Za-z]. Each random 16-bit value is scaled
+// onto the 62 characters with a multiply and shift instead of a modulo, and
+// mapped to its character arithmetically, so whole blocks convert without
+// branches or table lookups
 inline std::string RandomString(size_t length) {
-  auto randchar = []() -> char {
-    static const char charset[] =
-        "0123456789"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz";
-    const size_t max_index = (sizeof(charset) - 1);
-    return charset[xor128() % max_index];
-  };
+  // One step of the generator yields a block of 16 characters
+  static const size_t kBlockWords = Xoshiro256x4::kLanes;
+  static const size_t kBlockChars = kBlockWords * sizeof(uint64_t) / 2;
+  static const size_t kBatchBlocks = 16;
+  static const unsigned kNumChars = 62;
   std::string str(length, 0);
-  std::generate_n(str.begin(), length, randchar);
+  uint64_t words[kBatchBlocks * kBlockWords];
+  uint16_t values[kBatchBlocks * kBlockChars];
+  char chars[kBatchBlocks * kBlockChars];
+  for (size_t i = 0; i < length; i += sizeof(chars)) {
+    const size_t n = std::min(sizeof(chars), length - i);
+    const size_t num_blocks = (n + kBlockChars - 1) / kBlockChars;
+    ThreadRandom().Fill(words, num_blocks * kBlockWords);
+    std::memcpy(values, words, num_blocks * sizeof(words[0]) * kBlockWords);
+    // Convert into a local buffer; writes through the string could alias the
+    // loop's inputs and keep it from vectorizing
+    for (size_t block = 0; block < num_blocks; block++) {
+      const uint16_t *in = values + block * kBlockChars;
+      char *out = chars + block * kBlockChars;
+      for (size_t j = 0; j < kBlockChars; j++) {
+        // Keeping every step at 16 bits lets a vector hold 8 characters
+        const uint16_t index =
+            static_cast<uint16_t>((in[j] * kNumChars) >> 16);
+        // '0'..'9' are followed by 'A' 7 code points later and 'Z' by 'a' 6
+        // code points later. The sign bit of 9 - index is set from 10 on
+        const uint16_t upper = (static_cast<uint16_t>(9 - index) >> 15) * 7;
+        const uint16_t lower = (static_cast<uint16_t>(35 - index) >> 15) * 6;
+        out[j] = static_cast<char>(index + upper + lower + '0');
+      }
+    }
+    std::memcpy(&str[i], chars, n);
+  }
   return str;
 }
 
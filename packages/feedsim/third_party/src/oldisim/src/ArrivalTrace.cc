@@ -0,0 +1,174 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/ArrivalTrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+static const char kTraceMagic[8] = {'O', 'L', 'D', 'T', 'R', 'A', 'C', 'E'};
+static const uint64_t kTraceVersion = 1;
+
+struct TraceFileHeader {
+  char magic[8];
+  uint64_t version;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord must have no padding");
+
+ArrivalTrace::ArrivalTrace()
+    : records_(nullptr),
+      num_records_(0),
+      mapping_(nullptr),
+      mapping_length_(0) {}
+
+ArrivalTrace::~ArrivalTrace() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_length_);
+  }
+}
+
+std::shared_ptr<const ArrivalTrace> ArrivalTrace::Open(
+    const std::string& path) {
+  std::shared_ptr<ArrivalTrace> trace(new ArrivalTrace());
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DIE("Could not open trace %s: %s", path.c_str(), strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    DIE("Could not stat trace %s: %s", path.c_str(), strerror(errno));
+  }
+
+  TraceFileHeader header;
+  bool is_binary =
+      st.st_size >= static_cast<off_t>(sizeof(header)) &&
+      pread(fd, &header, sizeof(header), 0) ==
+          static_cast<ssize_t>(sizeof(header)) &&
+      memcmp(header.magic, kTraceMagic, sizeof(kTraceMagic)) == 0;
+
+  if (is_binary) {
+    if (header.version != kTraceVersion) {
+      DIE("Trace %s has version %" PRIu64 ", expected %" PRIu64, path.c_str(),
+          header.version, kTraceVersion);
+    }
+    trace->mapping_length_ = st.st_size;
+    trace->mapping_ =
+        mmap(nullptr, trace->mapping_length_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->mapping_ == MAP_FAILED) {
+      DIE("Could not map trace %s: %s", path.c_str(), strerror(errno));
+    }
+    // Records are replayed front to back
+    madvise(trace->mapping_, trace->mapping_length_, MADV_SEQUENTIAL);
+    trace->records_ = reinterpret_cast<const TraceRecord*>(
+        reinterpret_cast<const char*>(trace->mapping_) + sizeof(header));
+    // A trailing partial record is left over from an interrupted recording
+    trace->num_records_ = (st.st_size - sizeof(header)) / sizeof(TraceRecord);
+  } else {
+    std::ifstream input(path.c_str());
+    std::string line;
+    int line_number = 0;
+    while (std::getline(input, line)) {
+      line_number++;
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      std::replace(line.begin(), line.end(), ',', ' ');
+      std::istringstream fields(line);
+      TraceRecord record;
+      if (!(fields >> record.timestamp_ns >> record.type >>
+            record.payload_length)) {
+        // Only the first line may be a header
+        if (line_number == 1) {
+          continue;
+        }
+        DIE("Malformed line %d in trace %s", line_number, path.c_str());
+      }
+      trace->parsed_records_.push_back(record);
+    }
+    trace->records_ = trace->parsed_records_.data();
+    trace->num_records_ = trace->parsed_records_.size();
+  }
+  close(fd);
+
+  if (trace->num_records_ == 0) {
+    DIE("Trace %s has no arrivals", path.c_str());
+  }
+  for (size_t i = 1; i < trace->num_records_; i++) {
+    if (trace->records_[i].timestamp_ns < trace->records_[i - 1].timestamp_ns) {
+      DIE("Trace %s is not in timestamp order at record %zu", path.c_str(), i);
+    }
+  }
+
+  return trace;
+}
+
+uint64_t ArrivalTrace::period_ns() const {
+  uint64_t span =
+      records_[num_records_ - 1].timestamp_ns - records_[0].timestamp_ns;
+  uint64_t mean_gap = num_records_ > 1 ? span / (num_records_ - 1) : 0;
+  return std::max<uint64_t>(span + mean_gap, 1);
+}
+
+ArrivalTraceRecorder::ArrivalTraceRecorder(const std::string& path)
+    : file_(fopen(path.c_str(), "wb")),
+      start_time_ns_(GetTimeAccurateNano()),
+      last_timestamp_ns_(0) {
+  if (file_ == nullptr) {
+    DIE("Could not create trace %s: %s", path.c_str(), strerror(errno));
+  }
+  TraceFileHeader header;
+  memcpy(header.magic, kTraceMagic, sizeof(kTraceMagic));
+  header.version = kTraceVersion;
+  fwrite(&header, sizeof(header), 1, file_);
+}
+
+ArrivalTraceRecorder::~ArrivalTraceRecorder() { Close(); }
+
+void ArrivalTraceRecorder::Record(uint64_t time_ns, uint32_t type,
+                                  uint32_t payload_length) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (file_ == nullptr) {
+    return;
+  }
+  // Threads race for the lock, so keep the file in timestamp order
+  uint64_t timestamp = time_ns > start_time_ns_ ? time_ns - start_time_ns_ : 0;
+  last_timestamp_ns_ = std::max(last_timestamp_ns_, timestamp);
+  TraceRecord record = {last_timestamp_ns_, type, payload_length};
+  fwrite(&record, sizeof(record), 1, file_);
+}
+
+void ArrivalTraceRecorder::Close() {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+}  // namespace oldisim
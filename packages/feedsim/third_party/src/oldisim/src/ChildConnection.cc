@@ -23,22 +23,63 @@
 #include <netinet/tcp.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <algorithm>
 #include <memory>
 #include <queue>
 
 #include "ChildConnectionImpl.h"
+#include "CompactFraming.h"
+#include "ConnectionUtil.h"
+#include "LocalTransport.h"
+#include "NodeThreadImpl.h"
+#include "RssConnector.h"
+#include "TlsTransport.h"
 #include "oldisim/Response.h"
 #include "oldisim/ResponseContext.h"
+#include "oldisim/Tls.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
 
+namespace {
+
+// Receive buffer shared by the connections of a thread that use shared
+// buffers, see ChildConnectionImpl::SharedReadCallback
+const size_t kSharedReceiveBufferSize = 64 * 1024;
+
+struct SharedReceiveBuffer {
+  char data[kSharedReceiveBufferSize];
+  // Refers to data while the responses received into it are processed
+  evbuffer* view;
+};
+
+SharedReceiveBuffer& GetSharedReceiveBuffer() {
+  static thread_local SharedReceiveBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    buffer = new SharedReceiveBuffer();
+    buffer->view = evbuffer_new();
+  }
+  return *buffer;
+}
+}  // namespace
+
+std::atomic<int64_t> ChildConnection::ChildConnectionImpl::num_private_buffers(
+    0);
+std::atomic<int64_t> ChildConnection::ChildConnectionImpl::peak_private_buffers(
+    0);
+
 ChildConnection::ChildConnection(std::unique_ptr<ChildConnectionImpl> impl)
     : impl_(std::move(impl)) {}
 
 ChildConnection::~ChildConnection() {
-  bufferevent_free(impl_->bev_);
+  // Its event has to go before the socket is closed
+  impl_->rx_timestamper_.reset();
+  if (impl_->bev_ != nullptr) {
+    ConnectionUtil::FreeSocketBufferevent(impl_->bev_);
+  }
 }
 
 void ChildConnection::Reset() {
@@ -48,6 +89,19 @@ void ChildConnection::Reset() {
 
 void ChildConnection::IssueRequest(uint32_t type, uint64_t request_id,
                                    const void* payload, uint32_t length) {
+  IssueRequest(type, request_id, payload, length, GetTimeAccurateNano());
+}
+
+void ChildConnection::IssueRequest(uint32_t type, uint64_t request_id,
+                                   const void* payload, uint32_t length,
+                                   uint64_t start_time) {
+  IssueRequest(type, request_id, payload, length, start_time, 0, 0);
+}
+
+void ChildConnection::IssueRequest(uint32_t type, uint64_t request_id,
+                                   const void* payload, uint32_t length,
+                                   uint64_t start_time, uint32_t priority,
+                                   uint32_t deadline_us) {
   // Start tracking the query in the system
   Query query_internal;
 
@@ -55,16 +109,35 @@ void ChildConnection::IssueRequest(uint32_t type, uint64_t request_id,
   query_internal.query_header_.type = type;
   query_internal.query_header_.request_id = request_id;
   query_internal.query_header_.payload_length = length;
+  query_internal.query_header_.priority = priority;
+  query_internal.query_header_.deadline_us = deadline_us;
 
   // Start timing begin of operation
-  query_internal.query_header_.start_time = GetTimeAccurateNano();
+  query_internal.query_header_.start_time = start_time;
 
   // Write out operation on the wire
-  QueryPacketHeader packet_header =
-      std::move(query_internal.GetHeaderNetworkOrder());
-  bufferevent_write(impl_->bev_, &packet_header, sizeof(packet_header));
-  if (length > 0) {
-    bufferevent_write(impl_->bev_, payload, length);
+  if (impl_->compact_framing_) {
+    // Keep the start time instead of sending it
+    impl_->start_times_[request_id] = start_time;
+    QueryPacketHeader header = query_internal.query_header_;
+    header.start_time = 0;
+    uint8_t packet_header[CompactFraming::kMaxHeaderLength];
+    query_internal.header_length_ =
+        CompactFraming::EncodeQueryHeader(header, packet_header);
+    if (impl_->batch_output_ != nullptr) {
+      impl_->StageQuery(packet_header, query_internal.header_length_,
+                        payload, length);
+    } else {
+      iovec chunks[2] = {{packet_header, query_internal.header_length_},
+                         {const_cast<void*>(payload), length}};
+      impl_->Send(chunks, length > 0 ? 2 : 1);
+    }
+  } else {
+    QueryPacketHeader packet_header =
+        std::move(query_internal.GetHeaderNetworkOrder());
+    iovec chunks[2] = {{&packet_header, sizeof(packet_header)},
+                       {const_cast<void*>(payload), length}};
+    impl_->Send(chunks, length > 0 ? 2 : 1);
   }
 
   // Log the request
@@ -75,6 +148,12 @@ void ChildConnection::IssueRequest(uint32_t type, uint64_t request_id,
 }
 
 void ChildConnection::set_priority(int pri) {
+  if (impl_->bev_ == nullptr) {
+    if (event_priority_set(impl_->read_event_, pri) ||
+        event_priority_set(impl_->write_event_, pri))
+      DIE("event_priority_set(%d) failed", pri);
+    return;
+  }
   if (bufferevent_priority_set(impl_->bev_, pri))
     DIE("bufferevent_set_priority(bev_, %d) failed", pri);
 }
@@ -89,7 +168,9 @@ int ChildConnection::GetNumOutstandingRequests() const {
 ChildConnection::ChildConnectionImpl::ChildConnectionImpl(
     const ResponseCallback& response_handler, const ClosedCallback& _closed_cb,
     event_base* base, const addrinfo* address,
-    ChildConnectionStats& thread_conn_stats, bool store_queries, bool no_delay)
+    ChildConnectionStats& thread_conn_stats, bool store_queries, bool no_delay,
+    bool segmented_payloads, Transport transport, Framing framing,
+    bool shared_buffers)
     : base_(base),
       closed_cb(_closed_cb),
       response_cb(response_handler),
@@ -97,31 +178,39 @@ ChildConnection::ChildConnectionImpl::ChildConnectionImpl(
       start_time_(GetTimeAccurate()),
       thread_conn_stats_(thread_conn_stats),
       read_state_(ReadState::WAITING),
-      num_outstanding_requests(0) {
-  // Open socket
-  int sockfd = 0;
-  if ((sockfd = socket(address->ai_family, address->ai_socktype,
-                       address->ai_protocol)) < 0) {
-    DIE("\n Error : Could not create socket \n");
-  }
-
-  if (connect(sockfd, address->ai_addr, address->ai_addrlen) < 0) {
-    char ipstr[INET6_ADDRSTRLEN];
-    void* addr;
-
-    // Get the pointer to the address itself,
-    // different fields in IPv4 and IPv6:
-    if (address->ai_family == AF_INET) {  // IPv4
-      struct sockaddr_in* ipv4 = (struct sockaddr_in*)address->ai_addr;
-      addr = &(ipv4->sin_addr);
-    } else {  // IPv6
-      struct sockaddr_in6* ipv6 = (struct sockaddr_in6*)address->ai_addr;
-      addr = &(ipv6->sin6_addr);
-    }
-    inet_ntop(address->ai_family, addr, ipstr, sizeof ipstr);
-    DIE("\n Error : Connect Failed to %s \n", ipstr);
+      num_outstanding_requests(0),
+      segmented_payloads_(segmented_payloads),
+      framing_(framing),
+      hello_pending_(false),
+      compact_framing_(false),
+      batch_output_(nullptr),
+      batch_flush_event_(nullptr),
+      num_batched_queries_(0),
+      shared_buffers_(shared_buffers),
+      fd_(-1),
+      read_event_(nullptr),
+      write_event_(nullptr),
+      input_(nullptr),
+      output_(nullptr) {
+  if (framing_ == Framing::kCompactBatched) {
+    batch_output_ = evbuffer_new();
+    batch_flush_event_ = evtimer_new(base_, BatchFlushCallback, this);
   }
 
+  if (shared_buffers_ && (transport != Transport::kTcp || IsTlsEnabled())) {
+    DIE("Shared connection buffers need plain TCP connections");
+  }
+
+  // Local transports find the child by its port alone
+  if (transport != Transport::kTcp) {
+    bev_ = ConnectLocal(base_, GetAddressPort(address->ai_addr), transport,
+                        BEV_OPT_CLOSE_ON_FREE);
+    return;
+  }
+
+  // Connect to the next address of the child, spread over the network
+  int sockfd = ConnectSpread(address);
+
   // Make it send back without delay
   if (no_delay_) {
     int optval = 1;
@@ -129,12 +218,167 @@ ChildConnection::ChildConnectionImpl::ChildConnectionImpl(
       DIE("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
     }
   }
+  ConnectionUtil::SetBusyPollSocketOptions(sockfd);
 
   // Make it non-blocking
   evutil_make_socket_nonblocking(sockfd);
 
-  // Make buffer event
-  bev_ = bufferevent_socket_new(base_, sockfd, BEV_OPT_CLOSE_ON_FREE);
+  // Events on the socket are set up once the connection exists, as the
+  // callbacks of a bufferevent are
+  if (shared_buffers_) {
+    fd_ = sockfd;
+    bev_ = nullptr;
+    rx_timestamper_ = RxTimestamper::Create(base_, sockfd);
+    return;
+  }
+
+  // Make buffer event, encrypted if TLS is enabled
+  if (IsTlsEnabled()) {
+    bev_ = TlsBuffereventNew(base_, sockfd, false, BEV_OPT_CLOSE_ON_FREE);
+    if (bev_ == nullptr) {
+      DIE("TLS handshake with the child node failed");
+    }
+  } else {
+    bev_ = ConnectionUtil::NewSocketBufferevent(base_, sockfd,
+                                                BEV_OPT_CLOSE_ON_FREE);
+  }
+  rx_timestamper_ = RxTimestamper::Create(base_, sockfd);
+}
+
+ChildConnection::ChildConnectionImpl::~ChildConnectionImpl() {
+  if (batch_flush_event_ != nullptr) {
+    event_free(batch_flush_event_);
+  }
+  if (batch_output_ != nullptr) {
+    evbuffer_free(batch_output_);
+  }
+  if (read_event_ != nullptr) {
+    event_free(read_event_);
+  }
+  if (write_event_ != nullptr) {
+    event_free(write_event_);
+  }
+  FreePrivateBuffer(&input_);
+  FreePrivateBuffer(&output_);
+  if (fd_ >= 0) {
+    evutil_closesocket(fd_);
+  }
+}
+
+evbuffer* ChildConnection::ChildConnectionImpl::NewPrivateBuffer() {
+  int64_t count = ++num_private_buffers;
+  int64_t peak = peak_private_buffers.load(std::memory_order_relaxed);
+  while (count > peak &&
+         !peak_private_buffers.compare_exchange_weak(peak, count)) {
+  }
+  return evbuffer_new();
+}
+
+void ChildConnection::ChildConnectionImpl::FreePrivateBuffer(
+    evbuffer** buffer) {
+  if (*buffer != nullptr) {
+    evbuffer_free(*buffer);
+    *buffer = nullptr;
+    num_private_buffers--;
+  }
+}
+
+void ChildConnection::ChildConnectionImpl::Send(const iovec* chunks,
+                                                int num_chunks) {
+  if (bev_ != nullptr) {
+    for (int i = 0; i < num_chunks; i++) {
+      bufferevent_write(bev_, chunks[i].iov_base, chunks[i].iov_len);
+    }
+    return;
+  }
+
+  // Write straight to the socket, unless earlier data is still waiting
+  size_t sent = 0;
+  if (output_ == nullptr) {
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = const_cast<iovec*>(chunks);
+    message.msg_iovlen = num_chunks;
+    ssize_t ret = sendmsg(fd_, &message, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Like a bufferevent, leave it to the read side to see the close
+        D("sendmsg to child failed: %s", strerror(errno));
+        return;
+      }
+      ret = 0;
+    }
+    sent = ret;
+  }
+
+  // Keep the rest until the socket can take it
+  for (int i = 0; i < num_chunks; i++) {
+    if (sent >= chunks[i].iov_len) {
+      sent -= chunks[i].iov_len;
+      continue;
+    }
+    if (output_ == nullptr) {
+      output_ = NewPrivateBuffer();
+      event_add(write_event_, nullptr);
+    }
+    evbuffer_add(output_, static_cast<const char*>(chunks[i].iov_base) + sent,
+                 chunks[i].iov_len - sent);
+    sent = 0;
+  }
+}
+
+void ChildConnection::ChildConnectionImpl::Send(const void* data,
+                                                size_t length) {
+  iovec chunk = {const_cast<void*>(data), length};
+  Send(&chunk, 1);
+}
+
+void ChildConnection::ChildConnectionImpl::SendHello() {
+  Query hello;
+  hello.query_header_ = QueryPacketHeader();
+  hello.query_header_.type = CompactFraming::kHelloType;
+  hello.query_header_.request_id = CompactFraming::kHelloMagic;
+  QueryPacketHeader packet_header = hello.GetHeaderNetworkOrder();
+  Send(&packet_header, sizeof(packet_header));
+  hello_pending_ = true;
+}
+
+void ChildConnection::ChildConnectionImpl::StageQuery(const uint8_t* header,
+                                                      size_t header_length,
+                                                      const void* payload,
+                                                      uint32_t length) {
+  evbuffer_add(batch_output_, header, header_length);
+  if (length > 0) {
+    evbuffer_add(batch_output_, payload, length);
+  }
+  if (num_batched_queries_++ == 0) {
+    // Runs once the callbacks of the current loop iteration are done
+    event_active(batch_flush_event_, EV_TIMEOUT, 0);
+  }
+}
+
+void ChildConnection::ChildConnectionImpl::FlushBatch() {
+  // A lone query needs no batch header
+  if (num_batched_queries_ > 1) {
+    uint8_t batch_header[CompactFraming::kMaxHeaderLength];
+    size_t batch_header_length = CompactFraming::EncodeBatchHeader(
+        evbuffer_get_length(batch_output_), batch_header);
+    Send(batch_header, batch_header_length);
+  }
+  if (bev_ != nullptr) {
+    bufferevent_write_buffer(bev_, batch_output_);
+  } else {
+    // Batches are a handful of small queries, cheap to make linear
+    size_t length = evbuffer_get_length(batch_output_);
+    Send(evbuffer_pullup(batch_output_, -1), length);
+    evbuffer_drain(batch_output_, length);
+  }
+  num_batched_queries_ = 0;
+}
+
+void ChildConnection::ChildConnectionImpl::BatchFlushCallback(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  reinterpret_cast<ChildConnectionImpl*>(arg)->FlushBatch();
 }
 
 // The followings are C trampolines for libevent callbacks.
@@ -147,51 +391,91 @@ void ChildConnection::ChildConnectionImpl::bev_event_cb(struct bufferevent* bev,
     DIE("Timeout from child");
   } else if (events & BEV_EVENT_ERROR) {
   } else if (events & BEV_EVENT_EOF) {
-    D("Child closed connection");
-    conn->impl_->read_state_ = ReadState::CLOSED;
-    bufferevent_disable(conn->impl_->bev_, EV_READ | EV_WRITE);
-    if (conn->impl_->closed_cb != nullptr) {
-      conn->impl_->closed_cb(*conn);
-    }
+    conn->impl_->HandleEof(conn);
+  }
+}
+
+void ChildConnection::ChildConnectionImpl::HandleEof(ChildConnection* conn) {
+  D("Child closed connection");
+  read_state_ = ReadState::CLOSED;
+  if (bev_ != nullptr) {
+    bufferevent_disable(bev_, EV_READ | EV_WRITE);
+  } else {
+    event_del(read_event_);
+    event_del(write_event_);
+  }
+  if (closed_cb != nullptr) {
+    closed_cb(*conn);
   }
 }
 
 /**
  * Check to see if the buffer contains at least one full response that is ready
- * for retrieval. If so, it returns true; false otherwise
+ * for retrieval. If so, decode its header into response in host byte order.
  *
  * @param input evbuffer to read response from
- * @return true if a response is ready to be read, false if not enough data in
- *buffer
+ * @param compact whether the response may be a compact frame
+ * @param response where to decode the header of the response to
+ * @return the length of the header if a response is ready to be read, 0 if not
+ * enough data in buffer, or CompactFraming::kMalformedHeader if the frame
+ * can never be read
  */
-static bool BufferContainsResponse(evbuffer* input) {
+static size_t BufferContainsResponse(evbuffer* input, bool compact,
+                                     Response* response) {
   // Check length of input buffer
   size_t buffer_length = evbuffer_get_length(input);
-  const size_t header_length = sizeof(ResponsePacketHeader);
-  if (buffer_length < header_length) {
-    return false;
+  if (buffer_length == 0) {
+    return 0;
   }
-  ResponsePacketHeader* h = reinterpret_cast<ResponsePacketHeader*>(
-      evbuffer_pullup(input, header_length));
-  assert(h);
 
-  // Not whole query
-  uint32_t packet_length = header_length + be32toh(h->payload_length);
-  if (buffer_length < packet_length) {
-    return false;
+  uint8_t first_byte;
+  evbuffer_copyout(input, &first_byte, 1);
+  if (compact && CompactFraming::IsCompactFrame(first_byte)) {
+    size_t available =
+        std::min(buffer_length, CompactFraming::kMaxHeaderLength);
+    const uint8_t* data = evbuffer_pullup(input, available);
+    assert(data);
+    response->header_length_ = CompactFraming::DecodeResponseHeader(
+        data, available, &response->response_header_);
+    if (response->header_length_ == 0 ||
+        response->header_length_ == CompactFraming::kMalformedHeader) {
+      return response->header_length_;
+    }
+  } else {
+    if (buffer_length < sizeof(ResponsePacketHeader)) {
+      return 0;
+    }
+    ResponsePacketHeader* h = reinterpret_cast<ResponsePacketHeader*>(
+        evbuffer_pullup(input, sizeof(ResponsePacketHeader)));
+    assert(h);
+    *response = Response::FromHeaderNetworkOrder(h);
   }
 
-  // Must be full query
-  return true;
+  // Not whole response
+  if (buffer_length < response->GetResponsePacketSize()) {
+    return 0;
+  }
+
+  // Must be full response
+  return response->header_length_;
 }
 
 void ChildConnection::ChildConnectionImpl::bev_read_cb(struct bufferevent* bev,
                                                        void* ptr) {
   ChildConnection* conn = reinterpret_cast<ChildConnection*>(ptr);
   struct evbuffer* input = bufferevent_get_input(conn->impl_->bev_);
+  NoteEventLoopActivity();
+  uint64_t arrival_time = conn->impl_->rx_timestamper_ != nullptr
+                              ? conn->impl_->rx_timestamper_->TakeArrival()
+                              : 0;
+  conn->impl_->ProcessInput(conn, input, arrival_time);
+}
 
+void ChildConnection::ChildConnectionImpl::ProcessInput(
+    ChildConnection* conn, evbuffer* input, uint64_t arrival_time) {
   // Protocol processing loop.
-  if (conn->impl_->num_outstanding_requests == 0) {
+  if (conn->impl_->num_outstanding_requests == 0 &&
+      !conn->impl_->hello_pending_) {
     V("Spurious read callback.");
     return;
   }
@@ -202,28 +486,66 @@ void ChildConnection::ChildConnectionImpl::bev_read_cb(struct bufferevent* bev,
         DIE("event from closed connection");
       }
       case ReadState::WAITING: {
-        if (BufferContainsResponse(input)) {
-          // Read out response header
-          const size_t header_length = sizeof(ResponsePacketHeader);
-
-          ResponsePacketHeader* h = reinterpret_cast<ResponsePacketHeader*>(
-              evbuffer_pullup(input, header_length));
-          assert(h);
-          Response response = Response::FromHeaderNetworkOrder(h);
-
+        Response response;
+        size_t header_length = BufferContainsResponse(
+            input, conn->impl_->compact_framing_, &response);
+        if (header_length == CompactFraming::kMalformedHeader) {
+          // Nothing after it can be framed, so give up on the connection
+          W("Malformed response frame from child, closing connection");
+          evbuffer_drain(input, evbuffer_get_length(input));
+          shutdown(bev_ != nullptr ? bufferevent_getfd(bev_) : fd_,
+                   SHUT_RDWR);
+          HandleEof(conn);
+          return;
+        }
+        if (header_length > 0) {
           // Remove the header
           evbuffer_drain(input, header_length);
 
-          // Linearize evbuffer to allow for payload reading
-          void* payload =
-              evbuffer_pullup(input, response.response_header_.payload_length);
+          // The child acknowledged the hello, switch to compact framing
+          if (conn->impl_->hello_pending_ &&
+              response.GetType() == CompactFraming::kHelloType &&
+              response.GetRequestID() == CompactFraming::kHelloMagic) {
+            evbuffer_drain(input, response.GetPayloadLength());
+            conn->impl_->hello_pending_ = false;
+            conn->impl_->compact_framing_ = true;
+            // Compact responses may be shorter than a fixed header
+            if (conn->impl_->bev_ != nullptr) {
+              bufferevent_setwatermark(conn->impl_->bev_, EV_READ, 1, 0);
+            }
+            break;
+          }
+
+          // Compact responses only carry the start times that were sent
+          if (response.GetStartTime() == 0) {
+            auto start_time =
+                conn->impl_->start_times_.find(response.GetRequestID());
+            if (start_time != conn->impl_->start_times_.end()) {
+              response.response_header_.start_time = start_time->second;
+              conn->impl_->start_times_.erase(start_time);
+            }
+          }
+
+          // Linearize evbuffer to allow for payload reading, unless the
+          // payload may be handed out in segments
+          void* payload = ConnectionUtil::PeekPayload(
+              input, response.response_header_.payload_length,
+              conn->impl_->segmented_payloads_,
+              &conn->impl_->payload_segments_);
           response.payload_ = payload;
 
           uint64_t request_id = response.GetRequestID();
 
           // Log query statistics
           Query originating_query = response.RebuildOriginatingQuery();
-          originating_query.end_time_ = GetTimeAccurateNano();
+          // A kernel timestamp cannot be later than the read that saw it,
+          // nor earlier than the query
+          uint64_t now = GetTimeAccurateNano();
+          originating_query.end_time_ =
+              arrival_time == 0
+                  ? now
+                  : std::max(std::min(arrival_time, now),
+                             originating_query.GetStartTime());
 
           // Drained one request
           conn->impl_->num_outstanding_requests--;
@@ -232,8 +554,11 @@ void ChildConnection::ChildConnectionImpl::bev_read_cb(struct bufferevent* bev,
           ResponseContext context(
               response.GetType(), response.GetRequestID(),
               response.GetPayloadLength(), response.GetResponsePacketSize(),
-              response.payload_, false, originating_query.GetStartTime(),
-              originating_query.end_time_);
+              response.payload_, conn->impl_->payload_segments_.data(),
+              conn->impl_->payload_segments_.size(), false,
+              response.GetStatus(), originating_query.GetStartTime(),
+              originating_query.end_time_,
+              &conn->impl_->linear_payload_);
           assert(conn->impl_->response_cb != nullptr);
           conn->impl_->response_cb(context);
 
@@ -257,5 +582,70 @@ void ChildConnection::ChildConnectionImpl::bev_write_cb(struct bufferevent* bev,
   ChildConnection* conn = reinterpret_cast<ChildConnection*>(ptr);
   // Currently write cb does nothing
 }
+
+void ChildConnection::ChildConnectionImpl::SharedReadCallback(
+    evutil_socket_t fd, int16_t flags, void* arg) {
+  ChildConnection* conn = reinterpret_cast<ChildConnection*>(arg);
+  ChildConnectionImpl& impl = *conn->impl_;
+  SharedReceiveBuffer& shared = GetSharedReceiveBuffer();
+  NoteEventLoopActivity();
+
+  ssize_t length = recv(fd, shared.data, sizeof(shared.data), 0);
+  if (length == 0) {
+    impl.HandleEof(conn);
+    return;
+  }
+  if (length < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      // Like a bufferevent, stop reading after an error
+      D("recv from child failed: %s", strerror(errno));
+      event_del(impl.read_event_);
+    }
+    return;
+  }
+  uint64_t arrival_time = impl.rx_timestamper_ != nullptr
+                              ? impl.rx_timestamper_->TakeArrival()
+                              : 0;
+
+  // Work on the responses straight out of the shared buffer, unless the
+  // first of them began in an earlier read
+  evbuffer* input;
+  if (impl.input_ == nullptr) {
+    evbuffer_add_reference(shared.view, shared.data, length, nullptr,
+                           nullptr);
+    input = shared.view;
+  } else {
+    evbuffer_add(impl.input_, shared.data, length);
+    input = impl.input_;
+  }
+  impl.ProcessInput(conn, input, arrival_time);
+
+  size_t remaining = evbuffer_get_length(input);
+  if (input == shared.view) {
+    if (remaining > 0) {
+      // Keep the partial response until the rest of it arrives
+      impl.input_ = impl.NewPrivateBuffer();
+      evbuffer_add(impl.input_, evbuffer_pullup(input, remaining), remaining);
+      evbuffer_drain(input, remaining);
+    }
+  } else if (remaining == 0) {
+    impl.FreePrivateBuffer(&impl.input_);
+  }
+}
+
+void ChildConnection::ChildConnectionImpl::SharedWriteCallback(
+    evutil_socket_t fd, int16_t flags, void* arg) {
+  ChildConnection* conn = reinterpret_cast<ChildConnection*>(arg);
+  ChildConnectionImpl& impl = *conn->impl_;
+  if (evbuffer_write(impl.output_, fd) < 0 && errno != EAGAIN &&
+      errno != EWOULDBLOCK && errno != EINTR) {
+    D("write to child failed: %s", strerror(errno));
+    evbuffer_drain(impl.output_, evbuffer_get_length(impl.output_));
+  }
+  if (evbuffer_get_length(impl.output_) == 0) {
+    event_del(impl.write_event_);
+    impl.FreePrivateBuffer(&impl.output_);
+  }
+}
 }  // namespace oldisim
 
@@ -24,13 +24,20 @@
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <event2/util.h>
+#include <sys/uio.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "oldisim/ChildConnection.h"
 #include "oldisim/ChildConnectionStats.h"
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
 #include "InternalCallbacks.h"
+#include "RxTimestamper.h"
 
 namespace oldisim {
 
@@ -60,16 +67,84 @@ class ChildConnection::ChildConnectionImpl {
 
   ResponseCallback response_cb;
 
+  // Responses whose payload spans several receive buffers are handed out as
+  // segments instead of being linearized; see ParentConnectionImpl
+  const bool segmented_payloads_;
+  std::vector<iovec> payload_segments_;
+  std::vector<char> linear_payload_;
+
+  // Compact framing, see Framing. hello_pending_ is set from sending the
+  // hello until the child acknowledges it, from when queries are sent as
+  // compact frames and their start times are kept in start_times_.
+  const Framing framing_;
+  bool hello_pending_;
+  bool compact_framing_;
+  std::unordered_map<uint64_t, uint64_t> start_times_;
+
+  // With kCompactBatched, compact queries issued during one event loop
+  // iteration are staged in batch_output_, and sent together as one batch
+  // frame by batch_flush_event_
+  evbuffer *batch_output_;
+  event *batch_flush_event_;
+  int num_batched_queries_;
+
+  // Arrival times of responses from kernel timestamps, nullptr if off
+  std::unique_ptr<RxTimestamper> rx_timestamper_;
+
+  // With shared buffers bev_ is null, and the connection instead reads its
+  // socket from read_event_ into the receive buffer shared by its thread.
+  // input_ only exists while it holds a partial response and output_ while
+  // it holds data the socket did not take, so idle connections keep no
+  // buffers; see DriverNode::EnableHighConnectionCount.
+  const bool shared_buffers_;
+  int fd_;
+  event *read_event_;
+  event *write_event_;
+  evbuffer *input_;
+  evbuffer *output_;
+
   ChildConnectionImpl(const ResponseCallback &response_handler,
                       const ClosedCallback &_closed_cb, event_base *base,
                       const addrinfo *address,
                       ChildConnectionStats &thread_conn_stats,
-                      bool store_queries, bool no_delay);
+                      bool store_queries, bool no_delay,
+                      bool segmented_payloads, Transport transport,
+                      Framing framing, bool shared_buffers);
+  ~ChildConnectionImpl();
+
+  // Private buffers all connections with shared buffers hold now, and the
+  // most they held at once
+  static std::atomic<int64_t> num_private_buffers;
+  static std::atomic<int64_t> peak_private_buffers;
+  evbuffer *NewPrivateBuffer();
+  void FreePrivateBuffer(evbuffer **buffer);
+
+  // Queue data for the child, on bev_ or the socket itself
+  void Send(const iovec *chunks, int num_chunks);
+  void Send(const void *data, size_t length);
+  // Run the protocol over the responses received in input
+  void ProcessInput(ChildConnection *conn, evbuffer *input,
+                    uint64_t arrival_time);
+  // The child closed the connection
+  void HandleEof(ChildConnection *conn);
+
+  // Ask the child for compact framing
+  void SendHello();
+  // Add a compact query to the batch being staged
+  void StageQuery(const uint8_t *header, size_t header_length,
+                  const void *payload, uint32_t length);
+  void FlushBatch();
 
   // The followings are C trampolines for libevent callbacks.
   static void bev_event_cb(struct bufferevent *bev, int16_t events, void *ptr);
   static void bev_read_cb(struct bufferevent *bev, void *ptr);
   static void bev_write_cb(struct bufferevent *bev, void *ptr);
+  static void BatchFlushCallback(evutil_socket_t listener, int16_t flags,
+                                 void *arg);
+  static void SharedReadCallback(evutil_socket_t fd, int16_t flags,
+                                 void *arg);
+  static void SharedWriteCallback(evutil_socket_t fd, int16_t flags,
+                                  void *arg);
 };
 }  // namespace oldisim
 
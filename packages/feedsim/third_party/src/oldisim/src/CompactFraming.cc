@@ -0,0 +1,254 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "CompactFraming.h"
+
+namespace oldisim {
+
+namespace {
+size_t PutVarint(uint64_t value, uint8_t* out) {
+  size_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = static_cast<uint8_t>(value);
+  return length;
+}
+
+enum class VarintResult { kOk, kIncomplete, kMalformed };
+
+/**
+ * Read a varint of a field of the given width in bits at *data and advance
+ * *data past it. The varint is malformed if it is longer than the longest
+ * encoding of the field or its value does not fit in it.
+ */
+VarintResult GetVarint(const uint8_t** data, const uint8_t* end, int bits,
+                       uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < bits; shift += 7) {
+    if (*data == end) {
+      return VarintResult::kIncomplete;
+    }
+    uint8_t byte = *(*data)++;
+    uint64_t part = byte & 0x7f;
+    if (bits - shift < 7 && (part >> (bits - shift)) != 0) {
+      return VarintResult::kMalformed;
+    }
+    result |= part << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return VarintResult::kOk;
+    }
+  }
+  return VarintResult::kMalformed;
+}
+
+/**
+ * Reads the varints of a header in turn, stopping at the first one that is
+ * incomplete or malformed
+ */
+class HeaderReader {
+ public:
+  HeaderReader(const uint8_t* data, size_t length)
+      : data_(data), p_(data + 1), end_(data + length),
+        result_(VarintResult::kOk) {}
+
+  void Get(int bits, uint64_t* value) {
+    if (result_ == VarintResult::kOk) {
+      result_ = GetVarint(&p_, end_, bits, value);
+    }
+  }
+
+  // The header length, 0 if incomplete or kMalformedHeader
+  size_t Finish() const {
+    switch (result_) {
+      case VarintResult::kOk:
+        return p_ - data_;
+      case VarintResult::kIncomplete:
+        return 0;
+      default:
+        return CompactFraming::kMalformedHeader;
+    }
+  }
+
+ private:
+  const uint8_t* data_;
+  const uint8_t* p_;
+  const uint8_t* end_;
+  VarintResult result_;
+};
+}  // namespace
+
+size_t CompactFraming::EncodeQueryHeader(const QueryPacketHeader& header,
+                                         uint8_t* out) {
+  uint8_t marker = kMarker;
+  if (header.start_time != 0) {
+    marker |= kQueryStartTime;
+  }
+  if (header.priority != 0) {
+    marker |= kQueryPriority;
+  }
+  if (header.deadline_us != 0) {
+    marker |= kQueryDeadline;
+  }
+
+  size_t length = 0;
+  out[length++] = marker;
+  length += PutVarint(header.type, out + length);
+  length += PutVarint(header.request_id, out + length);
+  length += PutVarint(header.payload_length, out + length);
+  if (marker & kQueryStartTime) {
+    length += PutVarint(header.start_time, out + length);
+  }
+  if (marker & kQueryPriority) {
+    length += PutVarint(header.priority, out + length);
+  }
+  if (marker & kQueryDeadline) {
+    length += PutVarint(header.deadline_us, out + length);
+  }
+  return length;
+}
+
+size_t CompactFraming::EncodeResponseHeader(const ResponsePacketHeader& header,
+                                            uint8_t* out) {
+  uint8_t marker = kMarker;
+  if (header.start_time != 0) {
+    marker |= kResponseStartTime;
+  }
+  if (header.processing_time != 0) {
+    marker |= kResponseProcessingTime;
+  }
+  if (header.status != static_cast<uint32_t>(ResponseStatus::kOk)) {
+    marker |= kResponseStatus;
+  }
+  if (header.queue_time != 0) {
+    marker |= kResponseQueueTime;
+  }
+
+  size_t length = 0;
+  out[length++] = marker;
+  length += PutVarint(header.type, out + length);
+  length += PutVarint(header.request_id, out + length);
+  length += PutVarint(header.payload_length, out + length);
+  if (marker & kResponseStartTime) {
+    length += PutVarint(header.start_time, out + length);
+  }
+  if (marker & kResponseProcessingTime) {
+    length += PutVarint(header.processing_time, out + length);
+  }
+  if (marker & kResponseStatus) {
+    length += PutVarint(header.status, out + length);
+  }
+  if (marker & kResponseQueueTime) {
+    length += PutVarint(header.queue_time, out + length);
+  }
+  return length;
+}
+
+size_t CompactFraming::EncodeBatchHeader(uint32_t body_length, uint8_t* out) {
+  out[0] = kMarker | kBatch;
+  return 1 + PutVarint(body_length, out + 1);
+}
+
+size_t CompactFraming::DecodeQueryHeader(const uint8_t* data, size_t length,
+                                         QueryPacketHeader* header) {
+  if (length == 0) {
+    return 0;
+  }
+  uint8_t marker = data[0];
+  HeaderReader reader(data, length);
+  uint64_t type = 0, request_id = 0, payload_length = 0;
+  uint64_t start_time = 0, priority = 0, deadline_us = 0;
+  reader.Get(32, &type);
+  reader.Get(64, &request_id);
+  reader.Get(32, &payload_length);
+  if (marker & kQueryStartTime) {
+    reader.Get(64, &start_time);
+  }
+  if (marker & kQueryPriority) {
+    reader.Get(32, &priority);
+  }
+  if (marker & kQueryDeadline) {
+    reader.Get(32, &deadline_us);
+  }
+  size_t header_length = reader.Finish();
+  if (header_length == 0 || header_length == kMalformedHeader) {
+    return header_length;
+  }
+  header->type = type;
+  header->request_id = request_id;
+  header->start_time = start_time;
+  header->payload_length = payload_length;
+  header->priority = priority;
+  header->deadline_us = deadline_us;
+  return header_length;
+}
+
+size_t CompactFraming::DecodeResponseHeader(const uint8_t* data,
+                                            size_t length,
+                                            ResponsePacketHeader* header) {
+  if (length == 0) {
+    return 0;
+  }
+  uint8_t marker = data[0];
+  HeaderReader reader(data, length);
+  uint64_t type = 0, request_id = 0, payload_length = 0;
+  uint64_t start_time = 0, processing_time = 0, queue_time = 0;
+  uint64_t status = static_cast<uint64_t>(ResponseStatus::kOk);
+  reader.Get(32, &type);
+  reader.Get(64, &request_id);
+  reader.Get(32, &payload_length);
+  if (marker & kResponseStartTime) {
+    reader.Get(64, &start_time);
+  }
+  if (marker & kResponseProcessingTime) {
+    reader.Get(64, &processing_time);
+  }
+  if (marker & kResponseStatus) {
+    reader.Get(32, &status);
+  }
+  if (marker & kResponseQueueTime) {
+    reader.Get(64, &queue_time);
+  }
+  size_t header_length = reader.Finish();
+  if (header_length == 0 || header_length == kMalformedHeader) {
+    return header_length;
+  }
+  header->type = type;
+  header->request_id = request_id;
+  header->start_time = start_time;
+  header->processing_time = processing_time;
+  header->queue_time = queue_time;
+  header->payload_length = payload_length;
+  header->status = status;
+  return header_length;
+}
+
+size_t CompactFraming::DecodeBatchHeader(const uint8_t* data, size_t length,
+                                         uint32_t* body_length) {
+  if (length == 0) {
+    return 0;
+  }
+  HeaderReader reader(data, length);
+  uint64_t value = 0;
+  reader.Get(32, &value);
+  size_t header_length = reader.Finish();
+  if (header_length == 0 || header_length == kMalformedHeader) {
+    return header_length;
+  }
+  *body_length = value;
+  return header_length;
+}
+}  // namespace oldisim
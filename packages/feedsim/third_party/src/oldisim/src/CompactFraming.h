@@ -0,0 +1,95 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "oldisim/Query.h"
+#include "oldisim/Response.h"
+
+namespace oldisim {
+
+/**
+ * Encoding of compact frames, see Framing.
+ *
+ * A compact frame starts with a marker byte whose low bits flag the
+ * optional header fields that follow the type, request id and payload
+ * length, all as little-endian base 128 varints. Fixed frames start with
+ * the high byte of their type, so types 0xc0000000 to 0xcfffffff are
+ * reserved. A batch frame is a marker followed by the varint length of
+ * the compact query frames it carries.
+ *
+ * The hello is a fixed query, and its acknowledgement a fixed response,
+ * both of kHelloType with kHelloMagic as their request id.
+ */
+class CompactFraming {
+ public:
+  static const uint32_t kHelloType = 0xffffffff;
+  static const uint64_t kHelloMagic = 0x4f4c44495632ULL;  // "OLDIV2"
+
+  static const uint8_t kMarker = 0xc0;
+  static const uint8_t kMarkerMask = 0xf0;
+  // Optional query fields
+  static const uint8_t kQueryStartTime = 0x01;
+  static const uint8_t kQueryPriority = 0x02;
+  static const uint8_t kQueryDeadline = 0x04;
+  static const uint8_t kBatch = 0x08;
+  // Optional response fields
+  static const uint8_t kResponseStartTime = 0x01;
+  static const uint8_t kResponseProcessingTime = 0x02;
+  static const uint8_t kResponseStatus = 0x04;
+  // Free for responses since they are never batched
+  static const uint8_t kResponseQueueTime = 0x08;
+
+  // Marker, type, request id, payload length, start, processing and queue
+  // time and status of a response, the longest header
+  static const size_t kMaxHeaderLength = 1 + 5 + 10 + 5 + 10 + 10 + 10 + 5;
+  // Returned by the decoders for a header that can never be complete
+  static const size_t kMalformedHeader = static_cast<size_t>(-1);
+
+  static bool IsCompactFrame(uint8_t first_byte) {
+    return (first_byte & kMarkerMask) == kMarker;
+  }
+
+  static bool IsBatchFrame(uint8_t first_byte) {
+    return first_byte == (kMarker | kBatch);
+  }
+
+  /**
+   * Write the compact header of a query or response given in host byte
+   * order to out, which must hold kMaxHeaderLength bytes. Returns its length.
+   */
+  static size_t EncodeQueryHeader(const QueryPacketHeader& header,
+                                  uint8_t* out);
+  static size_t EncodeResponseHeader(const ResponsePacketHeader& header,
+                                     uint8_t* out);
+  static size_t EncodeBatchHeader(uint32_t body_length, uint8_t* out);
+
+  /**
+   * Read a compact header from the length bytes at data into header, in
+   * host byte order. Returns the header length, 0 if data ends before the
+   * header does, or kMalformedHeader if a varint is longer than its field
+   * allows or does not fit in it. Fields without a flag are left at 0.
+   */
+  static size_t DecodeQueryHeader(const uint8_t* data, size_t length,
+                                  QueryPacketHeader* header);
+  static size_t DecodeResponseHeader(const uint8_t* data, size_t length,
+                                     ResponsePacketHeader* header);
+  static size_t DecodeBatchHeader(const uint8_t* data, size_t length,
+                                  uint32_t* body_length);
+};
+}  // namespace oldisim
@@ -14,24 +14,50 @@
 
 #include "ConnectionUtil.h"
 
+#include <errno.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
 #include <memory>
 #include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "ChildConnectionImpl.h"
 #include "ConnectionUtil.h"
+#include "IoUringEngine.h"
+#include "LocalTransport.h"
 #include "ParentConnectionImpl.h"
+#include "RxTimestamper.h"
+#include "TlsTransport.h"
 #include "oldisim/ChildConnectionStats.h"
+#include "oldisim/EventLoop.h"
+#include "oldisim/IoEngine.h"
 #include "oldisim/LeafNodeStats.h"
 #include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
 #include "oldisim/Query.h"
+#include "oldisim/StatsLog.h"
+#include "oldisim/Tls.h"
+
+// From <asm-generic/socket.h> on kernels newer than some libc headers
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
 
 namespace oldisim {
 
@@ -39,30 +65,48 @@ std::unique_ptr<ParentConnection> ConnectionUtil::MakeParentConnection(
     const ParentConnectionReceivedCallback& request_handler,
     const ParentConnection::ParentConnectionImpl::ClosedCallback& close_handler,
     const NodeThread& node_thread, int socket_fd, bool store_queries,
-    bool use_locking) {
+    bool cross_thread_responses, int flush_budget_us,
+    bool segmented_payloads) {
   typedef ParentConnection::ParentConnectionImpl ParentConnectionImpl;
 
-  // Set socket to send without delay
-  int optval = 1;
-  if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &optval,
-                 sizeof(optval))) {
-    DIE("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
-  }
-  evutil_make_socket_nonblocking(socket_fd);
-
   // Create buffer event for connection, associate it with an event base for
-  // a thread
-  int locking_opts = 0;
-  if (use_locking) {
-    locking_opts = BEV_OPT_THREADSAFE;
+  // a thread. Local transport clients say which transport they want first.
+  bufferevent* bev;
+  std::unique_ptr<RxTimestamper> rx_timestamper;
+  if (IsLocalSocket(socket_fd)) {
+    bev = AcceptLocal(node_thread.get_event_base(), socket_fd,
+                      BEV_OPT_CLOSE_ON_FREE);
+    if (bev == nullptr) {
+      return nullptr;
+    }
+  } else {
+    // Set socket to send without delay
+    int optval = 1;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &optval,
+                   sizeof(optval))) {
+      DIE("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
+    }
+    SetBusyPollSocketOptions(socket_fd);
+    evutil_make_socket_nonblocking(socket_fd);
+    if (IsTlsEnabled()) {
+      bev = TlsBuffereventNew(node_thread.get_event_base(), socket_fd, true,
+                              BEV_OPT_CLOSE_ON_FREE);
+      if (bev == nullptr) {
+        return nullptr;
+      }
+    } else {
+      bev = NewSocketBufferevent(node_thread.get_event_base(), socket_fd,
+                                 BEV_OPT_CLOSE_ON_FREE);
+    }
+    rx_timestamper =
+        RxTimestamper::Create(node_thread.get_event_base(), socket_fd);
   }
-  bufferevent* const bev =
-      bufferevent_socket_new(node_thread.get_event_base(), socket_fd,
-                             BEV_OPT_CLOSE_ON_FREE | locking_opts);
 
   // Construct implementation details and connection
   std::unique_ptr<ParentConnectionImpl> impl(new ParentConnectionImpl(
-      request_handler, close_handler, bev, use_locking));
+      request_handler, close_handler, bev, cross_thread_responses,
+      flush_budget_us, segmented_payloads));
+  impl->rx_timestamper = std::move(rx_timestamper);
   std::unique_ptr<ParentConnection> conn(new ParentConnection(std::move(impl)));
 
   // Set handlers for event base now that ParentConnection is constructed
@@ -73,11 +117,68 @@ std::unique_ptr<ParentConnection> ConnectionUtil::MakeParentConnection(
   return std::move(conn);
 }
 
+void ConnectionUtil::AwaitParentConnection(
+    const NodeThread& node_thread, int socket_fd,
+    std::function<void(int)> on_ready) {
+  if (IsLocalSocket(socket_fd)) {
+    AwaitLocalHello(node_thread.get_event_base(), socket_fd,
+                    std::move(on_ready));
+  } else {
+    on_ready(socket_fd);
+  }
+}
+
 void ConnectionUtil::EnableParentConnection(ParentConnection& connection) {
   typedef ParentConnection::ParentConnectionImpl ParentConnectionImpl;
 
   connection.impl_->read_state = ParentConnectionImpl::ReadState::WAITING;
   bufferevent_enable(connection.impl_->bev, EV_READ | EV_WRITE);
+  if (connection.impl_->rx_timestamper != nullptr) {
+    connection.impl_->rx_timestamper->Start();
+  }
+}
+
+bufferevent* ConnectionUtil::NewSocketBufferevent(event_base* base,
+                                                 int socket_fd, int options) {
+  if (GetIoEngine() == IoEngine::kIoUring) {
+    return IoUringBuffereventNew(base, socket_fd, options);
+  }
+  return bufferevent_socket_new(base, socket_fd, options);
+}
+
+void ConnectionUtil::FreeSocketBufferevent(bufferevent* bev) {
+  if (!IoUringBuffereventFree(bev) && !SharedMemoryBuffereventFree(bev)) {
+    bufferevent_free(bev);
+  }
+}
+
+void ConnectionUtil::SetBusyPollSocketOptions(int socket_fd) {
+  if (GetEventLoopMode() != EventLoopMode::kBusyPoll) {
+    return;
+  }
+  const BusyPollOptions& options = GetBusyPollOptions();
+  if (options.socket_busy_poll_us == 0) {
+    return;
+  }
+
+  // Warn once per process rather than once per connection
+  static bool warned = false;
+  int busy_poll_us = options.socket_busy_poll_us;
+  if (setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us,
+                 sizeof(busy_poll_us)) < 0 &&
+      !warned) {
+    W("setsockopt(SO_BUSY_POLL, %d) failed: %s", busy_poll_us,
+      strerror(errno));
+    warned = true;
+  }
+  int prefer = 1;
+  if (options.prefer_busy_poll &&
+      setsockopt(socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                 sizeof(prefer)) < 0 &&
+      !warned) {
+    W("setsockopt(SO_PREFER_BUSY_POLL) failed: %s", strerror(errno));
+    warned = true;
+  }
 }
 
 std::unique_ptr<ChildConnection> ConnectionUtil::MakeChildConnection(
@@ -85,29 +186,97 @@ std::unique_ptr<ChildConnection> ConnectionUtil::MakeChildConnection(
     const ChildConnection::ChildConnectionImpl::ClosedCallback& close_handler,
     const NodeThread& node_thread, const addrinfo* address,
     ChildConnectionStats& thread_conn_stats, bool store_queries,
-    bool no_delay) {
+    bool no_delay, bool segmented_payloads, Transport transport,
+    Framing framing, bool shared_buffers) {
   typedef ChildConnection::ChildConnectionImpl ChildConnectionImpl;
 
   // Construct implemntation details and connection
   std::unique_ptr<ChildConnectionImpl> impl(new ChildConnectionImpl(
       response_handler, close_handler, node_thread.get_event_base(), address,
-      thread_conn_stats, store_queries, no_delay));
+      thread_conn_stats, store_queries, no_delay, segmented_payloads,
+      transport, framing, shared_buffers));
   std::unique_ptr<ChildConnection> conn(new ChildConnection(std::move(impl)));
 
   // Set handlers for event base now that ParentConnection is constructed
-  bufferevent_setcb(conn->impl_->bev_, ChildConnectionImpl::bev_read_cb, NULL,
-                    ChildConnectionImpl::bev_event_cb, conn.get());
-  bufferevent_enable(conn->impl_->bev_, EV_READ | EV_WRITE);
-  bufferevent_setwatermark(conn->impl_->bev_, EV_READ,
-                           sizeof(ResponsePacketHeader), 0);
+  if (shared_buffers) {
+    ChildConnectionImpl& conn_impl = *conn->impl_;
+    conn_impl.read_event_ =
+        event_new(node_thread.get_event_base(), conn_impl.fd_,
+                  EV_READ | EV_PERSIST, ChildConnectionImpl::SharedReadCallback,
+                  conn.get());
+    conn_impl.write_event_ = event_new(
+        node_thread.get_event_base(), conn_impl.fd_, EV_WRITE | EV_PERSIST,
+        ChildConnectionImpl::SharedWriteCallback, conn.get());
+    event_add(conn_impl.read_event_, nullptr);
+  } else {
+    bufferevent_setcb(conn->impl_->bev_, ChildConnectionImpl::bev_read_cb,
+                      NULL, ChildConnectionImpl::bev_event_cb, conn.get());
+    bufferevent_enable(conn->impl_->bev_, EV_READ | EV_WRITE);
+    bufferevent_setwatermark(conn->impl_->bev_, EV_READ,
+                             sizeof(ResponsePacketHeader), 0);
+  }
+  if (conn->impl_->rx_timestamper_ != nullptr) {
+    conn->impl_->rx_timestamper_->Start();
+  }
+  if (framing != Framing::kFixed) {
+    conn->impl_->SendHello();
+  }
 
   return std::move(conn);
 }
 
+int64_t ConnectionUtil::GetPeakPrivateChildBuffers() {
+  return ChildConnection::ChildConnectionImpl::peak_private_buffers.load();
+}
+
+void* ConnectionUtil::PeekPayload(evbuffer* input, size_t length,
+                                  bool segmented,
+                                  std::vector<iovec>* segments) {
+  int num_chains = 0;
+  if (segmented && length > 0) {
+    num_chains = evbuffer_peek(input, length, nullptr, nullptr, 0);
+  }
+  if (num_chains <= 1) {
+    void* payload = evbuffer_pullup(input, length);
+    segments->resize(1);
+    (*segments)[0].iov_base = payload;
+    (*segments)[0].iov_len = length;
+    return payload;
+  }
+
+  // evbuffer_iovec has the same layout as iovec, but peek fills in whole
+  // chains, so trim the last one to the end of the payload
+  segments->resize(num_chains);
+  evbuffer_peek(input, length, nullptr,
+                reinterpret_cast<evbuffer_iovec*>(segments->data()),
+                num_chains);
+  size_t remaining = length;
+  for (auto& segment : *segments) {
+    segment.iov_len = std::min(segment.iov_len, remaining);
+    remaining -= segment.iov_len;
+  }
+  return nullptr;
+}
+
+const void* ConnectionUtil::LinearizePayload(const iovec* segments,
+                                             int num_segments, size_t length,
+                                             std::vector<char>* buffer) {
+  if (buffer->size() < length) {
+    buffer->resize(length);
+  }
+  char* dest = buffer->data();
+  for (int i = 0; i < num_segments; i++) {
+    memcpy(dest, segments[i].iov_base, segments[i].iov_len);
+    dest += segments[i].iov_len;
+  }
+  return buffer->data();
+}
+
 std::map<uint32_t, std::map<std::string, double>>
 ConnectionUtil::MakeChildConnectionStatsMap(const ChildConnectionStats& stats,
                                             double elapsed_time) {
-  // Return QPS, RX BW, TX BW, mean, 50%, 90%, 95%, 99% latencies
+  // Return QPS, RX BW, TX BW, mean, 50%, 90%, 95%, 99% latencies, and the
+  // mean, 50% and 99% of their network, queue and service parts
   std::map<uint32_t, std::map<std::string, double>> results;
   // Create stats for each query type
   for (const auto& sampler_pair : stats.query_samplers_) {
@@ -121,7 +290,40 @@ ConnectionUtil::MakeChildConnectionStatsMap(const ChildConnectionStats& stats,
     double latency_90p = stats.query_samplers_.at(type).get_nth(90) / 1000000;
     double latency_95p = stats.query_samplers_.at(type).get_nth(95) / 1000000;
     double latency_99p = stats.query_samplers_.at(type).get_nth(99) / 1000000;
+    // Latency decomposition, see ChildConnectionStats
+    const HdrHistogram& network = stats.query_network_time_samplers_.at(type);
+    const HdrHistogram& queue = stats.query_queue_time_samplers_.at(type);
+    const HdrHistogram& service = stats.query_service_time_samplers_.at(type);
+    double network_mean = network.average() / 1000000;
+    double network_50p = network.get_nth(50) / 1000000;
+    double network_99p = network.get_nth(99) / 1000000;
+    double queue_mean = queue.average() / 1000000;
+    double queue_50p = queue.get_nth(50) / 1000000;
+    double queue_99p = queue.get_nth(99) / 1000000;
+    double service_mean = service.average() / 1000000;
+    double service_50p = service.get_nth(50) / 1000000;
+    double service_99p = service.get_nth(99) / 1000000;
     double dropped_requests = stats.dropped_requests_.at(type) / elapsed_time;
+    double late_requests = stats.late_requests_.at(type) / elapsed_time;
+    double abandoned_requests =
+        stats.abandoned_requests_.at(type) / elapsed_time;
+    double rejected_requests = stats.rejected_requests_.at(type) / elapsed_time;
+    double expired_requests = stats.expired_requests_.at(type) / elapsed_time;
+    // Credit window queueing, see FanoutManager::SetCreditWindow
+    uint64_t queued = stats.queued_requests_.at(type);
+    double queued_requests = queued / elapsed_time;
+    double queue_wait_mean =
+        queued > 0 ? stats.queue_wait_ns_.at(type) / 1000000.0 / queued : 0.0;
+    double throttled_requests =
+        stats.throttled_requests_.at(type) / elapsed_time;
+    // Hedge rate is per original request, win rate per backup request
+    uint64_t hedged = stats.hedged_requests_.at(type);
+    uint64_t originals = stats.query_counts_.at(type) - hedged;
+    double hedge_rate =
+        originals > 0 ? static_cast<double>(hedged) / originals : 0.0;
+    double hedge_win_rate =
+        hedged > 0 ? static_cast<double>(stats.hedge_wins_.at(type)) / hedged
+                   : 0.0;
     results.insert(
         std::make_pair(type, std::map<std::string, double>(
                                  {{"qps", qps},
@@ -132,7 +334,27 @@ ConnectionUtil::MakeChildConnectionStatsMap(const ChildConnectionStats& stats,
                                   {"latency_90p", latency_90p},
                                   {"latency_95p", latency_95p},
                                   {"latency_99p", latency_99p},
-                                  {"dropped_requests", dropped_requests}})));
+                                  {"network_mean", network_mean},
+                                  {"network_50p", network_50p},
+                                  {"network_99p", network_99p},
+                                  {"queue_mean", queue_mean},
+                                  {"queue_50p", queue_50p},
+                                  {"queue_99p", queue_99p},
+                                  {"service_mean", service_mean},
+                                  {"service_50p", service_50p},
+                                  {"service_99p", service_99p},
+                                  {"dropped_requests", dropped_requests},
+                                  {"late_requests", late_requests},
+                                  {"abandoned_requests", abandoned_requests},
+                                  {"rejected_requests", rejected_requests},
+                                  {"expired_requests", expired_requests},
+                                  {"credit_window",
+                                   static_cast<double>(stats.credit_window_)},
+                                  {"queued_requests", queued_requests},
+                                  {"queue_wait_mean", queue_wait_mean},
+                                  {"throttled_requests", throttled_requests},
+                                  {"hedge_rate", hedge_rate},
+                                  {"hedge_win_rate", hedge_win_rate}})));
   }
 
   return results;
@@ -141,13 +363,16 @@ ConnectionUtil::MakeChildConnectionStatsMap(const ChildConnectionStats& stats,
 std::map<uint32_t, std::map<std::string, double>>
 ConnectionUtil::MakeLeafNodeStatsMap(const LeafNodeStats& stats,
                                      double elapsed_time) {
-  // Return QPS, RX BW, TX BW, mean, 50%, 90%, 95%, 99% latencies
+  // Return QPS, expired and rejected QPS, RX BW, TX BW, mean, 50%, 90%,
+  // 95%, 99% latencies
   std::map<uint32_t, std::map<std::string, double>> results;
   // Create stats for each query type
   for (const auto& sampler_pair : stats.processing_time_samplers_) {
     uint32_t type = sampler_pair.first;
     auto& sampler = sampler_pair.second;
     double qps = stats.query_counts_.at(type) / elapsed_time;
+    double expired_qps = stats.expired_counts_.at(type) / elapsed_time;
+    double rejected_qps = stats.rejected_counts_.at(type) / elapsed_time;
     double rx_mbps = stats.rx_bytes_.at(type) / elapsed_time / 1024 / 1024;
     double tx_mbps = stats.tx_bytes_.at(type) / elapsed_time / 1024 / 1024;
     double latency_mean =
@@ -162,6 +387,8 @@ ConnectionUtil::MakeLeafNodeStatsMap(const LeafNodeStats& stats,
         stats.processing_time_samplers_.at(type).get_nth(99) / 1000000;
     results.insert(std::make_pair(
         type, std::map<std::string, double>({{"qps", qps},
+                                             {"expired_qps", expired_qps},
+                                             {"rejected_qps", rejected_qps},
                                              {"rx_mbps", rx_mbps},
                                              {"tx_mbps", tx_mbps},
                                              {"latency_mean", latency_mean},
@@ -173,5 +400,290 @@ ConnectionUtil::MakeLeafNodeStatsMap(const LeafNodeStats& stats,
 
   return results;
 }
+
+void ConnectionUtil::AddChildConnectionStatsToLog(
+    StatsLogWriter& log, const std::string& prefix,
+    const ChildConnectionStats& stats) {
+  for (const auto& count : stats.query_counts_) {
+    uint32_t type = count.first;
+    const std::string name = prefix + "type" + std::to_string(type) + ".";
+    log.AddCounter(name + "requests", count.second);
+    log.AddCounter(name + "tx_bytes", stats.tx_bytes_.at(type));
+    log.AddCounter(name + "rx_bytes", stats.rx_bytes_.at(type));
+    log.AddCounter(name + "dropped", stats.dropped_requests_.at(type));
+    log.AddCounter(name + "late", stats.late_requests_.at(type));
+    log.AddCounter(name + "schedule_slip_ns", stats.schedule_slip_ns_.at(type));
+    log.AddCounter(name + "hedged", stats.hedged_requests_.at(type));
+    log.AddCounter(name + "hedge_wins", stats.hedge_wins_.at(type));
+    log.AddCounter(name + "abandoned", stats.abandoned_requests_.at(type));
+    log.AddCounter(name + "rejected", stats.rejected_requests_.at(type));
+    log.AddCounter(name + "expired", stats.expired_requests_.at(type));
+    log.AddCounter(name + "queued", stats.queued_requests_.at(type));
+    log.AddCounter(name + "queue_wait_ns", stats.queue_wait_ns_.at(type));
+    log.AddCounter(name + "throttled", stats.throttled_requests_.at(type));
+    log.AddHistogram(name + "latency", stats.query_samplers_.at(type));
+    log.AddHistogram(name + "processing_time",
+                     stats.query_processing_time_samplers_.at(type));
+    log.AddHistogram(name + "network_time",
+                     stats.query_network_time_samplers_.at(type));
+    log.AddHistogram(name + "queue_time",
+                     stats.query_queue_time_samplers_.at(type));
+    log.AddHistogram(name + "service_time",
+                     stats.query_service_time_samplers_.at(type));
+  }
+}
+
+void ConnectionUtil::AddLeafNodeStatsToLog(StatsLogWriter& log,
+                                           const LeafNodeStats& stats) {
+  for (const auto& count : stats.query_counts_) {
+    uint32_t type = count.first;
+    const std::string name = "type" + std::to_string(type) + ".";
+    log.AddCounter(name + "queries", count.second);
+    log.AddCounter(name + "responses", stats.response_counts_.at(type));
+    log.AddCounter(name + "tx_bytes", stats.tx_bytes_.at(type));
+    log.AddCounter(name + "rx_bytes", stats.rx_bytes_.at(type));
+    log.AddCounter(name + "expired", stats.expired_counts_.at(type));
+    log.AddCounter(name + "rejected", stats.rejected_counts_.at(type));
+    log.AddHistogram(name + "processing_time",
+                     stats.processing_time_samplers_.at(type));
+  }
+}
+
+std::string ConnectionUtil::EncodeChildConnectionStats(
+    const ChildConnectionStats& stats) {
+  std::ostringstream out;
+  out << stats.query_counts_.size();
+  for (const auto& count : stats.query_counts_) {
+    out << ' ' << count.first;
+  }
+  out << ' ' << stats.credit_window_ << '\n';
+  for (const auto& count : stats.query_counts_) {
+    uint32_t type = count.first;
+    out << count.second << ' ' << stats.tx_bytes_.at(type) << ' '
+        << stats.rx_bytes_.at(type) << ' ' << stats.dropped_requests_.at(type)
+        << ' ' << stats.late_requests_.at(type) << ' '
+        << stats.schedule_slip_ns_.at(type) << ' '
+        << stats.hedged_requests_.at(type) << ' ' << stats.hedge_wins_.at(type)
+        << ' ' << stats.abandoned_requests_.at(type) << ' '
+        << stats.rejected_requests_.at(type) << ' '
+        << stats.expired_requests_.at(type) << ' '
+        << stats.queued_requests_.at(type) << ' '
+        << stats.queue_wait_ns_.at(type) << ' '
+        << stats.throttled_requests_.at(type) << '\n';
+    stats.query_samplers_.at(type).Encode(out);
+    stats.query_processing_time_samplers_.at(type).Encode(out);
+    stats.query_network_time_samplers_.at(type).Encode(out);
+    stats.query_queue_time_samplers_.at(type).Encode(out);
+    stats.query_service_time_samplers_.at(type).Encode(out);
+  }
+  return out.str();
+}
+
+std::unique_ptr<ChildConnectionStats>
+ConnectionUtil::DecodeChildConnectionStats(std::istream& input) {
+  size_t num_types;
+  if (!(input >> num_types)) {
+    return nullptr;
+  }
+  std::set<uint32_t> types;
+  for (size_t i = 0; i < num_types; i++) {
+    uint32_t type;
+    if (!(input >> type)) {
+      return nullptr;
+    }
+    types.insert(type);
+  }
+
+  std::unique_ptr<ChildConnectionStats> stats(new ChildConnectionStats(types));
+  if (!(input >> stats->credit_window_)) {
+    return nullptr;
+  }
+  for (uint32_t type : types) {
+    if (!(input >> stats->query_counts_[type] >> stats->tx_bytes_[type] >>
+          stats->rx_bytes_[type] >> stats->dropped_requests_[type] >>
+          stats->late_requests_[type] >> stats->schedule_slip_ns_[type] >>
+          stats->hedged_requests_[type] >> stats->hedge_wins_[type] >>
+          stats->abandoned_requests_[type] >>
+          stats->rejected_requests_[type] >> stats->expired_requests_[type] >>
+          stats->queued_requests_[type] >> stats->queue_wait_ns_[type] >>
+          stats->throttled_requests_[type]) ||
+        !stats->query_samplers_[type].Decode(input) ||
+        !stats->query_processing_time_samplers_[type].Decode(input) ||
+        !stats->query_network_time_samplers_[type].Decode(input) ||
+        !stats->query_queue_time_samplers_[type].Decode(input) ||
+        !stats->query_service_time_samplers_[type].Decode(input)) {
+      return nullptr;
+    }
+  }
+  return stats;
+}
+
+void ConnectionUtil::PrintChildConnectionStats(
+    const ChildConnectionStats& stats, double elapsed_time) {
+  for (const auto& sampler_pair : stats.query_samplers_) {
+    uint32_t type = sampler_pair.first;
+    const HdrHistogram& sampler = sampler_pair.second;
+    printf("Stats for node under test, type %d\n", type);
+    printf("   RX: %.2f MB/sec (%lu bytes)\n",
+           stats.rx_bytes_.at(type) / elapsed_time / 1024 / 1024,
+           stats.rx_bytes_.at(type));
+    printf("   TX: %.2f MB/sec (%lu bytes)\n",
+           stats.tx_bytes_.at(type) / elapsed_time / 1024 / 1024,
+           stats.tx_bytes_.at(type));
+    printf("    #: %.2f QPS (%lu queries)\n",
+           stats.query_counts_.at(type) / elapsed_time,
+           stats.query_counts_.at(type));
+    printf("  min: %.3f ms\n", sampler.minimum() / 1000000);
+    printf("  avg: %.3f ms\n", sampler.average() / 1000000);
+    printf("  50p: %.3f ms\n", sampler.get_nth(50) / 1000000);
+    printf("  90p: %.3f ms\n", sampler.get_nth(90) / 1000000);
+    printf("  95p: %.3f ms\n", sampler.get_nth(95) / 1000000);
+    printf("  99p: %.3f ms\n", sampler.get_nth(99) / 1000000);
+    printf("  99.9p: %.3f ms\n", sampler.get_nth(99.9) / 1000000);
+    printf("  max: %.3f ms\n", sampler.maximum() / 1000000);
+    static const char* kParts[] = {"network", "queue", "service"};
+    const HdrHistogram* parts[] = {
+        &stats.query_network_time_samplers_.at(type),
+        &stats.query_queue_time_samplers_.at(type),
+        &stats.query_service_time_samplers_.at(type)};
+    for (int i = 0; i < 3; i++) {
+      printf("  %s: %.3f ms avg, %.3f ms 50p, %.3f ms 99p\n", kParts[i],
+             parts[i]->average() / 1000000, parts[i]->get_nth(50) / 1000000,
+             parts[i]->get_nth(99) / 1000000);
+    }
+    uint64_t late_requests = stats.late_requests_.at(type);
+    if (late_requests > 0) {
+      printf("  late: %lu queries, %.3f ms mean slip\n", late_requests,
+             static_cast<double>(stats.schedule_slip_ns_.at(type)) /
+                 late_requests / 1000000);
+    }
+    uint64_t shed_requests =
+        stats.rejected_requests_.at(type) + stats.expired_requests_.at(type);
+    if (shed_requests > 0) {
+      printf("  shed: %lu rejected, %lu expired (%.2f QPS)\n",
+             stats.rejected_requests_.at(type),
+             stats.expired_requests_.at(type), shed_requests / elapsed_time);
+    }
+    uint64_t queued_requests = stats.queued_requests_.at(type);
+    uint64_t throttled_requests = stats.throttled_requests_.at(type);
+    if (queued_requests > 0 || throttled_requests > 0) {
+      printf("  credit window %lu: %lu queued, %.3f ms mean wait, "
+             "%lu throttled\n",
+             stats.credit_window_, queued_requests,
+             queued_requests > 0 ? static_cast<double>(
+                                       stats.queue_wait_ns_.at(type)) /
+                                       queued_requests / 1000000
+                                 : 0.0,
+             throttled_requests);
+    }
+  }
+}
+
+void ConnectionUtil::WriteHistogramOutputFiles(
+    const ChildConnectionStats& stats, const std::string& path) {
+  for (const auto& sampler_pair : stats.query_samplers_) {
+    std::string type_path = path;
+    if (stats.query_samplers_.size() > 1) {
+      type_path += "." + std::to_string(sampler_pair.first);
+    }
+    std::ofstream out(type_path);
+    if (!out) {
+      W("Could not open histogram output file %s", type_path.c_str());
+      continue;
+    }
+    sampler_pair.second.OutputPercentileDistribution(out, 1000000);
+  }
+}
+
+int ConnectionUtil::ListenAnyAddress(uint16_t port, bool reuse_port,
+                                     int backlog) {
+  sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  socklen_t length;
+
+  // IPv6 sockets take IPv4 connections on mapped addresses too, where the
+  // host has IPv6 at all
+  int listener = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listener >= 0) {
+    int zero = 0;
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&address);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    sin6->sin6_port = htons(port);
+    length = sizeof(*sin6);
+  } else {
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0) {
+      DIE("socket failed: %s", strerror(errno));
+    }
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&address);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_ANY);
+    sin->sin_port = htons(port);
+    length = sizeof(*sin);
+  }
+
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (reuse_port &&
+      setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    DIE("SO_REUSEPORT failed: %s", strerror(errno));
+  }
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address), length) < 0) {
+    DIE("bind failed: %s", strerror(errno));
+  }
+  if (listen(listener, backlog) < 0) {
+    DIE("listen failed: %s", strerror(errno));
+  }
+  return listener;
+}
+
+int ConnectionUtil::ListenReusePort(uint16_t port) {
+  // Each socket only takes its share of a connection storm, but give it the
+  // full system backlog anyway
+  return ListenAnyAddress(port, true, SOMAXCONN);
+}
+
+bool ConnectionUtil::SteerReusePortByCpu(int fd, const std::vector<int>& cpus) {
+  // Compare the receiving CPU against every pinned socket owner in turn
+  std::vector<sock_filter> program;
+  program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                             static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] >= 0) {
+      program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                 static_cast<uint32_t>(cpus[i]), 0, 1));
+      program.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+    }
+  }
+  program.push_back(
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(cpus.size())));
+  program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+  if (cpus.empty() || program.size() > BPF_MAXINSNS) {
+    return false;
+  }
+
+  sock_fprog fprog;
+  fprog.len = program.size();
+  fprog.filter = program.data();
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog,
+                    sizeof(fprog)) == 0;
+}
+
+void ConnectionUtil::AcceptConnections(
+    int listener, int max_accepts, const std::function<void(int)>& on_accept) {
+  for (int i = 0; i < max_accepts; i++) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      // Only a drained backlog is expected, anything else is worth a note
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        W("accept failed: %s", strerror(errno));
+      }
+      return;
+    }
+    on_accept(fd);
+  }
+}
 }  // namespace oldisim
 
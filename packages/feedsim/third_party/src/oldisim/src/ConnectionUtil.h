@@ -17,22 +17,28 @@
 #include <netdb.h>
 #include <event2/event.h>
 
+#include <functional>
+#include <istream>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "oldisim/Callbacks.h"
 #include "oldisim/ChildConnection.h"
 #include "ChildConnectionImpl.h"
+#include "oldisim/Framing.h"
 #include "oldisim/ParentConnection.h"
+#include "oldisim/Transport.h"
 #include "ParentConnectionImpl.h"
 
 namespace oldisim {
 
 class ChildConnectionStats;
 class LeafNodeStats;
+class StatsLogWriter;
 
 class ConnectionUtil {
  public:
@@ -54,20 +60,131 @@ class ConnectionUtil {
       const ChildConnection::ChildConnectionImpl::ClosedCallback& close_handler,
       const NodeThread& node_thread, const addrinfo* address,
       ChildConnectionStats& thread_conn_stats, bool store_queries,
-      bool no_delay);
+      bool no_delay, bool segmented_payloads = false,
+      Transport transport = Transport::kTcp,
+      Framing framing = Framing::kFixed, bool shared_buffers = false);
 
+  // Most receive and send buffers of their own the child connections with
+  // shared buffers held at once
+  static int64_t GetPeakPrivateChildBuffers();
+
+  // Returns nullptr, having closed socket_fd, if a local transport or TLS
+  // client fails its handshake. Must be called on node_thread. Set
+  // cross_thread_responses if queries may be answered on other threads.
   static std::unique_ptr<ParentConnection> MakeParentConnection(
       const ParentConnectionReceivedCallback& request_handler,
       const ParentConnection::ParentConnectionImpl::ClosedCallback&
           close_handler,
       const NodeThread& node_thread, int socket_fd, bool store_queries,
-      bool use_locking);
+      bool cross_thread_responses, int flush_budget_us = -1,
+      bool segmented_payloads = false);
   static void EnableParentConnection(ParentConnection& connection);
+  /**
+   * Hand the accepted socket_fd to on_ready once MakeParentConnection can
+   * take it without blocking: right away for TCP, and once its hello has
+   * arrived for a local transport client. Must be called on node_thread.
+   */
+  static void AwaitParentConnection(const NodeThread& node_thread,
+                                    int socket_fd,
+                                    std::function<void(int)> on_ready);
+
+  /**
+   * Describe the first length bytes of input in segments, reusing its
+   * storage. Returns them as contiguous bytes, linearizing input if needed,
+   * unless segmented is set and they span several chains, in which case it
+   * returns nullptr and leaves input untouched.
+   */
+  static void* PeekPayload(evbuffer* input, size_t length, bool segmented,
+                           std::vector<iovec>* segments);
+  /**
+   * Copy segments holding length bytes into buffer, which is grown as needed
+   * and reused across calls, and return its contents
+   */
+  static const void* LinearizePayload(const iovec* segments, int num_segments,
+                                      size_t length,
+                                      std::vector<char>* buffer);
+
+  /**
+   * Make and free the bufferevent of a connected socket using the I/O
+   * engine selected with SetIoEngine
+   */
+  static bufferevent* NewSocketBufferevent(event_base* base, int socket_fd,
+                                           int options);
+  static void FreeSocketBufferevent(bufferevent* bev);
+
+  /**
+   * Set the socket busy polling options selected with SetEventLoopMode on a
+   * TCP socket, if any. Failures only warn, since raising SO_BUSY_POLL past
+   * net.core.busy_read needs privileges.
+   */
+  static void SetBusyPollSocketOptions(int socket_fd);
+
+  /**
+   * Open a non-blocking socket listening on port on all IPv6 and IPv4
+   * addresses, or all IPv4 addresses if the host has no IPv6, with
+   * SO_REUSEPORT if reuse_port is set. Failing to listen is fatal.
+   */
+  static int ListenAnyAddress(uint16_t port, bool reuse_port, int backlog);
+  /**
+   * Listen on port on all addresses with SO_REUSEPORT, so several threads
+   * can each listen on their own socket and the kernel spreads incoming
+   * connections across them
+   */
+  static int ListenReusePort(uint16_t port);
+  /**
+   * Steer the connections of the SO_REUSEPORT group that fd belongs to by
+   * the CPU that received them: cpus[i] is the CPU the owner of the i-th
+   * socket of the group runs on, -1 if it is not pinned. Connections that
+   * arrive on any other CPU go to socket CPU % group size. Returns false if
+   * the kernel does not take the steering program.
+   */
+  static bool SteerReusePortByCpu(int fd, const std::vector<int>& cpus);
+  /**
+   * Accept up to max_accepts pending connections on a non-blocking
+   * listener and hand each connected socket to on_accept
+   */
+  static void AcceptConnections(int listener, int max_accepts,
+                                const std::function<void(int)>& on_accept);
 
   static std::map<uint32_t, std::map<std::string, double>>
   MakeChildConnectionStatsMap(const ChildConnectionStats& stats,
                               double elapsed_time);
   static std::map<uint32_t, std::map<std::string, double>> MakeLeafNodeStatsMap(
       const LeafNodeStats& stats, double elapsed_time);
+
+  /**
+   * Add stats to the window log is building, as counters and histograms
+   * named prefix + "type<type>." + what they count
+   */
+  static void AddChildConnectionStatsToLog(StatsLogWriter& log,
+                                           const std::string& prefix,
+                                           const ChildConnectionStats& stats);
+  static void AddLeafNodeStatsToLog(StatsLogWriter& log,
+                                    const LeafNodeStats& stats);
+
+  /**
+   * Write stats as text for DecodeChildConnectionStats, with the full
+   * histograms so that stats from several drivers merge exactly
+   */
+  static std::string EncodeChildConnectionStats(
+      const ChildConnectionStats& stats);
+  /**
+   * Read stats written by EncodeChildConnectionStats. Returns nullptr if
+   * the input is malformed.
+   */
+  static std::unique_ptr<ChildConnectionStats> DecodeChildConnectionStats(
+      std::istream& input);
+  /**
+   * Print the end-of-run report of a driver over elapsed_time seconds
+   */
+  static void PrintChildConnectionStats(const ChildConnectionStats& stats,
+                                        double elapsed_time);
+  /**
+   * Write the latency distribution of each request type to path in
+   * HdrHistogram percentile text format, with values in milliseconds. With
+   * several request types, the type is appended as ".<type>".
+   */
+  static void WriteHistogramOutputFiles(const ChildConnectionStats& stats,
+                                        const std::string& path);
 };
 }  // namespace oldisim
@@ -0,0 +1,393 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/DriverCoordinator.h"
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <errno.h>
+#include <event2/http.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "ConnectionUtil.h"
+#include "oldisim/ChildConnectionStats.h"
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+static const int kLiveStatsIntervalSeconds = 1;
+// Registrations are long-polled until the last driver arrives
+static const int kRegisterTimeoutSeconds = 3600;
+
+struct DriverCoordinator::DriverCoordinatorImpl {
+  struct DriverState {
+    // Sum of the windows streamed so far
+    std::unique_ptr<ChildConnectionStats> windows;
+    // Most recent window, for the live summary
+    std::unique_ptr<ChildConnectionStats> last_window;
+    // Final totals, which supersede the windows once reported
+    std::unique_ptr<ChildConnectionStats> totals;
+  };
+
+  uint16_t port;
+  int num_drivers;
+  std::string histogram_output_path;
+
+  event_base* base;
+  evhttp* http;
+  event* live_stats_timer_event;
+
+  std::map<std::string, DriverState> drivers;
+  // Registrations waiting for the start, keyed by their connection so a
+  // driver that goes away before the start can be forgotten
+  std::map<evhttp_connection*, std::pair<std::string, evhttp_request*>>
+      pending_registrations;
+  std::set<uint32_t> request_types;
+  bool started;
+  int num_done;
+  double start_time;
+  double end_time;
+
+  DriverCoordinatorImpl(uint16_t _port, int _num_drivers);
+
+  // Split a request body into the driver name line and the rest
+  static std::string ReadRequest(evhttp_request* req, std::string* body);
+  // Decode stats sent by a registered driver, replying with an error and
+  // returning nullptr if they cannot be used
+  std::unique_ptr<ChildConnectionStats> DecodeDriverStats(
+      evhttp_request* req, const std::string& name, const std::string& body);
+  ChildConnectionStats MergedStats(int* num_reporting) const;
+  void Start();
+  void PrintReport();
+
+  static void RegisterHandler(evhttp_request* req, void* arg);
+  static void SnapshotHandler(evhttp_request* req, void* arg);
+  static void DoneHandler(evhttp_request* req, void* arg);
+  static void RegistrationClosedHandler(evhttp_connection* conn, void* arg);
+  static void LiveStatsTimerHandler(evutil_socket_t listener, int16_t flags,
+                                    void* arg);
+  static void ShutdownHandler(evutil_socket_t listener, int16_t event,
+                              void* arg);
+};
+
+DriverCoordinator::DriverCoordinatorImpl::DriverCoordinatorImpl(
+    uint16_t _port, int _num_drivers)
+    : port(_port),
+      num_drivers(_num_drivers),
+      base(nullptr),
+      http(nullptr),
+      live_stats_timer_event(nullptr),
+      started(false),
+      num_done(0),
+      start_time(0),
+      end_time(0) {}
+
+std::string DriverCoordinator::DriverCoordinatorImpl::ReadRequest(
+    evhttp_request* req, std::string* body) {
+  evbuffer* input = evhttp_request_get_input_buffer(req);
+  std::string contents(evbuffer_get_length(input), '\0');
+  if (!contents.empty()) {
+    evbuffer_copyout(input, &contents[0], contents.size());
+  }
+  size_t newline = contents.find('\n');
+  if (newline == std::string::npos) {
+    body->clear();
+    return contents;
+  }
+  *body = contents.substr(newline + 1);
+  return contents.substr(0, newline);
+}
+
+std::unique_ptr<ChildConnectionStats>
+DriverCoordinator::DriverCoordinatorImpl::DecodeDriverStats(
+    evhttp_request* req, const std::string& name, const std::string& body) {
+  if (!started || drivers.count(name) == 0) {
+    W("Stats from unregistered driver %s", name.c_str());
+    evhttp_send_error(req, HTTP_BADREQUEST, "Driver is not registered");
+    return nullptr;
+  }
+
+  std::istringstream input(body);
+  std::unique_ptr<ChildConnectionStats> stats =
+      ConnectionUtil::DecodeChildConnectionStats(input);
+  if (stats == nullptr) {
+    W("Malformed stats from driver %s", name.c_str());
+    evhttp_send_error(req, HTTP_BADREQUEST, "Malformed stats");
+    return nullptr;
+  }
+
+  // All drivers must run the same workload to be merged
+  std::set<uint32_t> types;
+  for (const auto& count : stats->query_counts_) {
+    types.insert(count.first);
+  }
+  if (request_types.empty()) {
+    request_types = types;
+  } else if (types != request_types) {
+    W("Driver %s sends different request types than the others", name.c_str());
+    evhttp_send_error(req, HTTP_BADREQUEST, "Mismatched request types");
+    return nullptr;
+  }
+  return stats;
+}
+
+ChildConnectionStats DriverCoordinator::DriverCoordinatorImpl::MergedStats(
+    int* num_reporting) const {
+  ChildConnectionStats merged(request_types);
+  *num_reporting = 0;
+  for (const auto& driver : drivers) {
+    const DriverState& state = driver.second;
+    const ChildConnectionStats* stats =
+        state.totals != nullptr ? state.totals.get() : state.windows.get();
+    if (stats != nullptr) {
+      merged.Accumulate(*stats);
+      (*num_reporting)++;
+    }
+  }
+  return merged;
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::Start() {
+  started = true;
+  start_time = GetTimeAccurate();
+  I("All %d drivers registered, starting the run", num_drivers);
+
+  for (const auto& pending : pending_registrations) {
+    evhttp_send_reply(pending.second.second, 200, "OK", nullptr);
+  }
+  pending_registrations.clear();
+
+  timeval t = {kLiveStatsIntervalSeconds, 0};
+  evtimer_add(live_stats_timer_event, &t);
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::PrintReport() {
+  if (request_types.empty()) {
+    W("No stats were received from any driver");
+    return;
+  }
+
+  int num_reporting;
+  ChildConnectionStats merged = MergedStats(&num_reporting);
+  double elapsed_time =
+      (end_time > 0 ? end_time : GetTimeAccurate()) - start_time;
+  printf("Merged stats from %d of %d drivers (%d finished)\n", num_reporting,
+         num_drivers, num_done);
+  ConnectionUtil::PrintChildConnectionStats(merged, elapsed_time);
+
+  if (!histogram_output_path.empty()) {
+    ConnectionUtil::WriteHistogramOutputFiles(merged, histogram_output_path);
+  }
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::RegisterHandler(
+    evhttp_request* req, void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  std::string body;
+  std::string name = ReadRequest(req, &body);
+  if (impl->started) {
+    W("Driver %s registered after the run started", name.c_str());
+    evhttp_send_error(req, HTTP_BADREQUEST, "Run has already started");
+    return;
+  }
+  if (impl->drivers.count(name) > 0) {
+    W("Driver %s registered twice", name.c_str());
+    evhttp_send_error(req, HTTP_BADREQUEST, "Driver is already registered");
+    return;
+  }
+
+  I("Driver %s registered (%zu of %d)", name.c_str(),
+    impl->drivers.size() + 1, impl->num_drivers);
+  impl->drivers[name];
+  evhttp_connection* conn = evhttp_request_get_connection(req);
+  impl->pending_registrations[conn] = std::make_pair(name, req);
+  evhttp_connection_set_closecb(conn, RegistrationClosedHandler, impl);
+
+  if (impl->drivers.size() == static_cast<size_t>(impl->num_drivers)) {
+    impl->Start();
+  }
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::RegistrationClosedHandler(
+    evhttp_connection* conn, void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+  auto pending = impl->pending_registrations.find(conn);
+  if (pending == impl->pending_registrations.end()) {
+    return;
+  }
+
+  W("Driver %s went away before the run started",
+    pending->second.first.c_str());
+  impl->drivers.erase(pending->second.first);
+  impl->pending_registrations.erase(pending);
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::SnapshotHandler(
+    evhttp_request* req, void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+  std::string body;
+  std::string name = ReadRequest(req, &body);
+  std::unique_ptr<ChildConnectionStats> window =
+      impl->DecodeDriverStats(req, name, body);
+  if (window == nullptr) {
+    return;
+  }
+
+  DriverState& state = impl->drivers[name];
+  if (state.windows == nullptr) {
+    state.windows.reset(new ChildConnectionStats(impl->request_types));
+  }
+  state.windows->Accumulate(*window);
+  state.last_window = std::move(window);
+  evhttp_send_reply(req, 200, "OK", nullptr);
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::DoneHandler(evhttp_request* req,
+                                                           void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+  std::string body;
+  std::string name = ReadRequest(req, &body);
+  std::unique_ptr<ChildConnectionStats> totals =
+      impl->DecodeDriverStats(req, name, body);
+  if (totals == nullptr) {
+    return;
+  }
+
+  DriverState& state = impl->drivers[name];
+  if (state.totals == nullptr) {
+    impl->num_done++;
+  }
+  state.totals = std::move(totals);
+  state.last_window.reset();
+  I("Driver %s finished (%d of %d)", name.c_str(), impl->num_done,
+    impl->num_drivers);
+  evhttp_send_reply(req, 200, "OK", nullptr);
+
+  if (impl->num_done == impl->num_drivers) {
+    impl->end_time = GetTimeAccurate();
+    // Leave the loop running briefly so the last reply is flushed
+    timeval t = {0, 100000};
+    event_base_loopexit(impl->base, &t);
+  }
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::LiveStatsTimerHandler(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+
+  if (!impl->request_types.empty()) {
+    ChildConnectionStats window(impl->request_types);
+    int num_running = 0;
+    for (const auto& driver : impl->drivers) {
+      if (driver.second.last_window != nullptr) {
+        window.Accumulate(*driver.second.last_window);
+        num_running++;
+      }
+    }
+    for (const auto& sampler_pair : window.query_samplers_) {
+      uint32_t type = sampler_pair.first;
+      printf("type %d: %.2f QPS, 50p %.3f ms, 99p %.3f ms (%d drivers)\n", type,
+             static_cast<double>(window.query_counts_.at(type)) /
+                 kLiveStatsIntervalSeconds,
+             sampler_pair.second.get_nth(50) / 1000000,
+             sampler_pair.second.get_nth(99) / 1000000, num_running);
+    }
+    fflush(stdout);
+  }
+
+  timeval t = {kLiveStatsIntervalSeconds, 0};
+  evtimer_add(impl->live_stats_timer_event, &t);
+}
+
+void DriverCoordinator::DriverCoordinatorImpl::ShutdownHandler(
+    evutil_socket_t listener, int16_t event, void* arg) {
+  DriverCoordinatorImpl* impl = reinterpret_cast<DriverCoordinatorImpl*>(arg);
+  event_base_loopbreak(impl->base);
+}
+
+/**
+ * Implementation details for DriverCoordinator
+ */
+DriverCoordinator::DriverCoordinator(uint16_t port, int num_drivers)
+    : impl_(new DriverCoordinatorImpl(port, num_drivers)) {
+  if (num_drivers < 1) {
+    DIE("A coordinator needs at least one driver, got %d", num_drivers);
+  }
+  impl_->base = event_base_new();
+  impl_->live_stats_timer_event = evtimer_new(
+      impl_->base, DriverCoordinatorImpl::LiveStatsTimerHandler, impl_.get());
+}
+
+DriverCoordinator::~DriverCoordinator() {
+  event_free(impl_->live_stats_timer_event);
+  if (impl_->http != nullptr) {
+    evhttp_free(impl_->http);
+  }
+  event_base_free(impl_->base);
+}
+
+void DriverCoordinator::SetHistogramOutputFile(const std::string& path) {
+  impl_->histogram_output_path = path;
+}
+
+void DriverCoordinator::Run() {
+  // Ignore SIGPIPE (happens if a driver closes its connection first)
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    DIE("Could not ignore SIGPIPE: %s", strerror(errno));
+  }
+
+  impl_->http = evhttp_new(impl_->base);
+  if (impl_->http == nullptr) {
+    DIE("couldn't create evhttp. Exiting.");
+  }
+  evhttp_set_timeout(impl_->http, kRegisterTimeoutSeconds);
+  evhttp_set_cb(impl_->http, "/register",
+                DriverCoordinatorImpl::RegisterHandler, impl_.get());
+  evhttp_set_cb(impl_->http, "/snapshot",
+                DriverCoordinatorImpl::SnapshotHandler, impl_.get());
+  evhttp_set_cb(impl_->http, "/done", DriverCoordinatorImpl::DoneHandler,
+                impl_.get());
+
+  if (evhttp_bind_socket_with_handle(impl_->http, "::", impl_->port) ==
+          nullptr &&
+      evhttp_bind_socket_with_handle(impl_->http, "0.0.0.0", impl_->port) ==
+          nullptr) {
+    DIE("couldn't bind to port %d. Exiting.\n", impl_->port);
+  }
+
+  // Report whatever has been merged so far on ctrl-c
+  event* sigint_event = evsignal_new(
+      impl_->base, SIGINT, DriverCoordinatorImpl::ShutdownHandler, impl_.get());
+  event_add(sigint_event, nullptr);
+
+  I("Waiting for %d drivers on port %d", impl_->num_drivers, impl_->port);
+  event_base_dispatch(impl_->base);
+  event_free(sigint_event);
+
+  impl_->PrintReport();
+}
+}  // namespace oldisim
@@ -34,11 +34,16 @@
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
+#include <stdio.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <deque>
+#include <fstream>
 #include <list>
 #include <memory>
 #include <mutex>
@@ -52,20 +57,72 @@
 #include "FanoutManagerImpl.h"
 #include "ForcedEvTimer.h"
 #include "InternalCallbacks.h"
+#include "MonitoringConfig.h"
 #include "NodeThreadImpl.h"
+#include "OpenMetrics.h"
+#include "PowerSampler.h"
+#include "RssConnector.h"
 #include "TestDriverImpl.h"
+#include "oldisim/ArrivalTrace.h"
 #include "oldisim/ChildConnection.h"
 #include "oldisim/FanoutManager.h"
+#include "oldisim/IoEngine.h"
 #include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
+#include "oldisim/StatsLog.h"
 #include "oldisim/TestDriver.h"
+#include "oldisim/Tls.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
 
 static const int kStatsWindowSeconds = 1;
 static const int kStatsMaxWindows = 3600;  // 1 hour
+// File descriptors to leave for everything other than the connections
+static const uint64_t kSpareFileDescriptors = 1024;
+
+/**
+ * Resident memory of the process, 0 if it cannot be read
+ */
+static uint64_t GetResidentBytes() {
+  unsigned long long total_pages = 0;
+  unsigned long long resident_pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr) {
+    return 0;
+  }
+  if (fscanf(statm, "%llu %llu", &total_pages, &resident_pages) != 2) {
+    resident_pages = 0;
+  }
+  fclose(statm);
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Raise the soft open file limit so that num_connections sockets fit
+ */
+static void RaiseOpenFileLimit(uint64_t num_connections) {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    DIE("getrlimit(RLIMIT_NOFILE) failed: %s", strerror(errno));
+  }
+  uint64_t needed = num_connections + kSpareFileDescriptors;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur >= needed) {
+    return;
+  }
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+    DIE("%llu connections need %llu open files, but the hard limit is %llu",
+        static_cast<unsigned long long>(num_connections),
+        static_cast<unsigned long long>(needed),
+        static_cast<unsigned long long>(limit.rlim_max));
+  }
+  limit.rlim_cur = needed;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    DIE("setrlimit(RLIMIT_NOFILE, %llu) failed: %s",
+        static_cast<unsigned long long>(needed), strerror(errno));
+  }
+}
 
 struct DriverNode::DriverNodeThread {
   ~DriverNodeThread();
@@ -103,12 +160,14 @@ struct DriverNode::DriverNodeImpl {
   // Callback pointers and data
   DriverNodeThreadStartupCallback on_thread_startup;
   DriverNodeMakeRequestCallback make_request_cb;
+  DriverNodeStatsWindowCallback on_stats_window;
   std::unordered_map<uint32_t, const DriverNodeResponseCallback> on_reply_cbs;
   std::set<uint32_t> request_types;
 
   // Test configuration
   int num_connections_per_thread;
   int max_connection_depth;
+  bool high_connection_count;
 
   // Threads
   std::vector<std::unique_ptr<DriverNodeThread>> threads;
@@ -119,9 +178,11 @@ struct DriverNode::DriverNodeImpl {
   // Forced timer for event loop
   std::unique_ptr<ForcedEvTimer> forced_timer;
 
-  // Test node address
+  // Test node address and how to reach it
   addrinfo* test_node_addr;
   std::string test_node_addr_string;
+  Transport test_node_transport;
+  Framing test_node_framing;
 
   // Save queries for debugging
   bool store_queries;
@@ -129,9 +190,17 @@ struct DriverNode::DriverNodeImpl {
   // Thread initialization barrier
   pthread_barrier_t thread_init_barrier;
 
+  // Holds the threads back from sending load until the run starts
+  pthread_barrier_t thread_start_barrier;
+
   // Remote monitoring settings
   bool monitor_enabled;
   uint16_t monitor_port;
+  MonitoringConfigEndpoint monitoring_config;
+
+  // Energy and frequency over the measure phase, null if disabled
+  bool power_telemetry_enabled;
+  std::unique_ptr<PowerSampler> power_sampler;
 
   // Aggregated stats every 5 seconds
   event* stats_timer_event;
@@ -141,6 +210,44 @@ struct DriverNode::DriverNodeImpl {
   // Aggregated stats over entire run
   std::unique_ptr<ChildConnectionStats> total_child_stats;
 
+  // Warmup, measure and cooldown phases, counted in stats windows. None of
+  // it applies unless phases_enabled.
+  enum class Phase { kWarmup, kMeasure, kCooldown };
+  bool phases_enabled;
+  int warmup_windows;
+  int measure_windows;
+  int cooldown_windows;
+  Phase phase;
+  int phase_windows;
+
+  // Steady state detection extends the warmup, disabled with 0 windows
+  size_t steady_state_windows;
+  double steady_state_max_cv;
+  int max_warmup_windows;
+  std::deque<ChildConnectionStats>
+      steady_state_candidates;  // newest samples are in the back
+
+  // Aggregated stats over the measure phase
+  std::unique_ptr<ChildConnectionStats> measured_child_stats;
+  int measured_windows;
+
+  // Where to write HdrHistogram percentile distributions, empty if disabled
+  std::string histogram_output_path;
+
+  // Where to record the arrivals of the run, empty if disabled
+  std::string trace_record_path;
+  std::unique_ptr<ArrivalTraceRecorder> trace_recorder;
+
+  // Where to append every stats window, empty if disabled
+  std::string stats_log_path;
+  std::unique_ptr<StatsLogWriter> stats_log;
+
+  // Coordinator to report to, empty hostname if running standalone
+  std::string coordinator_hostname;
+  uint16_t coordinator_port;
+  std::string driver_name;
+  evhttp_connection* coordinator_connection;
+
   DriverNodeImpl();
   static void ShutdownHandler(evutil_socket_t listener, int16_t event,
                               void* arg);
@@ -148,9 +255,26 @@ struct DriverNode::DriverNodeImpl {
                                     void* arg);
   static void AddPullStatsTimer(DriverNode& driver);
 
+  // Move the run through its phases with the stats of each window
+  void AddPhaseWindow(DriverNode& driver, const ChildConnectionStats& window);
+  void StartMeasuring(DriverNode& driver);
+  void EndMeasuringIfDone(DriverNode& driver);
+  bool IsSteady() const;
+
+  // Stats of the measure phase if there is one, of the whole run otherwise
+  const ChildConnectionStats& MeasuredStats() const;
+
+  // Coordinator client, requests carry the driver name on the first line
+  bool CallCoordinator(const char* path, const std::string& body,
+                       std::string* reply);
+  void PostCoordinatorSnapshot(const ChildConnectionStats& snapshot);
+  static void CoordinatorReplyHandler(evhttp_request* req, void* arg);
+
   // Remote monitoring HTTP callbacks
   static void MonitoringTopologyHandler(evhttp_request* req, void* arg);
   static void MonitoringChildStatsHandler(evhttp_request* req, void* arg);
+  static void MonitoringMetricsHandler(evhttp_request* req, void* arg);
+  static void MonitoringPowerHandler(evhttp_request* req, void* arg);
   static void MonitoringDefaultHandler(evhttp_request* req, void* arg);
 };
 
@@ -160,15 +284,33 @@ struct DriverNode::DriverNodeImpl {
 DriverNode::DriverNodeImpl::DriverNodeImpl()
     : on_thread_startup(nullptr),
       make_request_cb(nullptr),
+      on_stats_window(nullptr),
       num_connections_per_thread(0),
       max_connection_depth(0),
+      high_connection_count(false),
       base(nullptr),
       test_node_addr(nullptr),
+      test_node_transport(Transport::kTcp),
+      test_node_framing(Framing::kFixed),
       store_queries(false),
       monitor_enabled(false),
       monitor_port(0),
+      power_telemetry_enabled(false),
       stats_timer_event(nullptr),
-      total_child_stats(nullptr) {}
+      total_child_stats(nullptr),
+      phases_enabled(false),
+      warmup_windows(0),
+      measure_windows(0),
+      cooldown_windows(0),
+      phase(Phase::kWarmup),
+      phase_windows(0),
+      steady_state_windows(0),
+      steady_state_max_cv(0),
+      max_warmup_windows(0),
+      measured_child_stats(nullptr),
+      measured_windows(0),
+      coordinator_port(0),
+      coordinator_connection(nullptr) {}
 
 void DriverNode::DriverNodeImpl::ShutdownHandler(evutil_socket_t listener,
                                                  int16_t event, void* arg) {
@@ -191,14 +333,40 @@ void DriverNode::DriverNodeImpl::PullStatsTimerHandler(evutil_socket_t listener,
   // Pull the snapshots
   for (int i = 0; i < num_ready_snapshots; i++) {
     ChildConnectionStats snapshot(driver->impl_->request_types);
+    uint64_t window_start = 0;
     for (const auto& thread : driver->impl_->threads) {
       // Aggregate into one big snapshot
-      snapshot.Accumulate(thread->stats_snapshotter->PopSnapshot());
+      ChildConnectionStats thread_snapshot =
+          thread->stats_snapshotter->PopSnapshot();
+      if (window_start == 0 || thread_snapshot.start_time_ < window_start) {
+        window_start = thread_snapshot.start_time_;
+      }
+      snapshot.Accumulate(thread_snapshot);
+    }
+
+    if (driver->impl_->stats_log != nullptr) {
+      // Windows pulled together were cut a window apart
+      uint64_t window_end =
+          std::min<uint64_t>(window_start + kStatsWindowSeconds * 1000000000ULL,
+                   GetTimeAccurateNano());
+      ConnectionUtil::AddChildConnectionStatsToLog(*driver->impl_->stats_log,
+                                                   "", snapshot);
+      driver->impl_->stats_log->WriteWindow(window_start, window_end);
     }
 
     // Aggregate over entire run
     driver->impl_->total_child_stats->Accumulate(snapshot);
 
+    if (driver->impl_->coordinator_connection != nullptr) {
+      driver->impl_->PostCoordinatorSnapshot(snapshot);
+    }
+    if (driver->impl_->phases_enabled) {
+      driver->impl_->AddPhaseWindow(*driver, snapshot);
+    }
+    if (driver->impl_->on_stats_window != nullptr) {
+      driver->impl_->on_stats_window(snapshot);
+    }
+
     // Put it into the stats snapshot history
     driver->impl_->stats_history.emplace_front(std::move(snapshot));
 
@@ -216,6 +384,197 @@ void DriverNode::DriverNodeImpl::AddPullStatsTimer(DriverNode& driver) {
   evtimer_add(driver.impl_->stats_timer_event, &t);
 }
 
+/**
+ * Number of responses that came back within stats
+ */
+static uint64_t CountResponses(const ChildConnectionStats& stats) {
+  uint64_t responses = 0;
+  for (const auto& sampler_pair : stats.query_samplers_) {
+    responses += sampler_pair.second.total();
+  }
+  return responses;
+}
+
+void DriverNode::DriverNodeImpl::AddPhaseWindow(
+    DriverNode& driver, const ChildConnectionStats& window) {
+  phase_windows++;
+  switch (phase) {
+    case Phase::kWarmup:
+      if (phase_windows <= warmup_windows) {
+        if (phase_windows == warmup_windows && steady_state_windows == 0) {
+          StartMeasuring(driver);
+        }
+        return;
+      }
+      // Past the fixed warmup, wait for the last windows to settle
+      steady_state_candidates.push_back(window);
+      if (steady_state_candidates.size() > steady_state_windows) {
+        steady_state_candidates.pop_front();
+      }
+      if (steady_state_candidates.size() == steady_state_windows &&
+          IsSteady()) {
+        I("Steady state after %d seconds of warmup",
+          (phase_windows - static_cast<int>(steady_state_windows)) *
+              kStatsWindowSeconds);
+        StartMeasuring(driver);
+      } else if (max_warmup_windows > 0 &&
+                 phase_windows >= max_warmup_windows) {
+        W("No steady state after %d seconds of warmup, measuring anyway",
+          phase_windows * kStatsWindowSeconds);
+        steady_state_candidates.clear();
+        StartMeasuring(driver);
+      }
+      return;
+
+    case Phase::kMeasure:
+      measured_child_stats->Accumulate(window);
+      measured_windows++;
+      EndMeasuringIfDone(driver);
+      return;
+
+    case Phase::kCooldown:
+      if (phase_windows >= cooldown_windows) {
+        driver.Shutdown();
+      }
+      return;
+  }
+}
+
+void DriverNode::DriverNodeImpl::StartMeasuring(DriverNode& driver) {
+  phase = Phase::kMeasure;
+  phase_windows = 0;
+  if (power_sampler != nullptr) {
+    power_sampler->Start();
+  }
+  // The windows that showed the steady state are already part of it
+  for (const auto& window : steady_state_candidates) {
+    measured_child_stats->Accumulate(window);
+    measured_windows++;
+    phase_windows++;
+  }
+  steady_state_candidates.clear();
+  EndMeasuringIfDone(driver);
+}
+
+void DriverNode::DriverNodeImpl::EndMeasuringIfDone(DriverNode& driver) {
+  if (measure_windows == 0 || measured_windows < measure_windows) {
+    return;
+  }
+  phase = Phase::kCooldown;
+  phase_windows = 0;
+  if (power_sampler != nullptr) {
+    power_sampler->Stop();
+  }
+  if (cooldown_windows == 0) {
+    driver.Shutdown();
+  }
+}
+
+const ChildConnectionStats& DriverNode::DriverNodeImpl::MeasuredStats() const {
+  return phases_enabled && phase != Phase::kWarmup ? *measured_child_stats
+                                                   : *total_child_stats;
+}
+
+bool DriverNode::DriverNodeImpl::IsSteady() const {
+  // Coefficient of variation of the windows' QPS and mean latency
+  std::vector<double> qps;
+  std::vector<double> latency;
+  for (const auto& window : steady_state_candidates) {
+    uint64_t responses = CountResponses(window);
+    double latency_sum = 0;
+    for (const auto& sampler_pair : window.query_samplers_) {
+      latency_sum += sampler_pair.second.sum();
+    }
+    if (responses == 0) {
+      return false;
+    }
+    qps.push_back(static_cast<double>(responses) / kStatsWindowSeconds);
+    latency.push_back(latency_sum / responses);
+  }
+
+  for (const auto* samples : {&qps, &latency}) {
+    double mean = 0;
+    for (double sample : *samples) {
+      mean += sample;
+    }
+    mean /= samples->size();
+    double variance = 0;
+    for (double sample : *samples) {
+      variance += (sample - mean) * (sample - mean);
+    }
+    variance /= samples->size();
+    if (std::sqrt(variance) > steady_state_max_cv * mean) {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+// Outcome of a synchronous coordinator request
+struct CoordinatorCall {
+  event_base* base;
+  bool ok;
+  std::string reply;
+};
+}  // namespace
+
+void DriverNode::DriverNodeImpl::CoordinatorReplyHandler(evhttp_request* req,
+                                                         void* arg) {
+  CoordinatorCall* call = reinterpret_cast<CoordinatorCall*>(arg);
+  if (call == nullptr) {
+    // Snapshots are fire and forget, the final totals supersede them
+    if (req == nullptr || evhttp_request_get_response_code(req) != 200) {
+      W("Coordinator did not accept a stats snapshot");
+    }
+    return;
+  }
+
+  call->ok = req != nullptr && evhttp_request_get_response_code(req) == 200;
+  if (call->ok) {
+    evbuffer* input = evhttp_request_get_input_buffer(req);
+    size_t length = evbuffer_get_length(input);
+    call->reply.resize(length);
+    evbuffer_copyout(input, &call->reply[0], length);
+  }
+  event_base_loopbreak(call->base);
+}
+
+bool DriverNode::DriverNodeImpl::CallCoordinator(const char* path,
+                                                 const std::string& body,
+                                                 std::string* reply) {
+  CoordinatorCall call = {base, false, ""};
+  evhttp_request* req = evhttp_request_new(CoordinatorReplyHandler, &call);
+  evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s\n%s",
+                      driver_name.c_str(), body.c_str());
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Host",
+                    coordinator_hostname.c_str());
+  if (evhttp_make_request(coordinator_connection, req, EVHTTP_REQ_POST,
+                          path) != 0) {
+    return false;
+  }
+
+  // The reply handler breaks out of the loop, as does a ctrl-c
+  event_base_dispatch(base);
+  if (reply != nullptr) {
+    *reply = std::move(call.reply);
+  }
+  return call.ok;
+}
+
+void DriverNode::DriverNodeImpl::PostCoordinatorSnapshot(
+    const ChildConnectionStats& snapshot) {
+  evhttp_request* req = evhttp_request_new(CoordinatorReplyHandler, nullptr);
+  evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s\n%s",
+                      driver_name.c_str(),
+                      ConnectionUtil::EncodeChildConnectionStats(snapshot)
+                          .c_str());
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Host",
+                    coordinator_hostname.c_str());
+  evhttp_make_request(coordinator_connection, req, EVHTTP_REQ_POST,
+                      "/snapshot");
+}
+
 void DriverNode::DriverNodeImpl::MonitoringTopologyHandler(evhttp_request* req,
                                                            void* arg) {
   DriverNode* driver = reinterpret_cast<DriverNode*>(arg);
@@ -316,6 +675,75 @@ void DriverNode::DriverNodeImpl::MonitoringChildStatsHandler(
   evbuffer_free(evb);
 }
 
+void DriverNode::DriverNodeImpl::MonitoringMetricsHandler(evhttp_request* req,
+                                                          void* arg) {
+  DriverNode* driver = reinterpret_cast<DriverNode*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  // The driver threads hand over their stats once per window, so the
+  // totals of the run so far advance once per kStatsWindowSeconds
+  OpenMetricsWriter writer(evb);
+  writer.ChildConnectionStatsFamilies(
+      "oldisim_driver", {driver->impl_->test_node_addr_string},
+      {*driver->impl_->total_child_stats});
+  writer.Finish();
+
+  // Send response
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    OpenMetricsWriter::kContentType);
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void DriverNode::DriverNodeImpl::MonitoringPowerHandler(evhttp_request* req,
+                                                        void* arg) {
+  DriverNode* driver = reinterpret_cast<DriverNode*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  // Like the stats, the query count advances once per kStatsWindowSeconds
+  std::stringstream ss;
+  {
+    cereal::JSONOutputArchive oarchive(ss);
+    oarchive(cereal::make_nvp(
+        "power", PowerSampler::MakeReportMap(
+                     driver->impl_->power_sampler->GetReport(),
+                     CountResponses(driver->impl_->MeasuredStats()))));
+  }
+  evbuffer_add_printf(evb, "%s", ss.str().c_str());
+
+  // Send response
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
 void DriverNode::DriverNodeImpl::MonitoringDefaultHandler(evhttp_request* req,
                                                           void* arg) {
   DriverNode* driver = reinterpret_cast<DriverNode*>(arg);
@@ -345,7 +773,10 @@ void DriverNode::DriverNodeThread::Init() {
       driver_node.impl_->num_connections_per_thread,
       driver_node.impl_->max_connection_depth, driver_node.impl_->on_reply_cbs,
       driver_node.impl_->request_types, driver_node.impl_->make_request_cb,
-      node_thread));
+      node_thread, driver_node.impl_->test_node_transport,
+      driver_node.impl_->test_node_framing,
+      driver_node.impl_->high_connection_count));
+  test_driver->impl_->trace_recorder = driver_node.impl_->trace_recorder.get();
   // Create forced timer
   forced_timer.reset(new ForcedEvTimer(node_thread.impl_->base));
 
@@ -370,20 +801,23 @@ void* DriverNode::DriverNodeThread::ThreadMain(void* arg) {
   // Signal this thread has init'ed
   pthread_barrier_wait(&thread->driver_node.impl_->thread_init_barrier);
 
-  // Start collection of stats
-  thread->stats_snapshotter->Enable();
-
   // Run user provided callback
   if (thread->driver_node.impl_->on_thread_startup != nullptr) {
     thread->driver_node.impl_->on_thread_startup(thread->node_thread,
                                                  *thread->test_driver);
   }
 
+  // Wait for the run to start, which may be held up by a coordinator
+  pthread_barrier_wait(&thread->driver_node.impl_->thread_start_barrier);
+
+  // Start collection of stats
+  thread->stats_snapshotter->Enable();
+
   // Start the test driver
   thread->test_driver->Start();
 
   // Start event loop
-  event_base_dispatch(thread->node_thread.impl_->base);
+  thread->node_thread.impl_->RunEventLoop();
 
   D("DriverNodeThread about to exit...");
 
@@ -444,7 +878,8 @@ void DriverNode::DriverNodeThread::SpawnThread(DriverNodeThread& thread,
 /**
  * Implementation details for DriverNode
  */
-DriverNode::DriverNode(const std::string& hostname, uint16_t port)
+DriverNode::DriverNode(const std::string& hostname, uint16_t port,
+                       Transport transport, Framing framing)
     : impl_(new DriverNodeImpl()) {
   // Setup libevent to use pthreads
   if (evthread_use_pthreads()) {
@@ -454,6 +889,8 @@ DriverNode::DriverNode(const std::string& hostname, uint16_t port)
   // Resolve the host under test
   impl_->test_node_addr = ResolveHost(hostname, port);
   impl_->test_node_addr_string = MakeAddress(hostname, port);
+  impl_->test_node_transport = transport;
+  impl_->test_node_framing = framing;
 
   // Create libevent base for main thread
   // This one terminates the program on ctrl-c
@@ -479,6 +916,17 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
   impl_->num_connections_per_thread = num_connections_per_thread;
   impl_->max_connection_depth = max_connection_depth;
 
+  uint64_t num_connections =
+      static_cast<uint64_t>(num_threads) * num_connections_per_thread;
+  if (impl_->high_connection_count) {
+    if (impl_->test_node_transport != Transport::kTcp || IsTlsEnabled() ||
+        GetIoEngine() != IoEngine::kLibevent) {
+      DIE("High connection count mode needs plain TCP connections through "
+          "the libevent I/O engine");
+    }
+    RaiseOpenFileLimit(num_connections);
+  }
+
   // Ignore SIGPIPE (happens if parent closes connection from other side)
   if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
     DIE("Could not ignore SIGPIPE: %s", strerror(errno));
@@ -487,10 +935,32 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
   // Create global child stats collection object
   impl_->total_child_stats.reset(
       new ChildConnectionStats(impl_->request_types));
+  impl_->measured_child_stats.reset(
+      new ChildConnectionStats(impl_->request_types));
+  if (impl_->warmup_windows == 0 && impl_->steady_state_windows == 0) {
+    impl_->phase = DriverNodeImpl::Phase::kMeasure;
+  }
+  if (impl_->power_telemetry_enabled) {
+    impl_->power_sampler.reset(new PowerSampler());
+  }
 
-  // Init the thread init barrier
+  // Start recording before any thread can send a request
+  if (!impl_->trace_record_path.empty()) {
+    impl_->trace_recorder.reset(
+        new ArrivalTraceRecorder(impl_->trace_record_path));
+  }
+  if (!impl_->stats_log_path.empty()) {
+    impl_->stats_log.reset(new StatsLogWriter(impl_->stats_log_path, "driver"));
+  }
+
+  // Memory before the connections are made, to report what they cost
+  uint64_t resident_bytes_before = GetResidentBytes();
+
+  // Init the thread init and start barriers
   pthread_barrier_init(&impl_->thread_init_barrier, nullptr,
                        num_threads + 1);  // one more for main thread
+  pthread_barrier_init(&impl_->thread_start_barrier, nullptr,
+                       num_threads + 1);
 
   // Start up the threads
   for (int i = 0; i < num_threads; i++) {
@@ -512,8 +982,48 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
 
   // Wait for all worker threads to start
   pthread_barrier_wait(&impl_->thread_init_barrier);
+  LogRssQueueConnections();
+  if (num_connections > 0) {
+    uint64_t resident_bytes = GetResidentBytes();
+    uint64_t growth = resident_bytes > resident_bytes_before
+                          ? resident_bytes - resident_bytes_before
+                          : 0;
+    I("Opened %llu connections in %u threads, %.0f bytes of memory each, "
+      "including each thread's setup",
+      static_cast<unsigned long long>(num_connections), num_threads,
+      static_cast<double>(growth) / num_connections);
+  }
+
+  // Register with the coordinator, which replies once every driver is ready
+  if (!impl_->coordinator_hostname.empty()) {
+    impl_->coordinator_connection = evhttp_connection_base_new(
+        impl_->base, nullptr, impl_->coordinator_hostname.c_str(),
+        impl_->coordinator_port);
+    if (impl_->coordinator_connection == nullptr) {
+      DIE("Could not connect to coordinator %s:%d",
+          impl_->coordinator_hostname.c_str(), impl_->coordinator_port);
+    }
+    // Registration is held open until the last driver arrives
+    evhttp_connection_set_timeout(impl_->coordinator_connection, 3600);
+    evhttp_connection_set_retries(impl_->coordinator_connection, 10);
+
+    I("Registering with coordinator %s:%d as %s",
+      impl_->coordinator_hostname.c_str(), impl_->coordinator_port,
+      impl_->driver_name.c_str());
+    if (!impl_->CallCoordinator("/register", "", nullptr)) {
+      DIE("Coordinator %s:%d did not start the run",
+          impl_->coordinator_hostname.c_str(), impl_->coordinator_port);
+    }
+  }
+
+  // Release the worker threads
+  pthread_barrier_wait(&impl_->thread_start_barrier);
 
   double start_time = GetTimeAccurate();
+  if (impl_->power_sampler != nullptr &&
+      impl_->phase == DriverNodeImpl::Phase::kMeasure) {
+    impl_->power_sampler->Start();
+  }
 
   // Remote monitoring
   evhttp* monitor_http;
@@ -529,6 +1039,15 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
                   DriverNodeImpl::MonitoringTopologyHandler, this);
     evhttp_set_cb(monitor_http, "/child_stats",
                   DriverNodeImpl::MonitoringChildStatsHandler, this);
+    evhttp_set_cb(monitor_http, "/metrics",
+                  DriverNodeImpl::MonitoringMetricsHandler, this);
+    if (impl_->monitoring_config.enabled()) {
+      impl_->monitoring_config.Register(monitor_http);
+    }
+    if (impl_->power_sampler != nullptr) {
+      evhttp_set_cb(monitor_http, "/power",
+                    DriverNodeImpl::MonitoringPowerHandler, this);
+    }
     evhttp_set_gencb(monitor_http, DriverNodeImpl::MonitoringDefaultHandler,
                      this);
 
@@ -542,7 +1061,13 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
         DIE("couldn't bind to port %d. Exiting.\n", impl_->monitor_port);
       }
     }
+  }
 
+  // Windows are needed for the monitor history, the coordinator stream, the
+  // window callback, the measurement phases and the stats log
+  if (impl_->monitor_enabled || impl_->coordinator_connection != nullptr ||
+      impl_->on_stats_window != nullptr || impl_->phases_enabled ||
+      impl_->stats_log != nullptr) {
     DriverNodeImpl::AddPullStatsTimer(*this);
   }
 
@@ -553,51 +1078,98 @@ void DriverNode::Run(uint32_t num_threads, bool thread_pinning,
   for (const auto& thread : impl_->threads) {
     pthread_join(thread->node_thread.impl_->pt, nullptr);
   }
+  if (impl_->trace_recorder != nullptr) {
+    impl_->trace_recorder->Close();
+  }
+  if (impl_->stats_log != nullptr) {
+    impl_->stats_log->Close();
+  }
 
   double end_time = GetTimeAccurate();
   double elapsed_time = end_time - start_time;
+  if (impl_->high_connection_count) {
+    I("The %llu connections held at most %lld receive and send buffers of "
+      "their own at once",
+      static_cast<unsigned long long>(num_connections),
+      static_cast<long long>(ConnectionUtil::GetPeakPrivateChildBuffers()));
+  }
+  if (impl_->power_sampler != nullptr) {
+    impl_->power_sampler->Stop();
+  }
 
-  // Aggregate remaining samples from each child thread
+  // Aggregate remaining samples from each child thread, including
+  // windows that were snapshotted but not yet pulled
+  evtimer_del(impl_->stats_timer_event);
+  bool measuring = impl_->phase == DriverNodeImpl::Phase::kMeasure;
+  int remaining_windows = 0;
   for (const auto& thread : impl_->threads) {
+    int thread_windows = thread->stats_snapshotter->GetNumberSnapshots();
+    remaining_windows = std::max(remaining_windows, thread_windows);
+    while (thread->stats_snapshotter->GetNumberSnapshots() > 0) {
+      ChildConnectionStats window = thread->stats_snapshotter->PopSnapshot();
+      impl_->total_child_stats->Accumulate(window);
+      if (measuring) {
+        impl_->measured_child_stats->Accumulate(window);
+      }
+    }
     impl_->total_child_stats->Accumulate(
         thread->test_driver->impl_->current_child_stats);
+    if (measuring) {
+      impl_->measured_child_stats->Accumulate(
+          thread->test_driver->impl_->current_child_stats);
+    }
+  }
+
+  // Report only the measure phase when there is one
+  const ChildConnectionStats* report_stats = impl_->total_child_stats.get();
+  double report_time = elapsed_time;
+  if (impl_->phases_enabled) {
+    if (impl_->phase == DriverNodeImpl::Phase::kWarmup) {
+      W("Run ended during warmup, reporting all of it");
+    } else {
+      report_stats = impl_->measured_child_stats.get();
+      report_time = impl_->measured_windows * kStatsWindowSeconds;
+      if (measuring) {
+        // The windows that were not pulled yet and the partial last one
+        report_time +=
+            remaining_windows * kStatsWindowSeconds +
+            (GetTimeAccurateNano() -
+             impl_->threads[0]->test_driver->impl_->current_child_stats
+                 .start_time_) /
+                1e9;
+      }
+      I("Reporting %.1f measured seconds out of %.1f", report_time,
+        elapsed_time);
+    }
+  }
+
+  // Report the totals, which replace the windows streamed during the run
+  if (impl_->coordinator_connection != nullptr) {
+    if (!impl_->CallCoordinator(
+            "/done",
+            ConnectionUtil::EncodeChildConnectionStats(*report_stats),
+            nullptr)) {
+      W("Could not report totals to coordinator %s:%d",
+        impl_->coordinator_hostname.c_str(), impl_->coordinator_port);
+    }
+    evhttp_connection_free(impl_->coordinator_connection);
+    impl_->coordinator_connection = nullptr;
   }
 
   // Print stats
-  for (uint32_t type : impl_->request_types) {
-    printf("Stats for node under test, type %d\n", type);
-    printf(
-        "   RX: %.2f MB/sec (%lu bytes)\n",
-        impl_->total_child_stats->rx_bytes_[type] / elapsed_time / 1024 / 1024,
-        impl_->total_child_stats->rx_bytes_[type]);
-    printf(
-        "   TX: %.2f MB/sec (%lu bytes)\n",
-        impl_->total_child_stats->tx_bytes_[type] / elapsed_time / 1024 / 1024,
-        impl_->total_child_stats->tx_bytes_[type]);
-    printf("    #: %.2f QPS (%lu queries)\n",
-           impl_->total_child_stats->query_counts_[type] / elapsed_time,
-           impl_->total_child_stats->query_counts_[type]);
-    printf(
-        "  min: %.3f ms\n",
-        impl_->total_child_stats->query_samplers_.at(type).minimum() / 1000000);
-    printf(
-        "  avg: %.3f ms\n",
-        impl_->total_child_stats->query_samplers_.at(type).average() / 1000000);
-    printf("  50p: %.3f ms\n",
-           impl_->total_child_stats->query_samplers_.at(type).get_nth(50) /
-               1000000);
-    printf("  90p: %.3f ms\n",
-           impl_->total_child_stats->query_samplers_.at(type).get_nth(90) /
-               1000000);
-    printf("  95p: %.3f ms\n",
-           impl_->total_child_stats->query_samplers_.at(type).get_nth(95) /
-               1000000);
-    printf("  99p: %.3f ms\n",
-           impl_->total_child_stats->query_samplers_.at(type).get_nth(99) /
-               1000000);
-    printf("  99.9p: %.3f ms\n",
-           impl_->total_child_stats->query_samplers_.at(type).get_nth(99.9) /
-               1000000);
+  ConnectionUtil::PrintChildConnectionStats(*report_stats, report_time);
+  if (impl_->power_sampler != nullptr) {
+    PowerReport power_report = impl_->power_sampler->GetReport();
+    if (power_report.elapsed_seconds > 0) {
+      PowerSampler::PrintReport(power_report, CountResponses(*report_stats));
+    }
+  }
+
+  // Dump latency distributions in HdrHistogram text format, one file per
+  // request type if there is more than one
+  if (!impl_->histogram_output_path.empty()) {
+    ConnectionUtil::WriteHistogramOutputFiles(*report_stats,
+                                              impl_->histogram_output_path);
   }
 }
 
@@ -607,10 +1179,86 @@ void DriverNode::Shutdown() {
 
   // Stop event_base on threads
   for (auto& thread : impl_->threads) {
-    event_base_loopbreak(thread->node_thread.impl_->base);
+    thread->node_thread.impl_->StopEventLoop();
   }
 }
 
+/**
+ * Write the end-of-run latency distribution of each request type to path
+ * in HdrHistogram percentile text format, with values in milliseconds.
+ */
+void DriverNode::SetHistogramOutputFile(const std::string& path) {
+  impl_->histogram_output_path = path;
+}
+
+/**
+ * Record the arrival time, type and size of every request sent during the
+ * run to path as a binary trace.
+ */
+void DriverNode::SetTraceRecordFile(const std::string& path) {
+  impl_->trace_record_path = path;
+}
+
+void DriverNode::EnableHighConnectionCount() {
+  impl_->high_connection_count = true;
+}
+
+/**
+ * Append every stats window of the run to the stats log at path.
+ */
+void DriverNode::SetStatsLogFile(const std::string& path) {
+  impl_->stats_log_path = path;
+}
+
+/**
+ * Run under the DriverCoordinator at hostname:port, which starts the run
+ * and merges the stats of all its drivers.
+ */
+void DriverNode::SetCoordinator(const std::string& hostname, uint16_t port) {
+  impl_->coordinator_hostname = hostname;
+  impl_->coordinator_port = port;
+
+  char local_hostname[256];
+  if (gethostname(local_hostname, sizeof(local_hostname)) != 0) {
+    snprintf(local_hostname, sizeof(local_hostname), "driver");
+  }
+  local_hostname[sizeof(local_hostname) - 1] = '\0';
+  impl_->driver_name =
+      std::string(local_hostname) + ":" + std::to_string(getpid());
+}
+
+/**
+ * Set the callback to run with the stats of each one second window, on the
+ * main thread.
+ */
+void DriverNode::SetStatsWindowCallback(
+    const DriverNodeStatsWindowCallback& callback) {
+  impl_->on_stats_window = callback;
+}
+
+/**
+ * Split the run into warmup, measure and cooldown phases of whole stats
+ * windows.
+ */
+void DriverNode::SetMeasurementPhases(int warmup_seconds, int measure_seconds,
+                                      int cooldown_seconds) {
+  impl_->phases_enabled = true;
+  impl_->warmup_windows = warmup_seconds / kStatsWindowSeconds;
+  impl_->measure_windows = measure_seconds / kStatsWindowSeconds;
+  impl_->cooldown_windows = cooldown_seconds / kStatsWindowSeconds;
+}
+
+/**
+ * Extend the warmup until the last num_windows stats windows are steady.
+ */
+void DriverNode::SetSteadyStateDetection(int num_windows, double max_cv,
+                                         int max_warmup_seconds) {
+  impl_->phases_enabled = true;
+  impl_->steady_state_windows = num_windows;
+  impl_->steady_state_max_cv = max_cv;
+  impl_->max_warmup_windows = max_warmup_seconds / kStatsWindowSeconds;
+}
+
 /**
  * Set the callback to run after a thread has started up.
  * It will run in the context of the newly started thread.
@@ -657,5 +1305,18 @@ void DriverNode::EnableMonitoring(uint16_t port) {
   impl_->monitor_enabled = true;
   impl_->monitor_port = port;
 }
+
+void DriverNode::SetMonitoringConfigCallback(
+    const std::string& token, const MonitoringConfigCallback& callback) {
+  impl_->monitoring_config = MonitoringConfigEndpoint(token, callback);
+}
+
+/**
+ * Sample energy and effective frequency of this host over the measure
+ * phase.
+ */
+void DriverNode::EnablePowerTelemetry() {
+  impl_->power_telemetry_enabled = true;
+}
 }  // namespace oldisim
 
@@ -0,0 +1,37 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/EventLoop.h"
+
+#include "oldisim/NodeThread.h"
+#include "NodeThreadImpl.h"
+
+namespace oldisim {
+
+static EventLoopMode current_event_loop_mode = EventLoopMode::kInterrupt;
+static BusyPollOptions current_busy_poll_options;
+
+thread_local uint64_t event_loop_activity = 0;
+
+void SetEventLoopMode(EventLoopMode mode, const BusyPollOptions& options) {
+  current_event_loop_mode = mode;
+  current_busy_poll_options = options;
+}
+
+EventLoopMode GetEventLoopMode() { return current_event_loop_mode; }
+
+const BusyPollOptions& GetBusyPollOptions() {
+  return current_busy_poll_options;
+}
+}  // namespace oldisim
@@ -15,7 +15,9 @@
 
 #include "oldisim/FanoutManager.h"
 
+#include <algorithm>
 #include <memory>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
@@ -23,11 +25,63 @@
 #include "ConnectionUtil.h"
 #include "FanoutManagerImpl.h"
 #include "oldisim/ChildConnection.h"
+#include "oldisim/NodeThread.h"
 #include "oldisim/ResponseContext.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
 
+// Initial number of request slots in the tracker registry, a power of two
+static const size_t kInitialRegistrySize = 4096;
+static const int kTimerWheelSlots = 4096;
+
+// Number of recent reply latencies the hedge delay is taken from, how many
+// of them are needed before hedging starts, and how often it is refreshed
+static const size_t kHedgeLatencyWindow = 1024;
+static const size_t kHedgeMinSamples = 128;
+static const uint32_t kHedgeUpdateInterval = 128;
+
+constexpr uint64_t FanoutReplyTrackerInternal::kNoHedge;
+
+// Weight of the newest sample in the reply latency averages
+static const double kLatencyEwmaWeight = 0.2;
+
+/**
+ * Pick one of num candidates according to policy, given the cost of each.
+ * Scans start at the round-robin cursor so that ties are spread evenly.
+ */
+template <typename CostFunction>
+static uint32_t SelectByPolicy(ConnectionPolicy policy, uint32_t num,
+                               uint32_t* next_index, std::minstd_rand& rng,
+                               const CostFunction& cost) {
+  uint32_t start = *next_index % num;
+  *next_index = (start + 1) % num;
+  if (policy == ConnectionPolicy::kRoundRobin || num == 1) {
+    return start;
+  }
+
+  if (policy == ConnectionPolicy::kPowerOfTwoChoices) {
+    uint32_t first = rng() % num;
+    uint32_t second = rng() % (num - 1);
+    if (second >= first) {
+      second++;
+    }
+    return cost(second) < cost(first) ? second : first;
+  }
+
+  uint32_t best = start;
+  double best_cost = cost(start);
+  for (uint32_t offset = 1; offset < num; offset++) {
+    uint32_t i = (start + offset) % num;
+    double i_cost = cost(i);
+    if (i_cost < best_cost) {
+      best = i;
+      best_cost = i_cost;
+    }
+  }
+  return best;
+}
+
 /**
  *  Implementation details for FanoutManager
  */
@@ -39,12 +93,15 @@ void FanoutManager::MakeChildConnection(uint32_t child_node_id) {
 
   std::unique_ptr<ChildConnection> conn(ConnectionUtil::MakeChildConnection(
       std::bind(FanoutManager::FanoutManagerImpl::ResponseCallback,
-                std::ref(*this), std::placeholders::_1),
+                std::ref(*this), child_node_id, std::placeholders::_1),
       std::bind(FanoutManager::FanoutManagerImpl::ChildConnectionClosedHandler,
                 std::ref(*this), std::placeholders::_1),
       impl_->node_thread, impl_->child_node_addr[child_node_id],
-      *impl_->child_nodes[child_node_id].stats, false, true));
+      *impl_->child_nodes[child_node_id].stats, false, true, true,
+      impl_->child_node_transport[child_node_id],
+      impl_->child_node_framing[child_node_id]));
   impl_->child_nodes[child_node_id].connections.emplace_back(std::move(conn));
+  impl_->child_nodes[child_node_id].connection_latency_ewma_ms.push_back(0.0);
 }
 
 void FanoutManager::MakeChildConnections(uint32_t child_node_id, int num) {
@@ -56,76 +113,130 @@ void FanoutManager::MakeChildConnections(uint32_t child_node_id, int num) {
 void FanoutManager::Fanout(QueryContext&& originating_query,
                            const FanoutRequest* requests, int num_requests,
                            const FanoutDoneCallback& callback,
-                           double timeout_ms) {
+                           double timeout_ms, int quorum) {
   // Allocate new internal tracker
-  auto tracker = std::make_shared<FanoutReplyTrackerInternal>(
-      impl_->next_request_id, num_requests, callback,
-      std::move(originating_query));
+  auto tracker = impl_->NewReplyTracker(num_requests, quorum, callback,
+                                        std::move(originating_query));
+  const QueryContext& query = tracker->originating_query();
 
-  // Send the request out on the child connections, round-robin between
-  // connections to the same child node
+  // Send the request out on the child connections, spreading requests to
+  // the same child node over its connections according to the policy
   for (int i = 0; i < num_requests; i++) {
     const FanoutRequest& request = requests[i];
-    ChildConnection& conn = impl_->GetConnection(request.child_node_id);
 
     // Check if request type has been registered
     if (impl_->request_types.count(request.request_type) == 0) {
       DIE("Request type %d has not been registered\n", request.request_type);
     }
 
-    conn.IssueRequest(request.request_type, impl_->next_request_id++,
-                      request.request_data, request.request_data_length);
+    uint32_t connection_index = impl_->SendRequest(
+        request.child_node_id, request.request_type, impl_->next_request_id++,
+        request.request_data, request.request_data_length, query);
 
     // Fill in tracking data
     tracker->user_tracker.replies[i].child_node_id = request.child_node_id;
     tracker->user_tracker.replies[i].request_type = request.request_type;
+    tracker->connection_indices[i] = connection_index;
+    if (connection_index == FanoutManagerImpl::kRefusedRequest) {
+      impl_->RefuseReply(*tracker, i);
+    }
   }
 
   // Register the tracker
-  impl_->RegisterReplyTracker(tracker);
+  impl_->RegisterReplyTracker(*tracker);
 
   tracker->user_tracker.start_time = GetTimeAccurateNano();
 
+  // Enough requests may have been refused to settle the fanout already
+  if (FanoutManagerImpl::CloseOnQuorum(*impl_, *tracker)) {
+    return;
+  }
+
+  impl_->StartHedging(*tracker, requests, false);
+
   // Activate timeout timer if specified
   if (timeout_ms > 0) {
-    impl_->RegisterTrackerTimeout(tracker, timeout_ms);
+    impl_->RegisterTrackerTimeout(*tracker, timeout_ms);
   }
 }
 
 void FanoutManager::FanoutAll(QueryContext&& originating_query,
                               const FanoutRequest& request,
                               const FanoutDoneCallback& callback,
-                              double timeout_ms) {
+                              double timeout_ms, int quorum) {
   // Check if request type has been registered
   if (impl_->request_types.count(request.request_type) == 0) {
     DIE("Request type %d has not been registered\n", request.request_type);
   }
 
   // Allocate new internal tracker
-  auto tracker = std::make_shared<FanoutReplyTrackerInternal>(
-      impl_->next_request_id, impl_->child_nodes.size(), callback,
-      std::move(originating_query));
+  auto tracker =
+      impl_->NewReplyTracker(impl_->child_nodes.size(), quorum, callback,
+                             std::move(originating_query));
+  const QueryContext& query = tracker->originating_query();
 
-  // Send the request out on the child connections, round-robin between
-  // connections to the same child node
+  // Send the request out on the child connections, spreading requests to
+  // the same child node over its connections according to the policy
   for (int i = 0; i < impl_->child_nodes.size(); i++) {
-    ChildConnection& conn = impl_->GetConnection(i);
-    conn.IssueRequest(request.request_type, impl_->next_request_id++,
-                      request.request_data, request.request_data_length);
+    uint32_t connection_index = impl_->SendRequest(
+        i, request.request_type, impl_->next_request_id++,
+        request.request_data, request.request_data_length, query);
 
     // Fill in tracking data
     tracker->user_tracker.replies[i].child_node_id = i;
     tracker->user_tracker.replies[i].request_type = request.request_type;
+    tracker->connection_indices[i] = connection_index;
+    if (connection_index == FanoutManagerImpl::kRefusedRequest) {
+      impl_->RefuseReply(*tracker, i);
+    }
   }
 
   // Register the tracker
-  impl_->RegisterReplyTracker(tracker);
+  impl_->RegisterReplyTracker(*tracker);
 
   tracker->user_tracker.start_time = GetTimeAccurateNano();
 
+  // Enough requests may have been refused to settle the fanout already
+  if (FanoutManagerImpl::CloseOnQuorum(*impl_, *tracker)) {
+    return;
+  }
+
+  impl_->StartHedging(*tracker, &request, true);
+
   // Activate timeout timer if specified
   if (timeout_ms > 0) {
-    impl_->RegisterTrackerTimeout(tracker, timeout_ms);
+    impl_->RegisterTrackerTimeout(*tracker, timeout_ms);
+  }
+}
+
+void FanoutManager::SetConnectionPolicy(ConnectionPolicy policy) {
+  impl_->connection_policy = policy;
+}
+
+uint32_t FanoutManager::SelectChildNode() {
+  assert(impl_->child_nodes.size() > 0);
+  return SelectByPolicy(
+      impl_->connection_policy, impl_->child_nodes.size(),
+      &impl_->next_child_node_index, impl_->selection_rng, [this](uint32_t i) {
+        return impl_->ChildNodeCost(impl_->child_nodes[i]);
+      });
+}
+
+void FanoutManager::SetHedgePolicy(HedgePolicy policy, double hedge_percentile,
+                                   double min_delay_ms) {
+  impl_->hedge_policy = policy;
+  impl_->hedge_percentile = hedge_percentile;
+  impl_->hedge_min_delay_ms = min_delay_ms;
+}
+
+void FanoutManager::SetCreditWindow(int window, OverflowPolicy overflow,
+                                    int max_queued) {
+  assert(window >= 0 && max_queued >= 0);
+  impl_->credit_window = window;
+  impl_->overflow_policy = overflow;
+  impl_->max_queued_requests = max_queued;
+  for (auto& node : impl_->child_nodes) {
+    node.stats->SetCreditWindow(window);
   }
 }
 
@@ -134,40 +245,216 @@ void FanoutManager::FanoutAll(QueryContext&& originating_query,
  */
 FanoutManager::FanoutManagerImpl::FanoutManagerImpl(
     const std::vector<addrinfo*>& _child_node_addr,
+    const std::vector<Transport>& _child_node_transport,
+    const std::vector<Framing>& _child_node_framing,
     const std::set<uint32_t>& _request_types, const NodeThread& _node_thread)
     : child_node_addr(_child_node_addr),
+      child_node_transport(_child_node_transport),
+      child_node_framing(_child_node_framing),
       next_request_id(0),
       request_types(_request_types),
-      node_thread(_node_thread) {
+      node_thread(_node_thread),
+      timer_wheel(_node_thread.get_event_base(), NodeThread::kTimerTickNs,
+                  kTimerWheelSlots),
+      free_trackers(nullptr),
+      tracker_by_id(kInitialRegistrySize),
+      tracker_by_id_mask(kInitialRegistrySize - 1),
+      connection_policy(ConnectionPolicy::kRoundRobin),
+      next_child_node_index(0),
+      selection_rng(_node_thread.get_thread_num() + 1),
+      hedge_policy(HedgePolicy::kNone),
+      hedge_percentile(95.0),
+      hedge_min_delay_ms(0.0),
+      hedge_delay_ms(-1.0),
+      recent_latency_next(0),
+      replies_since_hedge_update(0),
+      credit_window(0),
+      overflow_policy(OverflowPolicy::kQueue),
+      max_queued_requests(0) {
   child_nodes.resize(child_node_addr.size());
 
   // Create connection stats objects for each node
   for (int i = 0; i < child_nodes.size(); i++) {
     child_nodes[i].stats.reset(new ChildConnectionStats(request_types));
+    child_nodes[i].latency_ewma_ms = 0.0;
+  }
+}
+
+FanoutManager::FanoutManagerImpl::~FanoutManagerImpl() {
+  // Free trackers still outstanding, found through their first request
+  for (const auto& entry : tracker_by_id) {
+    if (entry.tracker != nullptr &&
+        entry.request_id == entry.tracker->user_tracker.starting_request_id) {
+      entry.tracker->Release();
+      delete entry.tracker;
+    }
+  }
+
+  while (free_trackers != nullptr) {
+    FanoutReplyTrackerInternal* next = free_trackers->next_free;
+    delete free_trackers;
+    free_trackers = next;
   }
 }
 
-ChildConnection& FanoutManager::FanoutManagerImpl::GetConnection(
+uint32_t FanoutManager::FanoutManagerImpl::SelectConnection(
     uint32_t child_node_id) {
   assert(child_node_id < child_nodes.size());
   assert(child_nodes[child_node_id].connections.size() > 0);
 
-  const auto& connection_ptr =
-      child_nodes[child_node_id]
-          .connections[child_nodes[child_node_id].next_connection_index];
-  child_nodes[child_node_id].next_connection_index =
-      (child_nodes[child_node_id].next_connection_index + 1) %
-      child_nodes[child_node_id].connections.size();
+  FanoutNode& node = child_nodes[child_node_id];
+  return SelectByPolicy(connection_policy, node.connections.size(),
+                        &node.next_connection_index, selection_rng,
+                        [this, &node](uint32_t i) {
+                          return ConnectionCost(node, i);
+                        });
+}
+
+double FanoutManager::FanoutManagerImpl::ConnectionCost(
+    const FanoutNode& node, uint32_t connection_index) const {
+  int outstanding =
+      node.connections[connection_index]->GetNumOutstandingRequests();
+  if (connection_policy == ConnectionPolicy::kLatencyEwma) {
+    return node.connection_latency_ewma_ms[connection_index] *
+           (outstanding + 1);
+  }
+  return outstanding;
+}
 
-  return *connection_ptr;
+double FanoutManager::FanoutManagerImpl::ChildNodeCost(
+    const FanoutNode& node) const {
+  int outstanding = node.GetNumOutstandingRequests();
+  if (connection_policy == ConnectionPolicy::kLatencyEwma) {
+    return node.latency_ewma_ms * (outstanding + 1);
+  }
+  return outstanding;
+}
+
+void FanoutManager::FanoutManagerImpl::RecordConnectionLatency(
+    uint32_t child_node_id, uint32_t connection_index, float latency_ms) {
+  if (connection_policy != ConnectionPolicy::kLatencyEwma) {
+    return;
+  }
+
+  FanoutNode& node = child_nodes[child_node_id];
+  double& connection_ewma = node.connection_latency_ewma_ms[connection_index];
+  connection_ewma += kLatencyEwmaWeight * (latency_ms - connection_ewma);
+  node.latency_ewma_ms +=
+      kLatencyEwmaWeight * (latency_ms - node.latency_ewma_ms);
+}
+
+uint32_t FanoutManager::FanoutManagerImpl::SendRequest(
+    uint32_t child_node_id, uint32_t request_type, uint64_t request_id,
+    const void* request_data, uint32_t request_data_length,
+    const QueryContext& query) {
+  FanoutNode& node = child_nodes[child_node_id];
+
+  // Requests already waiting for a credit go first
+  if (node.pending_requests.empty() && HasCredit(node)) {
+    uint32_t connection_index = SelectConnection(child_node_id);
+    node.connections[connection_index]->IssueRequest(
+        request_type, request_id, request_data, request_data_length,
+        GetTimeAccurateNano(), query.priority, query.GetRemainingBudgetUs());
+    return connection_index;
+  }
+
+  if (overflow_policy == OverflowPolicy::kFailFast ||
+      (max_queued_requests > 0 &&
+       node.pending_requests.size() >= max_queued_requests)) {
+    node.stats->LogThrottledRequest(request_type);
+    return kRefusedRequest;
+  }
+
+  const uint8_t* data = static_cast<const uint8_t*>(request_data);
+  node.pending_requests.emplace_back();
+  FanoutNode::PendingRequest& pending = node.pending_requests.back();
+  pending.request_id = request_id;
+  pending.request_type = request_type;
+  pending.queued_time = GetTimeAccurateNano();
+  pending.request_data.assign(data, data + request_data_length);
+  node.stats->LogQueuedRequest(request_type);
+  return kQueuedRequest;
+}
+
+bool FanoutManager::FanoutManagerImpl::HasCredit(const FanoutNode& node) const {
+  return credit_window == 0 ||
+         node.GetNumOutstandingRequests() < credit_window;
+}
+
+void FanoutManager::FanoutManagerImpl::SendPendingRequests(
+    uint32_t child_node_id) {
+  FanoutNode& node = child_nodes[child_node_id];
+  while (!node.pending_requests.empty() && HasCredit(node)) {
+    FanoutNode::PendingRequest& pending = node.pending_requests.front();
+    uint64_t now = GetTimeAccurateNano();
+    node.stats->LogQueueWait(pending.request_type, now - pending.queued_time);
+
+    // The tracker may have timed out or reached its quorum while waiting
+    RegistryEntry& entry =
+        tracker_by_id[pending.request_id & tracker_by_id_mask];
+    if (entry.tracker != nullptr && entry.request_id == pending.request_id) {
+      const QueryContext& query = entry.tracker->originating_query();
+      uint32_t connection_index = SelectConnection(child_node_id);
+      node.connections[connection_index]->IssueRequest(
+          pending.request_type, pending.request_id,
+          pending.request_data.data(), pending.request_data.size(), now,
+          query.priority, query.GetRemainingBudgetUs());
+      entry.connection_index = connection_index;
+      entry.tracker->connection_indices[entry.reply_index] = connection_index;
+    }
+    node.pending_requests.pop_front();
+  }
+}
+
+void FanoutManager::FanoutManagerImpl::RefuseReply(
+    FanoutReplyTrackerInternal& tracker, int reply_index) {
+  FanoutReply& reply = tracker.user_tracker.replies[reply_index];
+  reply.timed_out = false;
+  reply.status = ResponseStatus::kRejected;
+  tracker.user_tracker.num_replies_received++;
+}
+
+int FanoutNode::GetNumOutstandingRequests() const {
+  int outstanding = 0;
+  for (const auto& conn : connections) {
+    outstanding += conn->GetNumOutstandingRequests();
+  }
+  return outstanding;
+}
+
+FanoutReplyTrackerInternal* FanoutManager::FanoutManagerImpl::NewReplyTracker(
+    int num_requests, int quorum,
+    const FanoutManager::FanoutDoneCallback& callback,
+    QueryContext&& originating_query) {
+  FanoutReplyTrackerInternal* tracker = free_trackers;
+  if (tracker != nullptr) {
+    free_trackers = tracker->next_free;
+    tracker_pool_stats.hits++;
+  } else {
+    tracker = new FanoutReplyTrackerInternal(*this);
+    tracker_pool_stats.misses++;
+  }
+  tracker->Open(next_request_id, num_requests, quorum, callback,
+                std::move(originating_query));
+  return tracker;
+}
+
+void FanoutManager::FanoutManagerImpl::FreeReplyTracker(
+    FanoutReplyTrackerInternal* tracker) {
+  tracker->Release();
+  tracker->next_free = free_trackers;
+  free_trackers = tracker;
 }
 
 void FanoutManager::FanoutManagerImpl::RegisterReplyTracker(
-    std::shared_ptr<FanoutReplyTrackerInternal> tracker) {
-  for (int i = 0; i < tracker->user_tracker.num_requests; i++) {
-    uint64_t request_id = tracker->user_tracker.starting_request_id + i;
-    assert(tracker_by_id.count(request_id) == 0);
-    tracker_by_id[request_id] = tracker;
+    FanoutReplyTrackerInternal& tracker) {
+  const uint64_t starting_request_id = tracker.user_tracker.starting_request_id;
+  for (int i = 0; i < tracker.user_tracker.num_requests; i++) {
+    // Refused requests have their reply already
+    if (tracker.connection_indices[i] != kRefusedRequest) {
+      RegisterRequest(starting_request_id + i, tracker, i,
+                      tracker.connection_indices[i], false);
+    }
   }
 }
 
@@ -176,24 +463,167 @@ void FanoutManager::FanoutManagerImpl::UnregisterReplyTracker(
   const uint32_t num_requests = tracker.user_tracker.num_requests;
   const uint64_t starting_request_id = tracker.user_tracker.starting_request_id;
   for (int i = 0; i < num_requests; i++) {
-    uint64_t request_id = starting_request_id + i;
-    assert(tracker_by_id.count(request_id) == 1);
-    assert(tracker_by_id.at(request_id).get() == &tracker);
-    tracker_by_id.erase(request_id);
+    UnregisterRequest(starting_request_id + i, tracker);
+  }
+  for (uint64_t hedge_request_id : tracker.hedge_request_ids) {
+    if (hedge_request_id != FanoutReplyTrackerInternal::kNoHedge) {
+      UnregisterRequest(hedge_request_id, tracker);
+    }
+  }
+}
+
+void FanoutManager::FanoutManagerImpl::RegisterRequest(
+    uint64_t request_id, FanoutReplyTrackerInternal& tracker,
+    uint32_t reply_index, uint32_t connection_index, bool is_hedge) {
+  // Slot still taken by an older request, make room
+  while (tracker_by_id[request_id & tracker_by_id_mask].tracker != nullptr) {
+    GrowRegistry();
+  }
+  RegistryEntry& entry = tracker_by_id[request_id & tracker_by_id_mask];
+  entry.request_id = request_id;
+  entry.tracker = &tracker;
+  entry.reply_index = reply_index;
+  entry.connection_index = connection_index;
+  entry.is_hedge = is_hedge;
+}
+
+void FanoutManager::FanoutManagerImpl::UnregisterRequest(
+    uint64_t request_id, const FanoutReplyTrackerInternal& tracker) {
+  // Requests already settled by a hedge race are no longer registered
+  RegistryEntry& entry = tracker_by_id[request_id & tracker_by_id_mask];
+  if (entry.tracker == &tracker && entry.request_id == request_id) {
+    entry.tracker = nullptr;
+  }
+}
+
+const FanoutManager::FanoutManagerImpl::RegistryEntry*
+FanoutManager::FanoutManagerImpl::FindRequest(uint64_t request_id) const {
+  const RegistryEntry& entry = tracker_by_id[request_id & tracker_by_id_mask];
+  if (entry.tracker == nullptr || entry.request_id != request_id) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+void FanoutManager::FanoutManagerImpl::GrowRegistry() {
+  std::vector<RegistryEntry> old_registry(tracker_by_id.size() * 2);
+  old_registry.swap(tracker_by_id);
+  tracker_by_id_mask = tracker_by_id.size() - 1;
+
+  // Live request IDs are distinct, so they cannot collide after doubling
+  for (const auto& entry : old_registry) {
+    if (entry.tracker != nullptr) {
+      tracker_by_id[entry.request_id & tracker_by_id_mask] = entry;
+    }
   }
 }
 
 void FanoutManager::FanoutManagerImpl::RegisterTrackerTimeout(
-    const std::shared_ptr<FanoutReplyTrackerInternal>& tracker,
-    double timeout_ms) {
-  // Make a heap-allocated shared_ptr to not leak the tracker
-  auto timeout_args = new TimeoutArgs(*this, tracker);
-  tracker->timeout_event = evtimer_new(
-      node_thread.get_event_base(),
-      FanoutManager::FanoutManagerImpl::TimeoutCallback, timeout_args);
-  timeval tv;
-  DoubleToTv(timeout_ms / 1000, &tv);
-  evtimer_add(tracker->timeout_event, &tv);
+    FanoutReplyTrackerInternal& tracker, double timeout_ms) {
+  timer_wheel.Schedule(
+      &tracker.timeout_timer,
+      GetTimeAccurateNano() + static_cast<uint64_t>(timeout_ms * 1000000));
+}
+
+void FanoutManager::FanoutManagerImpl::StartHedging(
+    FanoutReplyTrackerInternal& tracker, const FanoutRequest* requests,
+    bool shared_request) {
+  if (hedge_policy == HedgePolicy::kNone) {
+    return;
+  }
+
+  const int num_requests = tracker.user_tracker.num_requests;
+  if (hedge_policy == HedgePolicy::kTied) {
+    for (int i = 0; i < num_requests; i++) {
+      if (!tracker.user_tracker.replies[i].timed_out) {
+        continue;
+      }
+      const FanoutRequest& request = requests[shared_request ? 0 : i];
+      IssueHedge(tracker, i, request.request_data, request.request_data_length);
+    }
+    return;
+  }
+
+  // Not enough replies seen yet to know when a request is slow
+  if (hedge_delay_ms < 0) {
+    return;
+  }
+
+  // Keep the payloads around for the backups sent from HedgeCallback
+  for (int i = 0; i < num_requests; i++) {
+    const FanoutRequest& request = requests[shared_request ? 0 : i];
+    if (shared_request && i > 0) {
+      tracker.request_extents.push_back(tracker.request_extents[0]);
+      continue;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(request.request_data);
+    FanoutReplyTrackerInternal::RequestExtent extent = {
+        static_cast<uint32_t>(tracker.request_data.size()),
+        request.request_data_length};
+    tracker.request_data.insert(tracker.request_data.end(), data,
+                                data + request.request_data_length);
+    tracker.request_extents.push_back(extent);
+  }
+
+  timer_wheel.Schedule(
+      &tracker.hedge_timer,
+      GetTimeAccurateNano() + static_cast<uint64_t>(hedge_delay_ms * 1000000));
+}
+
+void FanoutManager::FanoutManagerImpl::IssueHedge(
+    FanoutReplyTrackerInternal& tracker, int reply_index,
+    const void* request_data, uint32_t request_data_length) {
+  const FanoutReply& reply = tracker.user_tracker.replies[reply_index];
+
+  // A backup would only add to the load of a child that is already behind
+  FanoutNode& node = child_nodes[reply.child_node_id];
+  if (!node.pending_requests.empty() || !HasCredit(node)) {
+    return;
+  }
+
+  // Put the backup on a different connection than the original, if any
+  uint32_t connection_index = SelectConnection(reply.child_node_id);
+  if (connection_index == tracker.connection_indices[reply_index] &&
+      node.connections.size() > 1) {
+    connection_index = (connection_index + 1) % node.connections.size();
+  }
+  uint64_t request_id = next_request_id++;
+  const QueryContext& query = tracker.originating_query();
+  node.connections[connection_index]->IssueRequest(
+      reply.request_type, request_id, request_data, request_data_length,
+      GetTimeAccurateNano(), query.priority, query.GetRemainingBudgetUs());
+
+  RegisterRequest(request_id, tracker, reply_index, connection_index, true);
+  tracker.hedge_request_ids[reply_index] = request_id;
+  child_nodes[reply.child_node_id].stats->LogHedgedRequest(reply.request_type);
+}
+
+void FanoutManager::FanoutManagerImpl::RecordReplyLatency(float latency_ms) {
+  if (hedge_policy != HedgePolicy::kHedged) {
+    return;
+  }
+
+  if (recent_latency_ms.size() < kHedgeLatencyWindow) {
+    recent_latency_ms.push_back(latency_ms);
+  } else {
+    recent_latency_ms[recent_latency_next] = latency_ms;
+    recent_latency_next = (recent_latency_next + 1) % kHedgeLatencyWindow;
+  }
+
+  if (recent_latency_ms.size() < kHedgeMinSamples ||
+      ++replies_since_hedge_update < kHedgeUpdateInterval) {
+    return;
+  }
+  replies_since_hedge_update = 0;
+
+  // Refresh the delay from the percentile of the window
+  hedge_scratch.assign(recent_latency_ms.begin(), recent_latency_ms.end());
+  size_t rank = std::min(
+      hedge_scratch.size() - 1,
+      static_cast<size_t>(hedge_percentile / 100 * hedge_scratch.size()));
+  std::nth_element(hedge_scratch.begin(), hedge_scratch.begin() + rank,
+                   hedge_scratch.end());
+  hedge_delay_ms = std::max<double>(hedge_scratch[rank], hedge_min_delay_ms);
 }
 
 void FanoutManager::FanoutManagerImpl::CloseTracker(
@@ -204,70 +634,103 @@ void FanoutManager::FanoutManagerImpl::CloseTracker(
 void FanoutManager::FanoutManagerImpl::CloseTracker(
     FanoutManagerImpl& manager_impl, FanoutReplyTrackerInternal& tracker) {
   tracker.user_tracker.closed = true;  // Close the tracker
-  tracker.done_callback(tracker.originating_query,
+  tracker.done_callback(tracker.originating_query(),
                         tracker.user_tracker);  // Call user-callback
-  if (tracker.timeout_event != nullptr) {
-    // Deregister timeout event
-    auto timeout_args = reinterpret_cast<TimeoutArgs*>(
-        event_get_callback_arg(tracker.timeout_event));
-    delete timeout_args;
-    event_free(tracker.timeout_event);
-    tracker.timeout_event = nullptr;
-  }
-  // Have to do this last, because when the last one is deleted the
-  // reference becomes no-good (shared-ptr) will clean it up from under you
+  // Disarm the timers, they are kept for the next use of the tracker
+  manager_impl.timer_wheel.Cancel(&tracker.timeout_timer);
+  manager_impl.timer_wheel.Cancel(&tracker.hedge_timer);
   manager_impl.UnregisterReplyTracker(tracker);  // remove from tracker table
+  manager_impl.FreeReplyTracker(&tracker);
+}
+
+bool FanoutManager::FanoutManagerImpl::CloseOnQuorum(
+    FanoutManagerImpl& manager_impl, FanoutReplyTrackerInternal& tracker) {
+  if (tracker.user_tracker.num_replies_received < tracker.quorum) {
+    return false;
+  }
+  // Stragglers are given up on, their requests freed by CloseTracker
+  if (tracker.quorum < tracker.user_tracker.num_requests) {
+    for (const auto& straggler : tracker.user_tracker.replies) {
+      if (straggler.timed_out) {
+        manager_impl.child_nodes[straggler.child_node_id]
+            .stats->LogAbandonedRequest(straggler.request_type);
+      }
+    }
+  }
+  CloseTracker(manager_impl, tracker);
+  return true;
 }
 
 void FanoutManager::FanoutManagerImpl::ResponseCallback(
-    FanoutManager& manager, ResponseContext& context) {
-  // Get the tracking data structure in the map
-  const auto& tracker_it =
-      manager.impl_->tracker_by_id.find(context.request_id);
-  if (tracker_it == manager.impl_->tracker_by_id.end()) {
-    return;
-  } else {
-    FanoutReplyTrackerInternal& tracker = *tracker_it->second;
+    FanoutManager& manager, uint32_t child_node_id, ResponseContext& context) {
+  // Get the tracking data structure in the registry
+  const RegistryEntry* entry = manager.impl_->FindRequest(context.request_id);
+  if (entry != nullptr) {
+    FanoutReplyTrackerInternal& tracker = *entry->tracker;
+    const uint32_t index = entry->reply_index;
+    const uint32_t connection_index = entry->connection_index;
+    const bool is_hedge = entry->is_hedge;
 
     // Debug checking
-    assert(context.request_id >= tracker.user_tracker.starting_request_id);
-    assert(context.request_id < tracker.user_tracker.starting_request_id +
-                                    tracker.user_tracker.num_requests);
+    assert(index < tracker.user_tracker.num_requests);
 
-    // Find the index in the tracker holding the reply struct
-    int index = context.request_id - tracker.user_tracker.starting_request_id;
+    // Find the reply struct this request was sent for
     FanoutReply& reply = tracker.user_tracker.replies[index];
     assert(reply.request_type == context.type);
     assert(reply.reply_data == nullptr);
 
+    // If the request was duplicated, this reply won the race; forget both
+    // copies so that the loser is ignored when it arrives
+    uint64_t hedge_request_id = tracker.hedge_request_ids[index];
+    if (hedge_request_id != FanoutReplyTrackerInternal::kNoHedge) {
+      manager.impl_->UnregisterRequest(
+          tracker.user_tracker.starting_request_id + index, tracker);
+      manager.impl_->UnregisterRequest(hedge_request_id, tracker);
+      if (is_hedge) {
+        manager.impl_->child_nodes[reply.child_node_id].stats->LogHedgeWin(
+            reply.request_type);
+      }
+    }
+
     // Fill in the fields of the reply object
     reply.timed_out = false;
-    // Allocate memory to copy the payload data
+    reply.status = context.status;
+    // Allocate memory to copy the payload data, gathering it straight from
+    // the receive buffers
     uint8_t* payload_copy = new uint8_t[context.payload_length];
-    memcpy(payload_copy, context.payload, context.payload_length);
+    uint8_t* dest = payload_copy;
+    for (int i = 0; i < context.num_payload_segments; i++) {
+      memcpy(dest, context.payload_segments[i].iov_base,
+             context.payload_segments[i].iov_len);
+      dest += context.payload_segments[i].iov_len;
+    }
     reply.reply_data = std::unique_ptr<uint8_t[]>(payload_copy);
     reply.reply_data_length = context.payload_length;
     reply.latency_ms =
         (context.response_timestamp - context.request_timestamp) / 1000000.0;
+    // A shed request returns quickly, which says nothing about how fast the
+    // child serves requests
+    if (reply.status == ResponseStatus::kOk) {
+      manager.impl_->RecordReplyLatency(reply.latency_ms);
+      manager.impl_->RecordConnectionLatency(
+          reply.child_node_id, connection_index, reply.latency_ms);
+    }
 
-    // Update tracker, check to see if all responses received
+    // Update tracker, check to see if enough responses received
     tracker.user_tracker.num_replies_received++;
-    if (tracker.user_tracker.num_replies_received ==
-        tracker.user_tracker.num_requests) {
-      CloseTracker(manager, tracker);
-    }
+    CloseOnQuorum(*manager.impl_, tracker);
   }
+
+  // Every response, stale ones included, frees a credit of the child
+  manager.impl_->SendPendingRequests(child_node_id);
 }
 
 void FanoutManager::FanoutManagerImpl::ChildConnectionClosedHandler(
     const FanoutManager& manager, const ChildConnection& conn) {}
 
-void FanoutManager::FanoutManagerImpl::TimeoutCallback(evutil_socket_t listener,
-                                                       int16_t event,
-                                                       void* arg) {
-  auto args = reinterpret_cast<TimeoutArgs*>(arg);
-  FanoutManager::FanoutManagerImpl& manager_impl = std::get<0>(*args);
-  auto tracker = std::get<1>(*args);
+void FanoutManager::FanoutManagerImpl::TimeoutCallback(void* arg) {
+  auto tracker = reinterpret_cast<FanoutReplyTrackerInternal*>(arg);
+  FanoutManager::FanoutManagerImpl& manager_impl = tracker->manager;
 
   // Log timed out requests
   for (const auto& reply_tracker : tracker->user_tracker.replies) {
@@ -280,12 +743,31 @@ void FanoutManager::FanoutManagerImpl::TimeoutCallback(evutil_socket_t listener,
   CloseTracker(manager_impl, *tracker);
 }
 
+void FanoutManager::FanoutManagerImpl::HedgeCallback(void* arg) {
+  auto tracker = reinterpret_cast<FanoutReplyTrackerInternal*>(arg);
+  FanoutManager::FanoutManagerImpl& manager_impl = tracker->manager;
+
+  // Back up every request that is still waiting for its reply
+  const int num_requests = tracker->user_tracker.num_requests;
+  for (int i = 0; i < num_requests; i++) {
+    if (tracker->user_tracker.replies[i].timed_out &&
+        tracker->hedge_request_ids[i] ==
+            FanoutReplyTrackerInternal::kNoHedge) {
+      const auto& extent = tracker->request_extents[i];
+      manager_impl.IssueHedge(*tracker, i,
+                              tracker->request_data.data() + extent.offset,
+                              extent.length);
+    }
+  }
+}
+
 /**
  * Implementation details of FanoutReplyTrackerInternal
  */
 static FanoutReply EmptyFanoutReply() {
   FanoutReply empty;
   empty.timed_out = true;
+  empty.status = ResponseStatus::kOk;
   empty.child_node_id = 0;
   empty.request_type = 0;
   empty.reply_data = nullptr;
@@ -295,31 +777,69 @@ static FanoutReply EmptyFanoutReply() {
   return empty;
 }
 
+void FanoutReplyList::Reset(size_t num_replies) {
+  if (num_replies <= static_cast<size_t>(kInlineReplies)) {
+    data_ = inline_;
+  } else {
+    if (num_replies > spill_capacity_) {
+      spill_.reset(new FanoutReply[num_replies]);
+      spill_capacity_ = num_replies;
+    }
+    data_ = spill_.get();
+  }
+  size_ = num_replies;
+
+  for (size_t i = 0; i < size_; i++) {
+    data_[i] = EmptyFanoutReply();
+  }
+}
+
 FanoutReplyTrackerInternal::FanoutReplyTrackerInternal(
-    uint64_t starting_request_id, int num_requests,
+    FanoutManager::FanoutManagerImpl& _manager)
+    : quorum(0),
+      manager(_manager),
+      timeout_timer(FanoutManager::FanoutManagerImpl::TimeoutCallback, this),
+      next_free(nullptr),
+      hedge_timer(FanoutManager::FanoutManagerImpl::HedgeCallback, this),
+      is_open(false) {}
+
+FanoutReplyTrackerInternal::~FanoutReplyTrackerInternal() {
+  assert(!is_open);
+  manager.timer_wheel.Cancel(&timeout_timer);
+  manager.timer_wheel.Cancel(&hedge_timer);
+}
+
+void FanoutReplyTrackerInternal::Open(
+    uint64_t starting_request_id, int num_requests, int _quorum,
     const FanoutManager::FanoutDoneCallback& _done_callback,
-    QueryContext&& _originating_query)
-    : done_callback(_done_callback),
-      timeout_event(nullptr),
-      originating_query(std::move(_originating_query)) {
+    QueryContext&& _originating_query) {
+  assert(!is_open);
+  done_callback = _done_callback;
+  quorum = _quorum > 0 && _quorum < num_requests ? _quorum : num_requests;
+  new (&originating_query_storage) QueryContext(std::move(_originating_query));
+  is_open = true;
+
   // Initialize user_tracker
   user_tracker.starting_request_id = starting_request_id;
   user_tracker.num_requests = num_requests;
   user_tracker.num_replies_received = 0;
   user_tracker.closed = false;
-
-  // Fill up FanoutReply vector
-  user_tracker.replies.reserve(num_requests);
-  for (int i = 0; i < num_requests; i++) {
-    user_tracker.replies.emplace_back(EmptyFanoutReply());
-  }
+  user_tracker.replies.Reset(num_requests);
+  hedge_request_ids.assign(num_requests, kNoHedge);
+  connection_indices.resize(num_requests);
 }
 
-FanoutReplyTrackerInternal::~FanoutReplyTrackerInternal() {
-  if (timeout_event != nullptr) {
-    event_free(timeout_event);
-    timeout_event = nullptr;
+void FanoutReplyTrackerInternal::Release() {
+  assert(is_open);
+  originating_query().~QueryContext();
+  is_open = false;
+
+  // Drop reply payloads now rather than on the next use
+  for (auto& reply : user_tracker.replies) {
+    reply.reply_data.reset();
   }
+  request_data.clear();
+  request_extents.clear();
 }
 }  // namespace oldisim
 
@@ -17,14 +17,22 @@
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 
+#include <stdint.h>
+
+#include <deque>
+#include <random>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <utility>
-#include <unordered_map>
 #include <vector>
 
+#include "ObjectPool.h"
+#include "TimerWheel.h"
 #include "oldisim/ChildConnectionStats.h"
 #include "oldisim/FanoutManager.h"
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
 #include "oldisim/QueryContext.h"
 
 namespace oldisim {
@@ -33,64 +41,208 @@ class ChildConnection;
 class FanoutManager;
 class NodeThread;
 
+/**
+ * Book-keeping for one outstanding fanout. Trackers are owned by their
+ * FanoutManager from the call to Fanout until CloseTracker, and are then
+ * put on the manager's intrusive free list for reuse, keeping their reply
+ * storage and timers. The originating query is constructed in place
+ * on Open and destroyed on Release, as QueryContext cannot be reassigned.
+ */
 struct FanoutReplyTrackerInternal {
   FanoutReplyTracker user_tracker;
   FanoutManager::FanoutDoneCallback done_callback;
-  event* timeout_event;
-  QueryContext originating_query;
+  int quorum;  // Replies needed to close, at most num_requests
+  FanoutManager::FanoutManagerImpl& manager;
+  TimerWheel::Timer timeout_timer;
+  FanoutReplyTrackerInternal* next_free;
+
+  // Hedging state. Request payloads are copied only while a delayed hedge
+  // may still need them; hedge_request_ids holds the ID of the backup sent
+  // for each reply, or kNoHedge
+  static constexpr uint64_t kNoHedge = UINT64_MAX;
+  struct RequestExtent {
+    uint32_t offset;
+    uint32_t length;
+  };
+  TimerWheel::Timer hedge_timer;
+  std::vector<uint8_t> request_data;
+  std::vector<RequestExtent> request_extents;
+  std::vector<uint64_t> hedge_request_ids;
+
+  // Connection index each original request went out on, per reply
+  std::vector<uint32_t> connection_indices;
 
-  FanoutReplyTrackerInternal(
-      uint64_t starting_request_id, int num_requests,
-      const FanoutManager::FanoutDoneCallback& _done_callback,
-      QueryContext&& _originating_query);
+  explicit FanoutReplyTrackerInternal(
+      FanoutManager::FanoutManagerImpl& _manager);
+  FanoutReplyTrackerInternal(const FanoutReplyTrackerInternal& that) = delete;
   ~FanoutReplyTrackerInternal();
+
+  void Open(uint64_t starting_request_id, int num_requests, int _quorum,
+            const FanoutManager::FanoutDoneCallback& _done_callback,
+            QueryContext&& _originating_query);
+  void Release();
+
+  QueryContext& originating_query() {
+    return *reinterpret_cast<QueryContext*>(&originating_query_storage);
+  }
+
+ private:
+  typename std::aligned_storage<sizeof(QueryContext),
+                                alignof(QueryContext)>::type
+      originating_query_storage;
+  bool is_open;
 };
 
 struct FanoutNode {
   std::vector<std::unique_ptr<ChildConnection>> connections;
   uint32_t next_connection_index;
   std::unique_ptr<ChildConnectionStats> stats;
+
+  // Reply latency averages for kLatencyEwma, per connection and for the
+  // whole node
+  std::vector<double> connection_latency_ewma_ms;
+  double latency_ewma_ms;
+
+  // Requests held back by a full credit window, oldest first
+  struct PendingRequest {
+    uint64_t request_id;
+    uint32_t request_type;
+    uint64_t queued_time;
+    std::vector<uint8_t> request_data;
+  };
+  std::deque<PendingRequest> pending_requests;
+
+  int GetNumOutstandingRequests() const;
 };
 
 struct FanoutManager::FanoutManagerImpl {
   const std::vector<addrinfo*>& child_node_addr;
+  const std::vector<Transport>& child_node_transport;
+  const std::vector<Framing>& child_node_framing;
   std::vector<FanoutNode> child_nodes;
   uint64_t next_request_id;
   const std::set<uint32_t>& request_types;
   const NodeThread& node_thread;
 
-  // Facilitie to keep track of outstanding requests
-  std::unordered_map<uint64_t, std::shared_ptr<FanoutReplyTrackerInternal>>
-      tracker_by_id;
+  // Timeout and hedge timers of all trackers, ticking on the event base of
+  // node_thread
+  TimerWheel timer_wheel;
+
+  // Closed trackers kept for reuse, linked through next_free
+  FanoutReplyTrackerInternal* free_trackers;
+  ObjectPoolStats tracker_pool_stats;
+
+  // Outstanding requests indexed by request ID modulo the registry size.
+  // Request IDs are handed out sequentially, so the slots of live requests
+  // only collide once more IDs are in flight than there are slots, in which
+  // case the registry doubles. The stored ID tells a live request from a
+  // stale reply that maps onto a reused slot.
+  struct RegistryEntry {
+    uint64_t request_id;
+    FanoutReplyTrackerInternal* tracker;
+    uint32_t reply_index;
+    uint32_t connection_index;
+    bool is_hedge;
+  };
+  std::vector<RegistryEntry> tracker_by_id;
+  uint64_t tracker_by_id_mask;
+
+  // Connection and child node selection
+  ConnectionPolicy connection_policy;
+  uint32_t next_child_node_index;
+  std::minstd_rand selection_rng;
+
+  // Hedging policy, and a window of recent reply latencies whose
+  // hedge_percentile sets the hedge delay. The delay stays negative, which
+  // disables delayed hedges, until the window has enough samples.
+  HedgePolicy hedge_policy;
+  double hedge_percentile;
+  double hedge_min_delay_ms;
+  double hedge_delay_ms;
+  std::vector<float> recent_latency_ms;
+  size_t recent_latency_next;
+  uint32_t replies_since_hedge_update;
+  std::vector<float> hedge_scratch;
+
+  // Credit window per child node, see SetCreditWindow. 0 leaves it open.
+  int credit_window;
+  OverflowPolicy overflow_policy;
+  size_t max_queued_requests;
 
   FanoutManagerImpl(const std::vector<addrinfo*>& _child_node_addr,
+                    const std::vector<Transport>& _child_node_transport,
+                    const std::vector<Framing>& _child_node_framing,
                     const std::set<uint32_t>& _request_types,
                     const NodeThread& _node_thread);
-  ChildConnection& GetConnection(uint32_t child_node_id);
+  ~FanoutManagerImpl();
+  uint32_t SelectConnection(uint32_t child_node_id);
+  double ConnectionCost(const FanoutNode& node,
+                        uint32_t connection_index) const;
+  double ChildNodeCost(const FanoutNode& node) const;
+  void RecordConnectionLatency(uint32_t child_node_id,
+                               uint32_t connection_index, float latency_ms);
+
+  // Send a request to a child node on the connection chosen by the policy,
+  // unless its credit window is full. Returns the connection index, or
+  // kQueuedRequest or kRefusedRequest if the request was held back or
+  // refused instead
+  static constexpr uint32_t kQueuedRequest = UINT32_MAX;
+  static constexpr uint32_t kRefusedRequest = UINT32_MAX - 1;
+  uint32_t SendRequest(uint32_t child_node_id, uint32_t request_type,
+                       uint64_t request_id, const void* request_data,
+                       uint32_t request_data_length,
+                       const QueryContext& query);
+  bool HasCredit(const FanoutNode& node) const;
+  // Send held back requests while the child has credits, skipping those of
+  // trackers that have been closed meanwhile
+  void SendPendingRequests(uint32_t child_node_id);
+  // Complete a reply whose request was refused by SendRequest
+  void RefuseReply(FanoutReplyTrackerInternal& tracker, int reply_index);
+
+  // Take a tracker off the free list, or allocate one if it is empty
+  FanoutReplyTrackerInternal* NewReplyTracker(
+      int num_requests, int quorum,
+      const FanoutManager::FanoutDoneCallback& callback,
+      QueryContext&& originating_query);
+  void FreeReplyTracker(FanoutReplyTrackerInternal* tracker);
 
   // Methods to register/deregister a tracker
-  void RegisterReplyTracker(
-      std::shared_ptr<FanoutReplyTrackerInternal> tracker);
+  void RegisterReplyTracker(FanoutReplyTrackerInternal& tracker);
   void UnregisterReplyTracker(const FanoutReplyTrackerInternal& tracker);
-  void RegisterTrackerTimeout(
-      const std::shared_ptr<FanoutReplyTrackerInternal>& tracker,
-      double timeout_ms);
+  void RegisterRequest(uint64_t request_id,
+                       FanoutReplyTrackerInternal& tracker,
+                       uint32_t reply_index, uint32_t connection_index,
+                       bool is_hedge);
+  void UnregisterRequest(uint64_t request_id,
+                         const FanoutReplyTrackerInternal& tracker);
+  const RegistryEntry* FindRequest(uint64_t request_id) const;
+  void GrowRegistry();
+
+  // Hedging helpers. requests holds either one request per reply, or a
+  // single request shared by all replies in the case of FanoutAll
+  void StartHedging(FanoutReplyTrackerInternal& tracker,
+                    const FanoutRequest* requests, bool shared_request);
+  void IssueHedge(FanoutReplyTrackerInternal& tracker, int reply_index,
+                  const void* request_data, uint32_t request_data_length);
+  void RecordReplyLatency(float latency_ms);
+  void RegisterTrackerTimeout(FanoutReplyTrackerInternal& tracker,
+                              double timeout_ms);
 
   // Helper method when closing a tracker
   static void CloseTracker(FanoutManager& manager,
                            FanoutReplyTrackerInternal& tracker);
   static void CloseTracker(FanoutManagerImpl& manager_impl,
                            FanoutReplyTrackerInternal& tracker);
+  // Close the tracker if it has its quorum of replies, giving up on the
+  // stragglers. Returns whether it was closed
+  static bool CloseOnQuorum(FanoutManagerImpl& manager_impl,
+                            FanoutReplyTrackerInternal& tracker);
 
-  static void ResponseCallback(FanoutManager& manager,
+  static void ResponseCallback(FanoutManager& manager, uint32_t child_node_id,
                                ResponseContext& response);
   static void ChildConnectionClosedHandler(const FanoutManager& manager,
                                            const ChildConnection& conn);
-  static void TimeoutCallback(evutil_socket_t listener, int16_t event,
-                              void* arg);
-
-  // Typedef for timeout argument
-  typedef std::tuple<FanoutManagerImpl&,
-                     std::shared_ptr<FanoutReplyTrackerInternal>> TimeoutArgs;
+  static void TimeoutCallback(void* arg);
+  static void HedgeCallback(void* arg);
 };
 }  // namespace oldisim
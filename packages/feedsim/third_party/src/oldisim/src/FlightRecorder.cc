@@ -0,0 +1,172 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/FlightRecorder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+namespace {
+bool flight_recorder_enabled = false;
+FlightRecorderOptions flight_recorder_options;
+uint64_t threshold_ns = 0;
+
+/**
+ * The records of one responding thread, which is their only writer. Every
+ * slot has a sequence that is odd while the writer is in it, so readers
+ * can drop the copies a write tore.
+ */
+struct FlightRing {
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    FlightRecord record;
+  };
+
+  explicit FlightRing(size_t capacity) : slots(capacity), next(0) {}
+
+  std::vector<Slot> slots;
+  // Records written so far
+  std::atomic<uint64_t> next;
+};
+
+// Rings outlive their threads, so records of exited threads stay readable
+std::mutex rings_lock;
+std::vector<std::unique_ptr<FlightRing>>& Rings() {
+  static auto rings = new std::vector<std::unique_ptr<FlightRing>>();
+  return *rings;
+}
+
+FlightRing& ThisThreadRing() {
+  static thread_local FlightRing* ring = nullptr;
+  if (ring == nullptr) {
+    std::unique_ptr<FlightRing> new_ring(
+        new FlightRing(flight_recorder_options.records_per_thread));
+    ring = new_ring.get();
+    std::lock_guard<std::mutex> lock(rings_lock);
+    Rings().push_back(std::move(new_ring));
+  }
+  return *ring;
+}
+
+void WriteMicros(std::ostream& output, uint64_t ns) {
+  output << ns / 1000 << "." << (ns % 1000) / 100;
+}
+}  // namespace
+
+void EnableFlightRecorder(const FlightRecorderOptions& options) {
+  if (options.records_per_thread == 0) {
+    DIE("The flight recorder needs room for at least one record per thread");
+  }
+  flight_recorder_options = options;
+  threshold_ns = options.threshold_us * 1000;
+  flight_recorder_enabled = true;
+}
+
+bool IsFlightRecorderEnabled() { return flight_recorder_enabled; }
+
+const FlightRecorderOptions& GetFlightRecorderOptions() {
+  return flight_recorder_options;
+}
+
+void RecordFlight(const FlightRecord& record) {
+  if (record.response_ns < threshold_ns) {
+    return;
+  }
+  FlightRing& ring = ThisThreadRing();
+  uint64_t index = ring.next.load(std::memory_order_relaxed);
+  FlightRing::Slot& slot = ring.slots[index % ring.slots.size()];
+  uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.record = record;
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+  ring.next.store(index + 1, std::memory_order_release);
+}
+
+std::vector<FlightRecord> GetFlightRecords() {
+  std::vector<FlightRecord> records;
+  std::lock_guard<std::mutex> lock(rings_lock);
+  for (const auto& ring : Rings()) {
+    const uint64_t size = ring->slots.size();
+    const uint64_t next = ring->next.load(std::memory_order_acquire);
+    for (uint64_t i = next > size ? next - size : 0; i < next; i++) {
+      const FlightRing::Slot& slot = ring->slots[i % size];
+      uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence % 2 != 0) {
+        continue;
+      }
+      FlightRecord copy = slot.record;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+        records.push_back(copy);
+      }
+    }
+  }
+  std::sort(records.begin(), records.end(),
+            [](const FlightRecord& a, const FlightRecord& b) {
+              return a.arrival_time < b.arrival_time;
+            });
+  return records;
+}
+
+void WriteFlightRecordsJson(const std::vector<FlightRecord>& records,
+                            std::ostream& output) {
+  const auto& stage_names = flight_recorder_options.stage_names;
+  output << "{\"threshold_us\": " << flight_recorder_options.threshold_us
+         << ", \"records\": [";
+  for (size_t i = 0; i < records.size(); i++) {
+    const FlightRecord& record = records[i];
+    const FlightTrace& trace = record.trace;
+    output << (i == 0 ? "\n" : ",\n") << "{\"request_id\": "
+           << record.request_id << ", \"type\": " << record.type
+           << ", \"status\": " << static_cast<int>(record.status)
+           << ", \"arrival_time_us\": ";
+    WriteMicros(output, record.arrival_time);
+    output << ", \"queue_thread\": " << trace.queue_thread
+           << ", \"dequeue_thread\": " << trace.dequeue_thread
+           << ", \"dequeue_cpu\": " << trace.dequeue_cpu << ", \"stolen\": "
+           << (trace.queue_thread >= 0 && trace.dequeue_thread >= 0 &&
+                       trace.queue_thread != trace.dequeue_thread
+                   ? "true"
+                   : "false")
+           << ", \"queue_us\": ";
+    WriteMicros(output, record.dequeue_ns);
+    output << ", \"latency_us\": ";
+    WriteMicros(output, record.response_ns);
+    output << ", \"response_tid\": " << record.response_tid
+           << ", \"response_cpu\": " << record.response_cpu
+           << ", \"stages\": [";
+    for (int s = 0; s < trace.num_stages; s++) {
+      const FlightStage& stage = trace.stages[s];
+      output << (s == 0 ? "" : ", ") << "{\"stage\": \"";
+      if (stage.stage < stage_names.size()) {
+        output << stage_names[stage.stage];
+      } else {
+        output << static_cast<int>(stage.stage);
+      }
+      output << "\", \"end_us\": ";
+      WriteMicros(output, stage.end_ns);
+      output << ", \"cpu\": " << stage.cpu << "}";
+    }
+    output << "]}";
+  }
+  output << "\n]}\n";
+}
+}  // namespace oldisim
@@ -0,0 +1,34 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/IoEngine.h"
+
+#include "IoUringEngine.h"
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+static IoEngine current_io_engine = IoEngine::kLibevent;
+
+void SetIoEngine(IoEngine engine) {
+  if (engine == IoEngine::kIoUring && !IsIoUringSupported()) {
+    DIE("io_uring engine requested but not supported on this system");
+  }
+  current_io_engine = engine;
+}
+
+IoEngine GetIoEngine() { return current_io_engine; }
+
+bool IsIoUringSupported() { return IoUringSupported(); }
+}  // namespace oldisim
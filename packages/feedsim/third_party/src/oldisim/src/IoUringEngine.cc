@@ -0,0 +1,487 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "IoUringEngine.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#ifdef OLDISIM_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+#ifdef OLDISIM_HAVE_LIBURING
+
+namespace {
+
+const unsigned kRingEntries = 1024;
+// Provided receive buffers per thread, must be a power of two
+const unsigned kNumRecvBuffers = 256;
+const size_t kRecvBufferSize = 16 * 1024;
+const int kRecvBufferGroup = 0;
+const int kMaxSendIovecs = 64;
+
+// Operation kinds, stored in the low bits of the SQE user data
+const uint64_t kRecvOp = 0;
+const uint64_t kSendOp = 1;
+const uint64_t kCancelOp = 2;
+const uint64_t kOpMask = 3;
+
+class IoUringEngine;
+
+/**
+ * Per-connection state. The connection code talks to one end of a
+ * bufferevent pair; the engine drives the other end, called far here.
+ * Data written by the connection shows up in the input of far and is sent
+ * from there, received data is added to the output of far.
+ */
+struct IoUringSocket {
+  IoUringEngine* engine;
+  int fd;
+  bufferevent* far;
+  evbuffer* sending;  // Data owned by the in-flight sendmsg
+  iovec send_iov[kMaxSendIovecs];
+  msghdr send_msg;
+  bool recv_armed;
+  bool send_in_flight;
+  bool peer_closed;
+  bool closing;
+  int ops_in_flight;
+};
+
+class IoUringEngine {
+ public:
+  explicit IoUringEngine(event_base* base);
+
+  event_base* base() const { return base_; }
+  bufferevent* Attach(int fd, int options);
+  void Detach(IoUringSocket* socket);
+
+  static void FarReadCallback(bufferevent* bev, void* arg);
+
+ private:
+  event_base* base_;
+  io_uring ring_;
+  io_uring_buf_ring* recv_ring_;
+  char* recv_buffers_;
+  // Sockets whose multishot recv stopped because all buffers were in use
+  std::vector<IoUringSocket*> starved_sockets_;
+  int event_fd_;
+  event* completion_event_;
+  event* submit_event_;
+  bool submit_pending_;
+
+  io_uring_sqe* GetSqe();
+  void RequestSubmit();
+  void ArmRecv(IoUringSocket* socket);
+  void QueueSend(IoUringSocket* socket);
+  void HandleRecv(IoUringSocket* socket, int res, uint32_t flags);
+  void HandleSend(IoUringSocket* socket, int res);
+  void MarkPeerClosed(IoUringSocket* socket);
+  void MaybeFinishClose(IoUringSocket* socket);
+  void ReturnRecvBuffer(const void* data);
+
+  static void CompletionCallback(evutil_socket_t fd, int16_t flags, void* arg);
+  static void SubmitCallback(evutil_socket_t fd, int16_t flags, void* arg);
+  static void ReleaseRecvBuffer(const void* data, size_t length, void* arg);
+};
+
+// Engines live as long as the event loop of their thread
+thread_local IoUringEngine* current_engine = nullptr;
+
+uint64_t MakeUserData(IoUringSocket* socket, uint64_t op) {
+  return reinterpret_cast<uint64_t>(socket) | op;
+}
+
+IoUringEngine::IoUringEngine(event_base* base)
+    : base_(base),
+      recv_ring_(nullptr),
+      recv_buffers_(nullptr),
+      event_fd_(-1),
+      completion_event_(nullptr),
+      submit_event_(nullptr),
+      submit_pending_(false) {
+  int ret = io_uring_queue_init(kRingEntries, &ring_, 0);
+  if (ret < 0) {
+    DIE("io_uring_queue_init failed: %s", strerror(-ret));
+  }
+
+  // Register the receive buffers with the kernel as a provided buffer ring,
+  // so multishot recv picks a free buffer for every completion
+  void* buffers;
+  if (posix_memalign(&buffers, 4096, kNumRecvBuffers * kRecvBufferSize)) {
+    DIE("Could not allocate io_uring receive buffers");
+  }
+  recv_buffers_ = reinterpret_cast<char*>(buffers);
+  recv_ring_ = io_uring_setup_buf_ring(&ring_, kNumRecvBuffers,
+                                       kRecvBufferGroup, 0, &ret);
+  if (recv_ring_ == nullptr) {
+    DIE("io_uring_setup_buf_ring failed: %s", strerror(-ret));
+  }
+  for (unsigned i = 0; i < kNumRecvBuffers; i++) {
+    io_uring_buf_ring_add(recv_ring_, recv_buffers_ + i * kRecvBufferSize,
+                          kRecvBufferSize, i,
+                          io_uring_buf_ring_mask(kNumRecvBuffers), i);
+  }
+  io_uring_buf_ring_advance(recv_ring_, kNumRecvBuffers);
+
+  // Completions wake up the event loop through an eventfd
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    DIE("eventfd failed: %s", strerror(errno));
+  }
+  ret = io_uring_register_eventfd(&ring_, event_fd_);
+  if (ret < 0) {
+    DIE("io_uring_register_eventfd failed: %s", strerror(-ret));
+  }
+  completion_event_ = event_new(base_, event_fd_, EV_READ | EV_PERSIST,
+                                CompletionCallback, this);
+  event_add(completion_event_, nullptr);
+
+  // Submissions queued during one loop iteration go out in a single batch
+  submit_event_ = event_new(base_, -1, 0, SubmitCallback, this);
+}
+
+bufferevent* IoUringEngine::Attach(int fd, int options) {
+  bufferevent* pair[2];
+  if (bufferevent_pair_new(
+          base_, (options & ~BEV_OPT_CLOSE_ON_FREE) | BEV_OPT_DEFER_CALLBACKS,
+          pair)) {
+    DIE("bufferevent_pair_new failed");
+  }
+
+  IoUringSocket* socket = new IoUringSocket();
+  socket->engine = this;
+  socket->fd = fd;
+  socket->far = pair[1];
+  socket->sending = evbuffer_new();
+  socket->recv_armed = false;
+  socket->send_in_flight = false;
+  socket->peer_closed = false;
+  socket->closing = false;
+  socket->ops_in_flight = 0;
+
+  bufferevent_setcb(socket->far, FarReadCallback, nullptr, nullptr, socket);
+  bufferevent_enable(socket->far, EV_READ | EV_WRITE);
+  ArmRecv(socket);
+
+  return pair[0];
+}
+
+void IoUringEngine::Detach(IoUringSocket* socket) {
+  socket->closing = true;
+  if (socket->recv_armed) {
+    io_uring_sqe* sqe = GetSqe();
+    io_uring_prep_cancel64(sqe, MakeUserData(socket, kRecvOp), 0);
+    io_uring_sqe_set_data64(sqe, MakeUserData(socket, kCancelOp));
+    socket->ops_in_flight++;
+    RequestSubmit();
+  }
+  starved_sockets_.erase(
+      std::remove(starved_sockets_.begin(), starved_sockets_.end(), socket),
+      starved_sockets_.end());
+  MaybeFinishClose(socket);
+}
+
+io_uring_sqe* IoUringEngine::GetSqe() {
+  io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+  if (sqe == nullptr) {
+    // Submission queue is full, flush it early
+    io_uring_submit(&ring_);
+    sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+      DIE("io_uring submission queue full");
+    }
+  }
+  return sqe;
+}
+
+void IoUringEngine::RequestSubmit() {
+  if (!submit_pending_) {
+    submit_pending_ = true;
+    event_active(submit_event_, EV_TIMEOUT, 0);
+  }
+}
+
+void IoUringEngine::ArmRecv(IoUringSocket* socket) {
+  io_uring_sqe* sqe = GetSqe();
+  io_uring_prep_recv_multishot(sqe, socket->fd, nullptr, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kRecvBufferGroup;
+  io_uring_sqe_set_data64(sqe, MakeUserData(socket, kRecvOp));
+  socket->recv_armed = true;
+  socket->ops_in_flight++;
+  RequestSubmit();
+}
+
+void IoUringEngine::QueueSend(IoUringSocket* socket) {
+  if (socket->send_in_flight || socket->closing || socket->peer_closed) {
+    return;
+  }
+
+  // Take over everything written so far; the connection keeps appending to
+  // the input of far while the send is in flight
+  evbuffer_add_buffer(socket->sending, bufferevent_get_input(socket->far));
+  if (evbuffer_get_length(socket->sending) == 0) {
+    return;
+  }
+
+  evbuffer_iovec chunks[kMaxSendIovecs];
+  int num_chunks =
+      evbuffer_peek(socket->sending, -1, nullptr, chunks, kMaxSendIovecs);
+  num_chunks = std::min(num_chunks, kMaxSendIovecs);
+  for (int i = 0; i < num_chunks; i++) {
+    socket->send_iov[i].iov_base = chunks[i].iov_base;
+    socket->send_iov[i].iov_len = chunks[i].iov_len;
+  }
+  memset(&socket->send_msg, 0, sizeof(socket->send_msg));
+  socket->send_msg.msg_iov = socket->send_iov;
+  socket->send_msg.msg_iovlen = num_chunks;
+
+  io_uring_sqe* sqe = GetSqe();
+  io_uring_prep_sendmsg(sqe, socket->fd, &socket->send_msg, MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, MakeUserData(socket, kSendOp));
+  socket->send_in_flight = true;
+  socket->ops_in_flight++;
+  RequestSubmit();
+}
+
+void IoUringEngine::HandleRecv(IoUringSocket* socket, int res,
+                               uint32_t flags) {
+  if (res > 0) {
+    assert(flags & IORING_CQE_F_BUFFER);
+    unsigned buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+    char* data = recv_buffers_ + buffer_id * kRecvBufferSize;
+    if (socket->closing) {
+      ReturnRecvBuffer(data);
+    } else {
+      // Hand the buffer to the connection without copying; it comes back
+      // to the ring once the connection has drained it
+      evbuffer_add_reference(bufferevent_get_output(socket->far), data, res,
+                             ReleaseRecvBuffer, this);
+    }
+  } else if (res == -EINVAL) {
+    DIE("io_uring multishot recv is not supported by this kernel");
+  } else if (res != -ENOBUFS && res != -ECANCELED && !socket->closing) {
+    MarkPeerClosed(socket);
+  }
+
+  // Without F_MORE the multishot request has ended
+  if (!(flags & IORING_CQE_F_MORE)) {
+    socket->recv_armed = false;
+    socket->ops_in_flight--;
+    if (!socket->closing && !socket->peer_closed) {
+      if (res == -ENOBUFS) {
+        starved_sockets_.push_back(socket);
+      } else {
+        ArmRecv(socket);
+      }
+    }
+  }
+}
+
+void IoUringEngine::HandleSend(IoUringSocket* socket, int res) {
+  socket->send_in_flight = false;
+  socket->ops_in_flight--;
+  if (res > 0) {
+    evbuffer_drain(socket->sending, res);
+  } else if (!socket->closing) {
+    MarkPeerClosed(socket);
+  }
+  QueueSend(socket);
+}
+
+void IoUringEngine::MarkPeerClosed(IoUringSocket* socket) {
+  socket->peer_closed = true;
+  // Deliver what was received, then EOF, to the connection end of the pair
+  bufferevent_flush(socket->far, EV_WRITE, BEV_FINISHED);
+}
+
+void IoUringEngine::MaybeFinishClose(IoUringSocket* socket) {
+  if (!socket->closing || socket->ops_in_flight > 0) {
+    return;
+  }
+  close(socket->fd);
+  bufferevent_free(socket->far);
+  evbuffer_free(socket->sending);
+  delete socket;
+}
+
+void IoUringEngine::ReturnRecvBuffer(const void* data) {
+  unsigned buffer_id =
+      (reinterpret_cast<const char*>(data) - recv_buffers_) / kRecvBufferSize;
+  io_uring_buf_ring_add(recv_ring_, recv_buffers_ + buffer_id * kRecvBufferSize,
+                        kRecvBufferSize, buffer_id,
+                        io_uring_buf_ring_mask(kNumRecvBuffers), 0);
+  io_uring_buf_ring_advance(recv_ring_, 1);
+
+  // Restart receiving on sockets that ran out of buffers
+  if (!starved_sockets_.empty()) {
+    std::vector<IoUringSocket*> starved;
+    starved.swap(starved_sockets_);
+    for (IoUringSocket* socket : starved) {
+      ArmRecv(socket);
+    }
+  }
+}
+
+void IoUringEngine::CompletionCallback(evutil_socket_t fd, int16_t flags,
+                                       void* arg) {
+  IoUringEngine* engine = reinterpret_cast<IoUringEngine*>(arg);
+  uint64_t count;
+  if (read(engine->event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    DIE("read from io_uring eventfd failed: %s", strerror(errno));
+  }
+
+  // Copy the completions out first, since handling them may submit more
+  struct Completion {
+    uint64_t user_data;
+    int res;
+    uint32_t flags;
+  };
+  std::vector<Completion> completions;
+  unsigned head;
+  io_uring_cqe* cqe;
+  io_uring_for_each_cqe(&engine->ring_, head, cqe) {
+    completions.push_back(Completion{cqe->user_data, cqe->res, cqe->flags});
+  }
+  io_uring_cq_advance(&engine->ring_, completions.size());
+
+  for (const auto& completion : completions) {
+    IoUringSocket* socket =
+        reinterpret_cast<IoUringSocket*>(completion.user_data & ~kOpMask);
+    switch (completion.user_data & kOpMask) {
+      case kRecvOp:
+        engine->HandleRecv(socket, completion.res, completion.flags);
+        break;
+      case kSendOp:
+        engine->HandleSend(socket, completion.res);
+        break;
+      case kCancelOp:
+        socket->ops_in_flight--;
+        break;
+    }
+    engine->MaybeFinishClose(socket);
+  }
+}
+
+void IoUringEngine::SubmitCallback(evutil_socket_t fd, int16_t flags,
+                                   void* arg) {
+  IoUringEngine* engine = reinterpret_cast<IoUringEngine*>(arg);
+  engine->submit_pending_ = false;
+  int ret = io_uring_submit(&engine->ring_);
+  if (ret < 0) {
+    DIE("io_uring_submit failed: %s", strerror(-ret));
+  }
+}
+
+void IoUringEngine::FarReadCallback(bufferevent* bev, void* arg) {
+  IoUringSocket* socket = reinterpret_cast<IoUringSocket*>(arg);
+  socket->engine->QueueSend(socket);
+}
+
+void IoUringEngine::ReleaseRecvBuffer(const void* data, size_t length,
+                                      void* arg) {
+  reinterpret_cast<IoUringEngine*>(arg)->ReturnRecvBuffer(data);
+}
+
+bool ProbeIoUring() {
+  io_uring ring;
+  if (io_uring_queue_init(8, &ring, 0) < 0) {
+    return false;
+  }
+  bool supported = true;
+  io_uring_probe* probe = io_uring_get_probe_ring(&ring);
+  if (probe == nullptr || !io_uring_opcode_supported(probe, IORING_OP_RECV) ||
+      !io_uring_opcode_supported(probe, IORING_OP_SENDMSG)) {
+    supported = false;
+  }
+  if (probe != nullptr) {
+    io_uring_free_probe(probe);
+  }
+  int ret;
+  io_uring_buf_ring* buf_ring =
+      io_uring_setup_buf_ring(&ring, 8, kRecvBufferGroup, 0, &ret);
+  if (buf_ring == nullptr) {
+    supported = false;
+  } else {
+    io_uring_free_buf_ring(&ring, buf_ring, 8, kRecvBufferGroup);
+  }
+  io_uring_queue_exit(&ring);
+  return supported;
+}
+}  // namespace
+
+bool IoUringSupported() {
+  static const bool supported = ProbeIoUring();
+  return supported;
+}
+
+bufferevent* IoUringBuffereventNew(event_base* base, int fd, int options) {
+  if (current_engine == nullptr) {
+    current_engine = new IoUringEngine(base);
+  } else if (current_engine->base() != base) {
+    DIE("io_uring connections must be created on the thread that runs them");
+  }
+  return current_engine->Attach(fd, options);
+}
+
+bool IoUringBuffereventFree(bufferevent* bev) {
+  bufferevent* far = bufferevent_pair_get_partner(bev);
+  if (far == nullptr) {
+    return false;
+  }
+  bufferevent_data_cb read_cb;
+  void* arg;
+  bufferevent_getcb(far, &read_cb, nullptr, nullptr, &arg);
+  if (read_cb != IoUringEngine::FarReadCallback) {
+    return false;
+  }
+
+  IoUringSocket* socket = reinterpret_cast<IoUringSocket*>(arg);
+  bufferevent_free(bev);
+  socket->engine->Detach(socket);
+  return true;
+}
+
+#else  // OLDISIM_HAVE_LIBURING
+
+bool IoUringSupported() { return false; }
+
+bufferevent* IoUringBuffereventNew(event_base* base, int fd, int options) {
+  DIE("oldisim was built without liburing");
+  return nullptr;
+}
+
+bool IoUringBuffereventFree(bufferevent* bev) { return false; }
+
+#endif  // OLDISIM_HAVE_LIBURING
+}  // namespace oldisim
@@ -0,0 +1,42 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+namespace oldisim {
+
+/**
+ * Probe whether io_uring connections can be used in this process
+ */
+bool IoUringSupported();
+
+/**
+ * Make a bufferevent for a connected socket whose I/O is done through the
+ * io_uring of the calling thread, which is created on first use around the
+ * thread's event_base. The returned bufferevent behaves like a socket
+ * bufferevent and takes ownership of fd.
+ */
+bufferevent* IoUringBuffereventNew(event_base* base, int fd, int options);
+
+/**
+ * Free a bufferevent made by IoUringBuffereventNew and close its socket once
+ * the outstanding operations on it have completed. Returns false, without
+ * touching bev, if bev was not made by IoUringBuffereventNew.
+ */
+bool IoUringBuffereventFree(bufferevent* bev);
+}  // namespace oldisim
@@ -16,12 +16,12 @@
 #include "oldisim/LeafNodeServer.h"
 
 #include <assert.h>
-#include <boost/lockfree/queue.hpp>
 #include <cereal/types/map.hpp>
 #include <cereal/types/vector.hpp>
 #include <cereal/types/string.hpp>
 #include <cereal/archives/json.hpp>
 #include <errno.h>
+#include <sched.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -34,7 +34,10 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
 #include <deque>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <list>
@@ -42,19 +45,28 @@
 #include <mutex>
 #include <random>
 #include <set>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 
-#include "AutoSnapshot.h"
 #include "CerealMapAsJSObject.h"
 #include "ConnectionUtil.h"
 #include "ForcedEvTimer.h"
 #include "InternalCallbacks.h"
+#include "LocalTransport.h"
+#include "MonitoringConfig.h"
 #include "NodeThreadImpl.h"
+#include "ObjectPool.h"
+#include "OpenMetrics.h"
+#include "PowerSampler.h"
+#include "WorkStealingDeque.h"
+#include "oldisim/FlightRecorder.h"
 #include "oldisim/LeafNodeStats.h"
 #include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
+#include "oldisim/StatsLog.h"
+#include "oldisim/Topology.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
@@ -66,13 +78,11 @@ enum ThreadPriority {
   kNumPriorities
 };
 
-struct RequestTask {
-  QueryContext* request;
-};
-
 static const int kStatsWindowSeconds = 1;
 static const int kStatsMaxWindows = 3600;  // 1 hour
 const int kRequestQueueSize = 10000;
+// Most requests a thread takes from one victim in a single steal
+const size_t kMaxStealBatch = 32;
 
 struct LeafNodeServer::LeafNodeServerThread {
   NodeThread node_thread;
@@ -81,26 +91,68 @@ struct LeafNodeServer::LeafNodeServerThread {
                            // thread on new connection
   LeafNodeServer& server;
 
-  // Stats keeping objects
+  // Stats keeping objects. this_node_stats holds running totals logged by
+  // this thread; last_stats_snapshot is the copy the main thread took of
+  // them at the end of the previous stats window.
   std::unique_ptr<LeafNodeStats> this_node_stats;
-
-  // Auto snapshot of children stats
-  std::unique_ptr<AutoSnapshot<LeafNodeStats>> stats_snapshotter;
-  LeafNodeStats GetStatsSnapshotCallback();
-  void PostSnapshotCallback();
+  std::unique_ptr<LeafNodeStats> last_stats_snapshot;
 
   // Queue of fds of incoming connections and it's lock
   event* incoming_fd_event;
   std::deque<int> incoming_fds;
   std::mutex incoming_fds_lock;
 
+  // Own SO_REUSEPORT listening socket, if threads accept for themselves
+  event* listen_event;
+
   // Forced timer for event loop
   std::unique_ptr<ForcedEvTimer> forced_timer;
 
-  // Per-thread task queues and wakeup event for load balancing
+  // Per-thread work-stealing deque and wakeup event for load balancing.
+  // Requests are pushed by the thread that read them and popped by it LIFO,
+  // idle threads steal the oldest ones. A thread that runs out of work
+  // parks; producers wake at most one parked thread at a time, and only
+  // while no other woken thread is still searching for work.
   event* do_work_event;
-  boost::lockfree::queue<RequestTask> request_queue;
-  int worker_to_wake;
+  WorkStealingDeque<QueryContext*> request_queue;
+  // Takes the place of request_queue with a scheduling queue discipline: a
+  // heap under a lock, with the most urgent request on top for both the
+  // owner and thieves
+  std::mutex scheduled_queue_lock;
+  std::vector<QueryContext*> scheduled_queue;
+  std::atomic<size_t> scheduled_queue_size;
+  // Takes the place of scheduled_queue with kWeightedFair, under the same
+  // lock: a FIFO per request type, each tagged with the virtual time its
+  // next request starts at. The type with the earliest tag is served and
+  // the virtual time moves on to that tag.
+  struct FairQueue {
+    std::deque<QueryContext*> requests;
+    double next_start;
+  };
+  std::unordered_map<uint32_t, FairQueue> fair_queues;
+  double fair_virtual_time;
+  std::atomic<bool> wakeup_pending;  // do_work_event is active
+  std::atomic<bool> parked;          // Out of work until woken
+  std::atomic<bool> searching;       // Woken by a peer, has not found work
+  std::minstd_rand victim_rng;
+
+  // Requests served per wakeup of do_work_event. With adaptive batching it
+  // follows the queue depth and service time, otherwise it is pinned to
+  // lb_process_request_batch_size.
+  int request_batch_size;
+  uint64_t service_time_ns;  // Moving average of the time to serve a request
+
+  // CoDel state of sojourn time admission control. While not dropping,
+  // codel_first_above_time is when requests will have waited too long for
+  // a whole interval, 0 when the last one was below target.
+  uint64_t codel_first_above_time;
+  uint64_t codel_drop_next;
+  uint32_t codel_drop_count;
+  bool codel_dropping;
+
+  // Load-balanced requests are copied into contexts from this pool, and
+  // returned to it by whichever thread ends up serving them
+  ObjectPool<QueryContext> request_pool;
 
   // Initialization routine called after thread is started
   void Init();
@@ -113,15 +165,31 @@ struct LeafNodeServer::LeafNodeServerThread {
    */
   static void* ThreadMain(void* arg);
   static void AcceptHandler(evutil_socket_t listener, int16_t flags, void* arg);
+  static void ListenHandler(evutil_socket_t listener, int16_t flags, void* arg);
   static void TaskQueueHandler(evutil_socket_t listener, int16_t flags,
                                void* arg);
 
   void ParentConnectionClosedHandler(const ParentConnection& conn);
+  void AddParentConnection(int fd);
+  void SetUpParentConnection(int fd);
+  void Listen(int listener);
   void ProcessRequest(QueryContext& request);
   void RequestHandler(QueryContext& request, int num_request_in_batch);
+  bool PushRequest(QueryContext* request);
+  bool PopRequest(QueryContext** request);
+  bool StealRequest(QueryContext** request);
+  bool PopFairRequest(QueryContext** request);
+  size_t NumQueuedRequests() const;
+  void WakeUp();
+  void WakeIdleThread();
+  bool StealRequests(QueryContext** request);
+  void AdaptBatchSize(int num_processed, uint64_t elapsed_ns, bool drained);
+  bool ShouldShed(const QueryContext& request, uint64_t now);
+  void StopSearching();
   void LogResponse(const Response& response);
 
-  static void SpawnThread(LeafNodeServerThread& thread, bool thread_pinning);
+  static void SpawnThread(LeafNodeServerThread& thread, bool thread_pinning,
+                          int numa_cpu);
 };
 
 struct LeafNodeServer::LeafNodeServerImpl {
@@ -150,10 +218,37 @@ struct LeafNodeServer::LeafNodeServerImpl {
   // Is thread pinning enabled
   bool use_thread_pinning;
 
+  // Are pinned threads spread across NUMA nodes
+  bool use_numa_placement;
+
+  // Does every thread accept on its own SO_REUSEPORT socket, and are
+  // connections steered to the thread on the CPU that received them
+  bool use_reuse_port;
+  bool use_cpu_steering;
+
   // Is thread load balancing enabled
   bool use_thread_lb;
   int lb_process_connections_batch_size;
   int lb_process_request_batch_size;
+  // Adaptive batching replaces both batch sizes with a per-thread one
+  bool use_adaptive_batching;
+  int lb_max_request_batch_size;
+  uint64_t lb_batch_budget_ns;
+  QueueDiscipline queue_discipline;
+  // Weights of request types under kWeightedFair
+  std::unordered_map<uint32_t, double> queue_weights;
+  // Admission control limits, 0 if disabled
+  uint32_t max_queued_requests;
+  uint64_t sojourn_target_ns;
+  uint64_t sojourn_interval_ns;
+  // Threads woken to steal that have not found work yet
+  std::atomic<int> num_searching_threads;
+
+  // Response flush budget for corked connections, -1 if corking is off
+  int response_flush_budget_us;
+
+  // Are non-contiguous query payloads handed out as segments
+  bool use_segmented_payloads;
 
   // Thread initialization barrier
   pthread_barrier_t thread_init_barrier;
@@ -161,6 +256,12 @@ struct LeafNodeServer::LeafNodeServerImpl {
   // Remote monitoring settings
   bool monitor_enabled;
   uint16_t monitor_port;
+  MonitoringStatsCallback monitoring_stats_cb;
+  MonitoringConfigEndpoint monitoring_config;
+
+  // Energy and frequency while the server runs, null if disabled
+  bool power_telemetry_enabled;
+  std::unique_ptr<PowerSampler> power_sampler;
 
   // Aggregated stats every 5 seconds
   event* stats_timer_event;
@@ -168,6 +269,10 @@ struct LeafNodeServer::LeafNodeServerImpl {
   // Newest samples are in the front
   std::deque<LeafNodeStats> stats_history;
 
+  // Where to append every stats window, empty if disabled
+  std::string stats_log_path;
+  std::unique_ptr<StatsLogWriter> stats_log;
+
   LeafNodeServerImpl();
   static void AcceptHandler(evutil_socket_t listener, int16_t event, void* arg);
   static void ShutdownHandler(evutil_socket_t listener, int16_t event,
@@ -175,11 +280,23 @@ struct LeafNodeServer::LeafNodeServerImpl {
   static void PullStatsTimerHandler(evutil_socket_t listener, int16_t flags,
                                     void* arg);
   static void AddPullStatsTimer(LeafNodeServer& server);
+  void ListenOnThreads();
+
+  // Responses sent by all threads so far
+  uint64_t CountResponses() const;
 
   // Remote monitoring HTTP callbacks
   static void MonitoringTopologyHandler(evhttp_request* req, void* arg);
   static void MonitoringChildStatsHandler(evhttp_request* req, void* arg);
+  static void MonitoringServerStatsHandler(evhttp_request* req, void* arg);
+  static void MonitoringMetricsHandler(evhttp_request* req, void* arg);
+  static void MonitoringPowerHandler(evhttp_request* req, void* arg);
+  static void MonitoringFlightRecorderHandler(evhttp_request* req, void* arg);
   static void MonitoringDefaultHandler(evhttp_request* req, void* arg);
+
+  // Write the flight records to the dump path on SIGUSR1
+  static void FlightRecorderDumpHandler(evutil_socket_t signal, int16_t flags,
+                                        void* arg);
 };
 
 /**
@@ -194,11 +311,26 @@ LeafNodeServer::LeafNodeServerImpl::LeafNodeServerImpl()
       store_queries(false),
       num_threads(1),
       use_thread_pinning(true),
+      use_numa_placement(false),
+      use_reuse_port(false),
+      use_cpu_steering(false),
       use_thread_lb(false),
       lb_process_connections_batch_size(1),
       lb_process_request_batch_size(1),
+      use_adaptive_batching(false),
+      lb_max_request_batch_size(1),
+      lb_batch_budget_ns(0),
+      queue_discipline(QueueDiscipline::kFifo),
+      max_queued_requests(0),
+      sojourn_target_ns(0),
+      sojourn_interval_ns(0),
+      num_searching_threads(0),
+      response_flush_budget_us(-1),
+      use_segmented_payloads(false),
       monitor_enabled(false),
-      monitor_port(0) {}
+      monitor_port(0),
+      monitoring_stats_cb(nullptr),
+      power_telemetry_enabled(false) {}
 
 void LeafNodeServer::LeafNodeServerImpl::AcceptHandler(evutil_socket_t listener,
                                                        int16_t event,
@@ -231,6 +363,30 @@ void LeafNodeServer::LeafNodeServerImpl::AcceptHandler(evutil_socket_t listener,
   }
 }
 
+/**
+ * Give every thread its own SO_REUSEPORT socket. The sockets are made in
+ * thread order so that socket i of the group belongs to thread i, which
+ * the CPU steering program relies on.
+ */
+void LeafNodeServer::LeafNodeServerImpl::ListenOnThreads() {
+  std::vector<int> cpus;
+  int first_listener = -1;
+  for (auto& thread : threads) {
+    int listener = ConnectionUtil::ListenReusePort(port);
+    if (first_listener < 0) {
+      first_listener = listener;
+    }
+    cpus.push_back(GetPinnedCpu(thread->node_thread.get_pthread()));
+    thread->Listen(listener);
+  }
+  if (use_cpu_steering &&
+      !ConnectionUtil::SteerReusePortByCpu(first_listener, cpus)) {
+    W("Could not steer connections by CPU, the kernel hashes them instead");
+  }
+  std::cout << "LeafServer listening on port " << port << " with "
+            << threads.size() << " SO_REUSEPORT sockets" << std::endl;
+}
+
 void LeafNodeServer::LeafNodeServerImpl::ShutdownHandler(
     evutil_socket_t listener, int16_t event, void* arg) {
   LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
@@ -241,29 +397,34 @@ void LeafNodeServer::LeafNodeServerImpl::PullStatsTimerHandler(
     evutil_socket_t listener, int16_t flags, void* arg) {
   LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
 
-  // Figure out number of ready snapshots from all threads
-  unsigned int num_ready_snapshots = -1;  // this is MAX_INT in unsigned
+  // The window of each thread is the difference between its running totals
+  // now and at the end of the last window. Reading them does not stop the
+  // thread, which keeps logging while the copy is taken.
+  std::set<uint32_t> query_types =
+      ConnectionUtil::GetQueryTypes(server->impl_->on_query_cbs);
+  LeafNodeStats snapshot(query_types);
   for (const auto& thread : server->impl_->threads) {
-    num_ready_snapshots = std::min(
-        num_ready_snapshots, thread->stats_snapshotter->GetNumberSnapshots());
+    std::unique_ptr<LeafNodeStats> totals(new LeafNodeStats(query_types));
+    thread->this_node_stats->Snapshot(totals.get());
+
+    // Aggregate into one big snapshot
+    snapshot.Accumulate(*totals);
+    snapshot.Subtract(*thread->last_stats_snapshot);
+    thread->last_stats_snapshot = std::move(totals);
   }
 
-  // Pull the snapshots
-  for (int i = 0; i < num_ready_snapshots; i++) {
-    LeafNodeStats snapshot(
-        ConnectionUtil::GetQueryTypes(server->impl_->on_query_cbs));
-    for (const auto& thread : server->impl_->threads) {
-      // Aggregate into one big snapshot
-      snapshot.Accumulate(thread->stats_snapshotter->PopSnapshot());
-    }
+  if (server->impl_->stats_log != nullptr) {
+    StatsLogWriter& log = *server->impl_->stats_log;
+    ConnectionUtil::AddLeafNodeStatsToLog(log, snapshot);
+    log.WriteWindow(log.last_window_end_ns(), GetTimeAccurateNano());
+  }
 
-    // Put it into the stats snapshot history
-    server->impl_->stats_history.emplace_front(std::move(snapshot));
+  // Put it into the stats snapshot history
+  server->impl_->stats_history.emplace_front(std::move(snapshot));
 
-    // Pop from end if stats history is too large
-    if (server->impl_->stats_history.size() > kStatsMaxWindows) {
-      server->impl_->stats_history.pop_back();
-    }
+  // Pop from end if stats history is too large
+  if (server->impl_->stats_history.size() > kStatsMaxWindows) {
+    server->impl_->stats_history.pop_back();
   }
 
   AddPullStatsTimer(*server);
@@ -369,6 +530,176 @@ void LeafNodeServer::LeafNodeServerImpl::MonitoringChildStatsHandler(
   evbuffer_free(evb);
 }
 
+void LeafNodeServer::LeafNodeServerImpl::MonitoringServerStatsHandler(
+    evhttp_request* req, void* arg) {
+  LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  std::stringstream ss;
+  {
+    cereal::JSONOutputArchive oarchive(ss);
+    oarchive(cereal::make_nvp("stats", server->impl_->monitoring_stats_cb()));
+  }
+  evbuffer_add_printf(evb, "%s", ss.str().c_str());
+
+  // Send response
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void LeafNodeServer::LeafNodeServerImpl::MonitoringMetricsHandler(
+    evhttp_request* req, void* arg) {
+  LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  // Sum up the running totals of all threads as they are right now
+  std::set<uint32_t> query_types =
+      ConnectionUtil::GetQueryTypes(server->impl_->on_query_cbs);
+  LeafNodeStats stats(query_types);
+  for (const auto& thread : server->impl_->threads) {
+    LeafNodeStats thread_stats(query_types);
+    thread->this_node_stats->Snapshot(&thread_stats);
+    stats.Accumulate(thread_stats);
+  }
+
+  OpenMetricsWriter writer(evb);
+  writer.LeafNodeStatsFamilies("oldisim_leaf", stats);
+  writer.Family("oldisim_leaf_queued_requests", "gauge",
+                "Requests waiting in the load balancing queue of a thread");
+  for (const auto& thread : server->impl_->threads) {
+    writer.Sample("oldisim_leaf_queued_requests",
+                  OpenMetricsWriter::Label(
+                      "thread",
+                      std::to_string(thread->node_thread.get_thread_num())),
+                  static_cast<uint64_t>(thread->NumQueuedRequests()));
+  }
+  writer.Finish();
+
+  // Send response
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    OpenMetricsWriter::kContentType);
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void LeafNodeServer::LeafNodeServerImpl::MonitoringPowerHandler(
+    evhttp_request* req, void* arg) {
+  LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  std::stringstream ss;
+  {
+    cereal::JSONOutputArchive oarchive(ss);
+    oarchive(cereal::make_nvp(
+        "power",
+        PowerSampler::MakeReportMap(server->impl_->power_sampler->GetReport(),
+                                    server->impl_->CountResponses())));
+  }
+  evbuffer_add_printf(evb, "%s", ss.str().c_str());
+
+  // Send response
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void LeafNodeServer::LeafNodeServerImpl::MonitoringFlightRecorderHandler(
+    evhttp_request* req, void* arg) {
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  std::stringstream ss;
+  WriteFlightRecordsJson(GetFlightRecords(), ss);
+  const std::string json = ss.str();
+  evbuffer_add(evb, json.data(), json.size());
+
+  // Send response
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "application/json");
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void LeafNodeServer::LeafNodeServerImpl::FlightRecorderDumpHandler(
+    evutil_socket_t signal, int16_t flags, void* arg) {
+  const std::string& path = GetFlightRecorderOptions().dump_path;
+  std::vector<FlightRecord> records = GetFlightRecords();
+  std::ofstream output(path);
+  WriteFlightRecordsJson(records, output);
+  output.close();
+  if (!output) {
+    W("Could not write the flight records to %s", path.c_str());
+    return;
+  }
+  I("Wrote %zu flight records to %s", records.size(), path.c_str());
+}
+
+uint64_t LeafNodeServer::LeafNodeServerImpl::CountResponses() const {
+  std::set<uint32_t> query_types = ConnectionUtil::GetQueryTypes(on_query_cbs);
+  uint64_t responses = 0;
+  for (const auto& thread : threads) {
+    LeafNodeStats thread_stats(query_types);
+    thread->this_node_stats->Snapshot(&thread_stats);
+    for (const auto& count : thread_stats.response_counts_) {
+      responses += count.second;
+    }
+  }
+  return responses;
+}
+
 void LeafNodeServer::LeafNodeServerImpl::MonitoringDefaultHandler(
     evhttp_request* req, void* arg) {
   LeafNodeServer* server = reinterpret_cast<LeafNodeServer*>(arg);
@@ -383,7 +714,21 @@ void LeafNodeServer::LeafNodeServerImpl::MonitoringDefaultHandler(
 
 LeafNodeServer::LeafNodeServerThread::LeafNodeServerThread(
     LeafNodeServer& _server)
-    : server(_server), request_queue(0) {}
+    : server(_server),
+      listen_event(nullptr),
+      do_work_event(nullptr),
+      request_queue(kRequestQueueSize),
+      scheduled_queue_size(0),
+      fair_virtual_time(0),
+      wakeup_pending(false),
+      parked(true),
+      searching(false),
+      request_batch_size(1),
+      service_time_ns(0),
+      codel_first_above_time(0),
+      codel_drop_next(0),
+      codel_drop_count(0),
+      codel_dropping(false) {}
 
 void LeafNodeServer::LeafNodeServerThread::Init() {
   // Create event base;
@@ -396,28 +741,23 @@ void LeafNodeServer::LeafNodeServerThread::Init() {
       event_new(node_thread.impl_->base, -1, 0, AcceptHandler, this);
   event_priority_set(incoming_fd_event, kConnectionPriority);
 
-  // Create stats keeping object
+  // Create stats keeping objects
   this_node_stats.reset(new LeafNodeStats(
       ConnectionUtil::GetQueryTypes(server.impl_->on_query_cbs)));
+  this_node_stats->ReserveForSnapshots();
+  last_stats_snapshot.reset(new LeafNodeStats(
+      ConnectionUtil::GetQueryTypes(server.impl_->on_query_cbs)));
 
   // Create event for waking up on task queue (if load balancing)
   if (server.impl_->use_thread_lb) {
     do_work_event =
         event_new(node_thread.impl_->base, -1, 0, TaskQueueHandler, this);
-    worker_to_wake = node_thread.get_thread_num();  // start by waking self
+    victim_rng.seed(node_thread.get_thread_num() + 1);
+    if (!server.impl_->use_adaptive_batching) {
+      request_batch_size = server.impl_->lb_process_request_batch_size;
+    }
   }
 
-  // Reserve space for task queue free-list
-  request_queue.reserve(kRequestQueueSize);
-
-  // Create auto snapshot
-  stats_snapshotter.reset(new AutoSnapshot<LeafNodeStats>(
-      node_thread.impl_->base, kStatsWindowSeconds,
-      std::bind(&LeafNodeServer::LeafNodeServerThread::GetStatsSnapshotCallback,
-                this),
-      std::bind(&LeafNodeServer::LeafNodeServerThread::PostSnapshotCallback,
-                this)));
-
   // Create forced timer
   forced_timer.reset(new ForcedEvTimer(node_thread.impl_->base));
   forced_timer->SetPriority(kStatsPriority);
@@ -442,13 +782,8 @@ void* LeafNodeServer::LeafNodeServerThread::ThreadMain(void* arg) {
     thread->server.impl_->on_thread_startup(thread->node_thread);
   }
 
-  // If remote monitoring is enabled, start collection
-  if (thread->server.impl_->monitor_enabled) {
-    thread->stats_snapshotter->Enable();
-  }
-
   // Start event loop
-  event_base_dispatch(thread->node_thread.impl_->base);
+  thread->node_thread.impl_->RunEventLoop();
 
   D("LeafNodeServerThread about to exit...");
 
@@ -483,26 +818,7 @@ void LeafNodeServer::LeafNodeServerThread::AcceptHandler(
 
     // Create event buffer objects and such for each fd
     for (int i = 0; i < num_accepted_fds; i++) {
-      int fd = incoming_fds[i];
-      // Create a parent connection object
-      std::unique_ptr<ParentConnection> conn(
-          ConnectionUtil::MakeParentConnection(
-              std::bind(&LeafNodeServer::LeafNodeServerThread::RequestHandler,
-                        thread, std::placeholders::_1, std::placeholders::_2),
-              std::bind(&LeafNodeServer::LeafNodeServerThread::
-                            ParentConnectionClosedHandler,
-                        thread, std::placeholders::_1),
-              thread->node_thread, fd, thread->server.impl_->store_queries,
-              thread->server.impl_->use_thread_lb));
-
-      // Call the OnAccept handler
-      if (thread->server.impl_->on_accept != nullptr) {
-        thread->server.impl_->on_accept(thread->node_thread, *conn);
-      }
-
-      // Assign connection to the thread's internal book-keeping and activate it
-      ConnectionUtil::EnableParentConnection(*conn);
-      thread->parent_connections.emplace_back(move(conn));
+      thread->AddParentConnection(incoming_fds[i]);
     }
 
     if (num_new_fds == num_accepted_fds) {
@@ -512,33 +828,358 @@ void LeafNodeServer::LeafNodeServerThread::AcceptHandler(
   }
 }
 
+void LeafNodeServer::LeafNodeServerThread::ListenHandler(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  LeafNodeServerThread* thread = reinterpret_cast<LeafNodeServerThread*>(arg);
+
+  // Bound the accepts per call so a connection storm does not starve the
+  // connections already served; the event stays readable until drained
+  const int kMaxAccepts = 10;
+  ConnectionUtil::AcceptConnections(
+      listener, kMaxAccepts,
+      [thread](int fd) { thread->AddParentConnection(fd); });
+}
+
+void LeafNodeServer::LeafNodeServerThread::AddParentConnection(int fd) {
+  // Local transport clients are only set up once their hello is in, which
+  // the event loop waits for rather than holding up other connections
+  ConnectionUtil::AwaitParentConnection(node_thread, fd, [this](int ready_fd) {
+    SetUpParentConnection(ready_fd);
+  });
+}
+
+void LeafNodeServer::LeafNodeServerThread::SetUpParentConnection(int fd) {
+  // Create a parent connection object
+  std::unique_ptr<ParentConnection> conn(ConnectionUtil::MakeParentConnection(
+      std::bind(&LeafNodeServer::LeafNodeServerThread::RequestHandler, this,
+                std::placeholders::_1, std::placeholders::_2),
+      std::bind(
+          &LeafNodeServer::LeafNodeServerThread::ParentConnectionClosedHandler,
+          this, std::placeholders::_1),
+      node_thread, fd, server.impl_->store_queries, server.impl_->use_thread_lb,
+      server.impl_->response_flush_budget_us,
+      server.impl_->use_segmented_payloads));
+  if (conn == nullptr) {
+    return;
+  }
+
+  // Call the OnAccept handler
+  if (server.impl_->on_accept != nullptr) {
+    server.impl_->on_accept(node_thread, *conn);
+  }
+
+  // Assign connection to the thread's internal book-keeping and activate it
+  ConnectionUtil::EnableParentConnection(*conn);
+  parent_connections.emplace_back(move(conn));
+}
+
+void LeafNodeServer::LeafNodeServerThread::Listen(int listener) {
+  // Safe from the main thread, libevent locking is enabled
+  listen_event = event_new(node_thread.impl_->base, listener,
+                           EV_READ | EV_PERSIST, ListenHandler, this);
+  assert(listen_event);
+  event_priority_set(listen_event, kConnectionPriority);
+  event_add(listen_event, nullptr);
+}
+
 void LeafNodeServer::LeafNodeServerThread::TaskQueueHandler(
     evutil_socket_t listener, int16_t flags, void* arg) {
   int num_requests_processed = 0;
   LeafNodeServerThread* thread = reinterpret_cast<LeafNodeServerThread*>(arg);
+  uint64_t start_time =
+      thread->server.impl_->use_adaptive_batching ? GetTimeAccurateNano() : 0;
+  NoteEventLoopActivity();
+
+  // Clear the flags first so that wakeups from now on re-activate the event
+  thread->wakeup_pending = false;
+  thread->parked = false;
+
+  // Drain own deque before going around to steal work
+  QueryContext* request;
+  while (thread->PopRequest(&request) || thread->StealRequests(&request)) {
+    thread->StopSearching();
+
+    // Process the work, unless the thread is shedding load
+    if (thread->ShouldShed(*request, GetTimeAccurateNano())) {
+      thread->this_node_stats->LogRejectedQuery(*request);
+      request->SendRejection(ResponseStatus::kRejected);
+    } else {
+      thread->ProcessRequest(*request);
+    }
+    ObjectPool<QueryContext>::Delete(request);  // Return to owning pool
+
+    num_requests_processed++;
+
+    if (num_requests_processed >= thread->request_batch_size) {
+      thread->AdaptBatchSize(num_requests_processed,
+                             GetTimeAccurateNano() - start_time, false);
+
+      // Re-add the event to check for more tasks
+      thread->WakeUp();
+
+      return;
+    }
+  }
+  thread->AdaptBatchSize(num_requests_processed,
+                         GetTimeAccurateNano() - start_time, true);
+
+  // Nothing left anywhere, park until woken
+  thread->StopSearching();
+  thread->parked = true;
+}
+
+void LeafNodeServer::LeafNodeServerThread::AdaptBatchSize(int num_processed,
+                                                          uint64_t elapsed_ns,
+                                                          bool drained) {
+  if (!server.impl_->use_adaptive_batching || num_processed == 0) {
+    return;
+  }
+  uint64_t per_request_ns = elapsed_ns / num_processed;
+  service_time_ns = service_time_ns == 0
+                        ? per_request_ns
+                        : service_time_ns - service_time_ns / 8 +
+                              per_request_ns / 8;
+
+  // A batch holds up the connections of this thread for as long as it runs,
+  // so its expected length has to stay within the budget
+  const uint64_t budget_ns = server.impl_->lb_batch_budget_ns;
+  const uint64_t batch_ns = request_batch_size * service_time_ns;
+  if (elapsed_ns > budget_ns || batch_ns > budget_ns) {
+    // Requests got slower, back off quickly
+    request_batch_size = std::max(request_batch_size / 2, 1);
+  } else if (!drained &&
+             NumQueuedRequests() >= static_cast<size_t>(request_batch_size) &&
+             2 * batch_ns <= budget_ns) {
+    // Another full batch is waiting and a larger one still fits
+    request_batch_size = std::min(2 * request_batch_size,
+                                  server.impl_->lb_max_request_batch_size);
+  } else if (drained && request_batch_size > 1) {
+    // The queue ran dry before the batch did, load is going down
+    request_batch_size--;
+  }
+}
+
+/**
+ * CoDel's control law, applied as request is dequeued at time now
+ */
+bool LeafNodeServer::LeafNodeServerThread::ShouldShed(
+    const QueryContext& request, uint64_t now) {
+  const uint64_t target_ns = server.impl_->sojourn_target_ns;
+  const uint64_t interval_ns = server.impl_->sojourn_interval_ns;
+  if (target_ns == 0) {
+    return false;
+  }
+  if (now - request.received_time < target_ns) {
+    // The queue drains, stop dropping
+    codel_first_above_time = 0;
+    codel_dropping = false;
+    return false;
+  }
+  if (!codel_dropping) {
+    if (codel_first_above_time == 0) {
+      codel_first_above_time = now + interval_ns;
+      return false;
+    }
+    if (now < codel_first_above_time) {
+      return false;
+    }
+    // Resume near the last drop rate if the queue went bad again soon
+    codel_dropping = true;
+    codel_drop_count =
+        codel_drop_count > 2 && now - codel_drop_next < 16 * interval_ns
+            ? codel_drop_count - 2
+            : 1;
+    codel_drop_next = now + interval_ns / std::sqrt(codel_drop_count);
+    return true;
+  }
+  if (now < codel_drop_next) {
+    return false;
+  }
+  codel_drop_count++;
+  codel_drop_next += interval_ns / std::sqrt(codel_drop_count);
+  return true;
+}
 
-  // Look at own queue before going around to steal work
-  const int num_threads = thread->server.impl_->num_threads;
+void LeafNodeServer::LeafNodeServerThread::WakeUp() {
+  if (!wakeup_pending.exchange(true)) {
+    event_active(do_work_event, 0, 0);
+  }
+}
+
+void LeafNodeServer::LeafNodeServerThread::WakeIdleThread() {
+  // One searching thread is enough to pick up spare work
+  if (server.impl_->num_searching_threads > 0) {
+    return;
+  }
+
+  const int num_threads = server.impl_->num_threads;
+  int start = victim_rng() % num_threads;
   for (int offset = 0; offset < num_threads; offset++) {
-    int thread_num =
-        (thread->node_thread.get_thread_num() + offset) % num_threads;
-    auto& task_queue = thread->server.impl_->threads[thread_num]->request_queue;
-    RequestTask task;
-    while (task_queue.pop(task)) {
-      // Process the work
-      thread->ProcessRequest(*task.request);
-      delete task.request;  // Deallocate memory for request
-
-      num_requests_processed++;
-
-      if (num_requests_processed >=
-          thread->server.impl_->lb_process_request_batch_size) {
-        // Re-add the event to check for more tasks
-        event_active(thread->do_work_event, 0, 0);
-
-        return;
-      }
+    auto& peer = *server.impl_->threads[(start + offset) % num_threads];
+    bool was_parked = true;
+    if (&peer == this ||
+        !peer.parked.compare_exchange_strong(was_parked, false)) {
+      continue;
+    }
+    server.impl_->num_searching_threads++;
+    peer.searching = true;
+    peer.WakeUp();
+    return;
+  }
+}
+
+bool LeafNodeServer::LeafNodeServerThread::StealRequests(
+    QueryContext** request) {
+  // Visit victims in random order so thieves do not pile onto one thread
+  const int num_threads = server.impl_->num_threads;
+  int start = victim_rng() % num_threads;
+  for (int offset = 0; offset < num_threads; offset++) {
+    auto& victim = *server.impl_->threads[(start + offset) % num_threads];
+    if (&victim == this) {
+      continue;
+    }
+    size_t available = victim.NumQueuedRequests();
+    if (available == 0 || !victim.StealRequest(request)) {
+      continue;
     }
+
+    // Take up to half of the victim's backlog into the own deque, so the
+    // next requests do not need another trip to the victim
+    size_t batch = std::min(available / 2, kMaxStealBatch);
+    QueryContext* extra;
+    for (size_t i = 1; i < batch && victim.StealRequest(&extra); i++) {
+      // Cannot fail, thieves only steal with an empty queue
+      bool pushed = PushRequest(extra);
+      assert(pushed);
+      (void)pushed;
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Whether request a is to be served after request b under discipline
+ */
+static bool IsServedAfter(QueueDiscipline discipline, const QueryContext* a,
+                          const QueryContext* b) {
+  if (discipline == QueueDiscipline::kEarliestDeadline) {
+    // Requests without a deadline can always wait
+    uint64_t a_deadline = a->deadline == 0 ? UINT64_MAX : a->deadline;
+    uint64_t b_deadline = b->deadline == 0 ? UINT64_MAX : b->deadline;
+    if (a_deadline != b_deadline) {
+      return a_deadline > b_deadline;
+    }
+  }
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  return a->received_time > b->received_time;
+}
+
+bool LeafNodeServer::LeafNodeServerThread::PushRequest(QueryContext* request) {
+  const QueueDiscipline discipline = server.impl_->queue_discipline;
+  if (discipline == QueueDiscipline::kFifo) {
+    return request_queue.Push(request);
+  }
+  std::lock_guard<std::mutex> lock(scheduled_queue_lock);
+  if (scheduled_queue_size >= static_cast<size_t>(kRequestQueueSize)) {
+    return false;
+  }
+  if (discipline == QueueDiscipline::kWeightedFair) {
+    auto it = fair_queues.find(request->type);
+    if (it == fair_queues.end()) {
+      it = fair_queues.emplace(request->type, FairQueue{{}, 0}).first;
+    }
+    FairQueue& queue = it->second;
+    // A type that was idle starts from now, it gets no credit for the time
+    // it had nothing queued
+    if (queue.requests.empty()) {
+      queue.next_start = std::max(queue.next_start, fair_virtual_time);
+    }
+    queue.requests.push_back(request);
+    scheduled_queue_size++;
+    return true;
+  }
+  scheduled_queue.push_back(request);
+  std::push_heap(scheduled_queue.begin(), scheduled_queue.end(),
+                 [discipline](const QueryContext* a, const QueryContext* b) {
+                   return IsServedAfter(discipline, a, b);
+                 });
+  scheduled_queue_size = scheduled_queue.size();
+  return true;
+}
+
+bool LeafNodeServer::LeafNodeServerThread::PopRequest(QueryContext** request) {
+  if (server.impl_->queue_discipline == QueueDiscipline::kFifo) {
+    return request_queue.Pop(request);
+  }
+  return StealRequest(request);
+}
+
+bool LeafNodeServer::LeafNodeServerThread::StealRequest(
+    QueryContext** request) {
+  const QueueDiscipline discipline = server.impl_->queue_discipline;
+  if (discipline == QueueDiscipline::kFifo) {
+    return request_queue.Steal(request);
+  }
+  // The owner and thieves alike take the most urgent request
+  std::lock_guard<std::mutex> lock(scheduled_queue_lock);
+  if (discipline == QueueDiscipline::kWeightedFair) {
+    return PopFairRequest(request);
+  }
+  if (scheduled_queue.empty()) {
+    return false;
+  }
+  std::pop_heap(scheduled_queue.begin(), scheduled_queue.end(),
+                [discipline](const QueryContext* a, const QueryContext* b) {
+                  return IsServedAfter(discipline, a, b);
+                });
+  *request = scheduled_queue.back();
+  scheduled_queue.pop_back();
+  scheduled_queue_size = scheduled_queue.size();
+  return true;
+}
+
+/**
+ * Take the oldest request of the type whose turn it is. Called with
+ * scheduled_queue_lock held.
+ */
+bool LeafNodeServer::LeafNodeServerThread::PopFairRequest(
+    QueryContext** request) {
+  FairQueue* next = nullptr;
+  uint32_t next_type = 0;
+  for (auto& entry : fair_queues) {
+    FairQueue& queue = entry.second;
+    if (!queue.requests.empty() &&
+        (next == nullptr || queue.next_start < next->next_start)) {
+      next = &queue;
+      next_type = entry.first;
+    }
+  }
+  if (next == nullptr) {
+    return false;
+  }
+  const auto& weights = server.impl_->queue_weights;
+  auto weight = weights.find(next_type);
+  fair_virtual_time = next->next_start;
+  next->next_start += 1 / (weight == weights.end() ? 1.0 : weight->second);
+  *request = next->requests.front();
+  next->requests.pop_front();
+  scheduled_queue_size--;
+  return true;
+}
+
+size_t LeafNodeServer::LeafNodeServerThread::NumQueuedRequests() const {
+  if (server.impl_->queue_discipline == QueueDiscipline::kFifo) {
+    return request_queue.Size();
+  }
+  return scheduled_queue_size;
+}
+
+void LeafNodeServer::LeafNodeServerThread::StopSearching() {
+  if (searching.exchange(false)) {
+    server.impl_->num_searching_threads--;
   }
 }
 
@@ -547,6 +1188,19 @@ void LeafNodeServer::LeafNodeServerThread::ParentConnectionClosedHandler(
 
 void LeafNodeServer::LeafNodeServerThread::ProcessRequest(
     QueryContext& request) {
+  request.dequeue_time = GetTimeAccurateNano();
+  if (IsFlightRecorderEnabled()) {
+    request.trace.dequeue_thread = node_thread.get_thread_num();
+    request.trace.dequeue_cpu = sched_getcpu();
+  }
+
+  // Answer requests that ran out of time without doing the work
+  if (request.IsExpired()) {
+    this_node_stats->LogExpiredQuery(request);
+    request.SendRejection(ResponseStatus::kExpired);
+    return;
+  }
+
   // Set logger callback
   request.logger =
       std::bind(&LeafNodeServer::LeafNodeServerThread::LogResponse, this,
@@ -570,21 +1224,37 @@ void LeafNodeServer::LeafNodeServerThread::RequestHandler(
 
   // If using per-thread load balancing, enqueue it as work instead
   if (server.impl_->use_thread_lb) {
-    QueryContext* request_copy = new QueryContext(std::move(request));
-    RequestTask task = {request_copy};
-    bool was_queue_empty = request_queue.empty();
-    request_queue.push(task);
-
-    if (num_request_in_batch == 0 && was_queue_empty) {
-      // Wake self on first request if self queue is empty
-      event_active(do_work_event, 0, 0);
-    } else if (num_request_in_batch %
-                   server.impl_->lb_process_connections_batch_size ==
-               0) {
-      // Wake someone up to handle it
-      event_active(server.impl_->threads[worker_to_wake]->do_work_event, 0, 0);
-      worker_to_wake = (server.impl_->num_threads + worker_to_wake - 1) %
-                       server.impl_->num_threads;
+    // Turn the request away before it takes up a place in the queue
+    if (server.impl_->max_queued_requests > 0 &&
+        NumQueuedRequests() >= server.impl_->max_queued_requests) {
+      this_node_stats->LogRejectedQuery(request);
+      request.SendRejection(ResponseStatus::kRejected);
+      return;
+    }
+
+    if (IsFlightRecorderEnabled()) {
+      request.trace.queue_thread = node_thread.get_thread_num();
+    }
+    QueryContext* request_copy = request_pool.New(std::move(request));
+    if (!PushRequest(request_copy)) {
+      // Queue is full, serve the request right away
+      ProcessRequest(*request_copy);
+      ObjectPool<QueryContext>::Delete(request_copy);
+      return;
+    }
+
+    // The owner always gets to its own deque
+    WakeUp();
+
+    // Once requests pile up, ask an idle peer to steal some
+    // With adaptive batching, once per batch the owner would take
+    int connections_batch_size =
+        server.impl_->use_adaptive_batching
+            ? request_batch_size
+            : server.impl_->lb_process_connections_batch_size;
+    if (NumQueuedRequests() > 1 &&
+        num_request_in_batch % connections_batch_size == 0) {
+      WakeIdleThread();
     }
   } else {
     ProcessRequest(request);
@@ -596,24 +1266,26 @@ void LeafNodeServer::LeafNodeServerThread::LogResponse(
   this_node_stats->LogResponse(response);
 }
 
-LeafNodeStats LeafNodeServer::LeafNodeServerThread::GetStatsSnapshotCallback() {
-  return *this_node_stats;
-}
-
-void LeafNodeServer::LeafNodeServerThread::PostSnapshotCallback() {
-  this_node_stats->Reset();
-}
-
 /**
  *  Spawn a worker thread that processes incoming queries
+ *  numa_cpu, if not negative, is the CPU picked by NUMA placement
  */
 void LeafNodeServer::LeafNodeServerThread::SpawnThread(
-    LeafNodeServerThread& thread, bool thread_pinning) {
+    LeafNodeServerThread& thread, bool thread_pinning, int numa_cpu) {
   pthread_attr_t attr;
   pthread_attr_init(&attr);
 
   // Set CPU thread affinity if requested
-  if (thread_pinning) {
+  if (thread_pinning && numa_cpu >= 0) {
+    cpu_set_t m;
+    CPU_ZERO(&m);
+    CPU_SET(numa_cpu, &m);
+    int ret;
+    if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &m))) {
+      DIE("pthread_attr_setaffinity_np(%d) failed: %s", numa_cpu,
+          strerror(ret));
+    }
+  } else if (thread_pinning) {
     static int current_cpu = -1;
     int max_cpus = 8 * sizeof(cpu_set_t);
     cpu_set_t m;
@@ -674,6 +1346,16 @@ void LeafNodeServer::SetThreadPinning(bool use_thread_pinning) {
   impl_->use_thread_pinning = use_thread_pinning;
 }
 
+void LeafNodeServer::SetThreadNumaPlacement(bool use_numa_placement) {
+  impl_->use_numa_placement = use_numa_placement;
+}
+
+void LeafNodeServer::SetReusePortListeners(bool use_reuse_port,
+                                           bool use_cpu_steering) {
+  impl_->use_reuse_port = use_reuse_port;
+  impl_->use_cpu_steering = use_cpu_steering;
+}
+
 void LeafNodeServer::SetThreadLoadBalancing(bool use_thread_lb) {
   impl_->use_thread_lb = use_thread_lb;
 }
@@ -682,84 +1364,101 @@ void LeafNodeServer::SetThreadLoadBalancingParams(
     int lb_process_connections_batch_size, int lb_process_request_batch_size) {
   impl_->lb_process_connections_batch_size = lb_process_connections_batch_size;
   impl_->lb_process_request_batch_size = lb_process_request_batch_size;
+  impl_->use_adaptive_batching = false;
 }
 
-void LeafNodeServer::Run() {
-  // Ignore SIGPIPE (happens if parent closes connection from other side)
-  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-    DIE("Could not ignore SIGPIPE: %s", strerror(errno));
-  }
+void LeafNodeServer::SetAdaptiveBatching(int max_request_batch_size,
+                                         uint32_t batch_budget_us) {
+  impl_->use_adaptive_batching = true;
+  impl_->lb_max_request_batch_size = std::max(max_request_batch_size, 1);
+  impl_->lb_batch_budget_ns = batch_budget_us * 1000ULL;
+}
 
-  int status;
-  struct addrinfo *servinfo;
+void LeafNodeServer::SetQueueDiscipline(QueueDiscipline discipline) {
+  impl_->queue_discipline = discipline;
+}
 
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_addr = nullptr;
+void LeafNodeServer::SetQueueWeight(uint32_t type, double weight) {
+  impl_->queue_weights[type] = weight;
+}
 
-  auto port = std::to_string(impl_->port);
-  if ((status = getaddrinfo(nullptr, port.c_str(), &hints, &servinfo)) != 0) {
-    DIE("getaddrinfo error: %s", gai_strerror(status));
-  }
+void LeafNodeServer::SetAdmissionControl(uint32_t max_queued_requests,
+                                         uint32_t sojourn_target_us,
+                                         uint32_t sojourn_interval_us) {
+  impl_->max_queued_requests = max_queued_requests;
+  impl_->sojourn_target_ns = sojourn_target_us * 1000ULL;
+  impl_->sojourn_interval_ns = sojourn_interval_us * 1000ULL;
+}
 
-  // Set up the socket to listen on
-  struct addrinfo *rp;
-  int socketfd;
-  for (rp = servinfo; rp != nullptr; rp = servinfo->ai_next) {
-    socketfd = socket(rp->ai_family, rp->ai_socktype, 0);
-    if (socketfd == -1) {
-      continue;
-    }
-    int one = 1;
-    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    if (bind(socketfd, rp->ai_addr, rp->ai_addrlen) == 0) {
-      break;
-    }
-    close(socketfd);
-  }
-  if (rp == NULL) {
-    DIE("bind failed: %s", strerror(errno));
-  }
+void LeafNodeServer::SetResponseCorking(int flush_budget_us) {
+  impl_->response_flush_budget_us = flush_budget_us < 0 ? -1 : flush_budget_us;
+}
 
+void LeafNodeServer::SetSegmentedPayloads(bool use_segmented_payloads) {
+  impl_->use_segmented_payloads = use_segmented_payloads;
+}
 
-  evutil_socket_t listener = socketfd;
-  evutil_make_socket_nonblocking(listener);
+/**
+ * Open the listening socket the main thread accepts on for all threads
+ */
+static evutil_socket_t ListenOnPort(uint16_t port_number) {
+  // Drivers in high connection count mode open thousands of connections
+  // at once
+  evutil_socket_t listener =
+      ConnectionUtil::ListenAnyAddress(port_number, false, SOMAXCONN);
+
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  const char* any = "Unknown AF";
+  if (getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) ==
+      0) {
+    any = address.ss_family == AF_INET6 ? "[::]" : "0.0.0.0";
+  }
+  std::cout << "LeafServer listening on " << any << ":" << port_number
+            << std::endl;
 
+  return listener;
+}
 
-  if (listen(listener, 16) < 0) {
-    DIE("listen failed: %s", strerror(errno));
+void LeafNodeServer::Run() {
+  // Ignore SIGPIPE (happens if parent closes connection from other side)
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    DIE("Could not ignore SIGPIPE: %s", strerror(errno));
   }
-  char ipstr[INET6_ADDRSTRLEN];
-  switch(rp->ai_addr->sa_family) {
-    case AF_INET:
-      inet_ntop(AF_INET, &(((struct sockaddr_in *)rp->ai_addr)->sin_addr),
-                ipstr, INET6_ADDRSTRLEN);
-      break;
-    case AF_INET6:
-      inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)rp->ai_addr)->sin6_addr),
-                ipstr, INET6_ADDRSTRLEN);
-      break;
-    default:
-      strncpy(ipstr, "Unknown AF", INET6_ADDRSTRLEN);
+
+  // Without SO_REUSEPORT the main thread accepts for all threads
+  evutil_socket_t listener = -1;
+  if (!impl_->use_reuse_port) {
+    listener = ListenOnPort(impl_->port);
   }
-  std::cout << "LeafServer listening on " << ipstr << ":" << impl_->port << std::endl;
-  freeaddrinfo(servinfo);
 
   // Init the thread init barrier
   pthread_barrier_init(&impl_->thread_init_barrier, nullptr,
                        impl_->num_threads + 1);  // one more for main thread
 
+  // Read NUMA topology if threads are placed by node
+  std::vector<NumaNodeCpus> numa_nodes;
+  if (impl_->use_thread_pinning && impl_->use_numa_placement) {
+    numa_nodes = GetNumaTopology();
+  }
+
   // Start up the threads
   for (int i = 0; i < impl_->num_threads; i++) {
     impl_->threads.emplace_back(
         std::unique_ptr<LeafNodeServerThread>(new LeafNodeServerThread(*this)));
     impl_->threads[i]->node_thread.impl_->thread_num = i;
 
+    // Thread i goes to node i % N, using that node's CPUs in order
+    int numa_cpu = -1;
+    if (!numa_nodes.empty()) {
+      const NumaNodeCpus& node = numa_nodes[i % numa_nodes.size()];
+      numa_cpu = node.cpus[(i / numa_nodes.size()) % node.cpus.size()];
+      impl_->threads[i]->node_thread.impl_->numa_node = node.node;
+      D("Placing thread %d on NUMA node %d, cpu %d", i, node.node, numa_cpu);
+    }
+
     LeafNodeServerThread::SpawnThread(*impl_->threads[i],
-                                      impl_->use_thread_pinning);
+                                      impl_->use_thread_pinning, numa_cpu);
   }
 
   // Set sigint handler to stop all threads on ctrl-c
@@ -771,11 +1470,31 @@ void LeafNodeServer::Run() {
   // Wait for all worker threads to start
   pthread_barrier_wait(&impl_->thread_init_barrier);
 
-  // Make the listener event for libevent
-  event* listener_event = event_new(impl_->base, listener, EV_READ | EV_PERSIST,
-                                    LeafNodeServerImpl::AcceptHandler, this);
-  assert(listener_event);
-  event_add(listener_event, nullptr);
+  if (impl_->power_telemetry_enabled) {
+    impl_->power_sampler.reset(new PowerSampler());
+    impl_->power_sampler->Start();
+  }
+
+  if (impl_->use_reuse_port) {
+    impl_->ListenOnThreads();
+  } else {
+    // Make the listener event for libevent
+    event* listener_event =
+        event_new(impl_->base, listener, EV_READ | EV_PERSIST,
+                  LeafNodeServerImpl::AcceptHandler, this);
+    assert(listener_event);
+    event_add(listener_event, nullptr);
+  }
+
+  // Local transport connections are spread over the threads like TCP ones
+  int local_listener = ListenLocal(impl_->port);
+  if (local_listener >= 0) {
+    event* local_listener_event =
+        event_new(impl_->base, local_listener, EV_READ | EV_PERSIST,
+                  LeafNodeServerImpl::AcceptHandler, this);
+    assert(local_listener_event);
+    event_add(local_listener_event, nullptr);
+  }
 
   // Remote monitoring
   evhttp* monitor_http;
@@ -791,6 +1510,23 @@ void LeafNodeServer::Run() {
                   LeafNodeServerImpl::MonitoringTopologyHandler, this);
     evhttp_set_cb(monitor_http, "/child_stats",
                   LeafNodeServerImpl::MonitoringChildStatsHandler, this);
+    if (impl_->monitoring_stats_cb) {
+      evhttp_set_cb(monitor_http, "/server_stats",
+                    LeafNodeServerImpl::MonitoringServerStatsHandler, this);
+    }
+    evhttp_set_cb(monitor_http, "/metrics",
+                  LeafNodeServerImpl::MonitoringMetricsHandler, this);
+    if (impl_->monitoring_config.enabled()) {
+      impl_->monitoring_config.Register(monitor_http);
+    }
+    if (impl_->power_sampler != nullptr) {
+      evhttp_set_cb(monitor_http, "/power",
+                    LeafNodeServerImpl::MonitoringPowerHandler, this);
+    }
+    if (IsFlightRecorderEnabled()) {
+      evhttp_set_cb(monitor_http, "/flight_recorder",
+                    LeafNodeServerImpl::MonitoringFlightRecorderHandler, this);
+    }
     evhttp_set_gencb(monitor_http, LeafNodeServerImpl::MonitoringDefaultHandler,
                      this);
 
@@ -805,16 +1541,56 @@ void LeafNodeServer::Run() {
       }
     }
     std::cout << "Monitor Server listening on port " << impl_->monitor_port << std::endl;
+  }
+
+  // Windows are needed for the monitor history and the stats log
+  if (!impl_->stats_log_path.empty()) {
+    impl_->stats_log.reset(new StatsLogWriter(impl_->stats_log_path, "leaf"));
+  }
+  if (impl_->monitor_enabled || impl_->stats_log != nullptr) {
     LeafNodeServerImpl::AddPullStatsTimer(*this);
   }
 
+  // Dump the flight records on demand, from the main thread
+  event* flight_dump_event = nullptr;
+  if (IsFlightRecorderEnabled()) {
+    flight_dump_event =
+        evsignal_new(impl_->base, SIGUSR1,
+                     LeafNodeServerImpl::FlightRecorderDumpHandler, this);
+    evsignal_add(flight_dump_event, nullptr);
+  }
+
   // Start main event loop
   event_base_dispatch(impl_->base);
+  if (flight_dump_event != nullptr) {
+    event_free(flight_dump_event);
+  }
 
   // Wait for all threads to finish
   for (auto& thread : impl_->threads) {
     pthread_join(thread->node_thread.impl_->pt, nullptr);
   }
+  if (impl_->stats_log != nullptr) {
+    impl_->stats_log->Close();
+  }
+
+  if (impl_->power_sampler != nullptr) {
+    impl_->power_sampler->Stop();
+    PowerSampler::PrintReport(impl_->power_sampler->GetReport(),
+                              impl_->CountResponses());
+  }
+
+  // Report how well the request context pools absorbed allocations
+  if (impl_->use_thread_lb) {
+    ObjectPoolStats pool_stats;
+    for (const auto& thread : impl_->threads) {
+      pool_stats += thread->request_pool.GetStats();
+    }
+    I("QueryContext pool: %lu hits, %lu misses (%.1f%% hit rate), "
+      "%lu returned cross-thread",
+      pool_stats.hits, pool_stats.misses, pool_stats.HitRate() * 100,
+      pool_stats.remote_frees);
+  }
 }
 
 void LeafNodeServer::Shutdown() {
@@ -823,7 +1599,7 @@ void LeafNodeServer::Shutdown() {
 
   // Stop event_base on threads
   for (auto& thread : impl_->threads) {
-    event_base_loopbreak(thread->node_thread.impl_->base);
+    thread->node_thread.impl_->StopEventLoop();
   }
 }
 
@@ -866,4 +1642,37 @@ void LeafNodeServer::EnableMonitoring(uint16_t port) {
   impl_->monitor_enabled = true;
   impl_->monitor_port = port;
 }
+
+/**
+ * Sample energy and effective frequency of this host while the server runs.
+ */
+void LeafNodeServer::EnablePowerTelemetry() {
+  impl_->power_telemetry_enabled = true;
+}
+
+/**
+ * Append every stats window to the stats log at path.
+ */
+void LeafNodeServer::SetStatsLogFile(const std::string& path) {
+  impl_->stats_log_path = path;
+}
+
+void LeafNodeServer::SetMonitoringStatsCallback(
+    const MonitoringStatsCallback& callback) {
+  impl_->monitoring_stats_cb = callback;
+}
+
+void LeafNodeServer::SetMonitoringConfigCallback(
+    const std::string& token, const MonitoringConfigCallback& callback) {
+  impl_->monitoring_config = MonitoringConfigEndpoint(token, callback);
+}
+
+std::map<uint32_t, std::map<std::string, double>>
+LeafNodeServer::GetLastWindowStats() const {
+  if (impl_->stats_history.empty()) {
+    return {};
+  }
+  return ConnectionUtil::MakeLeafNodeStatsMap(impl_->stats_history.front(),
+                                              kStatsWindowSeconds);
+}
 }  // namespace oldisim
@@ -0,0 +1,468 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LocalTransport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "ConnectionUtil.h"
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+namespace {
+
+const uint32_t kLocalHelloMagic = 0x4f4c444c;  // "OLDL"
+// Bytes per ring, must be a power of two
+const uint64_t kSharedMemoryRingSize = 1 << 20;
+// How long a server waits for the hello of a freshly connected client
+const int kHelloTimeoutSeconds = 1;
+
+// First message on every local connection. A shared memory hello carries
+// the region and the eventfds of the client and the server as SCM_RIGHTS.
+struct LocalHello {
+  uint32_t magic;
+  uint32_t transport;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory rings need address-free atomics");
+
+/**
+ * One direction of a shared memory connection. head is only written by the
+ * producer and tail only by the consumer, both count bytes since the start.
+ * A producer that finds the ring full sets producer_blocked and waits for
+ * the consumer to wake it once it has made room.
+ */
+struct SharedMemoryRing {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> producer_blocked;
+  alignas(64) char data[kSharedMemoryRingSize];
+};
+
+// Ring 0 carries client to server traffic, ring 1 the replies
+struct SharedMemoryRegion {
+  SharedMemoryRing rings[2];
+};
+
+/**
+ * Per-connection state for one side. As with the io_uring engine, the
+ * connection code talks to one end of a bufferevent pair, and the other
+ * end, far, is moved to and from the rings. The control socket carries no
+ * data after the hello, it only tells each side when the other goes away.
+ */
+struct SharedMemorySocket {
+  bufferevent* far;
+  SharedMemoryRegion* region;
+  SharedMemoryRing* tx;
+  SharedMemoryRing* rx;
+  int control_fd;
+  int wait_fd;    // Signalled by the peer
+  int notify_fd;  // Signals the peer
+  event* wait_event;
+  event* control_event;
+  bool peer_closed;
+};
+
+sockaddr_un LocalAddress(uint16_t port, socklen_t* length) {
+  sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  // A leading NUL puts the name in the abstract namespace
+  int name_length =
+      snprintf(sun.sun_path + 1, sizeof(sun.sun_path) - 1, "oldisim-%u", port);
+  *length = offsetof(sockaddr_un, sun_path) + 1 + name_length;
+  return sun;
+}
+
+bool SetBlocking(int fd, bool blocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    return false;
+  }
+  flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+void Notify(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    W("Could not wake up shared memory peer: %s", strerror(errno));
+  }
+}
+
+/**
+ * Move what the connection wrote into the transmit ring, as far as it fits
+ */
+void PumpTransmit(SharedMemorySocket* socket) {
+  SharedMemoryRing* ring = socket->tx;
+  evbuffer* input = bufferevent_get_input(socket->far);
+  while (!socket->peer_closed && evbuffer_get_length(input) > 0) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    uint64_t space = kSharedMemoryRingSize - (head - tail);
+    if (space == 0) {
+      // Publish the wait before checking again, so the consumer either
+      // sees it or has already made room that the check finds
+      ring->producer_blocked.store(1);
+      if (ring->tail.load() == tail) {
+        return;
+      }
+      ring->producer_blocked.store(0);
+      continue;
+    }
+
+    uint64_t length = std::min<uint64_t>(space, evbuffer_get_length(input));
+    uint64_t offset = head & (kSharedMemoryRingSize - 1);
+    uint64_t first = std::min(length, kSharedMemoryRingSize - offset);
+    evbuffer_remove(input, ring->data + offset, first);
+    if (first < length) {
+      evbuffer_remove(input, ring->data, length - first);
+    }
+
+    // Wake the consumer if it may have gone idle on an empty ring
+    ring->head.store(head + length);
+    if (ring->tail.load() == head) {
+      Notify(socket->notify_fd);
+    }
+  }
+}
+
+/**
+ * Hand everything in the receive ring to the connection
+ */
+void DrainReceive(SharedMemorySocket* socket) {
+  SharedMemoryRing* ring = socket->rx;
+  evbuffer* output = bufferevent_get_output(socket->far);
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  while (true) {
+    uint64_t head = ring->head.load();
+    if (head == tail) {
+      return;
+    }
+
+    uint64_t length = head - tail;
+    uint64_t offset = tail & (kSharedMemoryRingSize - 1);
+    uint64_t first = std::min(length, kSharedMemoryRingSize - offset);
+    evbuffer_add(output, ring->data + offset, first);
+    if (first < length) {
+      evbuffer_add(output, ring->data, length - first);
+    }
+
+    tail = head;
+    ring->tail.store(tail);
+    if (ring->producer_blocked.load() != 0) {
+      ring->producer_blocked.store(0);
+      Notify(socket->notify_fd);
+    }
+  }
+}
+
+void MarkPeerClosed(SharedMemorySocket* socket) {
+  if (socket->peer_closed) {
+    return;
+  }
+  socket->peer_closed = true;
+  event_del(socket->wait_event);
+  event_del(socket->control_event);
+  // Deliver what was received, then EOF, to the connection end of the pair
+  DrainReceive(socket);
+  bufferevent_flush(socket->far, EV_WRITE, BEV_FINISHED);
+}
+
+void FarReadCallback(bufferevent* bev, void* arg) {
+  PumpTransmit(reinterpret_cast<SharedMemorySocket*>(arg));
+}
+
+void WaitCallback(evutil_socket_t fd, int16_t flags, void* arg) {
+  SharedMemorySocket* socket = reinterpret_cast<SharedMemorySocket*>(arg);
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    DIE("read from shared memory eventfd failed: %s", strerror(errno));
+  }
+  // The peer wakes us both for new data and for room to send more
+  DrainReceive(socket);
+  PumpTransmit(socket);
+}
+
+void ControlCallback(evutil_socket_t fd, int16_t flags, void* arg) {
+  char byte;
+  ssize_t ret = recv(fd, &byte, sizeof(byte), MSG_DONTWAIT);
+  if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+    MarkPeerClosed(reinterpret_cast<SharedMemorySocket*>(arg));
+  }
+}
+
+bufferevent* AttachSharedMemory(event_base* base, int control_fd,
+                                SharedMemoryRegion* region, bool is_server,
+                                int wait_fd, int notify_fd, int options) {
+  bufferevent* pair[2];
+  if (bufferevent_pair_new(
+          base, (options & ~BEV_OPT_CLOSE_ON_FREE) | BEV_OPT_DEFER_CALLBACKS,
+          pair)) {
+    DIE("bufferevent_pair_new failed");
+  }
+  SetBlocking(control_fd, false);
+
+  SharedMemorySocket* socket = new SharedMemorySocket();
+  socket->far = pair[1];
+  socket->region = region;
+  socket->tx = &region->rings[is_server ? 1 : 0];
+  socket->rx = &region->rings[is_server ? 0 : 1];
+  socket->control_fd = control_fd;
+  socket->wait_fd = wait_fd;
+  socket->notify_fd = notify_fd;
+  socket->peer_closed = false;
+  socket->wait_event =
+      event_new(base, wait_fd, EV_READ | EV_PERSIST, WaitCallback, socket);
+  socket->control_event = event_new(base, control_fd, EV_READ | EV_PERSIST,
+                                    ControlCallback, socket);
+  event_add(socket->wait_event, nullptr);
+  event_add(socket->control_event, nullptr);
+
+  bufferevent_setcb(socket->far, FarReadCallback, nullptr, nullptr, socket);
+  bufferevent_enable(socket->far, EV_READ | EV_WRITE);
+
+  // Pick up anything the peer sent before we were attached
+  DrainReceive(socket);
+  return pair[0];
+}
+
+struct PendingHello {
+  std::function<void(int)> on_hello;
+};
+
+void HelloCallback(evutil_socket_t fd, int16_t flags, void* arg) {
+  std::unique_ptr<PendingHello> pending(reinterpret_cast<PendingHello*>(arg));
+  if ((flags & EV_READ) == 0) {
+    W("Dropping local connection: no hello within %d s",
+      kHelloTimeoutSeconds);
+    close(fd);
+    return;
+  }
+  pending->on_hello(fd);
+}
+
+SharedMemoryRegion* MapRegion(int memfd) {
+  void* region = mmap(nullptr, sizeof(SharedMemoryRegion),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (region == MAP_FAILED) {
+    return nullptr;
+  }
+  return reinterpret_cast<SharedMemoryRegion*>(region);
+}
+}  // namespace
+
+int ListenLocal(uint16_t port) {
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    W("Could not create local socket: %s", strerror(errno));
+    return -1;
+  }
+  socklen_t length;
+  sockaddr_un sun = LocalAddress(port, &length);
+  if (bind(listener, reinterpret_cast<sockaddr*>(&sun), length) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    W("Local transports disabled, could not listen on local port %d: %s",
+      port, strerror(errno));
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+bool IsLocalSocket(int fd) {
+  sockaddr_storage ss;
+  socklen_t length = sizeof(ss);
+  return getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &length) == 0 &&
+         ss.ss_family == AF_UNIX;
+}
+
+bufferevent* ConnectLocal(event_base* base, uint16_t port, Transport transport,
+                          int options) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    DIE("Could not create local socket: %s", strerror(errno));
+  }
+  socklen_t length;
+  sockaddr_un sun = LocalAddress(port, &length);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&sun), length) < 0) {
+    DIE("Could not connect to local port %d: %s", port, strerror(errno));
+  }
+
+  LocalHello hello = {kLocalHelloMagic, static_cast<uint32_t>(transport)};
+  iovec iov = {&hello, sizeof(hello)};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (transport == Transport::kUnix) {
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+      DIE("Could not send local hello: %s", strerror(errno));
+    }
+    evutil_make_socket_nonblocking(fd);
+    return ConnectionUtil::NewSocketBufferevent(base, fd, options);
+  }
+
+  // Zero-filled memory is a pair of empty rings
+  int memfd = memfd_create("oldisim-ring", MFD_CLOEXEC);
+  if (memfd < 0 || ftruncate(memfd, sizeof(SharedMemoryRegion)) < 0) {
+    DIE("Could not create shared memory ring: %s", strerror(errno));
+  }
+  SharedMemoryRegion* region = MapRegion(memfd);
+  if (region == nullptr) {
+    DIE("Could not map shared memory ring: %s", strerror(errno));
+  }
+  int client_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int server_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (client_fd < 0 || server_fd < 0) {
+    DIE("eventfd failed: %s", strerror(errno));
+  }
+
+  int fds[3] = {memfd, client_fd, server_fd};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+    DIE("Could not send shared memory hello: %s", strerror(errno));
+  }
+  close(memfd);
+
+  return AttachSharedMemory(base, fd, region, false, client_fd, server_fd,
+                            options);
+}
+
+void AwaitLocalHello(event_base* base, int fd,
+                     std::function<void(int)> on_hello) {
+  // The client sends its hello right after connecting
+  timeval timeout = {kHelloTimeoutSeconds, 0};
+  PendingHello* pending = new PendingHello{std::move(on_hello)};
+  if (event_base_once(base, fd, EV_READ, HelloCallback, pending, &timeout) <
+      0) {
+    DIE("event_base_once failed");
+  }
+}
+
+bufferevent* AcceptLocal(event_base* base, int fd, int options) {
+  // The hello is sent in one go, so it is all there once fd is readable
+  LocalHello hello;
+  iovec iov = {&hello, sizeof(hello)};
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+  // Take ownership of any passed descriptors before validating the hello
+  int num_fds = 0;
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (ret > 0 && cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    num_fds = std::min(num_fds, 3);
+    memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+  }
+  auto fail = [&](const char* reason) -> bufferevent* {
+    W("Dropping local connection: %s", reason);
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    close(fd);
+    return nullptr;
+  };
+
+  if (ret != sizeof(hello) || hello.magic != kLocalHelloMagic) {
+    return fail("bad hello");
+  }
+
+  switch (static_cast<Transport>(hello.transport)) {
+    case Transport::kUnix:
+      if (num_fds != 0) {
+        return fail("unexpected descriptors");
+      }
+      evutil_make_socket_nonblocking(fd);
+      return ConnectionUtil::NewSocketBufferevent(base, fd, options);
+    case Transport::kSharedMemory: {
+      if (num_fds != 3) {
+        return fail("missing shared memory descriptors");
+      }
+      SharedMemoryRegion* region = MapRegion(fds[0]);
+      close(fds[0]);
+      num_fds = 0;
+      if (region == nullptr) {
+        close(fds[1]);
+        close(fds[2]);
+        return fail("could not map shared memory ring");
+      }
+      return AttachSharedMemory(base, fd, region, true, fds[2], fds[1],
+                                options);
+    }
+    default:
+      return fail("unknown transport");
+  }
+}
+
+bool SharedMemoryBuffereventFree(bufferevent* bev) {
+  bufferevent* far = bufferevent_pair_get_partner(bev);
+  if (far == nullptr) {
+    return false;
+  }
+  bufferevent_data_cb read_cb;
+  void* arg;
+  bufferevent_getcb(far, &read_cb, nullptr, nullptr, &arg);
+  if (read_cb != FarReadCallback) {
+    return false;
+  }
+
+  // Closing the control socket tells the peer the connection is gone
+  SharedMemorySocket* socket = reinterpret_cast<SharedMemorySocket*>(arg);
+  bufferevent_free(bev);
+  bufferevent_free(socket->far);
+  event_free(socket->wait_event);
+  event_free(socket->control_event);
+  close(socket->control_fd);
+  close(socket->wait_fd);
+  close(socket->notify_fd);
+  munmap(socket->region, sizeof(SharedMemoryRegion));
+  delete socket;
+  return true;
+}
+}  // namespace oldisim
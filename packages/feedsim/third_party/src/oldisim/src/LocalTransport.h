@@ -0,0 +1,70 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <stdint.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <functional>
+
+#include "oldisim/Transport.h"
+
+namespace oldisim {
+
+/**
+ * Open the non-blocking AF_UNIX listening socket for the local transports
+ * of the node server on port. It lives in the abstract namespace, so
+ * nothing is left behind in the filesystem. Returns -1 if the socket cannot
+ * be bound, e.g. because another server on this host uses the port.
+ */
+int ListenLocal(uint16_t port);
+
+/**
+ * Whether fd is an AF_UNIX socket, i.e. was accepted from ListenLocal
+ */
+bool IsLocalSocket(int fd);
+
+/**
+ * Connect to the node server on port of this host with a local transport
+ * and return the bufferevent of the connection. Failing to connect is
+ * fatal.
+ */
+bufferevent* ConnectLocal(event_base* base, uint16_t port, Transport transport,
+                          int options);
+
+/**
+ * Call on_hello with the accepted socket fd from the event loop of base
+ * once the hello of the client can be read from it, so that accepting it
+ * never blocks. Closes fd instead if the hello does not come in time.
+ */
+void AwaitLocalHello(event_base* base, int fd,
+                     std::function<void(int)> on_hello);
+
+/**
+ * Complete the handshake a client started with ConnectLocal on the accepted
+ * socket fd, whose hello has arrived, and return the bufferevent of the
+ * connection, which takes ownership of fd. Returns nullptr and closes fd if
+ * the handshake fails.
+ */
+bufferevent* AcceptLocal(event_base* base, int fd, int options);
+
+/**
+ * Free a bufferevent made for a shared memory connection. Returns false,
+ * without touching bev, if bev was not made for one.
+ */
+bool SharedMemoryBuffereventFree(bufferevent* bev);
+}  // namespace oldisim
@@ -0,0 +1,137 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "MonitoringConfig.h"
+
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+#include <string.h>
+
+#include <map>
+
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+namespace {
+const size_t kMaxConfigBodySize = 16384;
+const int kHttpUnauthorized = 401;
+
+// Compares in time independent of where the strings differ, so that
+// response times do not give the token away
+bool TokenMatches(const std::string& given, const std::string& token) {
+  if (given.size() != token.size()) {
+    return false;
+  }
+  unsigned char difference = 0;
+  for (size_t i = 0; i < token.size(); i++) {
+    difference |= given[i] ^ token[i];
+  }
+  return difference == 0;
+}
+
+void SendText(evhttp_request* req, int code, const char* reason,
+              const std::string& text) {
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+  evbuffer_add(evb, text.data(), text.size());
+  evbuffer_add(evb, "\n", 1);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain");
+  evhttp_send_reply(req, code, reason, evb);
+  evbuffer_free(evb);
+}
+}  // namespace
+
+MonitoringConfigEndpoint::MonitoringConfigEndpoint(
+    const std::string& token, const MonitoringConfigCallback& callback)
+    : token_(token), callback_(callback) {
+  if (token_.empty()) {
+    DIE("The monitoring config endpoint needs a non-empty token");
+  }
+}
+
+void MonitoringConfigEndpoint::Register(evhttp* http) {
+  evhttp_set_cb(http, "/config", MonitoringConfigEndpoint::Handler, this);
+}
+
+void MonitoringConfigEndpoint::Handler(evhttp_request* req, void* arg) {
+  MonitoringConfigEndpoint* endpoint =
+      reinterpret_cast<MonitoringConfigEndpoint*>(arg);
+
+  // Only respond to POST requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    evhttp_send_error(req, HTTP_BADMETHOD, 0);
+    return;
+  }
+
+  const char* authorization = evhttp_find_header(
+      evhttp_request_get_input_headers(req), "Authorization");
+  const char kBearer[] = "Bearer ";
+  if (authorization == nullptr ||
+      strncmp(authorization, kBearer, sizeof(kBearer) - 1) != 0 ||
+      !TokenMatches(authorization + sizeof(kBearer) - 1, endpoint->token_)) {
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "WWW-Authenticate", "Bearer");
+    evhttp_send_error(req, kHttpUnauthorized, "Unauthorized");
+    return;
+  }
+
+  evbuffer* input = evhttp_request_get_input_buffer(req);
+  const size_t length = evbuffer_get_length(input);
+  if (length > kMaxConfigBodySize) {
+    SendText(req, HTTP_BADREQUEST, "Bad Request", "configuration too large");
+    return;
+  }
+  std::string body(length, '\0');
+  evbuffer_copyout(input, &body[0], length);
+
+  evkeyvalq pairs;
+  if (evhttp_parse_query_str(body.c_str(), &pairs) != 0) {
+    SendText(req, HTTP_BADREQUEST, "Bad Request",
+             "configuration must be form encoded as key=value&key=value");
+    return;
+  }
+  std::map<std::string, std::string> update;
+  std::string error;
+  for (evkeyval* pair = pairs.tqh_first; pair != nullptr;
+       pair = pair->next.tqe_next) {
+    if (!update.emplace(pair->key, pair->value).second) {
+      error = std::string("key ") + pair->key + " given twice";
+    }
+  }
+  evhttp_clear_headers(&pairs);
+  if (error.empty() && update.empty()) {
+    error = "configuration is empty";
+  }
+  if (error.empty()) {
+    error = endpoint->callback_(update);
+  }
+  if (!error.empty()) {
+    W("Rejected monitoring config update: %s", error.c_str());
+    SendText(req, HTTP_BADREQUEST, "Bad Request", error);
+    return;
+  }
+
+  std::string applied;
+  for (const auto& pair : update) {
+    applied += (applied.empty() ? "" : " ") + pair.first + "=" + pair.second;
+  }
+  I("Applied monitoring config update: %s", applied.c_str());
+  SendText(req, 200, "OK", applied);
+}
+}  // namespace oldisim
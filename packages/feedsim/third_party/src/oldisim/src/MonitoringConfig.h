@@ -0,0 +1,53 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <event2/http.h>
+
+#include <string>
+
+#include "oldisim/Callbacks.h"
+
+namespace oldisim {
+
+/**
+ * The /config URL of a monitoring server. A POST whose Authorization header
+ * is "Bearer <token>" and whose body is form encoded, key=value&key=value,
+ * is handed to the callback as a map; it is answered 200 if the callback
+ * applied it and 400 with the reason if not, 401 without the token.
+ * Requests are served on the thread running the monitoring server, one at
+ * a time.
+ */
+class MonitoringConfigEndpoint {
+ public:
+  MonitoringConfigEndpoint() {}
+  MonitoringConfigEndpoint(const std::string& token,
+                           const MonitoringConfigCallback& callback);
+
+  bool enabled() const { return static_cast<bool>(callback_); }
+
+  /**
+   * Serve /config on http, which must not outlive the endpoint
+   */
+  void Register(evhttp* http);
+
+ private:
+  static void Handler(evhttp_request* req, void* arg);
+
+  std::string token_;
+  MonitoringConfigCallback callback_;
+};
+}  // namespace oldisim
@@ -14,17 +14,125 @@
 
 #include "oldisim/NodeThread.h"
 
+#include <utility>
+
 #include "NodeThreadImpl.h"
 #include "oldisim/ChildConnection.h"
+#include "oldisim/EventLoop.h"
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
 
 namespace oldisim {
 
-NodeThread::NodeThread() : impl_(new NodeThreadImpl()) {}
+// Covers a bit over 400ms with 100us ticks, so typical emulated I/O sleeps
+// never wrap around the wheel
+static const int kTimerWheelSlots = 4096;
+
+const uint64_t NodeThread::kTimerTickNs;
+
+NodeThread::NodeThread() : impl_(new NodeThreadImpl()) {
+  impl_->numa_node = -1;
+}
 
 int NodeThread::get_thread_num() const { return impl_->thread_num; }
 
+int NodeThread::get_numa_node() const { return impl_->numa_node; }
+
 pthread_t NodeThread::get_pthread() const { return impl_->pt; }
 
 event_base* NodeThread::get_event_base() const { return impl_->base; }
+
+static void RunClosureCallback(evutil_socket_t listener, int16_t flags,
+                               void* arg) {
+  auto closure = reinterpret_cast<std::function<void()>*>(arg);
+  (*closure)();
+  delete closure;
+}
+
+void NodeThread::RunInLoop(std::function<void()> closure) const {
+  // Relies on the servers enabling libevent locking before creating bases
+  auto closure_copy = new std::function<void()>(std::move(closure));
+  timeval now = {0, 0};
+  if (event_base_once(impl_->base, -1, EV_TIMEOUT, RunClosureCallback,
+                      closure_copy, &now) != 0) {
+    DIE("event_base_once failed");
+  }
+}
+
+void NodeThread::NodeThreadImpl::ScheduleTimer(
+    uint64_t deadline_ns, std::function<void()> closure) {
+  if (!timer_wheel) {
+    timer_wheel.reset(new TimerWheel(base, kTimerTickNs, kTimerWheelSlots));
+  }
+  timer_wheel->ScheduleAt(deadline_ns, std::move(closure));
+}
+
+void NodeThread::NodeThreadImpl::RunEventLoop() {
+  if (GetEventLoopMode() != EventLoopMode::kBusyPoll) {
+    event_base_dispatch(base);
+    return;
+  }
+
+  const uint64_t idle_backoff_ns =
+      static_cast<uint64_t>(GetBusyPollOptions().idle_backoff_us) * 1000;
+  uint64_t last_activity = event_loop_activity;
+  uint64_t idle_since = GetTimeAccurateNano();
+  stop_requested = false;
+  while (!stop_requested) {
+    // Like event_base_dispatch, give up on errors or once nothing is left
+    // to wait for
+    if (event_base_loop(base, EVLOOP_NONBLOCK) != 0) {
+      return;
+    }
+    if (event_loop_activity != last_activity) {
+      last_activity = event_loop_activity;
+      idle_since = GetTimeAccurateNano();
+    } else if (idle_backoff_ns != 0 &&
+               GetTimeAccurateNano() - idle_since >= idle_backoff_ns) {
+      // Park in epoll until the next event, then go back to spinning
+      if (event_base_loop(base, EVLOOP_ONCE) != 0) {
+        return;
+      }
+      last_activity = event_loop_activity;
+      idle_since = GetTimeAccurateNano();
+    }
+  }
+}
+
+void NodeThread::NodeThreadImpl::StopEventLoopCallback(evutil_socket_t listener,
+                                                       int16_t flags,
+                                                       void* arg) {
+  auto impl = reinterpret_cast<NodeThreadImpl*>(arg);
+  impl->stop_requested = true;
+  event_base_loopbreak(impl->base);
+}
+
+void NodeThread::NodeThreadImpl::StopEventLoop() {
+  if (GetEventLoopMode() != EventLoopMode::kBusyPoll) {
+    event_base_loopbreak(base);
+    return;
+  }
+  // Every pass of the busy loop clears the break flag when it starts, so a
+  // break that lands between two passes would be lost. Stop from inside the
+  // loop instead.
+  timeval now = {0, 0};
+  if (event_base_once(base, -1, EV_TIMEOUT, StopEventLoopCallback, this,
+                      &now) != 0) {
+    DIE("event_base_once failed");
+  }
+}
+
+void NodeThread::RunAfter(uint64_t delay_ns,
+                          std::function<void()> closure) const {
+  uint64_t deadline_ns = GetTimeAccurateNano() + delay_ns;
+  if (pthread_equal(pthread_self(), impl_->pt)) {
+    impl_->ScheduleTimer(deadline_ns, std::move(closure));
+    return;
+  }
+  NodeThreadImpl* impl = impl_.get();
+  RunInLoop([impl, deadline_ns, closure]() {
+    impl->ScheduleTimer(deadline_ns, closure);
+  });
+}
 }  // namespace oldisim
 
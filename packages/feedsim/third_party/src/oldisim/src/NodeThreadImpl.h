@@ -18,19 +18,45 @@
 #define NODE_THREAD_IMPL_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <event2/event.h>
 
+#include <functional>
 #include <memory>
 #include <vector>
 
+#include "TimerWheel.h"
+
 namespace oldisim {
 
 class ChildConnection;
 
+// Counts the connection reads and task queue runs of the calling thread, so
+// busy polling can tell the passes that did work from idle ones
+extern thread_local uint64_t event_loop_activity;
+
+inline void NoteEventLoopActivity() { event_loop_activity++; }
+
 struct NodeThread::NodeThreadImpl {
   pthread_t pt;      // pthread handle
   event_base* base;  // Event base handle
   int thread_num;    // Numbered starting from 0
+  int numa_node;     // NUMA node the thread is placed on, -1 if unknown
+  // Backs RunAfter, created on first use by the thread itself
+  std::unique_ptr<TimerWheel> timer_wheel;
+  // Set by StopEventLoop, on the thread itself
+  bool stop_requested = false;
+
+  // Must be called on the thread itself
+  void ScheduleTimer(uint64_t deadline_ns, std::function<void()> closure);
+
+  // Must be called on the thread itself, returns once StopEventLoop is
+  // called. Blocks in epoll or busy polls depending on the event loop mode.
+  void RunEventLoop();
+  // May be called from any thread
+  void StopEventLoop();
+  static void StopEventLoopCallback(evutil_socket_t listener, int16_t flags,
+                                    void* arg);
 };
 }
 
@@ -0,0 +1,196 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace oldisim {
+
+/**
+ * Counters describing how well an ObjectPool is serving allocations.
+ * A hit is an allocation satisfied from a cached slot, a miss had to fall
+ * back to operator new. Remote frees are objects released by a thread
+ * other than the owner and handed back through the lock-free return list.
+ */
+struct ObjectPoolStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t remote_frees;
+
+  ObjectPoolStats() : hits(0), misses(0), remote_frees(0) {}
+
+  ObjectPoolStats& operator+=(const ObjectPoolStats& other) {
+    hits += other.hits;
+    misses += other.misses;
+    remote_frees += other.remote_frees;
+    return *this;
+  }
+
+  double HitRate() const {
+    uint64_t total = hits + misses;
+    return total == 0 ? 0.0 : static_cast<double>(hits) / total;
+  }
+};
+
+/**
+ * Free-list pool of T owned by a single thread. New() must only be called
+ * by the thread that first allocated from the pool; Delete() may be called
+ * from any thread. Objects freed on the owner thread go straight back on a
+ * local free list, objects freed elsewhere are pushed onto an atomic stack
+ * that the owner reclaims in one exchange once its local list runs dry.
+ * Each slot records its pool, so Delete() needs no pool argument. At most
+ * max_cached slots are kept on the local list, the rest are released.
+ * The pool must outlive every object allocated from it.
+ */
+template <typename T>
+class ObjectPool {
+ public:
+  static constexpr size_t kDefaultMaxCached = 4096;
+
+  explicit ObjectPool(size_t max_cached = kDefaultMaxCached)
+      : max_cached_(max_cached),
+        local_free_(nullptr),
+        num_local_free_(0),
+        remote_free_(nullptr),
+        hits_(0),
+        misses_(0),
+        remote_frees_(0) {}
+
+  ~ObjectPool() {
+    FreeList(local_free_);
+    FreeList(remote_free_.exchange(nullptr, std::memory_order_acquire));
+  }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  template <typename... Args>
+  T* New(Args&&... args) {
+    if (owner_ == std::thread::id()) {
+      owner_ = std::this_thread::get_id();
+    }
+
+    if (local_free_ == nullptr) {
+      ReclaimRemoteFrees();
+    }
+
+    Slot* slot = local_free_;
+    if (slot != nullptr) {
+      local_free_ = slot->next;
+      num_local_free_--;
+      hits_.store(hits_.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    } else {
+      slot = new Slot;
+      slot->pool = this;
+      misses_.store(misses_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+    return new (&slot->storage) T(std::forward<Args>(args)...);
+  }
+
+  static void Delete(T* object) {
+    if (object == nullptr) {
+      return;
+    }
+
+    Slot* slot = reinterpret_cast<Slot*>(reinterpret_cast<char*>(object) -
+                                         offsetof(Slot, storage));
+    object->~T();
+
+    ObjectPool* pool = slot->pool;
+    if (std::this_thread::get_id() == pool->owner_) {
+      if (pool->num_local_free_ >= pool->max_cached_) {
+        delete slot;
+        return;
+      }
+      slot->next = pool->local_free_;
+      pool->local_free_ = slot;
+      pool->num_local_free_++;
+    } else {
+      Slot* head = pool->remote_free_.load(std::memory_order_relaxed);
+      do {
+        slot->next = head;
+      } while (!pool->remote_free_.compare_exchange_weak(
+          head, slot, std::memory_order_release, std::memory_order_relaxed));
+      pool->remote_frees_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  ObjectPoolStats GetStats() const {
+    ObjectPoolStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.remote_frees = remote_frees_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  struct Slot {
+    ObjectPool* pool;
+    Slot* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  void ReclaimRemoteFrees() {
+    Slot* slot = remote_free_.exchange(nullptr, std::memory_order_acquire);
+    while (slot != nullptr) {
+      Slot* next = slot->next;
+      if (num_local_free_ < max_cached_) {
+        slot->next = local_free_;
+        local_free_ = slot;
+        num_local_free_++;
+      } else {
+        delete slot;
+      }
+      slot = next;
+    }
+  }
+
+  static void FreeList(Slot* slot) {
+    while (slot != nullptr) {
+      Slot* next = slot->next;
+      delete slot;
+      slot = next;
+    }
+  }
+
+  const size_t max_cached_;
+  std::thread::id owner_;
+
+  // Owner-thread state
+  Slot* local_free_;
+  size_t num_local_free_;
+
+  // Slots returned by other threads, reclaimed by the owner in bulk
+  std::atomic<Slot*> remote_free_;
+
+  // Written only by the owner except remote_frees_, read by anyone
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> remote_frees_;
+};
+
+template <typename T>
+constexpr size_t ObjectPool<T>::kDefaultMaxCached;
+
+}  // namespace oldisim
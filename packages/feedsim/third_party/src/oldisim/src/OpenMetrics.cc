@@ -0,0 +1,231 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "OpenMetrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "oldisim/ChildConnectionStats.h"
+#include "oldisim/HdrHistogram.h"
+#include "oldisim/LeafNodeStats.h"
+
+namespace oldisim {
+
+const char OpenMetricsWriter::kContentType[] =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+// Upper bounds of the latency histogram buckets, 10us to 10s
+static const double kLatencyBucketsSeconds[] = {
+    0.00001, 0.00002, 0.00005, 0.0001, 0.0002, 0.0005, 0.001,
+    0.002,   0.005,   0.01,    0.02,   0.05,   0.1,    0.2,
+    0.5,     1,       2,       5,      10};
+
+static std::string TypeLabel(uint32_t type) {
+  return OpenMetricsWriter::Label("type", std::to_string(type));
+}
+
+void OpenMetricsWriter::Family(const std::string& name, const char* type,
+                               const char* help) {
+  evbuffer_add_printf(out_, "# TYPE %s %s\n# HELP %s %s\n", name.c_str(), type,
+                      name.c_str(), help);
+}
+
+void OpenMetricsWriter::Sample(const std::string& name,
+                               const std::string& labels, uint64_t value) {
+  if (labels.empty()) {
+    evbuffer_add_printf(out_, "%s %" PRIu64 "\n", name.c_str(), value);
+  } else {
+    evbuffer_add_printf(out_, "%s{%s} %" PRIu64 "\n", name.c_str(),
+                        labels.c_str(), value);
+  }
+}
+
+void OpenMetricsWriter::Sample(const std::string& name,
+                               const std::string& labels, double value) {
+  if (labels.empty()) {
+    evbuffer_add_printf(out_, "%s %.9g\n", name.c_str(), value);
+  } else {
+    evbuffer_add_printf(out_, "%s{%s} %.9g\n", name.c_str(), labels.c_str(),
+                        value);
+  }
+}
+
+void OpenMetricsWriter::Histogram(const std::string& name,
+                                  const std::string& labels,
+                                  const HdrHistogram& histogram_ns) {
+  std::string bucket_labels = labels.empty() ? "" : labels + ",";
+  for (double bound : kLatencyBucketsSeconds) {
+    char le[32];
+    snprintf(le, sizeof(le), "%g", bound);
+    Sample(name + "_bucket", bucket_labels + Label("le", le),
+           histogram_ns.count_at_or_below(bound * 1e9));
+  }
+  Sample(name + "_bucket", bucket_labels + Label("le", "+Inf"),
+         histogram_ns.total());
+  Sample(name + "_count", labels, histogram_ns.total());
+  Sample(name + "_sum", labels, histogram_ns.sum() / 1e9);
+}
+
+void OpenMetricsWriter::LeafNodeStatsFamilies(const std::string& prefix,
+                                              const LeafNodeStats& stats) {
+  auto counter = [&](const char* suffix, const char* help,
+                     const TypeIndexedArray<uint64_t>& counts) {
+    std::string name = prefix + suffix;
+    Family(name, "counter", help);
+    for (const auto& count : counts) {
+      Sample(name + "_total", TypeLabel(count.first), count.second);
+    }
+  };
+  counter("_requests", "Requests received", stats.query_counts_);
+  counter("_responses", "Responses sent", stats.response_counts_);
+  counter("_expired_requests", "Requests dropped past their deadline",
+          stats.expired_counts_);
+  counter("_rejected_requests", "Requests turned away by admission control",
+          stats.rejected_counts_);
+  counter("_request_bytes", "Bytes of requests received", stats.rx_bytes_);
+  counter("_response_bytes", "Bytes of responses sent", stats.tx_bytes_);
+
+  std::string name = prefix + "_processing_time_seconds";
+  Family(name, "histogram", "Time spent processing requests");
+  for (const auto& sampler : stats.processing_time_samplers_) {
+    Histogram(name, TypeLabel(sampler.first), sampler.second);
+  }
+}
+
+void OpenMetricsWriter::ChildConnectionStatsFamilies(
+    const std::string& prefix, const std::vector<std::string>& child_names,
+    const std::vector<ChildConnectionStats>& stats) {
+  auto labels = [&](size_t child, uint32_t type) {
+    return Label("child", child_names[child]) + "," + TypeLabel(type);
+  };
+  auto counter = [&](const char* suffix, const char* help,
+                     TypeIndexedArray<uint64_t> ChildConnectionStats::*counts) {
+    std::string name = prefix + suffix;
+    Family(name, "counter", help);
+    for (size_t i = 0; i < stats.size(); i++) {
+      for (const auto& count : stats[i].*counts) {
+        Sample(name + "_total", labels(i, count.first), count.second);
+      }
+    }
+  };
+  counter("_requests", "Requests sent, including hedges",
+          &ChildConnectionStats::query_counts_);
+  counter("_request_bytes", "Bytes of requests sent",
+          &ChildConnectionStats::tx_bytes_);
+  counter("_response_bytes", "Bytes of responses received",
+          &ChildConnectionStats::rx_bytes_);
+  counter("_dropped_requests", "Requests that never got a response",
+          &ChildConnectionStats::dropped_requests_);
+  counter("_late_requests", "Requests sent after their scheduled time",
+          &ChildConnectionStats::late_requests_);
+  counter("_hedged_requests", "Backup requests sent",
+          &ChildConnectionStats::hedged_requests_);
+  counter("_hedge_wins", "Backup requests answered before the original",
+          &ChildConnectionStats::hedge_wins_);
+  counter("_abandoned_requests", "Requests left behind by a quorum",
+          &ChildConnectionStats::abandoned_requests_);
+  counter("_rejected_requests", "Requests the child turned away",
+          &ChildConnectionStats::rejected_requests_);
+  counter("_expired_requests", "Requests the child dropped past their deadline",
+          &ChildConnectionStats::expired_requests_);
+  counter("_queued_requests", "Requests held back by a full credit window",
+          &ChildConnectionStats::queued_requests_);
+  counter("_throttled_requests", "Requests failed by a full credit window",
+          &ChildConnectionStats::throttled_requests_);
+
+  std::string name = prefix + "_queue_wait_seconds";
+  Family(name, "counter", "Time requests waited for a credit window");
+  for (size_t i = 0; i < stats.size(); i++) {
+    for (const auto& wait : stats[i].queue_wait_ns_) {
+      Sample(name + "_total", labels(i, wait.first), wait.second / 1e9);
+    }
+  }
+
+  name = prefix + "_credit_window";
+  Family(name, "gauge", "Requests a thread may have outstanding, 0 for any");
+  for (size_t i = 0; i < stats.size(); i++) {
+    Sample(name, Label("child", child_names[i]), stats[i].credit_window_);
+  }
+
+  name = prefix + "_outstanding_requests";
+  Family(name, "gauge", "Requests sent that have not been answered yet");
+  for (size_t i = 0; i < stats.size(); i++) {
+    for (const auto& count : stats[i].query_counts_) {
+      uint64_t answered = stats[i].query_samplers_.at(count.first).total() +
+                          stats[i].rejected_requests_.at(count.first) +
+                          stats[i].expired_requests_.at(count.first);
+      Sample(name, labels(i, count.first),
+             count.second > answered ? count.second - answered : 0);
+    }
+  }
+
+  name = prefix + "_latency_seconds";
+  Family(name, "histogram", "Time from sending a request to its response");
+  for (size_t i = 0; i < stats.size(); i++) {
+    for (const auto& sampler : stats[i].query_samplers_) {
+      Histogram(name, labels(i, sampler.first), sampler.second);
+    }
+  }
+
+  name = prefix + "_processing_time_seconds";
+  Family(name, "histogram", "Processing time reported by the child");
+  for (size_t i = 0; i < stats.size(); i++) {
+    for (const auto& sampler : stats[i].query_processing_time_samplers_) {
+      Histogram(name, labels(i, sampler.first), sampler.second);
+    }
+  }
+
+  auto histograms = [&](const char* suffix, const char* help,
+                        TypeIndexedArray<HdrHistogram> ChildConnectionStats::*
+                            samplers) {
+    std::string name = prefix + suffix;
+    Family(name, "histogram", help);
+    for (size_t i = 0; i < stats.size(); i++) {
+      for (const auto& sampler : stats[i].*samplers) {
+        Histogram(name, labels(i, sampler.first), sampler.second);
+      }
+    }
+  };
+  histograms("_network_time_seconds",
+             "Latency outside the child: the network and both stacks",
+             &ChildConnectionStats::query_network_time_samplers_);
+  histograms("_queue_time_seconds",
+             "Time requests waited at the child before being handled",
+             &ChildConnectionStats::query_queue_time_samplers_);
+  histograms("_service_time_seconds",
+             "Processing time at the child after requests were dequeued",
+             &ChildConnectionStats::query_service_time_samplers_);
+}
+
+void OpenMetricsWriter::Finish() { evbuffer_add_printf(out_, "# EOF\n"); }
+
+std::string OpenMetricsWriter::Label(const char* key,
+                                     const std::string& value) {
+  std::string label = key;
+  label += "=\"";
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      label += '\\';
+      label += c;
+    } else if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  label += '"';
+  return label;
+}
+}  // namespace oldisim
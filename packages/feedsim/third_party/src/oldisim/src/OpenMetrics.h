@@ -0,0 +1,92 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <event2/buffer.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace oldisim {
+
+class ChildConnectionStats;
+class HdrHistogram;
+class LeafNodeStats;
+
+/**
+ * Writes metrics into an evbuffer in the OpenMetrics text exposition
+ * format, for scrapers that poll the /metrics monitoring endpoint.
+ * Counters are running totals, so scrapers derive rates themselves, and
+ * latency histograms are exported in seconds over a fixed set of buckets.
+ *
+ * All samples of a family must be written right after its Family() line.
+ */
+class OpenMetricsWriter {
+ public:
+  static const char kContentType[];
+
+  explicit OpenMetricsWriter(evbuffer* out) : out_(out) {}
+
+  /**
+   * Start a family. type is an OpenMetrics type such as "counter", whose
+   * samples are named name + "_total", "gauge" or "histogram".
+   */
+  void Family(const std::string& name, const char* type, const char* help);
+
+  /**
+   * Write one sample. labels is a list made by Label(), or empty.
+   */
+  void Sample(const std::string& name, const std::string& labels,
+              uint64_t value);
+  void Sample(const std::string& name, const std::string& labels,
+              double value);
+
+  /**
+   * Write the buckets, count and sum of a histogram of nanoseconds
+   */
+  void Histogram(const std::string& name, const std::string& labels,
+                 const HdrHistogram& histogram_ns);
+
+  /**
+   * Write the request counters, byte counters and processing time
+   * histograms of stats, one series per request type
+   */
+  void LeafNodeStatsFamilies(const std::string& prefix,
+                             const LeafNodeStats& stats);
+
+  /**
+   * Write the request, byte and outcome counters, outstanding requests and
+   * latency histograms of each child, labelled by child_names
+   */
+  void ChildConnectionStatsFamilies(
+      const std::string& prefix, const std::vector<std::string>& child_names,
+      const std::vector<ChildConnectionStats>& stats);
+
+  /**
+   * Terminate the exposition. Nothing may be written afterwards.
+   */
+  void Finish();
+
+  /**
+   * key="value", with value escaped, to be joined with commas
+   */
+  static std::string Label(const char* key, const std::string& value);
+
+ private:
+  evbuffer* out_;
+};
+}  // namespace oldisim
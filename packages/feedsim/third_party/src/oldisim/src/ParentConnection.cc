@@ -23,12 +23,36 @@
 #include <sys/socket.h>
 #include <string.h>
 
+#include <atomic>
+
 #include "ParentConnectionImpl.h"
 #include "oldisim/LeafNodeServer.h"
 #include "oldisim/Response.h"
 
 namespace oldisim {
 
+namespace {
+/**
+ * Shared by all segments of one zero-copy response, so the owner is
+ * released when libevent is done with the last of them
+ */
+struct ResponseSegmentsRelease {
+  std::atomic<int> num_segments;
+  std::function<void()> release;
+};
+
+void ReleaseResponseSegment(const void* data, size_t length, void* arg) {
+  ResponseSegmentsRelease* segments_release =
+      reinterpret_cast<ResponseSegmentsRelease*>(arg);
+  if (--segments_release->num_segments == 0) {
+    if (segments_release->release != nullptr) {
+      segments_release->release();
+    }
+    delete segments_release;
+  }
+}
+}  // namespace
+
 ParentConnection::ParentConnection(std::unique_ptr<ParentConnectionImpl> impl)
     : impl_(move(impl)) {}
 
@@ -37,23 +61,64 @@ ParentConnection::~ParentConnection() {}
 void ParentConnection::SendResponse(
     uint32_t response_type, uint64_t query_id, uint64_t start_time,
     uint64_t processing_time, const void* data, uint32_t data_length,
-    std::function<void(const Response&)> logger) {
+    std::function<void(const Response&)> logger, ResponseStatus status,
+    uint64_t queue_time) {
   Response response(response_type, query_id, start_time, processing_time,
-                    data_length);
-
-  // Send it over the wire
-  {
-    std::unique_lock<std::mutex> lock;
-    // Grab the lock if locking is enabled to avoid split responses
-    if (impl_->use_locking) {
-      lock = std::unique_lock<std::mutex>(impl_->sending_lock);
+                    data_length, status, queue_time);
+
+  // Send it over the wire, or hand it to the owner thread to send
+  ParentConnectionImpl::CompletedResponse* completion;
+  evbuffer* output = impl_->BeginResponse(&completion);
+  impl_->AddResponseHeader(output, &response);
+  if (data_length > 0) {
+    evbuffer_add(output, data, data_length);
+  }
+  impl_->EndResponse(completion);
+
+  // Update stats
+  if (logger != nullptr) {
+    logger(response);
+  }
+}
+
+void ParentConnection::SendResponse(
+    uint32_t response_type, uint64_t query_id, uint64_t start_time,
+    uint64_t processing_time, const iovec* segments, int num_segments,
+    std::function<void()> release,
+    std::function<void(const Response&)> logger, uint64_t queue_time) {
+  uint32_t data_length = 0;
+  int num_nonempty_segments = 0;
+  for (int i = 0; i < num_segments; i++) {
+    data_length += segments[i].iov_len;
+    if (segments[i].iov_len > 0) {
+      num_nonempty_segments++;
     }
-    ResponsePacketHeader header = std::move(response.GetHeaderNetworkOrder());
-    bufferevent_write(impl_->bev, &header, sizeof(header));
-    if (data_length > 0) {
-      bufferevent_write(impl_->bev, data, data_length);
+  }
+  Response response(response_type, query_id, start_time, processing_time,
+                    data_length, ResponseStatus::kOk, queue_time);
+
+  ResponseSegmentsRelease* segments_release = nullptr;
+  if (num_nonempty_segments > 0) {
+    segments_release = new ResponseSegmentsRelease;
+    segments_release->num_segments = num_nonempty_segments;
+    segments_release->release = std::move(release);
+  } else if (release != nullptr) {
+    release();
+  }
+
+  // Send it over the wire referencing the payload segments in place, or
+  // hand it to the owner thread to send
+  ParentConnectionImpl::CompletedResponse* completion;
+  evbuffer* output = impl_->BeginResponse(&completion);
+  impl_->AddResponseHeader(output, &response);
+  for (int i = 0; i < num_segments; i++) {
+    if (segments[i].iov_len > 0) {
+      evbuffer_add_reference(output, segments[i].iov_base,
+                             segments[i].iov_len, ReleaseResponseSegment,
+                             segments_release);
     }
   }
+  impl_->EndResponse(completion);
 
   // Update stats
   if (logger != nullptr) {
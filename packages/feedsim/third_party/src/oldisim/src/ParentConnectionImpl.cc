@@ -18,26 +18,217 @@
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <string.h>
+#include <sys/socket.h>
 
+#include <algorithm>
+
+#include "CompactFraming.h"
 #include "ConnectionUtil.h"
+#include "NodeThreadImpl.h"
 #include "oldisim/Callbacks.h"
 #include "oldisim/Query.h"
 #include "oldisim/QueryContext.h"
+#include "oldisim/Util.h"
 
 namespace oldisim {
 
+// Staged responses beyond this many bytes are flushed without waiting for
+// the flush budget to expire
+static const size_t kCorkedFlushBytes = 64 * 1024;
+
 ParentConnection::ParentConnectionImpl::ParentConnectionImpl(
     const ParentConnectionReceivedCallback& _request_handler,
-    const ClosedCallback& _closed_cb, bufferevent* _bev, bool _use_locking)
+    const ClosedCallback& _closed_cb, bufferevent* _bev,
+    bool _cross_thread_responses, int _flush_budget_us,
+    bool _segmented_payloads)
     : request_handler(_request_handler),
       bev(_bev),
       read_state(ReadState::INIT_READ),
       closed_cb(_closed_cb),
-      use_locking(_use_locking) {}
+      cross_thread_responses(_cross_thread_responses),
+      owner(pthread_self()),
+      completed_responses(nullptr),
+      completion_event(nullptr),
+      compact_framing(false),
+      corked_output(nullptr),
+      flush_event(nullptr),
+      flush_pending(false),
+      flush_budget_us(_flush_budget_us),
+      segmented_payloads(_segmented_payloads) {
+  if (flush_budget_us >= 0) {
+    corked_output = evbuffer_new();
+    flush_event = evtimer_new(bufferevent_get_base(bev), FlushCallback, this);
+  }
+  if (cross_thread_responses) {
+    completion_event =
+        event_new(bufferevent_get_base(bev), -1, 0, CompletionCallback, this);
+  }
+}
 
 ParentConnection::ParentConnectionImpl::~ParentConnectionImpl() {
+  if (completion_event != nullptr) {
+    event_free(completion_event);
+  }
+  // Responses completed after the last callback are dropped with the socket
+  CompletedResponse* completion = completed_responses.exchange(nullptr);
+  while (completion != nullptr) {
+    CompletedResponse* next = completion->next;
+    evbuffer_free(completion->output);
+    delete completion;
+    completion = next;
+  }
+  if (flush_event != nullptr) {
+    event_free(flush_event);
+  }
+  if (corked_output != nullptr) {
+    evbuffer_free(corked_output);
+  }
+  // Its event has to go before the socket is closed
+  rx_timestamper.reset();
   bufferevent_disable(bev, EV_READ | EV_WRITE);
-  bufferevent_free(bev);
+  ConnectionUtil::FreeSocketBufferevent(bev);
+}
+
+evbuffer* ParentConnection::ParentConnectionImpl::BeginResponse(
+    CompletedResponse** completion) {
+  if (!cross_thread_responses || pthread_equal(pthread_self(), owner)) {
+    *completion = nullptr;
+    return GetResponseOutput();
+  }
+  *completion = new CompletedResponse;
+  (*completion)->output = evbuffer_new();
+  return (*completion)->output;
+}
+
+void ParentConnection::ParentConnectionImpl::EndResponse(
+    CompletedResponse* completion) {
+  if (completion == nullptr) {
+    ScheduleFlush();
+    return;
+  }
+
+  CompletedResponse* head = completed_responses.load(std::memory_order_relaxed);
+  do {
+    completion->next = head;
+  } while (!completed_responses.compare_exchange_weak(
+      head, completion, std::memory_order_release, std::memory_order_relaxed));
+  // The owner takes the whole stack at once, so only the first response
+  // pushed since then needs to wake it up
+  if (head == nullptr) {
+    event_active(completion_event, EV_TIMEOUT, 0);
+  }
+}
+
+void ParentConnection::ParentConnectionImpl::TakeCompletedResponses() {
+  CompletedResponse* completion =
+      completed_responses.exchange(nullptr, std::memory_order_acquire);
+  if (completion == nullptr) {
+    return;
+  }
+
+  // The stack holds the latest response first, send in completion order
+  CompletedResponse* in_order = nullptr;
+  while (completion != nullptr) {
+    CompletedResponse* next = completion->next;
+    completion->next = in_order;
+    in_order = completion;
+    completion = next;
+  }
+
+  evbuffer* output = GetResponseOutput();
+  while (in_order != nullptr) {
+    CompletedResponse* next = in_order->next;
+    evbuffer_add_buffer(output, in_order->output);
+    evbuffer_free(in_order->output);
+    delete in_order;
+    in_order = next;
+  }
+  ScheduleFlush();
+}
+
+evbuffer* ParentConnection::ParentConnectionImpl::GetResponseOutput() {
+  if (corked_output != nullptr) {
+    return corked_output;
+  }
+  return bufferevent_get_output(bev);
+}
+
+void ParentConnection::ParentConnectionImpl::AddResponseHeader(
+    evbuffer* output, Response* response) {
+  if (compact_framing) {
+    uint8_t header[CompactFraming::kMaxHeaderLength];
+    response->header_length_ =
+        CompactFraming::EncodeResponseHeader(response->response_header_,
+                                             header);
+    evbuffer_add(output, header, response->header_length_);
+  } else {
+    ResponsePacketHeader header = response->GetHeaderNetworkOrder();
+    evbuffer_add(output, &header, sizeof(header));
+  }
+}
+
+void ParentConnection::ParentConnectionImpl::AcknowledgeHello() {
+  Response ack(CompactFraming::kHelloType, CompactFraming::kHelloMagic, 0, 0,
+               0);
+  AddResponseHeader(GetResponseOutput(), &ack);
+  ScheduleFlush();
+  compact_framing = true;
+
+  // Compact queries may be shorter than a fixed header
+  bufferevent_setwatermark(bev, EV_READ, 1, 0);
+}
+
+void ParentConnection::ParentConnectionImpl::ScheduleFlush() {
+  if (corked_output == nullptr) {
+    return;
+  }
+
+  if (evbuffer_get_length(corked_output) >= kCorkedFlushBytes) {
+    // Enough staged that waiting any longer only adds latency
+    event_active(flush_event, EV_TIMEOUT, 0);
+    flush_pending = true;
+  } else if (!flush_pending) {
+    if (flush_budget_us == 0) {
+      // Runs once the callbacks of the current loop iteration are done
+      event_active(flush_event, EV_TIMEOUT, 0);
+    } else {
+      timeval tv;
+      MicroToTv(flush_budget_us, &tv);
+      evtimer_add(flush_event, &tv);
+    }
+    flush_pending = true;
+  }
+}
+
+void ParentConnection::ParentConnectionImpl::Flush() {
+  flush_pending = false;
+  event_del(flush_event);
+
+  if (evbuffer_get_length(corked_output) == 0) {
+    return;
+  }
+
+  // If nothing is queued in the bufferevent, write all the staged responses
+  // with a single writev, and leave only what the socket did not take to
+  // the bufferevent. Otherwise append behind the queued data to keep order.
+  // Bufferevents without a socket, as with the io_uring engine, batch the
+  // send themselves.
+  evbuffer* output = bufferevent_get_output(bev);
+  evutil_socket_t fd = bufferevent_getfd(bev);
+  if (fd >= 0 && evbuffer_get_length(output) == 0) {
+    evbuffer_write(corked_output, fd);
+  }
+  evbuffer_add_buffer(output, corked_output);
+}
+
+void ParentConnection::ParentConnectionImpl::FlushCallback(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  reinterpret_cast<ParentConnectionImpl*>(arg)->Flush();
+}
+
+void ParentConnection::ParentConnectionImpl::CompletionCallback(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  reinterpret_cast<ParentConnectionImpl*>(arg)->TakeCompletedResponses();
 }
 
 // The followings are C trampolines for libevent callbacks
@@ -50,41 +241,93 @@ void ParentConnection::ParentConnectionImpl::bev_event_cb(bufferevent* bev,
   } else if (events & BEV_EVENT_ERROR) {
   } else if (events & BEV_EVENT_EOF) {
     D("Parent closed connection");
-    conn->impl_->read_state = ReadState::CLOSED;
-    bufferevent_disable(conn->impl_->bev, EV_READ | EV_WRITE);
-    if (conn->impl_->closed_cb != nullptr) {
-      conn->impl_->closed_cb(*conn);
-    }
+    conn->impl_->HandleClose(conn);
+  }
+}
+
+void ParentConnection::ParentConnectionImpl::HandleClose(
+    ParentConnection* conn) {
+  read_state = ReadState::CLOSED;
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  if (closed_cb != nullptr) {
+    closed_cb(*conn);
   }
 }
 
 /**
  * Check to see if the buffer contains at least one full query that is ready
- * for retrieval. If so, it returns true; false otherwise
+ * for retrieval. If so, decode its header in host byte order. Batch frame
+ * headers are drained once the whole batch is in, leaving its queries to be
+ * read like any other.
  *
  * @param input evbuffer to read query from
- * @return true if a query is ready to be read, false if not enough data in
- *buffer
+ * @param compact whether the query may be a compact frame
+ * @param header where to decode the header of the query to
+ * @return the length of the header if a query is ready to be read, 0 if not
+ * enough data in buffer, or CompactFraming::kMalformedHeader if the frame
+ * can never be read
  */
-static bool BufferContainsQuery(evbuffer* input) {
-  // Check length of input buffer
-  size_t buffer_length = evbuffer_get_length(input);
-  const size_t header_length = sizeof(QueryPacketHeader);
-  if (buffer_length < header_length) {
-    return false;
-  }
-  QueryPacketHeader* h = reinterpret_cast<QueryPacketHeader*>(
-      evbuffer_pullup(input, header_length));
-  assert(h);
+static size_t BufferContainsQuery(evbuffer* input, bool compact,
+                                  QueryPacketHeader* header) {
+  while (true) {
+    // Check length of input buffer
+    size_t buffer_length = evbuffer_get_length(input);
+    if (buffer_length == 0) {
+      return 0;
+    }
 
-  // Not whole query
-  uint32_t packet_length = header_length + be32toh(h->payload_length);
-  if (buffer_length < packet_length) {
-    return false;
-  }
+    size_t header_length;
+    uint8_t first_byte;
+    evbuffer_copyout(input, &first_byte, 1);
+    if (compact && CompactFraming::IsCompactFrame(first_byte)) {
+      size_t available =
+          std::min(buffer_length, CompactFraming::kMaxHeaderLength);
+      const uint8_t* data = evbuffer_pullup(input, available);
+      assert(data);
+      if (CompactFraming::IsBatchFrame(first_byte)) {
+        uint32_t body_length;
+        size_t batch_header_length =
+            CompactFraming::DecodeBatchHeader(data, available, &body_length);
+        if (batch_header_length == CompactFraming::kMalformedHeader) {
+          return batch_header_length;
+        }
+        if (batch_header_length == 0 ||
+            buffer_length < batch_header_length + body_length) {
+          return 0;
+        }
+        evbuffer_drain(input, batch_header_length);
+        continue;
+      }
+      header_length =
+          CompactFraming::DecodeQueryHeader(data, available, header);
+      if (header_length == 0 ||
+          header_length == CompactFraming::kMalformedHeader) {
+        return header_length;
+      }
+    } else {
+      header_length = sizeof(QueryPacketHeader);
+      if (buffer_length < header_length) {
+        return 0;
+      }
+      QueryPacketHeader* h = reinterpret_cast<QueryPacketHeader*>(
+          evbuffer_pullup(input, header_length));
+      assert(h);
+      header->type = be32toh(h->type);
+      header->request_id = be64toh(h->request_id);
+      header->start_time = be64toh(h->start_time);
+      header->payload_length = be32toh(h->payload_length);
+      header->priority = be32toh(h->priority);
+      header->deadline_us = be32toh(h->deadline_us);
+    }
+
+    // Not whole query
+    if (buffer_length < header_length + header->payload_length) {
+      return 0;
+    }
 
-  // Must be full query
-  return true;
+    // Must be full query
+    return header_length;
+  }
 }
 
 void ParentConnection::ParentConnectionImpl::bev_read_cb(bufferevent* bev,
@@ -92,6 +335,10 @@ void ParentConnection::ParentConnectionImpl::bev_read_cb(bufferevent* bev,
   ParentConnection* conn = reinterpret_cast<ParentConnection*>(ptr);
   evbuffer* input = bufferevent_get_input(bev);
   int num_queries_processed = 0;
+  NoteEventLoopActivity();
+  uint64_t arrival_time = conn->impl_->rx_timestamper != nullptr
+                              ? conn->impl_->rx_timestamper->TakeArrival()
+                              : 0;
 
   while (true) {
     switch (conn->impl_->read_state) {
@@ -102,29 +349,51 @@ void ParentConnection::ParentConnectionImpl::bev_read_cb(bufferevent* bev,
         DIE("event from closed connection");
       }
       case ReadState::WAITING: {
-        if (BufferContainsQuery(input)) {
-          // Read out entire query
-          const size_t header_length = sizeof(QueryPacketHeader);
-          QueryPacketHeader* h = reinterpret_cast<QueryPacketHeader*>(
-              evbuffer_pullup(input, header_length));
-          assert(h);
-
+        QueryPacketHeader header;
+        size_t header_length = BufferContainsQuery(
+            input, conn->impl_->compact_framing, &header);
+        if (header_length == CompactFraming::kMalformedHeader) {
+          // Nothing after it can be framed, so give up on the connection
+          W("Malformed query frame from parent, closing connection");
+          evbuffer_drain(input, evbuffer_get_length(input));
+          shutdown(bufferevent_getfd(bev), SHUT_RDWR);
+          conn->impl_->HandleClose(conn);
+          return;
+        }
+        if (header_length > 0) {
           // Get the header information
-          uint32_t type = be32toh(h->type);
-          uint64_t query_id = be64toh(h->request_id);
-          uint64_t start_time = be64toh(h->start_time);
-          uint32_t payload_length = be32toh(h->payload_length);
+          uint32_t type = header.type;
+          uint64_t query_id = header.request_id;
+          uint64_t start_time = header.start_time;
+          uint32_t payload_length = header.payload_length;
           uint32_t packet_length = header_length + payload_length;
+          uint32_t priority = header.priority;
+          uint32_t deadline_us = header.deadline_us;
 
           // Remove the header
           evbuffer_drain(input, header_length);
 
-          // Linearize evbuffer to allow for payload reading
-          void* payload = evbuffer_pullup(input, payload_length);
+          // The hello of a child asking for compact framing is not a query
+          if (type == CompactFraming::kHelloType &&
+              query_id == CompactFraming::kHelloMagic) {
+            evbuffer_drain(input, payload_length);
+            conn->impl_->AcknowledgeHello();
+            break;
+          }
+
+          // Linearize evbuffer to allow for payload reading, unless the
+          // payload may be handed out in segments
+          void* payload = ConnectionUtil::PeekPayload(
+              input, payload_length, conn->impl_->segmented_payloads,
+              &conn->impl_->payload_segments);
 
           // Create query context
           QueryContext context(*conn, type, query_id, start_time,
-                               payload_length, packet_length, payload, false);
+                               payload_length, packet_length, priority,
+                               deadline_us, payload, false,
+                               conn->impl_->payload_segments.data(),
+                               conn->impl_->payload_segments.size(),
+                               &conn->impl_->linear_payload, arrival_time);
 
           // Call callback, handing off full query context and # of query
           // processed in this loop
@@ -16,15 +16,21 @@
 #pragma once
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <set>
-#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include "oldisim/Callbacks.h"
 #include "InternalCallbacks.h"
+#include "RxTimestamper.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
 
@@ -45,16 +51,83 @@ struct ParentConnection::ParentConnectionImpl {
   };
   ReadState read_state;
 
-  std::mutex sending_lock;
-  bool use_locking;
+  // Only the owner, the thread the connection was created on and whose
+  // event base runs bev, touches bev and the output buffers. Responses sent
+  // from other threads are framed into a CompletedResponse of their own and
+  // pushed onto completed_responses, a lock-free stack the owner takes over
+  // from completion_event, so that responses need no bufferevent locking.
+  // completion_event is only created if cross_thread_responses is set, and
+  // is activated by whoever pushes onto an empty stack.
+  struct CompletedResponse {
+    evbuffer* output;
+    CompletedResponse* next;
+  };
+  const bool cross_thread_responses;
+  const pthread_t owner;
+  std::atomic<CompletedResponse*> completed_responses;
+  event* completion_event;
+
+  // Set once the child sends its hello, from when it may send compact
+  // frames and is answered with them; see Framing. Set by the owner before
+  // it reads the queries that follow the hello, so the threads answering
+  // those queries see it.
+  bool compact_framing;
+
+  // Corked response mode. Responses are staged in corked_output and flushed
+  // to the socket together, at the end of the event loop tick when the flush
+  // budget is 0, or at most flush_budget_us after the first staged response.
+  // corked_output is nullptr when corking is off.
+  evbuffer* corked_output;
+  event* flush_event;
+  bool flush_pending;
+  int flush_budget_us;
+
+  // Queries whose payload spans several receive buffers are handed out as
+  // segments instead of being linearized. payload_segments describes the
+  // query being handled and linear_payload is reused by every query that
+  // asks for contiguous bytes.
+  const bool segmented_payloads;
+  std::vector<iovec> payload_segments;
+  std::vector<char> linear_payload;
+
+  // Arrival times of queries from kernel timestamps, nullptr if off
+  std::unique_ptr<RxTimestamper> rx_timestamper;
 
   ParentConnectionImpl(const ParentConnectionReceivedCallback& _request_handler,
                        const ClosedCallback& _closed_cb, bufferevent* _bev,
-                       bool _use_locking);
+                       bool _cross_thread_responses, int _flush_budget_us,
+                       bool _segmented_payloads);
   ~ParentConnectionImpl();
 
+  // Returns where a response should be written to. Off the owner thread
+  // that is the output of a new CompletedResponse, returned in completion,
+  // which EndResponse hands over to the owner
+  evbuffer* BeginResponse(CompletedResponse** completion);
+  void EndResponse(CompletedResponse* completion);
+  // Move the responses completed on other threads to the output
+  void TakeCompletedResponses();
+
+  // The following must be called on the owner thread
+  // Returns where responses should be written to
+  evbuffer* GetResponseOutput();
+  // Stop reading and writing and tell the owner the connection is closed
+  void HandleClose(ParentConnection* conn);
+  // Answer the hello of a child and switch to compact framing
+  void AcknowledgeHello();
+  // Arrange for staged responses to be flushed
+  void ScheduleFlush();
+  void Flush();
+
+  // Write the header of response in the framing of the connection, and
+  // record its length in response
+  void AddResponseHeader(evbuffer* output, Response* response);
+
   static void bev_event_cb(struct bufferevent* bev, int16_t events, void* ptr);
   static void bev_read_cb(struct bufferevent* bev, void* ptr);
   static void bev_write_cb(struct bufferevent* bev, void* ptr);
+  static void FlushCallback(evutil_socket_t listener, int16_t flags,
+                            void* arg);
+  static void CompletionCallback(evutil_socket_t listener, int16_t flags,
+                                 void* arg);
 };
 }  // namespace oldisim
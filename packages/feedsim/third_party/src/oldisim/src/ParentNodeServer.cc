@@ -40,7 +40,6 @@
 #include <algorithm>
 #include <array>
 #include <deque>
-#include <iomanip>
 #include <list>
 #include <memory>
 #include <mutex>
@@ -50,19 +49,25 @@
 #include <unordered_map>
 #include <vector>
 
-#include "AutoSnapshot.h"
 #include "CerealMapAsJSObject.h"
 #include "ConnectionUtil.h"
 #include "FanoutManagerImpl.h"
 #include "ForcedEvTimer.h"
 #include "InternalCallbacks.h"
+#include "LocalTransport.h"
+#include "MonitoringConfig.h"
 #include "NodeThreadImpl.h"
+#include "ObjectPool.h"
+#include "OpenMetrics.h"
+#include "RssConnector.h"
 #include "oldisim/ChildConnection.h"
 #include "oldisim/FanoutManager.h"
 #include "oldisim/LeafNodeStats.h"
 #include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
+#include "oldisim/StatsLog.h"
+#include "oldisim/Topology.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
@@ -90,10 +95,12 @@ struct ParentNodeServer::ParentNodeServerThread {
   std::deque<int> incoming_fds;
   std::mutex incoming_fds_lock;
 
-  // Auto snapshot of children stats
-  std::unique_ptr<AutoSnapshot<StatsSnapshot>> stats_snapshotter;
-  StatsSnapshot GetStatsSnapshotCallback();
-  void PostSnapshotCallback();
+  // Own SO_REUSEPORT listening socket, if threads accept for themselves
+  event* listen_event;
+
+  // Copy of the running totals of the children stats that the main thread
+  // took at the end of the previous stats window
+  StatsSnapshot last_stats_snapshot;
 
   // Forced timer for event loop
   std::unique_ptr<ForcedEvTimer> forced_timer;
@@ -112,8 +119,12 @@ struct ParentNodeServer::ParentNodeServerThread {
    */
   static void* ThreadMain(void* arg);
   static void AcceptHandler(evutil_socket_t listener, int16_t flags, void* arg);
+  static void ListenHandler(evutil_socket_t listener, int16_t flags, void* arg);
 
   void ParentConnectionClosedHandler(const ParentConnection& conn);
+  void AddParentConnection(int fd);
+  void SetUpParentConnection(int fd);
+  void Listen(int listener);
   void RequestHandler(QueryContext& request, int num_request_in_batch);
   void LogResponse(const Response& response);
 
@@ -141,21 +152,34 @@ struct ParentNodeServer::ParentNodeServerImpl {
   // List of children node addresses
   std::vector<addrinfo*> child_node_addr;
   std::vector<std::string> child_node_addr_string;
+  std::vector<Transport> child_node_transport;
+  std::vector<Framing> child_node_framing;
 
   // Save queries for debugging
   bool store_queries;
 
+  // Does every thread accept on its own SO_REUSEPORT socket, and are
+  // connections steered to the thread on the CPU that received them
+  bool use_reuse_port;
+  bool use_cpu_steering;
+
   // Thread initialization barrier
   pthread_barrier_t thread_init_barrier;
 
   // Remote monitoring settings
   bool monitor_enabled;
   uint16_t monitor_port;
+  MonitoringStatsCallback monitoring_stats_cb;
+  MonitoringConfigEndpoint monitoring_config;
 
   // Aggregated stats every 5 seconds
   event* stats_timer_event;
   std::deque<StatsSnapshot> stats_history;  // newest samples are in the front
 
+  // Where to append every stats window, empty if disabled
+  std::string stats_log_path;
+  std::unique_ptr<StatsLogWriter> stats_log;
+
   ParentNodeServerImpl();
   static void AcceptHandler(evutil_socket_t listener, int16_t event, void* arg);
   static void ShutdownHandler(evutil_socket_t listener, int16_t event,
@@ -163,10 +187,13 @@ struct ParentNodeServer::ParentNodeServerImpl {
   static void PullStatsTimerHandler(evutil_socket_t listener, int16_t flags,
                                     void* arg);
   static void AddPullStatsTimer(ParentNodeServer& server);
+  void ListenOnThreads();
 
   // Remote monitoring HTTP callbacks
   static void MonitoringTopologyHandler(evhttp_request* req, void* arg);
   static void MonitoringChildStatsHandler(evhttp_request* req, void* arg);
+  static void MonitoringServerStatsHandler(evhttp_request* req, void* arg);
+  static void MonitoringMetricsHandler(evhttp_request* req, void* arg);
   static void MonitoringDefaultHandler(evhttp_request* req, void* arg);
 };
 
@@ -180,8 +207,11 @@ ParentNodeServer::ParentNodeServerImpl::ParentNodeServerImpl()
       base(nullptr),
       port(0),
       store_queries(false),
+      use_reuse_port(false),
+      use_cpu_steering(false),
       monitor_enabled(false),
-      monitor_port(0) {}
+      monitor_port(0),
+      monitoring_stats_cb(nullptr) {}
 
 void ParentNodeServer::ParentNodeServerImpl::AcceptHandler(
     evutil_socket_t listener, int16_t event, void* arg) {
@@ -214,6 +244,28 @@ void ParentNodeServer::ParentNodeServerImpl::AcceptHandler(
   }
 }
 
+/**
+ * Give every thread its own SO_REUSEPORT socket. The sockets are made in
+ * thread order so that socket i of the group belongs to thread i, which
+ * the CPU steering program relies on.
+ */
+void ParentNodeServer::ParentNodeServerImpl::ListenOnThreads() {
+  std::vector<int> cpus;
+  int first_listener = -1;
+  for (auto& thread : threads) {
+    int listener = ConnectionUtil::ListenReusePort(port);
+    if (first_listener < 0) {
+      first_listener = listener;
+    }
+    cpus.push_back(GetPinnedCpu(thread->node_thread.get_pthread()));
+    thread->Listen(listener);
+  }
+  if (use_cpu_steering &&
+      !ConnectionUtil::SteerReusePortByCpu(first_listener, cpus)) {
+    W("Could not steer connections by CPU, the kernel hashes them instead");
+  }
+}
+
 void ParentNodeServer::ParentNodeServerImpl::ShutdownHandler(
     evutil_socket_t listener, int16_t event, void* arg) {
   ParentNodeServer* server = reinterpret_cast<ParentNodeServer*>(arg);
@@ -224,34 +276,39 @@ void ParentNodeServer::ParentNodeServerImpl::PullStatsTimerHandler(
     evutil_socket_t listener, int16_t flags, void* arg) {
   ParentNodeServer* server = reinterpret_cast<ParentNodeServer*>(arg);
 
-  // Figure out number of ready snapshots from all threads
-  unsigned int num_ready_snapshots = -1;  // this is MAX_INT in unsigned
+  // The window of each thread is the difference between its running totals
+  // now and at the end of the last window, read while the thread keeps
+  // logging into them
+  StatsSnapshot snapshot(
+      server->impl_->child_node_addr.size(),
+      ChildConnectionStats(server->impl_->child_request_types));
   for (const auto& thread : server->impl_->threads) {
-    num_ready_snapshots = std::min(
-        num_ready_snapshots, thread->stats_snapshotter->GetNumberSnapshots());
-  }
-
-  // Pull the snapshots
-  for (int i = 0; i < num_ready_snapshots; i++) {
-    StatsSnapshot snapshot(
-        server->impl_->child_node_addr.size(),
-        ChildConnectionStats(server->impl_->child_request_types));
-    for (const auto& thread : server->impl_->threads) {
-      // Aggregate into one big snapshot by node
-      const StatsSnapshot& thread_snapshot =
-          thread->stats_snapshotter->PopSnapshot();
-      for (int j = 0; j < snapshot.size(); j++) {
-        snapshot[j].Accumulate(thread_snapshot[j]);
-      }
+    const auto& child_nodes = thread->fanout_manager->impl_->child_nodes;
+    // Aggregate into one big snapshot by node
+    for (int j = 0; j < snapshot.size(); j++) {
+      ChildConnectionStats totals(server->impl_->child_request_types);
+      child_nodes[j].stats->Snapshot(&totals);
+      snapshot[j].Accumulate(totals);
+      snapshot[j].Subtract(thread->last_stats_snapshot[j]);
+      thread->last_stats_snapshot[j] = std::move(totals);
     }
+  }
 
-    // Put it into the stats snapshot history
-    server->impl_->stats_history.emplace_front(std::move(snapshot));
-
-    // Pop from end if stats history is too large
-    if (server->impl_->stats_history.size() > kStatsMaxWindows) {
-      server->impl_->stats_history.pop_back();
+  if (server->impl_->stats_log != nullptr) {
+    StatsLogWriter& log = *server->impl_->stats_log;
+    for (int j = 0; j < snapshot.size(); j++) {
+      ConnectionUtil::AddChildConnectionStatsToLog(
+          log, "child" + std::to_string(j) + ".", snapshot[j]);
     }
+    log.WriteWindow(log.last_window_end_ns(), GetTimeAccurateNano());
+  }
+
+  // Put it into the stats snapshot history
+  server->impl_->stats_history.emplace_front(std::move(snapshot));
+
+  // Pop from end if stats history is too large
+  if (server->impl_->stats_history.size() > kStatsMaxWindows) {
+    server->impl_->stats_history.pop_back();
   }
 
   AddPullStatsTimer(*server);
@@ -385,6 +442,91 @@ void ParentNodeServer::ParentNodeServerImpl::MonitoringChildStatsHandler(
   evbuffer_free(evb);
 }
 
+void ParentNodeServer::ParentNodeServerImpl::MonitoringServerStatsHandler(
+    evhttp_request* req, void* arg) {
+  ParentNodeServer* server = reinterpret_cast<ParentNodeServer*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  std::stringstream ss;
+  {
+    cereal::JSONOutputArchive oarchive(ss);
+    oarchive(cereal::make_nvp("stats", server->impl_->monitoring_stats_cb()));
+  }
+  evbuffer_add_printf(evb, "%s", ss.str().c_str());
+
+  // Send response
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
+void ParentNodeServer::ParentNodeServerImpl::MonitoringMetricsHandler(
+    evhttp_request* req, void* arg) {
+  ParentNodeServer* server = reinterpret_cast<ParentNodeServer*>(arg);
+
+  // Only respond to GET requests
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADREQUEST, 0);
+    return;
+  }
+
+  // Create a buffer to put reply contents in
+  evbuffer* evb = evbuffer_new();
+  if (evb == nullptr) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, 0);
+    return;
+  }
+
+  // Sum up the running totals of all threads as they are right now
+  std::set<uint32_t> query_types =
+      ConnectionUtil::GetQueryTypes(server->impl_->on_query_cbs);
+  LeafNodeStats stats(query_types);
+  StatsSnapshot child_stats(
+      server->impl_->child_node_addr.size(),
+      ChildConnectionStats(server->impl_->child_request_types));
+  for (const auto& thread : server->impl_->threads) {
+    LeafNodeStats thread_stats(query_types);
+    thread->this_node_stats->Snapshot(&thread_stats);
+    stats.Accumulate(thread_stats);
+
+    const auto& child_nodes = thread->fanout_manager->impl_->child_nodes;
+    for (int i = 0; i < child_stats.size(); i++) {
+      ChildConnectionStats thread_child_stats(
+          server->impl_->child_request_types);
+      child_nodes[i].stats->Snapshot(&thread_child_stats);
+      child_stats[i].Accumulate(thread_child_stats);
+    }
+  }
+
+  OpenMetricsWriter writer(evb);
+  writer.LeafNodeStatsFamilies("oldisim_parent", stats);
+  writer.ChildConnectionStatsFamilies("oldisim_parent_child",
+                                      server->impl_->child_node_addr_string,
+                                      child_stats);
+  writer.Finish();
+
+  // Send response
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    OpenMetricsWriter::kContentType);
+  evhttp_send_reply(req, 200, "OK", evb);
+
+  // Cleanup
+  evbuffer_free(evb);
+}
+
 void ParentNodeServer::ParentNodeServerImpl::MonitoringDefaultHandler(
     evhttp_request* req, void* arg) {
   ParentNodeServer* server = reinterpret_cast<ParentNodeServer*>(arg);
@@ -402,7 +544,8 @@ ParentNodeServer::ParentNodeServerThread::~ParentNodeServerThread() {
 
 ParentNodeServer::ParentNodeServerThread::ParentNodeServerThread(
     ParentNodeServer& _server)
-    : server(_server)
+    : server(_server),
+      listen_event(nullptr)
 #ifdef PARENT_CONN_STATS
       ,
       total_parent_conn_stats(
@@ -419,8 +562,10 @@ void ParentNodeServer::ParentNodeServerThread::Init() {
   fanout_manager.reset(
       new FanoutManager(std::unique_ptr<FanoutManager::FanoutManagerImpl>(
           new FanoutManager::FanoutManagerImpl(
-              server.impl_->child_node_addr, server.impl_->child_request_types,
-              node_thread))));
+              server.impl_->child_node_addr,
+              server.impl_->child_node_transport,
+              server.impl_->child_node_framing,
+              server.impl_->child_request_types, node_thread))));
 
   // Create function objects that contain NodeThread and FanoutManager
   // information
@@ -431,14 +576,12 @@ void ParentNodeServer::ParentNodeServerThread::Init() {
                                      std::placeholders::_1));
   }
 
-  // Create auto snapshot
-  stats_snapshotter.reset(new AutoSnapshot<StatsSnapshot>(
-      node_thread.impl_->base, kStatsWindowSeconds,
-      std::bind(
-          &ParentNodeServer::ParentNodeServerThread::GetStatsSnapshotCallback,
-          this),
-      std::bind(&ParentNodeServer::ParentNodeServerThread::PostSnapshotCallback,
-                this)));
+  // Children stats are read by the main thread while this thread logs
+  for (auto& node : fanout_manager->impl_->child_nodes) {
+    node.stats->ReserveForSnapshots();
+    last_stats_snapshot.push_back(
+        ChildConnectionStats(server.impl_->child_request_types));
+  }
 
   this_node_stats.reset(new LeafNodeStats(
       ConnectionUtil::GetQueryTypes(server.impl_->on_query_cbs)));
@@ -472,52 +615,14 @@ void* ParentNodeServer::ParentNodeServerThread::ThreadMain(void* arg) {
   // Signal this thread has init'ed
   pthread_barrier_wait(&thread->server.impl_->thread_init_barrier);
 
-  // If remote monitoring is enabled, start collection
-  if (thread->server.impl_->monitor_enabled) {
-    thread->stats_snapshotter->Enable();
-  }
-
   // Start event loop
-  event_base_dispatch(thread->node_thread.impl_->base);
+  thread->node_thread.impl_->RunEventLoop();
 
   D("ParentNodeServerThread about to exit...");
 
   return nullptr;
 }
 
-StatsSnapshot
-ParentNodeServer::ParentNodeServerThread::GetStatsSnapshotCallback() {
-  // Print out queue depths of each connection
-  std::stringstream ss;
-  ss.precision(2);
-  for (const auto& node : fanout_manager->impl_->child_nodes) {
-    for (const auto& conn : node.connections) {
-      ss << "(" << std::setw(5) << conn->GetNumOutstandingRequests() << ", "
-         << std::setw(6)
-         << (node.stats->query_processing_time_samplers_.at(0).average() /
-             1000000) << ") ";
-    }
-  }
-  D("T: %02d %s", fanout_manager->impl_->node_thread.get_thread_num(),
-    ss.str().c_str());
-
-  // Create copy of stats
-  std::vector<ChildConnectionStats> stats_copy;
-  stats_copy.reserve(fanout_manager->impl_->child_nodes.size());
-  for (auto& node : fanout_manager->impl_->child_nodes) {
-    stats_copy.push_back(*node.stats);
-  }
-
-  return stats_copy;
-}
-
-void ParentNodeServer::ParentNodeServerThread::PostSnapshotCallback() {
-  // Reset stats
-  for (auto& node : fanout_manager->impl_->child_nodes) {
-    node.stats->Reset();
-  }
-}
-
 void ParentNodeServer::ParentNodeServerThread::AcceptHandler(
     evutil_socket_t listener, int16_t flags, void* arg) {
   ParentNodeServerThread* thread =
@@ -547,27 +652,7 @@ void ParentNodeServer::ParentNodeServerThread::AcceptHandler(
 
     // Create event buffer objects and such for each fd
     for (int i = 0; i < num_accepted_fds; i++) {
-      int fd = incoming_fds[i];
-      // Create a parent connection object
-      std::unique_ptr<ParentConnection> conn(
-          ConnectionUtil::MakeParentConnection(
-              std::bind(
-                  &ParentNodeServer::ParentNodeServerThread::RequestHandler,
-                  thread, std::placeholders::_1, std::placeholders::_2),
-              std::bind(&ParentNodeServer::ParentNodeServerThread::
-                            ParentConnectionClosedHandler,
-                        thread, std::placeholders::_1),
-              thread->node_thread, fd, thread->server.impl_->store_queries,
-              false));
-
-      // Call the OnAccept handler
-      if (thread->server.impl_->on_accept != nullptr) {
-        thread->server.impl_->on_accept(thread->node_thread, *conn);
-      }
-
-      // Assign connection to the thread's internal book-keeping and activate it
-      ConnectionUtil::EnableParentConnection(*conn);
-      thread->parent_connections.emplace_back(move(conn));
+      thread->AddParentConnection(incoming_fds[i]);
     }
 
     if (num_new_fds == num_accepted_fds) {
@@ -577,6 +662,58 @@ void ParentNodeServer::ParentNodeServerThread::AcceptHandler(
   }
 }
 
+void ParentNodeServer::ParentNodeServerThread::ListenHandler(
+    evutil_socket_t listener, int16_t flags, void* arg) {
+  ParentNodeServerThread* thread =
+      reinterpret_cast<ParentNodeServerThread*>(arg);
+
+  // Bound the accepts per call so a connection storm does not starve the
+  // connections already served; the event stays readable until drained
+  const int kMaxAccepts = 10;
+  ConnectionUtil::AcceptConnections(
+      listener, kMaxAccepts,
+      [thread](int fd) { thread->AddParentConnection(fd); });
+}
+
+void ParentNodeServer::ParentNodeServerThread::AddParentConnection(int fd) {
+  // Local transport clients are only set up once their hello is in, which
+  // the event loop waits for rather than holding up other connections
+  ConnectionUtil::AwaitParentConnection(node_thread, fd, [this](int ready_fd) {
+    SetUpParentConnection(ready_fd);
+  });
+}
+
+void ParentNodeServer::ParentNodeServerThread::SetUpParentConnection(int fd) {
+  // Create a parent connection object
+  std::unique_ptr<ParentConnection> conn(ConnectionUtil::MakeParentConnection(
+      std::bind(&ParentNodeServer::ParentNodeServerThread::RequestHandler, this,
+                std::placeholders::_1, std::placeholders::_2),
+      std::bind(&ParentNodeServer::ParentNodeServerThread::
+                    ParentConnectionClosedHandler,
+                this, std::placeholders::_1),
+      node_thread, fd, server.impl_->store_queries, false));
+  if (conn == nullptr) {
+    return;
+  }
+
+  // Call the OnAccept handler
+  if (server.impl_->on_accept != nullptr) {
+    server.impl_->on_accept(node_thread, *conn);
+  }
+
+  // Assign connection to the thread's internal book-keeping and activate it
+  ConnectionUtil::EnableParentConnection(*conn);
+  parent_connections.emplace_back(move(conn));
+}
+
+void ParentNodeServer::ParentNodeServerThread::Listen(int listener) {
+  // Safe from the main thread, libevent locking is enabled
+  listen_event = event_new(node_thread.impl_->base, listener,
+                           EV_READ | EV_PERSIST, ListenHandler, this);
+  assert(listen_event);
+  event_add(listen_event, nullptr);
+}
+
 void ParentNodeServer::ParentNodeServerThread::ParentConnectionClosedHandler(
     const ParentConnection& conn) {}
 
@@ -701,33 +838,35 @@ void ParentNodeServer::Run(uint32_t num_threads, bool thread_pinning) {
 
   // Wait for all worker threads to start
   pthread_barrier_wait(&impl_->thread_init_barrier);
+  LogRssQueueConnections();
 
   // Set up the socket to listen on after all threads are ready
-  sockaddr_in sin;
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = 0;
-  sin.sin_port = htons(impl_->port);
-
-  evutil_socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
-  evutil_make_socket_nonblocking(listener);
-
-  int one = 1;
-  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-
-  if (bind(listener, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0) {
-    DIE("bind failed: %s", strerror(errno));
+  if (impl_->use_reuse_port) {
+    impl_->ListenOnThreads();
+  } else {
+    // Drivers in high connection count mode open thousands of connections
+    // at once
+    evutil_socket_t listener =
+        ConnectionUtil::ListenAnyAddress(impl_->port, false, SOMAXCONN);
+
+    // Make the listener event for libevent
+    event* listener_event =
+        event_new(impl_->base, listener, EV_READ | EV_PERSIST,
+                  ParentNodeServerImpl::AcceptHandler, this);
+    assert(listener_event);
+    event_add(listener_event, nullptr);
   }
 
-  if (listen(listener, 16) < 0) {
-    DIE("listen failed: %s", strerror(errno));
+  // Local transport connections are spread over the threads like TCP ones
+  int local_listener = ListenLocal(impl_->port);
+  if (local_listener >= 0) {
+    event* local_listener_event =
+        event_new(impl_->base, local_listener, EV_READ | EV_PERSIST,
+                  ParentNodeServerImpl::AcceptHandler, this);
+    assert(local_listener_event);
+    event_add(local_listener_event, nullptr);
   }
 
-  // Make the listener event for libevent
-  event* listener_event = event_new(impl_->base, listener, EV_READ | EV_PERSIST,
-                                    ParentNodeServerImpl::AcceptHandler, this);
-  assert(listener_event);
-  event_add(listener_event, nullptr);
-
   // Remote monitoring
   evhttp* monitor_http;
   evhttp_bound_socket* monitor_http_handle;
@@ -742,6 +881,15 @@ void ParentNodeServer::Run(uint32_t num_threads, bool thread_pinning) {
                   ParentNodeServerImpl::MonitoringTopologyHandler, this);
     evhttp_set_cb(monitor_http, "/child_stats",
                   ParentNodeServerImpl::MonitoringChildStatsHandler, this);
+    if (impl_->monitoring_stats_cb) {
+      evhttp_set_cb(monitor_http, "/server_stats",
+                    ParentNodeServerImpl::MonitoringServerStatsHandler, this);
+    }
+    evhttp_set_cb(monitor_http, "/metrics",
+                  ParentNodeServerImpl::MonitoringMetricsHandler, this);
+    if (impl_->monitoring_config.enabled()) {
+      impl_->monitoring_config.Register(monitor_http);
+    }
     evhttp_set_gencb(monitor_http,
                      ParentNodeServerImpl::MonitoringDefaultHandler, this);
 
@@ -756,6 +904,13 @@ void ParentNodeServer::Run(uint32_t num_threads, bool thread_pinning) {
       }
     }
     std::cout << "Monitor Server listening on port " << impl_->monitor_port << std::endl;
+  }
+
+  // Windows are needed for the monitor history and the stats log
+  if (!impl_->stats_log_path.empty()) {
+    impl_->stats_log.reset(new StatsLogWriter(impl_->stats_log_path, "parent"));
+  }
+  if (impl_->monitor_enabled || impl_->stats_log != nullptr) {
     ParentNodeServerImpl::AddPullStatsTimer(*this);
   }
 
@@ -766,6 +921,19 @@ void ParentNodeServer::Run(uint32_t num_threads, bool thread_pinning) {
   for (const auto& thread : impl_->threads) {
     pthread_join(thread->node_thread.impl_->pt, nullptr);
   }
+  if (impl_->stats_log != nullptr) {
+    impl_->stats_log->Close();
+  }
+
+  // Report how well the fanout tracker pools absorbed allocations
+  ObjectPoolStats pool_stats;
+  for (const auto& thread : impl_->threads) {
+    if (thread->fanout_manager) {
+      pool_stats += thread->fanout_manager->impl_->tracker_pool_stats;
+    }
+  }
+  I("Fanout tracker pool: %lu hits, %lu misses (%.1f%% hit rate)",
+    pool_stats.hits, pool_stats.misses, pool_stats.HitRate() * 100);
 }
 
 void ParentNodeServer::Shutdown() {
@@ -774,7 +942,7 @@ void ParentNodeServer::Shutdown() {
 
   // Stop event_base on threads
   for (auto& thread : impl_->threads) {
-    event_base_loopbreak(thread->node_thread.impl_->base);
+    thread->node_thread.impl_->StopEventLoop();
   }
 }
 
@@ -796,6 +964,12 @@ void ParentNodeServer::SetAcceptCallback(const AcceptCallback& callback) {
   impl_->on_accept = callback;
 }
 
+void ParentNodeServer::SetReusePortListeners(bool use_reuse_port,
+                                             bool use_cpu_steering) {
+  impl_->use_reuse_port = use_reuse_port;
+  impl_->use_cpu_steering = use_cpu_steering;
+}
+
 /**
  * Set the callback to run after an incoming query is received.
  * It will run in the context of the event thread that is responsible
@@ -819,9 +993,12 @@ void ParentNodeServer::RegisterRequestType(uint32_t type) {
  * Add a hostname:port as a child node that requests can be sent to.
  * Note that it is up to the thread to create the actual connections.
  */
-void ParentNodeServer::AddChildNode(std::string hostname, uint16_t port) {
+void ParentNodeServer::AddChildNode(std::string hostname, uint16_t port,
+                                    Transport transport, Framing framing) {
   // Add it to the chlid nodes structure
   impl_->child_node_addr.emplace_back(ResolveHost(hostname, port));
+  impl_->child_node_transport.push_back(transport);
+  impl_->child_node_framing.push_back(framing);
 
   // Make a string representation of the node
   impl_->child_node_addr_string.emplace_back(MakeAddress(hostname, port));
@@ -836,4 +1013,18 @@ void ParentNodeServer::EnableMonitoring(uint16_t port) {
   impl_->monitor_enabled = true;
   impl_->monitor_port = port;
 }
+
+void ParentNodeServer::SetMonitoringStatsCallback(
+    const MonitoringStatsCallback& callback) {
+  impl_->monitoring_stats_cb = callback;
+}
+
+void ParentNodeServer::SetMonitoringConfigCallback(
+    const std::string& token, const MonitoringConfigCallback& callback) {
+  impl_->monitoring_config = MonitoringConfigEndpoint(token, callback);
+}
+
+void ParentNodeServer::SetStatsLogFile(const std::string& path) {
+  impl_->stats_log_path = path;
+}
 }  // namespace oldisim
@@ -0,0 +1,132 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/PerfCounters.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "oldisim/Log.h"
+
+namespace oldisim {
+
+struct PerfCounterEvent {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+static const PerfCounterEvent kPerfCounterEvents[kNumPerfCounters] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"l1i_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static int OpenPerfEvent(const PerfCounterEvent& event, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // The leader starts the whole group once every member is attached
+  attr.disabled = group_fd < 0 ? 1 : 0;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+PerfCounterGroup::PerfCounterGroup() {
+  fds_.fill(-1);
+  ids_.fill(0);
+
+  for (int i = 0; i < kNumPerfCounters; i++) {
+    int fd = OpenPerfEvent(kPerfCounterEvents[i], fds_[0]);
+    if (fd < 0) {
+      if (i == 0) {
+        // Every thread fails the same way, so only warn once
+        static std::atomic_flag warned = ATOMIC_FLAG_INIT;
+        if (!warned.test_and_set()) {
+          W("Could not open perf counters: %s", strerror(errno));
+        }
+        return;
+      }
+      D("Perf counter %s is not available: %s", kPerfCounterEvents[i].name,
+        strerror(errno));
+      continue;
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_ID, &ids_[i]) != 0) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    fds_[i] = fd;
+  }
+
+  ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounterGroup::~PerfCounterGroup() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+PerfCounterValues PerfCounterGroup::Read() const {
+  PerfCounterValues values;
+  if (!enabled()) {
+    return values;
+  }
+
+  // PERF_FORMAT_GROUP | PERF_FORMAT_ID: nr, then a value and id per member
+  uint64_t buffer[1 + 2 * kNumPerfCounters];
+  ssize_t length = read(fds_[0], buffer, sizeof(buffer));
+  if (length < static_cast<ssize_t>(sizeof(uint64_t))) {
+    return values;
+  }
+  uint64_t nr = std::min<uint64_t>(buffer[0], kNumPerfCounters);
+  for (uint64_t i = 0; i < nr; i++) {
+    uint64_t value = buffer[1 + 2 * i];
+    uint64_t id = buffer[2 + 2 * i];
+    for (int c = 0; c < kNumPerfCounters; c++) {
+      if (fds_[c] >= 0 && ids_[c] == id) {
+        values.counts[c] = value;
+        break;
+      }
+    }
+  }
+  return values;
+}
+
+const char* PerfCounterGroup::CounterName(PerfCounter counter) {
+  return kPerfCounterEvents[static_cast<int>(counter)].name;
+}
+}  // namespace oldisim
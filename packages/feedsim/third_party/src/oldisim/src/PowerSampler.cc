@@ -0,0 +1,331 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "PowerSampler.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <chrono>
+#include <fstream>
+
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+static const char* kPowercapPath = "/sys/class/powercap";
+static const char* kHwmonPath = "/sys/class/hwmon";
+static const char* kCpuPath = "/sys/devices/system/cpu";
+static const int kSampleIntervalSeconds = 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+static const off_t kMsrMperf = 0xe7;
+static const off_t kMsrAperf = 0xe8;
+#endif
+
+static std::vector<std::string> ListDirectory(const std::string& path) {
+  std::vector<std::string> names;
+  DIR* dir = opendir(path.c_str());
+  if (dir != nullptr) {
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        names.push_back(entry->d_name);
+      }
+    }
+    closedir(dir);
+  }
+  return names;
+}
+
+static bool ReadCounter(const std::string& path, uint64_t* value) {
+  std::ifstream file(path);
+  return static_cast<bool>(file >> *value);
+}
+
+PowerSampler::PowerSampler()
+    : running_(false),
+      start_time_(0),
+      final_report_({0, false, 0, false, 0}),
+      energy_uj_(0),
+      start_aperf_(0),
+      start_mperf_(0),
+      start_tsc_(0),
+      cpufreq_sum_mhz_(0),
+      num_cpufreq_samples_(0) {
+  // Top level RAPL zones are the packages, their subzones are part of them
+  for (const std::string& zone : ListDirectory(kPowercapPath)) {
+    unsigned int package;
+    char trailing;
+    if (sscanf(zone.c_str(), "intel-rapl:%u%c", &package, &trailing) != 1) {
+      continue;
+    }
+    EnergyCounter counter = {
+        std::string(kPowercapPath) + "/" + zone + "/energy_uj", 0, 0};
+    ReadCounter(std::string(kPowercapPath) + "/" + zone +
+                    "/max_energy_range_uj",
+                &counter.max_range_uj);
+    if (ReadCounter(counter.path, &counter.last_uj)) {
+      energy_counters_.push_back(counter);
+    }
+  }
+  if (energy_counters_.empty()) {
+    for (const std::string& hwmon : ListDirectory(kHwmonPath)) {
+      std::string hwmon_path = std::string(kHwmonPath) + "/" + hwmon;
+      for (const std::string& sensor : ListDirectory(hwmon_path)) {
+        unsigned int index;
+        char suffix[8];
+        if (sscanf(sensor.c_str(), "energy%u_%7s", &index, suffix) != 2 ||
+            strcmp(suffix, "input") != 0) {
+          continue;
+        }
+        EnergyCounter counter = {hwmon_path + "/" + sensor, 0, 0};
+        if (ReadCounter(counter.path, &counter.last_uj)) {
+          energy_counters_.push_back(counter);
+        }
+      }
+    }
+  }
+
+  std::vector<int> cpus;
+  for (const std::string& cpu_name : ListDirectory(kCpuPath)) {
+    int cpu;
+    char trailing;
+    if (sscanf(cpu_name.c_str(), "cpu%d%c", &cpu, &trailing) == 1) {
+      cpus.push_back(cpu);
+    }
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  for (int cpu : cpus) {
+    int fd = open(("/dev/cpu/" + std::to_string(cpu) + "/msr").c_str(),
+                  O_RDONLY);
+    if (fd < 0) {
+      // One unreadable CPU makes the sums meaningless
+      for (int msr_fd : msr_fds_) {
+        close(msr_fd);
+      }
+      msr_fds_.clear();
+      break;
+    }
+    msr_fds_.push_back(fd);
+  }
+#endif
+  if (msr_fds_.empty()) {
+    for (int cpu : cpus) {
+      std::string path = std::string(kCpuPath) + "/cpu" + std::to_string(cpu) +
+                         "/cpufreq/scaling_cur_freq";
+      uint64_t khz;
+      if (ReadCounter(path, &khz)) {
+        cpufreq_paths_.push_back(path);
+      }
+    }
+  }
+
+  if (energy_counters_.empty()) {
+    W("No readable RAPL or hwmon energy counters, not reporting energy");
+  }
+  if (msr_fds_.empty() && cpufreq_paths_.empty()) {
+    W("Neither /dev/cpu/N/msr nor cpufreq is readable, not reporting "
+      "frequency");
+  }
+}
+
+PowerSampler::~PowerSampler() {
+  Stop();
+  for (int fd : msr_fds_) {
+    close(fd);
+  }
+}
+
+void PowerSampler::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_) {
+    return;
+  }
+  for (EnergyCounter& counter : energy_counters_) {
+    ReadCounter(counter.path, &counter.last_uj);
+  }
+  energy_uj_ = 0;
+  cpufreq_sum_mhz_ = 0;
+  num_cpufreq_samples_ = 0;
+  if (!ReadAperfMperf(&start_aperf_, &start_mperf_)) {
+    for (int fd : msr_fds_) {
+      close(fd);
+    }
+    msr_fds_.clear();
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  start_tsc_ = __rdtsc();
+#endif
+  start_time_ = GetTimeAccurate();
+  running_ = true;
+  if (pthread_create(&thread_, nullptr, PowerSampler::ThreadMain, this)) {
+    DIE("pthread_create() failed: %s", strerror(errno));
+  }
+}
+
+void PowerSampler::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    TakeSample();
+    final_report_ = MakeReport(GetTimeAccurate());
+    running_ = false;
+  }
+  stop_cv_.notify_all();
+  pthread_join(thread_, nullptr);
+}
+
+PowerReport PowerSampler::GetReport() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!running_) {
+    return final_report_;
+  }
+  TakeSample();
+  return MakeReport(GetTimeAccurate());
+}
+
+void* PowerSampler::ThreadMain(void* arg) {
+  PowerSampler* sampler = reinterpret_cast<PowerSampler*>(arg);
+  std::unique_lock<std::mutex> lock(sampler->mutex_);
+  while (sampler->running_) {
+    sampler->stop_cv_.wait_for(lock,
+                               std::chrono::seconds(kSampleIntervalSeconds));
+    if (sampler->running_) {
+      sampler->TakeSample();
+    }
+  }
+  return nullptr;
+}
+
+void PowerSampler::TakeSample() {
+  for (EnergyCounter& counter : energy_counters_) {
+    uint64_t uj;
+    if (!ReadCounter(counter.path, &uj)) {
+      continue;
+    }
+    // RAPL counters wrap at max_energy_range_uj, at most once per sample
+    if (uj >= counter.last_uj) {
+      energy_uj_ += uj - counter.last_uj;
+    } else if (counter.max_range_uj > 0) {
+      energy_uj_ += counter.max_range_uj - counter.last_uj + uj;
+    }
+    counter.last_uj = uj;
+  }
+
+  if (!cpufreq_paths_.empty()) {
+    uint64_t sum_khz = 0;
+    for (const std::string& path : cpufreq_paths_) {
+      uint64_t khz = 0;
+      ReadCounter(path, &khz);
+      sum_khz += khz;
+    }
+    cpufreq_sum_mhz_ += sum_khz / 1000.0 / cpufreq_paths_.size();
+    num_cpufreq_samples_++;
+  }
+}
+
+PowerReport PowerSampler::MakeReport(double end_time) {
+  PowerReport report = {end_time - start_time_, !energy_counters_.empty(),
+                        energy_uj_ / 1e6, false, 0};
+
+  uint64_t aperf, mperf;
+  if (!msr_fds_.empty() && ReadAperfMperf(&aperf, &mperf)) {
+    // MPERF ticks at the TSC rate while the CPU is busy, APERF at the
+    // actual one
+    double elapsed_seconds = end_time - start_time_;
+    uint64_t mperf_ticks = mperf - start_mperf_;
+    if (mperf_ticks > 0 && elapsed_seconds > 0) {
+#if defined(__x86_64__) || defined(__i386__)
+      double tsc_hz = (__rdtsc() - start_tsc_) / elapsed_seconds;
+      report.has_frequency = true;
+      report.average_frequency_mhz =
+          tsc_hz * (aperf - start_aperf_) / mperf_ticks / 1e6;
+#endif
+    }
+  } else if (num_cpufreq_samples_ > 0) {
+    report.has_frequency = true;
+    report.average_frequency_mhz = cpufreq_sum_mhz_ / num_cpufreq_samples_;
+  }
+  return report;
+}
+
+bool PowerSampler::ReadAperfMperf(uint64_t* aperf, uint64_t* mperf) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (msr_fds_.empty()) {
+    return false;
+  }
+  *aperf = 0;
+  *mperf = 0;
+  for (int fd : msr_fds_) {
+    uint64_t cpu_aperf, cpu_mperf;
+    if (pread(fd, &cpu_aperf, sizeof(cpu_aperf), kMsrAperf) !=
+            sizeof(cpu_aperf) ||
+        pread(fd, &cpu_mperf, sizeof(cpu_mperf), kMsrMperf) !=
+            sizeof(cpu_mperf)) {
+      W("Could not read APERF/MPERF: %s", strerror(errno));
+      return false;
+    }
+    *aperf += cpu_aperf;
+    *mperf += cpu_mperf;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void PowerSampler::PrintReport(const PowerReport& report,
+                               uint64_t num_queries) {
+  if (report.has_energy) {
+    printf("Energy: %.1f J over %.1f s (%.1f W), %.2f queries/J\n",
+           report.energy_joules, report.elapsed_seconds,
+           report.elapsed_seconds > 0
+               ? report.energy_joules / report.elapsed_seconds
+               : 0,
+           report.energy_joules > 0 ? num_queries / report.energy_joules
+                                    : 0);
+  }
+  if (report.has_frequency) {
+    printf("Frequency: %.0f MHz average\n", report.average_frequency_mhz);
+  }
+}
+
+std::map<std::string, double> PowerSampler::MakeReportMap(
+    const PowerReport& report, uint64_t num_queries) {
+  std::map<std::string, double> values;
+  values["elapsed_seconds"] = report.elapsed_seconds;
+  if (report.has_energy) {
+    values["energy_joules"] = report.energy_joules;
+    values["power_watts"] = report.elapsed_seconds > 0
+                                ? report.energy_joules / report.elapsed_seconds
+                                : 0;
+    values["queries_per_joule"] =
+        report.energy_joules > 0 ? num_queries / report.energy_joules : 0;
+  }
+  if (report.has_frequency) {
+    values["average_frequency_mhz"] = report.average_frequency_mhz;
+  }
+  return values;
+}
+}  // namespace oldisim
@@ -0,0 +1,108 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace oldisim {
+
+/**
+ * Energy use and effective CPU frequency of this host over a measurement
+ * window. Each half is only valid if the host exposes its counters.
+ */
+struct PowerReport {
+  double elapsed_seconds;
+  bool has_energy;
+  double energy_joules;
+  bool has_frequency;
+  double average_frequency_mhz;
+};
+
+/**
+ * Samples the energy counters and CPU frequency of this host from a thread
+ * of its own, once per second so that energy counters cannot wrap unseen.
+ * Energy comes from the RAPL package zones under powercap, or from the
+ * hwmon energy sensors on hosts without RAPL such as most aarch64 servers.
+ * Frequency is the busy-time average of APERF/MPERF when /dev/cpu/N/msr is
+ * readable, and the mean cpufreq current frequency otherwise. Counters that
+ * cannot be read are left out of the report instead of failing the run.
+ */
+class PowerSampler {
+ public:
+  PowerSampler();
+  ~PowerSampler();
+  PowerSampler(const PowerSampler& that) = delete;
+
+  void Start();
+  void Stop();
+
+  /**
+   * The report for the measurement window, up to now if it is still going
+   */
+  PowerReport GetReport();
+
+  /**
+   * Print the report with the queries completed in the window to stdout
+   */
+  static void PrintReport(const PowerReport& report, uint64_t num_queries);
+
+  /**
+   * The report as named values for the monitoring JSON
+   */
+  static std::map<std::string, double> MakeReportMap(const PowerReport& report,
+                                                     uint64_t num_queries);
+
+ private:
+  struct EnergyCounter {
+    std::string path;
+    uint64_t max_range_uj;  // 0 if the counter does not wrap
+    uint64_t last_uj;
+  };
+
+  static void* ThreadMain(void* arg);
+
+  // These need mutex_ to be held
+  void TakeSample();
+  PowerReport MakeReport(double end_time);
+
+  // Sums over all CPUs, false if any of them could not be read
+  bool ReadAperfMperf(uint64_t* aperf, uint64_t* mperf);
+
+  std::vector<EnergyCounter> energy_counters_;
+  std::vector<int> msr_fds_;
+  std::vector<std::string> cpufreq_paths_;
+
+  std::mutex mutex_;
+  std::condition_variable stop_cv_;
+  bool running_;
+  pthread_t thread_;
+
+  double start_time_;
+  PowerReport final_report_;
+  uint64_t energy_uj_;
+  uint64_t start_aperf_;
+  uint64_t start_mperf_;
+  uint64_t start_tsc_;
+  double cpufreq_sum_mhz_;
+  uint64_t num_cpufreq_samples_;
+};
+}  // namespace oldisim
@@ -16,32 +16,62 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 
+#include "ConnectionUtil.h"
 #include "oldisim/Log.h"
 #include "oldisim/Util.h"
 
 namespace oldisim {
 
+// Flight records keep offsets of up to about 4 seconds
+static uint32_t SaturatingOffset(uint64_t ns) {
+  return std::min<uint64_t>(ns, std::numeric_limits<uint32_t>::max());
+}
+
 QueryContext::QueryContext(ParentConnection& _connection, uint32_t _type,
                            uint64_t _request_id, uint64_t _start_time,
                            uint32_t _payload_length, uint32_t _packet_length,
-                           void* _payload, bool _is_payload_heap)
+                           uint32_t _priority, uint32_t deadline_us,
+                           void* _payload, bool _is_payload_heap,
+                           const iovec* _segments, int _num_segments,
+                           std::vector<char>* _linear_buffer,
+                           uint64_t _arrival_time)
     : connection(_connection),
       type(_type),
       request_id(_request_id),
       start_time(_start_time),
       received_time(GetTimeAccurateNano()),
+      // A kernel timestamp cannot be later than the read that saw it
+      arrival_time(_arrival_time == 0
+                       ? received_time
+                       : std::min(_arrival_time, received_time)),
       payload_length(_payload_length),
       packet_length(_packet_length),
+      priority(_priority),
+      deadline(deadline_us == 0 ? 0 : received_time + deadline_us * 1000ULL),
       payload(_payload),
       response_sent(false),
       is_active(true),
       is_payload_heap(_is_payload_heap),
-      logger(nullptr) {}
+      logger(nullptr),
+      dequeue_time(received_time),
+      segments(_segments),
+      num_segments(_num_segments),
+      linear_buffer(_linear_buffer) {
+  trace.queue_thread = -1;
+  trace.dequeue_thread = -1;
+  trace.dequeue_cpu = -1;
+  trace.num_stages = 0;
+}
 
 QueryContext::QueryContext(QueryContext&& other)
     : connection(other.connection),
@@ -49,18 +79,32 @@ QueryContext::QueryContext(QueryContext&& other)
       request_id(other.request_id),
       start_time(other.start_time),
       received_time(other.received_time),
+      arrival_time(other.arrival_time),
       payload_length(other.payload_length),
       packet_length(other.packet_length),
+      priority(other.priority),
+      deadline(other.deadline),
       payload(other.is_payload_heap ? other.payload : malloc(payload_length)),
       response_sent(other.response_sent),
       is_active(other.is_active),
-      logger(other.logger) {
+      logger(other.logger),
+      dequeue_time(other.dequeue_time),
+      segments(&heap_segment),
+      num_segments(1),
+      linear_buffer(nullptr),
+      trace(other.trace) {
   // Make copy of payload to newly malloced memory if other context was
-  // not allocated in the heap
+  // not allocated in the heap, gathering it if it was segmented
   if (!other.is_payload_heap) {
-    memcpy(payload, other.payload, payload_length);
+    char* dest = reinterpret_cast<char*>(payload);
+    for (int i = 0; i < other.num_segments; i++) {
+      memcpy(dest, other.segments[i].iov_base, other.segments[i].iov_len);
+      dest += other.segments[i].iov_len;
+    }
   }
   is_payload_heap = true;
+  heap_segment.iov_base = payload;
+  heap_segment.iov_len = payload_length;
 
   // Clear out other object
   other.response_sent = false;
@@ -81,14 +125,99 @@ QueryContext::~QueryContext() {
   }
 }
 
+const void* QueryContext::GetContiguousPayload() {
+  if (payload != nullptr) {
+    return payload;
+  }
+  return ConnectionUtil::LinearizePayload(segments, num_segments,
+                                          payload_length, linear_buffer);
+}
+
+bool QueryContext::IsExpired() const {
+  return deadline != 0 && GetTimeAccurateNano() > deadline;
+}
+
+uint32_t QueryContext::GetRemainingBudgetUs() const {
+  if (deadline == 0) {
+    return 0;
+  }
+  uint64_t now = GetTimeAccurateNano();
+  return now >= deadline ? 1 : std::max<uint64_t>((deadline - now) / 1000, 1);
+}
+
 void QueryContext::SendResponse(const void* data, uint32_t data_length) {
   // Make sure this is first time sending a response
   assert(!response_sent);
 
   // Send it over the wire
-  uint64_t processing_time = GetTimeAccurateNano() - received_time;
+  uint64_t processing_time = GetTimeAccurateNano() - arrival_time;
   connection.SendResponse(type, request_id, start_time, processing_time, data,
-                          data_length, logger);
+                          data_length, logger, ResponseStatus::kOk,
+                          dequeue_time - arrival_time);
   response_sent = true;
+  if (IsFlightRecorderEnabled()) {
+    LogFlight(ResponseStatus::kOk, processing_time);
+  }
+}
+
+void QueryContext::SendResponse(const iovec* segments, int num_segments,
+                                std::function<void()> release) {
+  // Make sure this is first time sending a response
+  assert(!response_sent);
+
+  // Send it over the wire
+  uint64_t processing_time = GetTimeAccurateNano() - arrival_time;
+  connection.SendResponse(type, request_id, start_time, processing_time,
+                          segments, num_segments, std::move(release), logger,
+                          dequeue_time - arrival_time);
+  response_sent = true;
+  if (IsFlightRecorderEnabled()) {
+    LogFlight(ResponseStatus::kOk, processing_time);
+  }
+}
+
+void QueryContext::SendRejection(ResponseStatus status) {
+  // Make sure this is first time sending a response
+  assert(!response_sent);
+  assert(status != ResponseStatus::kOk);
+
+  uint64_t processing_time = GetTimeAccurateNano() - arrival_time;
+  connection.SendResponse(type, request_id, start_time, processing_time,
+                          nullptr, 0, logger, status,
+                          dequeue_time - arrival_time);
+  response_sent = true;
+  if (IsFlightRecorderEnabled()) {
+    LogFlight(status, processing_time);
+  }
+}
+
+void QueryContext::MarkStage(uint8_t stage) {
+  if (!IsFlightRecorderEnabled() || trace.num_stages == kMaxFlightStages) {
+    return;
+  }
+  FlightStage& mark = trace.stages[trace.num_stages++];
+  mark.end_ns = SaturatingOffset(GetTimeAccurateNano() - arrival_time);
+  mark.cpu = sched_getcpu();
+  mark.stage = stage;
+}
+
+void QueryContext::LogFlight(ResponseStatus status, uint64_t processing_time) {
+  // Most queries are below the threshold, skip building their record
+  if (processing_time < GetFlightRecorderOptions().threshold_us * 1000) {
+    return;
+  }
+  // Kernel thread ids do not change, so look it up once per thread
+  static thread_local int32_t tid = syscall(SYS_gettid);
+  FlightRecord record;
+  record.request_id = request_id;
+  record.arrival_time = arrival_time;
+  record.type = type;
+  record.dequeue_ns = SaturatingOffset(dequeue_time - arrival_time);
+  record.response_ns = SaturatingOffset(processing_time);
+  record.response_tid = tid;
+  record.response_cpu = sched_getcpu();
+  record.status = static_cast<uint8_t>(status);
+  record.trace = trace;
+  RecordFlight(record);
 }
 }  // namespace oldisim
@@ -14,18 +14,34 @@
 
 #include "oldisim/ResponseContext.h"
 
+#include "ConnectionUtil.h"
+
 namespace oldisim {
 
-ResponseContext::ResponseContext(uint32_t _type, uint64_t _request_id,
-                                 uint32_t _payload_length,
-                                 uint32_t _packet_length, const void* _payload,
-                                 bool _timed_out, uint64_t _request_timestamp,
-                                 uint64_t _response_timestamp)
+ResponseContext::ResponseContext(
+    uint32_t _type, uint64_t _request_id, uint32_t _payload_length,
+    uint32_t _packet_length, const void* _payload,
+    const iovec* _payload_segments, int _num_payload_segments,
+    bool _timed_out, ResponseStatus _status, uint64_t _request_timestamp,
+    uint64_t _response_timestamp, std::vector<char>* _linear_buffer)
     : type(_type),
       request_id(_request_id),
       payload_length(_payload_length),
+      packet_length(_packet_length),
       payload(_payload),
+      payload_segments(_payload_segments),
+      num_payload_segments(_num_payload_segments),
       timed_out(_timed_out),
+      status(_status),
       request_timestamp(_request_timestamp),
-      response_timestamp(_response_timestamp) {}
+      response_timestamp(_response_timestamp),
+      linear_buffer(_linear_buffer) {}
+
+const void* ResponseContext::GetContiguousPayload() {
+  if (payload == nullptr) {
+    payload = ConnectionUtil::LinearizePayload(
+        payload_segments, num_payload_segments, payload_length, linear_buffer);
+  }
+  return payload;
+}
 }  // namespace oldisim
@@ -0,0 +1,532 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "RssConnector.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "oldisim/ConnectionSpreading.h"
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+namespace {
+// The key NICs default to, from Microsoft's RSS specification
+const uint8_t kDefaultRssKey[] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+const size_t kDefaultIndirectionSize = 128;
+// IPv6 source and destination addresses, then ports
+const size_t kMaxHashInput = 36;
+// The hfunc bit of Toeplitz, ETH_RSS_HASH_TOP, which userspace headers do
+// not export
+const uint8_t kToeplitzHashFunction = 1;
+
+struct Address {
+  sockaddr_storage storage;
+  socklen_t length;
+
+  sockaddr* get() { return reinterpret_cast<sockaddr*>(&storage); }
+  const sockaddr* get() const {
+    return reinterpret_cast<const sockaddr*>(&storage);
+  }
+};
+
+/**
+ * How a local interface spreads the packets it receives over its queues
+ */
+struct RssInterface {
+  std::string name;
+  bool from_device;
+  // Whether the hash function is one the queue can be predicted with
+  bool predictable;
+  std::vector<uint8_t> key;
+  std::vector<uint32_t> indirection;
+  std::vector<uint64_t> connections;
+};
+
+std::mutex spreading_lock;
+ConnectionSpreadOptions spreading_options;
+std::vector<Address> source_addresses;
+size_t next_source = 0;
+std::map<const addrinfo*, size_t> next_target;
+// Interfaces by name, and by the local addresses connections came from
+std::map<std::string, std::unique_ptr<RssInterface>> interfaces;
+std::map<std::string, RssInterface*> address_interfaces;
+bool port_range_read = false;
+uint16_t port_range_low = 32768;
+uint16_t port_range_high = 60999;
+
+std::string AddressString(const sockaddr* address) {
+  char ipstr[INET6_ADDRSTRLEN];
+  const void* addr;
+  if (address->sa_family == AF_INET6) {
+    addr = &reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr;
+  } else {
+    addr = &reinterpret_cast<const sockaddr_in*>(address)->sin_addr;
+  }
+  if (inet_ntop(address->sa_family, addr, ipstr, sizeof(ipstr)) == nullptr) {
+    return "unknown address";
+  }
+  return ipstr;
+}
+
+/**
+ * Append the IP address of address to output in network order, returning
+ * its length
+ */
+size_t CopyAddressBytes(const sockaddr* address, uint8_t* output) {
+  if (address->sa_family == AF_INET6) {
+    memcpy(output, &reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr,
+           16);
+    return 16;
+  }
+  memcpy(output, &reinterpret_cast<const sockaddr_in*>(address)->sin_addr, 4);
+  return 4;
+}
+
+uint32_t ToeplitzHash(const std::vector<uint8_t>& key, const uint8_t* input,
+                      size_t length) {
+  uint32_t hash = 0;
+  uint32_t window = (static_cast<uint32_t>(key[0]) << 24) |
+                    (static_cast<uint32_t>(key[1]) << 16) |
+                    (static_cast<uint32_t>(key[2]) << 8) | key[3];
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      if (input[i] & (1 << bit)) {
+        hash ^= window;
+      }
+      window <<= 1;
+      if (key[i + 4] & (1 << bit)) {
+        window |= 1;
+      }
+    }
+  }
+  return hash;
+}
+
+/**
+ * The queue of iface the packets from remote to local hash onto
+ */
+uint32_t QueueOf(const RssInterface& iface, const sockaddr* remote,
+                 const sockaddr* local) {
+  uint8_t input[kMaxHashInput];
+  size_t length = CopyAddressBytes(remote, input);
+  length += CopyAddressBytes(local, input + length);
+  uint16_t ports[2] = {htobe16(GetAddressPort(remote)),
+                       htobe16(GetAddressPort(local))};
+  memcpy(input + length, ports, sizeof(ports));
+  length += sizeof(ports);
+  uint32_t hash = ToeplitzHash(iface.key, input, length);
+  return iface.indirection[hash % iface.indirection.size()];
+}
+
+/**
+ * Read the RSS key and indirection table of interface name from its driver
+ */
+bool ReadDeviceRss(const std::string& name, RssInterface* iface) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+
+  // Ask for the sizes of the table and key first
+  ethtool_rxfh sizes;
+  memset(&sizes, 0, sizeof(sizes));
+  sizes.cmd = ETHTOOL_GRSSH;
+  ifr.ifr_data = reinterpret_cast<char*>(&sizes);
+  bool read = false;
+  if (ioctl(fd, SIOCETHTOOL, &ifr) == 0 && sizes.indir_size > 0 &&
+      sizes.key_size > 0) {
+    std::vector<uint32_t> buffer(
+        (sizeof(ethtool_rxfh) + sizes.key_size) / sizeof(uint32_t) + 1 +
+        sizes.indir_size);
+    ethtool_rxfh* rxfh = reinterpret_cast<ethtool_rxfh*>(buffer.data());
+    rxfh->cmd = ETHTOOL_GRSSH;
+    rxfh->indir_size = sizes.indir_size;
+    rxfh->key_size = sizes.key_size;
+    ifr.ifr_data = reinterpret_cast<char*>(rxfh);
+    if (ioctl(fd, SIOCETHTOOL, &ifr) == 0) {
+      iface->indirection.assign(rxfh->rss_config,
+                                rxfh->rss_config + rxfh->indir_size);
+      const uint8_t* key = reinterpret_cast<const uint8_t*>(
+          rxfh->rss_config + rxfh->indir_size);
+      iface->key.assign(key, key + rxfh->key_size);
+      // Drivers that do not say which function they hash with use Toeplitz
+      iface->predictable =
+          rxfh->hfunc == 0 || (rxfh->hfunc & kToeplitzHashFunction) != 0;
+      read = true;
+    }
+  }
+  close(fd);
+  return read;
+}
+
+/**
+ * Number of receive queues of interface name, from sysfs
+ */
+uint32_t CountReceiveQueues(const std::string& name) {
+  std::string path = "/sys/class/net/" + name + "/queues";
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return 1;
+  }
+  uint32_t queues = 0;
+  while (dirent* entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "rx-", 3) == 0) {
+      queues++;
+    }
+  }
+  closedir(dir);
+  return std::max(queues, 1u);
+}
+
+RssInterface* LoadInterface(const std::string& name) {
+  auto& iface = interfaces[name];
+  if (iface != nullptr) {
+    return iface.get();
+  }
+  iface.reset(new RssInterface());
+  iface->name = name;
+  iface->from_device = ReadDeviceRss(name, iface.get());
+  if (!iface->from_device) {
+    // Assume the default key spread evenly over the queues, as drivers set
+    // up unless told otherwise
+    uint32_t queues = CountReceiveQueues(name);
+    iface->key.assign(kDefaultRssKey, kDefaultRssKey + sizeof(kDefaultRssKey));
+    iface->indirection.resize(kDefaultIndirectionSize);
+    for (size_t i = 0; i < kDefaultIndirectionSize; i++) {
+      iface->indirection[i] = i % queues;
+    }
+    iface->predictable = true;
+  }
+  if (iface->key.size() < kMaxHashInput + 4) {
+    iface->predictable = false;
+  }
+  if (!iface->predictable) {
+    W("Cannot predict the receive queues of %s, which does not hash with "
+      "Toeplitz on a long enough key",
+      name.c_str());
+  }
+  uint32_t num_queues =
+      *std::max_element(iface->indirection.begin(), iface->indirection.end()) +
+      1;
+  iface->connections.resize(num_queues);
+  return iface.get();
+}
+
+/**
+ * The interface local is an address of, nullptr if none is
+ */
+RssInterface* InterfaceOf(const sockaddr* local) {
+  std::string address = AddressString(local);
+  auto it = address_interfaces.find(address);
+  if (it != address_interfaces.end()) {
+    return it->second;
+  }
+
+  std::string name;
+  ifaddrs* list;
+  if (getifaddrs(&list) == 0) {
+    uint8_t wanted[16];
+    size_t length = CopyAddressBytes(local, wanted);
+    for (ifaddrs* ifa = list; ifa != nullptr; ifa = ifa->ifa_next) {
+      if (ifa->ifa_addr == nullptr ||
+          ifa->ifa_addr->sa_family != local->sa_family) {
+        continue;
+      }
+      uint8_t bytes[16];
+      CopyAddressBytes(ifa->ifa_addr, bytes);
+      if (memcmp(bytes, wanted, length) == 0) {
+        name = ifa->ifa_name;
+        break;
+      }
+    }
+    freeifaddrs(list);
+  }
+
+  RssInterface* iface = name.empty() ? nullptr : LoadInterface(name);
+  address_interfaces[address] = iface;
+  return iface;
+}
+
+/**
+ * Take the next source address of family in turn
+ */
+bool NextSource(int family, Address* source) {
+  for (size_t i = 0; i < source_addresses.size(); i++) {
+    size_t index = (next_source + i) % source_addresses.size();
+    if (source_addresses[index].get()->sa_family == family) {
+      *source = source_addresses[index];
+      next_source = index + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The source address the kernel routes connections to target from
+ */
+bool RouteSource(const addrinfo* target, Address* source) {
+  int fd = socket(target->ai_family, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  source->length = sizeof(source->storage);
+  bool routed = connect(fd, target->ai_addr, target->ai_addrlen) == 0 &&
+                getsockname(fd, source->get(), &source->length) == 0;
+  close(fd);
+  return routed;
+}
+
+void ReadPortRange() {
+  port_range_read = true;
+  std::ifstream range("/proc/sys/net/ipv4/ip_local_port_range");
+  int low, high;
+  if (range >> low >> high && 0 < low && low <= high && high < 65536) {
+    port_range_low = low;
+    port_range_high = high;
+  }
+}
+
+/**
+ * Bind fd to a source port on local whose replies from remote hash onto the
+ * least loaded queue of iface, and count the connection there. Returns the
+ * queue, or -1 if no such port is free.
+ */
+int BindRssPort(int fd, RssInterface* iface, const sockaddr* remote,
+                Address local) {
+  if (!port_range_read) {
+    ReadPortRange();
+  }
+  std::vector<bool> in_table(iface->connections.size());
+  for (uint32_t queue : iface->indirection) {
+    in_table[queue] = true;
+  }
+  uint32_t target = 0;
+  for (uint32_t queue = 0; queue < iface->connections.size(); queue++) {
+    if (in_table[queue] &&
+        (!in_table[target] ||
+         iface->connections[queue] < iface->connections[target])) {
+      target = queue;
+    }
+  }
+
+  // Start somewhere random so that processes on the host do not all race
+  // for the same ports
+  uint32_t range = port_range_high - port_range_low + 1;
+  uint32_t start = xor128() % range;
+  for (uint32_t i = 0; i < range; i++) {
+    SetAddressPort(local.get(), port_range_low + (start + i) % range);
+    if (QueueOf(*iface, remote, local.get()) != target) {
+      continue;
+    }
+    if (bind(fd, local.get(), local.length) == 0) {
+      iface->connections[target]++;
+      return target;
+    }
+    if (errno != EADDRINUSE && errno != EACCES) {
+      DIE("Could not bind to %s: %s", AddressString(local.get()).c_str(),
+          strerror(errno));
+    }
+  }
+  W("No free source port on %s reaches receive queue %u",
+    AddressString(local.get()).c_str(), target);
+  return -1;
+}
+
+/**
+ * Count the connected socket fd on the queue its replies hash onto
+ */
+void CountConnection(int fd, const sockaddr* remote) {
+  Address local;
+  local.length = sizeof(local.storage);
+  if (getsockname(fd, local.get(), &local.length) != 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(spreading_lock);
+  RssInterface* iface = InterfaceOf(local.get());
+  if (iface != nullptr && iface->predictable) {
+    iface->connections[QueueOf(*iface, remote, local.get())]++;
+  }
+}
+
+/**
+ * Connect a new socket to target, returning -1 if it is refused
+ */
+int ConnectTo(const addrinfo* target) {
+  int fd = socket(target->ai_family, target->ai_socktype, target->ai_protocol);
+  if (fd < 0) {
+    DIE("Could not create socket: %s", strerror(errno));
+  }
+
+  // Bind the source address and port, if spreading picks either
+  RssInterface* iface = nullptr;
+  int queue = -1;
+  {
+    std::lock_guard<std::mutex> lock(spreading_lock);
+    Address local;
+    bool have_source = NextSource(target->ai_family, &local);
+    if (spreading_options.rss_source_ports &&
+        (have_source || RouteSource(target, &local))) {
+      iface = InterfaceOf(local.get());
+      if (iface != nullptr && iface->predictable &&
+          iface->connections.size() > 1) {
+        queue = BindRssPort(fd, iface, target->ai_addr, local);
+      }
+    }
+    if (queue < 0 && have_source) {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+      // Leave the port to connect, so sources do not run out of ports
+      int one = 1;
+      setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+      SetAddressPort(local.get(), 0);
+      if (bind(fd, local.get(), local.length) < 0) {
+        DIE("Could not bind to source address %s: %s",
+            AddressString(local.get()).c_str(), strerror(errno));
+      }
+    }
+  }
+
+  if (connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+    W("Connect to %s failed: %s", AddressString(target->ai_addr).c_str(),
+      strerror(errno));
+    if (queue >= 0) {
+      std::lock_guard<std::mutex> lock(spreading_lock);
+      iface->connections[queue]--;
+    }
+    close(fd);
+    return -1;
+  }
+  if (queue < 0) {
+    CountConnection(fd, target->ai_addr);
+  }
+  return fd;
+}
+}  // namespace
+
+void SetConnectionSpreading(const ConnectionSpreadOptions& options) {
+  std::vector<Address> sources;
+  for (const auto& source : options.source_addresses) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+    addrinfo* result;
+    int err = getaddrinfo(source.c_str(), nullptr, &hints, &result);
+    if (err != 0) {
+      DIE("Bad source address %s: %s", source.c_str(), gai_strerror(err));
+    }
+    Address address;
+    memcpy(&address.storage, result->ai_addr, result->ai_addrlen);
+    address.length = result->ai_addrlen;
+    freeaddrinfo(result);
+    sources.push_back(address);
+  }
+
+  std::lock_guard<std::mutex> lock(spreading_lock);
+  spreading_options = options;
+  source_addresses = sources;
+  next_source = 0;
+}
+
+const ConnectionSpreadOptions& GetConnectionSpreading() {
+  return spreading_options;
+}
+
+std::vector<RssQueueConnections> GetRssQueueConnections() {
+  std::vector<RssQueueConnections> result;
+  std::lock_guard<std::mutex> lock(spreading_lock);
+  for (const auto& iface_pair : interfaces) {
+    const RssInterface& iface = *iface_pair.second;
+    if (!iface.predictable) {
+      continue;
+    }
+    RssQueueConnections queues;
+    queues.interface = iface.name;
+    queues.from_device = iface.from_device;
+    queues.connections = iface.connections;
+    result.push_back(queues);
+  }
+  return result;
+}
+
+void LogRssQueueConnections() {
+  for (const auto& queues : GetRssQueueConnections()) {
+    uint64_t total = 0;
+    std::string counts;
+    for (size_t i = 0; i < queues.connections.size(); i++) {
+      total += queues.connections[i];
+      counts += (i == 0 ? "" : " ") + std::to_string(queues.connections[i]);
+    }
+    if (total == 0) {
+      continue;
+    }
+    I("Connections per receive queue of %s%s: %s", queues.interface.c_str(),
+      queues.from_device ? "" : " (assuming the default RSS table)",
+      counts.c_str());
+  }
+}
+
+int ConnectSpread(const addrinfo* targets) {
+  size_t num_targets = 0;
+  for (const addrinfo* rp = targets; rp != nullptr; rp = rp->ai_next) {
+    num_targets++;
+  }
+  size_t first;
+  {
+    std::lock_guard<std::mutex> lock(spreading_lock);
+    first = next_target[targets]++ % num_targets;
+  }
+  const addrinfo* target = targets;
+  for (size_t i = 0; i < first; i++) {
+    target = target->ai_next;
+  }
+
+  for (size_t i = 0; i < num_targets; i++) {
+    int fd = ConnectTo(target);
+    if (fd >= 0) {
+      return fd;
+    }
+    target = target->ai_next != nullptr ? target->ai_next : targets;
+  }
+  DIE("Could not connect to any address of the child node");
+}
+}  // namespace oldisim
@@ -0,0 +1,35 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <netdb.h>
+
+namespace oldisim {
+
+/**
+ * Open a blocking TCP socket connected to one of targets, a list from
+ * ResolveHost, spread as SetConnectionSpreading selected. Successive calls
+ * with the same list start at successive addresses, and an address that
+ * refuses the connection is passed over for the next. Failing to connect
+ * to any of them is fatal.
+ */
+int ConnectSpread(const addrinfo* targets);
+
+/**
+ * Log how the connections made so far are spread over receive queues
+ */
+void LogRssQueueConnections();
+}  // namespace oldisim
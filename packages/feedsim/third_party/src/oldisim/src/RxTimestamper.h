@@ -0,0 +1,64 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#include <memory>
+
+namespace oldisim {
+
+/**
+ * Kernel receive timestamps for a TCP socket read by a bufferevent. Turns
+ * on SO_TIMESTAMPING and peeks at the socket from a one-shot event of the
+ * highest priority, so it runs ahead of the bufferevent reading the same
+ * bytes. The event is rearmed only once the bufferevent has taken the
+ * timestamp; a persistent one would keep the lower priority read starved
+ * for as long as the socket stays readable. A bufferevent read may take in
+ * several segments; they all get the timestamp of the oldest.
+ */
+class RxTimestamper {
+ public:
+  /**
+   * Returns nullptr unless kernel receive timestamps are enabled and
+   * socket_fd can provide them. Call Start once the bufferevent reading
+   * socket_fd is enabled.
+   */
+  static std::unique_ptr<RxTimestamper> Create(event_base* base,
+                                               int socket_fd);
+  ~RxTimestamper();
+  RxTimestamper(const RxTimestamper& that) = delete;
+
+  void Start();
+
+  /**
+   * When the kernel received the oldest bytes the bufferevent has just
+   * read, on the GetTimeAccurateNano clock, or 0 if it is not known. Call
+   * once from each bufferevent read callback; it rearms the peek for the
+   * next bytes.
+   */
+  uint64_t TakeArrival();
+
+ private:
+  explicit RxTimestamper(int socket_fd);
+
+  static void PeekCallback(evutil_socket_t fd, int16_t flags, void* arg);
+
+  const int socket_fd_;
+  event* peek_event_;
+  uint64_t last_arrival_;
+};
+}  // namespace oldisim
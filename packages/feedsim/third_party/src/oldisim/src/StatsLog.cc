@@ -0,0 +1,445 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/StatsLog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+static const char kStatsLogMagic[8] = {'O', 'L', 'D', 'S', 'T', 'A', 'T', 'S'};
+static const uint64_t kStatsLogVersion = 1;
+// The file first takes 1MB, about a quarter hour of driver windows, and
+// grows by doubling up to 64MB at a time
+static const size_t kInitialCapacity = 1 << 20;
+static const size_t kMaxGrowth = 64 << 20;
+
+enum StatsLogRecordType : uint32_t {
+  kNameRecord = 1,
+  kWindowRecord = 2,
+};
+
+struct StatsLogHeader {
+  char magic[8];
+  uint64_t version;
+  // Bytes of the file, header included, that hold complete records
+  uint64_t committed_length;
+  uint64_t start_realtime_ns;
+  char node[32];
+};
+
+struct StatsLogRecordHeader {
+  uint32_t type;
+  // Bytes of the record after this header
+  uint32_t length;
+};
+
+static_assert(sizeof(StatsLogHeader) == 64, "StatsLogHeader must be packed");
+
+static void PutVarint(std::string* output, uint64_t value) {
+  while (value >= 0x80) {
+    output->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
+}
+
+static void PutDouble(std::string* output, double value) {
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Reads the fields of a record, failing once any read runs past its end
+ */
+class RecordReader {
+ public:
+  RecordReader(const char* data, size_t length)
+      : next_(reinterpret_cast<const uint8_t*>(data)),
+        end_(next_ + length),
+        ok_(true) {}
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (next_ == end_) {
+        break;
+      }
+      uint8_t byte = *next_++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  double Double() {
+    double value = 0;
+    if (end_ - next_ < static_cast<ptrdiff_t>(sizeof(value))) {
+      ok_ = false;
+      return 0;
+    }
+    memcpy(&value, next_, sizeof(value));
+    next_ += sizeof(value);
+    return value;
+  }
+
+  std::string Rest() {
+    std::string rest(reinterpret_cast<const char*>(next_), end_ - next_);
+    next_ = end_;
+    return rest;
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  const uint8_t* next_;
+  const uint8_t* end_;
+  bool ok_;
+};
+
+void StatsLogWindow::Accumulate(const StatsLogWindow& other) {
+  start_ns = std::min(start_ns, other.start_ns);
+  end_ns = std::max(end_ns, other.end_ns);
+  for (const auto& counter : other.counters) {
+    counters[counter.first] += counter.second;
+  }
+  for (const auto& histogram : other.histograms) {
+    auto it = histograms.find(histogram.first);
+    if (it == histograms.end()) {
+      histograms.emplace(histogram.first, histogram.second);
+    } else {
+      it->second.accumulate(histogram.second);
+    }
+  }
+}
+
+StatsLog::StatsLog()
+    : start_realtime_ns_(0), mapping_(nullptr), mapping_length_(0) {}
+
+StatsLog::~StatsLog() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_length_);
+  }
+}
+
+std::shared_ptr<const StatsLog> StatsLog::Open(const std::string& path) {
+  std::shared_ptr<StatsLog> log(new StatsLog());
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    DIE("Could not open stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    DIE("Could not stat stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  if (st.st_size < static_cast<off_t>(sizeof(StatsLogHeader))) {
+    DIE("Stats log %s is too short", path.c_str());
+  }
+  log->mapping_length_ = st.st_size;
+  log->mapping_ =
+      mmap(nullptr, log->mapping_length_, PROT_READ, MAP_SHARED, fd, 0);
+  if (log->mapping_ == MAP_FAILED) {
+    DIE("Could not map stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  close(fd);
+
+  const char* data = reinterpret_cast<const char*>(log->mapping_);
+  StatsLogHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, kStatsLogMagic, sizeof(kStatsLogMagic)) != 0) {
+    DIE("%s is not a stats log", path.c_str());
+  }
+  if (header.version != kStatsLogVersion) {
+    DIE("Stats log %s has version %" PRIu64 ", expected %" PRIu64,
+        path.c_str(), header.version, kStatsLogVersion);
+  }
+  log->node_.assign(header.node, strnlen(header.node, sizeof(header.node)));
+  log->start_realtime_ns_ = header.start_realtime_ns;
+
+  // A log still being written may have committed more since it was mapped
+  size_t end = std::min<uint64_t>(header.committed_length, st.st_size);
+  size_t offset = sizeof(header);
+  while (offset + sizeof(StatsLogRecordHeader) <= end) {
+    StatsLogRecordHeader record;
+    memcpy(&record, data + offset, sizeof(record));
+    offset += sizeof(record);
+    if (record.length > end - offset) {
+      DIE("Stats log %s has a truncated record at offset %zu", path.c_str(),
+          offset);
+    }
+    RecordReader reader(data + offset, record.length);
+    if (record.type == kNameRecord) {
+      uint32_t id = reader.Varint();
+      Series series;
+      series.is_histogram = reader.Varint() != 0;
+      series.name = reader.Rest();
+      log->series_[id] = series;
+    } else if (record.type == kWindowRecord) {
+      reader.Varint();
+      log->windows_.emplace_back(offset, record.length);
+      log->window_ends_.push_back(reader.Varint());
+    }
+    if (!reader.ok()) {
+      DIE("Stats log %s has a malformed record at offset %zu", path.c_str(),
+          offset);
+    }
+    offset += record.length;
+  }
+
+  return log;
+}
+
+StatsLogWindow StatsLog::operator[](size_t i) const {
+  RecordReader reader(
+      reinterpret_cast<const char*>(mapping_) + windows_[i].first,
+      windows_[i].second);
+  StatsLogWindow window;
+  window.start_ns = reader.Varint();
+  window.end_ns = reader.Varint();
+
+  uint64_t num_counters = reader.Varint();
+  for (uint64_t c = 0; c < num_counters && reader.ok(); c++) {
+    auto series = series_.find(reader.Varint());
+    uint64_t value = reader.Varint();
+    if (series == series_.end() || series->second.is_histogram) {
+      DIE("Stats log window %zu has an unnamed counter", i);
+    }
+    window.counters[series->second.name] = value;
+  }
+
+  uint64_t num_histograms = reader.Varint();
+  for (uint64_t h = 0; h < num_histograms && reader.ok(); h++) {
+    auto series = series_.find(reader.Varint());
+    int significant_digits = reader.Varint();
+    int64_t highest_trackable_value = reader.Varint();
+    HdrHistogram::Buckets buckets;
+    buckets.total_count = reader.Varint();
+    buckets.sum = reader.Double();
+    buckets.sum_sq = reader.Double();
+    buckets.min = reader.Varint();
+    buckets.max = reader.Varint();
+    uint64_t num_buckets = reader.Varint();
+    int32_t index = 0;
+    for (uint64_t b = 0; b < num_buckets && reader.ok(); b++) {
+      index += reader.Varint();
+      buckets.counts.emplace_back(index, reader.Varint());
+    }
+    if (series == series_.end() || !series->second.is_histogram ||
+        significant_digits < 1 || significant_digits > 5 ||
+        highest_trackable_value < 2) {
+      DIE("Stats log window %zu has a malformed histogram", i);
+    }
+    HdrHistogram histogram(significant_digits, highest_trackable_value);
+    if (reader.ok() && !histogram.SetBuckets(buckets)) {
+      DIE("Stats log window %zu has a malformed histogram", i);
+    }
+    window.histograms.emplace(series->second.name, std::move(histogram));
+  }
+
+  if (!reader.ok()) {
+    DIE("Stats log window %zu is malformed", i);
+  }
+  return window;
+}
+
+StatsLogWindow StatsLog::Merge(uint64_t from_ns, uint64_t to_ns) const {
+  StatsLogWindow merged;
+  merged.start_ns = to_ns;
+  merged.end_ns = from_ns;
+  // Windows are written in time order
+  auto first = std::upper_bound(window_ends_.begin(), window_ends_.end(),
+                                from_ns);
+  for (size_t i = first - window_ends_.begin();
+       i < windows_.size() && window_ends_[i] <= to_ns; i++) {
+    merged.Accumulate((*this)[i]);
+  }
+  merged.start_ns = std::min(merged.start_ns, merged.end_ns);
+  return merged;
+}
+
+StatsLogWriter::StatsLogWriter(const std::string& path,
+                               const std::string& node)
+    : path_(path),
+      fd_(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)),
+      mapping_(nullptr),
+      capacity_(kInitialCapacity),
+      length_(sizeof(StatsLogHeader)),
+      start_time_ns_(GetTimeAccurateNano()),
+      last_window_end_ns_(start_time_ns_),
+      num_pending_counters_(0),
+      num_pending_histograms_(0) {
+  if (fd_ < 0) {
+    DIE("Could not create stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  if (ftruncate(fd_, capacity_) != 0) {
+    DIE("Could not size stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  void* mapping =
+      mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    DIE("Could not map stats log %s: %s", path.c_str(), strerror(errno));
+  }
+  mapping_ = reinterpret_cast<char*>(mapping);
+
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  StatsLogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kStatsLogMagic, sizeof(kStatsLogMagic));
+  header.version = kStatsLogVersion;
+  header.committed_length = length_;
+  header.start_realtime_ns =
+      static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+  strncpy(header.node, node.c_str(), sizeof(header.node) - 1);
+  memcpy(mapping_, &header, sizeof(header));
+}
+
+StatsLogWriter::~StatsLogWriter() { Close(); }
+
+uint32_t StatsLogWriter::SeriesId(const std::string& name, bool is_histogram) {
+  auto it = series_ids_.find(name);
+  if (it != series_ids_.end()) {
+    return it->second;
+  }
+  uint32_t id = series_ids_.size();
+  series_ids_.emplace(name, id);
+
+  std::string payload;
+  PutVarint(&payload, id);
+  PutVarint(&payload, is_histogram ? 1 : 0);
+  payload += name;
+  StatsLogRecordHeader record = {kNameRecord,
+                                 static_cast<uint32_t>(payload.size())};
+  pending_names_.append(reinterpret_cast<const char*>(&record),
+                        sizeof(record));
+  pending_names_ += payload;
+  return id;
+}
+
+void StatsLogWriter::AddCounter(const std::string& name, uint64_t value) {
+  PutVarint(&pending_counters_, SeriesId(name, false));
+  PutVarint(&pending_counters_, value);
+  num_pending_counters_++;
+}
+
+void StatsLogWriter::AddHistogram(const std::string& name,
+                                  const HdrHistogram& histogram) {
+  // Empty histograms read back as missing
+  if (histogram.total() == 0) {
+    return;
+  }
+  const HdrHistogram::Buckets buckets = histogram.GetBuckets();
+  std::string& out = pending_histograms_;
+  PutVarint(&out, SeriesId(name, true));
+  PutVarint(&out, histogram.significant_digits());
+  PutVarint(&out, histogram.highest_trackable_value());
+  PutVarint(&out, buckets.total_count);
+  PutDouble(&out, buckets.sum);
+  PutDouble(&out, buckets.sum_sq);
+  PutVarint(&out, buckets.min);
+  PutVarint(&out, buckets.max);
+  PutVarint(&out, buckets.counts.size());
+  int32_t index = 0;
+  for (const auto& bucket : buckets.counts) {
+    PutVarint(&out, bucket.first - index);
+    PutVarint(&out, bucket.second);
+    index = bucket.first;
+  }
+  num_pending_histograms_++;
+}
+
+void StatsLogWriter::WriteWindow(uint64_t start_ns, uint64_t end_ns) {
+  if (fd_ < 0) {
+    return;
+  }
+  std::string payload;
+  PutVarint(&payload, start_ns > start_time_ns_ ? start_ns - start_time_ns_
+                                                : 0);
+  PutVarint(&payload, end_ns > start_time_ns_ ? end_ns - start_time_ns_ : 0);
+  PutVarint(&payload, num_pending_counters_);
+  payload += pending_counters_;
+  PutVarint(&payload, num_pending_histograms_);
+  payload += pending_histograms_;
+
+  std::string records;
+  records.swap(pending_names_);
+  StatsLogRecordHeader record = {kWindowRecord,
+                                 static_cast<uint32_t>(payload.size())};
+  records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  records += payload;
+  Append(records);
+
+  // Readers only look as far as the committed length, which now covers the
+  // whole window
+  __atomic_store_n(
+      &reinterpret_cast<StatsLogHeader*>(mapping_)->committed_length,
+      static_cast<uint64_t>(length_), __ATOMIC_RELEASE);
+
+  pending_counters_.clear();
+  pending_histograms_.clear();
+  num_pending_counters_ = 0;
+  num_pending_histograms_ = 0;
+  last_window_end_ns_ = end_ns;
+}
+
+void StatsLogWriter::Append(const std::string& record) {
+  if (length_ + record.size() > capacity_) {
+    size_t capacity = capacity_;
+    while (length_ + record.size() > capacity) {
+      capacity += std::min(capacity, kMaxGrowth);
+    }
+    munmap(mapping_, capacity_);
+    if (ftruncate(fd_, capacity) != 0) {
+      DIE("Could not grow stats log %s: %s", path_.c_str(), strerror(errno));
+    }
+    void* mapping =
+        mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+      DIE("Could not map stats log %s: %s", path_.c_str(), strerror(errno));
+    }
+    mapping_ = reinterpret_cast<char*>(mapping);
+    capacity_ = capacity;
+  }
+  memcpy(mapping_ + length_, record.data(), record.size());
+  length_ += record.size();
+}
+
+void StatsLogWriter::Close() {
+  if (fd_ < 0) {
+    return;
+  }
+  munmap(mapping_, capacity_);
+  if (ftruncate(fd_, length_) != 0) {
+    W("Could not trim stats log %s: %s", path_.c_str(), strerror(errno));
+  }
+  close(fd_);
+  fd_ = -1;
+  mapping_ = nullptr;
+}
+}  // namespace oldisim
@@ -15,13 +15,16 @@
 #include "oldisim/TestDriver.h"
 
 #include <algorithm>
+#include <cmath>
 #include <functional>
 #include <memory>
+#include <random>
 #include <unordered_map>
 #include <vector>
 
 #include "ConnectionUtil.h"
 #include "TestDriverImpl.h"
+#include "oldisim/ArrivalTrace.h"
 #include "oldisim/Callbacks.h"
 #include "oldisim/ChildConnection.h"
 #include "oldisim/NodeThread.h"
@@ -30,24 +33,77 @@
 
 namespace oldisim {
 
+// Number of precomputed inter-arrival gaps, replayed cyclically
+static const size_t kArrivalScheduleLength = 1 << 16;
+// Requests sent within this long of their scheduled time are not counted
+// as late, to keep timer wakeup jitter out of the schedule slip count
+static const uint64_t kScheduleSlipToleranceNs = 100000;
+
 /**
  * Implementation details for TestDriver
  */
-void TestDriver::Start() { TestDriverImpl::MakeRequests(*this); }
+void TestDriver::Start() {
+  if (impl_->trace != nullptr) {
+    impl_->trace_start_time = GetTimeAccurateNano();
+    impl_->ScheduleTraceArrival();
+    TestDriverImpl::MakeScheduledRequests(*this);
+  } else if (impl_->open_loop) {
+    impl_->next_arrival_time = GetTimeAccurateNano() + impl_->arrival_phase;
+    TestDriverImpl::MakeScheduledRequests(*this);
+  } else {
+    TestDriverImpl::MakeRequests(*this);
+  }
+}
 
 void TestDriver::SendRequest(uint32_t type, const void* payload,
                              uint32_t payload_length,
                              uint64_t next_request_delay_us) {
+  SendRequest(type, payload, payload_length, next_request_delay_us, 0, 0);
+}
+
+void TestDriver::SendRequest(uint32_t type, const void* payload,
+                             uint32_t payload_length,
+                             uint64_t next_request_delay_us, uint32_t priority,
+                             uint32_t deadline_us) {
   int index = impl_->GetNextConnectionIndex();
   int conn_id = impl_->connections[index].first;
   auto& conn = *impl_->connections[index].second;
-  conn.IssueRequest(type, impl_->next_request_id++, payload, payload_length);
+  uint64_t now = GetTimeAccurateNano();
+  uint64_t send_time;
+  if (impl_->open_loop) {
+    // Time the request from when the schedule wanted it sent
+    send_time = impl_->current_scheduled_time;
+    uint64_t slip = now - send_time;
+    if (deadline_us != 0) {
+      // A request that is already late still goes out, to be dropped
+      deadline_us = slip / 1000 < deadline_us ? deadline_us - slip / 1000 : 1;
+    }
+    conn.IssueRequest(type, impl_->next_request_id++, payload, payload_length,
+                      send_time, priority, deadline_us);
+    if (slip > kScheduleSlipToleranceNs) {
+      impl_->current_child_stats.LogScheduleSlip(type, slip);
+    }
+  } else {
+    send_time = now;
+    conn.IssueRequest(type, impl_->next_request_id++, payload, payload_length,
+                      send_time, priority, deadline_us);
+  }
+
+  // Record the offered load, so open-loop runs keep their scheduled times
+  if (impl_->trace_recorder != nullptr) {
+    impl_->trace_recorder->Record(send_time, type, payload_length);
+  }
 
   // Check to see if this connection is filled to max depth
   if (conn.GetNumOutstandingRequests() == impl_->max_connection_depth) {
     impl_->MarkConnectionNotReady(conn_id);
   }
 
+  // The open-loop schedule arms its own timer
+  if (impl_->open_loop) {
+    return;
+  }
+
   // Schedule next request
   impl_->next_request_delay_us = next_request_delay_us;
 
@@ -59,6 +115,95 @@ void TestDriver::SendRequest(uint32_t type, const void* payload,
   }
 }
 
+void TestDriver::SetOpenLoopSchedule(ArrivalProcess process,
+                                     double requests_per_sec, uint64_t seed) {
+  if (requests_per_sec <= 0) {
+    DIE("Open-loop schedule needs a positive request rate, got %f",
+        requests_per_sec);
+  }
+
+  double mean_gap = 1e9 / requests_per_sec;
+  std::mt19937_64 rng(seed);
+  impl_->arrival_gaps.resize(kArrivalScheduleLength);
+  switch (process) {
+    case ArrivalProcess::kConstant: {
+      // Round cumulative times rather than each gap so the rate does not
+      // drift by the rounding error
+      for (size_t i = 0; i < kArrivalScheduleLength; i++) {
+        impl_->arrival_gaps[i] =
+            std::llround((i + 1) * mean_gap) - std::llround(i * mean_gap);
+      }
+      break;
+    }
+    case ArrivalProcess::kPoisson: {
+      std::exponential_distribution<double> gap_distribution(1.0 / mean_gap);
+      for (auto& gap : impl_->arrival_gaps) {
+        gap = std::llround(gap_distribution(rng));
+      }
+      break;
+    }
+  }
+
+  // Offset the first arrival so that threads with the same schedule do not
+  // fire in lockstep
+  std::uniform_int_distribution<uint64_t> phase_distribution(
+      0, static_cast<uint64_t>(mean_gap));
+  impl_->arrival_phase = phase_distribution(rng);
+  impl_->next_arrival_gap = 0;
+  impl_->arrival_rate = requests_per_sec;
+  impl_->arrival_gap_scale = 1.0;
+  impl_->open_loop = true;
+}
+
+void TestDriver::SetOpenLoopRate(double requests_per_sec) {
+  if (!impl_->open_loop || impl_->trace != nullptr) {
+    DIE("Only a generated open-loop schedule can change its rate");
+  }
+  if (requests_per_sec <= 0) {
+    DIE("Open-loop schedule needs a positive request rate, got %f",
+        requests_per_sec);
+  }
+  impl_->arrival_gap_scale = impl_->arrival_rate / requests_per_sec;
+
+  // Pull in an arrival that was scheduled at a much lower rate, so that a
+  // step up takes effect right away
+  if (impl_->next_arrival_time == 0) {
+    return;
+  }
+  uint64_t now = GetTimeAccurateNano();
+  uint64_t next_arrival_time = now + std::llround(1e9 / requests_per_sec);
+  if (next_arrival_time < impl_->next_arrival_time) {
+    impl_->next_arrival_time = next_arrival_time;
+    timeval tv;
+    MicroToTv((next_arrival_time - now) / 1000, &tv);
+    evtimer_add(impl_->next_request_event, &tv);
+  }
+}
+
+void TestDriver::SetTraceSchedule(std::shared_ptr<const ArrivalTrace> trace,
+                                  uint32_t thread_index, uint32_t num_threads,
+                                  double speedup, bool loop) {
+  if (speedup <= 0) {
+    DIE("Trace replay needs a positive speedup, got %f", speedup);
+  }
+  if (num_threads == 0 || thread_index >= num_threads) {
+    DIE("Invalid trace shard %u of %u", thread_index, num_threads);
+  }
+
+  impl_->trace = std::move(trace);
+  impl_->next_trace_index = thread_index;
+  impl_->trace_stride = num_threads;
+  impl_->trace_speedup = speedup;
+  impl_->trace_loop = loop;
+  impl_->trace_done = false;
+  impl_->trace_pass = 0;
+  impl_->open_loop = true;
+}
+
+const TraceRecord* TestDriver::GetCurrentTraceRecord() const {
+  return impl_->current_trace_record;
+}
+
 const ChildConnectionStats& TestDriver::GetConnectionStats() const {
   return impl_->last_child_stats;
 }
@@ -75,7 +220,8 @@ TestDriver::TestDriverImpl::TestDriverImpl(
         _on_reply_cbs,
     const std::set<uint32_t>& request_types,
     const DriverNodeMakeRequestCallback& _make_request_cb,
-    NodeThread& _node_thread)
+    NodeThread& _node_thread, Transport transport, Framing framing,
+    bool high_connection_count)
     : owner(_owner),
       max_connection_depth(_max_connection_depth),
       on_reply_cbs(_on_reply_cbs),
@@ -86,7 +232,24 @@ TestDriver::TestDriverImpl::TestDriverImpl(
       last_child_stats(request_types),
       next_request_event(nullptr),
       next_request_delay_us(0),
-      num_backlogged_requests(0) {
+      num_backlogged_requests(0),
+      open_loop(false),
+      arrival_rate(0),
+      arrival_gap_scale(1.0),
+      arrival_phase(0),
+      next_arrival_gap(0),
+      next_arrival_time(0),
+      current_scheduled_time(0),
+      trace(nullptr),
+      next_trace_index(0),
+      trace_stride(1),
+      trace_speedup(1.0),
+      trace_loop(false),
+      trace_done(false),
+      trace_start_time(0),
+      trace_pass(0),
+      current_trace_record(nullptr),
+      trace_recorder(nullptr) {
   // Establish connections to the service
   connections.reserve(num_connections);
   connection_positions.reserve(num_connections);
@@ -96,13 +259,15 @@ TestDriver::TestDriverImpl::TestDriverImpl(
                   std::placeholders::_1, i),
         std::bind(TestDriver::TestDriverImpl::ChildConnectionClosedHandler,
                   std::ref(owner), std::placeholders::_1, i),
-        node_thread, _service_node_addr, current_child_stats, false, true));
+        node_thread, _service_node_addr, current_child_stats, false, true,
+        false, transport, framing, high_connection_count));
     connections.emplace_back(std::make_pair(i, std::move(conn)));
     connection_positions.push_back(i);
   }
 
   next_connection_index = 0;
   num_ready_connections = num_connections;
+  rotate_connections = high_connection_count;
 
   // Make timer for next query, but do not activate yet
   next_request_event =
@@ -118,6 +283,12 @@ TestDriver::TestDriverImpl::~TestDriverImpl() {
 int TestDriver::TestDriverImpl::GetNextConnectionIndex() {
   if (num_ready_connections == 0) {
     return -1;
+  } else if (rotate_connections) {
+    // Connections marked not ready since shrink the ready part under it
+    if (next_connection_index >= num_ready_connections) {
+      next_connection_index = 0;
+    }
+    return next_connection_index++;
   } else {
     assert(next_connection_index < num_ready_connections);
     return next_connection_index;
@@ -165,7 +336,9 @@ void TestDriver::TestDriverImpl::ResponseCallback(TestDriver& driver,
   }
 
   // If there were backlogged queries, run the user query generator
-  if (driver.impl_->num_backlogged_requests) {
+  if (driver.impl_->open_loop) {
+    DrainScheduledBacklog(driver);
+  } else if (driver.impl_->num_backlogged_requests) {
     MakeRequests(driver);
     driver.impl_->num_backlogged_requests--;
   }
@@ -182,7 +355,11 @@ void TestDriver::TestDriverImpl::ChildConnectionClosedHandler(
 void TestDriver::TestDriverImpl::NextRequestCallback(evutil_socket_t listener,
                                                      int16_t event, void* arg) {
   TestDriver* driver = reinterpret_cast<TestDriver*>(arg);
-  MakeRequests(*driver);
+  if (driver->impl_->open_loop) {
+    MakeScheduledRequests(*driver);
+  } else {
+    MakeRequests(*driver);
+  }
 }
 
 void TestDriver::TestDriverImpl::MakeRequests(TestDriver& driver) {
@@ -199,4 +376,71 @@ void TestDriver::TestDriverImpl::MakeRequests(TestDriver& driver) {
     }
   } while (driver.impl_->next_request_delay_us == 0);
 }
+
+void TestDriver::TestDriverImpl::MakeScheduledRequests(TestDriver& driver) {
+  TestDriverImpl& impl = *driver.impl_;
+
+  // Queue every arrival that is due, behind any that are already waiting, so
+  // requests always go out in schedule order
+  uint64_t now = GetTimeAccurateNano();
+  while (!impl.trace_done && impl.next_arrival_time <= now) {
+    impl.backlogged_arrival_times.push_back(impl.next_arrival_time);
+    if (impl.trace != nullptr) {
+      impl.backlogged_trace_records.push_back(
+          &(*impl.trace)[impl.next_trace_index]);
+      impl.next_trace_index += impl.trace_stride;
+      impl.ScheduleTraceArrival();
+    } else {
+      impl.next_arrival_time += std::llround(
+          impl.arrival_gaps[impl.next_arrival_gap] * impl.arrival_gap_scale);
+      impl.next_arrival_gap =
+          (impl.next_arrival_gap + 1) % impl.arrival_gaps.size();
+    }
+  }
+  DrainScheduledBacklog(driver);
+
+  // A finished trace leaves only its backlog, which replies drain
+  if (impl.trace_done) {
+    return;
+  }
+
+  // Wake up for the next arrival regardless of how the service is keeping up
+  timeval tv;
+  MicroToTv((impl.next_arrival_time - now) / 1000, &tv);
+  evtimer_add(impl.next_request_event, &tv);
+}
+
+void TestDriver::TestDriverImpl::DrainScheduledBacklog(TestDriver& driver) {
+  TestDriverImpl& impl = *driver.impl_;
+  while (impl.num_ready_connections != 0 &&
+         !impl.backlogged_arrival_times.empty()) {
+    impl.current_scheduled_time = impl.backlogged_arrival_times.front();
+    impl.backlogged_arrival_times.pop_front();
+    if (impl.trace != nullptr) {
+      impl.current_trace_record = impl.backlogged_trace_records.front();
+      impl.backlogged_trace_records.pop_front();
+    }
+    impl.make_request_cb(impl.node_thread, driver);
+    impl.current_trace_record = nullptr;
+  }
+}
+
+void TestDriver::TestDriverImpl::ScheduleTraceArrival() {
+  // Wrap around into the next pass, keeping the shard's stride across the
+  // pass boundary
+  while (next_trace_index >= trace->size()) {
+    if (!trace_loop) {
+      trace_done = true;
+      return;
+    }
+    next_trace_index -= trace->size();
+    trace_pass++;
+  }
+
+  uint64_t offset = (*trace)[next_trace_index].timestamp_ns -
+                    (*trace)[0].timestamp_ns +
+                    trace_pass * trace->period_ns();
+  next_arrival_time =
+      trace_start_time + std::llround(offset / trace_speedup);
+}
 }  // namespace oldisim
@@ -16,12 +16,16 @@
 #include <inttypes.h>
 #include <event2/event.h>
 
+#include <deque>
 #include <memory>
 #include <vector>
 #include <unordered_map>
 
+#include "oldisim/ArrivalTrace.h"
 #include "oldisim/Callbacks.h"
 #include "oldisim/TestDriver.h"
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
 
 namespace oldisim {
 
@@ -42,6 +46,9 @@ struct TestDriver::TestDriverImpl {
   std::vector<int> connection_positions;
   int next_connection_index;
   int num_ready_connections;
+  // In high connection count mode requests go to the ready connections in
+  // turn, so all of them carry load, instead of to the first one ready
+  bool rotate_connections;
   int max_connection_depth;
   uint64_t next_request_id;
   NodeThread& node_thread;
@@ -57,6 +64,39 @@ struct TestDriver::TestDriverImpl {
   // was to be generated.
   int num_backlogged_requests;
 
+  // Open-loop schedule state. The inter-arrival gaps are generated once and
+  // replayed cyclically, stretched by arrival_gap_scale after a rate change;
+  // next_arrival_time is the absolute time in ns of the next scheduled
+  // request, and backlogged_arrival_times holds the scheduled times of
+  // requests waiting for a ready connection.
+  bool open_loop;
+  std::vector<uint64_t> arrival_gaps;
+  double arrival_rate;
+  double arrival_gap_scale;
+  uint64_t arrival_phase;
+  size_t next_arrival_gap;
+  uint64_t next_arrival_time;
+  std::deque<uint64_t> backlogged_arrival_times;
+  uint64_t current_scheduled_time;
+
+  // Trace replay state, on top of the open-loop schedule. Arrival times come
+  // from the trace records instead of arrival_gaps; backlogged_trace_records
+  // runs parallel to backlogged_arrival_times. trace_done is set once a
+  // trace that does not loop has been fully scheduled.
+  std::shared_ptr<const ArrivalTrace> trace;
+  size_t next_trace_index;
+  uint32_t trace_stride;
+  double trace_speedup;
+  bool trace_loop;
+  bool trace_done;
+  uint64_t trace_start_time;
+  uint64_t trace_pass;
+  std::deque<const TraceRecord*> backlogged_trace_records;
+  const TraceRecord* current_trace_record;
+
+  // Records every request sent if not null, owned by the DriverNode
+  ArrivalTraceRecorder* trace_recorder;
+
   // Callback pointers and data
   const std::unordered_map<uint32_t, const DriverNodeResponseCallback>&
       on_reply_cbs;
@@ -68,7 +108,8 @@ struct TestDriver::TestDriverImpl {
                      uint32_t, const DriverNodeResponseCallback>& _on_reply_cbs,
                  const std::set<uint32_t>& request_types,
                  const DriverNodeMakeRequestCallback& make_request_cb,
-                 NodeThread& _node_thread);
+                 NodeThread& _node_thread, Transport transport,
+                 Framing framing, bool high_connection_count);
   ~TestDriverImpl();
   int GetNextConnectionIndex();
 
@@ -85,5 +126,10 @@ struct TestDriver::TestDriverImpl {
                                   void* arg);
 
   static void MakeRequests(TestDriver& driver);
+  static void MakeScheduledRequests(TestDriver& driver);
+  static void DrainScheduledBacklog(TestDriver& driver);
+  // Sets next_arrival_time from the trace record at next_trace_index,
+  // moving on to the next pass or setting trace_done at the end of the trace
+  void ScheduleTraceArrival();
 };
 }  // namespace oldisim
@@ -0,0 +1,189 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TimerWheel.h"
+
+#include <sys/time.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+namespace {
+// A timer of ScheduleAt, freed once it has run
+struct ClosureTimer {
+  TimerWheel::Timer timer;
+  std::function<void()> callback;
+
+  ClosureTimer(TimerWheel::Timer::Callback run, std::function<void()> _callback)
+      : timer(run, this), callback(std::move(_callback)) {}
+};
+}  // namespace
+
+TimerWheel::Timer::Timer(Callback callback, void* arg)
+    : callback_(callback),
+      arg_(arg),
+      deadline_tick_(0),
+      prev_(nullptr),
+      next_(nullptr) {}
+
+TimerWheel::Timer::Timer()
+    : callback_(nullptr),
+      arg_(nullptr),
+      deadline_tick_(0),
+      prev_(this),
+      next_(this) {}
+
+TimerWheel::TimerWheel(event_base* base, uint64_t tick_ns, int num_slots)
+    : tick_event_(evtimer_new(base, TickHandler, this)),
+      tick_ns_(tick_ns),
+      start_ns_(GetTimeAccurateNano()),
+      current_tick_(0),
+      num_slots_(num_slots),
+      slots_(new Timer[num_slots]),
+      num_timers_(0),
+      armed_(false) {
+  if (tick_event_ == nullptr) {
+    DIE("evtimer_new failed");
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  // Owners may outlive the wheel, so leave their timers unscheduled
+  for (int i = 0; i < num_slots_; i++) {
+    Timer& head = slots_[i];
+    while (head.next_ != &head) {
+      Timer* timer = head.next_;
+      Unlink(timer);
+      if (timer->callback_ == RunClosure) {
+        delete reinterpret_cast<ClosureTimer*>(timer->arg_);
+      }
+    }
+  }
+  event_free(tick_event_);
+}
+
+void TimerWheel::Schedule(Timer* timer, uint64_t deadline_ns) {
+  Cancel(timer);
+  if (num_timers_ == 0) {
+    // Nothing is pending, so the ticks the wheel slept through are empty
+    current_tick_ = std::max(current_tick_,
+                             (GetTimeAccurateNano() - start_ns_) / tick_ns_);
+  }
+  uint64_t deadline_tick =
+      deadline_ns > start_ns_
+          ? (deadline_ns - start_ns_ + tick_ns_ - 1) / tick_ns_
+          : 0;
+  // The slot of the current tick has already been fired
+  if (deadline_tick <= current_tick_) {
+    deadline_tick = current_tick_ + 1;
+  }
+  timer->deadline_tick_ = deadline_tick;
+  Link(&slots_[deadline_tick % num_slots_], timer);
+  num_timers_++;
+  Arm();
+}
+
+void TimerWheel::Cancel(Timer* timer) {
+  if (!timer->scheduled()) {
+    return;
+  }
+  Unlink(timer);
+  num_timers_--;
+}
+
+void TimerWheel::ScheduleAt(uint64_t deadline_ns,
+                            std::function<void()> callback) {
+  ClosureTimer* closure = new ClosureTimer(RunClosure, std::move(callback));
+  Schedule(&closure->timer, deadline_ns);
+}
+
+void TimerWheel::RunClosure(void* arg) {
+  std::unique_ptr<ClosureTimer> closure(reinterpret_cast<ClosureTimer*>(arg));
+  closure->callback();
+}
+
+void TimerWheel::Link(Timer* head, Timer* timer) {
+  timer->prev_ = head->prev_;
+  timer->next_ = head;
+  head->prev_->next_ = timer;
+  head->prev_ = timer;
+}
+
+void TimerWheel::Unlink(Timer* timer) {
+  timer->prev_->next_ = timer->next_;
+  timer->next_->prev_ = timer->prev_;
+  timer->prev_ = nullptr;
+  timer->next_ = nullptr;
+}
+
+void TimerWheel::TickHandler(evutil_socket_t listener, int16_t flags,
+                             void* arg) {
+  TimerWheel* self = reinterpret_cast<TimerWheel*>(arg);
+  self->armed_ = false;
+  self->FireExpired();
+  self->Arm();
+}
+
+void TimerWheel::FireExpired() {
+  uint64_t now_tick = (GetTimeAccurateNano() - start_ns_) / tick_ns_;
+  if (now_tick <= current_tick_) {
+    return;
+  }
+  // After a stall longer than one revolution every slot is due for a look
+  uint64_t num_ticks =
+      std::min<uint64_t>(now_tick - current_tick_, num_slots_);
+
+  // Move the expired timers to a list of their own first, as callbacks may
+  // schedule new timers into these slots. They stay scheduled until they
+  // fire, so a callback can still cancel one that has not fired yet.
+  Timer expired;
+  for (uint64_t tick = now_tick - num_ticks + 1; tick <= now_tick; tick++) {
+    Timer& head = slots_[tick % num_slots_];
+    for (Timer* timer = head.next_; timer != &head;) {
+      Timer* next = timer->next_;
+      if (timer->deadline_tick_ <= now_tick) {
+        Unlink(timer);
+        Link(&expired, timer);
+      }
+      timer = next;
+    }
+  }
+  current_tick_ = now_tick;
+
+  while (expired.next_ != &expired) {
+    Timer* timer = expired.next_;
+    Cancel(timer);
+    timer->callback_(timer->arg_);
+  }
+}
+
+void TimerWheel::Arm() {
+  if (armed_ || num_timers_ == 0) {
+    return;
+  }
+  // Wake up at the start of the next tick
+  uint64_t next_tick_ns = start_ns_ + (current_tick_ + 1) * tick_ns_;
+  uint64_t now = GetTimeAccurateNano();
+  uint64_t delay_ns = next_tick_ns > now ? next_tick_ns - now : 0;
+  timeval t = {static_cast<time_t>(delay_ns / 1000000000),
+               static_cast<suseconds_t>(delay_ns % 1000000000 / 1000)};
+  evtimer_add(tick_event_, &t);
+  armed_ = true;
+}
+}  // namespace oldisim
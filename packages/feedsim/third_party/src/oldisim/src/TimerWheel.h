@@ -0,0 +1,105 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <event2/event.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+
+namespace oldisim {
+
+/**
+ * Hashed timer wheel driven by a single timer event on an event_base.
+ * Timers are hashed by their deadline tick into a ring of slots, so
+ * scheduling and cancelling are O(1) and each tick only looks at one slot,
+ * no matter how many timers are pending. The tick event is only armed while
+ * timers are pending. Deadlines are rounded up to the next tick.
+ *
+ * Not thread safe: all calls must be made on the thread running the
+ * event_base, which is also where the callbacks run.
+ */
+class TimerWheel {
+ public:
+  /**
+   * A timer embedded in its owner, e.g. a fanout reply tracker, so that
+   * arming and cancelling it neither allocates nor searches. It must not be
+   * destroyed while it is scheduled.
+   */
+  class Timer {
+   public:
+    typedef void (*Callback)(void* arg);
+
+    Timer(Callback callback, void* arg);
+    Timer(const Timer& that) = delete;
+    Timer& operator=(const Timer& that) = delete;
+
+    bool scheduled() const { return prev_ != nullptr; }
+
+   private:
+    friend class TimerWheel;
+    Timer();  // List head, linked to itself
+
+    Callback callback_;
+    void* arg_;
+    uint64_t deadline_tick_;
+    Timer* prev_;
+    Timer* next_;
+  };
+
+  TimerWheel(event_base* base, uint64_t tick_ns, int num_slots);
+  ~TimerWheel();
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  /**
+   * Fire timer once GetTimeAccurateNano reaches deadline_ns, moving it if it
+   * is already scheduled. Deadlines in the past fire on the next tick.
+   */
+  void Schedule(Timer* timer, uint64_t deadline_ns);
+
+  /**
+   * Stop timer from firing. Does nothing if it is not scheduled.
+   */
+  void Cancel(Timer* timer);
+
+  /**
+   * Run callback once GetTimeAccurateNano reaches deadline_ns, on a timer
+   * owned by the wheel
+   */
+  void ScheduleAt(uint64_t deadline_ns, std::function<void()> callback);
+
+  size_t size() const { return num_timers_; }
+
+ private:
+  static void TickHandler(evutil_socket_t listener, int16_t flags, void* arg);
+  static void RunClosure(void* arg);
+  static void Link(Timer* head, Timer* timer);
+  static void Unlink(Timer* timer);
+  void FireExpired();
+  void Arm();
+
+  event* tick_event_;
+  uint64_t tick_ns_;
+  uint64_t start_ns_;
+  uint64_t current_tick_;  // Last tick whose slot has been fired
+  int num_slots_;
+  std::unique_ptr<Timer[]> slots_;
+  size_t num_timers_;
+  bool armed_;
+};
+}  // namespace oldisim
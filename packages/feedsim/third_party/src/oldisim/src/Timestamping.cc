@@ -0,0 +1,122 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/Timestamping.h"
+
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "RxTimestamper.h"
+#include "oldisim/IoEngine.h"
+#include "oldisim/Log.h"
+#include "oldisim/Util.h"
+
+namespace oldisim {
+
+static bool kernel_rx_timestamps = false;
+
+void SetKernelRxTimestamps(bool enabled) { kernel_rx_timestamps = enabled; }
+
+bool GetKernelRxTimestamps() { return kernel_rx_timestamps; }
+
+std::unique_ptr<RxTimestamper> RxTimestamper::Create(event_base* base,
+                                                     int socket_fd) {
+  // The io_uring engine does not read through libevent, so there is nothing
+  // to run ahead of
+  if (!kernel_rx_timestamps || GetIoEngine() != IoEngine::kLibevent) {
+    return nullptr;
+  }
+
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                 sizeof(flags)) < 0) {
+    // Warn once per process rather than once per connection
+    static bool warned = false;
+    if (!warned) {
+      W("setsockopt(SO_TIMESTAMPING) failed: %s", strerror(errno));
+      warned = true;
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<RxTimestamper> timestamper(new RxTimestamper(socket_fd));
+  timestamper->peek_event_ = event_new(base, socket_fd, EV_READ, PeekCallback,
+                                       timestamper.get());
+  event_priority_set(timestamper->peek_event_, 0);
+  return timestamper;
+}
+
+RxTimestamper::RxTimestamper(int socket_fd)
+    : socket_fd_(socket_fd), peek_event_(nullptr), last_arrival_(0) {}
+
+RxTimestamper::~RxTimestamper() { event_free(peek_event_); }
+
+void RxTimestamper::Start() {
+  // Events of the same priority on one socket become active newest first,
+  // which also puts this one ahead on bases without priorities
+  event_add(peek_event_, nullptr);
+}
+
+uint64_t RxTimestamper::TakeArrival() {
+  uint64_t arrival = last_arrival_;
+  last_arrival_ = 0;
+  if (!event_pending(peek_event_, EV_READ, nullptr)) {
+    event_add(peek_event_, nullptr);
+  }
+  return arrival;
+}
+
+void RxTimestamper::PeekCallback(evutil_socket_t fd, int16_t flags,
+                                 void* arg) {
+  RxTimestamper* timestamper = reinterpret_cast<RxTimestamper*>(arg);
+
+  char byte;
+  iovec iov = {&byte, sizeof(byte)};
+  char control[CMSG_SPACE(sizeof(timespec) * 3)];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  if (recvmsg(timestamper->socket_fd_, &message, MSG_PEEK | MSG_DONTWAIT) <=
+      0) {
+    return;
+  }
+
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_TIMESTAMPING) {
+      continue;
+    }
+    // The software timestamp comes first, from CLOCK_REALTIME
+    timespec stamp;
+    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+    if (stamp.tv_sec == 0 && stamp.tv_nsec == 0) {
+      return;
+    }
+    timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    uint64_t now = GetTimeAccurateNano();
+    int64_t age = (realtime.tv_sec - stamp.tv_sec) * 1000000000LL +
+                  (realtime.tv_nsec - stamp.tv_nsec);
+    timestamper->last_arrival_ = age > 0 ? now - age : now;
+    return;
+  }
+}
+}  // namespace oldisim
@@ -0,0 +1,298 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TlsTransport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+#include <string>
+
+#ifdef OLDISIM_HAVE_OPENSSL
+#include <event2/bufferevent_ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#include "ConnectionUtil.h"
+#include "oldisim/Log.h"
+#include "oldisim/Tls.h"
+
+// OpenSSL 3 hands the session keys to the kernel itself when built with it
+#if defined(OLDISIM_HAVE_OPENSSL) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+#define OLDISIM_HAVE_KTLS 1
+#endif
+
+namespace oldisim {
+
+namespace {
+// Longest a handshake may block the thread making the connection
+const int kHandshakeTimeoutSec = 5;
+
+bool tls_enabled = false;
+
+struct TlsCounters {
+  std::atomic<uint64_t> handshakes{0};
+  std::atomic<uint64_t> handshake_failures{0};
+  std::atomic<uint64_t> kernel_connections{0};
+  std::atomic<uint64_t> kernel_send_connections{0};
+  std::atomic<uint64_t> user_space_connections{0};
+};
+TlsCounters counters;
+
+// Reads a counter of /proc/net/tls_stat, 0 if the kernel has no TLS
+uint64_t ReadKernelTlsStat(const std::string& name) {
+  std::ifstream input("/proc/net/tls_stat");
+  std::string key;
+  uint64_t value;
+  while (input >> key >> value) {
+    if (key == name) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+#ifdef OLDISIM_HAVE_OPENSSL
+SSL_CTX* server_context = nullptr;
+SSL_CTX* client_context = nullptr;
+
+// The oldest queued OpenSSL error, or the errno of a failed system call
+std::string TlsError() {
+  unsigned long error = ERR_get_error();
+  ERR_clear_error();
+  if (error == 0) {
+    return errno != 0 ? strerror(errno) : "connection closed";
+  }
+  char message[256];
+  ERR_error_string_n(error, message, sizeof(message));
+  return message;
+}
+
+/**
+ * Give node servers without a certificate a self-signed P-256 one, so
+ * benchmarks need no PKI; connections only verify it if given a CA bundle
+ */
+void UseSelfSignedCertificate(SSL_CTX* context) {
+  EVP_PKEY* key = nullptr;
+  EVP_PKEY_CTX* key_context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  if (key_context == nullptr || EVP_PKEY_keygen_init(key_context) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_context,
+                                             NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(key_context, &key) <= 0) {
+    DIE("Could not generate a TLS key: %s", TlsError().c_str());
+  }
+  EVP_PKEY_CTX_free(key_context);
+
+  X509* certificate = X509_new();
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 365L * 24 * 3600);
+  X509_NAME* name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char*>("oldisim"), -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  X509_set_pubkey(certificate, key);
+  if (X509_sign(certificate, key, EVP_sha256()) == 0 ||
+      SSL_CTX_use_certificate(context, certificate) != 1 ||
+      SSL_CTX_use_PrivateKey(context, key) != 1) {
+    DIE("Could not make a self-signed TLS certificate: %s",
+        TlsError().c_str());
+  }
+  // The context holds references of its own
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+}
+
+SSL_CTX* NewTlsContext(const TlsOptions& options, bool server) {
+  SSL_CTX* context =
+      SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (context == nullptr) {
+    DIE("Could not make a TLS context: %s", TlsError().c_str());
+  }
+  SSL_CTX_set_min_proto_version(context, TLS1_3_VERSION);
+  if (SSL_CTX_set_ciphersuites(context, options.ciphersuites.c_str()) != 1) {
+    DIE("Invalid TLS cipher suites %s", options.ciphersuites.c_str());
+  }
+  // Connections carry nothing but application data once handshaken: a
+  // session ticket arriving on a kernel TLS socket read as plain would fail
+  // the read
+  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_num_tickets(context, 0);
+#ifdef OLDISIM_HAVE_KTLS
+  if (options.offload == TlsOffload::kKernel) {
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+  }
+#endif
+
+  if (server) {
+    if (options.certificate_file.empty() != options.private_key_file.empty()) {
+      DIE("A TLS certificate and its private key must be given together");
+    }
+    if (options.certificate_file.empty()) {
+      UseSelfSignedCertificate(context);
+    } else if (SSL_CTX_use_certificate_chain_file(
+                   context, options.certificate_file.c_str()) != 1 ||
+               SSL_CTX_use_PrivateKey_file(context,
+                                           options.private_key_file.c_str(),
+                                           SSL_FILETYPE_PEM) != 1 ||
+               SSL_CTX_check_private_key(context) != 1) {
+      DIE("Could not load TLS certificate %s and key %s: %s",
+          options.certificate_file.c_str(), options.private_key_file.c_str(),
+          TlsError().c_str());
+    }
+  } else if (!options.ca_file.empty()) {
+    if (SSL_CTX_load_verify_locations(context, options.ca_file.c_str(),
+                                      nullptr) != 1) {
+      DIE("Could not load TLS CA bundle %s: %s", options.ca_file.c_str(),
+          TlsError().c_str());
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+  }
+  return context;
+}
+
+void SetBlocking(int fd, bool blocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 ||
+      fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) <
+          0) {
+    DIE("fcntl(O_NONBLOCK) failed: %s", strerror(errno));
+  }
+}
+
+// Bound blocking reads and writes on fd, 0 for no bound
+void SetSocketTimeout(int fd, int seconds) {
+  timeval timeout = {seconds, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+#endif  // OLDISIM_HAVE_OPENSSL
+}  // namespace
+
+void EnableTls(const TlsOptions& options) {
+#ifdef OLDISIM_HAVE_OPENSSL
+  // OpenSSL writes to sockets with write(), which raises SIGPIPE once the
+  // peer has gone
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    DIE("Could not ignore SIGPIPE: %s", strerror(errno));
+  }
+  server_context = NewTlsContext(options, true);
+  client_context = NewTlsContext(options, false);
+#ifndef OLDISIM_HAVE_KTLS
+  if (options.offload == TlsOffload::kKernel) {
+    W("OpenSSL was built without kernel TLS, encrypting in user space");
+  }
+#endif
+  tls_enabled = true;
+#else
+  DIE("TLS requested but oldisim was built without OpenSSL");
+#endif
+}
+
+bool IsTlsEnabled() { return tls_enabled; }
+
+bool IsTlsSupported() {
+#ifdef OLDISIM_HAVE_OPENSSL
+  return true;
+#else
+  return false;
+#endif
+}
+
+TlsStats GetTlsStats() {
+  TlsStats stats;
+  stats.handshakes = counters.handshakes.load();
+  stats.handshake_failures = counters.handshake_failures.load();
+  stats.kernel_connections = counters.kernel_connections.load();
+  stats.kernel_send_connections = counters.kernel_send_connections.load();
+  stats.user_space_connections = counters.user_space_connections.load();
+  stats.device_send_connections = ReadKernelTlsStat("TlsCurrTxDevice");
+  stats.device_receive_connections = ReadKernelTlsStat("TlsCurrRxDevice");
+  return stats;
+}
+
+#ifdef OLDISIM_HAVE_OPENSSL
+bufferevent* TlsBuffereventNew(event_base* base, int fd, bool server,
+                               int options) {
+  // Handshake in blocking mode, bounded so that a silent peer cannot hang
+  // the thread
+  SetBlocking(fd, true);
+  SetSocketTimeout(fd, kHandshakeTimeoutSec);
+  SSL* ssl = SSL_new(server ? server_context : client_context);
+  errno = 0;
+  if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1 ||
+      (server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+    W("TLS handshake as %s failed: %s", server ? "server" : "client",
+      TlsError().c_str());
+    SSL_free(ssl);
+    close(fd);
+    counters.handshake_failures++;
+    return nullptr;
+  }
+  SetSocketTimeout(fd, 0);
+  SetBlocking(fd, false);
+  counters.handshakes++;
+
+  bool kernel_send = false;
+  bool kernel_receive = false;
+#ifdef OLDISIM_HAVE_KTLS
+  kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+  kernel_receive = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+  if (kernel_send && kernel_receive && !SSL_has_pending(ssl)) {
+    // The kernel encrypts and decrypts every record from here on, so the
+    // socket is read and written as plain. SSL_set_fd left fd to us.
+    SSL_free(ssl);
+    counters.kernel_connections++;
+    D("TLS connection %d encrypted by the kernel", fd);
+    return ConnectionUtil::NewSocketBufferevent(base, fd, options);
+  }
+
+  if (kernel_send) {
+    counters.kernel_send_connections++;
+  } else {
+    counters.user_space_connections++;
+  }
+  D("TLS connection %d encrypted in user space%s", fd,
+    kernel_send ? ", sent through the kernel" : "");
+  bufferevent* bev = bufferevent_openssl_socket_new(base, fd, ssl,
+                                                    BUFFEREVENT_SSL_OPEN,
+                                                    options);
+  if (bev == nullptr) {
+    DIE("Could not make a TLS bufferevent");
+  }
+  // Peers close their connections without a close_notify
+  bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+  return bev;
+}
+#else   // OLDISIM_HAVE_OPENSSL
+bufferevent* TlsBuffereventNew(event_base* base, int fd, bool server,
+                               int options) {
+  DIE("TLS requested but oldisim was built without OpenSSL");
+}
+#endif  // OLDISIM_HAVE_OPENSSL
+}  // namespace oldisim
@@ -0,0 +1,33 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -*- c++-mode -*-
+#pragma once
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+namespace oldisim {
+
+/**
+ * Run the TLS handshake enabled with EnableTls on a connected TCP socket,
+ * as the server end if server is set, and make the bufferevent of the
+ * connection. If kernel TLS took over both directions it is a socket
+ * bufferevent of the selected I/O engine, otherwise an OpenSSL bufferevent.
+ * Either takes ownership of fd and is freed with FreeSocketBufferevent.
+ * Returns nullptr, having closed fd, if the handshake fails.
+ */
+bufferevent* TlsBuffereventNew(event_base* base, int fd, bool server,
+                               int options);
+}  // namespace oldisim
@@ -0,0 +1,131 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "oldisim/Topology.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace oldisim {
+
+static const char* kSysfsNodePath = "/sys/devices/system/node";
+
+/**
+ * Parse a kernel cpulist string such as "0-3,8,10-11"
+ */
+static std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int first = atoi(range.substr(0, dash).c_str());
+    int last = dash == std::string::npos
+                   ? first
+                   : atoi(range.substr(dash + 1).c_str());
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<NumaNodeCpus> GetNumaTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+
+  std::vector<NumaNodeCpus> nodes;
+  DIR* dir = opendir(kSysfsNodePath);
+  if (dir != nullptr) {
+    while (dirent* entry = readdir(dir)) {
+      int node;
+      char trailing;
+      if (sscanf(entry->d_name, "node%d%c", &node, &trailing) != 1) {
+        continue;
+      }
+      std::ifstream cpulist(std::string(kSysfsNodePath) + "/" +
+                            entry->d_name + "/cpulist");
+      std::string list;
+      std::getline(cpulist, list);
+
+      NumaNodeCpus node_cpus = {node, {}};
+      for (int cpu : ParseCpuList(list)) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          node_cpus.cpus.push_back(cpu);
+        }
+      }
+      if (!node_cpus.cpus.empty()) {
+        nodes.push_back(std::move(node_cpus));
+      }
+    }
+    closedir(dir);
+  }
+
+  if (nodes.empty()) {
+    NumaNodeCpus node_cpus = {0, {}};
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        node_cpus.cpus.push_back(cpu);
+      }
+    }
+    nodes.push_back(std::move(node_cpus));
+  }
+
+  std::sort(nodes.begin(), nodes.end(),
+            [](const NumaNodeCpus& a, const NumaNodeCpus& b) {
+              return a.node < b.node;
+            });
+  return nodes;
+}
+
+int PinCurrentThreadToCpus(const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return 0;
+  }
+  cpu_set_t m;
+  CPU_ZERO(&m);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &m);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &m);
+}
+
+int GetPinnedCpu(pthread_t thread) {
+  cpu_set_t m;
+  CPU_ZERO(&m);
+  if (pthread_getaffinity_np(thread, sizeof(cpu_set_t), &m) != 0 ||
+      CPU_COUNT(&m) != 1) {
+    return -1;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &m)) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+}  // namespace oldisim
@@ -0,0 +1,130 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+namespace oldisim {
+
+/**
+ * Fixed-capacity Chase-Lev work-stealing deque, following the C11 memory
+ * model formulation of Le, Pop, Cohen and Zappa Nardelli (PPoPP '13).
+ * Only the owning thread may Push and Pop, which work LIFO at the bottom;
+ * any thread may Steal, which takes the oldest element from the top.
+ * T must be trivially copyable, e.g. a pointer.
+ */
+template <typename T>
+class WorkStealingDeque {
+ public:
+  explicit WorkStealingDeque(size_t min_capacity)
+      : mask_(RoundUpToPowerOfTwo(min_capacity) - 1),
+        buffer_(new std::atomic<T>[mask_ + 1]),
+        top_(0),
+        bottom_(0) {}
+
+  WorkStealingDeque(const WorkStealingDeque& that) = delete;
+
+  /**
+   * Add an element at the bottom. Returns false if the deque is full.
+   */
+  bool Push(T item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    if (b - t > static_cast<int64_t>(mask_)) {
+      return false;
+    }
+    buffer_[b & mask_].store(item, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * Take the newest element. Returns false if the deque is empty or the
+   * last element was stolen concurrently.
+   */
+  bool Pop(T* item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    *item = buffer_[b & mask_].load(std::memory_order_relaxed);
+    if (t == b) {
+      // Last element, race against thieves for it
+      bool won = top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /**
+   * Take the oldest element. Returns false if the deque is empty or another
+   * thread took the element first.
+   */
+  bool Steal(T* item) {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    T stolen = buffer_[t & mask_].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return false;
+    }
+    *item = stolen;
+    return true;
+  }
+
+  /**
+   * Approximate number of elements, exact only when called by the owner
+   * with no concurrent thieves
+   */
+  size_t Size() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+  }
+
+ private:
+  static size_t RoundUpToPowerOfTwo(size_t n) {
+    size_t capacity = 1;
+    while (capacity < n) {
+      capacity <<= 1;
+    }
+    return capacity;
+  }
+
+  const size_t mask_;
+  const std::unique_ptr<std::atomic<T>[]> buffer_;
+  // Keep the thieves' and the owner's index on separate cache lines
+  char top_padding_[64];
+  std::atomic<int64_t> top_;
+  char bottom_padding_[64];
+  std::atomic<int64_t> bottom_;
+};
+}  // namespace oldisim
@@ -0,0 +1,632 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the per-request work oldisim itself does, from header
+// encoding and stats logging up to whole round trips through a leaf and a
+// parent on loopback. Each benchmark runs for at least --min_time seconds
+// and reports the time per iteration, like Google Benchmark does.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "oldisim/EventLoop.h"
+#include "oldisim/FanoutManager.h"
+#include "oldisim/LeafNodeServer.h"
+#include "oldisim/LeafNodeStats.h"
+#include "oldisim/LogHistogramSampler.h"
+#include "oldisim/NodeThread.h"
+#include "oldisim/ParentNodeServer.h"
+#include "oldisim/Query.h"
+#include "oldisim/QueryContext.h"
+#include "oldisim/Response.h"
+#include "oldisim/Timestamping.h"
+#include "oldisim/Util.h"
+
+// Internal to the library, benchmarked on their own
+#include "ObjectPool.h"
+#include "WorkStealingDeque.h"
+
+#include "FrameworkBenchmarkCmdline.h"
+
+namespace {
+
+gengetopt_args_info args;
+
+// Query types served by the loopback nodes
+const uint32_t kEchoType = 0;
+const uint32_t kLogQueryType = 1;
+const uint32_t kFanoutOneType = 2;
+const uint32_t kFanoutAllType = 3;
+const int kFanoutWidth = 4;
+
+const int kHistogramBins = 200;
+
+struct BenchmarkState {
+  uint64_t iterations;
+  // Set by benchmarks that time the iterations themselves, e.g. inside a
+  // server callback; negative to use the time the function call took
+  double manual_ns;
+};
+
+typedef void (*BenchmarkFunction)(BenchmarkState& state);
+
+struct Benchmark {
+  const char* name;
+  BenchmarkFunction function;
+};
+
+struct BenchmarkResult {
+  std::string name;
+  uint64_t iterations;
+  double real_ns;  // per iteration
+  double cpu_ns;   // per iteration, of the benchmark thread only
+};
+
+std::vector<Benchmark>& Registry() {
+  static std::vector<Benchmark> registry;
+  return registry;
+}
+
+bool RegisterBenchmark(const char* name, BenchmarkFunction function) {
+  Registry().push_back(Benchmark{name, function});
+  return true;
+}
+
+#define BENCHMARK(function) \
+  const bool function##_registered = RegisterBenchmark(#function, function)
+
+// Keeps the compiler from optimizing away the computation of value
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+uint64_t ThreadCpuNano() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Blocking client connection to a node server on this host, speaking the
+ * fixed framing every node server understands
+ */
+class LoopbackClient {
+ public:
+  explicit LoopbackClient(uint16_t port) : fd_(-1), next_request_id_(0) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // The server may still be starting up
+    for (int attempt = 0; attempt < 1000; attempt++) {
+      fd_ = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd_ < 0) {
+        DIE("socket() failed: %s", strerror(errno));
+      }
+      if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          0) {
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return;
+      }
+      close(fd_);
+      fd_ = -1;
+      usleep(10000);
+    }
+    DIE("Could not connect to port %d", port);
+  }
+
+  ~LoopbackClient() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  LoopbackClient(const LoopbackClient& that) = delete;
+
+  /**
+   * Send one query and wait for its response, whose payload is left in
+   * reply
+   */
+  void RoundTrip(uint32_t type, const void* payload, uint32_t length,
+                 std::vector<char>* reply) {
+    oldisim::Query query;
+    query.query_header_.type = type;
+    query.query_header_.request_id = next_request_id_++;
+    query.query_header_.start_time = GetTimeAccurateNano();
+    query.query_header_.payload_length = length;
+    query.query_header_.priority = 0;
+    query.query_header_.deadline_us = 0;
+    oldisim::QueryPacketHeader header = query.GetHeaderNetworkOrder();
+
+    iovec iov[2] = {{&header, sizeof(header)},
+                    {const_cast<void*>(payload), length}};
+    WriteFully(iov, length > 0 ? 2 : 1);
+
+    oldisim::ResponsePacketHeader response_header(
+        0, 0, 0, 0, 0, oldisim::ResponseStatus::kOk);
+    ReadFully(&response_header, sizeof(response_header));
+    oldisim::Response response =
+        oldisim::Response::FromHeaderNetworkOrder(&response_header);
+    if (response.GetStatus() != oldisim::ResponseStatus::kOk) {
+      DIE("Query of type %u was not served", type);
+    }
+    reply->resize(response.GetPayloadLength());
+    ReadFully(reply->data(), reply->size());
+  }
+
+ private:
+  void WriteFully(iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+      ssize_t written = writev(fd_, iov, iovcnt);
+      if (written < 0) {
+        DIE("writev() failed: %s", strerror(errno));
+      }
+      while (iovcnt > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+        iov->iov_len -= written;
+      }
+    }
+  }
+
+  void ReadFully(void* data, size_t length) {
+    char* out = static_cast<char*>(data);
+    while (length > 0) {
+      ssize_t got = read(fd_, out, length);
+      if (got <= 0) {
+        DIE("Connection closed by the server");
+      }
+      out += got;
+      length -= got;
+    }
+  }
+
+  int fd_;
+  uint64_t next_request_id_;
+};
+
+// Echoes the query payload back
+void EchoHandler(oldisim::NodeThread& thread, oldisim::QueryContext& context) {
+  context.SendResponse(context.GetContiguousPayload(), context.payload_length);
+}
+
+// Logs the query the number of times given in its payload into a leaf
+// stats object, and replies with the nanoseconds that took
+void LogQueryHandler(oldisim::NodeThread& thread,
+                     oldisim::QueryContext& context) {
+  static thread_local oldisim::LeafNodeStats stats(
+      std::set<uint32_t>{kEchoType, kLogQueryType});
+  uint64_t iterations;
+  memcpy(&iterations, context.GetContiguousPayload(), sizeof(iterations));
+  uint64_t start_time = GetTimeAccurateNano();
+  for (uint64_t i = 0; i < iterations; i++) {
+    stats.LogQuery(context);
+  }
+  uint64_t elapsed = GetTimeAccurateNano() - start_time;
+  DoNotOptimize(stats);
+  context.SendResponse(&elapsed, sizeof(elapsed));
+}
+
+void ParentThreadStartup(oldisim::NodeThread& thread,
+                         oldisim::FanoutManager& fanout_manager) {
+  for (int i = 0; i < kFanoutWidth; i++) {
+    fanout_manager.MakeChildConnection(i);
+  }
+}
+
+// Replies with the payload of the first leaf reply
+void FanoutDone(oldisim::QueryContext& originating_query,
+                const oldisim::FanoutReplyTracker& results) {
+  const oldisim::FanoutReply& reply = results.replies[0];
+  originating_query.SendResponse(reply.reply_data.get(),
+                                 reply.reply_data_length);
+}
+
+// Echoes the payload through one leaf, or through every leaf
+void FanoutHandler(oldisim::NodeThread& thread,
+                   oldisim::FanoutManager& fanout_manager,
+                   oldisim::QueryContext& context) {
+  oldisim::FanoutRequest request;
+  request.child_node_id = 0;
+  request.request_type = kEchoType;
+  request.request_data = context.GetContiguousPayload();
+  request.request_data_length = context.payload_length;
+  if (context.type == kFanoutOneType) {
+    fanout_manager.Fanout(std::move(context), &request, 1, FanoutDone);
+  } else {
+    fanout_manager.FanoutAll(std::move(context), request, FanoutDone);
+  }
+}
+
+/**
+ * One leaf that serves every request on the thread that read it, one leaf
+ * that queues requests for its threads to pick up in TaskQueueHandler, and
+ * a parent that fans out to the first leaf. Started on first use and shut
+ * down at exit.
+ */
+class LoopbackNodes {
+ public:
+  static LoopbackNodes& Get() {
+    static LoopbackNodes nodes(args.port_arg);
+    return nodes;
+  }
+
+  uint16_t direct_leaf_port() const { return port_; }
+  uint16_t queued_leaf_port() const { return port_ + 1; }
+  uint16_t parent_port() const { return port_ + 2; }
+
+  void Shutdown() {
+    for (auto server : {direct_leaf_.get(), queued_leaf_.get()}) {
+      server->Shutdown();
+    }
+    parent_->Shutdown();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+ private:
+  explicit LoopbackNodes(uint16_t port)
+      : port_(port),
+        direct_leaf_(MakeLeaf(direct_leaf_port(), false)),
+        queued_leaf_(MakeLeaf(queued_leaf_port(), true)),
+        parent_(new oldisim::ParentNodeServer(parent_port())) {
+    threads_.emplace_back([this]() { direct_leaf_->Run(); });
+    threads_.emplace_back([this]() { queued_leaf_->Run(); });
+    // Wait for the leaf to listen before the parent connects to it
+    LoopbackClient probe(direct_leaf_port());
+
+    parent_->SetThreadStartupCallback(ParentThreadStartup);
+    for (uint32_t type : {kFanoutOneType, kFanoutAllType}) {
+      parent_->RegisterQueryCallback(type, FanoutHandler);
+    }
+    parent_->RegisterRequestType(kEchoType);
+    for (int i = 0; i < kFanoutWidth; i++) {
+      parent_->AddChildNode("127.0.0.1", direct_leaf_port());
+    }
+    threads_.emplace_back([this]() { parent_->Run(1, false); });
+  }
+
+  static oldisim::LeafNodeServer* MakeLeaf(uint16_t port, bool queued) {
+    oldisim::LeafNodeServer* server = new oldisim::LeafNodeServer(port);
+    server->SetNumThreads(1);
+    server->SetThreadLoadBalancing(queued);
+    server->RegisterQueryCallback(kEchoType, EchoHandler);
+    server->RegisterQueryCallback(kLogQueryType, LogQueryHandler);
+    return server;
+  }
+
+  const uint16_t port_;
+  std::unique_ptr<oldisim::LeafNodeServer> direct_leaf_;
+  std::unique_ptr<oldisim::LeafNodeServer> queued_leaf_;
+  std::unique_ptr<oldisim::ParentNodeServer> parent_;
+  std::vector<std::thread> threads_;
+};
+
+bool loopback_nodes_started = false;
+
+LoopbackNodes& GetLoopbackNodes() {
+  loopback_nodes_started = true;
+  return LoopbackNodes::Get();
+}
+
+void RunRoundTrips(BenchmarkState& state, uint16_t port, uint32_t type) {
+  static thread_local std::vector<char> reply;
+  std::vector<char> payload(args.payload_size_arg, 'x');
+  LoopbackClient client(port);
+  // Get the connection set up before timing
+  client.RoundTrip(type, payload.data(), payload.size(), &reply);
+
+  uint64_t start_time = GetTimeAccurateNano();
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    client.RoundTrip(type, payload.data(), payload.size(), &reply);
+  }
+  state.manual_ns = GetTimeAccurateNano() - start_time;
+}
+
+void BM_QueryHeaderEncode(BenchmarkState& state) {
+  oldisim::Query query;
+  query.query_header_ = {kEchoType, 0, GetTimeAccurateNano(), 64, 0, 0};
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    query.query_header_.request_id = i;
+    oldisim::QueryPacketHeader header = query.GetHeaderNetworkOrder();
+    DoNotOptimize(header);
+  }
+}
+BENCHMARK(BM_QueryHeaderEncode);
+
+void BM_ResponseHeaderEncode(BenchmarkState& state) {
+  oldisim::Response response(kEchoType, 0, GetTimeAccurateNano(), 1000, 64);
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    response.response_header_.request_id = i;
+    oldisim::ResponsePacketHeader header = response.GetHeaderNetworkOrder();
+    DoNotOptimize(header);
+  }
+}
+BENCHMARK(BM_ResponseHeaderEncode);
+
+void BM_ResponseHeaderDecode(BenchmarkState& state) {
+  oldisim::ResponsePacketHeader header =
+      oldisim::Response(kEchoType, 0, GetTimeAccurateNano(), 1000, 64)
+          .GetHeaderNetworkOrder();
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    header.request_id = i;
+    DoNotOptimize(header);
+    oldisim::Response response =
+        oldisim::Response::FromHeaderNetworkOrder(&header);
+    DoNotOptimize(response);
+  }
+}
+BENCHMARK(BM_ResponseHeaderDecode);
+
+// Log-normal latencies in microseconds, roughly those of a loaded leaf
+std::vector<double> SampleLatencies() {
+  std::mt19937_64 rng(1);
+  std::lognormal_distribution<double> latency(std::log(500.0), 0.8);
+  std::vector<double> samples(4096);
+  for (double& sample : samples) {
+    sample = latency(rng);
+  }
+  return samples;
+}
+
+void BM_LogHistogramSamplerSample(BenchmarkState& state) {
+  const std::vector<double> samples = SampleLatencies();
+  oldisim::LogHistogramSampler sampler(kHistogramBins);
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    sampler.sample(samples[i % samples.size()]);
+  }
+  DoNotOptimize(sampler);
+}
+BENCHMARK(BM_LogHistogramSamplerSample);
+
+void BM_LogHistogramSamplerGetNth(BenchmarkState& state) {
+  static const double kPercentiles[] = {50, 90, 95, 99, 99.9};
+  const size_t num_percentiles = sizeof(kPercentiles) / sizeof(kPercentiles[0]);
+  oldisim::LogHistogramSampler sampler(kHistogramBins);
+  for (double sample : SampleLatencies()) {
+    sampler.sample(sample);
+  }
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    double nth = sampler.get_nth(kPercentiles[i % num_percentiles]);
+    DoNotOptimize(nth);
+  }
+}
+BENCHMARK(BM_LogHistogramSamplerGetNth);
+
+// QueryContexts only come from connections, so LogQuery is timed by the
+// leaf on the query that asks for it
+void BM_LeafNodeStatsLogQuery(BenchmarkState& state) {
+  LoopbackClient client(GetLoopbackNodes().direct_leaf_port());
+  std::vector<char> reply;
+  client.RoundTrip(kLogQueryType, &state.iterations, sizeof(state.iterations),
+                   &reply);
+  uint64_t elapsed;
+  memcpy(&elapsed, reply.data(), sizeof(elapsed));
+  state.manual_ns = elapsed;
+}
+BENCHMARK(BM_LeafNodeStatsLogQuery);
+
+void BM_LeafNodeStatsLogResponse(BenchmarkState& state) {
+  oldisim::LeafNodeStats stats(std::set<uint32_t>{kEchoType});
+  stats.ReserveForSnapshots();
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    oldisim::Response response(kEchoType, i, 0, 100000 + (i & 0xffff), 64);
+    stats.LogResponse(response);
+  }
+  DoNotOptimize(stats);
+}
+BENCHMARK(BM_LeafNodeStatsLogResponse);
+
+// The queue operations and request context recycling TaskQueueHandler does
+// for every request of a load balanced leaf, without contention
+void BM_WorkStealingDequePushPop(BenchmarkState& state) {
+  oldisim::WorkStealingDeque<uint64_t*> deque(1024);
+  uint64_t value = 0;
+  uint64_t* item = nullptr;
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    deque.Push(&value);
+    deque.Pop(&item);
+    DoNotOptimize(item);
+  }
+}
+BENCHMARK(BM_WorkStealingDequePushPop);
+
+void BM_WorkStealingDequePushSteal(BenchmarkState& state) {
+  oldisim::WorkStealingDeque<uint64_t*> deque(1024);
+  uint64_t value = 0;
+  uint64_t* item = nullptr;
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    deque.Push(&value);
+    deque.Steal(&item);
+    DoNotOptimize(item);
+  }
+}
+BENCHMARK(BM_WorkStealingDequePushSteal);
+
+void BM_ObjectPoolNewDelete(BenchmarkState& state) {
+  // About the size of a QueryContext
+  struct Slot {
+    char data[192];
+  };
+  oldisim::ObjectPool<Slot> pool;
+  for (uint64_t i = 0; i < state.iterations; i++) {
+    Slot* slot = pool.New();
+    DoNotOptimize(slot);
+    oldisim::ObjectPool<Slot>::Delete(slot);
+  }
+}
+BENCHMARK(BM_ObjectPoolNewDelete);
+
+void BM_LeafEcho(BenchmarkState& state) {
+  RunRoundTrips(state, GetLoopbackNodes().direct_leaf_port(), kEchoType);
+}
+BENCHMARK(BM_LeafEcho);
+
+void BM_LeafEchoTaskQueue(BenchmarkState& state) {
+  RunRoundTrips(state, GetLoopbackNodes().queued_leaf_port(), kEchoType);
+}
+BENCHMARK(BM_LeafEchoTaskQueue);
+
+// Every query opens and closes a fanout reply tracker on the parent
+void BM_ParentFanoutOne(BenchmarkState& state) {
+  RunRoundTrips(state, GetLoopbackNodes().parent_port(), kFanoutOneType);
+}
+BENCHMARK(BM_ParentFanoutOne);
+
+void BM_ParentFanoutAll(BenchmarkState& state) {
+  RunRoundTrips(state, GetLoopbackNodes().parent_port(), kFanoutAllType);
+}
+BENCHMARK(BM_ParentFanoutAll);
+
+/**
+ * Run benchmark with growing iteration counts until one run takes at least
+ * min_time_ns, as Google Benchmark does
+ */
+BenchmarkResult RunBenchmark(const Benchmark& benchmark, double min_time_ns) {
+  static const uint64_t kMaxIterations = 1000000000;
+  BenchmarkState state;
+  state.iterations = 1;
+  for (;;) {
+    state.manual_ns = -1;
+    uint64_t start_time = GetTimeAccurateNano();
+    uint64_t start_cpu = ThreadCpuNano();
+    benchmark.function(state);
+    double cpu_ns = ThreadCpuNano() - start_cpu;
+    double real_ns = GetTimeAccurateNano() - start_time;
+    if (state.manual_ns >= 0) {
+      real_ns = state.manual_ns;
+      cpu_ns = std::min(cpu_ns, real_ns);
+    }
+
+    if (real_ns >= min_time_ns || state.iterations >= kMaxIterations) {
+      BenchmarkResult result;
+      result.name = benchmark.name;
+      result.iterations = state.iterations;
+      result.real_ns = real_ns / state.iterations;
+      result.cpu_ns = cpu_ns / state.iterations;
+      return result;
+    }
+
+    // Aim a bit past min_time, growing by at most 10x at a time
+    double multiplier = real_ns > 0 ? min_time_ns * 1.4 / real_ns : 10;
+    multiplier = std::max(std::min(multiplier, 10.0), 2.0);
+    state.iterations = std::min<uint64_t>(state.iterations * multiplier,
+                                          kMaxIterations);
+  }
+}
+
+void WriteJson(const std::vector<BenchmarkResult>& results, FILE* out) {
+  char date[64];
+  time_t now = time(nullptr);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+  char host_name[256] = {0};
+  gethostname(host_name, sizeof(host_name) - 1);
+
+  fprintf(out, "{\n  \"context\": {\n");
+  fprintf(out, "    \"date\": \"%s\",\n", date);
+  fprintf(out, "    \"host_name\": \"%s\",\n", host_name);
+  fprintf(out, "    \"executable\": \"FrameworkBenchmark\",\n");
+  fprintf(out, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+  fprintf(out, "    \"payload_size\": %d\n", args.payload_size_arg);
+  fprintf(out, "  },\n  \"benchmarks\": [");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchmarkResult& result = results[i];
+    fprintf(out, "%s\n    {\n", i == 0 ? "" : ",");
+    fprintf(out, "      \"name\": \"%s\",\n", result.name.c_str());
+    fprintf(out, "      \"run_type\": \"iteration\",\n");
+    fprintf(out, "      \"iterations\": %lu,\n", result.iterations);
+    fprintf(out, "      \"real_time\": %.3f,\n", result.real_ns);
+    fprintf(out, "      \"cpu_time\": %.3f,\n", result.cpu_ns);
+    fprintf(out, "      \"time_unit\": \"ns\"\n    }");
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (cmdline_parser(argc, argv, &args) != 0) {
+    DIE("cmdline_parser failed");
+  }
+  if (args.min_time_arg <= 0) {
+    DIE("--min_time must be positive");
+  }
+  if (args.payload_size_arg < 0) {
+    DIE("--payload_size must not be negative");
+  }
+  if (strcmp(args.event_loop_arg, "busy_poll") == 0) {
+    if (args.busy_poll_idle_backoff_us_arg < 0) {
+      DIE("--busy_poll_idle_backoff_us must not be negative");
+    }
+    oldisim::BusyPollOptions busy_poll_options;
+    busy_poll_options.idle_backoff_us = args.busy_poll_idle_backoff_us_arg;
+    oldisim::SetEventLoopMode(oldisim::EventLoopMode::kBusyPoll,
+                              busy_poll_options);
+  }
+  if (args.kernel_rx_timestamps_given) {
+    oldisim::SetKernelRxTimestamps(true);
+  }
+
+  std::vector<BenchmarkResult> results;
+  printf("%-32s %14s %14s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+  for (const Benchmark& benchmark : Registry()) {
+    if (args.filter_given && strstr(benchmark.name, args.filter_arg) == nullptr) {
+      continue;
+    }
+    results.push_back(RunBenchmark(benchmark, args.min_time_arg * 1e9));
+    const BenchmarkResult& result = results.back();
+    printf("%-32s %11.1f ns %11.1f ns %12lu\n", result.name.c_str(),
+           result.real_ns, result.cpu_ns, result.iterations);
+    fflush(stdout);
+  }
+
+  if (args.json_given) {
+    FILE* out = fopen(args.json_arg, "w");
+    if (out == nullptr) {
+      DIE("Could not open %s: %s", args.json_arg, strerror(errno));
+    }
+    WriteJson(results, out);
+    fclose(out);
+  }
+
+  if (loopback_nodes_started) {
+    LoopbackNodes::Get().Shutdown();
+  }
+  return 0;
+}
@@ -0,0 +1,613 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "CompressionOffload.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include <zlib.h>
+
+#if defined(RANKING_USE_QATZIP)
+#include <qatzip.h>
+#endif
+#if defined(RANKING_USE_QPL)
+#include <qpl/qpl.h>
+#endif
+
+namespace ranking {
+
+// A thread's session on an accelerator. Jobs are identified by a slot below
+// the queue depth; a slot holds at most one job at a time.
+class CompressionOffload::Device {
+public:
+  virtual ~Device() = default;
+
+  // Starts compressing size bytes of data into out, which has room for
+  // capacity bytes. Returns false if the device did not take the job.
+  virtual bool submit(
+      size_t slot,
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity) = 0;
+
+  // Waits for the job of slot and returns its compressed size, or 0 if the
+  // job failed.
+  virtual size_t wait(size_t slot) = 0;
+
+  // Decompresses data into out; returns false if the device could not,
+  // e.g. because out has too little room.
+  virtual bool uncompress(
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity,
+      size_t* produced) = 0;
+};
+
+namespace {
+
+// Raw deflate, without zlib or gzip headers, like the accelerators write
+const int kDeflateWindowBits = -15;
+const int kDeflateMemLevel = 8;
+// Room accelerators may need beyond the zlib bound for stored blocks
+const size_t kDeviceOutputSlack = 1024;
+const int kBaselineRuns = 5;
+
+struct GlobalState {
+  CompressionOffloadOptions options;
+  OffloadBackend active = OffloadBackend::kSoftware;
+  double softwareCpuNanosPerByte = 0;
+};
+
+GlobalState& globalState() {
+  static GlobalState state;
+  return state;
+}
+
+uint64_t threadCpuNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+size_t outputBound(size_t size) {
+  return compressBound(size) + kDeviceOutputSlack;
+}
+
+void checkZlib(int result, const char* what) {
+  if (result != Z_OK) {
+    throw std::runtime_error(
+        std::string("zlib ") + what + " failed: " + zError(result));
+  }
+}
+
+z_stream* newDeflate(int level) {
+  auto stream = new z_stream();
+  checkZlib(
+      deflateInit2(
+          stream,
+          level,
+          Z_DEFLATED,
+          kDeflateWindowBits,
+          kDeflateMemLevel,
+          Z_DEFAULT_STRATEGY),
+      "deflate init");
+  return stream;
+}
+
+z_stream* newInflate() {
+  auto stream = new z_stream();
+  checkZlib(inflateInit2(stream, kDeflateWindowBits), "inflate init");
+  return stream;
+}
+
+// Compresses data into one frame at the front of out, which is grown to
+// the bound; returns the frame size.
+size_t deflateFrame(
+    z_stream* stream,
+    const uint8_t* data,
+    size_t size,
+    std::string& out) {
+  checkZlib(deflateReset(stream), "deflate reset");
+  const size_t bound = deflateBound(stream, size);
+  if (out.size() < bound) {
+    out.resize(bound);
+  }
+  stream->next_in = const_cast<Bytef*>(data);
+  stream->avail_in = size;
+  stream->next_out = reinterpret_cast<Bytef*>(&out[0]);
+  stream->avail_out = out.size();
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    throw std::runtime_error("zlib deflate failed: output bound exceeded");
+  }
+  return stream->total_out;
+}
+
+#if defined(RANKING_USE_QATZIP)
+// QATzip calls block until the engine is done, so a job completes during
+// submit() and wait() only hands back its result.
+class QatDevice : public CompressionOffload::Device {
+public:
+  static std::unique_ptr<QatDevice> open(const CompressionOffloadOptions& o) {
+    std::unique_ptr<QatDevice> device(new QatDevice(o.queueDepth));
+    // Without QATzip's own software backup a failure reaches the caller,
+    // which falls back and counts it
+    const int init = qzInit(&device->session_, 0);
+    if (init != QZ_OK && init != QZ_DUPLICATE) {
+      return nullptr;
+    }
+    QzSessionParamsDeflate_T params;
+    if (qzGetDefaultsDeflate(&params) != QZ_OK) {
+      return nullptr;
+    }
+    params.data_fmt = QZ_DEFLATE_RAW;
+    params.common_params.comp_lvl = std::min(std::max(o.level, 1), 9);
+    if (qzSetupSessionDeflate(&device->session_, &params) != QZ_OK) {
+      return nullptr;
+    }
+    return device;
+  }
+
+  ~QatDevice() override {
+    qzTeardownSession(&session_);
+    qzClose(&session_);
+  }
+
+  bool submit(
+      size_t slot,
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity) override {
+    unsigned int srcLen = size;
+    unsigned int destLen = capacity;
+    const int rc = qzCompress(&session_, data, &srcLen, out, &destLen, 1);
+    results_[slot] = rc == QZ_OK && srcLen == size ? destLen : 0;
+    return true;
+  }
+
+  size_t wait(size_t slot) override {
+    return results_[slot];
+  }
+
+  bool uncompress(
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity,
+      size_t* produced) override {
+    unsigned int srcLen = size;
+    unsigned int destLen = capacity;
+    if (qzDecompress(&session_, data, &srcLen, out, &destLen) != QZ_OK ||
+        srcLen != size) {
+      return false;
+    }
+    *produced = destLen;
+    return true;
+  }
+
+private:
+  explicit QatDevice(size_t queueDepth) : results_(queueDepth) {}
+
+  QzSession_T session_{};
+  std::vector<size_t> results_;
+};
+#endif
+
+#if defined(RANKING_USE_QPL)
+// One QPL job per slot, submitted to IAA and waited for separately, plus
+// one more for decompression.
+class IaaDevice : public CompressionOffload::Device {
+public:
+  static std::unique_ptr<IaaDevice> open(const CompressionOffloadOptions& o) {
+    uint32_t jobSize = 0;
+    if (qpl_get_job_size(qpl_path_hardware, &jobSize) != QPL_STS_OK) {
+      return nullptr;
+    }
+    std::unique_ptr<IaaDevice> device(new IaaDevice());
+    for (size_t i = 0; i < o.queueDepth + 1; i++) {
+      std::unique_ptr<uint8_t[]> buffer(new uint8_t[jobSize]);
+      if (qpl_init_job(qpl_path_hardware, asJob(buffer)) != QPL_STS_OK) {
+        return nullptr;
+      }
+      device->jobs_.push_back(std::move(buffer));
+    }
+    return device;
+  }
+
+  ~IaaDevice() override {
+    for (auto& job : jobs_) {
+      qpl_fini_job(asJob(job));
+    }
+  }
+
+  bool submit(
+      size_t slot,
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity) override {
+    qpl_job* job = asJob(jobs_[slot]);
+    // IAA compresses at the default level only
+    job->op = qpl_op_compress;
+    job->level = qpl_default_level;
+    job->next_in_ptr = const_cast<uint8_t*>(data);
+    job->available_in = size;
+    job->next_out_ptr = out;
+    job->available_out = capacity;
+    job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST | QPL_FLAG_DYNAMIC_HUFFMAN |
+        QPL_FLAG_OMIT_VERIFY;
+    return qpl_submit_job(job) == QPL_STS_OK;
+  }
+
+  size_t wait(size_t slot) override {
+    qpl_job* job = asJob(jobs_[slot]);
+    return qpl_wait_job(job) == QPL_STS_OK ? job->total_out : 0;
+  }
+
+  bool uncompress(
+      const uint8_t* data,
+      size_t size,
+      uint8_t* out,
+      size_t capacity,
+      size_t* produced) override {
+    qpl_job* job = asJob(jobs_.back());
+    job->op = qpl_op_decompress;
+    job->next_in_ptr = const_cast<uint8_t*>(data);
+    job->available_in = size;
+    job->next_out_ptr = out;
+    job->available_out = capacity;
+    job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST;
+    if (qpl_execute_job(job) != QPL_STS_OK) {
+      return false;
+    }
+    *produced = job->total_out;
+    return true;
+  }
+
+private:
+  static qpl_job* asJob(const std::unique_ptr<uint8_t[]>& buffer) {
+    return reinterpret_cast<qpl_job*>(buffer.get());
+  }
+
+  std::vector<std::unique_ptr<uint8_t[]>> jobs_;
+};
+#endif
+
+// Returns null if the backend is software, not compiled in or its device
+// cannot be opened.
+std::unique_ptr<CompressionOffload::Device> openDevice(
+    const CompressionOffloadOptions& options) {
+  switch (options.backend) {
+    case OffloadBackend::kQat:
+#if defined(RANKING_USE_QATZIP)
+      return QatDevice::open(options);
+#else
+      return nullptr;
+#endif
+    case OffloadBackend::kIaa:
+#if defined(RANKING_USE_QPL)
+      return IaaDevice::open(options);
+#else
+      return nullptr;
+#endif
+    case OffloadBackend::kSoftware:
+      break;
+  }
+  return nullptr;
+}
+
+// Median CPU time zlib takes per byte of sample.
+double measureSoftwareCost(const std::string& sample, int level) {
+  if (sample.empty()) {
+    return 0;
+  }
+  std::unique_ptr<z_stream, void (*)(z_stream*)> stream(
+      newDeflate(level), [](z_stream* s) {
+        deflateEnd(s);
+        delete s;
+      });
+  const auto* data = reinterpret_cast<const uint8_t*>(sample.data());
+  std::string out;
+  deflateFrame(stream.get(), data, sample.size(), out);
+  std::vector<uint64_t> runs;
+  for (int i = 0; i < kBaselineRuns; i++) {
+    const uint64_t start = threadCpuNanos();
+    deflateFrame(stream.get(), data, sample.size(), out);
+    runs.push_back(threadCpuNanos() - start);
+  }
+  std::nth_element(runs.begin(), runs.begin() + runs.size() / 2, runs.end());
+  return static_cast<double>(runs[runs.size() / 2]) / sample.size();
+}
+
+// Only the owning thread writes its counters.
+void bump(std::atomic<uint64_t>& counter, uint64_t value) {
+  counter.store(
+      counter.load(std::memory_order_relaxed) + value,
+      std::memory_order_relaxed);
+}
+
+} // namespace
+
+const char* offloadBackendName(OffloadBackend backend) {
+  switch (backend) {
+    case OffloadBackend::kSoftware:
+      return "software";
+    case OffloadBackend::kQat:
+      return "qat";
+    case OffloadBackend::kIaa:
+      return "iaa";
+  }
+  return "unknown";
+}
+
+OffloadBackend parseOffloadBackend(const std::string& name) {
+  for (auto backend :
+       {OffloadBackend::kSoftware, OffloadBackend::kQat, OffloadBackend::kIaa}) {
+    if (name == offloadBackendName(backend)) {
+      return backend;
+    }
+  }
+  throw std::invalid_argument("unknown compression offload backend " + name);
+}
+
+double CompressionOffloadStats::offloadRate() const {
+  const uint64_t bytes = offloadedBytes + softwareBytes;
+  return bytes == 0 ? 0.0 : static_cast<double>(offloadedBytes) / bytes;
+}
+
+double CompressionOffloadStats::offloadLatencyUs() const {
+  return offloadedFrames == 0 ? 0.0 : offloadNanos / 1e3 / offloadedFrames;
+}
+
+double CompressionOffloadStats::softwareLatencyUs() const {
+  return softwareFrames == 0 ? 0.0 : softwareNanos / 1e3 / softwareFrames;
+}
+
+double CompressionOffloadStats::cpuSavedMs() const {
+  return (offloadedBytes * softwareCpuNanosPerByte - offloadCpuNanos) / 1e6;
+}
+
+struct CompressionOffload::StatsRegistry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadStats>> threads;
+};
+
+CompressionOffload::StatsRegistry& CompressionOffload::statsRegistry() {
+  static StatsRegistry registry;
+  return registry;
+}
+
+OffloadBackend CompressionOffload::configure(
+    CompressionOffloadOptions options) {
+  auto& state = globalState();
+  options.queueDepth = std::max<size_t>(options.queueDepth, 1);
+  state.softwareCpuNanosPerByte =
+      measureSoftwareCost(options.baselineSample, options.level);
+  options.baselineSample.clear();
+  state.active = openDevice(options) != nullptr ? options.backend
+                                                : OffloadBackend::kSoftware;
+  state.options = std::move(options);
+  return state.active;
+}
+
+CompressionOffload& CompressionOffload::local() {
+  static thread_local CompressionOffload session(globalState().options);
+  return session;
+}
+
+CompressionOffloadStats CompressionOffload::aggregateStats() {
+  auto& registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  CompressionOffloadStats total;
+  for (const auto& thread : registry.threads) {
+    auto load = [](const std::atomic<uint64_t>& counter) {
+      return counter.load(std::memory_order_relaxed);
+    };
+    total.offloadedFrames += load(thread->offloadedFrames);
+    total.softwareFrames += load(thread->softwareFrames);
+    total.fallbacks += load(thread->fallbacks);
+    total.offloadedBytes += load(thread->offloadedBytes);
+    total.softwareBytes += load(thread->softwareBytes);
+    total.outputBytes += load(thread->outputBytes);
+    total.offloadNanos += load(thread->offloadNanos);
+    total.softwareNanos += load(thread->softwareNanos);
+    total.offloadCpuNanos += load(thread->offloadCpuNanos);
+  }
+  total.softwareCpuNanosPerByte = globalState().softwareCpuNanosPerByte;
+  return total;
+}
+
+CompressionOffload::CompressionOffload(
+    const CompressionOffloadOptions& options)
+    : options_(options),
+      deflate_(newDeflate(options.level)),
+      inflate_(newInflate()),
+      outputs_(options.queueDepth),
+      stats_(std::make_shared<ThreadStats>()) {
+  {
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(stats_);
+  }
+  if (globalState().active != OffloadBackend::kSoftware) {
+    // A thread that cannot open a session of its own compresses in software
+    device_ = openDevice(options_);
+  }
+}
+
+CompressionOffload::~CompressionOffload() {
+  deflateEnd(deflate_);
+  inflateEnd(inflate_);
+  delete deflate_;
+  delete inflate_;
+}
+
+size_t CompressionOffload::compressSoftware(
+    const uint8_t* data,
+    size_t size,
+    std::string& out) {
+  const auto start = std::chrono::steady_clock::now();
+  const size_t compressed = deflateFrame(deflate_, data, size, out);
+  bump(stats_->softwareFrames, 1);
+  bump(stats_->softwareBytes, size);
+  bump(stats_->outputBytes, compressed);
+  bump(stats_->softwareNanos, nanosSince(start));
+  return compressed;
+}
+
+std::string CompressionOffload::compress(folly::StringPiece data) {
+  const auto buf = folly::IOBuf::wrapBufferAsValue(data.data(), data.size());
+  compressSegments(buf, data.size());
+  return outputs_[0];
+}
+
+size_t CompressionOffload::compressSegments(
+    const folly::IOBuf& chain,
+    size_t maxBytes) {
+  size_t inputBytes = 0;
+  size_t total = 0;
+  if (device_ == nullptr) {
+    for (const auto& segment : chain) {
+      if (inputBytes >= maxBytes) {
+        break;
+      }
+      const size_t size =
+          compressSoftware(segment.data(), segment.size(), outputs_[0]);
+      outputs_[0].resize(size);
+      total += size;
+      inputBytes += segment.size();
+    }
+    return total;
+  }
+
+  // Frames in flight, in submission order, by the slot they occupy
+  struct Job {
+    const uint8_t* data;
+    size_t size;
+    std::chrono::steady_clock::time_point start;
+    bool submitted;
+  };
+  const size_t depth = outputs_.size();
+  std::vector<Job> jobs(depth);
+  auto finish = [&](size_t slot) {
+    const Job& job = jobs[slot];
+    size_t size = 0;
+    if (job.submitted) {
+      const uint64_t cpuStart = threadCpuNanos();
+      size = device_->wait(slot);
+      bump(stats_->offloadCpuNanos, threadCpuNanos() - cpuStart);
+    }
+    if (size == 0) {
+      bump(stats_->fallbacks, 1);
+      size = compressSoftware(job.data, job.size, outputs_[slot]);
+    } else {
+      bump(stats_->offloadedFrames, 1);
+      bump(stats_->offloadedBytes, job.size);
+      bump(stats_->outputBytes, size);
+      bump(stats_->offloadNanos, nanosSince(job.start));
+    }
+    outputs_[slot].resize(size);
+    total += size;
+  };
+
+  size_t next = 0;
+  for (const auto& segment : chain) {
+    if (inputBytes >= maxBytes) {
+      break;
+    }
+    const size_t slot = next % depth;
+    if (next >= depth) {
+      finish(slot);
+    }
+    auto& out = outputs_[slot];
+    out.resize(std::max(out.capacity(), outputBound(segment.size())));
+    Job& job = jobs[slot];
+    job.data = segment.data();
+    job.size = segment.size();
+    job.start = std::chrono::steady_clock::now();
+    const uint64_t cpuStart = threadCpuNanos();
+    job.submitted = device_->submit(
+        slot,
+        job.data,
+        job.size,
+        reinterpret_cast<uint8_t*>(&out[0]),
+        out.size());
+    bump(stats_->offloadCpuNanos, threadCpuNanos() - cpuStart);
+    inputBytes += segment.size();
+    next++;
+  }
+  // Drain in submission order
+  for (size_t i = next > depth ? next - depth : 0; i < next; i++) {
+    finish(i % depth);
+  }
+  return total;
+}
+
+std::string CompressionOffload::uncompress(folly::StringPiece data) {
+  const auto* input = reinterpret_cast<const uint8_t*>(data.data());
+  std::string& out = outputs_[0];
+  if (device_ != nullptr) {
+    out.resize(std::max(out.capacity(), 4 * data.size() + 4096));
+    size_t produced = 0;
+    if (device_->uncompress(
+            input,
+            data.size(),
+            reinterpret_cast<uint8_t*>(&out[0]),
+            out.size(),
+            &produced)) {
+      return out.substr(0, produced);
+    }
+  }
+
+  checkZlib(inflateReset(inflate_), "inflate reset");
+  out.resize(std::max(out.capacity(), 4 * data.size() + 4096));
+  inflate_->next_in = const_cast<Bytef*>(input);
+  inflate_->avail_in = data.size();
+  inflate_->next_out = reinterpret_cast<Bytef*>(&out[0]);
+  inflate_->avail_out = out.size();
+  while (true) {
+    const int result = inflate(inflate_, Z_NO_FLUSH);
+    if (result == Z_STREAM_END) {
+      return out.substr(0, inflate_->total_out);
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      throw std::runtime_error(
+          std::string("zlib inflate failed: ") + zError(result));
+    }
+    if (inflate_->avail_out != 0) {
+      throw std::runtime_error("zlib inflate failed: truncated frame");
+    }
+    const size_t produced = inflate_->total_out;
+    out.resize(out.size() * 2);
+    inflate_->next_out = reinterpret_cast<Bytef*>(&out[produced]);
+    inflate_->avail_out = out.size() - produced;
+  }
+}
+
+} // namespace ranking
@@ -0,0 +1,151 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
+
+struct z_stream_s;
+
+namespace ranking {
+
+// Where raw deflate frames are compressed. kQat goes through QATzip and kIaa
+// through the Intel Query Processing Library on the IAA hardware path; both
+// are only available in builds with RANKING_WITH_QATZIP or RANKING_WITH_QPL.
+// kSoftware is zlib, the baseline the accelerators are measured against and
+// what they fall back to.
+enum class OffloadBackend { kSoftware, kQat, kIaa };
+
+const char* offloadBackendName(OffloadBackend backend);
+
+// Throws std::invalid_argument for an unknown name.
+OffloadBackend parseOffloadBackend(const std::string& name);
+
+struct CompressionOffloadOptions {
+  OffloadBackend backend = OffloadBackend::kSoftware;
+  // Deflate level; accelerators map it onto the levels they support
+  int level = 1;
+  // Most jobs a thread has submitted to the accelerator before it waits for
+  // the oldest
+  size_t queueDepth = 8;
+  // Compressed in software at configure() to price a byte of software
+  // compression, for the CPU time the accelerator saves
+  std::string baselineSample;
+};
+
+// Compression work summed over every thread's session.
+struct CompressionOffloadStats {
+  // Frames compressed on the accelerator, and in software because the
+  // backend is kSoftware or the accelerator is missing
+  uint64_t offloadedFrames = 0;
+  uint64_t softwareFrames = 0;
+  // Frames the accelerator failed on and software compressed instead
+  uint64_t fallbacks = 0;
+  uint64_t offloadedBytes = 0;
+  uint64_t softwareBytes = 0;
+  uint64_t outputBytes = 0;
+  // Wall time from the submission of each frame to its completion
+  uint64_t offloadNanos = 0;
+  uint64_t softwareNanos = 0;
+  // CPU time the threads spent on offloaded frames, submitting and waiting
+  uint64_t offloadCpuNanos = 0;
+  // CPU time zlib takes per input byte, measured at configure()
+  double softwareCpuNanosPerByte = 0;
+
+  // Fraction of the input bytes compressed on the accelerator.
+  double offloadRate() const;
+  // Mean latency of an offloaded and a software frame, in microseconds.
+  double offloadLatencyUs() const;
+  double softwareLatencyUs() const;
+  // CPU time software compression of the offloaded bytes would have taken,
+  // less what offloading them took.
+  double cpuSavedMs() const;
+};
+
+// Per-thread compression sessions for the leaf compression stage, created
+// once and reused across frames like PayloadCompressor. Every frame is raw
+// deflate whichever backend made it, so frames from the accelerator and from
+// the software fallback decompress alike.
+class CompressionOffload {
+public:
+  // Sets the options of every thread's session and opens a probe session
+  // on the accelerator. Must be called before the first call to local().
+  // Returns the backend frames go to, kSoftware if the accelerator is not
+  // compiled in or cannot be opened.
+  static OffloadBackend configure(CompressionOffloadOptions options);
+
+  // Returns the calling thread's session, creating it on first use.
+  static CompressionOffload& local();
+
+  // Sums the stats of all sessions, including those of exited threads.
+  static CompressionOffloadStats aggregateStats();
+
+  ~CompressionOffload();
+
+  CompressionOffload(const CompressionOffload&) = delete;
+  CompressionOffload& operator=(const CompressionOffload&) = delete;
+
+  std::string compress(folly::StringPiece data);
+
+  // Throws std::runtime_error if data is not a valid frame.
+  std::string uncompress(folly::StringPiece data);
+
+  // Compresses each of the leading segments of chain into a frame of its
+  // own, stopping after the segment that brings the input to at least
+  // maxBytes. Up to queueDepth frames are in flight on the accelerator at
+  // once. Returns the compressed size of all frames.
+  size_t compressSegments(const folly::IOBuf& chain, size_t maxBytes);
+
+  class Device;
+
+private:
+  struct ThreadStats {
+    std::atomic<uint64_t> offloadedFrames{0};
+    std::atomic<uint64_t> softwareFrames{0};
+    std::atomic<uint64_t> fallbacks{0};
+    std::atomic<uint64_t> offloadedBytes{0};
+    std::atomic<uint64_t> softwareBytes{0};
+    std::atomic<uint64_t> outputBytes{0};
+    std::atomic<uint64_t> offloadNanos{0};
+    std::atomic<uint64_t> softwareNanos{0};
+    std::atomic<uint64_t> offloadCpuNanos{0};
+  };
+  struct StatsRegistry;
+
+  static StatsRegistry& statsRegistry();
+
+  explicit CompressionOffload(const CompressionOffloadOptions& options);
+
+  // Compresses data into out with zlib; returns the compressed size.
+  size_t compressSoftware(const uint8_t* data, size_t size, std::string& out);
+
+  const CompressionOffloadOptions& options_;
+  // Null unless the accelerator opened for this thread
+  std::unique_ptr<Device> device_;
+  z_stream_s* deflate_ = nullptr;
+  z_stream_s* inflate_ = nullptr;
+  // One output buffer per job in flight on the accelerator
+  std::vector<std::string> outputs_;
+  // Shared with the stats registry so totals outlive the thread.
+  std::shared_ptr<ThreadStats> stats_;
+};
+
+} // namespace ranking
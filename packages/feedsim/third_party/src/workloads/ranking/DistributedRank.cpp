@@ -0,0 +1,350 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "DistributedRank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "SuperstepMessages.h"
+
+namespace ranking {
+namespace {
+
+// State of a query the parent stopped driving is dropped after this long,
+// when another query starts on its shard
+const auto kQueryTimeout = std::chrono::seconds(10);
+
+// Buffers a server thread reuses across supersteps
+struct Scratch {
+  std::vector<DeltaFrame> frames;
+  std::vector<int32_t> ids;
+  std::vector<float> deltas;
+  // Contribution delta sent for each local vertex, 0 if it is not sent
+  std::vector<float> moved;
+  std::string block;
+  std::string body;
+};
+
+Scratch& threadScratch() {
+  static thread_local Scratch scratch;
+  return scratch;
+}
+
+} // namespace
+
+int64_t partitionBegin(int64_t numNodes, int index, int count) {
+  return numNodes * index / count;
+}
+
+int partitionOf(int64_t vertex, int64_t numNodes, int count) {
+  // The largest index whose partition begins at or before vertex
+  return ((vertex + 1) * count - 1) / numNodes;
+}
+
+DistributedRank::DistributedRank(
+    const CSRGraph<int32_t>& graph,
+    int index,
+    int count,
+    float damping,
+    double deltaThreshold,
+    size_t numShards)
+    : index_(index),
+      count_(count),
+      numNodes_(graph.num_nodes()),
+      damping_(damping),
+      deltaThreshold_(deltaThreshold / std::max<int64_t>(numNodes_, 1)) {
+  if (count < 1 || index < 0 || index >= count) {
+    throw std::invalid_argument(
+        "partition " + std::to_string(index) + " is not one of " +
+        std::to_string(count));
+  }
+  if (numNodes_ < count) {
+    throw std::invalid_argument(
+        "a graph of " + std::to_string(numNodes_) +
+        " nodes cannot be split over " + std::to_string(count) + " leafs");
+  }
+  begin_ = partitionBegin(numNodes_, index, count);
+  end_ = partitionBegin(numNodes_, index + 1, count);
+  const int32_t numLocal = end_ - begin_;
+  auto isLocal = [this](int32_t u) { return u >= begin_ && u < end_; };
+
+  // Ghosts are the remote in-neighbors, sorted so that a delta finds its own
+  for (int32_t v = begin_; v < end_; v++) {
+    for (const int32_t u : graph.in_neigh(v)) {
+      if (!isLocal(u)) {
+        ghostIds_.push_back(u);
+      }
+    }
+  }
+  std::sort(ghostIds_.begin(), ghostIds_.end());
+  ghostIds_.erase(
+      std::unique(ghostIds_.begin(), ghostIds_.end()), ghostIds_.end());
+
+  inOffsets_.reserve(numLocal + 1);
+  inOffsets_.push_back(0);
+  invOutDegree_.resize(numLocal);
+  for (int32_t v = begin_; v < end_; v++) {
+    for (const int32_t u : graph.in_neigh(v)) {
+      if (isLocal(u)) {
+        inSlots_.push_back(u - begin_);
+      } else {
+        const auto ghost =
+            std::lower_bound(ghostIds_.begin(), ghostIds_.end(), u);
+        inSlots_.push_back(numLocal + (ghost - ghostIds_.begin()));
+      }
+    }
+    inOffsets_.push_back(inSlots_.size());
+    const int64_t outDegree = graph.out_degree(v);
+    invOutDegree_[v - begin_] = outDegree > 0 ? 1.0f / outDegree : 0.0f;
+  }
+
+  boundary_.resize(count);
+  onBoundary_.assign(numLocal, false);
+  // The last local vertex added to each leaf's boundary, to add each once
+  std::vector<int32_t> lastAdded(count, -1);
+  for (int32_t v = begin_; v < end_; v++) {
+    for (const int32_t w : graph.out_neigh(v)) {
+      const int partition = partitionOf(w, numNodes_, count);
+      if (partition != index && lastAdded[partition] != v) {
+        boundary_[partition].push_back(v - begin_);
+        lastAdded[partition] = v;
+        onBoundary_[v - begin_] = true;
+      }
+    }
+  }
+
+  numShards = std::max<size_t>(1, numShards);
+  shards_.reserve(numShards);
+  for (size_t i = 0; i < numShards; i++) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+int64_t DistributedRank::numBoundary() const {
+  return std::count(onBoundary_.begin(), onBoundary_.end(), true);
+}
+
+DistributedRankStats DistributedRank::stats() const {
+  DistributedRankStats stats;
+  stats.supersteps = supersteps_.load(std::memory_order_relaxed);
+  stats.deltasSent = deltasSent_.load(std::memory_order_relaxed);
+  stats.deltasReceived = deltasReceived_.load(std::memory_order_relaxed);
+  stats.bytesSent = bytesSent_.load(std::memory_order_relaxed);
+  stats.activeQueries = activeQueries_.load(std::memory_order_relaxed);
+  stats.expiredQueries = expiredQueries_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+DistributedRank::Shard& DistributedRank::shardFor(uint64_t queryId) {
+  queryId *= 0x9e3779b97f4a7c15ULL;
+  return *shards_[(queryId >> 32) % shards_.size()];
+}
+
+std::shared_ptr<DistributedRank::QueryState> DistributedRank::startQuery(
+    uint64_t queryId) {
+  auto state = std::make_shared<QueryState>();
+  const int32_t numLocal = end_ - begin_;
+  const float uniform = 1.0f / numNodes_;
+  state->ranks.assign(numLocal, uniform);
+  state->contributions.assign(numLocal + ghostIds_.size(), 0.0f);
+  for (int32_t v = 0; v < numLocal; v++) {
+    state->contributions[v] = uniform * invOutDegree_[v];
+  }
+  state->sent.assign(numLocal, 0.0f);
+
+  const auto now = std::chrono::steady_clock::now();
+  state->touched = now;
+  auto& shard = shardFor(queryId);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  for (auto it = shard.states.begin(); it != shard.states.end();) {
+    if (now - it->second->touched > kQueryTimeout) {
+      it = shard.states.erase(it);
+      activeQueries_.fetch_sub(1, std::memory_order_relaxed);
+      expiredQueries_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      ++it;
+    }
+  }
+  // A restarted query starts over
+  if (shard.states.insert_or_assign(queryId, state).second) {
+    activeQueries_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return state;
+}
+
+std::shared_ptr<DistributedRank::QueryState> DistributedRank::findQuery(
+    uint64_t queryId) {
+  auto& shard = shardFor(queryId);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.states.find(queryId);
+  if (it == shard.states.end()) {
+    return nullptr;
+  }
+  it->second->touched = std::chrono::steady_clock::now();
+  return it->second;
+}
+
+void DistributedRank::dropQuery(uint64_t queryId) {
+  auto& shard = shardFor(queryId);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  if (shard.states.erase(queryId) > 0) {
+    activeQueries_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void DistributedRank::superstep(
+    const uint8_t* request,
+    size_t length,
+    std::string& reply) {
+  auto& scratch = threadScratch();
+  const auto header = parseSuperstepRequest(request, length, scratch.frames);
+  if (header.numPartitions != static_cast<uint32_t>(count_)) {
+    throw std::invalid_argument(
+        "superstep request partitions the graph over " +
+        std::to_string(header.numPartitions) + " leafs instead of " +
+        std::to_string(count_));
+  }
+
+  SuperstepReply out;
+  std::shared_ptr<QueryState> state;
+  if (header.superstep == 0) {
+    if (!scratch.frames.empty()) {
+      throw std::invalid_argument("superstep 0 carries delta frames");
+    }
+    state = startQuery(header.queryId);
+  } else {
+    state = findQuery(header.queryId);
+    if (state == nullptr) {
+      throw std::runtime_error(
+          "no state for query " + std::to_string(header.queryId));
+    }
+    if (header.superstep != state->superstep + 1) {
+      throw std::invalid_argument(
+          "superstep " + std::to_string(header.superstep) + " follows " +
+          std::to_string(state->superstep));
+    }
+    for (const auto& frame : scratch.frames) {
+      applyFrame(frame.data, frame.length, *state);
+    }
+    out.residual = updateRanks(*state);
+  }
+  state->superstep = header.superstep;
+  supersteps_.fetch_add(1, std::memory_order_relaxed);
+
+  scratch.body.clear();
+  if (header.final) {
+    dropQuery(header.queryId);
+  } else {
+    appendDeltas(*state, scratch.body, &out.numDeltas);
+  }
+  encodeSuperstepReply(out, reply);
+  reply.append(scratch.body);
+  bytesSent_.fetch_add(reply.size(), std::memory_order_relaxed);
+}
+
+void DistributedRank::applyFrame(
+    const uint8_t* data,
+    uint32_t length,
+    QueryState& state) {
+  auto& scratch = threadScratch();
+  decodeDeltaBlock(data, length, scratch.ids, scratch.deltas);
+  float* ghosts = state.contributions.data() + (end_ - begin_);
+  auto ghost = ghostIds_.begin();
+  for (size_t i = 0; i < scratch.ids.size(); i++) {
+    // Ids ascend within a block, so the search only moves forward
+    ghost = std::lower_bound(ghost, ghostIds_.end(), scratch.ids[i]);
+    if (ghost == ghostIds_.end() || *ghost != scratch.ids[i]) {
+      throw std::invalid_argument(
+          "delta for vertex " + std::to_string(scratch.ids[i]) +
+          ", which has no edge to this leaf");
+    }
+    ghosts[ghost - ghostIds_.begin()] += scratch.deltas[i];
+  }
+  deltasReceived_.fetch_add(scratch.ids.size(), std::memory_order_relaxed);
+}
+
+double DistributedRank::updateRanks(QueryState& state) {
+  const int32_t numLocal = end_ - begin_;
+  const float base = (1.0f - damping_) / numNodes_;
+  const float* contributions = state.contributions.data();
+  double residual = 0;
+  // Every rank is taken from the contributions of the previous superstep,
+  // which are only replaced once all ranks are in
+  for (int32_t v = 0; v < numLocal; v++) {
+    float sum = 0;
+    for (int64_t e = inOffsets_[v]; e < inOffsets_[v + 1]; e++) {
+      sum += contributions[inSlots_[e]];
+    }
+    const float rank = base + damping_ * sum;
+    residual += std::fabs(rank - state.ranks[v]);
+    state.ranks[v] = rank;
+  }
+  for (int32_t v = 0; v < numLocal; v++) {
+    state.contributions[v] = state.ranks[v] * invOutDegree_[v];
+  }
+  return residual;
+}
+
+void DistributedRank::appendDeltas(
+    QueryState& state,
+    std::string& reply,
+    uint32_t* count) {
+  auto& scratch = threadScratch();
+  const int32_t numLocal = end_ - begin_;
+  scratch.moved.resize(numLocal);
+  for (int32_t v = 0; v < numLocal; v++) {
+    if (!onBoundary_[v]) {
+      continue;
+    }
+    const float delta = state.contributions[v] - state.sent[v];
+    if (std::fabs(delta) > deltaThreshold_) {
+      scratch.moved[v] = delta;
+      state.sent[v] = state.contributions[v];
+    } else {
+      scratch.moved[v] = 0;
+    }
+  }
+
+  *count = 0;
+  for (int partition = 0; partition < count_; partition++) {
+    scratch.ids.clear();
+    scratch.deltas.clear();
+    for (const int32_t v : boundary_[partition]) {
+      if (scratch.moved[v] != 0) {
+        scratch.ids.push_back(begin_ + v);
+        scratch.deltas.push_back(scratch.moved[v]);
+      }
+    }
+    if (scratch.ids.empty()) {
+      continue;
+    }
+    scratch.block.clear();
+    encodeDeltaBlock(
+        scratch.ids.data(),
+        scratch.deltas.data(),
+        scratch.ids.size(),
+        scratch.block);
+    appendDeltaFrame(
+        partition,
+        reinterpret_cast<const uint8_t*>(scratch.block.data()),
+        scratch.block.size(),
+        reply);
+    *count += scratch.ids.size();
+  }
+  deltasSent_.fetch_add(*count, std::memory_order_relaxed);
+}
+
+} // namespace ranking
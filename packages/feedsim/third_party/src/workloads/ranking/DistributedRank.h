@@ -0,0 +1,143 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gapbs/src/graph.h>
+
+namespace ranking {
+
+// The partition of numNodes vertices index belongs to, out of count equal
+// ranges of consecutive ids.
+int64_t partitionBegin(int64_t numNodes, int index, int count);
+int partitionOf(int64_t vertex, int64_t numNodes, int count);
+
+struct DistributedRankStats {
+  uint64_t supersteps = 0;
+  uint64_t deltasSent = 0;
+  uint64_t deltasReceived = 0;
+  uint64_t bytesSent = 0;
+  uint64_t activeQueries = 0;
+  // Queries dropped without their final superstep, because the parent gave
+  // up on them
+  uint64_t expiredQueries = 0;
+};
+
+// One leaf's share of a PageRank partitioned over several leafs, run in
+// supersteps driven by the parent. The leaf keeps the in-edges of its own
+// vertices; the contributions of in-neighbors owned by other leafs are kept
+// as ghosts, updated from the deltas those leafs send. A vertex's
+// contribution is only sent again once it moved by more than deltaThreshold
+// times the uniform rank 1 / numNodes since it was last sent.
+//
+// Every query has state of its own, so one leaf can run the supersteps of
+// many queries at once from any server thread. The supersteps of one query
+// never overlap, as the parent waits for all leafs between them.
+class DistributedRank {
+public:
+  DistributedRank(
+      const CSRGraph<int32_t>& graph,
+      int index,
+      int count,
+      float damping,
+      double deltaThreshold,
+      size_t numShards);
+
+  DistributedRank(const DistributedRank&) = delete;
+  DistributedRank& operator=(const DistributedRank&) = delete;
+
+  // Runs the superstep of a ranking::SuperstepRequest on the calling thread
+  // and replaces reply with its ranking::SuperstepReply. Throws
+  // std::invalid_argument for a malformed request, one for a different
+  // partitioning or a superstep out of order, and std::runtime_error for a
+  // superstep of a query this leaf has no state for.
+  void superstep(const uint8_t* request, size_t length, std::string& reply);
+
+  int64_t numLocal() const {
+    return end_ - begin_;
+  }
+  int64_t numGhosts() const {
+    return ghostIds_.size();
+  }
+  // Local vertices with an out-neighbor on another leaf, over all leafs
+  int64_t numBoundary() const;
+
+  DistributedRankStats stats() const;
+
+private:
+  struct QueryState {
+    std::vector<float> ranks;
+    // Local contributions, then the ghosts in the order of ghostIds_
+    std::vector<float> contributions;
+    // Local contributions as last sent
+    std::vector<float> sent;
+    uint32_t superstep = 0;
+    std::chrono::steady_clock::time_point touched;
+  };
+
+  // Padded to a cache line so neighbouring shard locks do not false share.
+  struct alignas(64) Shard {
+    std::mutex lock;
+    std::unordered_map<uint64_t, std::shared_ptr<QueryState>> states;
+  };
+
+  Shard& shardFor(uint64_t queryId);
+  std::shared_ptr<QueryState> startQuery(uint64_t queryId);
+  std::shared_ptr<QueryState> findQuery(uint64_t queryId);
+  void dropQuery(uint64_t queryId);
+
+  // Adds the deltas of a frame to the ghosts
+  void applyFrame(const uint8_t* data, uint32_t length, QueryState& state);
+  // One Jacobi sweep over the local vertices; returns the residual
+  double updateRanks(QueryState& state);
+  // Appends a frame for every other leaf with the contributions that moved
+  void appendDeltas(QueryState& state, std::string& reply, uint32_t* count);
+
+  int index_;
+  int count_;
+  int64_t numNodes_;
+  int32_t begin_;
+  int32_t end_;
+  float damping_;
+  float deltaThreshold_;
+  // In-neighbors of the local vertices as indices into contributions
+  std::vector<int64_t> inOffsets_;
+  std::vector<int32_t> inSlots_;
+  std::vector<int32_t> ghostIds_;
+  // 1 / out-degree of the local vertices, 0 without out-edges
+  std::vector<float> invOutDegree_;
+  // Local vertices with out-neighbors on each leaf; empty for this one
+  std::vector<std::vector<int32_t>> boundary_;
+  // Whether a local vertex is on the boundary of any leaf
+  std::vector<bool> onBoundary_;
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> supersteps_{0};
+  std::atomic<uint64_t> deltasSent_{0};
+  std::atomic<uint64_t> deltasReceived_{0};
+  std::atomic<uint64_t> bytesSent_{0};
+  std::atomic<uint64_t> activeQueries_{0};
+  std::atomic<uint64_t> expiredQueries_{0};
+};
+
+} // namespace ranking
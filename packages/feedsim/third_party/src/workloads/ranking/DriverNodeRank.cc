@@ -12,40 +12,210 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "oldisim/ArrivalTrace.h"
 #include "oldisim/ChildConnectionStats.h"
+#include "oldisim/ConnectionSpreading.h"
+#include "oldisim/DriverCoordinator.h"
 #include "oldisim/DriverNode.h"
+#include "oldisim/EventLoop.h"
+#include "oldisim/IoEngine.h"
 #include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ResponseContext.h"
 #include "oldisim/TestDriver.h"
+#include "oldisim/Timestamping.h"
+#include "oldisim/Tls.h"
 #include "oldisim/Util.h"
 
 #include "DriverNodeRankCmdline.h"
+#include "LiveConfig.h"
+#include "QpsSearch.h"
 #include "RequestTypes.h"
 
+#include "../search/HistogramRandomSampler.h"
 #include "utils.h"
 
 static gengetopt_args_info args;
+static std::shared_ptr<const oldisim::ArrivalTrace> arrival_trace;
+// Cumulative probabilities of the zipf request keys, shared by all threads
+static std::vector<double> request_key_cdf;
+// Total QPS to offer, changed by the QPS search or at /config while the run
+// goes on. Each thread picks up a change when it next makes a request.
+static std::atomic<double> offered_qps{0};
+static std::atomic<uint64_t> offered_qps_version{0};
+// Drives offered_qps when searching for the QPS at a latency target
+static std::unique_ptr<ranking::QpsSearch> search;
 
 const int kMaxRequestSize = 8192;
+const int kDefaultRequestSize = 3000;
 const int kRecomputeQPSPeriod = 5;
 
+// One class of request in the mix, drawn with probability proportional to
+// weight. Payload sizes come from size_histogram when one is given. Every
+// request of the class carries priority and deadline_us, 0 for none.
+struct RequestClass {
+  uint32_t type;
+  double weight;
+  const char *size_histogram;
+  uint32_t priority;
+  uint32_t deadline_us;
+};
+
+struct ThreadRequestClass {
+  uint32_t type;
+  std::unique_ptr<HistogramRandomSampler> size_sampler;
+  uint32_t priority;
+  uint32_t deadline_us;
+};
+
 struct ThreadData {
   std::string random_string;
   double qps_per_thread;
   uint64_t request_delay; // This is per thread
+  uint64_t offered_qps_version;
   oldisim::TestDriver *test_driver;
-  event *recompute_qps_timer;
+  event *recompute_qps_timer = nullptr;
+  std::vector<ThreadRequestClass> request_classes;
+  std::discrete_distribution<int> request_class_distribution;
+  std::default_random_engine rng;
+  std::uniform_int_distribution<uint64_t> request_key_distribution;
+  std::uniform_real_distribution<double> request_key_quantile;
+  // Classes of replayed trace records, by request type
+  std::unordered_map<uint32_t, RequestClass> trace_classes;
 };
 
+uint32_t DeadlineUs(double deadline_ms) {
+  return static_cast<uint32_t>(std::max(deadline_ms, 0.0) * 1000);
+}
+
+std::vector<RequestClass> RequestClasses() {
+  std::vector<RequestClass> classes = {
+      {ranking::kPageRankRequestType,
+       args.heavy_rank_weight_arg,
+       args.heavy_rank_size_histogram_arg,
+       static_cast<uint32_t>(args.heavy_rank_priority_arg),
+       DeadlineUs(args.heavy_rank_deadline_ms_arg)},
+      {ranking::kLightRankRequestType,
+       args.light_rank_weight_arg,
+       args.light_rank_size_histogram_arg,
+       static_cast<uint32_t>(args.light_rank_priority_arg),
+       DeadlineUs(args.light_rank_deadline_ms_arg)},
+      {ranking::kCacheProbeRequestType,
+       args.cache_probe_weight_arg,
+       args.cache_probe_size_histogram_arg,
+       static_cast<uint32_t>(args.cache_probe_priority_arg),
+       DeadlineUs(args.cache_probe_deadline_ms_arg)},
+  };
+  // Tenant types are full ranking requests under another type
+  for (unsigned int i = 0; i < args.tenant_given; i++) {
+    uint32_t type;
+    double weight;
+    char trailing;
+    if (sscanf(args.tenant_arg[i], "%u:%lf%c", &type, &weight, &trailing) !=
+            2 ||
+        weight < 0) {
+      DIE("--tenant needs a request type and a non-negative weight as T:W, "
+          "not %s.",
+          args.tenant_arg[i]);
+    }
+    classes.push_back(
+        {type,
+         weight,
+         args.heavy_rank_size_histogram_arg,
+         static_cast<uint32_t>(args.heavy_rank_priority_arg),
+         DeadlineUs(args.heavy_rank_deadline_ms_arg)});
+  }
+  return classes;
+}
+
+std::vector<RequestClass> RequestMix() {
+  std::vector<RequestClass> mix = RequestClasses();
+  mix.erase(
+      std::remove_if(
+          mix.begin(),
+          mix.end(),
+          [](const RequestClass &c) { return c.weight <= 0; }),
+      mix.end());
+  return mix;
+}
+
+// Key k gets probability proportional to 1 / (k + 1)^skew.
+void BuildRequestKeyCdf() {
+  request_key_cdf.resize(args.request_key_count_arg);
+  double total = 0;
+  for (int k = 0; k < args.request_key_count_arg; k++) {
+    total += 1.0 / std::pow(k + 1, args.request_key_skew_arg);
+    request_key_cdf[k] = total;
+  }
+  for (auto &p : request_key_cdf) {
+    p /= total;
+  }
+}
+
+// Writes the next request key to the front of the thread's payload buffer.
+void WriteRequestKey(ThreadData &this_thread) {
+  uint64_t key;
+  if (request_key_cdf.empty()) {
+    key = this_thread.request_key_distribution(this_thread.rng);
+  } else {
+    const double q = this_thread.request_key_quantile(this_thread.rng);
+    key = std::lower_bound(request_key_cdf.begin(), request_key_cdf.end(), q) -
+          request_key_cdf.begin();
+    key = std::min<uint64_t>(key, request_key_cdf.size() - 1);
+  }
+  std::memcpy(&this_thread.random_string[0], &key, sizeof(key));
+}
+
 // Specific timer handler to recompute inter-request delays for QPS
 void AddRecomputeDelayTimer(ThreadData &this_thread);
 void RecomputeDelayTimerHandler(evutil_socket_t listener, int16_t flags,
                                 void *arg);
 
+// Switches the calling thread to its share of the offered QPS if it changed.
+// A closed loop offered 0 QPS sends as fast as its connections allow.
+void ApplyOfferedQps(oldisim::NodeThread &thread,
+                     ThreadData &this_thread,
+                     oldisim::TestDriver &test_driver) {
+  const uint64_t version = offered_qps_version.load();
+  if (version == this_thread.offered_qps_version) {
+    return;
+  }
+  this_thread.offered_qps_version = version;
+  const double qps_per_thread = offered_qps.load() / args.threads_arg;
+  if (std::strcmp(args.arrival_arg, "closed") != 0) {
+    test_driver.SetOpenLoopRate(qps_per_thread);
+    return;
+  }
+  this_thread.qps_per_thread = qps_per_thread;
+  if (qps_per_thread == 0) {
+    this_thread.request_delay = 0;
+    return;
+  }
+  this_thread.request_delay = 1000000 / qps_per_thread;
+  // A thread started without a target has no delay modulation yet
+  if (this_thread.recompute_qps_timer == nullptr) {
+    this_thread.recompute_qps_timer = evtimer_new(
+        thread.get_event_base(), RecomputeDelayTimerHandler, &this_thread);
+    AddRecomputeDelayTimer(this_thread);
+  }
+}
+
 // Declarations of handlers
 void ThreadStartup(oldisim::NodeThread &thread,
                    oldisim::TestDriver &test_driver,
@@ -61,12 +231,19 @@ void AddRecomputeDelayTimer(ThreadData &this_thread) {
 void RecomputeDelayTimerHandler(evutil_socket_t listener, int16_t flags,
                                 void *arg) {
   ThreadData *this_thread = reinterpret_cast<ThreadData *>(arg);
+  if (this_thread->qps_per_thread == 0) {
+    AddRecomputeDelayTimer(*this_thread);
+    return;
+  }
   const oldisim::ChildConnectionStats &stats =
       this_thread->test_driver->GetConnectionStats();
 
-  // Get QPS for last stats period
-  double qps = static_cast<double>(
-                   stats.query_counts_.at(ranking::kPageRankRequestType)) /
+  // Get QPS for last stats period, over all request types in the mix
+  uint64_t query_count = 0;
+  for (const auto &count : stats.query_counts_) {
+    query_count += count.second;
+  }
+  double qps = static_cast<double>(query_count) /
                (stats.end_time_ - stats.start_time_) * 1000000000;
 
   // Adjust delay based on QPS
@@ -75,21 +252,87 @@ void RecomputeDelayTimerHandler(evutil_socket_t listener, int16_t flags,
   AddRecomputeDelayTimer(*this_thread);
 }
 
+// Seed of the thread's streams, derived from --seed, or --arrival_seed plus
+// the thread number without it
+uint64_t ThreadSeed(const oldisim::NodeThread &thread) {
+  if (args.seed_given) {
+    return DeriveSeed(args.seed_arg, thread.get_thread_num());
+  }
+  return args.arrival_seed_arg + thread.get_thread_num();
+}
+
 void ThreadStartup(oldisim::NodeThread &thread,
                    oldisim::TestDriver &test_driver,
                    std::vector<ThreadData> &thread_data) {
   ThreadData &this_thread = thread_data[thread.get_thread_num()];
+  const uint64_t seed = ThreadSeed(thread);
 
   // Initialize random string with random bits
+  if (args.seed_given) {
+    SeedThreadRandom(seed);
+  }
   this_thread.random_string = RandomString(kMaxRequestSize);
 
   // Store pointer to test_driver
   this_thread.test_driver = &test_driver;
+  this_thread.offered_qps_version = offered_qps_version.load();
+
+  // Set up the request mix
+  std::vector<double> weights;
+  for (const auto &request_class : RequestMix()) {
+    ThreadRequestClass thread_class;
+    thread_class.type = request_class.type;
+    thread_class.priority = request_class.priority;
+    thread_class.deadline_us = request_class.deadline_us;
+    if (request_class.size_histogram != nullptr) {
+      thread_class.size_sampler = std::make_unique<HistogramRandomSampler>(
+          request_class.size_histogram);
+      if (args.seed_given) {
+        thread_class.size_sampler->Seed(
+            DeriveSeed(seed, this_thread.request_classes.size()));
+      }
+    }
+    this_thread.request_classes.push_back(std::move(thread_class));
+    weights.push_back(request_class.weight);
+  }
+  this_thread.request_class_distribution =
+      std::discrete_distribution<int>(weights.begin(), weights.end());
+  this_thread.rng.seed(seed);
+  this_thread.request_key_distribution =
+      std::uniform_int_distribution<uint64_t>(
+          0, std::max(args.request_key_count_arg, 1) - 1);
+
+  // Trace arrivals carry their own schedule, type and size
+  if (arrival_trace != nullptr) {
+    for (const auto &request_class : RequestClasses()) {
+      this_thread.trace_classes.emplace(request_class.type, request_class);
+    }
+    test_driver.SetTraceSchedule(
+        arrival_trace,
+        thread.get_thread_num(),
+        args.threads_arg,
+        args.trace_speedup_arg,
+        args.trace_loop_given);
+    this_thread.request_delay = 0;
+    return;
+  }
+
+  // Open-loop arrivals follow a fixed schedule, so there is no delay to tune
+  if (std::strcmp(args.arrival_arg, "closed") != 0) {
+    auto process = std::strcmp(args.arrival_arg, "poisson") == 0
+        ? oldisim::ArrivalProcess::kPoisson
+        : oldisim::ArrivalProcess::kConstant;
+    test_driver.SetOpenLoopSchedule(
+        process,
+        offered_qps.load() / args.threads_arg,
+        seed);
+    this_thread.request_delay = 0;
+    return;
+  }
 
   // If user gave QPS target, initialize QPS modulation
-  if (args.qps_arg != 0) {
-    this_thread.qps_per_thread =
-        (static_cast<double>(args.qps_arg)) / args.threads_arg;
+  if (offered_qps.load() != 0) {
+    this_thread.qps_per_thread = offered_qps.load() / args.threads_arg;
     this_thread.recompute_qps_timer = evtimer_new(
         thread.get_event_base(), RecomputeDelayTimerHandler, &this_thread);
     AddRecomputeDelayTimer(this_thread);
@@ -103,9 +346,69 @@ void MakeRequest(oldisim::NodeThread &thread, oldisim::TestDriver &test_driver,
                  std::vector<ThreadData> &thread_data) {
   ThreadData &this_thread = thread_data[thread.get_thread_num()];
 
-  test_driver.SendRequest(ranking::kPageRankRequestType,
-                          this_thread.random_string.c_str(), 3000,
-                          this_thread.request_delay);
+  ApplyOfferedQps(thread, this_thread, test_driver);
+
+  const bool keyed = std::strcmp(args.request_keys_arg, "none") != 0;
+  if (keyed) {
+    WriteRequestKey(this_thread);
+  }
+  // Keyed requests are never shorter than their key
+  const int min_size = keyed ? ranking::kRequestKeySize : 0;
+
+  const oldisim::TraceRecord *record = test_driver.GetCurrentTraceRecord();
+  if (record != nullptr) {
+    int size = std::min<uint32_t>(record->payload_length, kMaxRequestSize);
+    const RequestClass &trace_class =
+        this_thread.trace_classes.at(record->type);
+    test_driver.SendRequest(record->type,
+                            this_thread.random_string.c_str(),
+                            std::max(size, min_size),
+                            this_thread.request_delay,
+                            trace_class.priority,
+                            trace_class.deadline_us);
+    return;
+  }
+
+  const auto &request_class =
+      this_thread.request_classes[this_thread.request_class_distribution(
+          this_thread.rng)];
+  int size = kDefaultRequestSize;
+  if (request_class.size_sampler) {
+    size = std::min(
+        std::max(request_class.size_sampler->Sample(), min_size),
+        kMaxRequestSize);
+  }
+
+  test_driver.SendRequest(request_class.type,
+                          this_thread.random_string.c_str(), size,
+                          this_thread.request_delay, request_class.priority,
+                          request_class.deadline_us);
+}
+
+// Applies an update posted to /config: qps, the total QPS to offer. Returns
+// why an update was rejected, or an empty string.
+std::string UpdateOfferedQps(const std::map<std::string, std::string> &update) {
+  if (arrival_trace != nullptr || search != nullptr) {
+    return "the offered QPS is set by the trace or the QPS search";
+  }
+  double qps = 0;
+  try {
+    for (const auto &entry : update) {
+      if (entry.first != "qps") {
+        throw std::invalid_argument("unknown option " + entry.first);
+      }
+      qps = ranking::parseConfigNumber(entry.first, entry.second, 0);
+    }
+  } catch (const std::invalid_argument &e) {
+    return e.what();
+  }
+  if (qps == 0 && std::strcmp(args.arrival_arg, "closed") != 0) {
+    return std::string("--arrival=") + args.arrival_arg +
+        " needs a positive qps";
+  }
+  offered_qps = qps;
+  offered_qps_version++;
+  return "";
 }
 
 int main(int argc, char **argv) {
@@ -114,6 +417,48 @@ int main(int argc, char **argv) {
     DIE("cmdline_parser failed");
   }
 
+  if (std::strcmp(args.io_engine_arg, "io_uring") == 0) {
+    oldisim::SetIoEngine(oldisim::IoEngine::kIoUring);
+  }
+
+  if (std::strcmp(args.event_loop_arg, "busy_poll") == 0) {
+    if (args.busy_poll_idle_backoff_us_arg < 0 ||
+        args.socket_busy_poll_us_arg < 0) {
+      DIE("--busy_poll_idle_backoff_us and --socket_busy_poll_us must not be "
+          "negative");
+    }
+    oldisim::BusyPollOptions busy_poll_options;
+    busy_poll_options.idle_backoff_us = args.busy_poll_idle_backoff_us_arg;
+    busy_poll_options.socket_busy_poll_us = args.socket_busy_poll_us_arg;
+    oldisim::SetEventLoopMode(oldisim::EventLoopMode::kBusyPoll,
+                              busy_poll_options);
+  }
+
+  if (args.kernel_rx_timestamps_given) {
+    oldisim::SetKernelRxTimestamps(true);
+  }
+
+  if (args.tls_given) {
+    oldisim::TlsOptions tls_options;
+    if (std::strcmp(args.tls_offload_arg, "user") == 0) {
+      tls_options.offload = oldisim::TlsOffload::kUserSpace;
+    }
+    if (args.tls_ca_given) {
+      tls_options.ca_file = args.tls_ca_arg;
+    }
+    tls_options.ciphersuites = args.tls_ciphersuites_arg;
+    oldisim::EnableTls(tls_options);
+  }
+
+  if (args.source_address_given || args.rss_source_ports_given) {
+    oldisim::ConnectionSpreadOptions spread_options;
+    for (unsigned int i = 0; i < args.source_address_given; i++) {
+      spread_options.source_addresses.push_back(args.source_address_arg[i]);
+    }
+    spread_options.rss_source_ports = args.rss_source_ports_given;
+    oldisim::SetConnectionSpreading(spread_options);
+  }
+
   // Set logging level
   for (unsigned int i = 0; i < args.verbose_given; i++) {
     log_level = (log_level_t)(static_cast<int>(log_level) - 1);
@@ -122,17 +467,109 @@ int main(int argc, char **argv) {
     log_level = QUIET;
   }
 
+  // A coordinator only merges the stats of the drivers, it sends no load
+  if (args.coordinate_given) {
+    if (args.coordinate_arg <= 0) {
+      DIE("--coordinate must be positive.");
+    }
+    oldisim::DriverCoordinator coordinator(
+        args.coordinator_port_arg, args.coordinate_arg);
+    if (args.histogram_output_given) {
+      coordinator.SetHistogramOutputFile(args.histogram_output_arg);
+    }
+    coordinator.Run();
+    return 0;
+  }
+
   // Check requried arguments
   if (!args.server_given) {
     DIE("--server must be specified.");
   }
 
+  if (!args.trace_given && !args.search_given &&
+      std::strcmp(args.arrival_arg, "closed") != 0 && args.qps_arg <= 0) {
+    DIE("--arrival=%s requires a positive --qps.", args.arrival_arg);
+  }
+
+  // A trace decides which request types are sent, otherwise the mix does
+  std::set<uint32_t> request_types;
+  if (args.trace_given) {
+    if (args.trace_speedup_arg <= 0) {
+      DIE("--trace_speedup must be positive.");
+    }
+    arrival_trace = oldisim::ArrivalTrace::Open(args.trace_arg);
+    std::set<uint32_t> known_types;
+    for (const auto &request_class : RequestClasses()) {
+      known_types.insert(request_class.type);
+    }
+    for (size_t i = 0; i < arrival_trace->size(); i++) {
+      uint32_t type = (*arrival_trace)[i].type;
+      if (known_types.count(type) == 0) {
+        DIE("Trace record %zu has unknown request type %u.", i, type);
+      }
+      request_types.insert(type);
+    }
+  } else {
+    for (const auto &request_class : RequestMix()) {
+      request_types.insert(request_class.type);
+    }
+    if (request_types.empty()) {
+      DIE("At least one request class needs a positive weight.");
+    }
+  }
+
+  if (args.heavy_rank_priority_arg < 0 || args.light_rank_priority_arg < 0 ||
+      args.cache_probe_priority_arg < 0) {
+    DIE("Request priorities must not be negative.");
+  }
+
+  if (std::strcmp(args.request_keys_arg, "none") != 0) {
+    if (args.request_key_count_arg <= 0) {
+      DIE("--request_key_count must be positive.");
+    }
+    if (std::strcmp(args.request_keys_arg, "zipf") == 0) {
+      if (args.request_key_skew_arg < 0) {
+        DIE("--request_key_skew must not be negative.");
+      }
+      BuildRequestKeyCdf();
+    }
+  }
+
+  // A search picks the QPS itself, starting from --qps
+  offered_qps = args.qps_arg;
+  if (args.search_given) {
+    if (args.trace_given) {
+      DIE("--search cannot be combined with --trace.");
+    }
+    if (args.coordinator_given) {
+      DIE("--search cannot be combined with --coordinator.");
+    }
+    ranking::QpsSearchOptions options;
+    if (args.qps_arg > 0) {
+      options.startQps = args.qps_arg;
+    }
+    options.settleWindows = args.search_settle_seconds_arg;
+    options.stepWindows = args.search_step_seconds_arg;
+    options.tolerance = args.search_tolerance_arg;
+    options.maxSteps = args.search_max_steps_arg;
+    try {
+      ranking::parseQpsSearchTarget(args.search_arg, options);
+      search = std::make_unique<ranking::QpsSearch>(options);
+    } catch (const std::invalid_argument &e) {
+      DIE("--search: %s", e.what());
+    }
+    offered_qps = search->targetQps();
+  }
+
   auto host_port = ranking::utils::parseHostnameAndPort(args.server_arg);
 
   // Make storage for thread variables
   std::vector<ThreadData> thread_data(args.threads_arg);
 
-  oldisim::DriverNode driver_node(host_port.first, host_port.second);
+  oldisim::DriverNode driver_node(
+      host_port.first, host_port.second,
+      ranking::utils::parseTransport(args.transport_arg),
+      ranking::utils::parseFraming(args.framing_arg));
 
   driver_node.SetThreadStartupCallback(
       std::bind(ThreadStartup, std::placeholders::_1, std::placeholders::_2,
@@ -140,13 +577,105 @@ int main(int argc, char **argv) {
   driver_node.SetMakeRequestCallback(
       std::bind(MakeRequest, std::placeholders::_1, std::placeholders::_2,
                 std::ref(thread_data)));
-  driver_node.RegisterRequestType(ranking::kPageRankRequestType);
+  for (uint32_t type : request_types) {
+    driver_node.RegisterRequestType(type);
+  }
 
   // Enable remote monitoring
   driver_node.EnableMonitoring(args.monitor_port_arg);
+  if (args.config_token_file_given) {
+    std::string token;
+    try {
+      token = ranking::readConfigToken(args.config_token_file_arg);
+    } catch (const std::runtime_error &e) {
+      DIE("--config_token_file: %s", e.what());
+    }
+    driver_node.SetMonitoringConfigCallback(token, UpdateOfferedQps);
+  }
+  if (args.power_telemetry_given) {
+    driver_node.EnablePowerTelemetry();
+  }
+
+  if (args.histogram_output_given) {
+    driver_node.SetHistogramOutputFile(args.histogram_output_arg);
+  }
+
+  if (args.record_trace_given) {
+    driver_node.SetTraceRecordFile(args.record_trace_arg);
+  }
+  if (args.stats_log_given) {
+    driver_node.SetStatsLogFile(args.stats_log_arg);
+  }
+  if (args.high_connection_count_given) {
+    driver_node.EnableHighConnectionCount();
+  }
+
+  if (args.warmup_seconds_arg < 0 || args.measure_seconds_arg < 0 ||
+      args.cooldown_seconds_arg < 0 || args.steady_state_windows_arg < 0 ||
+      args.max_warmup_seconds_arg < 0) {
+    DIE("--warmup_seconds, --measure_seconds, --cooldown_seconds, "
+        "--steady_state_windows and --max_warmup_seconds must not be "
+        "negative");
+  }
+  if (args.warmup_seconds_given || args.measure_seconds_given ||
+      args.cooldown_seconds_given) {
+    driver_node.SetMeasurementPhases(args.warmup_seconds_arg,
+                                     args.measure_seconds_arg,
+                                     args.cooldown_seconds_arg);
+  }
+  if (args.steady_state_windows_arg > 0) {
+    if (args.steady_state_windows_arg < 2) {
+      DIE("--steady_state_windows needs at least 2 windows to vary");
+    }
+    driver_node.SetSteadyStateDetection(args.steady_state_windows_arg,
+                                        args.steady_state_cv_arg,
+                                        args.max_warmup_seconds_arg);
+  }
+
+  if (args.coordinator_given) {
+    std::string coordinator = args.coordinator_arg;
+    if (coordinator.find(':') == std::string::npos ||
+        coordinator.back() == ']') {
+      coordinator += ":" + std::to_string(args.coordinator_port_arg);
+    }
+    auto coordinator_host_port =
+        ranking::utils::parseHostnameAndPort(coordinator);
+    driver_node.SetCoordinator(
+        coordinator_host_port.first, coordinator_host_port.second);
+  }
+
+  // The search steps through QPS on whole stats windows and ends the run
+  // once it is done
+  if (search != nullptr) {
+    driver_node.SetStatsWindowCallback(
+        [&driver_node](const oldisim::ChildConnectionStats &window) {
+          const double previous_qps = search->targetQps();
+          if (search->addWindow(window)) {
+            driver_node.Shutdown();
+            return;
+          }
+          if (search->targetQps() != previous_qps) {
+            I("QPS search: offering %.2f QPS", search->targetQps());
+            offered_qps = search->targetQps();
+            offered_qps_version++;
+          }
+        });
+  }
 
   driver_node.Run(args.threads_arg, args.affinity_given, args.connections_arg,
                   args.depth_arg);
 
+  if (search != nullptr) {
+    if (args.search_report_given) {
+      std::ofstream report(args.search_report_arg);
+      if (!report) {
+        DIE("Could not open search report %s", args.search_report_arg);
+      }
+      search->writeReport(report);
+    } else {
+      search->writeReport(std::cout);
+    }
+  }
+
   return 0;
 }
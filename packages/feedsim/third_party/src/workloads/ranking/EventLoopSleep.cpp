@@ -0,0 +1,33 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "EventLoopSleep.h"
+
+#include <memory>
+
+#include <folly/executors/InlineExecutor.h>
+
+namespace ranking {
+
+folly::Future<folly::Unit> eventLoopSleep(
+    const oldisim::NodeThread& thread,
+    std::chrono::nanoseconds duration) {
+  auto promise = std::make_shared<folly::Promise<folly::Unit>>();
+  auto future =
+      promise->getSemiFuture().via(&folly::InlineExecutor::instance());
+  thread.RunAfter(duration.count(), [promise]() { promise->setValue(); });
+  return future;
+}
+
+} // namespace ranking
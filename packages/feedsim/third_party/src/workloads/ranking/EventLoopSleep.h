@@ -0,0 +1,35 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <chrono>
+
+#include <folly/Unit.h>
+#include <folly/futures/Future.h>
+
+#include "oldisim/NodeThread.h"
+
+namespace ranking {
+
+// Futures-compatible sleep on the timer wheel of thread's event loop. The
+// returned future is completed on thread itself and runs its continuations
+// inline there, so none of the wait is spent handing off between a
+// timekeeper thread and an executor. May be called from any thread, but the
+// wait only ends while thread's event loop is running: a handler that blocks
+// its own thread on the result would never wake up.
+folly::Future<folly::Unit> eventLoopSleep(
+    const oldisim::NodeThread& thread,
+    std::chrono::nanoseconds duration);
+
+} // namespace ranking
@@ -0,0 +1,138 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ExecutorPools.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <fstream>
+#include <utility>
+
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
+
+#include "oldisim/Log.h"
+#include "oldisim/Topology.h"
+
+namespace ranking {
+
+namespace {
+
+// Moves the calling thread into a threaded cgroup v2 directory.
+void joinThreadCgroup(const std::string& cgroup) {
+  std::ofstream threads(cgroup + "/cgroup.threads");
+  threads << syscall(SYS_gettid) << std::endl;
+  if (!threads) {
+    W("Could not move an executor thread into cgroup %s", cgroup.c_str());
+  }
+}
+
+// Names threads like NamedThreadFactory and pins each new thread to a set of
+// CPUs, and moves it into a cgroup, before running its work loop, so thread
+// stacks and anything the thread first-touches land on the CPUs' NUMA node.
+class PinnedThreadFactory : public folly::NamedThreadFactory {
+ public:
+  PinnedThreadFactory(
+      const std::string& prefix,
+      std::vector<int> cpus,
+      std::string cgroup)
+      : folly::NamedThreadFactory(prefix),
+        cpus_(std::move(cpus)),
+        cgroup_(std::move(cgroup)) {}
+
+  std::thread newThread(folly::Func&& func) override {
+    auto cpus = cpus_;
+    auto cgroup = cgroup_;
+    return folly::NamedThreadFactory::newThread(
+        [cpus = std::move(cpus),
+         cgroup = std::move(cgroup),
+         func = std::move(func)]() mutable {
+          if (!cgroup.empty()) {
+            joinThreadCgroup(cgroup);
+          }
+          oldisim::PinCurrentThreadToCpus(cpus);
+          func();
+        });
+  }
+
+ private:
+  std::vector<int> cpus_;
+  std::string cgroup_;
+};
+
+} // namespace
+
+ExecutorPools makeExecutorPools(
+    const ExecutorPoolSizes& sizes,
+    const std::vector<int>& cpus,
+    const std::string& cgroup) {
+  ExecutorPools pools;
+  pools.cpuThreadPool = std::make_shared<folly::CPUThreadPoolExecutor>(
+      sizes.cpuThreads,
+      std::make_shared<PinnedThreadFactory>("CPUThreadPool", cpus, cgroup));
+  pools.srvCPUThreadPool = std::make_shared<folly::CPUThreadPoolExecutor>(
+      sizes.srvCPUThreads,
+      std::make_shared<PinnedThreadFactory>("srvCPUThread", cpus, cgroup));
+  pools.srvIOThreadPool = std::make_shared<folly::CPUThreadPoolExecutor>(
+      sizes.srvIOThreads,
+      std::make_shared<PinnedThreadFactory>("srvIOThread", cpus, cgroup));
+  pools.ioThreadPool = std::make_shared<folly::IOThreadPoolExecutor>(
+      sizes.ioThreads,
+      std::make_shared<PinnedThreadFactory>("IOThreadPool", cpus, cgroup));
+  return pools;
+}
+
+ExecutorPools makeSharedExecutor(
+    int numWorkers,
+    const ExecutorPoolSizes& sizes,
+    const std::vector<int>& cpus,
+    const std::string& cgroup) {
+  std::array<size_t, LaneExecutor::kNumLanes> limits;
+  limits[static_cast<size_t>(LaneExecutor::Lane::kChase)] = sizes.srvCPUThreads;
+  limits[static_cast<size_t>(LaneExecutor::Lane::kCompression)] =
+      sizes.srvIOThreads;
+  limits[static_cast<size_t>(LaneExecutor::Lane::kIO)] = sizes.ioThreads;
+  limits[static_cast<size_t>(LaneExecutor::Lane::kPageRank)] =
+      sizes.cpuThreads;
+  ExecutorPools pools;
+  pools.sharedExecutor = std::make_shared<LaneExecutor>(
+      numWorkers,
+      limits,
+      std::make_shared<PinnedThreadFactory>("LaneWorker", cpus, cgroup));
+  return pools;
+}
+
+StageExecutors stageExecutors(const ExecutorPools& pools) {
+  const auto& shared = pools.sharedExecutor;
+  if (!shared) {
+    return StageExecutors{
+        pools.cpuThreadPool,
+        pools.srvCPUThreadPool,
+        pools.srvIOThreadPool,
+        pools.ioThreadPool,
+        static_cast<int>(pools.cpuThreadPool->numThreads())};
+  }
+  // The lanes share ownership of the executor they belong to
+  auto lane = [&shared](LaneExecutor::Lane lane) {
+    return std::shared_ptr<folly::Executor>(shared, shared->lane(lane));
+  };
+  return StageExecutors{
+      lane(LaneExecutor::Lane::kPageRank),
+      lane(LaneExecutor::Lane::kChase),
+      lane(LaneExecutor::Lane::kCompression),
+      lane(LaneExecutor::Lane::kIO),
+      static_cast<int>(shared->limit(LaneExecutor::Lane::kPageRank))};
+}
+
+} // namespace ranking
@@ -0,0 +1,72 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/IOThreadPoolExecutor.h>
+
+#include "LaneExecutor.h"
+
+namespace ranking {
+
+struct ExecutorPoolSizes {
+  int cpuThreads;
+  int srvCPUThreads;
+  int srvIOThreads;
+  int ioThreads;
+};
+
+// Helper executors used by a LeafNodeRank server thread: either a pool per
+// stage, or a single shared executor with a lane per stage.
+struct ExecutorPools {
+  std::shared_ptr<folly::CPUThreadPoolExecutor> cpuThreadPool;
+  std::shared_ptr<folly::CPUThreadPoolExecutor> srvCPUThreadPool;
+  std::shared_ptr<folly::CPUThreadPoolExecutor> srvIOThreadPool;
+  std::shared_ptr<folly::IOThreadPoolExecutor> ioThreadPool;
+  std::shared_ptr<LaneExecutor> sharedExecutor;
+};
+
+// The executor a server thread hands each stage to, whichever kind of
+// ExecutorPools they come from. cpuThreads is how many cpu tasks run at once.
+struct StageExecutors {
+  std::shared_ptr<folly::Executor> cpu;
+  std::shared_ptr<folly::Executor> srvCPU;
+  std::shared_ptr<folly::Executor> srvIO;
+  std::shared_ptr<folly::Executor> io;
+  int cpuThreads;
+};
+
+// Creates a set of pools whose threads are restricted to cpus. An empty cpus
+// leaves the threads unpinned. Unless cgroup is empty, every thread also
+// moves itself into that threaded cgroup v2 directory as it starts.
+ExecutorPools makeExecutorPools(
+    const ExecutorPoolSizes& sizes,
+    const std::vector<int>& cpus,
+    const std::string& cgroup = std::string());
+
+// Creates a shared executor of numWorkers threads restricted to cpus, whose
+// lanes run at most as many tasks at once as sizes gives the matching pool.
+ExecutorPools makeSharedExecutor(
+    int numWorkers,
+    const ExecutorPoolSizes& sizes,
+    const std::vector<int>& cpus,
+    const std::string& cgroup = std::string());
+
+StageExecutors stageExecutors(const ExecutorPools& pools);
+
+} // namespace ranking
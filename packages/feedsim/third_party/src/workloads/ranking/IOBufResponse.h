@@ -0,0 +1,47 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <memory>
+#include <vector>
+
+#include <folly/io/IOBuf.h>
+
+#include "oldisim/QueryContext.h"
+
+namespace ranking {
+
+// Sends every segment of an IOBuf chain as the response payload without
+// copying it; the chain is freed once libevent has written it out.
+inline void sendResponse(
+    oldisim::QueryContext& context,
+    std::unique_ptr<folly::IOBuf> buf) {
+  std::vector<iovec> segments;
+  if (buf) {
+    segments.reserve(buf->countChainElements());
+    for (auto range : *buf) {
+      segments.push_back(
+          {const_cast<unsigned char*>(range.data()), range.size()});
+    }
+  }
+  // std::function needs a copyable callable, so hand over the raw chain
+  folly::IOBuf* chain = buf.release();
+  context.SendResponse(
+      segments.data(), segments.size(), [chain]() { delete chain; });
+}
+
+} // namespace ranking
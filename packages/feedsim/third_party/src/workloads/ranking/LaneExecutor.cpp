@@ -0,0 +1,116 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LaneExecutor.h"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+#include "oldisim/Log.h"
+
+namespace ranking {
+
+void LaneExecutor::LaneView::add(folly::Func func) {
+  owner_.add(lane_, std::move(func));
+}
+
+LaneExecutor::LaneExecutor(
+    size_t numWorkers,
+    const std::array<size_t, kNumLanes> &limits,
+    std::shared_ptr<folly::ThreadFactory> threadFactory) {
+  numWorkers = std::max<size_t>(numWorkers, 1);
+  for (size_t lane = 0; lane < kNumLanes; lane++) {
+    limits_[lane] = std::max<size_t>(1, std::min(limits[lane], numWorkers));
+    views_[lane] = std::make_unique<LaneView>(*this, lane);
+  }
+  for (size_t i = 0; i < numWorkers; i++) {
+    workers_.push_back(threadFactory->newThread([this]() { run(); }));
+  }
+}
+
+LaneExecutor::~LaneExecutor() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  workAvailable_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+folly::Executor *LaneExecutor::lane(Lane lane) const {
+  return views_[static_cast<size_t>(lane)].get();
+}
+
+size_t LaneExecutor::numWorkers() const {
+  return workers_.size();
+}
+
+size_t LaneExecutor::limit(Lane lane) const {
+  return limits_[static_cast<size_t>(lane)];
+}
+
+void LaneExecutor::add(size_t lane, folly::Func func) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    queues_[lane].push_back(std::move(func));
+  }
+  workAvailable_.notify_one();
+}
+
+size_t LaneExecutor::runnableLane() const {
+  for (size_t lane = 0; lane < kNumLanes; lane++) {
+    if (!queues_[lane].empty() && running_[lane] < limits_[lane]) {
+      return lane;
+    }
+  }
+  return kNumLanes;
+}
+
+void LaneExecutor::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    size_t lane;
+    workAvailable_.wait(lock, [this, &lane]() {
+      lane = runnableLane();
+      return lane != kNumLanes ||
+          (stopping_ &&
+           std::all_of(queues_.begin(), queues_.end(), [](const auto &queue) {
+             return queue.empty();
+           }));
+    });
+    if (lane == kNumLanes) {
+      return;
+    }
+    folly::Func func = std::move(queues_[lane].front());
+    queues_[lane].pop_front();
+    running_[lane]++;
+    lock.unlock();
+    try {
+      func();
+    } catch (const std::exception &e) {
+      W("Uncaught exception in a lane executor task: %s", e.what());
+    }
+    // Drop whatever the task holds before taking the next one
+    func = nullptr;
+    lock.lock();
+    // A freed slot lets at most one more task of the lane through, which
+    // this worker takes itself instead of waking another
+    running_[lane]--;
+  }
+}
+
+} // namespace ranking
@@ -0,0 +1,85 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <folly/Executor.h>
+#include <folly/executors/thread_factory/ThreadFactory.h>
+
+namespace ranking {
+
+// One set of workers running the helper stages of LeafNodeRank, with a
+// queue per stage. Idle workers take the oldest task of the highest priority
+// lane that is below its concurrency limit, so a worker blocked on one stage
+// never keeps the others from running and no stage can take every worker.
+class LaneExecutor {
+public:
+  // In priority order: stages nearer the end of the request pipeline go
+  // first, so requests already in flight finish before new ones start.
+  enum class Lane { kChase, kCompression, kIO, kPageRank };
+  static constexpr size_t kNumLanes = 4;
+
+  // limits holds the most tasks of each lane that may run at once, indexed
+  // by Lane, and is capped at numWorkers.
+  LaneExecutor(
+      size_t numWorkers,
+      const std::array<size_t, kNumLanes> &limits,
+      std::shared_ptr<folly::ThreadFactory> threadFactory);
+  // Runs the queued tasks before joining the workers
+  ~LaneExecutor();
+
+  LaneExecutor(const LaneExecutor &) = delete;
+  LaneExecutor &operator=(const LaneExecutor &) = delete;
+
+  // An executor adding to lane, valid as long as this one
+  folly::Executor *lane(Lane lane) const;
+
+  size_t numWorkers() const;
+  size_t limit(Lane lane) const;
+
+private:
+  class LaneView : public folly::Executor {
+  public:
+    LaneView(LaneExecutor &owner, size_t lane) : owner_(owner), lane_(lane) {}
+
+    void add(folly::Func func) override;
+
+  private:
+    LaneExecutor &owner_;
+    size_t lane_;
+  };
+
+  void add(size_t lane, folly::Func func);
+  void run();
+  // Needs mutex_ to be held; kNumLanes if no lane may run a task
+  size_t runnableLane() const;
+
+  std::array<size_t, kNumLanes> limits_;
+  std::array<std::unique_ptr<LaneView>, kNumLanes> views_;
+  std::mutex mutex_;
+  std::condition_variable workAvailable_;
+  std::array<std::deque<folly::Func>, kNumLanes> queues_;
+  std::array<size_t, kNumLanes> running_{};
+  bool stopping_{false};
+  std::vector<std::thread> workers_;
+};
+
+} // namespace ranking
@@ -13,35 +13,73 @@
 // limitations under the License.
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Optional.h>
 #include <folly/Range.h>
 #include <folly/compression/Compression.h>
 #include <folly/compression/Counters.h>
 #include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/executors/IOThreadPoolExecutor.h>
+#include <folly/executors/InlineExecutor.h>
 #include <folly/futures/Future.h>
 #include <folly/init/Init.h>
 
-#include <thrift/lib/cpp2/protocol/CompactProtocol.h>
-#include <thrift/lib/cpp2/protocol/Serializer.h>
-
+#include "oldisim/EventLoop.h"
+#include "oldisim/FlightRecorder.h"
+#include "oldisim/IoEngine.h"
 #include "oldisim/LeafNodeServer.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
 #include "oldisim/QueryContext.h"
+#include "oldisim/Timestamping.h"
+#include "oldisim/Tls.h"
+#include "oldisim/Topology.h"
 #include "oldisim/Util.h"
 
 #include "LeafNodeRankCmdline.h"
 #include "RequestTypes.h"
 
+#include "CompressionOffload.h"
+#include "DistributedRank.h"
+#include "EventLoopSleep.h"
+#include "ExecutorPools.h"
+#include "IOBufResponse.h"
+#include "LiveConfig.h"
+#include "PayloadCompressor.h"
+#include "PayloadSerializer.h"
+#include "PoolSizing.h"
+#include "ResultCache.h"
+#include "RequestPerfStats.h"
+#include "StageCalibration.h"
+#include "StageLatency.h"
+#include "Tenants.h"
 #include "TimekeeperPool.h"
+#include "WorkingSetMemory.h"
+#include "dwarfs/compressed_neighbors.h"
+#include "dwarfs/embedding_tables.h"
+#include "dwarfs/graph_reorder.h"
+#include "dwarfs/graph_snapshot.h"
+#include "dwarfs/incremental_pagerank.h"
 #include "dwarfs/pagerank.h"
 
 #include "if/gen-cpp2/ranking_types.h"
@@ -58,177 +96,1395 @@ constexpr auto kMaxResponseSize = 1u << 12u;
 const auto kNumNops = 6;
 const auto kNumNopIterations = 60;
 const auto kNumCompressIterations = 100;
-const auto kNumICacheBusterMethods = 100000;
-const auto kPointerChaseSize = 10000000;
 const auto kPageRankThreshold = 1e-4;
+const auto kNoNumaNode = -1;
+// Shape and scale of the gamma distribution of icache buster methods run
+// per request, on top of --min_icache_iterations
+const double kICacheIterationsAlpha = 0.7;
+const double kICacheIterationsBeta = 20000;
+// Independently locked shards of the distributed PageRank query states
+const size_t kDistributedRankShards = 64;
+// Streams of --seed besides the server threads, which use their numbers
+const uint64_t kKeyedRequestStream = std::numeric_limits<uint64_t>::max();
+const uint64_t kCalibrationStream = kKeyedRequestStream - 1;
+
+// PageRank requests a server thread runs together with --batch_size. The
+// pipeline runs once per batch; every query of it gets its own response.
+using QueryBatch = std::vector<std::shared_ptr<oldisim::QueryContext>>;
+
+// Batches run and the queries in them, over all server threads
+static std::atomic<int64_t> rank_batches{0};
+static std::atomic<int64_t> rank_batched_queries{0};
+
+/** Running sums of the incremental PageRank calls of one server thread. They
+ * are recorded from CPU pool threads, so every access takes the lock.
+ */
+class IncrementalRankTotals {
+ public:
+  struct Sums {
+    int64_t calls = 0;
+    int64_t iterations = 0;
+    int64_t touched_vertices = 0;
+    int64_t pushes = 0;
+    int64_t unconverged = 0;
+    double seconds = 0.0;
+  };
+
+  void record(const ranking::dwarfs::IncrementalRankStats& stats) {
+    std::lock_guard<std::mutex> lock(lock_);
+    sums_.calls++;
+    sums_.iterations += stats.iterations;
+    sums_.touched_vertices += stats.touched_vertices;
+    sums_.pushes += stats.pushes;
+    sums_.unconverged += stats.converged ? 0 : 1;
+    sums_.seconds += stats.seconds;
+  }
+
+  void accumulateInto(Sums& sums) const {
+    std::lock_guard<std::mutex> lock(lock_);
+    sums.calls += sums_.calls;
+    sums.iterations += sums_.iterations;
+    sums.touched_vertices += sums_.touched_vertices;
+    sums.pushes += sums_.pushes;
+    sums.unconverged += sums_.unconverged;
+    sums.seconds += sums_.seconds;
+  }
+
+ private:
+  mutable std::mutex lock_;
+  Sums sums_;
+};
+
+// Options of the full ranking pipeline a tenant may override; see
+// ranking::tenantOptions()
+struct RequestParams {
+  int graph_subset;
+  int graph_max_iters;
+  int chase_iterations;
+  int io_time_ms;
+  int num_objects;
+};
 
 struct ThreadData {
-  std::shared_ptr<folly::CPUThreadPoolExecutor> cpuThreadPool;
-  std::shared_ptr<folly::CPUThreadPoolExecutor> srvCPUThreadPool;
-  std::shared_ptr<folly::CPUThreadPoolExecutor> srvIOThreadPool;
-  std::shared_ptr<folly::IOThreadPoolExecutor> ioThreadPool;
+  // The thread's copy of its tenant's live_params, refreshed on the server
+  // thread as requests start
+  RequestParams params;
+  const ranking::LiveConfig<RequestParams>* live_params = nullptr;
+  uint64_t params_version = 0;
+  // Lanes of one executor with --executor=shared
+  std::shared_ptr<folly::Executor> cpuThreadPool;
+  std::shared_ptr<folly::Executor> srvCPUThreadPool;
+  std::shared_ptr<folly::Executor> srvIOThreadPool;
+  std::shared_ptr<folly::Executor> ioThreadPool;
   std::shared_ptr<ranking::TimekeeperPool> timekeeperPool;
   std::unique_ptr<ranking::dwarfs::PageRank> page_ranker;
+  // Only set with --graph_incremental, which routes PageRank requests to it
+  std::unique_ptr<ranking::dwarfs::IncrementalPageRank> incremental_ranker;
+  std::unique_ptr<IncrementalRankTotals> incremental_totals;
+  // Shared with the other server threads on the node; null without
+  // --embedding_tables
+  std::shared_ptr<const ranking::dwarfs::EmbeddingTables> embedding_tables;
   std::unique_ptr<search::PointerChase> pointer_chaser;
   std::unique_ptr<ICacheBuster> icache_buster;
   std::default_random_engine rng;
   std::gamma_distribution<double> latency_distribution;
   std::string random_string;
+  // With --seed, the base of the thread's streams, the seed of the request
+  // it is working on, which the helper tasks of the request take theirs
+  // from, and the number of requests without a key it has seeded
+  uint64_t seed = 0;
+  uint64_t request_seed = 0;
+  uint64_t unkeyed_requests = 0;
+  // Asynchronous handler state, only touched on the server thread. Every
+  // in-flight batch owns one slot of the page ranker's score vectors;
+  // batches sealed while all slots are busy wait in pending_batches.
+  std::vector<int> free_rank_slots;
+  std::deque<std::shared_ptr<QueryBatch>> pending_batches;
+  // The batch collecting requests, and how many batches were sealed before
+  // it, so a window timer can tell whether its batch is still open
+  std::shared_ptr<QueryBatch> open_batch;
+  uint64_t sealed_batches = 0;
+  // Score vector entry reserved for light ranking requests, which run on the
+  // server thread and so never overlap each other.
+  int light_rank_slot;
+  // Shared by all server threads; null without --result_cache.
+  ranking::ResultCache* result_cache = nullptr;
+  // Null without --stage_latency.
+  std::unique_ptr<ranking::StageLatencyStats> stage_stats;
+  // Shared by all server threads; null without --perf_counters.
+  ranking::RequestPerfStats* perf_stats = nullptr;
+  // Shared by all server threads; null without --num_partitions.
+  ranking::DistributedRank* distributed_rank = nullptr;
+  std::string distributed_reply;
+  bool warned_distributed = false;
+};
+
+/** One workload of a server with --tenant, or the whole server without. It
+ * has server thread state of its own on every server thread, and helper
+ * executors of its own if its spec restricts them to CPUs or a cgroup.
+ */
+struct Tenant {
+  ranking::TenantSpec spec;
+  // Options of the full ranking pipeline, changed at /config
+  std::unique_ptr<ranking::LiveConfig<RequestParams>> live_params;
+  std::map<int, ranking::ExecutorPools> executor_pools;
+  std::vector<ThreadData> thread_data;
 };
 
+/** Hands out read-only graph data shared by several server threads. Graphs
+ * are keyed by NUMA node in 'numa' mode and by a single key in 'process'
+ * mode; their compressed neighbors are keyed by the graph they encode.
+ * Embedding tables are keyed by the NUMA node of the server thread.
+ * The first thread asking for a key builds the value, so with pinned server
+ * threads its pages are first touched on the requesting thread's node.
+ */
+template <typename Key, typename T>
+class SharedRegistry {
+ public:
+  template <typename Make>
+  std::shared_ptr<const T> get(Key key, Make make) {
+    std::promise<std::shared_ptr<const T>> promise;
+    std::shared_future<std::shared_ptr<const T>> value;
+    bool builder = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = values_.find(key);
+      if (it == values_.end()) {
+        value = promise.get_future().share();
+        values_.emplace(key, value);
+        builder = true;
+      } else {
+        value = it->second;
+      }
+    }
+    if (builder) {
+      promise.set_value(make());
+    }
+    return value.get();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<Key, std::shared_future<std::shared_ptr<const T>>> values_;
+};
+
+using SharedGraphRegistry = SharedRegistry<int, CSRGraph<int32_t>>;
+using SharedCompressedRegistry = SharedRegistry<
+    const CSRGraph<int32_t>*,
+    ranking::dwarfs::CompressedNeighbors>;
+using SharedEmbeddingRegistry =
+    SharedRegistry<int, ranking::dwarfs::EmbeddingTables>;
+
+int CurrentNumaNode() {
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  return static_cast<int>(node);
+}
+
+/** Whether --working_set_pages asks for huge pages of any kind. */
+bool WorkingSetHugePages() {
+  return std::strcmp(args.working_set_pages_arg, "default") != 0;
+}
+
+/** hugetlb page size of --working_set_pages, or 0 for none. */
+size_t WorkingSetHugetlbPageSize() {
+  if (std::strcmp(args.working_set_pages_arg, "hugetlb_2m") == 0) {
+    return size_t{2} << 20;
+  }
+  if (std::strcmp(args.working_set_pages_arg, "hugetlb_1g") == 0) {
+    return size_t{1} << 30;
+  }
+  return 0;
+}
+
+/** NUMA node the thread is placed on, or the one it is running on. */
+int ThreadNumaNode(const oldisim::NodeThread& thread) {
+  return thread.get_numa_node() != kNoNumaNode ? thread.get_numa_node()
+                                               : CurrentNumaNode();
+}
+
+/** Pointer chase working set for a thread on numa node. --chase_remote_numa
+ * places it on the node after that one, so every hop crosses the
+ * interconnect.
+ */
+search::PointerChaseOptions ChaseOptions(int node) {
+  search::PointerChaseOptions options;
+  options.num_elems = args.chase_elements_arg;
+  options.num_chains = args.chase_chains_arg;
+  options.huge_pages =
+      args.chase_huge_pages_given != 0u || WorkingSetHugePages();
+  options.hugetlb_page_size = WorkingSetHugetlbPageSize();
+  options.numa_node = args.chase_numa_node_arg;
+  if (args.chase_remote_numa_given) {
+    const auto numa_nodes = oldisim::GetNumaTopology();
+    for (size_t i = 0; i < numa_nodes.size(); i++) {
+      if (numa_nodes[i].node == node) {
+        options.numa_node = numa_nodes[(i + 1) % numa_nodes.size()].node;
+      }
+    }
+    if (numa_nodes.size() < 2) {
+      W("--chase_remote_numa needs at least two NUMA nodes");
+    }
+  }
+  return options;
+}
+
+ranking::dwarfs::GraphOrder GraphReorder() {
+  if (std::strcmp(args.graph_reorder_arg, "degree") == 0) {
+    return ranking::dwarfs::GraphOrder::kDegree;
+  }
+  if (std::strcmp(args.graph_reorder_arg, "hub") == 0) {
+    return ranking::dwarfs::GraphOrder::kHubCluster;
+  }
+  if (std::strcmp(args.graph_reorder_arg, "rcm") == 0) {
+    return ranking::dwarfs::GraphOrder::kRcm;
+  }
+  return ranking::dwarfs::GraphOrder::kNone;
+}
+
+/** Best of a few single iteration PageRank sweeps over graph, in ms. */
+double TimePageRankSweep(
+    std::shared_ptr<const CSRGraph<int32_t>> graph,
+    ranking::dwarfs::PageRankKernel kernel =
+        ranking::dwarfs::PageRankKernel::kPull,
+    std::shared_ptr<const ranking::dwarfs::CompressedNeighbors> compressed =
+        nullptr) {
+  constexpr int kSweeps = 3;
+  // chooseRanges needs at least two score vector entries to stay in bounds
+  ranking::dwarfs::PageRank ranker(
+      graph, 2, kernel, 0, nullptr, std::move(compressed));
+  double best_ms = 0.0;
+  for (int i = 0; i < kSweeps; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    // One node short of the whole graph keeps the pull range in bounds
+    ranker.rank(0, 1, 0.0, 1, graph->num_nodes() - 1);
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (i == 0 || elapsed.count() < best_ms) {
+      best_ms = elapsed.count();
+    }
+  }
+  return best_ms;
+}
+
+void ReportReorderGain(
+    std::shared_ptr<const CSRGraph<int32_t>> original,
+    std::shared_ptr<const CSRGraph<int32_t>> reordered) {
+  const auto before = ranking::dwarfs::measureLocality(*original);
+  const auto after = ranking::dwarfs::measureLocality(*reordered);
+  I("Graph reorder '%s': gather line hits %.1f%% -> %.1f%%, page hits "
+    "%.1f%% -> %.1f%%, mean gap %.0f -> %.0f lines",
+    args.graph_reorder_arg,
+    100.0 * before.line_hit_fraction,
+    100.0 * after.line_hit_fraction,
+    100.0 * before.page_hit_fraction,
+    100.0 * after.page_hit_fraction,
+    before.mean_line_gap,
+    after.mean_line_gap);
+  const double before_ms = TimePageRankSweep(original);
+  const double after_ms = TimePageRankSweep(reordered);
+  I("Graph reorder '%s': PageRank sweep %.2f ms -> %.2f ms (%.2fx)",
+    args.graph_reorder_arg,
+    before_ms,
+    after_ms,
+    after_ms > 0.0 ? before_ms / after_ms : 0.0);
+}
+
+ranking::dwarfs::GraphGeneratorOptions GraphGenerator() {
+  ranking::dwarfs::GraphGeneratorOptions options;
+  if (std::strcmp(args.graph_generator_arg, "rmat") == 0) {
+    options.generator = ranking::dwarfs::GraphGenerator::kRmat;
+  } else if (std::strcmp(args.graph_generator_arg, "zipf") == 0) {
+    options.generator = ranking::dwarfs::GraphGenerator::kZipf;
+  }
+  options.rmat_a = args.graph_rmat_a_arg;
+  options.rmat_b = args.graph_rmat_b_arg;
+  options.rmat_c = args.graph_rmat_c_arg;
+  options.zipf_exponent = args.graph_zipf_exponent_arg;
+  return options;
+}
+
+/** Builds the graph on pool, which belongs to the NUMA node of the thread
+ * asking for it, so its pages are first touched on that node.
+ */
+CSRGraph<int32_t> BuildGraph(
+    ranking::dwarfs::PageRankParams& params,
+    folly::Executor* pool,
+    int pool_threads) {
+  // A few splits per thread even out the skewed generators
+  constexpr int kGraphBuildSplitsPerThread = 4;
+  return params.buildGraph(pool, pool_threads * kGraphBuildSplitsPerThread);
+}
+
+std::shared_ptr<const CSRGraph<int32_t>> MapGraphSnapshot(
+    const ranking::dwarfs::PageRankParams& params) {
+  return ranking::dwarfs::mapGraphSnapshot(
+      args.graph_scale_arg,
+      args.graph_degree_arg,
+      ranking::dwarfs::graphGeneratorFingerprint(params.generatorOptions()),
+      args.graph_snapshot_arg);
+}
+
+/** Advises huge pages for the neighbor arrays of a graph built on the heap.
+ */
+void AdviseGraphHugePages(const CSRGraph<int32_t>& graph) {
+  if (graph.num_nodes() == 0) {
+    return;
+  }
+  const int32_t last = graph.num_nodes() - 1;
+  auto advise = [](const int32_t* begin, const int32_t* end) {
+    ranking::adviseHugePages(begin, (end - begin) * sizeof(int32_t));
+  };
+  advise(graph.out_neigh(0).begin(), graph.out_neigh(last).end());
+  if (graph.directed()) {
+    advise(graph.in_neigh(0).begin(), graph.in_neigh(last).end());
+  }
+}
+
+std::shared_ptr<const CSRGraph<int32_t>> MakeGraph(
+    ranking::dwarfs::PageRankParams& params,
+    folly::Executor* pool,
+    int pool_threads) {
+  std::shared_ptr<const CSRGraph<int32_t>> graph;
+  if (args.graph_snapshot_given) {
+    graph = MapGraphSnapshot(params);
+    if (graph == nullptr) {
+      DIE("Could not map graph snapshot %s", args.graph_snapshot_arg);
+    }
+  } else {
+    graph = std::make_shared<const CSRGraph<int32_t>>(
+        BuildGraph(params, pool, pool_threads));
+  }
+  const auto order = GraphReorder();
+  if (order == ranking::dwarfs::GraphOrder::kNone) {
+    // A mapped snapshot is advised as it is mapped
+    if (WorkingSetHugePages() && !args.graph_snapshot_given) {
+      AdviseGraphHugePages(*graph);
+    }
+    return graph;
+  }
+  // The snapshot keeps the generated order; the relabeled copy lives on the
+  // heap and replaces the original once the gain has been reported
+  auto reordered = std::make_shared<const CSRGraph<int32_t>>(
+      ranking::dwarfs::reorderGraph(*graph, order));
+  static std::once_flag report_once;
+  std::call_once(report_once, [&]() { ReportReorderGain(graph, reordered); });
+  if (WorkingSetHugePages()) {
+    AdviseGraphHugePages(*reordered);
+  }
+  return reordered;
+}
+
+std::shared_ptr<const CSRGraph<int32_t>> AcquireGraph(
+    const oldisim::NodeThread& thread,
+    ranking::dwarfs::PageRankParams& params,
+    SharedGraphRegistry& registry,
+    folly::Executor* pool,
+    int pool_threads) {
+  auto make_graph = [&params, pool, pool_threads]() {
+    return MakeGraph(params, pool, pool_threads);
+  };
+  if (std::strcmp(args.graph_sharing_arg, "process") == 0) {
+    return registry.get(0, make_graph);
+  }
+  if (std::strcmp(args.graph_sharing_arg, "numa") == 0) {
+    const int node = thread.get_numa_node() != kNoNumaNode
+        ? thread.get_numa_node()
+        : CurrentNumaNode();
+    return registry.get(node, make_graph);
+  }
+  return make_graph();
+}
+
+/** Logs how much the compressed neighbors save and the neighbor bandwidth of
+ * a PageRank sweep over raw and compressed neighbors. Effective bandwidth
+ * counts the raw bytes the sweep stands in for.
+ */
+void ReportCompressedNeighbors(
+    std::shared_ptr<const CSRGraph<int32_t>> graph,
+    std::shared_ptr<const ranking::dwarfs::CompressedNeighbors> compressed) {
+  constexpr double kMB = 1e6;
+  const double raw_mb = compressed->rawBytes() / kMB;
+  const double compressed_mb = compressed->compressedBytes() / kMB;
+  I("Compressed in-neighbors with the %s decoder: %.1f MB -> %.1f MB, "
+    "%.2f bits per edge",
+    compressed->decoderName(),
+    raw_mb,
+    compressed_mb,
+    compressed->numEdges() > 0
+        ? 8.0 * compressed->compressedBytes() / compressed->numEdges()
+        : 0.0);
+  const double raw_ms = TimePageRankSweep(graph);
+  const double compressed_ms = TimePageRankSweep(
+      graph, ranking::dwarfs::PageRankKernel::kCompressedPull, compressed);
+  auto gbps = [](double mb, double ms) {
+    return ms > 0.0 ? mb / ms : 0.0;
+  };
+  I("PageRank sweep over raw neighbors %.2f ms (%.2f GB/s), compressed "
+    "%.2f ms (%.2f GB/s effective, %.2f GB/s read)",
+    raw_ms,
+    gbps(raw_mb, raw_ms),
+    compressed_ms,
+    gbps(raw_mb, compressed_ms),
+    gbps(compressed_mb, compressed_ms));
+}
+
+std::shared_ptr<const ranking::dwarfs::CompressedNeighbors>
+AcquireCompressedNeighbors(
+    const std::shared_ptr<const CSRGraph<int32_t>>& graph,
+    SharedCompressedRegistry& registry) {
+  auto compressed = registry.get(graph.get(), [&graph]() {
+    return std::make_shared<const ranking::dwarfs::CompressedNeighbors>(*graph);
+  });
+  static std::once_flag report_once;
+  std::call_once(
+      report_once, [&]() { ReportCompressedNeighbors(graph, compressed); });
+  return compressed;
+}
+
+ranking::dwarfs::EmbeddingTableOptions EmbeddingOptions() {
+  ranking::dwarfs::EmbeddingTableOptions options;
+  options.num_tables = args.embedding_tables_arg;
+  options.rows_per_table = args.embedding_rows_arg;
+  options.dimension = args.embedding_dim_arg;
+  options.pooling_factor = args.embedding_pooling_factor_arg;
+  if (std::strcmp(args.embedding_precision_arg, "int8") == 0) {
+    options.precision = ranking::dwarfs::EmbeddingPrecision::kInt8;
+  }
+  if (std::strcmp(args.embedding_pooling_arg, "mean") == 0) {
+    options.pooling = ranking::dwarfs::EmbeddingPooling::kMean;
+  }
+  options.zipf_exponent = args.embedding_zipf_exponent_arg;
+  options.huge_pages =
+      args.embedding_huge_pages_given != 0u || WorkingSetHugePages();
+  options.hugetlb_page_size = WorkingSetHugetlbPageSize();
+  return options;
+}
+
+std::shared_ptr<const ranking::dwarfs::EmbeddingTables> AcquireEmbeddingTables(
+    const oldisim::NodeThread& thread,
+    SharedEmbeddingRegistry& registry) {
+  auto tables = registry.get(thread.get_numa_node(), []() {
+    const auto* kernels =
+        ranking::dwarfs::findEmbeddingPoolingKernels(args.embedding_simd_arg);
+    if (kernels == nullptr) {
+      DIE("Embedding pooling kernels '%s' are not supported on this CPU",
+          args.embedding_simd_arg);
+    }
+    try {
+      return std::make_shared<const ranking::dwarfs::EmbeddingTables>(
+          EmbeddingOptions(), kernels);
+    } catch (const std::bad_alloc&) {
+      DIE("Could not allocate the embedding tables");
+    }
+  });
+  static std::once_flag report_once;
+  std::call_once(report_once, [&]() {
+    const auto& options = tables->options();
+    I("Embedding tables: %d x %lld rows of %d %s values, %.1f MB%s, pooling "
+      "%d rows per table with the %s kernels",
+      options.num_tables,
+      static_cast<long long>(options.rows_per_table),
+      options.dimension,
+      args.embedding_precision_arg,
+      tables->bytes() / 1e6,
+      tables->hugetlb()         ? " on hugetlb pages"
+          : tables->hugePages() ? " on huge pages"
+                                : "",
+      options.pooling_factor,
+      tables->kernels().name);
+    if (options.hugetlb_page_size > 0 && !tables->hugetlb()) {
+      W("Too few hugetlb pages reserved for the embedding tables");
+    }
+    if (options.huge_pages && !tables->hugetlb() && !tables->hugePages()) {
+      W("Could not back the embedding tables with huge pages");
+    }
+  });
+  return tables;
+}
+
+/** Makes sure args.graph_snapshot holds a graph matching the requested scale
+ * and degree, generating and writing one if needed. Runs before any server
+ * thread starts so the file is only ever written once.
+ */
+void PrepareGraphSnapshot(
+    ranking::dwarfs::PageRankParams& params,
+    folly::Executor* pool,
+    int pool_threads) {
+  if (!args.graph_snapshot_given) {
+    return;
+  }
+  if (!args.graph_snapshot_regenerate_given &&
+      MapGraphSnapshot(params) != nullptr) {
+    I("Using graph snapshot %s", args.graph_snapshot_arg);
+    return;
+  }
+  I("Writing graph snapshot %s", args.graph_snapshot_arg);
+  auto graph = BuildGraph(params, pool, pool_threads);
+  ranking::dwarfs::writeGraphSnapshot(
+      graph,
+      args.graph_scale_arg,
+      args.graph_degree_arg,
+      ranking::dwarfs::graphGeneratorFingerprint(params.generatorOptions()),
+      args.graph_snapshot_arg);
+}
+
+/** Page ranker over graph with the kernels of --graph_kernel, --graph_simd
+ * and --graph_contrib_precision.
+ */
+std::unique_ptr<ranking::dwarfs::PageRank> MakePageRanker(
+    std::shared_ptr<const CSRGraph<int32_t>> graph,
+    int num_pvectors_entries,
+    SharedCompressedRegistry& compressed_registry) {
+  auto kernel = ranking::dwarfs::PageRankKernel::kPull;
+  std::shared_ptr<const ranking::dwarfs::CompressedNeighbors> compressed;
+  if (std::strcmp(args.graph_kernel_arg, "blocked") == 0) {
+    kernel = ranking::dwarfs::PageRankKernel::kBlockedPull;
+  } else if (std::strcmp(args.graph_kernel_arg, "compressed") == 0) {
+    kernel = ranking::dwarfs::PageRankKernel::kCompressedPull;
+    compressed = AcquireCompressedNeighbors(graph, compressed_registry);
+  }
+  const ranking::dwarfs::PageRankSimdKernels* simd = nullptr;
+  if (std::strcmp(args.graph_simd_arg, "scalar") != 0) {
+    simd = ranking::dwarfs::findPageRankSimdKernels(args.graph_simd_arg);
+    if (simd == nullptr) {
+      DIE("PageRank SIMD kernels '%s' are not supported on this CPU",
+          args.graph_simd_arg);
+    }
+  }
+  const ranking::dwarfs::PageRankHalfKernels* half = nullptr;
+  if (std::strcmp(args.graph_contrib_precision_arg, "fp32") != 0) {
+    const auto precision =
+        std::strcmp(args.graph_contrib_precision_arg, "bf16") == 0
+        ? ranking::dwarfs::ContribPrecision::kBf16
+        : ranking::dwarfs::ContribPrecision::kFp16;
+    half = ranking::dwarfs::findPageRankHalfKernels(
+        precision, args.graph_simd_arg);
+    if (half == nullptr) {
+      DIE("PageRank %s contributions are not supported with '%s' kernels",
+          args.graph_contrib_precision_arg, args.graph_simd_arg);
+    }
+  }
+  return std::make_unique<ranking::dwarfs::PageRank>(
+      std::move(graph),
+      num_pvectors_entries,
+      kernel,
+      args.graph_block_size_arg,
+      simd,
+      std::move(compressed),
+      half);
+}
+
+/** Seed of stream 'stream' of the leaf, derived from --seed, or from the
+ * clock without it.
+ */
+uint64_t LeafSeed(uint64_t stream) {
+  if (args.seed_given) {
+    return DeriveSeed(args.seed_arg, stream);
+  }
+  return std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+/** Icache buster of --icache_methods, --icache_distribution and the
+ * icache skew and entropy options.
+ */
+ICacheBusterOptions ICacheOptions(uint64_t seed) {
+  ICacheBusterOptions icache_options;
+  icache_options.num_methods = args.icache_methods_arg;
+  if (std::strcmp(args.icache_distribution_arg, "random") == 0) {
+    icache_options.distribution = ICacheBusterDistribution::kRandom;
+  } else if (std::strcmp(args.icache_distribution_arg, "zipf") == 0) {
+    icache_options.distribution = ICacheBusterDistribution::kZipf;
+  }
+  icache_options.zipf_skew = args.icache_zipf_skew_arg;
+  icache_options.branch_entropy = args.icache_branch_entropy_arg;
+  icache_options.seed = seed;
+  return icache_options;
+}
+
 void ThreadStartup(
     oldisim::NodeThread& thread,
     std::vector<ThreadData>& thread_data,
     ranking::dwarfs::PageRankParams& params,
-    const std::shared_ptr<folly::CPUThreadPoolExecutor>& cpuThreadPool,
-    const std::shared_ptr<folly::CPUThreadPoolExecutor>& srvCPUThreadPool,
-    const std::shared_ptr<folly::CPUThreadPoolExecutor>& srvIOThreadPool,
-    const std::shared_ptr<folly::IOThreadPoolExecutor>& ioThreadPool,
-    const std::shared_ptr<ranking::TimekeeperPool>& timekeeperPool) {
+    SharedGraphRegistry& graph_registry,
+    SharedCompressedRegistry& compressed_registry,
+    SharedEmbeddingRegistry& embedding_registry,
+    const std::map<int, ranking::ExecutorPools>& executor_pools,
+    const std::shared_ptr<ranking::TimekeeperPool>& timekeeperPool,
+    const ranking::LiveConfig<RequestParams>& live_params) {
   auto& this_thread = thread_data[thread.get_thread_num()];
-  auto graph = params.buildGraph();
-  this_thread.cpuThreadPool = cpuThreadPool;
-  this_thread.srvCPUThreadPool = srvCPUThreadPool;
-  this_thread.srvIOThreadPool = srvIOThreadPool;
-  this_thread.ioThreadPool = ioThreadPool;
+  this_thread.live_params = &live_params;
+  this_thread.params_version = live_params.version();
+  this_thread.params = *live_params.snapshot();
+  // Everything below is allocated on the thread's own arena
+  if (args.allocator_thread_arenas_given && !ranking::useThreadArena()) {
+    DIE("Could not create a jemalloc arena for server thread %d",
+        thread.get_thread_num());
+  }
+  // Pools are keyed by NUMA node with --numa_placement, otherwise there is a
+  // single set under kNoNumaNode.
+  auto pools = executor_pools.find(thread.get_numa_node());
+  if (pools == executor_pools.end()) {
+    pools = executor_pools.find(kNoNumaNode);
+  }
+  const auto executors = ranking::stageExecutors(pools->second);
+  auto graph = AcquireGraph(
+      thread,
+      params,
+      graph_registry,
+      executors.cpu.get(),
+      executors.cpuThreads);
+  this_thread.cpuThreadPool = executors.cpu;
+  this_thread.srvCPUThreadPool = executors.srvCPU;
+  this_thread.srvIOThreadPool = executors.srvIO;
+  this_thread.ioThreadPool = executors.io;
   this_thread.timekeeperPool = timekeeperPool;
-  this_thread.page_ranker = std::make_unique<ranking::dwarfs::PageRank>(
-      std::move(graph), args.cpu_threads_arg);
-  this_thread.icache_buster =
-      std::make_unique<ICacheBuster>(kNumICacheBusterMethods);
+  // A split rank call shares a single set of score vectors across all CPU
+  // threads. The asynchronous handler needs one set per in-flight request.
+  const int num_rank_slots =
+      args.async_handler_given ? std::max(args.async_max_inflight_arg, 1) : 1;
+  const int num_pvectors_entries =
+      (args.graph_split_rank_given ? 1 : args.cpu_threads_arg) *
+      num_rank_slots;
+  for (int slot = num_rank_slots - 1; slot >= 0; slot--) {
+    this_thread.free_rank_slots.push_back(slot);
+  }
+  this_thread.light_rank_slot = num_pvectors_entries;
+  if (args.embedding_tables_arg > 0) {
+    this_thread.embedding_tables =
+        AcquireEmbeddingTables(thread, embedding_registry);
+  }
+  if (args.graph_incremental_given) {
+    this_thread.incremental_ranker =
+        std::make_unique<ranking::dwarfs::IncrementalPageRank>(
+            graph,
+            kPageRankThreshold,
+            args.graph_delta_max_edges_arg,
+            thread.get_thread_num());
+    this_thread.incremental_totals = std::make_unique<IncrementalRankTotals>();
+  }
+  this_thread.page_ranker = MakePageRanker(
+      std::move(graph), num_pvectors_entries + 1, compressed_registry);
+  if (WorkingSetHugePages()) {
+    this_thread.page_ranker->forEachVector([](void* data, size_t bytes) {
+      ranking::adviseHugePages(data, bytes);
+    });
+  }
+  const uint64_t seed = LeafSeed(thread.get_thread_num());
+  this_thread.seed = seed;
+  auto chase_options = ChaseOptions(ThreadNumaNode(thread));
+  chase_options.seed = seed;
   this_thread.pointer_chaser =
-      std::make_unique<search::PointerChase>(kPointerChaseSize);
+      std::make_unique<search::PointerChase>(chase_options);
+  const auto& chaser = *this_thread.pointer_chaser;
+  if (chase_options.hugetlb_page_size > 0 && !chaser.hugetlb()) {
+    W("Too few hugetlb pages reserved for the pointer chase");
+  }
+  if (chase_options.huge_pages && !chaser.hugetlb() && !chaser.huge_pages()) {
+    W("Could not back the pointer chase with huge pages");
+  }
+  if (chase_options.numa_node >= 0 && !chaser.numa_bound()) {
+    W("Could not bind the pointer chase to NUMA node %d",
+      chase_options.numa_node);
+  }
 
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
   this_thread.rng.seed(seed);
 
-  const double alpha = 0.7;
-  const double beta = 20000;
-  this_thread.latency_distribution =
-      std::gamma_distribution<double>(alpha, beta);
+  this_thread.icache_buster =
+      std::make_unique<ICacheBuster>(ICacheOptions(seed));
+
+  this_thread.latency_distribution = std::gamma_distribution<double>(
+      kICacheIterationsAlpha, kICacheIterationsBeta);
 
+  if (args.seed_given) {
+    SeedThreadRandom(seed);
+  }
   this_thread.random_string = RandomString(args.random_data_size_arg);
+  if (WorkingSetHugePages()) {
+    ranking::adviseHugePages(
+        this_thread.random_string.data(), this_thread.random_string.size());
+  }
+}
+
+bool StreamingCompression() {
+  return std::strcmp(args.compression_pipeline_arg, "streaming") == 0;
+}
+
+// Whether payloads go to the offload backend instead of the codec pipeline
+bool OffloadCompression() {
+  return std::strcmp(args.compression_offload_arg, "none") != 0;
+}
+
+folly::io::CodecType CompressionCodecType() {
+  if (std::strcmp(args.compression_codec_arg, "lz4") == 0) {
+    return folly::io::CodecType::LZ4_FRAME;
+  }
+  if (std::strcmp(args.compression_codec_arg, "snappy") == 0) {
+    return folly::io::CodecType::SNAPPY;
+  }
+  return folly::io::CodecType::ZSTD;
+}
+
+std::unique_ptr<folly::io::Codec> GetCompressionCodec() {
+  return folly::io::getCodec(
+      CompressionCodecType(),
+      args.compression_level_given ? args.compression_level_arg
+                                   : folly::io::COMPRESSION_LEVEL_DEFAULT);
 }
 
 std::string compressPayload(const std::string& data, int result) {
   folly::StringPiece output(
       data.data(),
       std::min(args.compression_data_size_arg, args.random_data_size_arg));
-  auto codec = folly::io::getCodec(folly::io::CodecType::ZSTD);
+  if (OffloadCompression()) {
+    return ranking::CompressionOffload::local().compress(output);
+  }
+  if (StreamingCompression()) {
+    return ranking::PayloadCompressor::local().compress(output);
+  }
+  auto codec = GetCompressionCodec();
   std::string compressed = codec->compress(output);
   return std::move(compressed);
 }
 
 std::string decompressPayload(const std::string& data) {
-  auto codec = folly::io::getCodec(folly::io::CodecType::ZSTD);
+  if (OffloadCompression()) {
+    try {
+      return ranking::CompressionOffload::local().uncompress(data);
+    } catch (const std::runtime_error& e) {
+      DIE("%s", e.what());
+    }
+  }
+  if (StreamingCompression()) {
+    return ranking::PayloadCompressor::local().uncompress(data);
+  }
+  auto codec = GetCompressionCodec();
   std::string decompressed = codec->uncompress(data);
   return decompressed;
 }
 
 std::unique_ptr<folly::IOBuf> compressThrift(
     std::unique_ptr<folly::IOBuf> buf) {
-  auto codec = folly::io::getCodec(folly::io::CodecType::ZSTD);
+  if (OffloadCompression()) {
+    const auto data = buf->coalesce();
+    return folly::IOBuf::copyBuffer(
+        ranking::CompressionOffload::local().compress(folly::StringPiece(
+            reinterpret_cast<const char*>(data.data()), data.size())));
+  }
+  auto codec = GetCompressionCodec();
   auto compressed_buf = codec->compress(buf.get());
   return compressed_buf;
 }
 
 folly::IOBufQueue serializePayload(const ranking::RankingResponse& resp) {
-  folly::IOBufQueue bufq;
-  apache::thrift::CompactSerializer::serialize(resp, &bufq);
-  return std::move(bufq);
+  return ranking::PayloadSerializer::serialize(resp);
 }
 
-ranking::RankingResponse deserializePayload(const folly::IOBuf* buf) {
-  ranking::RankingResponse resp;
-  apache::thrift::CompactSerializer::deserialize(buf, resp);
-  return resp;
+// Reads back what a consumer of the response would; with --serialization=view
+// the objects are skipped in place instead of being materialized
+ranking::RankingResponseSummary deserializePayload(const folly::IOBuf* buf) {
+  return ranking::PayloadSerializer::summarize(buf);
 }
 
-void PageRankRequestHandler(
-    oldisim::NodeThread& thread,
+// Serializes a response from the configured generator: a freshly built one,
+// or a recycled one from the thread's arena with new IDs and weights.
+folly::IOBufQueue serializeGeneratedResponse(int num_objects) {
+  if (std::strcmp(args.response_generator_arg, "recycled") == 0) {
+    return serializePayload(
+        ranking::generators::recycledRankingResponse(num_objects));
+  }
+  auto resp = ranking::generators::generateRandomRankingResponse(num_objects);
+  return serializePayload(resp);
+}
+
+/** Trains a zstd dictionary on a sample of the responses the srv IO threads
+ * compress, so that small, structured responses start from shared context
+ * instead of an empty window.
+ */
+std::string TrainCompressionDictionary() {
+  const auto per_thread_num_objects =
+      args.num_objects_arg / args.srv_io_threads_arg;
+  std::vector<std::string> samples;
+  samples.reserve(args.compression_dictionary_samples_arg);
+  for (int i = 0; i < args.compression_dictionary_samples_arg; i++) {
+    auto buf = serializeGeneratedResponse(per_thread_num_objects).move();
+    samples.push_back(buf->moveToFbString().toStdString());
+  }
+  try {
+    auto dictionary = ranking::PayloadCompressor::trainDictionary(
+        samples, args.compression_dictionary_size_arg);
+    I("Trained %zu byte compression dictionary from %zu responses",
+      dictionary.size(),
+      samples.size());
+    return dictionary;
+  } catch (const std::runtime_error& e) {
+    DIE("%s", e.what());
+  }
+}
+
+/** Selects the response serialization protocol and, if asked to, times every
+ * protocol on a generated response before the server starts.
+ */
+void ConfigurePayloadSerialization() {
+  const auto protocol =
+      ranking::parseSerializationProtocol(args.serialization_arg);
+  ranking::PayloadSerializer::configure(protocol);
+  if (args.serialization_benchmark_arg <= 0) {
+    return;
+  }
+  const auto resp = ranking::generators::generateRandomRankingResponse(
+      args.num_objects_arg / args.srv_io_threads_arg);
+  const auto results = ranking::PayloadSerializer::benchmark(
+      resp, args.serialization_benchmark_arg);
+  for (auto p :
+       {ranking::SerializationProtocol::kCompact,
+        ranking::SerializationProtocol::kBinary,
+        ranking::SerializationProtocol::kView}) {
+    const auto& stats = results[static_cast<size_t>(p)];
+    I("Serialization %s: %zu bytes, encode %.1f MB/s, decode %.1f MB/s",
+      ranking::serializationProtocolName(p),
+      static_cast<size_t>(
+          stats.encodeBytes / std::max<uint64_t>(stats.encodes, 1)),
+      stats.encodeThroughputMBps(),
+      stats.decodeThroughputMBps());
+  }
+}
+
+/** Sets up the per-thread compressors used by the streaming pipeline from
+ * the command line.
+ */
+void ConfigurePayloadCompression() {
+  if (!StreamingCompression()) {
+    if (args.compression_dictionary_given) {
+      DIE("--compression_dictionary requires "
+          "--compression_pipeline=streaming");
+    }
+    return;
+  }
+  ranking::PayloadCompressorOptions options;
+  if (std::strcmp(args.compression_codec_arg, "lz4") == 0) {
+    options.codec = ranking::PayloadCodec::kLz4;
+  } else if (std::strcmp(args.compression_codec_arg, "snappy") == 0) {
+    options.codec = ranking::PayloadCodec::kSnappy;
+  }
+  options.level =
+      args.compression_level_given ? args.compression_level_arg : 0;
+  if (args.compression_dictionary_given &&
+      !folly::readFile(args.compression_dictionary_arg, options.dictionary)) {
+    DIE("Could not read compression dictionary %s",
+        args.compression_dictionary_arg);
+  }
+  if (args.compression_train_dictionary_given) {
+    if (args.compression_dictionary_given) {
+      DIE("--compression_train_dictionary and --compression_dictionary are "
+          "mutually exclusive");
+    }
+    options.dictionary = TrainCompressionDictionary();
+  }
+  try {
+    ranking::PayloadCompressor::configure(std::move(options));
+  } catch (const std::invalid_argument& e) {
+    DIE("Invalid compression options: %s", e.what());
+  }
+}
+
+/** Sets up the per-thread offload sessions and prices software compression
+ * on a generated response, for the CPU time the accelerator saves.
+ */
+void ConfigureCompressionOffload() {
+  if (!OffloadCompression()) {
+    return;
+  }
+  if (StreamingCompression()) {
+    DIE("--compression_offload and --compression_pipeline=streaming are "
+        "mutually exclusive");
+  }
+  if (args.compression_codec_given) {
+    W("--compression_codec is ignored with --compression_offload, which "
+      "always writes raw deflate");
+  }
+  if (args.compression_offload_queue_depth_arg <= 0) {
+    DIE("--compression_offload_queue_depth must be positive");
+  }
+  ranking::CompressionOffloadOptions options;
+  options.backend =
+      ranking::parseOffloadBackend(args.compression_offload_arg);
+  if (args.compression_level_given) {
+    options.level = args.compression_level_arg;
+  }
+  options.queueDepth = args.compression_offload_queue_depth_arg;
+  options.baselineSample =
+      serializeGeneratedResponse(args.num_objects_arg / args.srv_io_threads_arg)
+          .move()
+          ->moveToFbString()
+          .toStdString();
+  const auto active = ranking::CompressionOffload::configure(options);
+  if (active != options.backend) {
+    W("Could not open the %s compression accelerator, compressing in "
+      "software",
+      ranking::offloadBackendName(options.backend));
+  }
+  I("Compression offload backend: %s, %.2f ns of software CPU per byte",
+    ranking::offloadBackendName(active),
+    ranking::CompressionOffload::aggregateStats().softwareCpuNanosPerByte);
+}
+
+// Serializes a generated response and compresses the first half of it
+// segment by segment, as done on the srv IO threads. The streaming pipeline
+// feeds the segments in place into one frame on the thread's compressor; the
+// offload backend keeps several segments in flight on the accelerator.
+int compressResponseSegments(int num_objects) {
+  auto payloadiobufq = serializeGeneratedResponse(num_objects);
+  auto buf = payloadiobufq.move();
+  const auto compress_length = buf->computeChainDataLength() / 2;
+  if (OffloadCompression()) {
+    ranking::CompressionOffload::local().compressSegments(
+        *buf, compress_length);
+    return 1;
+  }
+  if (StreamingCompression()) {
+    ranking::PayloadCompressor::local().compressChain(*buf, compress_length);
+    return 1;
+  }
+  auto total_size = 0;
+  folly::IOBuf::Iterator it = buf->begin();
+  while (it != buf->end() && total_size < compress_length) {
+    const auto& b = *it;
+    auto iobuf = folly::IOBuf::copyBuffer(b.data(), b.size());
+    auto c = compressThrift(std::move(iobuf));
+    total_size += b.size();
+    ++it;
+  }
+  return 1;
+}
+
+// Returns the result cache key at the front of the query, if it has one.
+folly::Optional<uint64_t> requestKey(oldisim::QueryContext& context) {
+  if (context.payload_length < ranking::kRequestKeySize) {
+    return folly::none;
+  }
+  uint64_t key;
+  std::memcpy(&key, context.GetContiguousPayload(), sizeof(key));
+  return key;
+}
+
+// Answers the query from the result cache if it holds the query's key, so
+// the whole ranking pipeline is skipped.
+bool sendCachedResponse(
+    ranking::ResultCache* cache,
+    oldisim::QueryContext& context) {
+  if (cache == nullptr) {
+    return false;
+  }
+  auto key = requestKey(context);
+  if (!key) {
+    return false;
+  }
+  auto cached = cache->get(*key);
+  if (!cached) {
+    return false;
+  }
+  ranking::sendResponse(context, std::move(cached));
+  return true;
+}
+
+// Generates a response of num_objects objects and serializes it, then
+// reads it back.
+std::unique_ptr<folly::IOBuf> buildResponse(int num_objects) {
+  auto per_thread_num_objects = num_objects / args.srv_io_threads_arg;
+
+  // Generate a response and serialize into FBThrift
+  folly::IOBufQueue payloadiobufq;
+  if (std::strcmp(args.response_generator_arg, "recycled") == 0) {
+    payloadiobufq = serializeGeneratedResponse(per_thread_num_objects);
+  } else {
+    auto r = ranking::generators::generateRandomRankingResponse(
+        per_thread_num_objects);
+    ranking::RankingResponse resp = r; // std::move(r).get();
+    payloadiobufq = serializePayload(resp);
+  }
+  auto buf = payloadiobufq.move();
+
+  // folly::futures::sleep(std::chrono::milliseconds(2),
+  // timekeeper.get()).get();
+
+  auto resp1 = deserializePayload(buf.get());
+  return buf;
+}
+
+// Builds, serializes and round-trips a response of num_objects objects, then
+// sends it. The serialized response is cached under the query's key if the
+// thread has a result cache.
+void finishRequest(
+    const std::string& compressed,
     oldisim::QueryContext& context,
-    std::vector<ThreadData>& thread_data) {
-  auto& this_thread = thread_data[thread.get_thread_num()];
+    const ThreadData& this_thread,
+    int num_objects) {
+  auto uncompressed = decompressPayload(compressed);
+  auto buf = buildResponse(num_objects);
+  ranking::ResultCache* cache = this_thread.result_cache;
+
+  if (cache != nullptr) {
+    auto key = requestKey(context);
+    if (key) {
+      cache->put(*key, *buf);
+    }
+  }
+  ranking::sendResponse(context, std::move(buf));
+}
+
+/** With --seed, restarts the random streams of a request from a seed derived
+ * from its key, or from the thread's count of requests if it carries none:
+ * its icache buster iterations, and the PageRank windows of the num_entries
+ * score vectors from first_entry. Helper tasks derive the streams of their
+ * embedding rows and response contents from this_thread.request_seed.
+ */
+void seedRequest(
+    ThreadData& this_thread,
+    oldisim::QueryContext& context,
+    int first_entry,
+    int num_entries) {
+  if (!args.seed_given) {
+    return;
+  }
+  const auto key = requestKey(context);
+  this_thread.request_seed = key
+      ? DeriveSeed(LeafSeed(kKeyedRequestStream), *key)
+      : DeriveSeed(this_thread.seed, this_thread.unkeyed_requests++);
+  this_thread.rng.seed(this_thread.request_seed);
+  for (int i = 0; i < num_entries; i++) {
+    this_thread.page_ranker->seedRanges(
+        first_entry + i, DeriveSeed(this_thread.request_seed, i));
+  }
+}
+
+// With --seed, restarts the streams of the calling helper thread for task
+// 'task' of the request seeded with request_seed
+void seedHelperTask(uint64_t request_seed, int task) {
+  if (args.seed_given) {
+    SeedThreadRandom(DeriveSeed(request_seed, task));
+  }
+}
+
+void runICacheBuster(ThreadData& this_thread) {
   const int min_iterations = std::max(args.min_icache_iterations_arg, 0);
   const int num_iterations =
       static_cast<int>(this_thread.latency_distribution(this_thread.rng)) +
       min_iterations;
   ICacheBuster& buster = *this_thread.icache_buster;
-  search::PointerChase& chaser = *this_thread.pointer_chaser;
-
   for (int i = 0; i < num_iterations; i++) {
     buster.RunNextMethod();
   }
+}
 
-  // auto start = std::chrono::steady_clock::now();
-  auto per_thread_subset = args.graph_subset_arg / args.cpu_threads_arg;
+// Light ranking: a short PageRank over a small subset on the server thread,
+// answered with a small generated response.
+void LightRankRequestHandler(
+    oldisim::NodeThread& thread,
+    oldisim::QueryContext& context,
+    std::vector<ThreadData>& thread_data) {
+  auto& this_thread = thread_data[thread.get_thread_num()];
+  ranking::PerfCounterScope perf(
+      this_thread.perf_stats, ranking::kLightRankRequestType);
+  seedRequest(this_thread, context, this_thread.light_rank_slot, 1);
 
-  std::vector<folly::Future<int>> futures;
-  for (int i = 0; i < args.cpu_threads_arg; i++) {
-    auto f = folly::via(
+  this_thread.page_ranker->rank(
+      this_thread.light_rank_slot,
+      args.light_rank_iters_arg,
+      kPageRankThreshold,
+      1,
+      args.light_rank_subset_arg);
+
+  auto buf = serializeGeneratedResponse(args.light_rank_num_objects_arg).move();
+  ranking::sendResponse(context, std::move(buf));
+}
+
+// Cache probe: a short pointer chase answered with a slice of random data.
+void CacheProbeRequestHandler(
+    oldisim::NodeThread& thread,
+    oldisim::QueryContext& context,
+    std::vector<ThreadData>& thread_data) {
+  auto& this_thread = thread_data[thread.get_thread_num()];
+  ranking::PerfCounterScope perf(
+      this_thread.perf_stats, ranking::kCacheProbeRequestType);
+
+  this_thread.pointer_chaser->Chase(args.cache_probe_chase_iterations_arg);
+
+  context.SendResponse(
+      this_thread.random_string.data(),
+      std::min(
+          args.cache_probe_response_size_arg, args.random_data_size_arg));
+}
+
+// Distributed PageRank: one superstep of a query over this leaf's partition
+// of the graph, run on the server thread. The reply carries the deltas for
+// the other leafs, which the parent passes on with the next superstep.
+void DistributedRankRequestHandler(
+    oldisim::NodeThread& thread,
+    oldisim::QueryContext& context,
+    std::vector<ThreadData>& thread_data) {
+  auto& this_thread = thread_data[thread.get_thread_num()];
+  ranking::PerfCounterScope perf(
+      this_thread.perf_stats, ranking::kDistributedRankRequestType);
+
+  try {
+    this_thread.distributed_rank->superstep(
+        static_cast<const uint8_t*>(context.GetContiguousPayload()),
+        context.payload_length,
+        this_thread.distributed_reply);
+  } catch (const std::exception& e) {
+    if (!this_thread.warned_distributed) {
+      W("Rejecting a distributed PageRank superstep: %s", e.what());
+      this_thread.warned_distributed = true;
+    }
+    context.SendRejection(oldisim::ResponseStatus::kRejected);
+    return;
+  }
+  context.SendResponse(
+      this_thread.distributed_reply.data(),
+      this_thread.distributed_reply.size());
+}
+
+// Picks up the options published at /config since the thread last looked.
+// Only called on the server thread, before it hands the request on.
+void refreshRequestParams(ThreadData& this_thread) {
+  this_thread.live_params->refresh(
+      this_thread.params_version, this_thread.params);
+}
+
+/** Applies one batch of edge updates to the server thread's incremental
+ * ranker on the CPU pool and returns the frontier rounds it took.
+ */
+folly::Future<int> rankIncremental(ThreadData& this_thread, int max_iters) {
+  return folly::via(this_thread.cpuThreadPool.get(), [&this_thread,
+                                                      max_iters]() {
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kPageRank);
+    const auto stats = this_thread.incremental_ranker->update(
+        args.graph_update_batch_arg, max_iters);
+    this_thread.incremental_totals->record(stats);
+    return stats.iterations;
+  });
+}
+
+/** Pools the sparse features of num_queries requests on the CPU pool,
+ * splitting the embedding tables evenly over up to cpu_threads tasks that
+ * each look up their tables for every request. With --seed the rows come
+ * from streams of request_seed. Completes at once without
+ * --embedding_tables.
+ */
+folly::Future<folly::Unit> lookupEmbeddingsAsync(
+    ThreadData& this_thread,
+    uint64_t request_seed,
+    int num_queries = 1) {
+  if (!this_thread.embedding_tables) {
+    return folly::makeFuture();
+  }
+  const auto& options = this_thread.embedding_tables->options();
+  const int num_tasks = std::min(args.cpu_threads_arg, options.num_tables);
+  const size_t query_size =
+      static_cast<size_t>(options.num_tables) * options.dimension;
+  auto pooled = std::make_shared<std::vector<float>>(query_size * num_queries);
+  std::vector<folly::Future<folly::Unit>> futures;
+  for (int i = 0; i < num_tasks; i++) {
+    const int begin = options.num_tables * i / num_tasks;
+    const int end = options.num_tables * (i + 1) / num_tasks;
+    futures.push_back(folly::via(
         this_thread.cpuThreadPool.get(),
-        [i, &this_thread, per_thread_subset]() {
-          return this_thread.page_ranker->rank(
-              i,
-              args.graph_max_iters_arg,
-              kPageRankThreshold,
-              args.rank_trials_per_thread_arg,
-              per_thread_subset);
-        });
-    futures.push_back(std::move(f));
+        [&this_thread,
+         pooled,
+         begin,
+         end,
+         num_queries,
+         query_size,
+         request_seed]() {
+          ranking::PerfCounterScope perf(
+              this_thread.perf_stats,
+              ranking::kPageRankRequestType,
+              ranking::PipelineStage::kEmbedding);
+          thread_local std::mt19937_64 thread_rng(std::random_device{}());
+          std::mt19937_64 seeded_rng;
+          if (args.seed_given) {
+            seeded_rng.seed(DeriveSeed(request_seed, begin));
+          }
+          auto& rng = args.seed_given ? seeded_rng : thread_rng;
+          const auto& tables = *this_thread.embedding_tables;
+          for (int q = 0; q < num_queries; q++) {
+            tables.pool(
+                begin,
+                end,
+                rng,
+                pooled->data() + query_size * q +
+                    static_cast<size_t>(begin) * tables.options().dimension);
+          }
+        }));
+  }
+  return folly::collect(futures)
+      .via(&folly::InlineExecutor::instance())
+      .thenValue([pooled](std::vector<folly::Unit> _) {});
+}
+
+// Ends stage on the timer and in the flight recorder trace of the queries it
+// ran for.
+void markStage(
+    ranking::StageTimer& timer,
+    ranking::PipelineStage stage,
+    oldisim::QueryContext& context) {
+  timer.mark(stage);
+  context.MarkStage(static_cast<uint8_t>(stage));
+}
+
+void markStage(
+    ranking::StageTimer& timer,
+    ranking::PipelineStage stage,
+    const QueryBatch& batch) {
+  timer.mark(stage);
+  for (const auto& query : batch) {
+    query->MarkStage(static_cast<uint8_t>(stage));
   }
-  auto fs = folly::collect(futures).get();
-  int result = std::accumulate(fs.begin(), fs.end(), 0);
+}
+
+void PageRankRequestHandler(
+    oldisim::NodeThread& thread,
+    oldisim::QueryContext& context,
+    std::vector<ThreadData>& thread_data) {
+  auto& this_thread = thread_data[thread.get_thread_num()];
+  search::PointerChase& chaser = *this_thread.pointer_chaser;
+
+  if (sendCachedResponse(this_thread.result_cache, context)) {
+    return;
+  }
+  refreshRequestParams(this_thread);
+  seedRequest(
+      this_thread,
+      context,
+      0,
+      args.graph_split_rank_given ? 1 : args.cpu_threads_arg);
+
+  ranking::StageTimer timer;
+  {
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kICacheBuster);
+    runICacheBuster(this_thread);
+  }
+  markStage(timer, ranking::PipelineStage::kICacheBuster, context);
+
+  // auto start = std::chrono::steady_clock::now();
+  int result = 0;
+  if (this_thread.incremental_ranker) {
+    result =
+        rankIncremental(this_thread, this_thread.params.graph_max_iters).get();
+  } else if (args.graph_split_rank_given) {
+    // Counts only the coordinating thread; the splits are not instrumented
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kPageRank);
+    result = this_thread.page_ranker->rankOnExecutor(
+        this_thread.cpuThreadPool.get(),
+        args.cpu_threads_arg,
+        0,
+        this_thread.params.graph_max_iters,
+        kPageRankThreshold,
+        args.rank_trials_per_thread_arg,
+        this_thread.params.graph_subset);
+  } else {
+    auto per_thread_subset =
+        this_thread.params.graph_subset / args.cpu_threads_arg;
+
+    std::vector<folly::Future<int>> futures;
+    for (int i = 0; i < args.cpu_threads_arg; i++) {
+      auto f = folly::via(
+          this_thread.cpuThreadPool.get(),
+          [i, &this_thread, per_thread_subset]() {
+            ranking::PerfCounterScope perf(
+                this_thread.perf_stats,
+                ranking::kPageRankRequestType,
+                ranking::PipelineStage::kPageRank);
+            return this_thread.page_ranker->rank(
+                i,
+                this_thread.params.graph_max_iters,
+                kPageRankThreshold,
+                args.rank_trials_per_thread_arg,
+                per_thread_subset);
+          });
+      futures.push_back(std::move(f));
+    }
+    auto fs = folly::collect(futures).get();
+    result = std::accumulate(fs.begin(), fs.end(), 0);
+  }
+  markStage(timer, ranking::PipelineStage::kPageRank, context);
+  lookupEmbeddingsAsync(this_thread, this_thread.request_seed).get();
+  markStage(timer, ranking::PipelineStage::kEmbedding, context);
   // auto end = std::chrono::steady_clock::now();
   // auto duration =
   //     std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
   //         .count();
   // std::cout << duration
   //           << '\n';
-  auto timekeeper = this_thread.timekeeperPool->getTimekeeper();
-  auto s = folly::futures::sleep(
-               std::chrono::milliseconds(args.io_time_ms_arg), timekeeper.get())
-               .via(this_thread.ioThreadPool.get())
-               .thenValue([&](auto&& _) {
-                 // auto start = std::chrono::steady_clock::now();
-                 // chaser.Chase(args.io_chase_iterations_arg);
-                 // auto end = std::chrono::steady_clock::now();
-                 // std::cout <<
-                 // std::chrono::duration_cast<std::chrono::milliseconds>(
-                 //                  end - start)
-                 //                  .count()
-                 //           << '\n';
-                 return result + 1;
-               });
-  result = std::move(s).get();
-
-  auto compressed = compressPayload(this_thread.random_string, result);
-
-  auto per_thread_num_objects = args.num_objects_arg / args.srv_io_threads_arg;
+  if (this_thread.timekeeperPool) {
+    auto timekeeper = this_thread.timekeeperPool->getTimekeeper();
+    auto s =
+        folly::futures::sleep(
+            std::chrono::milliseconds(this_thread.params.io_time_ms),
+            timekeeper.get())
+            .via(this_thread.ioThreadPool.get())
+            .thenValue([&](auto&& _) {
+              // auto start = std::chrono::steady_clock::now();
+              // chaser.Chase(args.io_chase_iterations_arg);
+              // auto end = std::chrono::steady_clock::now();
+              // std::cout <<
+              // std::chrono::duration_cast<std::chrono::milliseconds>(
+              //                  end - start)
+              //                  .count()
+              //           << '\n';
+              return result + 1;
+            });
+    result = std::move(s).get();
+  } else {
+    // This handler holds the event loop until it responds, so a timer on the
+    // loop could not fire. Sleeping in place is the same wait without the
+    // hops through a timekeeper and the IO pool.
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(this_thread.params.io_time_ms));
+    result += 1;
+  }
+  markStage(timer, ranking::PipelineStage::kIoWait, context);
+
+  std::string compressed;
+  {
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kCompression);
+    compressed = compressPayload(this_thread.random_string, result);
+  }
+
+  auto per_thread_num_objects =
+      this_thread.params.num_objects / args.srv_io_threads_arg;
 
   std::vector<folly::Future<int>> compressionFutures;
   for (int i = 0; i < args.srv_io_threads_arg; i++) {
-    auto f = folly::via(this_thread.srvIOThreadPool.get(), [&]() {
-      auto resp = ranking::generators::generateRandomRankingResponse(
-          per_thread_num_objects);
-      auto payloadiobufq = serializePayload(resp);
-      auto buf = payloadiobufq.move();
-      const auto compress_length = buf->computeChainDataLength() / 2;
-      auto total_size = 0;
-      folly::IOBuf::Iterator it = buf->begin();
-      while (it != buf->end() && total_size < compress_length) {
-        const auto& b = *it;
-        auto iobuf = folly::IOBuf::copyBuffer(b.data(), b.size());
-        auto c = compressThrift(std::move(iobuf));
-        total_size += b.size();
-        ++it;
-      }
-      return 1;
+    auto f = folly::via(this_thread.srvIOThreadPool.get(), [&, i]() {
+      ranking::PerfCounterScope perf(
+          this_thread.perf_stats,
+          ranking::kPageRankRequestType,
+          ranking::PipelineStage::kCompression);
+      seedHelperTask(this_thread.request_seed, i);
+      return compressResponseSegments(per_thread_num_objects);
     });
     compressionFutures.push_back(std::move(f));
   }
   auto cfs = folly::collect(compressionFutures).get();
   int cResult = std::accumulate(cfs.begin(), cfs.end(), 0);
+  markStage(timer, ranking::PipelineStage::kCompression, context);
 
   /*
   auto r = folly::via(this_thread.srvCPUThreadPool.get(), [&]() {
@@ -239,10 +1495,14 @@ void PageRankRequestHandler(
   */
 
   auto per_thread_chase_iterations =
-      args.chase_iterations_arg / args.srv_threads_arg;
+      this_thread.params.chase_iterations / args.srv_threads_arg;
   std::vector<folly::Future<int>> chaseFutures;
   for (int i = 0; i < args.srv_threads_arg; i++) {
     auto f = folly::via(this_thread.srvCPUThreadPool.get(), [&]() {
+      ranking::PerfCounterScope perf(
+          this_thread.perf_stats,
+          ranking::kPageRankRequestType,
+          ranking::PipelineStage::kPointerChase);
       chaser.Chase(per_thread_chase_iterations);
       return 1;
     });
@@ -250,23 +1510,736 @@ void PageRankRequestHandler(
   }
   auto chaseFs = folly::collect(chaseFutures).get();
   int chaseResult = std::accumulate(chaseFs.begin(), chaseFs.end(), 0);
+  markStage(timer, ranking::PipelineStage::kPointerChase, context);
 
-  // Generate a response
-  auto r = ranking::generators::generateRandomRankingResponse(
-      per_thread_num_objects);
-  ranking::RankingResponse resp = r; // std::move(r).get();
+  {
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kSerialize);
+    finishRequest(
+        compressed, context, this_thread, this_thread.params.num_objects);
+  }
+  timer.mark(ranking::PipelineStage::kSerialize);
+  if (this_thread.stage_stats) {
+    this_thread.stage_stats->record(timer);
+  }
+}
 
-  // Serialize into FBThrift
-  auto payloadiobufq = serializePayload(resp);
-  auto buf = payloadiobufq.move();
+/** Runs PageRank for one asynchronous request on score vector slot 'slot'.
+ * Takes the options of the batch, since the server thread may refresh its
+ * own while the helper pools rank.
+ */
+folly::Future<int> rankAsync(
+    ThreadData& this_thread,
+    int slot,
+    const RequestParams& params) {
+  if (this_thread.incremental_ranker) {
+    return rankIncremental(this_thread, params.graph_max_iters);
+  }
+  if (args.graph_split_rank_given) {
+    // rankOnExecutor waits on its splits, so coordinate from a srv thread
+    // rather than from the CPU pool the splits run on
+    return folly::via(
+        this_thread.srvCPUThreadPool.get(), [&this_thread, slot, params]() {
+          ranking::PerfCounterScope perf(
+              this_thread.perf_stats,
+              ranking::kPageRankRequestType,
+              ranking::PipelineStage::kPageRank);
+          return this_thread.page_ranker->rankOnExecutor(
+              this_thread.cpuThreadPool.get(),
+              args.cpu_threads_arg,
+              slot,
+              params.graph_max_iters,
+              kPageRankThreshold,
+              args.rank_trials_per_thread_arg,
+              params.graph_subset);
+        });
+  }
 
-  // folly::futures::sleep(std::chrono::milliseconds(2),
-  // timekeeper.get()).get();
+  auto per_thread_subset = params.graph_subset / args.cpu_threads_arg;
+  const int max_iters = params.graph_max_iters;
+  std::vector<folly::Future<int>> futures;
+  for (int i = 0; i < args.cpu_threads_arg; i++) {
+    const int entry = slot * args.cpu_threads_arg + i;
+    futures.push_back(folly::via(
+        this_thread.cpuThreadPool.get(),
+        [entry, &this_thread, per_thread_subset, max_iters]() {
+          ranking::PerfCounterScope perf(
+              this_thread.perf_stats,
+              ranking::kPageRankRequestType,
+              ranking::PipelineStage::kPageRank);
+          return this_thread.page_ranker->rank(
+              entry,
+              max_iters,
+              kPageRankThreshold,
+              args.rank_trials_per_thread_arg,
+              per_thread_subset);
+        }));
+  }
+  return folly::collect(futures)
+      .via(this_thread.cpuThreadPool.get())
+      .thenValue([](std::vector<int> fs) {
+        return std::accumulate(fs.begin(), fs.end(), 0);
+      });
+}
 
-  auto uncompressed = decompressPayload(compressed);
-  auto resp1 = deserializePayload(buf.get());
+void releaseRankSlot(
+    oldisim::NodeThread& thread,
+    ThreadData& this_thread,
+    int slot);
+
+/** Emulated I/O of an asynchronous request. By default it is a timer on the
+ * server thread's event loop, which completes there and hands straight on to
+ * the next stage; with --io_timer=timekeeper it round-trips through a
+ * timekeeper thread and the IO pool.
+ */
+folly::Future<folly::Unit> ioWaitAsync(
+    const oldisim::NodeThread& thread,
+    ThreadData& this_thread,
+    int io_time_ms) {
+  const auto duration = std::chrono::milliseconds(io_time_ms);
+  if (this_thread.timekeeperPool) {
+    auto timekeeper = this_thread.timekeeperPool->getTimekeeper();
+    return folly::futures::sleep(duration, timekeeper.get())
+        .via(this_thread.ioThreadPool.get());
+  }
+  return ranking::eventLoopSleep(thread, duration);
+}
+
+/** Runs the same pipeline as PageRankRequestHandler as a chain of
+ * continuations, so the server thread is free while the batch waits on the
+ * helper pools and the emulated I/O. The icache buster, PageRank, I/O wait
+ * and payload compression run once for the whole batch; the embedding
+ * lookups, response segments and chases of every query run in the same
+ * helper tasks rather than in tasks of their own. The final stage hops back
+ * onto the server thread, which owns the connections and the stats, to
+ * respond to each query.
+ */
+void startBatchAsync(
+    oldisim::NodeThread& thread,
+    std::shared_ptr<QueryBatch> batch,
+    ThreadData& this_thread,
+    int slot) {
+  const int num_queries = batch->size();
+  // Continuations read the options of the batch, not the thread's
+  refreshRequestParams(this_thread);
+  const RequestParams params = this_thread.params;
+  rank_batches.fetch_add(1, std::memory_order_relaxed);
+  rank_batched_queries.fetch_add(num_queries, std::memory_order_relaxed);
+  // The pipeline runs once for the batch, so it takes the streams of its
+  // first query
+  if (args.graph_split_rank_given) {
+    seedRequest(this_thread, *batch->front(), slot, 1);
+  } else {
+    seedRequest(
+        this_thread,
+        *batch->front(),
+        slot * args.cpu_threads_arg,
+        args.cpu_threads_arg);
+  }
+  const uint64_t request_seed = this_thread.request_seed;
+  // Continuations run one after another, so they can share the timer
+  auto timer = std::make_shared<ranking::StageTimer>();
+  {
+    ranking::PerfCounterScope perf(
+        this_thread.perf_stats,
+        ranking::kPageRankRequestType,
+        ranking::PipelineStage::kICacheBuster);
+    runICacheBuster(this_thread);
+  }
+  markStage(*timer, ranking::PipelineStage::kICacheBuster, *batch);
+
+  // Continuations run inline on whichever thread completes the previous
+  // stage, so the I/O wait goes straight from the CPU pool to the event loop
+  // timer and on to the next stage
+  rankAsync(this_thread, slot, params)
+      .via(&folly::InlineExecutor::instance())
+      .thenValue([&this_thread, batch, timer, num_queries, request_seed](
+                     int result) {
+        markStage(*timer, ranking::PipelineStage::kPageRank, *batch);
+        return lookupEmbeddingsAsync(this_thread, request_seed, num_queries)
+            .thenValue([result](auto&& _) { return result; });
+      })
+      .thenValue([&thread, &this_thread, batch, timer, params](int result) {
+        markStage(*timer, ranking::PipelineStage::kEmbedding, *batch);
+        return ioWaitAsync(thread, this_thread, params.io_time_ms)
+            .thenValue([result](auto&& _) { return result + 1; });
+      })
+      .thenValue([&this_thread,
+                  batch,
+                  timer,
+                  num_queries,
+                  params,
+                  request_seed](int result) {
+        markStage(*timer, ranking::PipelineStage::kIoWait, *batch);
+        auto per_thread_num_objects =
+            params.num_objects / args.srv_io_threads_arg;
+        std::vector<folly::Future<int>> compressionFutures;
+        for (int i = 0; i < args.srv_io_threads_arg; i++) {
+          compressionFutures.push_back(folly::via(
+              this_thread.srvIOThreadPool.get(),
+              [&this_thread,
+               per_thread_num_objects,
+               num_queries,
+               request_seed,
+               i]() {
+                ranking::PerfCounterScope perf(
+                    this_thread.perf_stats,
+                    ranking::kPageRankRequestType,
+                    ranking::PipelineStage::kCompression);
+                seedHelperTask(request_seed, i);
+                int segments = 0;
+                for (int q = 0; q < num_queries; q++) {
+                  segments += compressResponseSegments(per_thread_num_objects);
+                }
+                return segments;
+              }));
+        }
+        return folly::collect(compressionFutures)
+            .via(this_thread.srvCPUThreadPool.get())
+            .thenValue([result](std::vector<int> _) { return result; });
+      })
+      .thenValue([&this_thread, batch, timer, num_queries, params](
+                     int result) {
+        markStage(*timer, ranking::PipelineStage::kCompression, *batch);
+        auto per_thread_chase_iterations =
+            params.chase_iterations / args.srv_threads_arg;
+        std::vector<folly::Future<int>> chaseFutures;
+        for (int i = 0; i < args.srv_threads_arg; i++) {
+          chaseFutures.push_back(folly::via(
+              this_thread.srvCPUThreadPool.get(),
+              [&this_thread, per_thread_chase_iterations, num_queries]() {
+                ranking::PerfCounterScope perf(
+                    this_thread.perf_stats,
+                    ranking::kPageRankRequestType,
+                    ranking::PipelineStage::kPointerChase);
+                this_thread.pointer_chaser->Chase(
+                    per_thread_chase_iterations * num_queries);
+                return 1;
+              }));
+        }
+        return folly::collect(chaseFutures)
+            .via(this_thread.srvCPUThreadPool.get())
+            .thenValue([result](std::vector<int> _) { return result; });
+      })
+      .thenValue([&thread, batch, &this_thread, slot, timer, params](
+                     int result) {
+        markStage(*timer, ranking::PipelineStage::kPointerChase, *batch);
+        const int num_objects = params.num_objects;
+        thread.RunInLoop([&thread,
+                          batch,
+                          &this_thread,
+                          slot,
+                          result,
+                          timer,
+                          num_objects]() {
+          std::string compressed;
+          {
+            ranking::PerfCounterScope perf(
+                this_thread.perf_stats,
+                ranking::kPageRankRequestType,
+                ranking::PipelineStage::kCompression);
+            compressed = compressPayload(this_thread.random_string, result);
+          }
+          markStage(*timer, ranking::PipelineStage::kCompression, *batch);
+          {
+            ranking::PerfCounterScope perf(
+                this_thread.perf_stats,
+                ranking::kPageRankRequestType,
+                ranking::PipelineStage::kSerialize);
+            for (const auto& query : *batch) {
+              finishRequest(compressed, *query, this_thread, num_objects);
+            }
+          }
+          timer->mark(ranking::PipelineStage::kSerialize);
+          if (this_thread.stage_stats) {
+            // Every query of the batch went through every stage
+            for (size_t i = 0; i < batch->size(); i++) {
+              this_thread.stage_stats->record(*timer);
+            }
+          }
+          releaseRankSlot(thread, this_thread, slot);
+        });
+      })
+      .thenError([](const folly::exception_wrapper& ew) {
+        DIE("Asynchronous request failed: %s", ew.what().c_str());
+      });
+}
+
+void releaseRankSlot(
+    oldisim::NodeThread& thread,
+    ThreadData& this_thread,
+    int slot) {
+  if (this_thread.pending_batches.empty()) {
+    this_thread.free_rank_slots.push_back(slot);
+    return;
+  }
+  auto next = std::move(this_thread.pending_batches.front());
+  this_thread.pending_batches.pop_front();
+  startBatchAsync(thread, std::move(next), this_thread, slot);
+}
+
+/** Closes the open batch to new requests and runs it, or queues it until a
+ * rank slot frees up.
+ */
+void sealBatch(oldisim::NodeThread& thread, ThreadData& this_thread) {
+  auto batch = std::move(this_thread.open_batch);
+  this_thread.open_batch.reset();
+  this_thread.sealed_batches++;
+  if (this_thread.free_rank_slots.empty()) {
+    this_thread.pending_batches.push_back(std::move(batch));
+    return;
+  }
+  const int slot = this_thread.free_rank_slots.back();
+  this_thread.free_rank_slots.pop_back();
+  startBatchAsync(thread, std::move(batch), this_thread, slot);
+}
+
+void PageRankRequestHandlerAsync(
+    oldisim::NodeThread& thread,
+    oldisim::QueryContext& context,
+    std::vector<ThreadData>& thread_data) {
+  auto& this_thread = thread_data[thread.get_thread_num()];
+  // Hits are answered right away and take no rank slot
+  if (sendCachedResponse(this_thread.result_cache, context)) {
+    return;
+  }
+  // The context only lives for the duration of this call, keep a copy
+  if (!this_thread.open_batch) {
+    this_thread.open_batch = std::make_shared<QueryBatch>();
+  }
+  this_thread.open_batch->push_back(
+      std::make_shared<oldisim::QueryContext>(std::move(context)));
+  if (this_thread.open_batch->size() >=
+      static_cast<size_t>(args.batch_size_arg)) {
+    sealBatch(thread, this_thread);
+    return;
+  }
+  if (this_thread.open_batch->size() == 1) {
+    // Run whatever has arrived once the first request has waited out the
+    // window, unless the batch filled up and was sealed before
+    const uint64_t batch_number = this_thread.sealed_batches;
+    ranking::eventLoopSleep(
+        thread, std::chrono::microseconds(args.batch_window_us_arg))
+        .thenValue([&thread, &this_thread, batch_number](auto&& _) {
+          if (this_thread.sealed_batches == batch_number) {
+            sealBatch(thread, this_thread);
+          }
+        });
+  }
+}
+
+/** Budget of stage in profile, or null if the profile leaves it out. */
+const ranking::StageBudget* StageBudgetOf(
+    const ranking::CalibrationProfile& profile,
+    ranking::PipelineStage stage) {
+  auto it = profile.stages.find(stage);
+  return it == profile.stages.end() ? nullptr : &it->second;
+}
+
+/** Sizes the working sets of the stages that have a byte budget in the
+ * profile, and sets the I/O wait to its off-CPU budget. Runs before the
+ * graph parameters are set up, since it may change --graph_scale.
+ */
+void ApplyWorkingSetBudgets(const ranking::CalibrationProfile& profile) {
+  using ranking::PipelineStage;
+  for (const auto& entry : profile.stages) {
+    const auto& budget = entry.second;
+    if (budget.bytes <= 0) {
+      continue;
+    }
+    switch (entry.first) {
+      case PipelineStage::kPageRank: {
+        // Out- and in-neighbor lists plus their offsets
+        const double node_bytes = 8.0 * args.graph_degree_arg + 16;
+        args.graph_scale_arg = std::max(
+            1,
+            static_cast<int>(
+                std::lround(std::log2(budget.bytes / node_bytes))));
+        break;
+      }
+      case PipelineStage::kEmbedding: {
+        if (args.embedding_tables_arg <= 0) {
+          W("Ignoring the embedding byte budget without --embedding_tables");
+          break;
+        }
+        const bool int8 =
+            std::strcmp(args.embedding_precision_arg, "int8") == 0;
+        const double row_bytes = int8
+            ? (args.embedding_dim_arg + 3) / 4 * 4 + 2 * sizeof(float)
+            : args.embedding_dim_arg * sizeof(float);
+        args.embedding_rows_arg = std::max<int64_t>(
+            1, budget.bytes / (row_bytes * args.embedding_tables_arg));
+        break;
+      }
+      case PipelineStage::kPointerChase:
+        args.chase_elements_arg =
+            std::max<int64_t>(1, budget.bytes / sizeof(uint64_t));
+        break;
+      default:
+        W("Ignoring the byte budget of %s, which is sized by its CPU budget",
+          ranking::pipelineStageName(entry.first));
+        break;
+    }
+  }
+  if (const auto* io = StageBudgetOf(profile, PipelineStage::kIoWait)) {
+    if (io->offCpuUs > 0) {
+      args.io_time_ms_arg = std::lround(io->offCpuUs / 1000);
+    }
+  }
+}
+
+/** Scales the dwarf knobs so that a request spends the CPU budgets of the
+ * profile in each stage on this machine, by timing the dwarfs on the calling
+ * thread. A stage split over several helper tasks costs the same CPU time
+ * in total as one task doing all of its work, which is what is timed.
+ * Stages are calibrated in pipeline order except that serialization goes
+ * before compression: the response segments compressed depend on
+ * --num_objects. Runs before any server thread starts, since it rewrites
+ * args. A graph built for PageRank is handed to graph_registry for the
+ * server threads when they share one.
+ */
+std::vector<ranking::StageCalibration> CalibrateStages(
+    const ranking::CalibrationProfile& profile,
+    ranking::dwarfs::PageRankParams& params,
+    SharedGraphRegistry& graph_registry,
+    SharedCompressedRegistry& compressed_registry,
+    folly::Executor* pool,
+    int pool_threads) {
+  using ranking::PipelineStage;
+  std::vector<ranking::StageCalibration> results;
+  auto calibrate = [&](PipelineStage stage,
+                       const ranking::CalibrationKnob& knob,
+                       int64_t value,
+                       double bytes) {
+    const double target = StageBudgetOf(profile, stage)->cpuUs;
+    double achieved = 0;
+    value = ranking::calibrateKnob(knob, value, target, &achieved);
+    results.push_back(
+        ranking::StageCalibration{
+            stage, knob.name, value, target, achieved, bytes});
+    return value;
+  };
+  auto has_cpu_budget = [&](PipelineStage stage) {
+    const auto* budget = StageBudgetOf(profile, stage);
+    return budget != nullptr && budget->cpuUs > 0;
+  };
+  const uint64_t seed = LeafSeed(kCalibrationStream);
+
+  if (has_cpu_budget(PipelineStage::kICacheBuster)) {
+    // The knob sets the methods run per request on average, most of which
+    // come from the gamma distribution
+    ICacheBuster buster(ICacheOptions(seed));
+    const int64_t mean_iterations =
+        kICacheIterationsAlpha * kICacheIterationsBeta;
+    const ranking::CalibrationKnob knob{
+        "min_icache_iterations", 1, std::numeric_limits<int>::max(),
+        [&buster](int64_t iterations) {
+          for (int64_t i = 0; i < iterations; i++) {
+            buster.RunNextMethod();
+          }
+        }};
+    const int64_t iterations = calibrate(
+        PipelineStage::kICacheBuster,
+        knob,
+        mean_iterations + args.min_icache_iterations_arg,
+        0);
+    if (iterations < mean_iterations) {
+      W("The icache_buster budget is below the %lld methods a request runs "
+        "on average with --min_icache_iterations=0",
+        static_cast<long long>(mean_iterations));
+    }
+    args.min_icache_iterations_arg =
+        std::max<int64_t>(iterations - mean_iterations, 0);
+    results.back().value = args.min_icache_iterations_arg;
+  }
+
+  if (has_cpu_budget(PipelineStage::kPageRank)) {
+    if (args.graph_incremental_given) {
+      W("Not calibrating pagerank, --graph_incremental does not rank subsets");
+    } else {
+      auto graph = MakeGraph(params, pool, pool_threads);
+      // Neighbors compressed for a graph nobody keeps must not stay in the
+      // shared registry, whose keys are graph addresses
+      SharedCompressedRegistry calibration_registry;
+      auto* registry = &calibration_registry;
+      if (std::strcmp(args.graph_sharing_arg, "process") == 0) {
+        graph = graph_registry.get(0, [&graph]() { return graph; });
+        registry = &compressed_registry;
+      }
+      auto ranker = MakePageRanker(graph, 1, *registry);
+      if (args.seed_given) {
+        ranker->seedRanges(0, seed);
+      }
+      const ranking::CalibrationKnob knob{
+          "graph_subset", args.cpu_threads_arg, graph->num_nodes(),
+          [&ranker](int64_t subset) {
+            ranker->rank(
+                0,
+                args.graph_max_iters_arg,
+                kPageRankThreshold,
+                args.rank_trials_per_thread_arg,
+                subset);
+          }};
+      const int64_t subset = args.graph_subset_arg > 0
+          ? args.graph_subset_arg
+          : graph->num_nodes();
+      args.graph_subset_arg = calibrate(
+          PipelineStage::kPageRank,
+          knob,
+          subset,
+          StageBudgetOf(profile, PipelineStage::kPageRank)->bytes);
+    }
+  }
+
+  if (has_cpu_budget(PipelineStage::kEmbedding)) {
+    if (args.embedding_tables_arg <= 0) {
+      W("Not calibrating embedding without --embedding_tables");
+    } else {
+      // Tables that pool a single row per call, called once per row
+      auto options = EmbeddingOptions();
+      options.pooling_factor = 1;
+      const auto* kernels =
+          ranking::dwarfs::findEmbeddingPoolingKernels(args.embedding_simd_arg);
+      if (kernels == nullptr) {
+        DIE("Embedding pooling kernels '%s' are not supported on this CPU",
+            args.embedding_simd_arg);
+      }
+      std::unique_ptr<ranking::dwarfs::EmbeddingTables> tables;
+      try {
+        tables = std::make_unique<ranking::dwarfs::EmbeddingTables>(
+            options, kernels);
+      } catch (const std::bad_alloc&) {
+        DIE("Could not allocate the embedding tables");
+      }
+      std::mt19937_64 rng(seed);
+      std::vector<float> pooled(
+          static_cast<size_t>(options.num_tables) * options.dimension);
+      const ranking::CalibrationKnob knob{
+          "embedding_pooling_factor", 1, options.rows_per_table,
+          [&](int64_t rows) {
+            for (int64_t i = 0; i < rows; i++) {
+              tables->pool(0, options.num_tables, rng, pooled.data());
+            }
+          }};
+      args.embedding_pooling_factor_arg = calibrate(
+          PipelineStage::kEmbedding,
+          knob,
+          args.embedding_pooling_factor_arg,
+          StageBudgetOf(profile, PipelineStage::kEmbedding)->bytes);
+    }
+  }
+
+  if (has_cpu_budget(PipelineStage::kPointerChase)) {
+    search::PointerChase chaser(ChaseOptions(CurrentNumaNode()));
+    const ranking::CalibrationKnob knob{
+        "chase_iterations", args.srv_threads_arg,
+        std::numeric_limits<int>::max(),
+        [&chaser](int64_t iterations) { chaser.Chase(iterations); }};
+    args.chase_iterations_arg = calibrate(
+        PipelineStage::kPointerChase,
+        knob,
+        args.chase_iterations_arg,
+        StageBudgetOf(profile, PipelineStage::kPointerChase)->bytes);
+  }
 
-  context.SendResponse(buf->data(), buf->length());
+  if (has_cpu_budget(PipelineStage::kSerialize)) {
+    const ranking::CalibrationKnob knob{
+        "num_objects", args.srv_io_threads_arg,
+        std::numeric_limits<int>::max(),
+        [](int64_t num_objects) { buildResponse(num_objects); }};
+    args.num_objects_arg =
+        calibrate(PipelineStage::kSerialize, knob, args.num_objects_arg, 0);
+  }
+
+  if (has_cpu_budget(PipelineStage::kCompression)) {
+    // The payload is compressed on the server thread and the response
+    // segments on the srv IO threads
+    std::string data;
+    const ranking::CalibrationKnob knob{
+        "compression_data_size", 1, std::numeric_limits<int>::max() / 2,
+        [&data](int64_t bytes) {
+          if (data.size() < static_cast<size_t>(bytes)) {
+            data = RandomString(bytes);
+          }
+          args.compression_data_size_arg = bytes;
+          args.random_data_size_arg = data.size();
+          compressPayload(data, 0);
+          for (int i = 0; i < args.srv_io_threads_arg; i++) {
+            compressResponseSegments(
+                args.num_objects_arg / args.srv_io_threads_arg);
+          }
+        }};
+    const int random_data_size = args.random_data_size_arg;
+    const int compression_data_size = args.compression_data_size_arg;
+    args.compression_data_size_arg = calibrate(
+        PipelineStage::kCompression, knob, compression_data_size, 0);
+    args.random_data_size_arg =
+        std::max(random_data_size, args.compression_data_size_arg);
+  }
+
+  if (const auto* io = StageBudgetOf(profile, PipelineStage::kIoWait)) {
+    results.push_back(
+        ranking::StageCalibration{
+            PipelineStage::kIoWait,
+            "io_time_ms",
+            args.io_time_ms_arg,
+            0,
+            0,
+            0});
+  }
+  return results;
+}
+
+// Sums the stage latency histograms of all server threads of all tenants.
+std::vector<oldisim::HdrHistogram> aggregateStageLatency(
+    const std::vector<Tenant>& tenants) {
+  auto histograms = ranking::StageLatencyStats::emptyHistograms();
+  for (const auto& tenant : tenants) {
+    for (const auto& this_thread : tenant.thread_data) {
+      if (this_thread.stage_stats) {
+        this_thread.stage_stats->accumulateInto(histograms);
+      }
+    }
+  }
+  return histograms;
+}
+
+// Sums the incremental PageRank calls of all server threads of all tenants.
+IncrementalRankTotals::Sums aggregateIncrementalRank(
+    const std::vector<Tenant>& tenants) {
+  IncrementalRankTotals::Sums sums;
+  for (const auto& tenant : tenants) {
+    for (const auto& this_thread : tenant.thread_data) {
+      if (this_thread.incremental_totals) {
+        this_thread.incremental_totals->accumulateInto(sums);
+      }
+    }
+  }
+  return sums;
+}
+
+// The fields of params, by the names of ranking::tenantOptions().
+std::map<std::string, int*> RequestParamsOptions(RequestParams& params) {
+  return {
+      {"graph_subset", &params.graph_subset},
+      {"graph_max_iters", &params.graph_max_iters},
+      {"chase_iterations", &params.chase_iterations},
+      {"io_time_ms", &params.io_time_ms},
+      {"num_objects", &params.num_objects},
+  };
+}
+
+// The full ranking options of the command line, with a tenant's overrides.
+RequestParams TenantRequestParams(const ranking::TenantSpec& spec) {
+  RequestParams params{
+      args.graph_subset_arg,
+      args.graph_max_iters_arg,
+      args.chase_iterations_arg,
+      args.io_time_ms_arg,
+      args.num_objects_arg};
+  const auto options = RequestParamsOptions(params);
+  for (const auto& option : spec.options) {
+    *options.at(option.first) = option.second;
+  }
+  return params;
+}
+
+/** Applies an update posted to /config to the full ranking options of the
+ * tenants. A key is one of ranking::tenantOptions(), which changes every
+ * tenant, or NAME.OPTION, which changes tenant NAME only and wins over the
+ * former. Every tenant gets its changes as one snapshot, and nothing changes
+ * if any key or value is invalid. Returns why an update was rejected, or an
+ * empty string.
+ */
+std::string UpdateRequestParams(
+    std::vector<Tenant>& tenants,
+    const std::map<std::string, std::string>& update) {
+  // New values by tenant, then option
+  std::vector<std::map<std::string, int>> changes(tenants.size());
+  const auto& known = ranking::tenantOptions();
+  try {
+    for (const auto& entry : update) {
+      std::string option = entry.first;
+      int only = -1;
+      const size_t dot = option.find('.');
+      if (dot != std::string::npos) {
+        const std::string name = option.substr(0, dot);
+        for (size_t i = 0; i < tenants.size() && !name.empty(); i++) {
+          if (tenants[i].spec.name == name) {
+            only = i;
+          }
+        }
+        if (only < 0) {
+          throw std::invalid_argument("unknown tenant " + name);
+        }
+        option = option.substr(dot + 1);
+      }
+      if (std::find(known.begin(), known.end(), option) == known.end()) {
+        throw std::invalid_argument("unknown option " + entry.first);
+      }
+      const int value = ranking::parseConfigInteger(
+          entry.first, entry.second, 0, std::numeric_limits<int>::max());
+      if (only >= 0) {
+        changes[only][option] = value;
+        continue;
+      }
+      for (auto& tenant_changes : changes) {
+        tenant_changes.emplace(option, value);
+      }
+    }
+  } catch (const std::invalid_argument& e) {
+    return e.what();
+  }
+  for (size_t i = 0; i < tenants.size(); i++) {
+    if (changes[i].empty()) {
+      continue;
+    }
+    tenants[i].live_params->update([&changes, i](RequestParams& params) {
+      const auto options = RequestParamsOptions(params);
+      for (const auto& change : changes[i]) {
+        *options.at(change.first) = change.second;
+      }
+    });
+  }
+  return "";
+}
+
+/** Serves requests of type from the server thread state in thread_data:
+ * light ranking, cache probes and distributed PageRank supersteps with their
+ * handlers, any other type with the full ranking pipeline.
+ */
+void RegisterRequestHandler(
+    oldisim::LeafNodeServer& server,
+    uint32_t type,
+    std::vector<ThreadData>& thread_data) {
+  if (type == ranking::kLightRankRequestType) {
+    server.RegisterQueryCallback(
+        type, [&thread_data](auto&& thread, auto&& context) {
+          return LightRankRequestHandler(thread, context, thread_data);
+        });
+  } else if (type == ranking::kCacheProbeRequestType) {
+    server.RegisterQueryCallback(
+        type, [&thread_data](auto&& thread, auto&& context) {
+          return CacheProbeRequestHandler(thread, context, thread_data);
+        });
+  } else if (type == ranking::kDistributedRankRequestType) {
+    server.RegisterQueryCallback(
+        type, [&thread_data](auto&& thread, auto&& context) {
+          return DistributedRankRequestHandler(thread, context, thread_data);
+        });
+  } else if (args.async_handler_given) {
+    server.RegisterQueryCallback(
+        type, [&thread_data](auto&& thread, auto&& context) {
+          return PageRankRequestHandlerAsync(thread, context, thread_data);
+        });
+  } else {
+    server.RegisterQueryCallback(
+        type, [&thread_data](auto&& thread, auto&& context) {
+          return PageRankRequestHandler(thread, context, thread_data);
+        });
+  }
 }
 
 int main(int argc, char** argv) {
@@ -274,6 +2247,61 @@ int main(int argc, char** argv) {
     DIE("cmdline_parser failed"); // NOLINT
   }
 
+  if (std::strcmp(args.io_engine_arg, "io_uring") == 0) {
+    oldisim::SetIoEngine(oldisim::IoEngine::kIoUring);
+  }
+
+  if (std::strcmp(args.event_loop_arg, "busy_poll") == 0) {
+    if (args.busy_poll_idle_backoff_us_arg < 0 ||
+        args.socket_busy_poll_us_arg < 0) {
+      DIE("--busy_poll_idle_backoff_us and --socket_busy_poll_us must not be "
+          "negative");
+    }
+    oldisim::BusyPollOptions busy_poll_options;
+    busy_poll_options.idle_backoff_us = args.busy_poll_idle_backoff_us_arg;
+    busy_poll_options.socket_busy_poll_us = args.socket_busy_poll_us_arg;
+    oldisim::SetEventLoopMode(oldisim::EventLoopMode::kBusyPoll,
+                              busy_poll_options);
+  }
+
+  if (args.kernel_rx_timestamps_given) {
+    oldisim::SetKernelRxTimestamps(true);
+  }
+
+  if (args.tls_given) {
+    oldisim::TlsOptions tls_options;
+    if (std::strcmp(args.tls_offload_arg, "user") == 0) {
+      tls_options.offload = oldisim::TlsOffload::kUserSpace;
+    }
+    if (args.tls_cert_given != args.tls_key_given) {
+      DIE("--tls_cert and --tls_key must be given together");
+    }
+    if (args.tls_cert_given) {
+      tls_options.certificate_file = args.tls_cert_arg;
+      tls_options.private_key_file = args.tls_key_arg;
+    }
+    tls_options.ciphersuites = args.tls_ciphersuites_arg;
+    oldisim::EnableTls(tls_options);
+  }
+
+  if (args.flight_recorder_threshold_us_given) {
+    if (args.flight_recorder_threshold_us_arg < 0) {
+      DIE("--flight_recorder_threshold_us must not be negative");
+    }
+    if (args.flight_recorder_records_arg <= 0) {
+      DIE("--flight_recorder_records must be positive");
+    }
+    oldisim::FlightRecorderOptions recorder_options;
+    recorder_options.threshold_us = args.flight_recorder_threshold_us_arg;
+    recorder_options.records_per_thread = args.flight_recorder_records_arg;
+    recorder_options.dump_path = args.flight_recorder_dump_arg;
+    for (size_t i = 0; i < ranking::kNumPipelineStages; i++) {
+      recorder_options.stage_names.push_back(
+          ranking::pipelineStageName(static_cast<ranking::PipelineStage>(i)));
+    }
+    oldisim::EnableFlightRecorder(recorder_options);
+  }
+
   // Set logging level
   for (unsigned int i = 0; i < args.verbose_given; i++) {
     log_level = (log_level_t)(static_cast<int>(log_level) - 1);
@@ -281,54 +2309,637 @@ int main(int argc, char** argv) {
   if (args.quiet_given != 0u) {
     log_level = QUIET;
   }
+  if (args.icache_methods_arg <= 0 ||
+      static_cast<size_t>(args.icache_methods_arg) >
+          ICacheBuster::NumGeneratedMethods()) {
+    DIE("--icache_methods must be between 1 and %zu",
+        ICacheBuster::NumGeneratedMethods());
+  }
+  if (args.graph_update_batch_arg < 0 || args.graph_delta_max_edges_arg < 0) {
+    DIE("--graph_update_batch and --graph_delta_max_edges must not be "
+        "negative");
+  }
+  if (args.chase_elements_arg <= 0) {
+    DIE("--chase_elements must be positive");
+  }
+  if (args.chase_chains_arg < 1 ||
+      args.chase_chains_arg > search::PointerChase::kMaxChains) {
+    DIE("--chase_chains must be between 1 and %d",
+        search::PointerChase::kMaxChains);
+  }
+  if (args.batch_size_arg < 1 || args.batch_window_us_arg < 1) {
+    DIE("--batch_size and --batch_window_us must be positive");
+  }
+  if (args.batch_size_arg > 1 && !args.async_handler_given) {
+    DIE("--batch_size needs --async_handler");
+  }
+  if (args.num_partitions_arg < 1 || args.partition_index_arg < 0 ||
+      args.partition_index_arg >= args.num_partitions_arg) {
+    DIE("--partition_index must be between 0 and --num_partitions - 1");
+  }
+  if (args.distributed_delta_threshold_arg < 0) {
+    DIE("--distributed_delta_threshold must not be negative");
+  }
+  // Without --tenant the server is a single tenant serving every type
+  std::vector<ranking::TenantSpec> tenant_specs;
+  if (args.tenant_given) {
+    try {
+      tenant_specs = ranking::parseTenantSpecs(std::vector<std::string>(
+          args.tenant_arg, args.tenant_arg + args.tenant_given));
+    } catch (const std::invalid_argument& e) {
+      DIE("Invalid tenant: %s", e.what());
+    }
+    if (args.noloadbalance_given) {
+      DIE("--tenant needs thread load balancing");
+    }
+    for (const auto& spec : tenant_specs) {
+      if (!spec.options.empty() &&
+          (spec.requestType == ranking::kLightRankRequestType ||
+           spec.requestType == ranking::kCacheProbeRequestType)) {
+        DIE("Tenant %s does not run the full ranking pipeline, its options "
+            "do not apply",
+            spec.name.c_str());
+      }
+      if (spec.requestType == ranking::kDistributedRankRequestType) {
+        DIE("Tenant %s cannot serve distributed PageRank supersteps",
+            spec.name.c_str());
+      }
+    }
+    // Tenants would answer each other's keys from one cache
+    if (std::strcmp(args.result_cache_arg, "none") != 0) {
+      DIE("--result_cache does not support --tenant");
+    }
+    if (args.num_partitions_arg > 1) {
+      DIE("--num_partitions does not support --tenant");
+    }
+  } else {
+    tenant_specs.emplace_back();
+  }
+  if (args.allocator_thread_arenas_given &&
+      std::strcmp(ranking::allocatorName(), "jemalloc") != 0) {
+    DIE("--allocator_thread_arenas needs LeafNodeRank built with "
+        "-DRANKING_ALLOCATOR=jemalloc, not %s",
+        ranking::allocatorName());
+  }
+  // Remap before any server thread runs the busted code
+  if (args.icache_huge_pages_given) {
+    const size_t remapped = ICacheBuster::RemapTextToHugePages();
+    if (remapped == 0) {
+      W("Could not move the icache buster code onto huge pages");
+    } else {
+      I("Moved %zu bytes of icache buster code onto huge pages", remapped);
+    }
+  }
   int fake_argc = 1;
   char* fake_argv[2] = {const_cast<char*>("./LeafNodeRank"), nullptr};
   char** sargv = static_cast<char**>(fake_argv);
   folly::init(&fake_argc, &sargv);
-  auto cpuThreadPool =
-      std::make_shared<folly::CPUThreadPoolExecutor>(args.cpu_threads_arg);
+  ConfigurePayloadSerialization();
+  ConfigurePayloadCompression();
+  ConfigureCompressionOffload();
+  // Auto sizing fills in every pool size not given on the command line
+  if (args.auto_given) {
+    const int cpus = ranking::availableCpus();
+    const bool smt = ranking::smtActive();
+    const auto sizes = ranking::autoPoolSizes(cpus, smt);
+    auto fill = [](unsigned int given, int* arg, int value) {
+      if (given == 0u) {
+        *arg = value;
+      }
+    };
+    fill(args.threads_given, &args.threads_arg, sizes.threads);
+    fill(args.cpu_threads_given, &args.cpu_threads_arg,
+         sizes.pools.cpuThreads);
+    fill(args.srv_threads_given, &args.srv_threads_arg,
+         sizes.pools.srvCPUThreads);
+    fill(args.srv_io_threads_given, &args.srv_io_threads_arg,
+         sizes.pools.srvIOThreads);
+    fill(args.io_threads_given, &args.io_threads_arg, sizes.pools.ioThreads);
+    fill(args.timekeeper_threads_given, &args.timekeeper_threads_arg,
+         sizes.timekeeperThreads);
+    I("Auto sizing for %d CPUs%s: %d server, %d cpu, %d srv, %d srv IO, "
+      "%d IO and %d timekeeper threads",
+      cpus, smt ? " with SMT" : "", args.threads_arg, args.cpu_threads_arg,
+      args.srv_threads_arg, args.srv_io_threads_arg, args.io_threads_arg,
+      args.timekeeper_threads_arg);
+  }
+  if (args.auto_rebalance_ms_arg < 0) {
+    DIE("--auto_rebalance_ms must not be negative");
+  }
+  const bool shared_executor = std::strcmp(args.executor_arg, "shared") == 0;
+  if (shared_executor && args.auto_rebalance_ms_arg > 0) {
+    DIE("--auto_rebalance_ms needs --executor=pools");
+  }
+  if (args.executor_threads_arg < 0) {
+    DIE("--executor_threads must not be negative");
+  }
+  // An async split rank blocks a srv task on the cpu tasks it spawns, so the
+  // chase lane must leave a worker for them
+  auto chase_limit = [](int srv_threads, int workers) {
+    if (!args.graph_split_rank_given || !args.async_handler_given) {
+      return srv_threads;
+    }
+    if (workers < 2) {
+      DIE("--graph_split_rank with --async_handler needs at least 2 "
+          "--executor_threads per NUMA node");
+    }
+    return std::min(srv_threads, workers - 1);
+  };
 
-  auto srvCPUThreadPool = std::make_shared<folly::CPUThreadPoolExecutor>(
-      args.srv_threads_arg,
-      std::make_shared<folly::NamedThreadFactory>("srvCPUThread"));
+  // With NUMA placement every node gets its own helper pools, pinned to the
+  // node's CPUs and sized to split the requested thread counts evenly.
+  const bool numa_placement =
+      (args.numa_placement_given || args.auto_given) &&
+      args.noaffinity_given == 0u;
+  std::map<int, ranking::ExecutorPools> executor_pools;
+  if (numa_placement) {
+    const auto numa_nodes = oldisim::GetNumaTopology();
+    const int num_nodes = numa_nodes.size();
+    auto per_node = [num_nodes](int threads) {
+      return std::max(1, (threads + num_nodes - 1) / num_nodes);
+    };
+    const ranking::ExecutorPoolSizes sizes{
+        per_node(args.cpu_threads_arg),
+        per_node(args.srv_threads_arg),
+        per_node(args.srv_io_threads_arg),
+        per_node(args.io_threads_arg)};
+    for (const auto& node : numa_nodes) {
+      if (shared_executor) {
+        const int workers = args.executor_threads_arg > 0
+            ? per_node(args.executor_threads_arg)
+            : static_cast<int>(node.cpus.size());
+        auto lane_sizes = sizes;
+        lane_sizes.srvCPUThreads = chase_limit(sizes.srvCPUThreads, workers);
+        executor_pools.emplace(
+            node.node,
+            ranking::makeSharedExecutor(workers, lane_sizes, node.cpus));
+      } else {
+        executor_pools.emplace(
+            node.node, ranking::makeExecutorPools(sizes, node.cpus));
+      }
+    }
+  } else {
+    ranking::ExecutorPoolSizes sizes{
+        args.cpu_threads_arg,
+        args.srv_threads_arg,
+        args.srv_io_threads_arg,
+        args.io_threads_arg};
+    if (shared_executor) {
+      const int workers = args.executor_threads_arg > 0
+          ? args.executor_threads_arg
+          : ranking::availableCpus();
+      sizes.srvCPUThreads = chase_limit(sizes.srvCPUThreads, workers);
+      executor_pools.emplace(
+          kNoNumaNode,
+          ranking::makeSharedExecutor(workers, sizes, std::vector<int>()));
+    } else {
+      executor_pools.emplace(
+          kNoNumaNode, ranking::makeExecutorPools(sizes, std::vector<int>()));
+    }
+  }
+  if (shared_executor) {
+    const auto& shared = *executor_pools.begin()->second.sharedExecutor;
+    using Lane = ranking::LaneExecutor::Lane;
+    I("Shared executor with %zu workers per set, running at most %zu chase, "
+      "%zu compression, %zu IO and %zu pagerank tasks at once",
+      shared.numWorkers(),
+      shared.limit(Lane::kChase),
+      shared.limit(Lane::kCompression),
+      shared.limit(Lane::kIO),
+      shared.limit(Lane::kPageRank));
+  }
 
-  auto srvIOThreadPool = std::make_shared<folly::CPUThreadPoolExecutor>(
-      args.srv_io_threads_arg,
-      std::make_shared<folly::NamedThreadFactory>("srvIOThread"));
+  // Tenants restricted to CPUs or a cgroup get helper executors of their
+  // own, sized like the server's without NUMA placement
+  std::vector<Tenant> tenants(tenant_specs.size());
+  for (size_t i = 0; i < tenants.size(); i++) {
+    auto& tenant = tenants[i];
+    const auto& spec = tenant_specs[i];
+    tenant.spec = spec;
+    tenant.thread_data = std::vector<ThreadData>(args.threads_arg);
+    if (spec.cpus.empty() && spec.cgroup.empty()) {
+      tenant.executor_pools = executor_pools;
+      continue;
+    }
+    ranking::ExecutorPoolSizes sizes{
+        args.cpu_threads_arg,
+        args.srv_threads_arg,
+        args.srv_io_threads_arg,
+        args.io_threads_arg};
+    if (shared_executor) {
+      const int workers = args.executor_threads_arg > 0
+          ? args.executor_threads_arg
+          : spec.cpus.empty() ? ranking::availableCpus()
+                              : static_cast<int>(spec.cpus.size());
+      sizes.srvCPUThreads = chase_limit(sizes.srvCPUThreads, workers);
+      tenant.executor_pools.emplace(
+          kNoNumaNode,
+          ranking::makeSharedExecutor(
+              workers, sizes, spec.cpus, spec.cgroup));
+    } else {
+      tenant.executor_pools.emplace(
+          kNoNumaNode,
+          ranking::makeExecutorPools(sizes, spec.cpus, spec.cgroup));
+    }
+  }
+  if (args.tenant_given) {
+    for (const auto& tenant : tenants) {
+      I("Tenant %s serves request type %u with weight %g on %s executors",
+        tenant.spec.name.c_str(),
+        tenant.spec.requestType,
+        tenant.spec.weight,
+        tenant.spec.cpus.empty() && tenant.spec.cgroup.empty() ? "shared"
+                                                               : "its own");
+    }
+  }
 
-  auto ioThreadPool =
-      std::make_shared<folly::IOThreadPoolExecutor>(args.io_threads_arg);
+  std::unique_ptr<ranking::PoolRebalancer> pool_rebalancer;
+  if (args.auto_rebalance_ms_arg > 0) {
+    std::vector<ranking::ExecutorPools> pools;
+    for (const auto& entry : executor_pools) {
+      pools.push_back(entry.second);
+    }
+    for (const auto& tenant : tenants) {
+      if (!tenant.spec.cpus.empty() || !tenant.spec.cgroup.empty()) {
+        pools.push_back(tenant.executor_pools.begin()->second);
+      }
+    }
+    pool_rebalancer = std::make_unique<ranking::PoolRebalancer>(
+        std::move(pools),
+        std::chrono::milliseconds(args.auto_rebalance_ms_arg));
+  }
 
-  auto timekeeperPool =
-      std::make_shared<ranking::TimekeeperPool>(args.timekeeper_threads_arg);
+  // Event loop timers need no threads of their own
+  std::shared_ptr<ranking::TimekeeperPool> timekeeperPool;
+  if (std::strcmp(args.io_timer_arg, "timekeeper") == 0) {
+    timekeeperPool =
+        std::make_shared<ranking::TimekeeperPool>(args.timekeeper_threads_arg);
+  }
 
-  std::vector<ThreadData> thread_data(args.threads_arg);
-  ranking::dwarfs::PageRankParams params{
-      args.graph_scale_arg, args.graph_degree_arg};
+  std::unique_ptr<ranking::RequestPerfStats> perf_stats;
+  if (args.perf_counters_given) {
+    perf_stats = std::make_unique<ranking::RequestPerfStats>();
+    for (auto& tenant : tenants) {
+      for (auto& this_thread : tenant.thread_data) {
+        this_thread.perf_stats = perf_stats.get();
+      }
+    }
+  }
+  if (args.stage_latency_given) {
+    // Calibrate the cycle counter now rather than on the first request
+    ranking::cycleCounterNanos();
+    for (auto& tenant : tenants) {
+      for (auto& this_thread : tenant.thread_data) {
+        this_thread.stage_stats =
+            std::make_unique<ranking::StageLatencyStats>();
+      }
+    }
+  }
+  std::unique_ptr<ranking::ResultCache> result_cache;
+  if (std::strcmp(args.result_cache_arg, "none") != 0) {
+    if (args.result_cache_entries_arg <= 0 ||
+        args.result_cache_shards_arg <= 0) {
+      DIE("--result_cache_entries and --result_cache_shards must be positive");
+    }
+    result_cache = std::make_unique<ranking::ResultCache>(
+        std::strcmp(args.result_cache_arg, "clock") == 0
+            ? ranking::ResultCachePolicy::kClock
+            : ranking::ResultCachePolicy::kLru,
+        args.result_cache_entries_arg,
+        args.result_cache_shards_arg);
+    for (auto& this_thread : tenants.front().thread_data) {
+      this_thread.result_cache = result_cache.get();
+    }
+  }
+  ranking::CalibrationProfile calibration_profile;
+  if (args.calibration_profile_given) {
+    try {
+      calibration_profile =
+          ranking::loadCalibrationProfile(args.calibration_profile_arg);
+    } catch (const std::exception& e) {
+      DIE("Invalid calibration profile: %s", e.what());
+    }
+    ApplyWorkingSetBudgets(calibration_profile);
+  }
+  std::unique_ptr<ranking::dwarfs::PageRankParams> params;
+  try {
+    params = std::make_unique<ranking::dwarfs::PageRankParams>(
+        args.graph_scale_arg, args.graph_degree_arg, GraphGenerator());
+  } catch (const std::invalid_argument& e) {
+    DIE("Invalid graph generator options: %s", e.what());
+  }
+  SharedGraphRegistry graph_registry;
+  SharedCompressedRegistry compressed_registry;
+  SharedEmbeddingRegistry embedding_registry;
+  if (args.embedding_tables_arg > 0) {
+    try {
+      ranking::dwarfs::validateEmbeddingTableOptions(EmbeddingOptions());
+    } catch (const std::invalid_argument& e) {
+      DIE("Invalid embedding table options: %s", e.what());
+    }
+  }
+  const auto snapshot_executors =
+      ranking::stageExecutors(executor_pools.begin()->second);
+  PrepareGraphSnapshot(
+      *params,
+      snapshot_executors.cpu.get(),
+      snapshot_executors.cpuThreads);
+  if (args.calibration_profile_given) {
+    const auto calibration = CalibrateStages(
+        calibration_profile,
+        *params,
+        graph_registry,
+        compressed_registry,
+        snapshot_executors.cpu.get(),
+        snapshot_executors.cpuThreads);
+    ranking::logCalibration(calibration);
+    if (args.calibration_record_given) {
+      try {
+        ranking::writeCalibrationRecord(
+            args.calibration_record_arg, calibration);
+      } catch (const std::exception& e) {
+        DIE("%s", e.what());
+      }
+    }
+  }
+  std::unique_ptr<ranking::DistributedRank> distributed_rank;
+  if (args.num_partitions_arg > 1) {
+    // The partition keeps the in-edges of its own vertices, so the graph is
+    // dropped once they are copied out
+    auto graph = MakeGraph(
+        *params,
+        snapshot_executors.cpu.get(),
+        snapshot_executors.cpuThreads);
+    try {
+      distributed_rank = std::make_unique<ranking::DistributedRank>(
+          *graph,
+          args.partition_index_arg,
+          args.num_partitions_arg,
+          ranking::dwarfs::PageRank::kDamp,
+          args.distributed_delta_threshold_arg,
+          kDistributedRankShards);
+    } catch (const std::invalid_argument& e) {
+      DIE("Invalid graph partition: %s", e.what());
+    }
+    I("Distributed PageRank partition %d of %d: %lld vertices, %lld ghost "
+      "in-neighbors, %lld vertices with out-edges to other leafs",
+      args.partition_index_arg,
+      args.num_partitions_arg,
+      static_cast<long long>(distributed_rank->numLocal()),
+      static_cast<long long>(distributed_rank->numGhosts()),
+      static_cast<long long>(distributed_rank->numBoundary()));
+    for (auto& this_thread : tenants.front().thread_data) {
+      this_thread.distributed_rank = distributed_rank.get();
+    }
+  }
+  // After calibration, which may change the options tenants start from
+  for (auto& tenant : tenants) {
+    tenant.live_params = std::make_unique<ranking::LiveConfig<RequestParams>>(
+        TenantRequestParams(tenant.spec));
+  }
   oldisim::LeafNodeServer server(args.port_arg);
   server.SetThreadStartupCallback([&](auto&& thread) {
-    return ThreadStartup(
-        thread,
-        thread_data,
-        params,
-        cpuThreadPool,
-        srvCPUThreadPool,
-        srvIOThreadPool,
-        ioThreadPool,
-        timekeeperPool);
+    for (auto& tenant : tenants) {
+      ThreadStartup(
+          thread,
+          tenant.thread_data,
+          *params,
+          graph_registry,
+          compressed_registry,
+          embedding_registry,
+          tenant.executor_pools,
+          timekeeperPool,
+          *tenant.live_params);
+    }
   });
-  server.RegisterQueryCallback(
-      ranking::kPageRankRequestType,
-      [&thread_data](auto&& thread, auto&& context) {
-        return PageRankRequestHandler(thread, context, thread_data);
-      });
+  if (args.tenant_given) {
+    for (auto& tenant : tenants) {
+      RegisterRequestHandler(
+          server, tenant.spec.requestType, tenant.thread_data);
+      server.SetQueueWeight(tenant.spec.requestType, tenant.spec.weight);
+    }
+  } else {
+    for (uint32_t type :
+         {ranking::kPageRankRequestType,
+          ranking::kLightRankRequestType,
+          ranking::kCacheProbeRequestType}) {
+      RegisterRequestHandler(server, type, tenants.front().thread_data);
+    }
+    if (distributed_rank) {
+      RegisterRequestHandler(
+          server,
+          ranking::kDistributedRankRequestType,
+          tenants.front().thread_data);
+    }
+  }
   server.SetNumThreads(args.threads_arg);
   server.SetThreadPinning(args.noaffinity_given == 0u);
+  server.SetThreadNumaPlacement(numa_placement);
+  server.SetReusePortListeners(
+      args.reuseport_given != 0u, args.reuseport_cpu_steering_given != 0u);
   server.SetThreadLoadBalancing(args.noloadbalance_given == 0u);
+  if (args.lb_request_batch_size_given) {
+    if (args.lb_request_batch_size_arg < 1 ||
+        args.lb_connections_batch_size_arg < 1) {
+      DIE("--lb_request_batch_size and --lb_connections_batch_size must be "
+          "positive");
+    }
+    server.SetThreadLoadBalancingParams(args.lb_connections_batch_size_arg,
+                                        args.lb_request_batch_size_arg);
+  } else {
+    server.SetAdaptiveBatching(args.lb_max_batch_size_arg,
+                               args.lb_batch_budget_us_arg);
+  }
+  if (std::strcmp(args.queue_discipline_arg, "priority") == 0) {
+    server.SetQueueDiscipline(oldisim::QueueDiscipline::kPriority);
+  } else if (std::strcmp(args.queue_discipline_arg, "deadline") == 0) {
+    server.SetQueueDiscipline(oldisim::QueueDiscipline::kEarliestDeadline);
+  } else if (
+      std::strcmp(args.queue_discipline_arg, "fair") == 0 ||
+      (args.tenant_given && !args.queue_discipline_given)) {
+    server.SetQueueDiscipline(oldisim::QueueDiscipline::kWeightedFair);
+  }
+  if (args.max_queue_length_arg < 0 || args.codel_target_us_arg < 0 ||
+      args.codel_interval_us_arg < 1) {
+    DIE("--max_queue_length and --codel_target_us must not be negative, "
+        "--codel_interval_us must be positive");
+  }
+  server.SetAdmissionControl(args.max_queue_length_arg,
+                             args.codel_target_us_arg,
+                             args.codel_interval_us_arg);
+  server.SetSegmentedPayloads(args.segmented_payloads_given != 0u);
 
+  if (args.stats_log_given) {
+    server.SetStatsLogFile(args.stats_log_arg);
+  }
   server.EnableMonitoring(args.monitor_port_arg);
+  if (args.config_token_file_given) {
+    std::string token;
+    try {
+      token = ranking::readConfigToken(args.config_token_file_arg);
+    } catch (const std::runtime_error& e) {
+      DIE("--config_token_file: %s", e.what());
+    }
+    server.SetMonitoringConfigCallback(
+        token, [&tenants](const std::map<std::string, std::string>& update) {
+          return UpdateRequestParams(tenants, update);
+        });
+  }
+  if (args.power_telemetry_given) {
+    server.EnablePowerTelemetry();
+  }
+  if (StreamingCompression() || OffloadCompression() || result_cache ||
+      args.stage_latency_given ||
+      perf_stats || args.graph_incremental_given ||
+      args.serialization_stats_given || args.memory_stats_given ||
+      args.batch_size_arg > 1 || args.tenant_given || distributed_rank ||
+      args.tls_given) {
+    server.SetMonitoringStatsCallback([&result_cache, &tenants, &perf_stats,
+                                       &distributed_rank, &server] {
+      std::map<std::string, double> out;
+      if (StreamingCompression()) {
+        const auto stats = ranking::PayloadCompressor::aggregateStats();
+        out["compression_frames"] = stats.frames;
+        out["compression_input_bytes"] = stats.inputBytes;
+        out["compression_output_bytes"] = stats.outputBytes;
+        out["compression_ratio"] = stats.ratio();
+        out["compression_throughput_mbps"] = stats.throughputMBps();
+      }
+      if (OffloadCompression()) {
+        const auto stats = ranking::CompressionOffload::aggregateStats();
+        out["compression_offload_frames"] = stats.offloadedFrames;
+        out["compression_software_frames"] = stats.softwareFrames;
+        out["compression_offload_fallbacks"] = stats.fallbacks;
+        out["compression_offload_rate"] = stats.offloadRate();
+        out["compression_input_bytes"] =
+            stats.offloadedBytes + stats.softwareBytes;
+        out["compression_output_bytes"] = stats.outputBytes;
+        out["compression_offload_latency_us"] = stats.offloadLatencyUs();
+        out["compression_software_latency_us"] = stats.softwareLatencyUs();
+        out["compression_offload_cpu_saved_ms"] = stats.cpuSavedMs();
+      }
+      if (args.tls_given) {
+        const auto stats = oldisim::GetTlsStats();
+        out["tls_handshakes"] = stats.handshakes;
+        out["tls_handshake_failures"] = stats.handshake_failures;
+        out["tls_kernel_connections"] = stats.kernel_connections;
+        out["tls_kernel_send_connections"] = stats.kernel_send_connections;
+        out["tls_user_space_connections"] = stats.user_space_connections;
+        out["tls_device_send_connections"] = stats.device_send_connections;
+        out["tls_device_receive_connections"] =
+            stats.device_receive_connections;
+      }
+      if (args.serialization_stats_given) {
+        const auto stats = ranking::PayloadSerializer::aggregateStats();
+        out["serialization_encodes"] = stats.encodes;
+        out["serialization_encode_bytes"] = stats.encodeBytes;
+        out["serialization_encode_throughput_mbps"] =
+            stats.encodeThroughputMBps();
+        out["serialization_decodes"] = stats.decodes;
+        out["serialization_decode_bytes"] = stats.decodeBytes;
+        out["serialization_decode_throughput_mbps"] =
+            stats.decodeThroughputMBps();
+      }
+      if (result_cache) {
+        const auto stats = result_cache->stats();
+        out["result_cache_hits"] = stats.hits;
+        out["result_cache_misses"] = stats.misses;
+        out["result_cache_evictions"] = stats.evictions;
+        out["result_cache_entries"] = stats.entries;
+        out["result_cache_bytes"] = stats.bytes;
+        out["result_cache_hit_ratio"] = stats.hitRatio();
+      }
+      if (args.stage_latency_given) {
+        ranking::StageLatencyStats::addMonitoringStats(
+            aggregateStageLatency(tenants), out);
+      }
+      if (perf_stats) {
+        perf_stats->addMonitoringStats(out);
+      }
+      if (args.memory_stats_given) {
+        ranking::addMemoryStats(out);
+      }
+      if (args.batch_size_arg > 1) {
+        const int64_t batches = rank_batches.load(std::memory_order_relaxed);
+        out["rank_batches"] = batches;
+        out["rank_batch_size_mean"] =
+            static_cast<double>(
+                rank_batched_queries.load(std::memory_order_relaxed)) /
+            std::max<int64_t>(batches, 1);
+      }
+      if (distributed_rank) {
+        const auto stats = distributed_rank->stats();
+        out["distributed_supersteps"] = stats.supersteps;
+        out["distributed_deltas_sent"] = stats.deltasSent;
+        out["distributed_deltas_received"] = stats.deltasReceived;
+        out["distributed_bytes_sent"] = stats.bytesSent;
+        out["distributed_active_queries"] = stats.activeQueries;
+        out["distributed_expired_queries"] = stats.expiredQueries;
+      }
+      if (args.tenant_given) {
+        // Leaf side QPS and latency of each tenant over the last window
+        const auto window = server.GetLastWindowStats();
+        for (const auto& tenant : tenants) {
+          auto stats = window.find(tenant.spec.requestType);
+          if (stats == window.end()) {
+            continue;
+          }
+          const std::string prefix = "tenant_" + tenant.spec.name + "_";
+          for (const char* stat :
+               {"qps", "expired_qps", "rejected_qps", "latency_mean",
+                "latency_50p", "latency_99p"}) {
+            out[prefix + stat] = stats->second.at(stat);
+          }
+        }
+      }
+      if (args.graph_incremental_given) {
+        const auto sums = aggregateIncrementalRank(tenants);
+        const double calls = std::max<int64_t>(sums.calls, 1);
+        out["incremental_rank_calls"] = sums.calls;
+        out["incremental_rank_iterations_mean"] = sums.iterations / calls;
+        out["incremental_rank_touched_vertices_mean"] =
+            sums.touched_vertices / calls;
+        out["incremental_rank_pushes_mean"] = sums.pushes / calls;
+        out["incremental_rank_convergence_ms_mean"] =
+            sums.seconds * 1000 / calls;
+        out["incremental_rank_unconverged"] = sums.unconverged;
+      }
+      return out;
+    });
+  }
 
   server.Run();
 
+  if (OffloadCompression()) {
+    const auto stats = ranking::CompressionOffload::aggregateStats();
+    I("Compression offload: %llu frames offloaded, %llu in software, %llu "
+      "fallbacks, %.1f%% of bytes offloaded, %.1f us per offloaded and %.1f "
+      "us per software frame, %.1f ms of CPU saved",
+      static_cast<unsigned long long>(stats.offloadedFrames),
+      static_cast<unsigned long long>(stats.softwareFrames),
+      static_cast<unsigned long long>(stats.fallbacks),
+      stats.offloadRate() * 100,
+      stats.offloadLatencyUs(),
+      stats.softwareLatencyUs(),
+      stats.cpuSavedMs());
+  }
+  if (args.stage_latency_given) {
+    ranking::StageLatencyStats::printSummary(
+        aggregateStageLatency(tenants));
+  }
+  if (args.graph_incremental_given) {
+    const auto sums = aggregateIncrementalRank(tenants);
+    const double calls = std::max<int64_t>(sums.calls, 1);
+    I("Incremental PageRank: %lld calls, %.1f rounds, %.0f touched "
+      "vertices, %.0f pushes and %.3f ms to converge per call, %lld hit "
+      "--graph_max_iters",
+      static_cast<long long>(sums.calls),
+      sums.iterations / calls,
+      sums.touched_vertices / calls,
+      sums.pushes / calls,
+      sums.seconds * 1000 / calls,
+      static_cast<long long>(sums.unconverged));
+  }
+
   return 0;
 }
@@ -0,0 +1,72 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LiveConfig.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+namespace ranking {
+
+int64_t parseConfigInteger(
+    const std::string& key,
+    const std::string& value,
+    int64_t min,
+    int64_t max) {
+  char* end = nullptr;
+  errno = 0;
+  const long long number = std::strtoll(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || errno != 0 || number < min ||
+      number > max) {
+    throw std::invalid_argument(
+        key + " needs an integer from " + std::to_string(min) + " to " +
+        std::to_string(max) + ", not " + value);
+  }
+  return number;
+}
+
+double parseConfigNumber(
+    const std::string& key,
+    const std::string& value,
+    double min) {
+  char* end = nullptr;
+  errno = 0;
+  const double number = std::strtod(value.c_str(), &end);
+  if (value.empty() || *end != '\0' || errno != 0 || !std::isfinite(number) ||
+      number < min) {
+    throw std::invalid_argument(
+        key + " needs a number of at least " + std::to_string(min) +
+        ", not " + value);
+  }
+  return number;
+}
+
+std::string readConfigToken(const std::string& path) {
+  std::ifstream input(path);
+  std::string token;
+  if (!input || !std::getline(input, token)) {
+    throw std::runtime_error("could not read token file " + path);
+  }
+  const auto last = token.find_last_not_of(" \t\r");
+  token.erase(last == std::string::npos ? 0 : last + 1);
+  if (token.empty()) {
+    throw std::runtime_error("token file " + path + " has an empty token");
+  }
+  return token;
+}
+
+} // namespace ranking
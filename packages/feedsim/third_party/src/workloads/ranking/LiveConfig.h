@@ -0,0 +1,93 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ranking {
+
+// Configuration that is changed while the threads using it run, RCU style.
+// Every update publishes a new immutable snapshot and bumps a version. Each
+// reader keeps a copy of its own, which refresh() replaces only when the
+// version moved, so the hot path costs one acquire load; a snapshot lives
+// until the last reader holding it lets it go.
+template <typename T>
+class LiveConfig {
+ public:
+  explicit LiveConfig(const T& initial)
+      : current_(std::make_shared<const T>(initial)) {}
+
+  LiveConfig(const LiveConfig&) = delete;
+  LiveConfig& operator=(const LiveConfig&) = delete;
+
+  std::shared_ptr<const T> snapshot() const {
+    return std::atomic_load(&current_);
+  }
+
+  uint64_t version() const {
+    return version_.load(std::memory_order_acquire);
+  }
+
+  // Publishes the snapshot change makes of a copy of the current one. If
+  // change throws, nothing is published. Updates are serialized, so none is
+  // lost to another made at the same time.
+  template <typename Change>
+  void update(const Change& change) {
+    std::lock_guard<std::mutex> lock(updateLock_);
+    auto next = std::make_shared<T>(*current_);
+    change(*next);
+    std::atomic_store(&current_, std::shared_ptr<const T>(std::move(next)));
+    version_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Copies the latest snapshot into copy if one was published since the
+  // version in seen, and returns whether it did.
+  bool refresh(uint64_t& seen, T& copy) const {
+    const uint64_t latest = version();
+    if (latest == seen) {
+      return false;
+    }
+    copy = *snapshot();
+    seen = latest;
+    return true;
+  }
+
+ private:
+  std::shared_ptr<const T> current_;
+  std::atomic<uint64_t> version_{0};
+  std::mutex updateLock_;
+};
+
+// Parses the value of a configuration update, throwing
+// std::invalid_argument naming key if it is not an integer from min to max,
+// or a number of at least min.
+int64_t parseConfigInteger(
+    const std::string& key,
+    const std::string& value,
+    int64_t min,
+    int64_t max);
+double parseConfigNumber(
+    const std::string& key,
+    const std::string& value,
+    double min);
+
+// The token configuration updates must carry, the first line of the file at
+// path. Throws std::runtime_error if it cannot be read or is empty.
+std::string readConfigToken(const std::string& path);
+
+} // namespace ranking
@@ -12,20 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <exception>
+#include <map>
 #include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
+#include <folly/io/IOBuf.h>
+
+#include "oldisim/ConnectionSpreading.h"
+#include "oldisim/EventLoop.h"
 #include "oldisim/FanoutManager.h"
+#include "oldisim/IoEngine.h"
 #include "oldisim/LeafNodeServer.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
 #include "oldisim/ParentNodeServer.h"
 #include "oldisim/QueryContext.h"
+#include "oldisim/Timestamping.h"
+#include "oldisim/Tls.h"
 #include "oldisim/Util.h"
 
+#include "IOBufResponse.h"
+#include "LiveConfig.h"
 #include "ParentNodeRankCmdline.h"
+#include "PayloadSerializer.h"
 #include "RequestTypes.h"
+#include "SuperstepMessages.h"
 
 #include "if/gen-cpp2/ranking_types.h"
 #include "utils.h"
@@ -33,21 +52,279 @@
 
 static gengetopt_args_info args;
 
+// Fanout options that can be changed at /config, --fanout_budget and
+// --quorum to start with
+struct FanoutParams {
+  double budget_ms;
+  int quorum;
+};
+static std::unique_ptr<ranking::LiveConfig<FanoutParams>> fanout_params;
+
 const int kMaxLeafRequestSize = 8 * 1024;
 
+// A story of a leaf reply, by its index in ThreadData::leaf_responses
+struct StoryRef {
+  double weight;
+  uint32_t response;
+  uint32_t story;
+};
+
 struct ThreadData {
   std::string random_string;
+  // The thread's copy of fanout_params, refreshed as queries arrive
+  FanoutParams fanout;
+  uint64_t fanout_version = 0;
+  // Leaf replies are deserialized into these in place, straight from the
+  // reply buffers. They are reused by every fanout of the thread, so their
+  // story lists keep their capacity instead of being reallocated per request.
+  std::vector<ranking::RankingResponse> leaf_responses;
+  // Bounded min-heap of the heaviest stories seen so far
+  std::vector<StoryRef> top_stories;
+  ranking::RankingResponse merged_response;
+  bool warned_malformed = false;
+  // Distributed PageRank queries of the thread are numbered from a random
+  // start, so that queries of different parents do not collide on a leaf.
+  // The superstep requests are copied out as they are sent, so one set of
+  // buffers serves every query of the thread.
+  uint64_t next_query_id = 0;
+  std::vector<std::string> superstep_requests;
+  std::vector<oldisim::FanoutRequest> superstep_fanout;
+  std::vector<ranking::DeltaFrame> reply_frames;
+  bool warned_superstep = false;
 };
 
+// Orders the heap so the lightest of the current top stories is at the front
+bool HeavierStory(const StoryRef& a, const StoryRef& b) {
+  return a.weight > b.weight;
+}
+
+/** Deserializes the RankingResponse of every leaf that answered, keeps the
+ * --merge_top_k heaviest stories across all of them and serializes those,
+ * heaviest first, as the reply. Returns nullptr if no leaf reply could be
+ * deserialized.
+ */
+std::unique_ptr<folly::IOBuf> MergeTopStories(
+    const oldisim::FanoutReplyTracker& results,
+    ThreadData& this_thread) {
+  const size_t top_k = args.merge_top_k_arg;
+  auto& responses = this_thread.leaf_responses;
+  if (responses.size() < results.replies.size()) {
+    responses.resize(results.replies.size());
+  }
+  auto& heap = this_thread.top_stories;
+  heap.clear();
+  uint32_t num_parsed = 0;
+  for (const auto& reply : results.replies) {
+    if (reply.timed_out || reply.status != oldisim::ResponseStatus::kOk ||
+        reply.reply_data == nullptr) {
+      continue;
+    }
+    auto& response = responses[num_parsed];
+    const auto buf = folly::IOBuf::wrapBufferAsValue(
+        reply.reply_data.get(), reply.reply_data_length);
+    try {
+      ranking::PayloadSerializer::deserialize(&buf, response);
+    } catch (const std::exception& e) {
+      if (!this_thread.warned_malformed) {
+        W("Dropping a leaf reply that is not a RankingResponse: %s", e.what());
+        this_thread.warned_malformed = true;
+      }
+      continue;
+    }
+    const uint32_t num_stories = response.rankingStories.size();
+    for (uint32_t i = 0; i < num_stories; i++) {
+      const StoryRef ref{response.rankingStories[i].weight, num_parsed, i};
+      if (heap.size() < top_k) {
+        heap.push_back(ref);
+        std::push_heap(heap.begin(), heap.end(), HeavierStory);
+      } else if (ref.weight > heap.front().weight) {
+        std::pop_heap(heap.begin(), heap.end(), HeavierStory);
+        heap.back() = ref;
+        std::push_heap(heap.begin(), heap.end(), HeavierStory);
+      }
+    }
+    num_parsed++;
+  }
+  if (num_parsed == 0) {
+    return nullptr;
+  }
+
+  // Sorting by the min-heap order puts the heaviest story first
+  std::sort_heap(heap.begin(), heap.end(), HeavierStory);
+  auto& merged = this_thread.merged_response;
+  merged.queryID = responses[0].queryID;
+  merged.metadata.swap(responses[0].metadata);
+  merged.rankingStories.clear();
+  merged.objectCounts.clear();
+  for (const auto& ref : heap) {
+    auto& story = responses[ref.response].rankingStories[ref.story];
+    merged.objectCounts.push_back(story.objects.size());
+    merged.rankingStories.push_back(std::move(story));
+  }
+  return ranking::PayloadSerializer::serialize(merged).move();
+}
+
 void PageRankRequestFanoutDone(oldisim::QueryContext& originating_query,
                              const oldisim::FanoutReplyTracker& results,
                              ThreadData& this_thread) {
+  // Pass the overload back up when every leaf turned the request away
+  bool all_shed = !results.replies.empty();
+  for (const auto& reply : results.replies) {
+    all_shed = all_shed && !reply.timed_out &&
+        reply.status != oldisim::ResponseStatus::kOk;
+  }
+  if (all_shed) {
+    originating_query.SendRejection(results.replies[0].status);
+    return;
+  }
+
+  if (originating_query.type == ranking::kPageRankRequestType &&
+      args.merge_top_k_arg > 0) {
+    auto merged = MergeTopStories(results, this_thread);
+    if (merged) {
+      ranking::sendResponse(originating_query, std::move(merged));
+      return;
+    }
+  }
+
+  // Without the merge full ranking requests return max_response_size bytes,
+  // the other request classes return as much as their largest leaf reply
+  size_t response_size = this_thread.random_string.size();
+  if (originating_query.type != ranking::kPageRankRequestType) {
+    size_t largest_reply = 0;
+    for (const auto& reply : results.replies) {
+      largest_reply = std::max(largest_reply,
+                               static_cast<size_t>(reply.reply_data_length));
+    }
+    response_size = std::min(response_size, largest_reply);
+  }
+
   // Finally send back the data
   originating_query.SendResponse(
+      reinterpret_cast<const uint8_t*>(this_thread.random_string.c_str()),
+      response_size);
+}
+
+void DistributedSuperstep(oldisim::QueryContext&& query,
+                          uint64_t query_id, uint32_t superstep,
+                          const oldisim::FanoutReplyTracker* previous,
+                          oldisim::FanoutManager& fanout_manager,
+                          ThreadData& this_thread);
+
+/** Answers a distributed PageRank query after its final superstep, or runs
+ * the next one with the deltas the leafs sent in this one.
+ */
+void DistributedSuperstepDone(oldisim::QueryContext& query,
+                              const oldisim::FanoutReplyTracker& results,
+                              oldisim::FanoutManager& fanout_manager,
+                              ThreadData& this_thread, uint64_t query_id,
+                              uint32_t superstep, bool final) {
+  if (!final) {
+    DistributedSuperstep(std::move(query), query_id, superstep + 1, &results,
+                         fanout_manager, this_thread);
+    return;
+  }
+  for (const auto& reply : results.replies) {
+    if (reply.timed_out || reply.status != oldisim::ResponseStatus::kOk) {
+      query.SendRejection(oldisim::ResponseStatus::kRejected);
+      return;
+    }
+  }
+  query.SendResponse(
       reinterpret_cast<const uint8_t*>(this_thread.random_string.c_str()),
       this_thread.random_string.size());
 }
 
+/** Sends superstep of a distributed PageRank query to every leaf, each with
+ * the delta frames the other leafs addressed to it in the previous
+ * superstep. The query is passed on from superstep to superstep and
+ * answered after --distributed_supersteps of them, or earlier once the rank
+ * changes fall below --distributed_tolerance. Every superstep needs the
+ * deltas of all leafs, so the query is rejected as soon as one fails.
+ */
+void DistributedSuperstep(oldisim::QueryContext&& query,
+                          uint64_t query_id, uint32_t superstep,
+                          const oldisim::FanoutReplyTracker* previous,
+                          oldisim::FanoutManager& fanout_manager,
+                          ThreadData& this_thread) {
+  const uint32_t num_leafs = args.leaf_given;
+  ranking::SuperstepRequest header;
+  header.queryId = query_id;
+  header.superstep = superstep;
+  header.numPartitions = num_leafs;
+  header.final = superstep + 1 >= static_cast<uint32_t>(
+      args.distributed_supersteps_arg);
+
+  auto& requests = this_thread.superstep_requests;
+  requests.resize(num_leafs);
+  if (previous != nullptr) {
+    double residual = 0;
+    for (const auto& reply : previous->replies) {
+      if (reply.timed_out || reply.status != oldisim::ResponseStatus::kOk ||
+          reply.reply_data == nullptr) {
+        query.SendRejection(oldisim::ResponseStatus::kRejected);
+        return;
+      }
+      try {
+        residual += ranking::parseSuperstepReply(
+                        reply.reply_data.get(), reply.reply_data_length,
+                        this_thread.reply_frames)
+                        .residual;
+        for (const auto& frame : this_thread.reply_frames) {
+          if (frame.partition >= num_leafs) {
+            throw std::invalid_argument("superstep reply addresses leaf " +
+                                        std::to_string(frame.partition));
+          }
+        }
+      } catch (const std::exception& e) {
+        if (!this_thread.warned_superstep) {
+          W("Rejecting a distributed PageRank query: %s", e.what());
+          this_thread.warned_superstep = true;
+        }
+        query.SendRejection(oldisim::ResponseStatus::kRejected);
+        return;
+      }
+    }
+    // Superstep 0 only spreads the initial ranks and changes none
+    if (superstep > 1 && residual < args.distributed_tolerance_arg) {
+      header.final = true;
+    }
+  }
+  for (uint32_t leaf = 0; leaf < num_leafs; leaf++) {
+    ranking::encodeSuperstepRequest(header, requests[leaf]);
+  }
+  if (previous != nullptr) {
+    // Each leaf gets the frames addressed to it, in the order of the leafs
+    // they come from
+    for (const auto& reply : previous->replies) {
+      ranking::parseSuperstepReply(reply.reply_data.get(),
+                                   reply.reply_data_length,
+                                   this_thread.reply_frames);
+      for (const auto& frame : this_thread.reply_frames) {
+        ranking::appendDeltaFrame(reply.child_node_id, frame.data,
+                                  frame.length, requests[frame.partition]);
+      }
+    }
+  }
+
+  auto& fanout = this_thread.superstep_fanout;
+  fanout.resize(num_leafs);
+  for (uint32_t leaf = 0; leaf < num_leafs; leaf++) {
+    fanout[leaf].child_node_id = leaf;
+    fanout[leaf].request_type = ranking::kDistributedRankRequestType;
+    fanout[leaf].request_data = requests[leaf].data();
+    fanout[leaf].request_data_length = requests[leaf].size();
+  }
+  const bool final = header.final;
+  auto f = [&fanout_manager, &this_thread, query_id, superstep, final](
+               auto& query, auto& results) {
+    DistributedSuperstepDone(query, results, fanout_manager, this_thread,
+                             query_id, superstep, final);
+  };
+  fanout_manager.Fanout(std::move(query), fanout.data(), num_leafs, f,
+                        this_thread.fanout.budget_ms);
+}
+
 void ThreadStartup(oldisim::NodeThread &thread,
                    oldisim::FanoutManager &fanout_manager,
                    std::vector<ThreadData> &thread_data) {
@@ -57,6 +334,45 @@ void ThreadStartup(oldisim::NodeThread &thread,
     fanout_manager.MakeChildConnections(i, args.connections_arg);
   }
 
+  if (std::strcmp(args.connection_policy_arg, "least_outstanding") == 0) {
+    fanout_manager.SetConnectionPolicy(
+        oldisim::ConnectionPolicy::kLeastOutstanding);
+  } else if (std::strcmp(args.connection_policy_arg, "p2c") == 0) {
+    fanout_manager.SetConnectionPolicy(
+        oldisim::ConnectionPolicy::kPowerOfTwoChoices);
+  } else if (std::strcmp(args.connection_policy_arg, "latency_ewma") == 0) {
+    fanout_manager.SetConnectionPolicy(oldisim::ConnectionPolicy::kLatencyEwma);
+  }
+
+  if (std::strcmp(args.hedge_arg, "hedged") == 0) {
+    fanout_manager.SetHedgePolicy(oldisim::HedgePolicy::kHedged,
+                                  args.hedge_percentile_arg,
+                                  args.hedge_min_delay_arg);
+  } else if (std::strcmp(args.hedge_arg, "tied") == 0) {
+    fanout_manager.SetHedgePolicy(oldisim::HedgePolicy::kTied);
+  }
+
+  if (args.credit_window_arg > 0) {
+    fanout_manager.SetCreditWindow(
+        args.credit_window_arg,
+        std::strcmp(args.credit_overflow_arg, "fail") == 0
+            ? oldisim::OverflowPolicy::kFailFast
+            : oldisim::OverflowPolicy::kQueue,
+        args.credit_max_queued_arg);
+  }
+
+  this_thread.fanout_version = fanout_params->version();
+  this_thread.fanout = *fanout_params->snapshot();
+
+  if (args.seed_given) {
+    const uint64_t seed = DeriveSeed(args.seed_arg, thread.get_thread_num());
+    SeedThreadRandom(seed);
+    this_thread.next_query_id = DeriveSeed(seed, 0);
+  } else {
+    std::random_device random_device;
+    this_thread.next_query_id =
+        (static_cast<uint64_t>(random_device()) << 32) | random_device();
+  }
   this_thread.random_string = RandomString(args.max_response_size_arg);
 }
 
@@ -65,15 +381,31 @@ void PageRankRequestHandler(oldisim::NodeThread& thread,
                           oldisim::QueryContext& context,
                           std::vector<ThreadData>& thread_data) {
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
+  fanout_params->refresh(this_thread.fanout_version, this_thread.fanout);
+
+  if (context.type == ranking::kPageRankRequestType &&
+      args.distributed_supersteps_arg > 0) {
+    DistributedSuperstep(std::move(context), this_thread.next_query_id++, 0,
+                         nullptr, fanout_manager, this_thread);
+    return;
+  }
 
   // ranking::Payload payload;
   // payload.message = this_thread.random_string;
   // payload.write(proto.get());
   // std::string serialized = strBuffer->getBufferAsString();
 
-  // Set up fanout structure to everyone
+  // Forward the result cache key at the front of the query to the leafs
+  if (context.payload_length >= ranking::kRequestKeySize &&
+      this_thread.random_string.size() >= ranking::kRequestKeySize) {
+    std::memcpy(&this_thread.random_string[0],
+                context.GetContiguousPayload(),
+                ranking::kRequestKeySize);
+  }
+
+  // Set up fanout structure to everyone, forwarding the request class
   oldisim::FanoutRequest request;
-  request.request_type = ranking::kPageRankRequestType;
+  request.request_type = context.type;
   request.request_data = this_thread.random_string.c_str();
   request.request_data_length = this_thread.random_string.size();
 
@@ -81,19 +413,107 @@ void PageRankRequestHandler(oldisim::NodeThread& thread,
     PageRankRequestFanoutDone(query, results, this_thread);
   };
 
-  fanout_manager.FanoutAll(std::move(context), request, f);
+  fanout_manager.FanoutAll(std::move(context), request, f,
+                           this_thread.fanout.budget_ms,
+                           this_thread.fanout.quorum);
 /*
       std::bind(PageRankRequestFanoutDone, std::placeholders::_1,
                 std::placeholders::_2, std::ref(this_thread)));
 */
 }
 
+/** Applies an update posted to /config to fanout_params: fanout_budget in
+ * milliseconds, quorum in leafs. Returns why an update was rejected, or an
+ * empty string.
+ */
+std::string UpdateFanoutParams(
+    const std::map<std::string, std::string>& update) {
+  // Negative for the options the update leaves as they are
+  double budget_ms = -1;
+  int quorum = -1;
+  try {
+    for (const auto& entry : update) {
+      if (entry.first == "fanout_budget") {
+        budget_ms = ranking::parseConfigNumber(entry.first, entry.second, 0);
+      } else if (entry.first == "quorum") {
+        // A superstep must reach every leaf
+        const int max_quorum =
+            args.distributed_supersteps_arg > 0 ? 0 : args.leaf_given;
+        quorum = ranking::parseConfigInteger(
+            entry.first, entry.second, 0, max_quorum);
+      } else {
+        throw std::invalid_argument("unknown option " + entry.first);
+      }
+    }
+  } catch (const std::invalid_argument& e) {
+    return e.what();
+  }
+  fanout_params->update([budget_ms, quorum](FanoutParams& params) {
+    if (budget_ms >= 0) {
+      params.budget_ms = budget_ms;
+    }
+    if (quorum >= 0) {
+      params.quorum = quorum;
+    }
+  });
+  return "";
+}
+
 int main(int argc, char** argv) {
   // Parse arguments
   if (cmdline_parser(argc, argv, &args) != 0) {
     DIE("cmdline_parser failed");
   }
 
+  if (std::strcmp(args.io_engine_arg, "io_uring") == 0) {
+    oldisim::SetIoEngine(oldisim::IoEngine::kIoUring);
+  }
+
+  if (std::strcmp(args.event_loop_arg, "busy_poll") == 0) {
+    if (args.busy_poll_idle_backoff_us_arg < 0 ||
+        args.socket_busy_poll_us_arg < 0) {
+      DIE("--busy_poll_idle_backoff_us and --socket_busy_poll_us must not be "
+          "negative");
+    }
+    oldisim::BusyPollOptions busy_poll_options;
+    busy_poll_options.idle_backoff_us = args.busy_poll_idle_backoff_us_arg;
+    busy_poll_options.socket_busy_poll_us = args.socket_busy_poll_us_arg;
+    oldisim::SetEventLoopMode(oldisim::EventLoopMode::kBusyPoll,
+                              busy_poll_options);
+  }
+
+  if (args.kernel_rx_timestamps_given) {
+    oldisim::SetKernelRxTimestamps(true);
+  }
+
+  if (args.tls_given) {
+    oldisim::TlsOptions tls_options;
+    if (std::strcmp(args.tls_offload_arg, "user") == 0) {
+      tls_options.offload = oldisim::TlsOffload::kUserSpace;
+    }
+    if (args.tls_cert_given != args.tls_key_given) {
+      DIE("--tls_cert and --tls_key must be given together");
+    }
+    if (args.tls_cert_given) {
+      tls_options.certificate_file = args.tls_cert_arg;
+      tls_options.private_key_file = args.tls_key_arg;
+    }
+    if (args.tls_ca_given) {
+      tls_options.ca_file = args.tls_ca_arg;
+    }
+    tls_options.ciphersuites = args.tls_ciphersuites_arg;
+    oldisim::EnableTls(tls_options);
+  }
+
+  if (args.source_address_given || args.rss_source_ports_given) {
+    oldisim::ConnectionSpreadOptions spread_options;
+    for (unsigned int i = 0; i < args.source_address_given; i++) {
+      spread_options.source_addresses.push_back(args.source_address_arg[i]);
+    }
+    spread_options.rss_source_ports = args.rss_source_ports_given;
+    oldisim::SetConnectionSpreading(spread_options);
+  }
+
   // Set logging level
   for (unsigned int i = 0; i < args.verbose_given; i++) {
     log_level = (log_level_t)(static_cast<int>(log_level) - 1);
@@ -106,6 +526,27 @@ int main(int argc, char** argv) {
   if (args.leaf_given == 0) {
     DIE("--leaf must be specified.");
   }
+  if (args.merge_top_k_arg < 0) {
+    DIE("--merge_top_k must not be negative");
+  }
+  if (args.credit_window_arg < 0 || args.credit_max_queued_arg < 0) {
+    DIE("--credit_window and --credit_max_queued must not be negative");
+  }
+  if (args.distributed_supersteps_arg < 0 ||
+      args.distributed_tolerance_arg < 0) {
+    DIE("--distributed_supersteps and --distributed_tolerance must not be "
+        "negative");
+  }
+  // A superstep applies the deltas it carries, so it must reach every leaf
+  // exactly once
+  if (args.distributed_supersteps_arg > 0 &&
+      (std::strcmp(args.hedge_arg, "none") != 0 || args.quorum_arg > 0)) {
+    DIE("--distributed_supersteps does not support --hedge or --quorum");
+  }
+  ranking::PayloadSerializer::configure(
+      ranking::parseSerializationProtocol(args.serialization_arg));
+  fanout_params = std::make_unique<ranking::LiveConfig<FanoutParams>>(
+      FanoutParams{args.fanout_budget_arg, args.quorum_arg});
 
   // Make storage for thread variables
   std::vector<ThreadData> thread_data(args.threads_arg);
@@ -115,20 +556,54 @@ int main(int argc, char** argv) {
   server.SetThreadStartupCallback(
       std::bind(ThreadStartup, std::placeholders::_1, std::placeholders::_2,
                 std::ref(thread_data)));
-  server.RegisterQueryCallback(
-      ranking::kPageRankRequestType,
-      std::bind(PageRankRequestHandler, std::placeholders::_1,
-                std::placeholders::_2, std::placeholders::_3,
-                std::ref(thread_data)));
-  server.RegisterRequestType(ranking::kPageRankRequestType);
+  std::set<uint32_t> request_types = {ranking::kPageRankRequestType,
+                                      ranking::kLightRankRequestType,
+                                      ranking::kCacheProbeRequestType};
+  for (unsigned int i = 0; i < args.tenant_type_given; i++) {
+    if (args.tenant_type_arg[i] < 0) {
+      DIE("--tenant_type must not be negative");
+    }
+    request_types.insert(args.tenant_type_arg[i]);
+  }
+  for (uint32_t type : request_types) {
+    server.RegisterQueryCallback(
+        type,
+        std::bind(PageRankRequestHandler, std::placeholders::_1,
+                  std::placeholders::_2, std::placeholders::_3,
+                  std::ref(thread_data)));
+    server.RegisterRequestType(type);
+  }
+  if (args.distributed_supersteps_arg > 0) {
+    server.RegisterRequestType(ranking::kDistributedRankRequestType);
+  }
 
 
   for (int i = 0; i < args.leaf_given; i++) {
     auto host_port = ranking::utils::parseHostnameAndPort(args.leaf_arg[i]);
-    server.AddChildNode(host_port.first, host_port.second);
+    server.AddChildNode(
+        host_port.first, host_port.second,
+        ranking::utils::parseTransport(args.leaf_transport_arg),
+        ranking::utils::parseFraming(args.leaf_framing_arg));
   }
 
+  if (args.stats_log_given) {
+    server.SetStatsLogFile(args.stats_log_arg);
+  }
   server.EnableMonitoring(args.monitor_port_arg);
+  if (args.config_token_file_given) {
+    std::string token;
+    try {
+      token = ranking::readConfigToken(args.config_token_file_arg);
+    } catch (const std::runtime_error& e) {
+      DIE("--config_token_file: %s", e.what());
+    }
+    server.SetMonitoringConfigCallback(
+        token, [](const std::map<std::string, std::string>& update) {
+          return UpdateFanoutParams(update);
+        });
+  }
+  server.SetReusePortListeners(
+      args.reuseport_given != 0u, args.reuseport_cpu_steering_given != 0u);
 
   server.Run(args.threads_arg, true);
 
@@ -0,0 +1,433 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "PayloadCompressor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+#include <lz4frame.h>
+#include <snappy-sinksource.h>
+#include <snappy.h>
+#include <zdict.h>
+#include <zstd.h>
+
+namespace ranking {
+
+namespace {
+
+constexpr size_t kInitialOutputSize = 64 * 1024;
+
+PayloadCompressorOptions& globalOptions() {
+  static PayloadCompressorOptions options;
+  return options;
+}
+
+void checkZstd(size_t result, const char* what) {
+  if (ZSTD_isError(result)) {
+    throw std::runtime_error(
+        std::string("zstd ") + what + " failed: " + ZSTD_getErrorName(result));
+  }
+}
+
+size_t checkLz4(size_t result, const char* what) {
+  if (LZ4F_isError(result)) {
+    throw std::runtime_error(
+        std::string("lz4 ") + what + " failed: " + LZ4F_getErrorName(result));
+  }
+  return result;
+}
+
+LZ4F_preferences_t lz4Preferences(int level) {
+  LZ4F_preferences_t prefs;
+  std::memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = level;
+  return prefs;
+}
+
+// Exposes the leading segments of an IOBuf chain to snappy, up to and
+// including the segment that reaches maxBytes.
+class IOBufPrefixSource : public snappy::Source {
+public:
+  IOBufPrefixSource(const folly::IOBuf& chain, size_t maxBytes)
+      : current_(&chain) {
+    for (const auto& segment : chain) {
+      if (available_ >= maxBytes) {
+        break;
+      }
+      available_ += segment.size();
+    }
+  }
+
+  size_t Available() const override {
+    return available_;
+  }
+
+  const char* Peek(size_t* len) override {
+    skipExhausted();
+    *len = std::min(current_->length() - offset_, available_);
+    return reinterpret_cast<const char*>(current_->data()) + offset_;
+  }
+
+  void Skip(size_t n) override {
+    while (n > 0) {
+      skipExhausted();
+      const size_t step = std::min(n, current_->length() - offset_);
+      offset_ += step;
+      available_ -= step;
+      n -= step;
+    }
+  }
+
+private:
+  void skipExhausted() {
+    while (available_ > 0 && offset_ == current_->length()) {
+      current_ = current_->next();
+      offset_ = 0;
+    }
+  }
+
+  const folly::IOBuf* current_;
+  size_t offset_ = 0;
+  size_t available_ = 0;
+};
+
+} // namespace
+
+struct PayloadCompressor::StatsRegistry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadStats>> threads;
+};
+
+PayloadCompressor::StatsRegistry& PayloadCompressor::statsRegistry() {
+  static StatsRegistry registry;
+  return registry;
+}
+
+double PayloadCompressionStats::ratio() const {
+  return outputBytes == 0 ? 0.0
+                          : static_cast<double>(inputBytes) / outputBytes;
+}
+
+double PayloadCompressionStats::throughputMBps() const {
+  return compressNanos == 0
+      ? 0.0
+      : static_cast<double>(inputBytes) * 1e3 / compressNanos;
+}
+
+void PayloadCompressor::configure(PayloadCompressorOptions options) {
+  if (!options.dictionary.empty() && options.codec != PayloadCodec::kZstd) {
+    throw std::invalid_argument("compression dictionaries require zstd");
+  }
+  globalOptions() = std::move(options);
+}
+
+PayloadCompressor& PayloadCompressor::local() {
+  static thread_local PayloadCompressor compressor(globalOptions());
+  return compressor;
+}
+
+std::string PayloadCompressor::trainDictionary(
+    const std::vector<std::string>& samples,
+    size_t maxSize) {
+  std::string samplesBuffer;
+  std::vector<size_t> sampleSizes;
+  sampleSizes.reserve(samples.size());
+  for (const auto& sample : samples) {
+    samplesBuffer += sample;
+    sampleSizes.push_back(sample.size());
+  }
+  std::string dictionary(maxSize, '\0');
+  const size_t size = ZDICT_trainFromBuffer(
+      &dictionary[0],
+      dictionary.size(),
+      samplesBuffer.data(),
+      sampleSizes.data(),
+      sampleSizes.size());
+  if (ZDICT_isError(size)) {
+    throw std::runtime_error(
+        std::string("zstd dictionary training failed: ") +
+        ZDICT_getErrorName(size));
+  }
+  dictionary.resize(size);
+  return dictionary;
+}
+
+PayloadCompressionStats PayloadCompressor::aggregateStats() {
+  auto& registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  PayloadCompressionStats total;
+  for (const auto& thread : registry.threads) {
+    total.frames += thread->frames.load(std::memory_order_relaxed);
+    total.inputBytes += thread->inputBytes.load(std::memory_order_relaxed);
+    total.outputBytes += thread->outputBytes.load(std::memory_order_relaxed);
+    total.compressNanos +=
+        thread->compressNanos.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+PayloadCompressor::PayloadCompressor(const PayloadCompressorOptions& options)
+    : options_(options),
+      output_(kInitialOutputSize),
+      stats_(std::make_shared<ThreadStats>()) {
+  {
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(stats_);
+  }
+  switch (options_.codec) {
+    case PayloadCodec::kZstd:
+      zstdCCtx_ = ZSTD_createCCtx();
+      zstdDCtx_ = ZSTD_createDCtx();
+      if (zstdCCtx_ == nullptr || zstdDCtx_ == nullptr) {
+        throw std::bad_alloc();
+      }
+      checkZstd(
+          ZSTD_CCtx_setParameter(
+              zstdCCtx_, ZSTD_c_compressionLevel, options_.level),
+          "set level");
+      if (!options_.dictionary.empty()) {
+        checkZstd(
+            ZSTD_CCtx_loadDictionary(
+                zstdCCtx_,
+                options_.dictionary.data(),
+                options_.dictionary.size()),
+            "load dictionary");
+        checkZstd(
+            ZSTD_DCtx_loadDictionary(
+                zstdDCtx_,
+                options_.dictionary.data(),
+                options_.dictionary.size()),
+            "load dictionary");
+      }
+      break;
+    case PayloadCodec::kLz4:
+      checkLz4(
+          LZ4F_createCompressionContext(&lz4CCtx_, LZ4F_VERSION),
+          "create context");
+      checkLz4(
+          LZ4F_createDecompressionContext(&lz4DCtx_, LZ4F_VERSION),
+          "create context");
+      break;
+    case PayloadCodec::kSnappy:
+      break;
+  }
+}
+
+PayloadCompressor::~PayloadCompressor() {
+  ZSTD_freeCCtx(zstdCCtx_);
+  ZSTD_freeDCtx(zstdDCtx_);
+  LZ4F_freeCompressionContext(lz4CCtx_);
+  LZ4F_freeDecompressionContext(lz4DCtx_);
+}
+
+void PayloadCompressor::reserveOutput(size_t size) {
+  if (output_.size() < size) {
+    output_.resize(std::max(size, output_.size() * 2));
+  }
+}
+
+size_t PayloadCompressor::compressChain(
+    const folly::IOBuf& chain,
+    size_t maxBytes) {
+  size_t inputBytes = 0;
+  for (const auto& segment : chain) {
+    if (inputBytes >= maxBytes) {
+      break;
+    }
+    inputBytes += segment.size();
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  size_t outputBytes = 0;
+  switch (options_.codec) {
+    case PayloadCodec::kZstd:
+      outputBytes = compressChainZstd(chain, maxBytes);
+      break;
+    case PayloadCodec::kLz4:
+      outputBytes = compressChainLz4(chain, maxBytes);
+      break;
+    case PayloadCodec::kSnappy:
+      outputBytes = compressChainSnappy(chain, maxBytes);
+      break;
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // Only this thread writes its counters.
+  auto bump = [](std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(
+        counter.load(std::memory_order_relaxed) + value,
+        std::memory_order_relaxed);
+  };
+  bump(stats_->frames, 1);
+  bump(stats_->inputBytes, inputBytes);
+  bump(stats_->outputBytes, outputBytes);
+  bump(
+      stats_->compressNanos,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  return outputBytes;
+}
+
+size_t PayloadCompressor::compressChainZstd(
+    const folly::IOBuf& chain,
+    size_t maxBytes) {
+  // A session reset keeps the level and dictionary loaded in the context.
+  checkZstd(ZSTD_CCtx_reset(zstdCCtx_, ZSTD_reset_session_only), "reset");
+  ZSTD_outBuffer out{output_.data(), output_.size(), 0};
+  auto stream = [&](ZSTD_inBuffer& in, ZSTD_EndDirective mode) {
+    size_t remaining;
+    do {
+      if (out.pos == out.size) {
+        reserveOutput(output_.size() * 2);
+        out.dst = output_.data();
+        out.size = output_.size();
+      }
+      remaining = ZSTD_compressStream2(zstdCCtx_, &out, &in, mode);
+      checkZstd(remaining, "compress");
+    } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+  };
+
+  size_t inputBytes = 0;
+  for (const auto& segment : chain) {
+    if (inputBytes >= maxBytes) {
+      break;
+    }
+    ZSTD_inBuffer in{segment.data(), segment.size(), 0};
+    stream(in, ZSTD_e_continue);
+    inputBytes += segment.size();
+  }
+  ZSTD_inBuffer end{nullptr, 0, 0};
+  stream(end, ZSTD_e_end);
+  return out.pos;
+}
+
+size_t PayloadCompressor::compressChainLz4(
+    const folly::IOBuf& chain,
+    size_t maxBytes) {
+  const auto prefs = lz4Preferences(options_.level);
+  reserveOutput(LZ4F_HEADER_SIZE_MAX);
+  size_t pos = checkLz4(
+      LZ4F_compressBegin(lz4CCtx_, output_.data(), output_.size(), &prefs),
+      "compress");
+
+  size_t inputBytes = 0;
+  for (const auto& segment : chain) {
+    if (inputBytes >= maxBytes) {
+      break;
+    }
+    reserveOutput(pos + LZ4F_compressBound(segment.size(), &prefs));
+    pos += checkLz4(
+        LZ4F_compressUpdate(
+            lz4CCtx_,
+            output_.data() + pos,
+            output_.size() - pos,
+            segment.data(),
+            segment.size(),
+            nullptr),
+        "compress");
+    inputBytes += segment.size();
+  }
+  reserveOutput(pos + LZ4F_compressBound(0, &prefs));
+  pos += checkLz4(
+      LZ4F_compressEnd(
+          lz4CCtx_, output_.data() + pos, output_.size() - pos, nullptr),
+      "compress");
+  return pos;
+}
+
+size_t PayloadCompressor::compressChainSnappy(
+    const folly::IOBuf& chain,
+    size_t maxBytes) {
+  IOBufPrefixSource source(chain, maxBytes);
+  reserveOutput(snappy::MaxCompressedLength(source.Available()));
+  snappy::UncheckedByteArraySink sink(output_.data());
+  return snappy::Compress(&source, &sink);
+}
+
+std::string PayloadCompressor::compress(folly::StringPiece data) {
+  const auto buf = folly::IOBuf::wrapBufferAsValue(data.data(), data.size());
+  const auto size = compressChain(buf, std::numeric_limits<size_t>::max());
+  return std::string(output_.data(), size);
+}
+
+std::string PayloadCompressor::uncompress(folly::StringPiece data) {
+  switch (options_.codec) {
+    case PayloadCodec::kZstd: {
+      checkZstd(ZSTD_DCtx_reset(zstdDCtx_, ZSTD_reset_session_only), "reset");
+      ZSTD_inBuffer in{data.data(), data.size(), 0};
+      ZSTD_outBuffer out{output_.data(), output_.size(), 0};
+      size_t remaining;
+      do {
+        if (out.pos == out.size) {
+          reserveOutput(output_.size() * 2);
+          out.dst = output_.data();
+          out.size = output_.size();
+        }
+        remaining = ZSTD_decompressStream(zstdDCtx_, &out, &in);
+        checkZstd(remaining, "decompress");
+        if (remaining != 0 && in.pos == in.size && out.pos < out.size) {
+          throw std::runtime_error("zstd decompress failed: truncated frame");
+        }
+      } while (remaining != 0);
+      return std::string(output_.data(), out.pos);
+    }
+    case PayloadCodec::kLz4: {
+      size_t srcPos = 0;
+      size_t dstPos = 0;
+      size_t remaining;
+      do {
+        if (dstPos == output_.size()) {
+          reserveOutput(output_.size() * 2);
+        }
+        size_t srcSize = data.size() - srcPos;
+        size_t dstSize = output_.size() - dstPos;
+        remaining = LZ4F_decompress(
+            lz4DCtx_,
+            output_.data() + dstPos,
+            &dstSize,
+            data.data() + srcPos,
+            &srcSize,
+            nullptr);
+        if (LZ4F_isError(remaining)) {
+          LZ4F_resetDecompressionContext(lz4DCtx_);
+          checkLz4(remaining, "decompress");
+        }
+        srcPos += srcSize;
+        dstPos += dstSize;
+        if (remaining != 0 && srcPos == data.size() &&
+            dstPos < output_.size()) {
+          LZ4F_resetDecompressionContext(lz4DCtx_);
+          throw std::runtime_error("lz4 decompress failed: truncated frame");
+        }
+      } while (remaining != 0);
+      return std::string(output_.data(), dstPos);
+    }
+    case PayloadCodec::kSnappy: {
+      std::string uncompressed;
+      if (!snappy::Uncompress(data.data(), data.size(), &uncompressed)) {
+        throw std::runtime_error("snappy decompress failed: corrupt input");
+      }
+      return uncompressed;
+    }
+  }
+  return std::string();
+}
+
+} // namespace ranking
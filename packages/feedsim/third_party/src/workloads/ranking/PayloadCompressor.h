@@ -0,0 +1,125 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct LZ4F_cctx_s;
+struct LZ4F_dctx_s;
+
+namespace ranking {
+
+enum class PayloadCodec { kZstd, kLz4, kSnappy };
+
+struct PayloadCompressorOptions {
+  PayloadCodec codec = PayloadCodec::kZstd;
+  // 0 selects the codec's default level. Ignored by snappy.
+  int level = 0;
+  // Raw zstd dictionary contents; empty for none. Only valid with kZstd.
+  std::string dictionary;
+};
+
+// Compression work summed over every thread's compressor.
+struct PayloadCompressionStats {
+  uint64_t frames = 0;
+  uint64_t inputBytes = 0;
+  uint64_t outputBytes = 0;
+  uint64_t compressNanos = 0;
+
+  // Input bytes per output byte; 0 before the first frame.
+  double ratio() const;
+  // Input megabytes compressed per second of compressor time.
+  double throughputMBps() const;
+};
+
+// Per-thread compression and decompression contexts that are created once
+// and reset between frames, so a request pays for the compressor itself
+// rather than for codec lookup and context setup. IOBuf chains are streamed
+// segment by segment into a single frame without copying the input.
+class PayloadCompressor {
+public:
+  // Sets the options every thread's compressor is built with. Must be called
+  // before the first call to local(). Throws std::invalid_argument if the
+  // options do not fit the codec.
+  static void configure(PayloadCompressorOptions options);
+
+  // Returns the calling thread's compressor, creating it on first use.
+  static PayloadCompressor& local();
+
+  // Trains a zstd dictionary of at most maxSize bytes from samples. Throws
+  // std::runtime_error if zstd cannot build one, e.g. from too few samples.
+  static std::string trainDictionary(
+      const std::vector<std::string>& samples,
+      size_t maxSize);
+
+  // Sums the stats of all compressors, including those of exited threads.
+  static PayloadCompressionStats aggregateStats();
+
+  ~PayloadCompressor();
+
+  PayloadCompressor(const PayloadCompressor&) = delete;
+  PayloadCompressor& operator=(const PayloadCompressor&) = delete;
+
+  // Compresses the leading segments of chain into one frame, stopping after
+  // the segment that brings the input to at least maxBytes. Returns the
+  // compressed size; the frame stays in an internal buffer that is reused by
+  // the next call.
+  size_t compressChain(const folly::IOBuf& chain, size_t maxBytes);
+
+  std::string compress(folly::StringPiece data);
+
+  // Throws std::runtime_error if data is not a valid frame.
+  std::string uncompress(folly::StringPiece data);
+
+private:
+  struct ThreadStats {
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> inputBytes{0};
+    std::atomic<uint64_t> outputBytes{0};
+    std::atomic<uint64_t> compressNanos{0};
+  };
+  struct StatsRegistry;
+
+  static StatsRegistry& statsRegistry();
+
+  explicit PayloadCompressor(const PayloadCompressorOptions& options);
+
+  // Grows output_ so that it holds at least size bytes.
+  void reserveOutput(size_t size);
+
+  size_t compressChainZstd(const folly::IOBuf& chain, size_t maxBytes);
+  size_t compressChainLz4(const folly::IOBuf& chain, size_t maxBytes);
+  size_t compressChainSnappy(const folly::IOBuf& chain, size_t maxBytes);
+
+  const PayloadCompressorOptions& options_;
+  ZSTD_CCtx_s* zstdCCtx_ = nullptr;
+  ZSTD_DCtx_s* zstdDCtx_ = nullptr;
+  LZ4F_cctx_s* lz4CCtx_ = nullptr;
+  LZ4F_dctx_s* lz4DCtx_ = nullptr;
+  std::vector<char> output_;
+  // Shared with the stats registry so totals outlive the thread.
+  std::shared_ptr<ThreadStats> stats_;
+};
+
+} // namespace ranking
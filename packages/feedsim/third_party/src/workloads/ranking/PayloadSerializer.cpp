@@ -0,0 +1,336 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "PayloadSerializer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <thrift/lib/cpp/protocol/TType.h>
+#include <thrift/lib/cpp2/protocol/CompactProtocol.h>
+#include <thrift/lib/cpp2/protocol/Serializer.h>
+
+namespace ranking {
+
+namespace {
+
+using apache::thrift::protocol::TType;
+using Clock = std::chrono::steady_clock;
+
+// Field ids from ranking.thrift
+constexpr int16_t kResponseQueryIdField = 1;
+constexpr int16_t kResponseStoriesField = 2;
+constexpr int16_t kStoryObjectsField = 2;
+constexpr int16_t kStoryWeightField = 3;
+
+struct ThreadStats {
+  std::atomic<uint64_t> encodes{0};
+  std::atomic<uint64_t> encodeBytes{0};
+  std::atomic<uint64_t> encodeNanos{0};
+  std::atomic<uint64_t> decodes{0};
+  std::atomic<uint64_t> decodeBytes{0};
+  std::atomic<uint64_t> decodeNanos{0};
+};
+
+struct StatsRegistry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadStats>> threads;
+};
+
+StatsRegistry& statsRegistry() {
+  static StatsRegistry registry;
+  return registry;
+}
+
+// Shared with the registry so totals outlive the thread
+ThreadStats& localStats() {
+  static thread_local std::shared_ptr<ThreadStats> stats = [] {
+    auto created = std::make_shared<ThreadStats>();
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(created);
+    return created;
+  }();
+  return *stats;
+}
+
+SerializationProtocol& globalProtocol() {
+  static SerializationProtocol protocol = SerializationProtocol::kCompact;
+  return protocol;
+}
+
+uint64_t nanosSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now() - start)
+      .count();
+}
+
+void addStory(
+    RankingResponseSummary& summary,
+    uint64_t objects,
+    double weight) {
+  summary.maxStoryWeight =
+      summary.stories == 0 ? weight : std::max(summary.maxStoryWeight, weight);
+  summary.stories++;
+  summary.objects += objects;
+}
+
+folly::IOBufQueue encode(
+    SerializationProtocol protocol,
+    const RankingResponse& response) {
+  folly::IOBufQueue queue;
+  if (protocol == SerializationProtocol::kBinary) {
+    apache::thrift::BinarySerializer::serialize(response, &queue);
+  } else {
+    apache::thrift::CompactSerializer::serialize(response, &queue);
+  }
+  return queue;
+}
+
+void decode(
+    SerializationProtocol protocol,
+    const folly::IOBuf* buf,
+    RankingResponse& response) {
+  if (protocol == SerializationProtocol::kBinary) {
+    apache::thrift::BinarySerializer::deserialize(buf, response);
+  } else {
+    apache::thrift::CompactSerializer::deserialize(buf, response);
+  }
+}
+
+// Reads the weight and object count of one RankingStory, skipping over the
+// objects themselves.
+void readStoryInPlace(
+    apache::thrift::CompactProtocolReader& reader,
+    RankingResponseSummary& summary) {
+  std::string name;
+  TType type;
+  int16_t id;
+  uint64_t objects = 0;
+  double weight = 0;
+  reader.readStructBegin(name);
+  for (;;) {
+    reader.readFieldBegin(name, type, id);
+    if (type == TType::T_STOP) {
+      break;
+    }
+    if (id == kStoryObjectsField && type == TType::T_LIST) {
+      TType elemType;
+      uint32_t size;
+      reader.readListBegin(elemType, size);
+      for (uint32_t i = 0; i < size; i++) {
+        reader.skip(elemType);
+      }
+      reader.readListEnd();
+      objects = size;
+    } else if (id == kStoryWeightField && type == TType::T_DOUBLE) {
+      reader.readDouble(weight);
+    } else {
+      reader.skip(type);
+    }
+    reader.readFieldEnd();
+  }
+  reader.readStructEnd();
+  addStory(summary, objects, weight);
+}
+
+RankingResponseSummary summarizeInPlace(const folly::IOBuf* buf) {
+  apache::thrift::CompactProtocolReader reader;
+  reader.setInput(buf);
+  RankingResponseSummary summary;
+  std::string name;
+  TType type;
+  int16_t id;
+  reader.readStructBegin(name);
+  for (;;) {
+    reader.readFieldBegin(name, type, id);
+    if (type == TType::T_STOP) {
+      break;
+    }
+    if (id == kResponseQueryIdField && type == TType::T_I64) {
+      reader.readI64(summary.queryID);
+    } else if (id == kResponseStoriesField && type == TType::T_LIST) {
+      TType elemType;
+      uint32_t size;
+      reader.readListBegin(elemType, size);
+      if (elemType != TType::T_STRUCT) {
+        throw std::runtime_error("rankingStories is not a list of structs");
+      }
+      for (uint32_t i = 0; i < size; i++) {
+        readStoryInPlace(reader, summary);
+      }
+      reader.readListEnd();
+    } else {
+      reader.skip(type);
+    }
+    reader.readFieldEnd();
+  }
+  reader.readStructEnd();
+  return summary;
+}
+
+RankingResponseSummary summarizeWith(
+    SerializationProtocol protocol,
+    const folly::IOBuf* buf) {
+  if (protocol == SerializationProtocol::kView) {
+    return summarizeInPlace(buf);
+  }
+  RankingResponse response;
+  decode(protocol, buf, response);
+  RankingResponseSummary summary;
+  summary.queryID = response.queryID;
+  for (const auto& story : response.rankingStories) {
+    addStory(summary, story.objects.size(), story.weight);
+  }
+  return summary;
+}
+
+} // namespace
+
+SerializationProtocol parseSerializationProtocol(const std::string& name) {
+  if (name == "compact") {
+    return SerializationProtocol::kCompact;
+  }
+  if (name == "binary") {
+    return SerializationProtocol::kBinary;
+  }
+  if (name == "view") {
+    return SerializationProtocol::kView;
+  }
+  throw std::invalid_argument("unknown serialization protocol: " + name);
+}
+
+const char* serializationProtocolName(SerializationProtocol protocol) {
+  switch (protocol) {
+    case SerializationProtocol::kCompact:
+      return "compact";
+    case SerializationProtocol::kBinary:
+      return "binary";
+    case SerializationProtocol::kView:
+      return "view";
+  }
+  return "unknown";
+}
+
+double SerializationStats::encodeThroughputMBps() const {
+  return encodeNanos == 0
+      ? 0.0
+      : static_cast<double>(encodeBytes) * 1e3 / encodeNanos;
+}
+
+double SerializationStats::decodeThroughputMBps() const {
+  return decodeNanos == 0
+      ? 0.0
+      : static_cast<double>(decodeBytes) * 1e3 / decodeNanos;
+}
+
+void PayloadSerializer::configure(SerializationProtocol protocol) {
+  globalProtocol() = protocol;
+}
+
+SerializationProtocol PayloadSerializer::protocol() {
+  return globalProtocol();
+}
+
+folly::IOBufQueue PayloadSerializer::serialize(
+    const RankingResponse& response) {
+  const auto start = Clock::now();
+  auto queue = encode(globalProtocol(), response);
+  const uint64_t nanos = nanosSince(start);
+  auto& stats = localStats();
+  stats.encodes.fetch_add(1, std::memory_order_relaxed);
+  stats.encodeBytes.fetch_add(queue.chainLength(), std::memory_order_relaxed);
+  stats.encodeNanos.fetch_add(nanos, std::memory_order_relaxed);
+  return queue;
+}
+
+void PayloadSerializer::deserialize(
+    const folly::IOBuf* buf,
+    RankingResponse& response) {
+  const auto start = Clock::now();
+  decode(globalProtocol(), buf, response);
+  const uint64_t nanos = nanosSince(start);
+  auto& stats = localStats();
+  stats.decodes.fetch_add(1, std::memory_order_relaxed);
+  stats.decodeBytes.fetch_add(
+      buf->computeChainDataLength(), std::memory_order_relaxed);
+  stats.decodeNanos.fetch_add(nanos, std::memory_order_relaxed);
+}
+
+RankingResponseSummary PayloadSerializer::summarize(const folly::IOBuf* buf) {
+  const auto start = Clock::now();
+  const auto summary = summarizeWith(globalProtocol(), buf);
+  const uint64_t nanos = nanosSince(start);
+  auto& stats = localStats();
+  stats.decodes.fetch_add(1, std::memory_order_relaxed);
+  stats.decodeBytes.fetch_add(
+      buf->computeChainDataLength(), std::memory_order_relaxed);
+  stats.decodeNanos.fetch_add(nanos, std::memory_order_relaxed);
+  return summary;
+}
+
+SerializationStats PayloadSerializer::aggregateStats() {
+  auto& registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  SerializationStats total;
+  for (const auto& thread : registry.threads) {
+    total.encodes += thread->encodes.load(std::memory_order_relaxed);
+    total.encodeBytes += thread->encodeBytes.load(std::memory_order_relaxed);
+    total.encodeNanos += thread->encodeNanos.load(std::memory_order_relaxed);
+    total.decodes += thread->decodes.load(std::memory_order_relaxed);
+    total.decodeBytes += thread->decodeBytes.load(std::memory_order_relaxed);
+    total.decodeNanos += thread->decodeNanos.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+std::array<SerializationStats, 3> PayloadSerializer::benchmark(
+    const RankingResponse& response,
+    int iterations) {
+  std::array<SerializationStats, 3> results;
+  for (auto protocol :
+       {SerializationProtocol::kCompact,
+        SerializationProtocol::kBinary,
+        SerializationProtocol::kView}) {
+    auto& stats = results[static_cast<size_t>(protocol)];
+    for (int i = 0; i < iterations; i++) {
+      auto start = Clock::now();
+      auto buf = encode(protocol, response).move();
+      stats.encodeNanos += nanosSince(start);
+      const uint64_t bytes = buf->computeChainDataLength();
+      start = Clock::now();
+      const auto summary = summarizeWith(protocol, buf.get());
+      stats.decodeNanos += nanosSince(start);
+      // Checking the result also keeps the decode from being optimized out
+      if (summary.stories != response.rankingStories.size()) {
+        throw std::runtime_error(
+            std::string(serializationProtocolName(protocol)) +
+            " round trip lost stories");
+      }
+      stats.encodes++;
+      stats.encodeBytes += bytes;
+      stats.decodes++;
+      stats.decodeBytes += bytes;
+    }
+  }
+  return results;
+}
+
+} // namespace ranking
@@ -0,0 +1,93 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include <folly/io/IOBuf.h>
+#include <folly/io/IOBufQueue.h>
+
+#include "if/gen-cpp2/ranking_types.h"
+
+namespace ranking {
+
+// Wire protocols a RankingResponse can be serialized with. kView writes the
+// compact protocol but reads it in place instead of materializing a
+// RankingResponse.
+enum class SerializationProtocol { kCompact, kBinary, kView };
+
+// Returns the protocol named "compact", "binary" or "view". Throws
+// std::invalid_argument for any other name.
+SerializationProtocol parseSerializationProtocol(const std::string& name);
+
+const char* serializationProtocolName(SerializationProtocol protocol);
+
+// The fields a consumer of a response reads: enough to merge or rank the
+// stories without keeping their objects.
+struct RankingResponseSummary {
+  int64_t queryID = 0;
+  uint32_t stories = 0;
+  uint64_t objects = 0;
+  double maxStoryWeight = 0;
+};
+
+// Encode and decode work summed over every thread.
+struct SerializationStats {
+  uint64_t encodes = 0;
+  uint64_t encodeBytes = 0;
+  uint64_t encodeNanos = 0;
+  uint64_t decodes = 0;
+  uint64_t decodeBytes = 0;
+  uint64_t decodeNanos = 0;
+
+  // Serialized megabytes written or read per second of serializer time; 0
+  // before the first call.
+  double encodeThroughputMBps() const;
+  double decodeThroughputMBps() const;
+};
+
+// Serializes and deserializes RankingResponses with the protocol selected by
+// configure(), timing every call into per-thread counters.
+class PayloadSerializer {
+public:
+  // Sets the protocol of every thread. Must be called before serializing.
+  static void configure(SerializationProtocol protocol);
+
+  static SerializationProtocol protocol();
+
+  static folly::IOBufQueue serialize(const RankingResponse& response);
+
+  // Materializes the whole response. kView payloads are decoded with the
+  // compact protocol they are written in. Throws if buf is malformed.
+  static void deserialize(const folly::IOBuf* buf, RankingResponse& response);
+
+  // Reads the summary of a serialized response. kView walks the payload in
+  // place and skips objects without allocating; the other protocols
+  // deserialize the whole response first. Throws if buf is malformed.
+  static RankingResponseSummary summarize(const folly::IOBuf* buf);
+
+  // Sums the stats of all threads, including those that have exited.
+  static SerializationStats aggregateStats();
+
+  // Encodes and summarizes response iterations times with every protocol
+  // and returns the stats of each, indexed by SerializationProtocol. Does not
+  // count towards aggregateStats().
+  static std::array<SerializationStats, 3> benchmark(
+      const RankingResponse& response,
+      int iterations);
+};
+
+} // namespace ranking
@@ -0,0 +1,183 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "PoolSizing.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <utility>
+
+#include "oldisim/Log.h"
+
+namespace ranking {
+
+namespace {
+
+constexpr int kMaxServerThreads = 216;
+constexpr int kMaxSrvIOThreads = 55;
+constexpr int kSrvCPUThreads = 8;
+constexpr int kIOThreads = 4;
+constexpr int kTimekeeperThreads = 2;
+
+// The cgroup v2 path of this process, from its "0::" line.
+std::string cgroupV2Path() {
+  std::ifstream cgroups("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(cgroups, line)) {
+    if (line.compare(0, 3, "0::") == 0) {
+      return line.substr(3);
+    }
+  }
+  return "";
+}
+
+// The CPU quota in CPUs, or 0 if there is none.
+double cgroupCpuQuota() {
+  for (const std::string& dir :
+       {"/sys/fs/cgroup" + cgroupV2Path(), std::string("/sys/fs/cgroup")}) {
+    std::ifstream cpuMax(dir + "/cpu.max");
+    std::string quota;
+    double period = 0;
+    if (cpuMax >> quota >> period) {
+      return quota == "max" || period <= 0 ? 0 : std::stod(quota) / period;
+    }
+  }
+  for (const char* dir :
+       {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"}) {
+    std::ifstream quotaFile(std::string(dir) + "/cpu.cfs_quota_us");
+    std::ifstream periodFile(std::string(dir) + "/cpu.cfs_period_us");
+    double quota = 0;
+    double period = 0;
+    if (quotaFile >> quota && periodFile >> period) {
+      return quota <= 0 || period <= 0 ? 0 : quota / period;
+    }
+  }
+  return 0;
+}
+
+} // namespace
+
+int availableCpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  int cpus = 1;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    cpus = std::max(1, CPU_COUNT(&allowed));
+  }
+  const double quota = cgroupCpuQuota();
+  if (quota > 0) {
+    cpus = std::min(cpus, std::max(1, static_cast<int>(std::ceil(quota))));
+  }
+  return cpus;
+}
+
+bool smtActive() {
+  std::ifstream active("/sys/devices/system/cpu/smt/active");
+  int value = 0;
+  return active >> value && value == 1;
+}
+
+AutoPoolSizes autoPoolSizes(int numCpus, bool smt) {
+  AutoPoolSizes sizes;
+  sizes.threads = std::min(numCpus, kMaxServerThreads);
+  sizes.pools.cpuThreads = std::max(1, numCpus * (smt ? 7 : 15) / 20);
+  sizes.pools.srvCPUThreads = std::min(numCpus, kSrvCPUThreads);
+  sizes.pools.srvIOThreads =
+      std::max(1, std::min(numCpus * (smt ? 7 : 11) / 20, kMaxSrvIOThreads));
+  sizes.pools.ioThreads = std::min(numCpus, kIOThreads);
+  sizes.timekeeperThreads = std::min(numCpus, kTimekeeperThreads);
+  return sizes;
+}
+
+PoolRebalancer::PoolRebalancer(
+    std::vector<ExecutorPools> pools,
+    std::chrono::milliseconds interval)
+    : executorPools_(std::move(pools)), interval_(interval) {
+  for (const auto& set : executorPools_) {
+    std::vector<Pool> setPools;
+    for (const auto& pool :
+         {std::make_pair(set.cpuThreadPool.get(), "cpu"),
+          std::make_pair(set.srvCPUThreadPool.get(), "srv_cpu"),
+          std::make_pair(set.srvIOThreadPool.get(), "srv_io")}) {
+      setPools.push_back(Pool{
+          pool.first,
+          pool.second,
+          std::max<size_t>(1, pool.first->numThreads() / 2)});
+    }
+    pools_.push_back(std::move(setPools));
+  }
+  thread_ = std::thread([this]() { run(); });
+}
+
+PoolRebalancer::~PoolRebalancer() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  stopCv_.notify_all();
+  thread_.join();
+}
+
+void PoolRebalancer::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopCv_.wait_for(lock, interval_, [this]() { return stopping_; })) {
+    for (auto& setPools : pools_) {
+      rebalance(setPools);
+    }
+  }
+}
+
+void PoolRebalancer::rebalance(std::vector<Pool>& pools) {
+  // Queued tasks per thread of each pool, read once for a consistent choice
+  std::vector<double> load;
+  for (const auto& pool : pools) {
+    load.push_back(
+        static_cast<double>(pool.executor->getPendingTaskCount()) /
+        pool.executor->numThreads());
+  }
+
+  size_t receiver = 0;
+  for (size_t i = 1; i < pools.size(); i++) {
+    if (load[i] > load[receiver]) {
+      receiver = i;
+    }
+  }
+  // Only pools with at least a task queued for every thread are short
+  if (load[receiver] < 1) {
+    return;
+  }
+  for (size_t donor = 0; donor < pools.size(); donor++) {
+    const size_t donorThreads = pools[donor].executor->numThreads();
+    if (donor == receiver || load[donor] > 0 ||
+        donorThreads <= pools[donor].minThreads) {
+      continue;
+    }
+    pools[donor].executor->setNumThreads(donorThreads - 1);
+    pools[receiver].executor->setNumThreads(
+        pools[receiver].executor->numThreads() + 1);
+    D("Moved a thread from the %s pool (%zu threads) to the %s pool "
+      "(%.1f tasks queued per thread)",
+      pools[donor].name,
+      donorThreads - 1,
+      pools[receiver].name,
+      load[receiver]);
+    return;
+  }
+}
+
+} // namespace ranking
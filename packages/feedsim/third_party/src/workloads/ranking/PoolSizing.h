@@ -0,0 +1,79 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ExecutorPools.h"
+
+namespace ranking {
+
+// CPUs the process may run on: the affinity mask, capped by the cgroup CPU
+// quota rounded up. cgroup v2 cpu.max is read before the v1 CFS quota.
+int availableCpus();
+
+// Whether /sys reports SMT siblings as active.
+bool smtActive();
+
+struct AutoPoolSizes {
+  int threads;
+  ExecutorPoolSizes pools;
+  int timekeeperThreads;
+};
+
+// Thread counts for numCpus CPUs, following the ratios run.sh used to work
+// out by hand: a server thread per CPU up to 216, 35% (75% without SMT) of
+// the CPUs for ranking work, 35% (55%) up to 55 for srv IO work, and fixed
+// small srv CPU, IO and timekeeper pools.
+AutoPoolSizes autoPoolSizes(int numCpus, bool smt);
+
+// Moves threads between the CPU, srv CPU and srv IO pools of every set of
+// pools, one thread per set and interval, from a pool with nothing queued to
+// the pool with the most tasks queued per thread. The total number of
+// threads of a set stays the same, and no pool drops below half its
+// starting size.
+class PoolRebalancer {
+public:
+  PoolRebalancer(
+      std::vector<ExecutorPools> pools,
+      std::chrono::milliseconds interval);
+  ~PoolRebalancer();
+
+  PoolRebalancer(const PoolRebalancer &) = delete;
+  PoolRebalancer &operator=(const PoolRebalancer &) = delete;
+
+private:
+  struct Pool {
+    folly::CPUThreadPoolExecutor *executor;
+    const char *name;
+    size_t minThreads;
+  };
+
+  void run();
+  static void rebalance(std::vector<Pool> &pools);
+
+  std::vector<ExecutorPools> executorPools_;
+  std::vector<std::vector<Pool>> pools_;
+  std::chrono::milliseconds interval_;
+  std::mutex mutex_;
+  std::condition_variable stopCv_;
+  bool stopping_{false};
+  std::thread thread_;
+};
+
+} // namespace ranking
@@ -0,0 +1,208 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "QpsSearch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+namespace ranking {
+
+namespace {
+
+// Geometric ramp until the search brackets the target.
+constexpr double kRampFactor = 2.0;
+
+// Writes value as a JSON number, with null for values JSON cannot hold.
+void writeNumber(std::ostream& out, double value) {
+  if (std::isfinite(value)) {
+    out << value;
+  } else {
+    out << "null";
+  }
+}
+
+} // namespace
+
+void parseQpsSearchTarget(const std::string& spec, QpsSearchOptions& options) {
+  const size_t colon = spec.find(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument(
+        "QPS search target must be <metric>:<ms>, got " + spec);
+  }
+  const std::string metric = spec.substr(0, colon);
+  const std::string target = spec.substr(colon + 1);
+
+  char* end = nullptr;
+  options.targetMs = std::strtod(target.c_str(), &end);
+  if (target.empty() || *end != '\0' || options.targetMs <= 0) {
+    throw std::invalid_argument("Invalid QPS search target latency " + target);
+  }
+
+  if (metric == "avg") {
+    options.percentile = -1;
+    return;
+  }
+  if (metric.size() < 2 || metric.back() != 'p') {
+    throw std::invalid_argument("Invalid QPS search metric " + metric);
+  }
+  const std::string percentile = metric.substr(0, metric.size() - 1);
+  options.percentile = std::strtod(percentile.c_str(), &end);
+  if (*end != '\0' || options.percentile <= 0 || options.percentile >= 100) {
+    throw std::invalid_argument("Invalid QPS search metric " + metric);
+  }
+}
+
+QpsSearch::QpsSearch(QpsSearchOptions options)
+    : options_(std::move(options)),
+      currentQps_(options_.startQps),
+      stepLatency_(oldisim::ChildConnectionStats::kHistogramSignificantDigits) {
+  if (options_.targetMs <= 0 || options_.startQps <= 0 ||
+      options_.minQps <= 0 || options_.maxQps < options_.minQps ||
+      options_.stepWindows <= 0 || options_.settleWindows < 0 ||
+      options_.tolerance <= 0 || options_.maxSteps <= 0) {
+    throw std::invalid_argument("Invalid QPS search options");
+  }
+  currentQps_ =
+      std::min(std::max(currentQps_, options_.minQps), options_.maxQps);
+}
+
+bool QpsSearch::addWindow(const oldisim::ChildConnectionStats& window) {
+  if (done_) {
+    return true;
+  }
+
+  windowsSeen_++;
+  if (windowsSeen_ <= options_.settleWindows) {
+    return false;
+  }
+  for (const auto& count : window.query_counts_) {
+    stepQueries_ += count.second;
+  }
+  for (const auto& sampler : window.query_samplers_) {
+    stepLatency_.accumulate(sampler.second);
+  }
+  if (windowsSeen_ == options_.settleWindows + options_.stepWindows) {
+    finishStep();
+  }
+  return done_;
+}
+
+double QpsSearch::latencyMs() const {
+  if (stepLatency_.total() == 0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  const double ns = options_.percentile < 0
+      ? stepLatency_.average()
+      : stepLatency_.get_nth(options_.percentile);
+  return ns / 1000000;
+}
+
+std::string QpsSearch::metricName() const {
+  if (options_.percentile < 0) {
+    return "avg";
+  }
+  std::ostringstream name;
+  name << options_.percentile << "p";
+  return name.str();
+}
+
+void QpsSearch::startStep(double qps) {
+  currentQps_ = qps;
+  windowsSeen_ = 0;
+  stepQueries_ = 0;
+  stepLatency_.Reset();
+}
+
+void QpsSearch::finishStep() {
+  Step step;
+  step.offeredQps = currentQps_;
+  step.achievedQps = static_cast<double>(stepQueries_) / options_.stepWindows;
+  step.latencyMs = latencyMs();
+  step.passed = step.latencyMs <= options_.targetMs &&
+      step.achievedQps >= options_.minAchievedFraction * step.offeredQps;
+  steps_.push_back(step);
+
+  if (step.passed) {
+    passQps_ = step.offeredQps;
+    passLatencyMs_ = step.latencyMs;
+  } else {
+    failQps_ = step.offeredQps;
+    failLatencyMs_ = step.latencyMs;
+  }
+
+  double next;
+  if (std::isinf(failQps_)) {
+    if (passQps_ >= options_.maxQps) {
+      done_ = true;
+      return;
+    }
+    next = std::min(passQps_ * kRampFactor, options_.maxQps);
+  } else if (passQps_ == 0) {
+    if (failQps_ <= options_.minQps) {
+      done_ = true;
+      return;
+    }
+    next = std::max(failQps_ / kRampFactor, options_.minQps);
+  } else {
+    if ((failQps_ - passQps_) / failQps_ <= options_.tolerance) {
+      converged_ = true;
+      done_ = true;
+      return;
+    }
+    // Interpolate the latency curve between the ends of the bracket; a
+    // failing step that was cut short by throughput has no usable latency
+    double fraction = 0.5;
+    if (std::isfinite(failLatencyMs_) && failLatencyMs_ > passLatencyMs_) {
+      fraction = (options_.targetMs - passLatencyMs_) /
+          (failLatencyMs_ - passLatencyMs_);
+    }
+    fraction = std::min(std::max(fraction, 0.25), 0.75);
+    next = passQps_ + fraction * (failQps_ - passQps_);
+  }
+
+  if (static_cast<int>(steps_.size()) >= options_.maxSteps) {
+    done_ = true;
+    return;
+  }
+  startStep(next);
+}
+
+void QpsSearch::writeReport(std::ostream& out) const {
+  out << "{\"metric\": \"" << metricName() << "\", \"target_ms\": ";
+  writeNumber(out, options_.targetMs);
+  out << ", \"converged\": " << (converged_ ? "true" : "false")
+      << ", \"qps\": ";
+  writeNumber(out, passQps_);
+  out << ", \"latency_ms\": ";
+  writeNumber(out, passQps_ > 0 ? passLatencyMs_ : NAN);
+  out << ", \"steps\": [";
+  for (size_t i = 0; i < steps_.size(); i++) {
+    const Step& step = steps_[i];
+    out << (i == 0 ? "" : ", ") << "{\"offered_qps\": ";
+    writeNumber(out, step.offeredQps);
+    out << ", \"achieved_qps\": ";
+    writeNumber(out, step.achievedQps);
+    out << ", \"latency_ms\": ";
+    writeNumber(out, step.latencyMs);
+    out << ", \"passed\": " << (step.passed ? "true" : "false") << "}";
+  }
+  out << "]}\n";
+}
+
+} // namespace ranking
@@ -0,0 +1,112 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "oldisim/ChildConnectionStats.h"
+#include "oldisim/HdrHistogram.h"
+
+namespace ranking {
+
+struct QpsSearchOptions {
+  // Latency metric held to the target: a percentile such as 99, or a
+  // negative value for the mean.
+  double percentile = 99;
+  double targetMs = 0;
+  double startQps = 100;
+  double minQps = 1;
+  double maxQps = 1e7;
+  // Windows discarded after every QPS change while queues settle.
+  int settleWindows = 2;
+  // Windows measured at every QPS.
+  int stepWindows = 10;
+  // The search stops once the passing and failing QPS are this close,
+  // relative to the failing one.
+  double tolerance = 0.02;
+  int maxSteps = 30;
+  // A step fails if it achieves less than this fraction of the offered QPS,
+  // e.g. because the driver itself cannot keep up.
+  double minAchievedFraction = 0.9;
+};
+
+// Parses "<metric>:<target ms>" with a metric of avg, 50p, 90p, 95p, 99p or
+// 99.9p, as taken by scripts/search_qps.sh -s, into options. Throws
+// std::invalid_argument if spec is malformed.
+void parseQpsSearchTarget(const std::string& spec, QpsSearchOptions& options);
+
+// Finds the highest QPS whose latency meets a target, fed with the stats of
+// consecutive one second windows of a single run.
+//
+// The QPS ramps geometrically from the start QPS until a step passes and a
+// step fails, and the bracket between the two then shrinks by interpolating
+// the measured latencies. Interpolated steps are clamped to the middle half
+// of the bracket, so every step shrinks it by at least a quarter however
+// sharply latency climbs near saturation.
+class QpsSearch {
+public:
+  explicit QpsSearch(QpsSearchOptions options);
+
+  // QPS the search wants offered now.
+  double targetQps() const {
+    return currentQps_;
+  }
+
+  // Takes the stats of the latest window. Returns true once the search has
+  // finished, after which targetQps() no longer changes.
+  bool addWindow(const oldisim::ChildConnectionStats& window);
+
+  bool done() const {
+    return done_;
+  }
+
+  // Writes the result and every step as a JSON object.
+  void writeReport(std::ostream& out) const;
+
+private:
+  struct Step {
+    double offeredQps;
+    double achievedQps;
+    double latencyMs;
+    bool passed;
+  };
+
+  // Measures the step that just ended and picks the next QPS.
+  void finishStep();
+  void startStep(double qps);
+  double latencyMs() const;
+  std::string metricName() const;
+
+  const QpsSearchOptions options_;
+  double currentQps_;
+  bool done_ = false;
+  bool converged_ = false;
+
+  int windowsSeen_ = 0;
+  uint64_t stepQueries_ = 0;
+  oldisim::HdrHistogram stepLatency_;
+  std::vector<Step> steps_;
+
+  // Highest passing and lowest failing QPS so far, with their latencies.
+  double passQps_ = 0;
+  double passLatencyMs_ = 0;
+  double failQps_ = std::numeric_limits<double>::infinity();
+  double failLatencyMs_ = 0;
+};
+
+} // namespace ranking
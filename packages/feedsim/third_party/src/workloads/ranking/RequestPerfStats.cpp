@@ -0,0 +1,101 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "RequestPerfStats.h"
+
+namespace ranking {
+
+void RequestPerfStats::add(
+    uint32_t type,
+    int stage,
+    const oldisim::PerfCounterValues& counts) {
+  std::lock_guard<std::mutex> guard(lock_);
+  totals_[std::make_pair(type, stage)] += counts;
+}
+
+void RequestPerfStats::addMonitoringStats(
+    std::map<std::string, double>& out) const {
+  std::map<uint32_t, oldisim::PerfCounterValues> typeTotals;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (const auto& entry : totals_) {
+      const uint32_t type = entry.first.first;
+      const int stage = entry.first.second;
+      typeTotals[type] += entry.second;
+      if (stage == kWholeHandler) {
+        continue;
+      }
+      const std::string prefix = "perf_type" + std::to_string(type) + "_" +
+          pipelineStageName(static_cast<PipelineStage>(stage)) + "_";
+      for (int c = 0; c < oldisim::kNumPerfCounters; c++) {
+        const auto counter = static_cast<oldisim::PerfCounter>(c);
+        out[prefix + oldisim::PerfCounterGroup::CounterName(counter)] =
+            entry.second[counter];
+      }
+    }
+  }
+
+  for (const auto& entry : typeTotals) {
+    const std::string prefix = "perf_type" + std::to_string(entry.first) + "_";
+    const auto& counts = entry.second;
+    for (int c = 0; c < oldisim::kNumPerfCounters; c++) {
+      const auto counter = static_cast<oldisim::PerfCounter>(c);
+      out[prefix + oldisim::PerfCounterGroup::CounterName(counter)] =
+          counts[counter];
+    }
+    const double cycles = counts[oldisim::PerfCounter::kCycles];
+    const double kiloInstructions =
+        counts[oldisim::PerfCounter::kInstructions] / 1000.0;
+    if (cycles > 0) {
+      out[prefix + "ipc"] =
+          counts[oldisim::PerfCounter::kInstructions] / cycles;
+    }
+    if (kiloInstructions > 0) {
+      out[prefix + "l1i_mpki"] =
+          counts[oldisim::PerfCounter::kL1ICacheMisses] / kiloInstructions;
+      out[prefix + "llc_mpki"] =
+          counts[oldisim::PerfCounter::kLLCMisses] / kiloInstructions;
+      out[prefix + "branch_mpki"] =
+          counts[oldisim::PerfCounter::kBranchMisses] / kiloInstructions;
+      out[prefix + "dtlb_mpki"] =
+          counts[oldisim::PerfCounter::kDTLBMisses] / kiloInstructions;
+    }
+  }
+}
+
+const oldisim::PerfCounterGroup& RequestPerfStats::threadCounters() {
+  static thread_local oldisim::PerfCounterGroup counters;
+  return counters;
+}
+
+PerfCounterScope::PerfCounterScope(
+    RequestPerfStats* stats,
+    uint32_t type,
+    int stage)
+    : stats_(stats), type_(type), stage_(stage) {
+  if (stats_ != nullptr) {
+    start_ = RequestPerfStats::threadCounters().Read();
+  }
+}
+
+PerfCounterScope::~PerfCounterScope() {
+  if (stats_ == nullptr) {
+    return;
+  }
+  auto counts = RequestPerfStats::threadCounters().Read();
+  counts -= start_;
+  stats_->add(type_, stage_, counts);
+}
+
+} // namespace ranking
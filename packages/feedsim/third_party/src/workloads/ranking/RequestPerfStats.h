@@ -0,0 +1,80 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "oldisim/PerfCounters.h"
+
+#include "StageLatency.h"
+
+namespace ranking {
+
+// Hardware counter totals by request type and pipeline stage, summed over
+// the server thread and every helper thread that worked on the requests.
+class RequestPerfStats {
+public:
+  void add(
+      uint32_t type,
+      int stage,
+      const oldisim::PerfCounterValues& counts);
+
+  // Adds "perf_type<type>_<counter>" totals and ipc / per-kilo-instruction
+  // miss rates for every request type, and the totals of each pipeline stage
+  // as "perf_type<type>_<stage>_<counter>".
+  void addMonitoringStats(std::map<std::string, double>& out) const;
+
+  // The calling thread's counter group, opened on first use.
+  static const oldisim::PerfCounterGroup& threadCounters();
+
+  // Stage of handlers that are not split into pipeline stages.
+  static constexpr int kWholeHandler = -1;
+
+private:
+  mutable std::mutex lock_;
+  std::map<std::pair<uint32_t, int>, oldisim::PerfCounterValues> totals_;
+};
+
+// Counts the calling thread's events from construction to destruction and
+// adds them to stats. Does nothing if stats is null.
+class PerfCounterScope {
+public:
+  PerfCounterScope(RequestPerfStats* stats, uint32_t type)
+      : PerfCounterScope(stats, type, RequestPerfStats::kWholeHandler) {}
+
+  PerfCounterScope(
+      RequestPerfStats* stats,
+      uint32_t type,
+      PipelineStage stage)
+      : PerfCounterScope(stats, type, static_cast<int>(stage)) {}
+
+  ~PerfCounterScope();
+
+  PerfCounterScope(const PerfCounterScope&) = delete;
+  PerfCounterScope& operator=(const PerfCounterScope&) = delete;
+
+private:
+  PerfCounterScope(RequestPerfStats* stats, uint32_t type, int stage);
+
+  RequestPerfStats* stats_;
+  uint32_t type_;
+  int stage_;
+  oldisim::PerfCounterValues start_;
+};
+
+} // namespace ranking
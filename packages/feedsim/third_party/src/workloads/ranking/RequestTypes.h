@@ -15,9 +15,23 @@
 #ifndef REQUEST_TYPES_H
 #define REQUEST_TYPES_H
 
+#include <cstdint>
+
 namespace ranking {
 
+// Full ranking: PageRank, IO wait, compression and a serialized response.
 static const int kPageRankRequestType = 0;
+// A single PageRank sweep over a small subset, run on the server thread.
+static const int kLightRankRequestType = 1;
+// A short pointer chase answered with a small payload, like a cache lookup.
+static const int kCacheProbeRequestType = 2;
+// One superstep of a PageRank over a graph partitioned across the leafs,
+// driven by the parent; see SuperstepMessages.h.
+static const int kDistributedRankRequestType = 3;
+
+// Requests sent with a result cache key carry it in the first
+// kRequestKeySize bytes of the payload, in host byte order.
+static const int kRequestKeySize = sizeof(uint64_t);
 } // namespace ranking
 
 #endif // REQUEST_TYPES_H
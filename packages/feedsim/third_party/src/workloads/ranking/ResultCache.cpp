@@ -0,0 +1,151 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ResultCache.h"
+
+#include <algorithm>
+
+namespace ranking {
+
+double ResultCacheStats::hitRatio() const {
+  const auto lookups = hits + misses;
+  return lookups == 0 ? 0 : static_cast<double>(hits) / lookups;
+}
+
+ResultCache::ResultCache(
+    ResultCachePolicy policy,
+    size_t capacity,
+    size_t numShards)
+    : policy_(policy),
+      shardCapacity_(
+          std::max<size_t>(1, capacity / std::max<size_t>(1, numShards))) {
+  numShards = std::max<size_t>(1, numShards);
+  shards_.reserve(numShards);
+  for (size_t i = 0; i < numShards; i++) {
+    shards_.push_back(std::make_unique<Shard>());
+    if (policy_ == ResultCachePolicy::kClock) {
+      shards_.back()->ring.reserve(shardCapacity_);
+    }
+  }
+}
+
+ResultCache::Shard& ResultCache::shardFor(uint64_t key) {
+  // Driver keys are small dense integers, so mix them before picking a shard
+  key *= 0x9e3779b97f4a7c15ULL;
+  return *shards_[(key >> 32) % shards_.size()];
+}
+
+std::unique_ptr<folly::IOBuf> ResultCache::get(uint64_t key) {
+  auto& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  if (policy_ == ResultCachePolicy::kLru) {
+    auto it = shard.lruIndex.find(key);
+    if (it == shard.lruIndex.end()) {
+      shard.stats.misses++;
+      return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    shard.stats.hits++;
+    return it->second->value->clone();
+  }
+
+  auto it = shard.ringIndex.find(key);
+  if (it == shard.ringIndex.end()) {
+    shard.stats.misses++;
+    return nullptr;
+  }
+  auto& entry = shard.ring[it->second];
+  entry.referenced = true;
+  shard.stats.hits++;
+  return entry.value->clone();
+}
+
+void ResultCache::put(uint64_t key, const folly::IOBuf& value) {
+  const size_t bytes = value.computeChainDataLength();
+  auto& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  if (policy_ == ResultCachePolicy::kLru) {
+    auto it = shard.lruIndex.find(key);
+    if (it != shard.lruIndex.end()) {
+      shard.stats.bytes -= it->second->bytes;
+      shard.lru.erase(it->second);
+      shard.lruIndex.erase(it);
+      shard.stats.entries--;
+    } else if (shard.lru.size() >= shardCapacity_) {
+      auto& victim = shard.lru.back();
+      shard.stats.bytes -= victim.bytes;
+      shard.lruIndex.erase(victim.key);
+      shard.lru.pop_back();
+      shard.stats.entries--;
+      shard.stats.evictions++;
+    }
+    shard.lru.push_front(Entry{key, value.clone(), bytes, false});
+    shard.lruIndex.emplace(key, shard.lru.begin());
+    shard.stats.entries++;
+    shard.stats.bytes += bytes;
+    return;
+  }
+
+  size_t slot;
+  auto it = shard.ringIndex.find(key);
+  if (it != shard.ringIndex.end()) {
+    slot = it->second;
+    shard.stats.bytes -= shard.ring[slot].bytes;
+  } else {
+    if (shard.ring.size() < shardCapacity_) {
+      slot = shard.ring.size();
+      shard.ring.emplace_back();
+    } else {
+      slot = evictClock(shard);
+    }
+    shard.ringIndex.emplace(key, slot);
+    shard.stats.entries++;
+  }
+  // New entries start unreferenced, so a key that is never hit again is the
+  // first to go
+  shard.ring[slot] = Entry{key, value.clone(), bytes, false};
+  shard.stats.bytes += bytes;
+}
+
+size_t ResultCache::evictClock(Shard& shard) {
+  while (shard.ring[shard.hand].referenced) {
+    shard.ring[shard.hand].referenced = false;
+    shard.hand = (shard.hand + 1) % shard.ring.size();
+  }
+  const size_t slot = shard.hand;
+  shard.hand = (shard.hand + 1) % shard.ring.size();
+
+  auto& victim = shard.ring[slot];
+  shard.stats.bytes -= victim.bytes;
+  shard.ringIndex.erase(victim.key);
+  victim.value.reset();
+  shard.stats.entries--;
+  shard.stats.evictions++;
+  return slot;
+}
+
+ResultCacheStats ResultCache::stats() const {
+  ResultCacheStats total;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard->lock);
+    total.hits += shard->stats.hits;
+    total.misses += shard->stats.misses;
+    total.evictions += shard->stats.evictions;
+    total.entries += shard->stats.entries;
+    total.bytes += shard->stats.bytes;
+  }
+  return total;
+}
+
+} // namespace ranking
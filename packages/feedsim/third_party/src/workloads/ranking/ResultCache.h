@@ -0,0 +1,95 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <folly/io/IOBuf.h>
+
+namespace ranking {
+
+enum class ResultCachePolicy { kLru, kClock };
+
+struct ResultCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t entries = 0;
+  uint64_t bytes = 0;
+
+  // Fraction of lookups that hit; 0 before the first lookup.
+  double hitRatio() const;
+};
+
+// Serialized responses keyed by the request key, shared by all server
+// threads. Keys are hashed onto shards that each have their own lock and
+// their own slice of the capacity, so threads only contend when they touch
+// the same shard. Values are IOBuf chains; lookups hand out clones that share
+// the cached buffers, so a hit copies no payload.
+class ResultCache {
+public:
+  // capacity is the total number of entries, split evenly over numShards.
+  ResultCache(ResultCachePolicy policy, size_t capacity, size_t numShards);
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Returns the cached value for key, or nullptr on a miss.
+  std::unique_ptr<folly::IOBuf> get(uint64_t key);
+
+  // Caches value under key, evicting an entry of the shard if it is full.
+  // Replaces the value already cached under key, if any.
+  void put(uint64_t key, const folly::IOBuf& value);
+
+  ResultCacheStats stats() const;
+
+private:
+  struct Entry {
+    uint64_t key;
+    std::unique_ptr<folly::IOBuf> value;
+    size_t bytes;
+    // Second-chance bit of the CLOCK policy.
+    bool referenced;
+  };
+
+  // Padded to a cache line so neighbouring shard locks do not false share.
+  struct alignas(64) Shard {
+    std::mutex lock;
+    // LRU keeps entries in recency order, most recent first. CLOCK keeps a
+    // fixed ring of slots swept by hand.
+    std::list<Entry> lru;
+    std::vector<Entry> ring;
+    size_t hand = 0;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> lruIndex;
+    std::unordered_map<uint64_t, size_t> ringIndex;
+    ResultCacheStats stats;
+  };
+
+  Shard& shardFor(uint64_t key);
+
+  // Evict and return the slot to reuse in a full CLOCK shard.
+  size_t evictClock(Shard& shard);
+
+  const ResultCachePolicy policy_;
+  const size_t shardCapacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // namespace ranking
@@ -0,0 +1,225 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "StageCalibration.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#include <folly/FileUtil.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+#include "oldisim/Log.h"
+
+namespace ranking {
+namespace {
+
+// Timed runs per measurement, after the warmup run
+const int kMeasureRuns = 5;
+const int kMaxCalibrationRounds = 6;
+// Close enough to the target to stop rescaling
+const double kCalibrationTolerance = 0.05;
+
+int64_t clampKnob(const CalibrationKnob& knob, double value) {
+  if (!(value > knob.minValue)) {
+    return knob.minValue;
+  }
+  if (value >= knob.maxValue) {
+    return knob.maxValue;
+  }
+  return std::llround(value);
+}
+
+double budgetValue(
+    const std::string& stage,
+    const std::string& key,
+    const folly::dynamic& value) {
+  if (!value.isNumber()) {
+    throw std::invalid_argument(
+        "calibration profile " + stage + "." + key + " must be a number");
+  }
+  const double number = value.asDouble();
+  if (number < 0) {
+    throw std::invalid_argument(
+        "calibration profile " + stage + "." + key + " must not be negative");
+  }
+  return number;
+}
+
+} // namespace
+
+CalibrationProfile parseCalibrationProfile(const std::string& json) {
+  folly::dynamic parsed;
+  try {
+    parsed = folly::parseJson(json);
+  } catch (const std::exception& e) {
+    throw std::invalid_argument(
+        std::string("calibration profile is not valid JSON: ") + e.what());
+  }
+  if (!parsed.isObject() || parsed.count("stages") == 0 ||
+      !parsed["stages"].isObject()) {
+    throw std::invalid_argument(
+        "calibration profile needs a \"stages\" object");
+  }
+
+  CalibrationProfile profile;
+  for (const auto& entry : parsed["stages"].items()) {
+    const std::string name = entry.first.asString();
+    size_t index = 0;
+    while (index < kNumPipelineStages &&
+           name != pipelineStageName(static_cast<PipelineStage>(index))) {
+      index++;
+    }
+    if (index == kNumPipelineStages) {
+      throw std::invalid_argument(
+          "calibration profile has an unknown stage " + name);
+    }
+    if (!entry.second.isObject()) {
+      throw std::invalid_argument(
+          "calibration profile stage " + name + " must be an object");
+    }
+    StageBudget budget;
+    for (const auto& field : entry.second.items()) {
+      const std::string key = field.first.asString();
+      if (key == "cpu_us") {
+        budget.cpuUs = budgetValue(name, key, field.second);
+      } else if (key == "bytes") {
+        budget.bytes = budgetValue(name, key, field.second);
+      } else if (key == "off_cpu_us") {
+        budget.offCpuUs = budgetValue(name, key, field.second);
+      } else {
+        throw std::invalid_argument(
+            "calibration profile has an unknown budget " + name + "." + key);
+      }
+    }
+    profile.stages[static_cast<PipelineStage>(index)] = budget;
+  }
+  return profile;
+}
+
+CalibrationProfile loadCalibrationProfile(const std::string& path) {
+  std::string json;
+  if (!folly::readFile(path.c_str(), json)) {
+    throw std::runtime_error("could not read calibration profile " + path);
+  }
+  return parseCalibrationProfile(json);
+}
+
+double threadCpuMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+double measureKnob(const CalibrationKnob& knob, int64_t value) {
+  knob.run(value);
+  std::vector<double> runs;
+  for (int i = 0; i < kMeasureRuns; i++) {
+    const double start = threadCpuMicros();
+    knob.run(value);
+    runs.push_back(threadCpuMicros() - start);
+  }
+  std::nth_element(runs.begin(), runs.begin() + runs.size() / 2, runs.end());
+  return runs[runs.size() / 2];
+}
+
+int64_t calibrateKnob(
+    const CalibrationKnob& knob,
+    int64_t value,
+    double targetCpuUs,
+    double* achievedCpuUs) {
+  value = clampKnob(knob, value);
+  double cost = measureKnob(knob, value);
+  for (int round = 0; round < kMaxCalibrationRounds &&
+       std::abs(cost - targetCpuUs) > kCalibrationTolerance * targetCpuUs;
+       round++) {
+    // A run too short to register on the clock says nothing about the cost
+    // per unit, so grow the knob until it does
+    const double next = cost > 0 ? targetCpuUs * value / cost : value * 16.0;
+    const int64_t nextValue = clampKnob(knob, next);
+    if (nextValue == value) {
+      break;
+    }
+    value = nextValue;
+    cost = measureKnob(knob, value);
+  }
+  *achievedCpuUs = cost;
+  return value;
+}
+
+void logCalibration(const std::vector<StageCalibration>& stages) {
+  double total = 0;
+  for (const auto& stage : stages) {
+    total += stage.achievedCpuUs;
+  }
+  for (const auto& stage : stages) {
+    char workingSet[64] = "";
+    if (stage.bytes > 0) {
+      snprintf(
+          workingSet,
+          sizeof(workingSet),
+          ", working set of %.1f MB",
+          stage.bytes / 1e6);
+    }
+    I("Calibrated %s: --%s=%lld, %.1f us CPU for a target of %.1f us, "
+      "%.1f%% of the calibrated CPU time%s",
+      pipelineStageName(stage.stage),
+      stage.knob.c_str(),
+      static_cast<long long>(stage.value),
+      stage.achievedCpuUs,
+      stage.targetCpuUs,
+      total > 0 ? 100 * stage.achievedCpuUs / total : 0.0,
+      workingSet);
+    if (stage.targetCpuUs > 0 &&
+        std::abs(stage.achievedCpuUs - stage.targetCpuUs) >
+            kCalibrationTolerance * stage.targetCpuUs) {
+      W("Could not calibrate %s to within %.0f%% of its budget",
+        pipelineStageName(stage.stage),
+        100 * kCalibrationTolerance);
+    }
+  }
+}
+
+void writeCalibrationRecord(
+    const std::string& path,
+    const std::vector<StageCalibration>& stages) {
+  double total = 0;
+  for (const auto& stage : stages) {
+    total += stage.achievedCpuUs;
+  }
+  folly::dynamic record = folly::dynamic::object;
+  for (const auto& stage : stages) {
+    folly::dynamic entry = folly::dynamic::object;
+    entry["knob"] = stage.knob;
+    entry["value"] = stage.value;
+    entry["target_cpu_us"] = stage.targetCpuUs;
+    entry["achieved_cpu_us"] = stage.achievedCpuUs;
+    entry["cpu_share"] = total > 0 ? stage.achievedCpuUs / total : 0.0;
+    if (stage.bytes > 0) {
+      entry["bytes"] = stage.bytes;
+    }
+    record[pipelineStageName(stage.stage)] = std::move(entry);
+  }
+  folly::dynamic out = folly::dynamic::object("stages", std::move(record));
+  if (!folly::writeFile(folly::toPrettyJson(out) + "\n", path.c_str())) {
+    throw std::runtime_error("could not write calibration record " + path);
+  }
+}
+
+} // namespace ranking
@@ -0,0 +1,99 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "StageLatency.h"
+
+namespace ranking {
+
+// What one request should spend in a pipeline stage. Zero leaves that part
+// of the stage as configured.
+struct StageBudget {
+  // CPU time, summed over all the threads the stage runs on
+  double cpuUs = 0;
+  // Working set the stage touches
+  double bytes = 0;
+  // Time off CPU; only the I/O wait has any
+  double offCpuUs = 0;
+};
+
+// Stage budgets of a production profile, read from JSON of the form
+//   {"stages": {"pagerank": {"cpu_us": 4000, "bytes": 268435456},
+//               "io_wait": {"off_cpu_us": 200000}, ...}}
+// with the stage names of pipelineStageName(). Stages left out are not
+// calibrated.
+struct CalibrationProfile {
+  std::map<PipelineStage, StageBudget> stages;
+};
+
+// Throw std::invalid_argument for malformed JSON, unknown stages or keys and
+// negative budgets. loadCalibrationProfile() throws std::runtime_error if the
+// file cannot be read.
+CalibrationProfile parseCalibrationProfile(const std::string& json);
+CalibrationProfile loadCalibrationProfile(const std::string& path);
+
+// CPU time used by the calling thread, in microseconds.
+double threadCpuMicros();
+
+// A dwarf knob the CPU time of a stage grows about linearly with, and how
+// to run the stage once on the calling thread with the knob at a value.
+struct CalibrationKnob {
+  const char* name;
+  int64_t minValue;
+  int64_t maxValue;
+  std::function<void(int64_t)> run;
+};
+
+// Median CPU time of a few runs of the stage after a warmup run.
+double measureKnob(const CalibrationKnob& knob, int64_t value);
+
+// Rescales the knob from value by the CPU time measured per unit until the
+// stage costs targetCpuUs to within a few percent, for a few rounds at most.
+// The value is kept within the knob's bounds. Returns it, and the CPU time
+// last measured in achievedCpuUs.
+int64_t calibrateKnob(
+    const CalibrationKnob& knob,
+    int64_t value,
+    double targetCpuUs,
+    double* achievedCpuUs);
+
+// The outcome of calibrating one stage.
+struct StageCalibration {
+  PipelineStage stage;
+  // Command line option the stage was calibrated with, and its new value
+  std::string knob;
+  int64_t value;
+  double targetCpuUs;
+  double achievedCpuUs;
+  // Working set the stage was sized to, or 0 if it kept its own
+  double bytes;
+};
+
+// Logs one line per stage with its share of the calibrated CPU time.
+void logCalibration(const std::vector<StageCalibration>& stages);
+
+// Writes the stages and knob values to path as JSON, so the stage mix a
+// profile reached on this CPU can be compared across machines. Throws
+// std::runtime_error if path cannot be written.
+void writeCalibrationRecord(
+    const std::string& path,
+    const std::vector<StageCalibration>& stages);
+
+} // namespace ranking
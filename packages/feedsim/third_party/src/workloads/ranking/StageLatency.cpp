@@ -0,0 +1,142 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "StageLatency.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+namespace ranking {
+namespace {
+
+const int kStageHistogramSignificantDigits = 2;
+
+const char* const kPipelineStageNames[kNumPipelineStages] = {
+    "icache_buster",
+    "pagerank",
+    "embedding",
+    "io_wait",
+    "compression",
+    "pointer_chase",
+    "serialize",
+};
+
+double measureCycleCounterNanos() {
+#if defined(__aarch64__)
+  uint64_t frequency;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+  return 1e9 / frequency;
+#elif defined(__x86_64__) || defined(__i386__)
+  // The invariant TSC ticks at a fixed rate, so a short sample against the
+  // steady clock is enough
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t startTicks = readCycleCounter();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  const uint64_t endTicks = readCycleCounter();
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+      (endTicks - startTicks);
+#else
+  return 1.0;
+#endif
+}
+
+} // namespace
+
+const char* pipelineStageName(PipelineStage stage) {
+  return kPipelineStageNames[static_cast<size_t>(stage)];
+}
+
+double cycleCounterNanos() {
+  static const double nanos = measureCycleCounterNanos();
+  return nanos;
+}
+
+StageLatencyStats::StageLatencyStats() : histograms_(emptyHistograms()) {}
+
+std::vector<oldisim::HdrHistogram> StageLatencyStats::emptyHistograms() {
+  return std::vector<oldisim::HdrHistogram>(
+      kNumPipelineStages,
+      oldisim::HdrHistogram(kStageHistogramSignificantDigits));
+}
+
+void StageLatencyStats::record(const StageTimer& timer) {
+  const double nanos = cycleCounterNanos();
+  std::lock_guard<std::mutex> guard(lock_);
+  for (size_t i = 0; i < kNumPipelineStages; i++) {
+    histograms_[i].sample(
+        timer.ticks(static_cast<PipelineStage>(i)) * nanos);
+  }
+}
+
+void StageLatencyStats::accumulateInto(
+    std::vector<oldisim::HdrHistogram>& histograms) const {
+  std::lock_guard<std::mutex> guard(lock_);
+  for (size_t i = 0; i < kNumPipelineStages; i++) {
+    histograms[i].accumulate(histograms_[i]);
+  }
+}
+
+void StageLatencyStats::addMonitoringStats(
+    const std::vector<oldisim::HdrHistogram>& histograms,
+    std::map<std::string, double>& out) {
+  for (size_t i = 0; i < kNumPipelineStages; i++) {
+    const auto& h = histograms[i];
+    const std::string prefix = std::string("stage_") +
+        pipelineStageName(static_cast<PipelineStage>(i)) + "_";
+    out[prefix + "count"] = h.total();
+    if (h.total() == 0) {
+      continue;
+    }
+    out[prefix + "mean_us"] = h.average() / 1000;
+    out[prefix + "p50_us"] = h.get_nth(50) / 1000;
+    out[prefix + "p90_us"] = h.get_nth(90) / 1000;
+    out[prefix + "p99_us"] = h.get_nth(99) / 1000;
+    out[prefix + "max_us"] = h.maximum() / 1000;
+  }
+}
+
+void StageLatencyStats::printSummary(
+    const std::vector<oldisim::HdrHistogram>& histograms) {
+  printf("Pipeline stage latency (us)\n");
+  printf(
+      "  %-14s %10s %10s %10s %10s %10s %10s\n",
+      "stage",
+      "count",
+      "mean",
+      "p50",
+      "p90",
+      "p99",
+      "max");
+  for (size_t i = 0; i < kNumPipelineStages; i++) {
+    const auto& h = histograms[i];
+    const char* name = pipelineStageName(static_cast<PipelineStage>(i));
+    if (h.total() == 0) {
+      printf("  %-14s %10d\n", name, 0);
+      continue;
+    }
+    printf(
+        "  %-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        name,
+        static_cast<unsigned long>(h.total()),
+        h.average() / 1000,
+        h.get_nth(50) / 1000,
+        h.get_nth(90) / 1000,
+        h.get_nth(99) / 1000,
+        h.maximum() / 1000);
+  }
+}
+
+} // namespace ranking
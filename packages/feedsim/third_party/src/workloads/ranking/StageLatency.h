@@ -0,0 +1,124 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+#include "oldisim/HdrHistogram.h"
+
+namespace ranking {
+
+// Stages of the full ranking pipeline, in the order a request runs them.
+enum class PipelineStage {
+  kICacheBuster,
+  kPageRank,
+  kEmbedding,
+  kIoWait,
+  kCompression,
+  kPointerChase,
+  kSerialize,
+};
+
+constexpr size_t kNumPipelineStages =
+    static_cast<size_t>(PipelineStage::kSerialize) + 1;
+
+const char* pipelineStageName(PipelineStage stage);
+
+// Reads a free-running cycle counter: the TSC on x86, the virtual counter on
+// AArch64 and a steady clock in nanoseconds elsewhere.
+inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t value;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Nanoseconds per tick of readCycleCounter(), measured on first use.
+double cycleCounterNanos();
+
+// Per-request stage timings. Each mark() charges the ticks since the previous
+// mark to a stage, so time a request spends queued for a helper pool counts
+// towards the stage it was waiting to run. Charging a stage twice adds up.
+class StageTimer {
+public:
+  StageTimer() : last_(readCycleCounter()) {
+    ticks_.fill(0);
+  }
+
+  void mark(PipelineStage stage) {
+    const uint64_t now = readCycleCounter();
+    ticks_[static_cast<size_t>(stage)] += now - last_;
+    last_ = now;
+  }
+
+  uint64_t ticks(PipelineStage stage) const {
+    return ticks_[static_cast<size_t>(stage)];
+  }
+
+private:
+  std::array<uint64_t, kNumPipelineStages> ticks_;
+  uint64_t last_;
+};
+
+// Stage latency histograms of one server thread. Written by that thread and
+// read by the monitoring thread, so every access takes a lock that is only
+// contended while a snapshot is taken.
+class StageLatencyStats {
+public:
+  StageLatencyStats();
+
+  StageLatencyStats(const StageLatencyStats&) = delete;
+  StageLatencyStats& operator=(const StageLatencyStats&) = delete;
+
+  void record(const StageTimer& timer);
+
+  // Adds this thread's histograms to histograms, one per stage.
+  void accumulateInto(std::vector<oldisim::HdrHistogram>& histograms) const;
+
+  static std::vector<oldisim::HdrHistogram> emptyHistograms();
+
+  // Flattens histograms into "stage_<name>_<stat>" monitoring values in
+  // microseconds.
+  static void addMonitoringStats(
+      const std::vector<oldisim::HdrHistogram>& histograms,
+      std::map<std::string, double>& out);
+
+  // Prints one row per stage to stdout.
+  static void printSummary(
+      const std::vector<oldisim::HdrHistogram>& histograms);
+
+private:
+  mutable std::mutex lock_;
+  std::vector<oldisim::HdrHistogram> histograms_;
+};
+
+} // namespace ranking
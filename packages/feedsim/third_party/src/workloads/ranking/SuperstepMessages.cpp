@@ -0,0 +1,190 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "SuperstepMessages.h"
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace ranking {
+namespace {
+
+const uint32_t kFinalFlag = 1;
+
+template <typename T>
+void appendValue(const T& value, std::string& out) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Reads fields front to back, throwing once past the end.
+class Reader {
+ public:
+  Reader(const uint8_t* data, size_t length, const char* what)
+      : next_(data), end_(data + length), what_(what) {}
+
+  template <typename T>
+  T value() {
+    T value;
+    std::memcpy(&value, take(sizeof(value)), sizeof(value));
+    return value;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      const uint8_t byte = *take(1);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    throw std::invalid_argument(std::string(what_) + " has an overlong varint");
+  }
+
+  const uint8_t* take(size_t length) {
+    if (static_cast<size_t>(end_ - next_) < length) {
+      throw std::invalid_argument(std::string(what_) + " is truncated");
+    }
+    const uint8_t* data = next_;
+    next_ += length;
+    return data;
+  }
+
+  bool done() const {
+    return next_ == end_;
+  }
+
+ private:
+  const uint8_t* next_;
+  const uint8_t* end_;
+  const char* what_;
+};
+
+void appendVarint(uint64_t value, std::string& out) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+void parseFrames(Reader& reader, std::vector<DeltaFrame>& frames) {
+  frames.clear();
+  while (!reader.done()) {
+    DeltaFrame frame;
+    frame.partition = reader.value<uint32_t>();
+    frame.length = reader.value<uint32_t>();
+    frame.data = reader.take(frame.length);
+    frames.push_back(frame);
+  }
+}
+
+} // namespace
+
+void encodeSuperstepRequest(const SuperstepRequest& request, std::string& out) {
+  out.clear();
+  appendValue(request.queryId, out);
+  appendValue(request.superstep, out);
+  appendValue(request.numPartitions, out);
+  appendValue(request.final ? kFinalFlag : 0u, out);
+}
+
+void encodeSuperstepReply(const SuperstepReply& reply, std::string& out) {
+  out.clear();
+  appendValue(reply.residual, out);
+  appendValue(reply.numDeltas, out);
+}
+
+void appendDeltaFrame(
+    uint32_t partition,
+    const uint8_t* data,
+    uint32_t length,
+    std::string& out) {
+  appendValue(partition, out);
+  appendValue(length, out);
+  out.append(reinterpret_cast<const char*>(data), length);
+}
+
+SuperstepRequest parseSuperstepRequest(
+    const uint8_t* data,
+    size_t length,
+    std::vector<DeltaFrame>& frames) {
+  Reader reader(data, length, "superstep request");
+  SuperstepRequest request;
+  request.queryId = reader.value<uint64_t>();
+  request.superstep = reader.value<uint32_t>();
+  request.numPartitions = reader.value<uint32_t>();
+  request.final = (reader.value<uint32_t>() & kFinalFlag) != 0;
+  parseFrames(reader, frames);
+  return request;
+}
+
+SuperstepReply parseSuperstepReply(
+    const uint8_t* data,
+    size_t length,
+    std::vector<DeltaFrame>& frames) {
+  Reader reader(data, length, "superstep reply");
+  SuperstepReply reply;
+  reply.residual = reader.value<double>();
+  reply.numDeltas = reader.value<uint32_t>();
+  parseFrames(reader, frames);
+  return reply;
+}
+
+void encodeDeltaBlock(
+    const int32_t* ids,
+    const float* deltas,
+    size_t count,
+    std::string& out) {
+  appendVarint(count, out);
+  int32_t previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    appendVarint(static_cast<uint32_t>(ids[i] - previous), out);
+    previous = ids[i];
+  }
+  out.append(reinterpret_cast<const char*>(deltas), count * sizeof(float));
+}
+
+void decodeDeltaBlock(
+    const uint8_t* data,
+    size_t length,
+    std::vector<int32_t>& ids,
+    std::vector<float>& deltas) {
+  Reader reader(data, length, "delta block");
+  const uint64_t count = reader.varint();
+  // Every delta takes at least a gap byte and a float
+  if (count > length / (1 + sizeof(float))) {
+    throw std::invalid_argument("delta block is truncated");
+  }
+  ids.resize(count);
+  deltas.resize(count);
+  int64_t id = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint64_t gap = reader.varint();
+    if ((i > 0 && gap == 0) ||
+        gap > static_cast<uint64_t>(std::numeric_limits<int32_t>::max() - id)) {
+      throw std::invalid_argument("delta block ids do not ascend");
+    }
+    id += gap;
+    ids[i] = id;
+  }
+  std::memcpy(
+      deltas.data(), reader.take(count * sizeof(float)), count * sizeof(float));
+  if (!reader.done()) {
+    throw std::invalid_argument("delta block has trailing bytes");
+  }
+}
+
+} // namespace ranking
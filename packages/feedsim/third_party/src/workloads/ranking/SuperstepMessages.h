@@ -0,0 +1,95 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ranking {
+
+// Wire format of the supersteps of a distributed PageRank query. Fixed width
+// fields are in host byte order, like the request key.
+//
+// The parent sends every leaf a request header followed by the delta frames
+// the other leafs addressed to it in the previous superstep. A leaf answers
+// with a reply header followed by one delta frame per leaf its boundary
+// vertices changed the contributions of. A frame is the partition it comes
+// from (in requests) or goes to (in replies), the length of its block and
+// the block: a varint count, the varint gaps between the ascending global
+// vertex ids and a float contribution delta per vertex.
+
+struct SuperstepRequest {
+  uint64_t queryId = 0;
+  // Superstep 0 starts the query, every later one applies the frames of the
+  // one before
+  uint32_t superstep = 0;
+  // Leafs the graph is partitioned over, which must match the leaf's own
+  uint32_t numPartitions = 0;
+  // The leaf drops the query after this superstep and sends no frames
+  bool final = false;
+};
+
+struct SuperstepReply {
+  // Sum of the rank changes over the leaf's partition
+  double residual = 0;
+  // Vertices the frames carry a delta for, summed over all frames
+  uint32_t numDeltas = 0;
+};
+
+// Where a frame sits in the message it was parsed from.
+struct DeltaFrame {
+  uint32_t partition;
+  const uint8_t* data;
+  uint32_t length;
+};
+
+// Replace out with the header; frames are appended after it.
+void encodeSuperstepRequest(const SuperstepRequest& request, std::string& out);
+void encodeSuperstepReply(const SuperstepReply& reply, std::string& out);
+
+void appendDeltaFrame(
+    uint32_t partition,
+    const uint8_t* data,
+    uint32_t length,
+    std::string& out);
+
+// Return the header and replace frames with the frames after it. Throw
+// std::invalid_argument for a truncated message.
+SuperstepRequest parseSuperstepRequest(
+    const uint8_t* data,
+    size_t length,
+    std::vector<DeltaFrame>& frames);
+SuperstepReply parseSuperstepReply(
+    const uint8_t* data,
+    size_t length,
+    std::vector<DeltaFrame>& frames);
+
+// Appends the block of count deltas and their ascending vertex ids to out.
+void encodeDeltaBlock(
+    const int32_t* ids,
+    const float* deltas,
+    size_t count,
+    std::string& out);
+
+// Replaces ids and deltas with the contents of a block. Throws
+// std::invalid_argument for a truncated block or ids that do not ascend.
+void decodeDeltaBlock(
+    const uint8_t* data,
+    size_t length,
+    std::vector<int32_t>& ids,
+    std::vector<float>& deltas);
+
+} // namespace ranking
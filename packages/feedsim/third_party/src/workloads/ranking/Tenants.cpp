@@ -0,0 +1,143 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Tenants.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+namespace ranking {
+namespace {
+
+long parseNumber(const std::string& tenant, const std::string& key,
+                 const std::string& value) {
+  char* end = nullptr;
+  errno = 0;
+  const long number = std::strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || errno != 0 || number < 0) {
+    throw std::invalid_argument(
+        "tenant " + tenant + " needs a non-negative integer for " + key +
+        ", not " + value);
+  }
+  return number;
+}
+
+std::vector<int> parseCpus(const std::string& tenant, const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    const size_t dash = range.find('-');
+    const long first = parseNumber(tenant, "cpus", range.substr(0, dash));
+    const long last = dash == std::string::npos
+        ? first
+        : parseNumber(tenant, "cpus", range.substr(dash + 1));
+    if (last < first) {
+      throw std::invalid_argument(
+          "tenant " + tenant + " has an empty cpu range " + range);
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) {
+    throw std::invalid_argument("tenant " + tenant + " has no cpus");
+  }
+  return cpus;
+}
+
+} // namespace
+
+const std::vector<std::string>& tenantOptions() {
+  static const std::vector<std::string> options = {
+      "graph_subset",
+      "graph_max_iters",
+      "chase_iterations",
+      "io_time_ms",
+      "num_objects",
+  };
+  return options;
+}
+
+TenantSpec parseTenantSpec(const std::string& spec) {
+  std::stringstream ss(spec);
+  TenantSpec tenant;
+  std::getline(ss, tenant.name, ':');
+  if (tenant.name.empty()) {
+    throw std::invalid_argument("tenant " + spec + " needs a name");
+  }
+  bool hasType = false;
+  std::string field;
+  while (std::getline(ss, field, ':')) {
+    const size_t equals = field.find('=');
+    if (equals == std::string::npos) {
+      throw std::invalid_argument(
+          "tenant " + tenant.name + " has a field without a value: " + field);
+    }
+    const std::string key = field.substr(0, equals);
+    const std::string value = field.substr(equals + 1);
+    if (key == "type") {
+      tenant.requestType = parseNumber(tenant.name, key, value);
+      hasType = true;
+    } else if (key == "weight") {
+      char* end = nullptr;
+      tenant.weight = std::strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || !(tenant.weight > 0)) {
+        throw std::invalid_argument(
+            "tenant " + tenant.name + " needs a positive weight, not " + value);
+      }
+    } else if (key == "cpus") {
+      tenant.cpus = parseCpus(tenant.name, value);
+    } else if (key == "cgroup") {
+      tenant.cgroup = value;
+    } else {
+      const auto& options = tenantOptions();
+      if (std::find(options.begin(), options.end(), key) == options.end()) {
+        throw std::invalid_argument(
+            "tenant " + tenant.name + " has an unknown option " + key);
+      }
+      tenant.options[key] = parseNumber(tenant.name, key, value);
+    }
+  }
+  if (!hasType) {
+    throw std::invalid_argument("tenant " + tenant.name + " needs a type");
+  }
+  return tenant;
+}
+
+std::vector<TenantSpec> parseTenantSpecs(
+    const std::vector<std::string>& specs) {
+  std::vector<TenantSpec> tenants;
+  std::set<std::string> names;
+  std::set<uint32_t> types;
+  for (const auto& spec : specs) {
+    tenants.push_back(parseTenantSpec(spec));
+    const auto& tenant = tenants.back();
+    if (!names.insert(tenant.name).second) {
+      throw std::invalid_argument("two tenants are named " + tenant.name);
+    }
+    if (!types.insert(tenant.requestType).second) {
+      throw std::invalid_argument(
+          "tenant " + tenant.name + " shares request type " +
+          std::to_string(tenant.requestType) + " with another tenant");
+    }
+  }
+  return tenants;
+}
+
+} // namespace ranking
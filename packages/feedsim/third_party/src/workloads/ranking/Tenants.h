@@ -0,0 +1,54 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ranking {
+
+// One of several workloads hosted by a multi-tenant LeafNodeRank, given as
+//   name:type=<request type>[:weight=<w>][:cpus=<cpulist>][:cgroup=<dir>]
+//       [:<option>=<value>]...
+// A tenant serves the requests of its type: light ranking and cache probes
+// for their types, full ranking for any other. The server threads share
+// the queued requests of all tenants in proportion to their weights.
+struct TenantSpec {
+  std::string name;
+  uint32_t requestType = 0;
+  double weight = 1;
+  // Helper executor threads of the tenant are pinned to these CPUs, in the
+  // kernel's cpulist format, and join the threaded cgroup v2 directory
+  // cgroup. A tenant with neither shares the server's helper executors.
+  std::vector<int> cpus;
+  std::string cgroup;
+  // Full ranking options overridden for the tenant, by option name; one of
+  // tenantOptions()
+  std::map<std::string, int> options;
+};
+
+// The options a TenantSpec may override.
+const std::vector<std::string>& tenantOptions();
+
+// Throws std::invalid_argument for a malformed spec, an unknown key or
+// option, a non-positive weight or an option value that is negative.
+TenantSpec parseTenantSpec(const std::string& spec);
+
+// Parses every spec, and throws std::invalid_argument as well if two
+// tenants share a name or a request type.
+std::vector<TenantSpec> parseTenantSpecs(const std::vector<std::string>& specs);
+
+} // namespace ranking
@@ -0,0 +1,143 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "WorkingSetMemory.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+
+#if defined(RANKING_USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(RANKING_USE_TCMALLOC)
+#include <gperftools/malloc_extension.h>
+#else
+#include <malloc.h>
+#endif
+
+namespace ranking {
+
+namespace {
+
+constexpr uintptr_t kHugePageSize = 2 << 20;
+// From <linux/mman.h> of Linux 6.1 and later; older kernels reject it and
+// leave the range to khugepaged
+constexpr int kMadvCollapse = 25;
+
+// The kB values of the smaps_rollup fields, in bytes
+std::map<std::string, double> readSmapsRollup() {
+  std::map<std::string, double> fields;
+  std::ifstream smaps("/proc/self/smaps_rollup");
+  std::string line;
+  while (std::getline(smaps, line)) {
+    std::istringstream fieldLine(line);
+    std::string name;
+    double kiloBytes;
+    if (fieldLine >> name >> kiloBytes && name.back() == ':') {
+      name.pop_back();
+      fields[name] = kiloBytes * 1024;
+    }
+  }
+  return fields;
+}
+
+#if defined(RANKING_USE_JEMALLOC)
+double jemallocStat(const char *name) {
+  size_t value = 0;
+  size_t size = sizeof(value);
+  mallctl(name, &value, &size, nullptr, 0);
+  return value;
+}
+#endif
+
+} // namespace
+
+size_t adviseHugePages(const void *data, size_t length) {
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t start = (begin + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  const uintptr_t end = (begin + length) & ~(kHugePageSize - 1);
+  if (end <= start) {
+    return 0;
+  }
+  void *range = reinterpret_cast<void *>(start);
+  if (madvise(range, end - start, MADV_HUGEPAGE) != 0) {
+    return 0;
+  }
+  madvise(range, end - start, kMadvCollapse);
+  return end - start;
+}
+
+const char *allocatorName() {
+#if defined(RANKING_USE_JEMALLOC)
+  return "jemalloc";
+#elif defined(RANKING_USE_TCMALLOC)
+  return "tcmalloc";
+#else
+  return "system";
+#endif
+}
+
+bool useThreadArena() {
+#if defined(RANKING_USE_JEMALLOC)
+  unsigned arena;
+  size_t size = sizeof(arena);
+  if (mallctl("arenas.create", &arena, &size, nullptr, 0) != 0) {
+    return false;
+  }
+  return mallctl("thread.arena", nullptr, nullptr, &arena, sizeof(arena)) ==
+      0;
+#else
+  return false;
+#endif
+}
+
+void addMemoryStats(std::map<std::string, double> &out) {
+  auto smaps = readSmapsRollup();
+  out["memory_rss_bytes"] = smaps["Rss"];
+  out["memory_thp_bytes"] = smaps["AnonHugePages"];
+  out["memory_hugetlb_bytes"] = smaps["Private_Hugetlb"] +
+      smaps["Shared_Hugetlb"];
+
+#if defined(RANKING_USE_JEMALLOC)
+  // Stats are a snapshot taken when the epoch advances
+  uint64_t epoch = 1;
+  size_t size = sizeof(epoch);
+  mallctl("epoch", &epoch, &size, &epoch, size);
+  out["allocator_allocated_bytes"] = jemallocStat("stats.allocated");
+  out["allocator_resident_bytes"] = jemallocStat("stats.resident");
+  unsigned arenas = 0;
+  size = sizeof(arenas);
+  mallctl("arenas.narenas", &arenas, &size, nullptr, 0);
+  out["allocator_arenas"] = arenas;
+#elif defined(RANKING_USE_TCMALLOC)
+  auto *extension = MallocExtension::instance();
+  size_t allocated = 0;
+  size_t heap = 0;
+  size_t unmapped = 0;
+  extension->GetNumericProperty("generic.current_allocated_bytes", &allocated);
+  extension->GetNumericProperty("generic.heap_size", &heap);
+  extension->GetNumericProperty("tcmalloc.pageheap_unmapped_bytes", &unmapped);
+  out["allocator_allocated_bytes"] = allocated;
+  out["allocator_resident_bytes"] = heap - unmapped;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  // Allocations above the mmap threshold are counted apart from the arenas
+  const auto info = mallinfo2();
+  out["allocator_allocated_bytes"] = info.uordblks + info.hblkhd;
+  out["allocator_resident_bytes"] = info.arena + info.hblkhd;
+#endif
+}
+
+} // namespace ranking
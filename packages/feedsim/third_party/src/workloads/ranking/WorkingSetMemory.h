@@ -0,0 +1,42 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+namespace ranking {
+
+// Advises transparent huge pages for the whole 2MB pages inside
+// [data, data + length) of a heap allocation that is already populated, and
+// asks the kernel to collapse them right away rather than whenever
+// khugepaged gets to them. Returns the bytes advised, 0 if the range holds no
+// whole huge page or madvise refused.
+size_t adviseHugePages(const void *data, size_t length);
+
+// The allocator LeafNodeRank is linked with: "jemalloc", "tcmalloc" or
+// "system".
+const char *allocatorName();
+
+// Moves the calling thread onto a jemalloc arena of its own, so its
+// allocations stay apart from those of other threads. Returns false if the
+// binary is not linked with jemalloc or the arena could not be created.
+bool useThreadArena();
+
+// Adds the resident, transparent huge page and hugetlb memory of the process
+// and the allocated and resident bytes the allocator reports.
+void addMemoryStats(std::map<std::string, double> &out);
+
+} // namespace ranking
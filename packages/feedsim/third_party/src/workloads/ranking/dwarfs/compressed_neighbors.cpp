@@ -0,0 +1,191 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "compressed_neighbors.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace ranking {
+namespace dwarfs {
+
+constexpr int64_t CompressedNeighbors::kDecodeSlack;
+
+namespace {
+
+// Decoders load 16 bytes after every tag, however short the group is
+constexpr size_t kTailPadding = 16;
+
+/** Byte length and shuffle mask of the group behind each tag. A mask entry
+ * of 0x80 produces a zero byte for both pshufb and tbl.
+ */
+struct GroupTables {
+  GroupTables() {
+    for (int tag = 0; tag < 256; tag++) {
+      uint8_t pos = 0;
+      for (int i = 0; i < 4; i++) {
+        const int bytes = ((tag >> (2 * i)) & 3) + 1;
+        for (int b = 0; b < 4; b++) {
+          shuffle[tag][4 * i + b] = b < bytes ? pos + b : 0x80;
+        }
+        pos += bytes;
+      }
+      length[tag] = pos;
+    }
+  }
+
+  alignas(16) uint8_t shuffle[256][16];
+  uint8_t length[256];
+};
+
+const GroupTables kGroupTables;
+
+int gapBytes(uint32_t gap) {
+  if (gap < (1u << 8u)) {
+    return 1;
+  }
+  if (gap < (1u << 16u)) {
+    return 2;
+  }
+  return gap < (1u << 24u) ? 3 : 4;
+}
+
+void decodeScalar(const uint8_t* in, int64_t groups, int32_t* out) {
+  static constexpr uint32_t kMasks[4] = {
+      0xffu, 0xffffu, 0xffffffu, 0xffffffffu};
+  uint32_t id = 0;
+  for (int64_t g = 0; g < groups; g++) {
+    const uint8_t tag = *in++;
+    for (int i = 0; i < 4; i++) {
+      const int code = (tag >> (2 * i)) & 3;
+      uint32_t gap;
+      std::memcpy(&gap, in, sizeof(gap));
+      id += gap & kMasks[code];
+      *out++ = static_cast<int32_t>(id);
+      in += code + 1;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("ssse3"))) void
+decodeSsse3(const uint8_t* in, int64_t groups, int32_t* out) {
+  __m128i base = _mm_setzero_si128();
+  for (int64_t g = 0; g < groups; g++) {
+    const uint8_t tag = *in++;
+    const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i gaps = _mm_shuffle_epi8(
+        data,
+        _mm_load_si128(
+            reinterpret_cast<const __m128i*>(kGroupTables.shuffle[tag])));
+    gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 4));
+    gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 8));
+    const __m128i ids = _mm_add_epi32(gaps, base);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), ids);
+    base = _mm_shuffle_epi32(ids, 0xff);
+    in += kGroupTables.length[tag];
+    out += 4;
+  }
+}
+
+#elif defined(__aarch64__)
+
+void decodeNeon(const uint8_t* in, int64_t groups, int32_t* out) {
+  const uint32x4_t zero = vdupq_n_u32(0);
+  uint32x4_t base = zero;
+  for (int64_t g = 0; g < groups; g++) {
+    const uint8_t tag = *in++;
+    uint32x4_t gaps = vreinterpretq_u32_u8(
+        vqtbl1q_u8(vld1q_u8(in), vld1q_u8(kGroupTables.shuffle[tag])));
+    gaps = vaddq_u32(gaps, vextq_u32(zero, gaps, 3));
+    gaps = vaddq_u32(gaps, vextq_u32(zero, gaps, 2));
+    const uint32x4_t ids = vaddq_u32(gaps, base);
+    vst1q_s32(out, vreinterpretq_s32_u32(ids));
+    base = vdupq_laneq_u32(ids, 3);
+    in += kGroupTables.length[tag];
+    out += 4;
+  }
+}
+
+#endif
+
+} // namespace
+
+CompressedNeighbors::CompressedNeighbors(const CSRGraph<int32_t>& graph)
+    : decode_groups_(decodeScalar), decoder_name_("scalar") {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    decode_groups_ = decodeSsse3;
+    decoder_name_ = "ssse3";
+  }
+#elif defined(__aarch64__)
+  decode_groups_ = decodeNeon;
+  decoder_name_ = "neon";
+#endif
+
+  const int64_t num_nodes = graph.num_nodes();
+  degrees_.resize(num_nodes);
+  offsets_.reserve(num_nodes + 1);
+  for (int64_t u = 0; u < num_nodes; u++) {
+    num_edges_ += graph.in_degree(u);
+  }
+  // Uniform graphs of a few million nodes mostly need two bytes per gap
+  bytes_.reserve(num_edges_ * 2 + num_nodes + kTailPadding);
+
+  uint32_t gaps[4];
+  for (int64_t u = 0; u < num_nodes; u++) {
+    offsets_.push_back(bytes_.size());
+    degrees_[u] = static_cast<int32_t>(graph.in_degree(u));
+    max_degree_ = std::max<int64_t>(max_degree_, degrees_[u]);
+    uint32_t prev = 0;
+    int count = 0;
+    auto flush = [this, &gaps, &count]() {
+      uint8_t tag = 0;
+      for (int i = 0; i < 4; i++) {
+        tag |= (i < count ? gapBytes(gaps[i]) - 1 : 0) << (2 * i);
+      }
+      bytes_.push_back(tag);
+      for (int i = 0; i < 4; i++) {
+        const uint32_t gap = i < count ? gaps[i] : 0;
+        for (int b = 0; b < gapBytes(gap); b++) {
+          bytes_.push_back(static_cast<uint8_t>(gap >> (8 * b)));
+        }
+      }
+      count = 0;
+    };
+    for (int32_t v : graph.in_neigh(u)) {
+      gaps[count++] = static_cast<uint32_t>(v) - prev;
+      prev = static_cast<uint32_t>(v);
+      if (count == 4) {
+        flush();
+      }
+    }
+    if (count > 0) {
+      flush();
+    }
+  }
+  offsets_.push_back(bytes_.size());
+  bytes_.resize(bytes_.size() + kTailPadding, 0);
+}
+
+} // namespace dwarfs
+} // namespace ranking
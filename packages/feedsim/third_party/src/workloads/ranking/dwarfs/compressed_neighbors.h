@@ -0,0 +1,92 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COMPRESSED_NEIGHBORS_H
+#define COMPRESSED_NEIGHBORS_H
+
+#include <cstdint>
+#include <vector>
+
+#include <gapbs/src/graph.h>
+
+namespace ranking {
+namespace dwarfs {
+
+/** In-neighborhoods of a graph stored as delta-coded group varints.
+ *
+ * Every sorted neighborhood is turned into gaps, the first one relative to
+ * zero, and the gaps are packed in groups of four behind a tag byte that
+ * holds the byte length of each gap (Google's varint-GB). A padded last
+ * group keeps every group full, so decoding never branches on the count.
+ * Groups are decoded with one byte shuffle and a prefix sum where the CPU
+ * has SSSE3 or NEON, and value by value otherwise.
+ */
+class CompressedNeighbors {
+ public:
+  /** Extra entries decode() may write past the end of a neighborhood. */
+  static constexpr int64_t kDecodeSlack = 3;
+
+  /** Compresses the in-neighborhoods of graph, which must be sorted. */
+  explicit CompressedNeighbors(const CSRGraph<int32_t>& graph);
+
+  int64_t numNodes() const {
+    return degrees_.size();
+  }
+  int64_t degree(int32_t u) const {
+    return degrees_[u];
+  }
+  int64_t maxDegree() const {
+    return max_degree_;
+  }
+
+  /** Writes the in-neighbors of u to out, which must have room for
+   * degree(u) + kDecodeSlack entries, and returns their count.
+   */
+  int64_t decode(int32_t u, int32_t* out) const {
+    decode_groups_(bytes_.data() + offsets_[u], (degrees_[u] + 3) / 4, out);
+    return degrees_[u];
+  }
+
+  /** Bytes of the packed neighborhoods, excluding offsets and degrees. */
+  int64_t compressedBytes() const {
+    return offsets_.back();
+  }
+  /** Bytes of the same neighborhoods as raw int32 ids. */
+  int64_t rawBytes() const {
+    return num_edges_ * static_cast<int64_t>(sizeof(int32_t));
+  }
+  int64_t numEdges() const {
+    return num_edges_;
+  }
+  /** "ssse3", "neon" or "scalar". */
+  const char* decoderName() const {
+    return decoder_name_;
+  }
+
+ private:
+  using DecodeFn = void (*)(const uint8_t* in, int64_t groups, int32_t* out);
+
+  std::vector<uint8_t> bytes_;
+  std::vector<int64_t> offsets_;
+  std::vector<int32_t> degrees_;
+  int64_t max_degree_ = 0;
+  int64_t num_edges_ = 0;
+  DecodeFn decode_groups_;
+  const char* decoder_name_;
+};
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // COMPRESSED_NEIGHBORS_H
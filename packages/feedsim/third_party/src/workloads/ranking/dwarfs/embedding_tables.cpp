@@ -0,0 +1,424 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "embedding_tables.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "pagerank_kernels.h"
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+constexpr size_t kHugePageSize = 2 << 20;
+// From <linux/mman.h>: the log2 of the hugetlb page size goes here
+constexpr int kMapHugeShift = 26;
+constexpr int64_t kCacheLineBytes = 64;
+// Ranks are scattered over the table by multiplying with a prime larger than
+// any table, which makes the map a bijection
+constexpr uint64_t kRowHashMultiplier = 2654435761ull;
+// Offsets the scatter of every table so hot rows differ across tables
+constexpr uint64_t kTableHashOffset = 0x9e3779b9ull;
+// Rows sampled ahead of the accumulation, and prefetched that far ahead
+constexpr int kSampleBatch = 64;
+constexpr int kPrefetchDistance = 8;
+
+uint64_t splitMix64(uint64_t& state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Uniform in [-0.5, 0.5) from 23 random mantissa bits
+float randomValue(uint32_t bits) {
+  const uint32_t one_to_two = (bits >> 9) | 0x3f800000u;
+  float value;
+  std::memcpy(&value, &one_to_two, sizeof(value));
+  return value - 1.5f;
+}
+
+void addFloatScalar(const float* row, float* out, int64_t dimension) {
+  for (int64_t i = 0; i < dimension; i++) {
+    out[i] += row[i];
+  }
+}
+
+void addInt8Scalar(
+    const uint8_t* row,
+    float scale,
+    float bias,
+    float* out,
+    int64_t dimension) {
+  for (int64_t i = 0; i < dimension; i++) {
+    out[i] += row[i] * scale + bias;
+  }
+}
+
+const EmbeddingPoolingKernels kScalarKernels{
+    "scalar", addFloatScalar, addInt8Scalar};
+
+// The vector kernels finish their rows with inline scalar loops rather than
+// calling the scalar kernels, which are not compiled for the wider ISA
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2,fma"))) void
+addFloatAvx2(const float* row, float* out, int64_t dimension) {
+  int64_t i = 0;
+  for (; i + 8 <= dimension; i += 8) {
+    _mm256_storeu_ps(
+        out + i,
+        _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_loadu_ps(row + i)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i];
+  }
+}
+
+__attribute__((target("avx2,fma"))) void addInt8Avx2(
+    const uint8_t* row,
+    float scale,
+    float bias,
+    float* out,
+    int64_t dimension) {
+  const __m256 vscale = _mm256_set1_ps(scale);
+  const __m256 vbias = _mm256_set1_ps(bias);
+  int64_t i = 0;
+  for (; i + 8 <= dimension; i += 8) {
+    const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + i))));
+    _mm256_storeu_ps(
+        out + i,
+        _mm256_add_ps(
+            _mm256_loadu_ps(out + i), _mm256_fmadd_ps(q, vscale, vbias)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i] * scale + bias;
+  }
+}
+
+const EmbeddingPoolingKernels kAvx2Kernels{"avx2", addFloatAvx2, addInt8Avx2};
+
+__attribute__((target("avx512f"))) void
+addFloatAvx512(const float* row, float* out, int64_t dimension) {
+  int64_t i = 0;
+  for (; i + 16 <= dimension; i += 16) {
+    _mm512_storeu_ps(
+        out + i,
+        _mm512_add_ps(_mm512_loadu_ps(out + i), _mm512_loadu_ps(row + i)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i];
+  }
+}
+
+__attribute__((target("avx512f"))) void addInt8Avx512(
+    const uint8_t* row,
+    float scale,
+    float bias,
+    float* out,
+    int64_t dimension) {
+  const __m512 vscale = _mm512_set1_ps(scale);
+  const __m512 vbias = _mm512_set1_ps(bias);
+  int64_t i = 0;
+  for (; i + 16 <= dimension; i += 16) {
+    const __m512 q = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i))));
+    _mm512_storeu_ps(
+        out + i,
+        _mm512_add_ps(
+            _mm512_loadu_ps(out + i), _mm512_fmadd_ps(q, vscale, vbias)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i] * scale + bias;
+  }
+}
+
+const EmbeddingPoolingKernels kAvx512Kernels{
+    "avx512", addFloatAvx512, addInt8Avx512};
+
+#elif defined(__aarch64__)
+
+void addFloatNeon(const float* row, float* out, int64_t dimension) {
+  int64_t i = 0;
+  for (; i + 4 <= dimension; i += 4) {
+    vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), vld1q_f32(row + i)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i];
+  }
+}
+
+void addInt8Neon(
+    const uint8_t* row,
+    float scale,
+    float bias,
+    float* out,
+    int64_t dimension) {
+  const float32x4_t vscale = vdupq_n_f32(scale);
+  const float32x4_t vbias = vdupq_n_f32(bias);
+  int64_t i = 0;
+  for (; i + 8 <= dimension; i += 8) {
+    const uint16x8_t q = vmovl_u8(vld1_u8(row + i));
+    const float32x4_t low = vcvtq_f32_u32(vmovl_u16(vget_low_u16(q)));
+    const float32x4_t high = vcvtq_f32_u32(vmovl_u16(vget_high_u16(q)));
+    vst1q_f32(
+        out + i,
+        vaddq_f32(vld1q_f32(out + i), vfmaq_f32(vbias, low, vscale)));
+    vst1q_f32(
+        out + i + 4,
+        vaddq_f32(vld1q_f32(out + i + 4), vfmaq_f32(vbias, high, vscale)));
+  }
+  for (; i < dimension; i++) {
+    out[i] += row[i] * scale + bias;
+  }
+}
+
+const EmbeddingPoolingKernels kNeonKernels{"neon", addFloatNeon, addInt8Neon};
+
+#endif
+
+const EmbeddingPoolingKernels* kernelsFor(const std::string& isa) {
+#if defined(__x86_64__)
+  if (isa == "avx2") {
+    return &kAvx2Kernels;
+  }
+  if (isa == "avx512") {
+    return &kAvx512Kernels;
+  }
+#elif defined(__aarch64__)
+  if (isa == "neon") {
+    return &kNeonKernels;
+  }
+#endif
+  if (isa == "scalar") {
+    return &kScalarKernels;
+  }
+  return nullptr;
+}
+
+} // namespace
+
+void validateEmbeddingTableOptions(const EmbeddingTableOptions& options) {
+  if (options.num_tables < 1 || options.rows_per_table < 1 ||
+      options.dimension < 1 || options.pooling_factor < 1) {
+    throw std::invalid_argument(
+        "Embedding table count, rows, dimension and pooling factor must be "
+        "positive");
+  }
+  if (static_cast<uint64_t>(options.rows_per_table) >= kRowHashMultiplier) {
+    throw std::invalid_argument("Embedding tables must have fewer than 2^31 "
+                                "rows");
+  }
+  if (!(options.zipf_exponent > 0)) {
+    throw std::invalid_argument("Zipf exponent must be positive");
+  }
+}
+
+const EmbeddingPoolingKernels* findEmbeddingPoolingKernels(
+    const std::string& isa) {
+  if (isa == "auto") {
+    for (const char* candidate : {"avx512", "avx2", "neon"}) {
+      if (cpuSupports(candidate) && kernelsFor(candidate) != nullptr) {
+        return kernelsFor(candidate);
+      }
+    }
+    return &kScalarKernels;
+  }
+  if (!cpuSupports(isa)) {
+    return nullptr;
+  }
+  return kernelsFor(isa);
+}
+
+EmbeddingTables::EmbeddingTables(
+    const EmbeddingTableOptions& options,
+    const EmbeddingPoolingKernels* kernels)
+    : options_(options),
+      kernels_(kernels),
+      row_bytes_(
+          options.precision == EmbeddingPrecision::kFloat
+              ? options.dimension * static_cast<int64_t>(sizeof(float))
+              : (options.dimension + 3) / 4 * 4 + 2 * sizeof(float)),
+      table_bytes_(row_bytes_ * options.rows_per_table),
+      zipf_span_(0.0),
+      mapping_(nullptr),
+      mapping_length_(0),
+      data_(nullptr),
+      huge_pages_(false),
+      hugetlb_(false) {
+  validateEmbeddingTableOptions(options_);
+  const double n = static_cast<double>(options_.rows_per_table) + 1.0;
+  const double s = options_.zipf_exponent;
+  zipf_span_ = s == 1.0 ? std::log(n) : std::pow(n, 1.0 - s) - 1.0;
+
+  const size_t length = bytes();
+  // hugetlb mappings are always aligned to their page size
+  if (options_.hugetlb_page_size > 0) {
+    const size_t page = options_.hugetlb_page_size;
+    mapping_length_ = (length + page - 1) / page * page;
+    mapping_ = mmap(
+        nullptr,
+        mapping_length_,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+            (__builtin_ctzll(page) << kMapHugeShift),
+        -1,
+        0);
+    hugetlb_ = mapping_ != MAP_FAILED;
+  }
+  uint8_t* data;
+  if (hugetlb_) {
+    data = static_cast<uint8_t*>(mapping_);
+  } else {
+    // Over-allocate so the tables can start on a huge page boundary
+    const bool advise =
+        options_.huge_pages || options_.hugetlb_page_size > 0;
+    const size_t alignment = advise ? kHugePageSize : 1;
+    mapping_length_ = length + alignment - 1;
+    mapping_ = mmap(
+        nullptr,
+        mapping_length_,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0);
+    if (mapping_ == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(mapping_);
+    start = (start + alignment - 1) / alignment * alignment;
+    data = reinterpret_cast<uint8_t*>(start);
+    // Advise before the pages are first touched below
+    if (advise) {
+      huge_pages_ = madvise(data, length, MADV_HUGEPAGE) == 0;
+    }
+  }
+  data_ = data;
+
+  uint64_t state = options_.seed;
+  const int64_t num_rows = options_.rows_per_table * options_.num_tables;
+  for (int64_t r = 0; r < num_rows; r++) {
+    uint8_t* row = data + r * row_bytes_;
+    if (options_.precision == EmbeddingPrecision::kFloat) {
+      auto* values = reinterpret_cast<float*>(row);
+      for (int i = 0; i < options_.dimension; i += 2) {
+        const uint64_t bits = splitMix64(state);
+        values[i] = randomValue(bits);
+        if (i + 1 < options_.dimension) {
+          values[i + 1] = randomValue(bits >> 32);
+        }
+      }
+    } else {
+      for (int i = 0; i < options_.dimension; i += 8) {
+        const uint64_t bits = splitMix64(state);
+        std::memcpy(
+            row + i, &bits, std::min(8, options_.dimension - i));
+      }
+      // Quantized over [-0.5, 0.5) with a slightly different step per row
+      const uint64_t bits = splitMix64(state);
+      const float scale = (1.0f + (bits & 0xff) / 256.0f) / 512.0f;
+      const float bias = -128.0f * scale;
+      std::memcpy(row + row_bytes_ - 2 * sizeof(float), &scale, sizeof(scale));
+      std::memcpy(row + row_bytes_ - sizeof(float), &bias, sizeof(bias));
+    }
+  }
+}
+
+EmbeddingTables::~EmbeddingTables() {
+  munmap(mapping_, mapping_length_);
+}
+
+int64_t EmbeddingTables::sampleRow(int table, std::mt19937_64& rng) const {
+  // Inverts the CDF of the continuous power law x^-s on [1, rows + 1), as
+  // the Zipf graph generator does
+  std::uniform_real_distribution<double> unit;
+  const double s = options_.zipf_exponent;
+  const double x = s == 1.0
+      ? std::exp(zipf_span_ * unit(rng))
+      : std::pow(1.0 + zipf_span_ * unit(rng), 1.0 / (1.0 - s));
+  const int64_t rank = std::min(
+      std::max<int64_t>(static_cast<int64_t>(x) - 1, 0),
+      options_.rows_per_table - 1);
+  return (rank * kRowHashMultiplier + table * kTableHashOffset) %
+      options_.rows_per_table;
+}
+
+void EmbeddingTables::pool(
+    int begin,
+    int end,
+    std::mt19937_64& rng,
+    float* out) const {
+  const int dimension = options_.dimension;
+  const bool is_float = options_.precision == EmbeddingPrecision::kFloat;
+  auto prefetch = [this](const uint8_t* row) {
+    for (int64_t offset = 0; offset < row_bytes_; offset += kCacheLineBytes) {
+      __builtin_prefetch(row + offset);
+    }
+  };
+  const uint8_t* rows[kSampleBatch];
+  for (int table = begin; table < end; table++) {
+    float* pooled = out + static_cast<int64_t>(table - begin) * dimension;
+    std::fill(pooled, pooled + dimension, 0.0f);
+    for (int done = 0; done < options_.pooling_factor; done += kSampleBatch) {
+      const int n = std::min(kSampleBatch, options_.pooling_factor - done);
+      for (int i = 0; i < n; i++) {
+        rows[i] = row(table, sampleRow(table, rng));
+      }
+      for (int i = 0; i < std::min(n, kPrefetchDistance); i++) {
+        prefetch(rows[i]);
+      }
+      for (int i = 0; i < n; i++) {
+        if (i + kPrefetchDistance < n) {
+          prefetch(rows[i + kPrefetchDistance]);
+        }
+        if (is_float) {
+          kernels_->add_float(
+              reinterpret_cast<const float*>(rows[i]), pooled, dimension);
+        } else {
+          float scale;
+          float bias;
+          const uint8_t* params = rows[i] + row_bytes_ - 2 * sizeof(float);
+          std::memcpy(&scale, params, sizeof(scale));
+          std::memcpy(&bias, params + sizeof(float), sizeof(bias));
+          kernels_->add_int8(rows[i], scale, bias, pooled, dimension);
+        }
+      }
+    }
+    if (options_.pooling == EmbeddingPooling::kMean) {
+      const float inv = 1.0f / options_.pooling_factor;
+      for (int i = 0; i < dimension; i++) {
+        pooled[i] *= inv;
+      }
+    }
+  }
+}
+
+} // namespace dwarfs
+} // namespace ranking
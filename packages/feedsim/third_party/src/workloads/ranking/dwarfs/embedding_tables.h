@@ -0,0 +1,148 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef EMBEDDING_TABLES_H
+#define EMBEDDING_TABLES_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+namespace ranking {
+namespace dwarfs {
+
+/** Row formats of the embedding tables.
+ * kFloat rows are dimension fp32 values.
+ * kInt8 rows are dimension uint8 values, padded to 4 bytes and followed by
+ * an fp32 scale and bias, so that value = q * scale + bias (the fused 8-bit
+ * rowwise layout of FBGEMM).
+ */
+enum class EmbeddingPrecision { kFloat, kInt8 };
+
+/** kSum adds the pooled rows, kMean divides the sum by the pooling factor. */
+enum class EmbeddingPooling { kSum, kMean };
+
+struct EmbeddingTableOptions {
+  int num_tables = 8;
+  int64_t rows_per_table = 1 << 20;
+  int dimension = 64;
+  // Rows looked up and pooled per table and request
+  int pooling_factor = 32;
+  EmbeddingPrecision precision = EmbeddingPrecision::kFloat;
+  EmbeddingPooling pooling = EmbeddingPooling::kSum;
+  // Row popularity follows a power law with this exponent
+  double zipf_exponent = 1.05;
+  // Back the tables with 2MB transparent huge pages
+  bool huge_pages = false;
+  // Map the tables from the hugetlbfs pool of this page size, e.g. 2MB or
+  // 1GB, or 0 for normal pages. Falls back to huge_pages if the pool has too
+  // few pages reserved.
+  size_t hugetlb_page_size = 0;
+  uint64_t seed = 27491095;
+};
+
+/** Throws std::invalid_argument if options do not describe usable tables. */
+void validateEmbeddingTableOptions(const EmbeddingTableOptions& options);
+
+/** Vectorized row accumulation for one instruction set.
+ *
+ * add_float: out[i] += row[i]
+ * add_int8:  out[i] += row[i] * scale + bias
+ */
+struct EmbeddingPoolingKernels {
+  const char* name;
+  void (*add_float)(const float* row, float* out, int64_t dimension);
+  void (*add_int8)(
+      const uint8_t* row,
+      float scale,
+      float bias,
+      float* out,
+      int64_t dimension);
+};
+
+/** Returns the kernels for isa ("scalar", "avx2", "avx512", "neon"), or the
+ * widest set the running CPU supports for "auto". Returns nullptr if the
+ * requested set was not compiled in or the CPU lacks it.
+ */
+const EmbeddingPoolingKernels* findEmbeddingPoolingKernels(
+    const std::string& isa);
+
+/** Read-only sparse feature embedding tables, as gathered and pooled by the
+ * first layers of a feed ranking model.
+ *
+ * All tables live in a single anonymous mapping filled with random rows.
+ * Every lookup draws row ranks from a Zipf distribution and scatters them
+ * over the table with a multiplicative hash, so hot rows are spread out
+ * rather than packed into the first pages. Rows are prefetched a few
+ * lookups ahead of the accumulation, since every one is a likely miss.
+ */
+class EmbeddingTables {
+ public:
+  /** Allocates and fills the tables. Throws std::bad_alloc if the mapping
+   * fails.
+   */
+  EmbeddingTables(
+      const EmbeddingTableOptions& options,
+      const EmbeddingPoolingKernels* kernels);
+  ~EmbeddingTables();
+  EmbeddingTables(const EmbeddingTables&) = delete;
+  EmbeddingTables& operator=(const EmbeddingTables&) = delete;
+
+  const EmbeddingTableOptions& options() const {
+    return options_;
+  }
+  const EmbeddingPoolingKernels& kernels() const {
+    return *kernels_;
+  }
+  int64_t bytes() const {
+    return table_bytes_ * options_.num_tables;
+  }
+  /** Whether madvise accepted the huge page request. */
+  bool hugePages() const {
+    return huge_pages_;
+  }
+  /** Whether the tables are mapped from the hugetlbfs pool. */
+  bool hugetlb() const {
+    return hugetlb_;
+  }
+
+  /** Looks up pooling_factor rows in each table of [begin, end) and writes
+   * their pooled embeddings to out, dimension floats per table starting with
+   * table begin. Safe to call concurrently with distinct rng and out.
+   */
+  void pool(int begin, int end, std::mt19937_64& rng, float* out) const;
+
+ private:
+  const uint8_t* row(int table, int64_t index) const {
+    return data_ + table * table_bytes_ + index * row_bytes_;
+  }
+  int64_t sampleRow(int table, std::mt19937_64& rng) const;
+
+  EmbeddingTableOptions options_;
+  const EmbeddingPoolingKernels* kernels_;
+  int64_t row_bytes_;
+  int64_t table_bytes_;
+  // Precomputed for inverting the power law CDF
+  double zipf_span_;
+  void* mapping_;
+  size_t mapping_length_;
+  const uint8_t* data_;
+  bool huge_pages_;
+  bool hugetlb_;
+};
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // EMBEDDING_TABLES_H
@@ -0,0 +1,298 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "graph_generator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <folly/Executor.h>
+#include <folly/futures/Future.h>
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+using Graph = CSRGraph<int32_t>;
+
+// Edges are drawn in fixed blocks with their own generator, so the graph
+// does not depend on how blocks are spread over splits.
+constexpr int64_t kEdgesPerBlock = 1 << 16;
+constexpr uint64_t kBlockSeedStride = 0x9e3779b97f4a7c15ull;
+
+struct Edge {
+  int32_t u;
+  int32_t v;
+};
+
+class SplitRunner {
+ public:
+  SplitRunner(folly::Executor* executor, int num_splits)
+      : executor_(executor), splits_(std::max(num_splits, 1)) {}
+
+  /** Runs fn(begin, end) over splits of [0, count) and waits for all. */
+  template <typename Fn>
+  void run(int64_t count, Fn fn) const {
+    auto boundary = [this, count](int i) { return count * i / splits_; };
+    if (executor_ == nullptr || splits_ == 1) {
+      fn(int64_t{0}, count);
+      return;
+    }
+    std::vector<folly::Future<folly::Unit>> futures;
+    for (int i = 0; i < splits_; i++) {
+      const int64_t begin = boundary(i);
+      const int64_t end = boundary(i + 1);
+      futures.push_back(
+          folly::via(executor_, [fn, begin, end]() { fn(begin, end); }));
+    }
+    folly::collect(futures).get();
+  }
+
+ private:
+  folly::Executor* executor_;
+  int splits_;
+};
+
+class EdgeSampler {
+ public:
+  EdgeSampler(int scale, const GraphGeneratorOptions& options)
+      : scale_(scale), num_nodes_(int64_t{1} << scale), options_(options) {
+    if (options_.generator != GraphGenerator::kUniform) {
+      permutation_.resize(num_nodes_);
+      std::iota(permutation_.begin(), permutation_.end(), 0);
+      std::mt19937_64 rng(options_.seed);
+      std::shuffle(permutation_.begin(), permutation_.end(), rng);
+    }
+  }
+
+  Edge sample(std::mt19937_64& rng) const {
+    switch (options_.generator) {
+      case GraphGenerator::kRmat:
+        return sampleRmat(rng);
+      case GraphGenerator::kZipf:
+        return Edge{
+            permutation_[sampleZipfRank(rng)],
+            permutation_[sampleZipfRank(rng)]};
+      case GraphGenerator::kUniform:
+        break;
+    }
+    std::uniform_int_distribution<int32_t> node(0, num_nodes_ - 1);
+    return Edge{node(rng), node(rng)};
+  }
+
+ private:
+  Edge sampleRmat(std::mt19937_64& rng) const {
+    std::uniform_real_distribution<double> unit;
+    const double ab = options_.rmat_a + options_.rmat_b;
+    const double abc = ab + options_.rmat_c;
+    int32_t u = 0;
+    int32_t v = 0;
+    for (int level = 0; level < scale_; level++) {
+      const double r = unit(rng);
+      u = (u << 1) | (r >= ab ? 1 : 0);
+      v = (v << 1) |
+          ((r >= options_.rmat_a && r < ab) || r >= abc ? 1 : 0);
+    }
+    return Edge{permutation_[u], permutation_[v]};
+  }
+
+  // Inverts the CDF of the continuous power law x^-s on [1, num_nodes + 1),
+  // which tracks the discrete Zipf distribution closely for large graphs.
+  int32_t sampleZipfRank(std::mt19937_64& rng) const {
+    std::uniform_real_distribution<double> unit;
+    const double s = options_.zipf_exponent;
+    const double n = static_cast<double>(num_nodes_) + 1.0;
+    const double x = s == 1.0
+        ? std::pow(n, unit(rng))
+        : std::pow(1.0 + (std::pow(n, 1.0 - s) - 1.0) * unit(rng),
+                   1.0 / (1.0 - s));
+    const int64_t rank = static_cast<int64_t>(x) - 1;
+    return static_cast<int32_t>(std::min(std::max<int64_t>(rank, 0),
+                                         num_nodes_ - 1));
+  }
+
+  int scale_;
+  int64_t num_nodes_;
+  GraphGeneratorOptions options_;
+  std::vector<int32_t> permutation_;
+};
+
+std::vector<Edge> sampleEdges(
+    int scale,
+    int64_t num_edges,
+    const GraphGeneratorOptions& options,
+    const SplitRunner& runner) {
+  const EdgeSampler sampler(scale, options);
+  std::vector<Edge> edges(num_edges);
+  const int64_t num_blocks = (num_edges + kEdgesPerBlock - 1) / kEdgesPerBlock;
+  runner.run(num_blocks, [&](int64_t begin, int64_t end) {
+    for (int64_t block = begin; block < end; block++) {
+      std::mt19937_64 rng(options.seed + (block + 1) * kBlockSeedStride);
+      const int64_t last = std::min(num_edges, (block + 1) * kEdgesPerBlock);
+      for (int64_t e = block * kEdgesPerBlock; e < last; e++) {
+        edges[e] = sampler.sample(rng);
+      }
+    }
+  });
+  return edges;
+}
+
+struct Direction {
+  int32_t** index;
+  int32_t* neighs;
+};
+
+// Builds the CSR of one direction of edges, keyed by source for out-edges
+// and by destination for in-edges. The arrays are handed to the CSRGraph,
+// which frees them.
+Direction buildDirection(
+    const std::vector<Edge>& edges,
+    int64_t num_nodes,
+    bool by_destination,
+    const SplitRunner& runner) {
+  auto key = [by_destination](const Edge& e) {
+    return by_destination ? e.v : e.u;
+  };
+  auto value = [by_destination](const Edge& e) {
+    return by_destination ? e.u : e.v;
+  };
+  const int64_t num_edges = edges.size();
+
+  std::unique_ptr<std::atomic<int64_t>[]> cursors(
+      new std::atomic<int64_t>[num_nodes]);
+  runner.run(num_nodes, [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++) {
+      cursors[n].store(0, std::memory_order_relaxed);
+    }
+  });
+  runner.run(num_edges, [&](int64_t begin, int64_t end) {
+    for (int64_t e = begin; e < end; e++) {
+      cursors[key(edges[e])].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  std::vector<int64_t> offsets(num_nodes + 1, 0);
+  for (int64_t n = 0; n < num_nodes; n++) {
+    offsets[n + 1] = offsets[n] + cursors[n].load(std::memory_order_relaxed);
+    cursors[n].store(offsets[n], std::memory_order_relaxed);
+  }
+
+  std::unique_ptr<int32_t[]> scattered(new int32_t[num_edges]);
+  runner.run(num_edges, [&](int64_t begin, int64_t end) {
+    for (int64_t e = begin; e < end; e++) {
+      const int64_t pos =
+          cursors[key(edges[e])].fetch_add(1, std::memory_order_relaxed);
+      scattered[pos] = value(edges[e]);
+    }
+  });
+  cursors.reset();
+
+  // Sorting, dropping self loops and duplicates shrinks every neighborhood
+  // in place; the counts are compacted once the sizes are known
+  std::vector<int64_t> degrees(num_nodes);
+  runner.run(num_nodes, [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++) {
+      int32_t* first = scattered.get() + offsets[n];
+      int32_t* last = scattered.get() + offsets[n + 1];
+      std::sort(first, last);
+      last = std::unique(first, last);
+      last = std::remove(first, last, static_cast<int32_t>(n));
+      degrees[n] = last - first;
+    }
+  });
+  std::vector<int64_t> compact_offsets(num_nodes + 1, 0);
+  for (int64_t n = 0; n < num_nodes; n++) {
+    compact_offsets[n + 1] = compact_offsets[n] + degrees[n];
+  }
+
+  Direction direction;
+  direction.neighs = new int32_t[compact_offsets[num_nodes]];
+  direction.index = new int32_t*[num_nodes + 1];
+  runner.run(num_nodes, [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++) {
+      direction.index[n] = direction.neighs + compact_offsets[n];
+      std::memcpy(
+          direction.index[n],
+          scattered.get() + offsets[n],
+          degrees[n] * sizeof(int32_t));
+    }
+  });
+  direction.index[num_nodes] = direction.neighs + compact_offsets[num_nodes];
+  return direction;
+}
+
+} // namespace
+
+void validateGraphGeneratorOptions(const GraphGeneratorOptions& options) {
+  if (options.rmat_a < 0 || options.rmat_b < 0 || options.rmat_c < 0 ||
+      options.rmat_a + options.rmat_b + options.rmat_c > 1.0) {
+    throw std::invalid_argument(
+        "R-MAT probabilities a, b and c must be non-negative and sum to at "
+        "most 1");
+  }
+  if (!(options.zipf_exponent > 0)) {
+    throw std::invalid_argument("Zipf exponent must be positive");
+  }
+}
+
+uint64_t graphGeneratorFingerprint(const GraphGeneratorOptions& options) {
+  // FNV-1a over the options that shape the graph
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&hash](const void* data, size_t length) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++) {
+      hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+  };
+  const uint32_t generator = static_cast<uint32_t>(options.generator);
+  mix(&generator, sizeof(generator));
+  mix(&options.seed, sizeof(options.seed));
+  if (options.generator == GraphGenerator::kRmat) {
+    mix(&options.rmat_a, sizeof(options.rmat_a));
+    mix(&options.rmat_b, sizeof(options.rmat_b));
+    mix(&options.rmat_c, sizeof(options.rmat_c));
+  } else if (options.generator == GraphGenerator::kZipf) {
+    mix(&options.zipf_exponent, sizeof(options.zipf_exponent));
+  }
+  return hash;
+}
+
+CSRGraph<int32_t> generateGraph(
+    int scale,
+    int degree,
+    const GraphGeneratorOptions& options,
+    folly::Executor* executor,
+    int num_splits) {
+  if (scale < 0 || scale > 30) {
+    throw std::invalid_argument("graph scale must be between 0 and 30");
+  }
+  validateGraphGeneratorOptions(options);
+  const SplitRunner runner(executor, num_splits);
+  const int64_t num_nodes = int64_t{1} << scale;
+  const std::vector<Edge> edges =
+      sampleEdges(scale, num_nodes * std::max(degree, 0), options, runner);
+  const Direction out = buildDirection(edges, num_nodes, false, runner);
+  const Direction in = buildDirection(edges, num_nodes, true, runner);
+  return Graph(num_nodes, out.index, out.neighs, in.index, in.neighs);
+}
+
+} // namespace dwarfs
+} // namespace ranking
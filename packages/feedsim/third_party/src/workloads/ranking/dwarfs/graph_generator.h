@@ -0,0 +1,76 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRAPH_GENERATOR_H
+#define GRAPH_GENERATOR_H
+
+#include <cstdint>
+
+#include <gapbs/src/graph.h>
+
+namespace folly {
+class Executor;
+} // namespace folly
+
+namespace ranking {
+namespace dwarfs {
+
+/** Edge distributions for the synthetic PageRank graph.
+ * kUniform picks both endpoints uniformly, like GAPBS's -u generator.
+ * kRmat is the recursive R-MAT/Kronecker generator: every edge descends
+ * scale levels of the adjacency matrix, picking a quadrant with
+ * probabilities a, b, c and 1 - a - b - c.
+ * kZipf draws both endpoints from a power law over node ranks, so in- and
+ * out-degrees are Zipfian with the given exponent.
+ * Node ids are shuffled for kRmat and kZipf so that hubs do not cluster at
+ * the lowest ids.
+ */
+enum class GraphGenerator { kUniform, kRmat, kZipf };
+
+struct GraphGeneratorOptions {
+  GraphGenerator generator = GraphGenerator::kUniform;
+  // GAPBS's Graph500 defaults
+  double rmat_a = 0.57;
+  double rmat_b = 0.19;
+  double rmat_c = 0.19;
+  double zipf_exponent = 1.0;
+  uint64_t seed = 27491095;
+};
+
+/** Throws std::invalid_argument if options do not describe a distribution. */
+void validateGraphGeneratorOptions(const GraphGeneratorOptions& options);
+
+/** Identifies the graph options generates, for telling stale snapshots
+ * apart. Stable across runs and builds.
+ */
+uint64_t graphGeneratorFingerprint(const GraphGeneratorOptions& options);
+
+/** Generates a directed graph of 2^scale nodes and degree * 2^scale edge
+ * samples, with self loops and duplicate edges removed and every
+ * neighborhood sorted. Edge generation, counting, scattering and cleanup are
+ * split into num_splits chunks that run on executor, or inline without one.
+ * The graph only depends on scale, degree and options, not on the split.
+ * Throws std::invalid_argument for a scale that does not fit int32 ids.
+ */
+CSRGraph<int32_t> generateGraph(
+    int scale,
+    int degree,
+    const GraphGeneratorOptions& options,
+    folly::Executor* executor,
+    int num_splits);
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // GRAPH_GENERATOR_H
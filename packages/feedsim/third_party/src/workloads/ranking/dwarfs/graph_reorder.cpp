@@ -0,0 +1,210 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "graph_reorder.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <numeric>
+#include <vector>
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+using Graph = CSRGraph<int32_t>;
+
+constexpr int64_t kNodesPerLine = 64 / sizeof(float);
+constexpr int64_t kNodesPerPage = 4096 / sizeof(float);
+
+int64_t totalDegree(const Graph& graph, int32_t n) {
+  return graph.directed() ? graph.out_degree(n) + graph.in_degree(n)
+                          : graph.out_degree(n);
+}
+
+// Returns the old ids of the nodes in their new order.
+std::vector<int32_t> degreeOrder(const Graph& graph) {
+  std::vector<int32_t> order(graph.num_nodes());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&graph](int32_t a, int32_t b) {
+    return graph.out_degree(a) > graph.out_degree(b);
+  });
+  return order;
+}
+
+std::vector<int32_t> hubClusterOrder(const Graph& graph) {
+  std::vector<int32_t> order(graph.num_nodes());
+  std::iota(order.begin(), order.end(), 0);
+  const double average_degree = graph.num_nodes() == 0
+      ? 0.0
+      : static_cast<double>(graph.num_edges_directed()) / graph.num_nodes();
+  std::stable_partition(
+      order.begin(), order.end(), [&graph, average_degree](int32_t n) {
+        return graph.out_degree(n) > average_degree;
+      });
+  return order;
+}
+
+std::vector<int32_t> rcmOrder(const Graph& graph) {
+  const int64_t num_nodes = graph.num_nodes();
+  auto by_degree = [&graph](int32_t a, int32_t b) {
+    return totalDegree(graph, a) < totalDegree(graph, b);
+  };
+  // Every component starts from its lowest degree node, a cheap stand-in for
+  // a pseudo-peripheral one
+  std::vector<int32_t> roots(num_nodes);
+  std::iota(roots.begin(), roots.end(), 0);
+  std::stable_sort(roots.begin(), roots.end(), by_degree);
+
+  std::vector<int32_t> order;
+  order.reserve(num_nodes);
+  std::vector<bool> visited(num_nodes, false);
+  std::vector<int32_t> frontier;
+  for (int32_t root : roots) {
+    if (visited[root]) {
+      continue;
+    }
+    visited[root] = true;
+    size_t head = order.size();
+    order.push_back(root);
+    while (head < order.size()) {
+      const int32_t u = order[head++];
+      frontier.clear();
+      for (int32_t v : graph.out_neigh(u)) {
+        if (!visited[v]) {
+          visited[v] = true;
+          frontier.push_back(v);
+        }
+      }
+      if (graph.directed()) {
+        for (int32_t v : graph.in_neigh(u)) {
+          if (!visited[v]) {
+            visited[v] = true;
+            frontier.push_back(v);
+          }
+        }
+      }
+      std::stable_sort(frontier.begin(), frontier.end(), by_degree);
+      order.insert(order.end(), frontier.begin(), frontier.end());
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+// Builds one direction of the relabeled graph. The arrays are handed to the
+// CSRGraph, which frees them.
+template <typename NeighFn>
+int32_t** relabelDirection(
+    const std::vector<int32_t>& order,
+    const std::vector<int32_t>& new_ids,
+    NeighFn neigh,
+    int32_t** neighs_out) {
+  const int64_t num_nodes = order.size();
+  std::vector<int64_t> offsets(num_nodes + 1, 0);
+  for (int64_t p = 0; p < num_nodes; p++) {
+    auto hood = neigh(order[p]);
+    offsets[p + 1] = offsets[p] + (hood.end() - hood.begin());
+  }
+  int32_t* neighs = new int32_t[offsets[num_nodes]];
+  int32_t** index = new int32_t*[num_nodes + 1];
+  for (int64_t p = 0; p < num_nodes; p++) {
+    int32_t* dst = neighs + offsets[p];
+    index[p] = dst;
+    for (int32_t v : neigh(order[p])) {
+      *dst++ = new_ids[v];
+    }
+    std::sort(index[p], dst);
+  }
+  index[num_nodes] = neighs + offsets[num_nodes];
+  *neighs_out = neighs;
+  return index;
+}
+
+} // namespace
+
+CSRGraph<int32_t> reorderGraph(
+    const CSRGraph<int32_t>& graph,
+    GraphOrder order) {
+  std::vector<int32_t> new_order;
+  switch (order) {
+    case GraphOrder::kDegree:
+      new_order = degreeOrder(graph);
+      break;
+    case GraphOrder::kHubCluster:
+      new_order = hubClusterOrder(graph);
+      break;
+    case GraphOrder::kRcm:
+      new_order = rcmOrder(graph);
+      break;
+    case GraphOrder::kNone:
+      new_order.resize(graph.num_nodes());
+      std::iota(new_order.begin(), new_order.end(), 0);
+      break;
+  }
+  std::vector<int32_t> new_ids(new_order.size());
+  for (size_t p = 0; p < new_order.size(); p++) {
+    new_ids[new_order[p]] = static_cast<int32_t>(p);
+  }
+
+  int32_t* out_neighs = nullptr;
+  int32_t** out_index = relabelDirection(
+      new_order,
+      new_ids,
+      [&graph](int32_t n) { return graph.out_neigh(n); },
+      &out_neighs);
+  if (!graph.directed()) {
+    return Graph(graph.num_nodes(), out_index, out_neighs);
+  }
+  int32_t* in_neighs = nullptr;
+  int32_t** in_index = relabelDirection(
+      new_order,
+      new_ids,
+      [&graph](int32_t n) { return graph.in_neigh(n); },
+      &in_neighs);
+  return Graph(graph.num_nodes(), out_index, out_neighs, in_index, in_neighs);
+}
+
+GraphLocality measureLocality(const CSRGraph<int32_t>& graph) {
+  int64_t gathers = 0;
+  int64_t line_hits = 0;
+  int64_t page_hits = 0;
+  double line_gaps = 0.0;
+  int64_t prev = -1;
+  for (int64_t u = 0; u < graph.num_nodes(); u++) {
+    for (int32_t v : graph.in_neigh(u)) {
+      if (prev >= 0) {
+        const int64_t line_gap =
+            std::llabs(v / kNodesPerLine - prev / kNodesPerLine);
+        line_hits += line_gap == 0 ? 1 : 0;
+        page_hits += v / kNodesPerPage == prev / kNodesPerPage ? 1 : 0;
+        line_gaps += line_gap;
+        gathers++;
+      }
+      prev = v;
+    }
+  }
+  GraphLocality locality{};
+  if (gathers > 0) {
+    locality.line_hit_fraction = static_cast<double>(line_hits) / gathers;
+    locality.page_hit_fraction = static_cast<double>(page_hits) / gathers;
+    locality.mean_line_gap = line_gaps / gathers;
+  }
+  return locality;
+}
+
+} // namespace dwarfs
+} // namespace ranking
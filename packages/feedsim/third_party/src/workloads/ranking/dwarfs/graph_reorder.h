@@ -0,0 +1,61 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRAPH_REORDER_H
+#define GRAPH_REORDER_H
+
+#include <cstdint>
+
+#include <gapbs/src/graph.h>
+
+namespace ranking {
+namespace dwarfs {
+
+/** Node relabelings applied to the synthetic graph before ranking.
+ *
+ * The pull sweep reads contrib[v] for every in-neighbor v of each node, so
+ * the order of node ids decides how those gathers land in the cache.
+ * kDegree sorts nodes by descending out-degree so the most gathered sources
+ * share cache lines; kHubCluster moves only the nodes of above average
+ * out-degree to the front and keeps everything else in place; kRcm is
+ * reverse Cuthill-McKee, which keeps the ids of neighbors close together.
+ */
+enum class GraphOrder { kNone, kDegree, kHubCluster, kRcm };
+
+/** How well the pull sweep's contribution gathers follow each other. */
+struct GraphLocality {
+  // Fractions of gathers that hit the 64-byte line or the 4 KiB page of the
+  // gather right before them
+  double line_hit_fraction;
+  double page_hit_fraction;
+  // Mean distance between consecutive gathers, in cache lines
+  double mean_line_gap;
+};
+
+/** Returns a copy of graph with nodes relabeled by order and each
+ * neighborhood sorted by the new ids. kNone returns an identical copy.
+ */
+CSRGraph<int32_t> reorderGraph(
+    const CSRGraph<int32_t>& graph,
+    GraphOrder order);
+
+/** Walks the in-neighborhoods of graph in node order, as the pull kernel
+ * does, and measures the locality of the gathers.
+ */
+GraphLocality measureLocality(const CSRGraph<int32_t>& graph);
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // GRAPH_REORDER_H
@@ -0,0 +1,254 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "graph_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+using Graph = CSRGraph<int32_t>;
+
+constexpr size_t kWriteChunkEntries = 1u << 20u;
+
+uint64_t alignUp(uint64_t pos) {
+  return (pos + kGraphSnapshotAlignment - 1) & ~(kGraphSnapshotAlignment - 1);
+}
+
+void writeAt(int fd, uint64_t pos, const void* data, size_t length) {
+  const char* bytes = static_cast<const char*>(data);
+  while (length > 0) {
+    ssize_t written = pwrite(fd, bytes, length, pos);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(
+          std::string("graph snapshot write failed: ") + std::strerror(errno));
+    }
+    bytes += written;
+    pos += written;
+    length -= written;
+  }
+}
+
+// Writes the offsets and the concatenated neighborhoods of one direction
+// starting at offsets_pos and neighs_pos respectively.
+template <typename NeighFn>
+void writeDirection(
+    int fd,
+    int64_t num_nodes,
+    uint64_t offsets_pos,
+    uint64_t neighs_pos,
+    NeighFn neigh) {
+  std::vector<int64_t> offsets;
+  offsets.reserve(num_nodes + 1);
+  std::vector<int32_t> chunk;
+  chunk.reserve(kWriteChunkEntries);
+
+  int64_t offset = 0;
+  uint64_t pos = neighs_pos;
+  for (int64_t n = 0; n < num_nodes; n++) {
+    offsets.push_back(offset);
+    for (int32_t v : neigh(n)) {
+      chunk.push_back(v);
+      offset++;
+      if (chunk.size() == kWriteChunkEntries) {
+        writeAt(fd, pos, chunk.data(), chunk.size() * sizeof(int32_t));
+        pos += chunk.size() * sizeof(int32_t);
+        chunk.clear();
+      }
+    }
+  }
+  offsets.push_back(offset);
+  writeAt(fd, pos, chunk.data(), chunk.size() * sizeof(int32_t));
+  writeAt(fd, offsets_pos, offsets.data(), offsets.size() * sizeof(int64_t));
+}
+
+int64_t countEdges(const Graph& graph, bool in_edges) {
+  int64_t edges = 0;
+  for (int64_t n = 0; n < graph.num_nodes(); n++) {
+    edges += in_edges ? graph.in_degree(n) : graph.out_degree(n);
+  }
+  return edges;
+}
+
+int32_t** makeIndex(
+    const int64_t* offsets,
+    int32_t* neighs,
+    int64_t num_nodes) {
+  int32_t** index = new int32_t*[num_nodes + 1];
+  for (int64_t n = 0; n <= num_nodes; n++) {
+    index[n] = neighs + offsets[n];
+  }
+  return index;
+}
+
+} // namespace
+
+void writeGraphSnapshot(
+    const CSRGraph<int32_t>& graph,
+    int scale,
+    int degree,
+    uint64_t generator,
+    const std::string& path) {
+  GraphSnapshotHeader header{};
+  header.magic = kGraphSnapshotMagic;
+  header.version = kGraphSnapshotVersion;
+  header.directed = graph.directed() ? 1 : 0;
+  header.scale = scale;
+  header.degree = degree;
+  header.generator = generator;
+  header.num_nodes = graph.num_nodes();
+  header.num_out_edges = countEdges(graph, false);
+  header.num_in_edges = graph.directed() ? countEdges(graph, true) : 0;
+
+  const uint64_t offsets_size = (header.num_nodes + 1) * sizeof(int64_t);
+  header.out_offsets_pos = alignUp(sizeof(header));
+  header.out_neighs_pos = alignUp(header.out_offsets_pos + offsets_size);
+  header.in_offsets_pos = alignUp(
+      header.out_neighs_pos + header.num_out_edges * sizeof(int32_t));
+  header.in_neighs_pos = alignUp(header.in_offsets_pos + offsets_size);
+
+  // Write to a temporary file first so a reader never maps a partial file
+  const std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error(
+        "cannot create graph snapshot " + tmp_path + ": " +
+        std::strerror(errno));
+  }
+  try {
+    writeDirection(
+        fd,
+        header.num_nodes,
+        header.out_offsets_pos,
+        header.out_neighs_pos,
+        [&graph](int64_t n) { return graph.out_neigh(n); });
+    if (header.directed != 0) {
+      writeDirection(
+          fd,
+          header.num_nodes,
+          header.in_offsets_pos,
+          header.in_neighs_pos,
+          [&graph](int64_t n) { return graph.in_neigh(n); });
+    }
+    writeAt(fd, 0, &header, sizeof(header));
+  } catch (...) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw;
+  }
+  if (fsync(fd) != 0 || close(fd) != 0 ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error(
+        "cannot finalize graph snapshot " + path + ": " +
+        std::strerror(errno));
+  }
+}
+
+std::shared_ptr<const CSRGraph<int32_t>>
+mapGraphSnapshot(
+    int scale,
+    int degree,
+    uint64_t generator,
+    const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(GraphSnapshotHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t size = st.st_size;
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const auto* header = static_cast<const GraphSnapshotHeader*>(addr);
+  const uint64_t offsets_size = (header->num_nodes + 1) * sizeof(int64_t);
+  const bool valid = header->magic == kGraphSnapshotMagic &&
+      header->version == kGraphSnapshotVersion && header->scale == scale &&
+      header->degree == degree && header->generator == generator &&
+      header->num_nodes >= 0 &&
+      header->out_offsets_pos + offsets_size <= size &&
+      header->out_neighs_pos + header->num_out_edges * sizeof(int32_t) <=
+          size &&
+      (header->directed == 0 ||
+       (header->in_offsets_pos + offsets_size <= size &&
+        header->in_neighs_pos + header->num_in_edges * sizeof(int32_t) <=
+            size));
+  if (!valid) {
+    munmap(addr, size);
+    return nullptr;
+  }
+
+  // Both hints are best effort: file-backed THP depends on the filesystem
+  // and kernel configuration.
+  madvise(addr, size, MADV_HUGEPAGE);
+  madvise(addr, size, MADV_WILLNEED);
+
+  char* base = static_cast<char*>(addr);
+  const int64_t num_nodes = header->num_nodes;
+  auto* out_offsets =
+      reinterpret_cast<const int64_t*>(base + header->out_offsets_pos);
+  auto* out_neighs = reinterpret_cast<int32_t*>(base + header->out_neighs_pos);
+  int32_t** out_index = makeIndex(out_offsets, out_neighs, num_nodes);
+  int32_t** in_index = nullptr;
+
+  // CSRGraph's destructor delete[]s its neighbor arrays, which live in the
+  // mapping here. Construct it in raw storage and release the pieces by hand
+  // instead of running the destructor.
+  void* storage = ::operator new(sizeof(Graph));
+  Graph* graph;
+  if (header->directed != 0) {
+    auto* in_offsets =
+        reinterpret_cast<const int64_t*>(base + header->in_offsets_pos);
+    auto* in_neighs = reinterpret_cast<int32_t*>(base + header->in_neighs_pos);
+    in_index = makeIndex(in_offsets, in_neighs, num_nodes);
+    graph = new (storage)
+        Graph(num_nodes, out_index, out_neighs, in_index, in_neighs);
+  } else {
+    graph = new (storage) Graph(num_nodes, out_index, out_neighs);
+  }
+
+  return std::shared_ptr<const Graph>(
+      graph, [addr, size, out_index, in_index](const Graph* g) {
+        delete[] out_index;
+        delete[] in_index;
+        munmap(addr, size);
+        ::operator delete(const_cast<Graph*>(g));
+      });
+}
+
+} // namespace dwarfs
+} // namespace ranking
@@ -0,0 +1,80 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRAPH_SNAPSHOT_H
+#define GRAPH_SNAPSHOT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <gapbs/src/graph.h>
+
+namespace ranking {
+namespace dwarfs {
+
+/** Flat on-disk CSR layout used to skip graph generation on restarts.
+ *
+ * The file starts with a GraphSnapshotHeader followed by the out-offsets
+ * (num_nodes + 1 int64 values), the out-neighbors (int32), and for directed
+ * graphs the in-offsets and in-neighbors. Every section begins on a
+ * kGraphSnapshotAlignment boundary so it can be backed by huge pages.
+ */
+struct GraphSnapshotHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t directed;
+  int32_t scale;
+  int32_t degree;
+  // graphGeneratorFingerprint() of the generator options
+  uint64_t generator;
+  int64_t num_nodes;
+  int64_t num_out_edges;
+  int64_t num_in_edges;
+  uint64_t out_offsets_pos;
+  uint64_t out_neighs_pos;
+  uint64_t in_offsets_pos;
+  uint64_t in_neighs_pos;
+};
+
+constexpr uint64_t kGraphSnapshotMagic = 0x31305253435047ull; // "GPCSR01"
+constexpr uint32_t kGraphSnapshotVersion = 2;
+constexpr uint64_t kGraphSnapshotAlignment = 2ull << 20u;
+
+/** Writes graph to path, replacing any existing file. Throws
+ * std::runtime_error on I/O failure.
+ */
+void writeGraphSnapshot(
+    const CSRGraph<int32_t>& graph,
+    int scale,
+    int degree,
+    uint64_t generator,
+    const std::string& path);
+
+/** Maps the snapshot at path read-only and returns a graph whose neighbor
+ * arrays live in the mapping. Returns nullptr if the file is missing or was
+ * generated with a different scale, degree or generator. The mapping is released when
+ * the last reference to the graph goes away.
+ */
+std::shared_ptr<const CSRGraph<int32_t>>
+mapGraphSnapshot(
+    int scale,
+    int degree,
+    uint64_t generator,
+    const std::string& path);
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // GRAPH_SNAPSHOT_H
@@ -0,0 +1,242 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "incremental_pagerank.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+// Finding a source with out-edges to delete gives up after this many draws
+constexpr int kDeleteTries = 8;
+
+} // namespace
+
+IncrementalPageRank::IncrementalPageRank(
+    std::shared_ptr<const CSRGraph<int32_t>> graph,
+    double epsilon,
+    int64_t max_delta_edges,
+    uint64_t seed)
+    : graph_(std::move(graph)),
+      threshold_(epsilon / graph_->num_nodes()),
+      max_delta_edges_(max_delta_edges),
+      rng_(seed),
+      scores_(graph_->num_nodes(), 0.0f),
+      residuals_(
+          graph_->num_nodes(), (1.0f - kDamp) / graph_->num_nodes()),
+      out_degrees_(graph_->num_nodes()),
+      in_frontier_(graph_->num_nodes(), 1),
+      touched_epochs_(graph_->num_nodes(), 0) {
+  const int32_t num_nodes = graph_->num_nodes();
+  next_frontier_.reserve(num_nodes);
+  frontier_.reserve(num_nodes);
+  for (int32_t u = 0; u < num_nodes; u++) {
+    out_degrees_[u] = graph_->out_degree(u);
+    next_frontier_.push_back(u);
+  }
+  // Every round shrinks the mass still in flight by kDamp, so a cold start
+  // always drains the frontier
+  IncrementalRankStats stats;
+  propagate(std::numeric_limits<int>::max(), stats);
+}
+
+IncrementalRankStats IncrementalPageRank::update(
+    int num_updates,
+    int max_iters) {
+  std::lock_guard<std::mutex> guard(lock_);
+  const auto start = std::chrono::steady_clock::now();
+  IncrementalRankStats stats;
+  if (++epoch_ == 0) {
+    std::fill(touched_epochs_.begin(), touched_epochs_.end(), 0);
+    epoch_ = 1;
+  }
+  touched_ = 0;
+
+  if (delta_edges_ + num_updates > max_delta_edges_) {
+    clearDelta();
+  }
+  for (int i = 0; i < num_updates; i++) {
+    if (i % 2 == 0 ? insertRandomEdge() : deleteRandomEdge()) {
+      stats.edge_updates++;
+    }
+  }
+  stats.iterations = propagate(max_iters, stats);
+  stats.touched_vertices = touched_;
+  stats.delta_edges = delta_edges_;
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  stats.seconds = elapsed.count();
+  return stats;
+}
+
+template <typename F>
+void IncrementalPageRank::forEachOutNeighbor(int32_t u, F f) const {
+  const auto it = delta_.find(u);
+  if (it == delta_.end()) {
+    for (int32_t v : graph_->out_neigh(u)) {
+      f(v);
+    }
+    return;
+  }
+  const VertexDelta& delta = it->second;
+  for (int32_t v : graph_->out_neigh(u)) {
+    if (!std::binary_search(delta.removed.begin(), delta.removed.end(), v)) {
+      f(v);
+    }
+  }
+  for (int32_t v : delta.added) {
+    f(v);
+  }
+}
+
+void IncrementalPageRank::touch(int32_t v) {
+  if (touched_epochs_[v] != epoch_) {
+    touched_epochs_[v] = epoch_;
+    touched_++;
+  }
+}
+
+void IncrementalPageRank::addResidual(int32_t v, float amount) {
+  residuals_[v] += amount;
+  touch(v);
+  if (!in_frontier_[v] && std::fabs(residuals_[v]) > threshold_) {
+    in_frontier_[v] = 1;
+    next_frontier_.push_back(v);
+  }
+}
+
+template <typename Change>
+void IncrementalPageRank::changeOutEdges(int32_t u, Change change) {
+  // Every out-neighbor has received kDamp * score / degree from u; residuals
+  // may go negative while the old share is taken back
+  const float pushed = scores_[u];
+  if (out_degrees_[u] > 0 && pushed != 0.0f) {
+    const float share = -kDamp * pushed / out_degrees_[u];
+    forEachOutNeighbor(u, [&](int32_t v) { addResidual(v, share); });
+  }
+  VertexDelta& delta = delta_[u];
+  const int64_t added = delta.added.size();
+  const int64_t removed = delta.removed.size();
+  change(delta);
+  delta_edges_ += static_cast<int64_t>(delta.added.size()) - added +
+      static_cast<int64_t>(delta.removed.size()) - removed;
+  out_degrees_[u] = graph_->out_degree(u) -
+      static_cast<int64_t>(delta.removed.size()) + delta.added.size();
+  if (delta.added.empty() && delta.removed.empty()) {
+    delta_.erase(u);
+  }
+  if (out_degrees_[u] > 0 && pushed != 0.0f) {
+    const float share = kDamp * pushed / out_degrees_[u];
+    forEachOutNeighbor(u, [&](int32_t v) { addResidual(v, share); });
+  }
+  touch(u);
+}
+
+bool IncrementalPageRank::insertRandomEdge() {
+  std::uniform_int_distribution<int32_t> nodes(0, graph_->num_nodes() - 1);
+  const int32_t u = nodes(rng_);
+  const int32_t v = nodes(rng_);
+  if (u == v) {
+    return false;
+  }
+  // Like the generators, the delta does not check for an existing u -> v,
+  // so an insertion may duplicate an edge
+  changeOutEdges(u, [v](VertexDelta& delta) { delta.added.push_back(v); });
+  return true;
+}
+
+bool IncrementalPageRank::deleteRandomEdge() {
+  std::uniform_int_distribution<int32_t> nodes(0, graph_->num_nodes() - 1);
+  for (int i = 0; i < kDeleteTries; i++) {
+    const int32_t u = nodes(rng_);
+    if (out_degrees_[u] == 0) {
+      continue;
+    }
+    const int32_t index = std::uniform_int_distribution<int32_t>(
+        0, out_degrees_[u] - 1)(rng_);
+    int32_t v = -1;
+    int32_t position = 0;
+    forEachOutNeighbor(u, [&](int32_t w) {
+      if (position++ == index) {
+        v = w;
+      }
+    });
+    changeOutEdges(u, [v](VertexDelta& delta) {
+      auto added = std::find(delta.added.begin(), delta.added.end(), v);
+      if (added != delta.added.end()) {
+        delta.added.erase(added);
+      } else {
+        delta.removed.insert(
+            std::upper_bound(delta.removed.begin(), delta.removed.end(), v),
+            v);
+      }
+    });
+    return true;
+  }
+  return false;
+}
+
+void IncrementalPageRank::clearDelta() {
+  std::vector<int32_t> sources;
+  sources.reserve(delta_.size());
+  for (const auto& entry : delta_) {
+    sources.push_back(entry.first);
+  }
+  for (int32_t u : sources) {
+    changeOutEdges(u, [](VertexDelta& delta) {
+      delta.added.clear();
+      delta.removed.clear();
+    });
+  }
+}
+
+int IncrementalPageRank::propagate(int max_iters, IncrementalRankStats& stats) {
+  int rounds = 0;
+  while (!next_frontier_.empty() && rounds < max_iters) {
+    frontier_.swap(next_frontier_);
+    next_frontier_.clear();
+    // Pushing may put a vertex of this round straight back in the next one
+    for (int32_t u : frontier_) {
+      in_frontier_[u] = 0;
+    }
+    for (int32_t u : frontier_) {
+      const float residual = residuals_[u];
+      if (std::fabs(residual) <= threshold_) {
+        continue;
+      }
+      residuals_[u] = 0.0f;
+      scores_[u] += residual;
+      touch(u);
+      stats.pushes++;
+      if (out_degrees_[u] == 0) {
+        continue;
+      }
+      const float share = kDamp * residual / out_degrees_[u];
+      forEachOutNeighbor(u, [&](int32_t v) { addResidual(v, share); });
+    }
+    rounds++;
+  }
+  stats.converged = next_frontier_.empty();
+  return rounds;
+}
+
+} // namespace dwarfs
+} // namespace ranking
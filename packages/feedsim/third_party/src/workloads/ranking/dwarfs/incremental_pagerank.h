@@ -0,0 +1,128 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCREMENTAL_PAGERANK_H
+#define INCREMENTAL_PAGERANK_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <gapbs/src/graph.h>
+
+namespace ranking {
+namespace dwarfs {
+
+/** What one IncrementalPageRank::update call did. */
+struct IncrementalRankStats {
+  // Edge insertions and deletions applied before propagating
+  int edge_updates = 0;
+  // Frontier rounds until no residual was above the threshold, or the cap
+  int iterations = 0;
+  // Distinct vertices whose score or residual changed
+  int64_t touched_vertices = 0;
+  // Residuals pushed to out-neighbors
+  int64_t pushes = 0;
+  // Inserted and deleted edges held in the delta after the call
+  int64_t delta_edges = 0;
+  double seconds = 0.0;
+  bool converged = false;
+};
+
+/** PageRank kept warm across calls over a graph that changes a little every
+ * call.
+ *
+ * The base graph is shared and read-only; inserted and deleted edges live in
+ * a per-source delta on top of it. Scores are maintained with residual
+ * pushing (forward-push, or delta-based, PageRank): every vertex holds a
+ * score and a residual of rank mass not yet passed on, and only vertices
+ * whose residual exceeds the threshold are in the frontier. Changing the
+ * out-edges of a vertex moves the mass it already pushed from its old
+ * out-neighbors' residuals to its new ones, so a small update batch only
+ * wakes the vertices around the changed edges.
+ */
+class IncrementalPageRank {
+ public:
+  constexpr static const float kDamp = 0.85;
+
+  /** Converges the scores of graph from scratch, pushing until every
+   * residual is at most epsilon / num_nodes. The delta is cleared whenever
+   * it grows past max_delta_edges.
+   */
+  IncrementalPageRank(
+      std::shared_ptr<const CSRGraph<int32_t>> graph,
+      double epsilon,
+      int64_t max_delta_edges,
+      uint64_t seed);
+
+  /** Applies num_updates random edge updates, half insertions and half
+   * deletions, then pushes residuals for at most max_iters frontier rounds.
+   * Calls are serialized on an internal lock.
+   */
+  IncrementalRankStats update(int num_updates, int max_iters);
+
+  const std::vector<float>& scores() const {
+    return scores_;
+  }
+
+ private:
+  struct VertexDelta {
+    std::vector<int32_t> added;
+    // Sorted base out-neighbors that were deleted
+    std::vector<int32_t> removed;
+  };
+
+  template <typename F>
+  void forEachOutNeighbor(int32_t u, F f) const;
+  void addResidual(int32_t v, float amount);
+  void touch(int32_t v);
+  // Moves the mass u already pushed from its current out-neighbors to the
+  // ones left after change(delta) runs
+  template <typename Change>
+  void changeOutEdges(int32_t u, Change change);
+  bool insertRandomEdge();
+  bool deleteRandomEdge();
+  void clearDelta();
+  // Runs frontier rounds and returns their count
+  int propagate(int max_iters, IncrementalRankStats& stats);
+
+  std::mutex lock_;
+  std::shared_ptr<const CSRGraph<int32_t>> graph_;
+  float threshold_;
+  int64_t max_delta_edges_;
+  std::mt19937_64 rng_;
+
+  std::vector<float> scores_;
+  std::vector<float> residuals_;
+  // Out-degrees with the delta applied
+  std::vector<int32_t> out_degrees_;
+  std::unordered_map<int32_t, VertexDelta> delta_;
+  int64_t delta_edges_ = 0;
+
+  std::vector<int32_t> frontier_;
+  std::vector<int32_t> next_frontier_;
+  std::vector<uint8_t> in_frontier_;
+  // Stamped with epoch_ to count each touched vertex once per update
+  std::vector<uint32_t> touched_epochs_;
+  uint32_t epoch_ = 0;
+  int64_t touched_ = 0;
+};
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // INCREMENTAL_PAGERANK_H
@@ -25,64 +25,343 @@
 
 #include "pagerank.h"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <numeric>
 #include <random>
 #include <string>
+#include <vector>
+
+#include <folly/Executor.h>
+#include <folly/futures/Future.h>
 
 #include <gapbs/src/benchmark.h>
-#include <gapbs/src/command_line.h>
 
 namespace ranking {
 namespace dwarfs {
 
-constexpr auto kPageRankTrials = 10;
-constexpr auto kPageRankTolerance = 1e-4;
-constexpr auto kPageRankMaxIters = 20;
-
 struct PageRankParams::Impl {
- public:
-  explicit Impl(std::unique_ptr<CLPageRankDummy> cli) : cli_{std::move(cli)} {
-    cli_->ParseArgs();
-    builder_ = std::make_unique<Builder>(*cli_);
-  }
-  CSRGraph<int32_t> makeGraph() {
-    return std::move(builder_->MakeGraph());
-  }
-
- private:
-  std::unique_ptr<Builder> builder_;
-  std::unique_ptr<CLPageRankDummy> cli_;
+  GraphGeneratorOptions generator;
 };
 
-PageRankParams::PageRankParams(int scale, int degrees)
-    : scale_(scale), degrees_(degrees) {
-  auto scale_str = std::to_string(scale_);
-  std::unique_ptr<CLPageRankDummy> cli{new CLPageRankDummy(
-      scale,
-      degrees,
-      true,
-      kPageRankTrials,
-      kPageRankTolerance,
-      kPageRankMaxIters)};
-  pimpl = std::make_unique<Impl>(std::move(cli));
+PageRankParams::PageRankParams(
+    int scale,
+    int degrees,
+    GraphGeneratorOptions generator)
+    : pimpl(std::make_unique<Impl>()), scale_(scale), degrees_(degrees) {
+  validateGraphGeneratorOptions(generator);
+  pimpl->generator = std::move(generator);
 }
 
 PageRankParams::~PageRankParams() = default;
 
-CSRGraph<int32_t> PageRankParams::buildGraph() {
-  return pimpl->makeGraph();
+CSRGraph<int32_t> PageRankParams::buildGraph(
+    folly::Executor* executor,
+    int num_splits) {
+  return generateGraph(
+      scale_, degrees_, pimpl->generator, executor, num_splits);
+}
+
+const GraphGeneratorOptions& PageRankParams::generatorOptions() const {
+  return pimpl->generator;
 }
 
-PageRank::PageRank(CSRGraph<int32_t> graph, int num_pvectors_entries)
-    : graph_(std::move(graph)), num_pvectors_entries_(num_pvectors_entries) {
-  const float init_score = 1.0f / graph_.num_nodes();
+PageRank::PageRank(
+    CSRGraph<int32_t> graph,
+    int num_pvectors_entries,
+    PageRankKernel kernel,
+    int64_t block_bytes,
+    const PageRankSimdKernels* simd,
+    std::shared_ptr<const CompressedNeighbors> compressed,
+    const PageRankHalfKernels* half)
+    : PageRank(
+          std::make_shared<const CSRGraph<int32_t>>(std::move(graph)),
+          num_pvectors_entries,
+          kernel,
+          block_bytes,
+          simd,
+          std::move(compressed),
+          half) {}
+
+PageRank::PageRank(
+    std::shared_ptr<const CSRGraph<int32_t>> graph,
+    int num_pvectors_entries,
+    PageRankKernel kernel,
+    int64_t block_bytes,
+    const PageRankSimdKernels* simd,
+    std::shared_ptr<const CompressedNeighbors> compressed,
+    const PageRankHalfKernels* half)
+    : graph_(std::move(graph)),
+      num_pvectors_entries_(num_pvectors_entries),
+      kernel_(kernel),
+      simd_(simd),
+      half_(half) {
+  if (kernel_ == PageRankKernel::kCompressedPull) {
+    compressed_ = compressed != nullptr
+        ? std::move(compressed)
+        : std::make_shared<const CompressedNeighbors>(*graph_);
+  }
+  const int64_t block_nodes = block_bytes / static_cast<int64_t>(sizeof(float));
+  block_nodes_ = block_nodes > 0
+      ? static_cast<NodeID>(std::min(block_nodes, graph_->num_nodes()))
+      : static_cast<NodeID>(graph_->num_nodes());
+  if (simd_ != nullptr || half_ != nullptr) {
+    // Multiplying by a precomputed reciprocal keeps the vector contribution
+    // loop free of divides.
+    inv_out_degree_ = pvector<float>(graph_->num_nodes());
+    for (NodeID n = 0; n < graph_->num_nodes(); n++) {
+      inv_out_degree_[n] = 1.0f / graph_->out_degree(n);
+    }
+  }
+  if (half_ != nullptr && half_->precision == ContribPrecision::kFp16) {
+    // Scores average 1 / num_nodes, which leaves contributions of large
+    // graphs in fp16's subnormal range or below it
+    contrib_scale_ = static_cast<float>(graph_->num_nodes());
+  }
+  const float init_score = 1.0f / graph_->num_nodes();
+  scores_pvectors_.resize(num_pvectors_entries);
+  range_seeds_.resize(num_pvectors_entries);
+  range_seeded_.resize(num_pvectors_entries);
+  outgoing_pvectors_.resize(num_pvectors_entries);
+  half_outgoing_pvectors_.resize(num_pvectors_entries);
+  incoming_pvectors_.resize(num_pvectors_entries);
+  cursor_pvectors_.resize(num_pvectors_entries);
   for (int i = 0; i < num_pvectors_entries; i++) {
-    pvector<float> scores{graph_.num_nodes(), init_score};
-    pvector<float> outgoing_contrib{graph_.num_nodes()};
+    scores_pvectors_[i] = pvector<float>(graph_->num_nodes(), init_score);
+    if (half_ != nullptr) {
+      half_outgoing_pvectors_[i] =
+          pvector<uint16_t>(graph_->num_nodes() + 1, 0);
+    } else {
+      outgoing_pvectors_[i] = pvector<float>(graph_->num_nodes());
+    }
+
+    if (kernel_ == PageRankKernel::kBlockedPull || simd_ != nullptr ||
+        half_ != nullptr) {
+      incoming_pvectors_[i] = pvector<float>(graph_->num_nodes());
+    }
+    if (kernel_ == PageRankKernel::kBlockedPull) {
+      cursor_pvectors_[i] = pvector<const NodeID*>(graph_->num_nodes());
+    }
+  }
+}
+
+void PageRank::seedRanges(int thread_id, uint64_t seed) {
+  range_seeds_[thread_id] = seed;
+  range_seeded_[thread_id] = 1;
+}
+
+PageRank::Ranges PageRank::chooseRanges(int thread_id, int subset) const {
+  const int64_t num_nodes = subset > 0
+      ? std::min(static_cast<int64_t>(subset), graph_->num_nodes())
+      : graph_->num_nodes();
+
+  std::uniform_int_distribution<int64_t> u_dist{
+      0,
+      num_nodes < graph_->num_nodes() ? graph_->num_nodes() - num_nodes
+                                      : graph_->num_nodes()};
+  std::random_device rd;
+  const bool seeded = range_seeded_[thread_id] != 0;
+  const uint64_t seed = range_seeds_[thread_id];
+  std::mt19937 gen(seeded ? static_cast<uint32_t>(seed) : rd());
+  NodeID start = u_dist(gen);
+
+  const auto split_size = std::max(num_pvectors_entries_, 1);
+  std::uniform_int_distribution<int64_t> split_dist{
+      0, graph_->num_nodes() / split_size - 1};
+  std::mt19937 split_gen(seeded ? static_cast<uint32_t>(seed >> 32) : rd());
+  NodeID split_start = split_dist(split_gen);
+  NodeID split_end = split_start + (graph_->num_nodes() / split_size) - 1;
+
+  return Ranges{
+      split_start, split_end, start, static_cast<NodeID>(start + num_nodes)};
+}
+
+void PageRank::computeContrib(int thread_id, NodeID begin, NodeID end) {
+  pvector<float>& scores = scores_pvectors_[thread_id];
+  if (half_ != nullptr) {
+    half_->contrib(
+        scores.begin() + begin,
+        inv_out_degree_.begin() + begin,
+        contrib_scale_,
+        half_outgoing_pvectors_[thread_id].begin() + begin,
+        end - begin);
+    return;
+  }
+  pvector<float>& outgoing_contrib = outgoing_pvectors_[thread_id];
+  if (simd_ != nullptr) {
+    simd_->contrib(
+        scores.begin() + begin,
+        inv_out_degree_.begin() + begin,
+        outgoing_contrib.begin() + begin,
+        end - begin);
+    return;
+  }
+  for (NodeID n = begin; n < end; n++) {
+    outgoing_contrib[n] = scores[n] / graph_->out_degree(n);
+  }
+}
+
+double PageRank::pullRange(
+    int thread_id,
+    float base_score,
+    NodeID begin,
+    NodeID end) {
+  if (simd_ != nullptr || half_ != nullptr) {
+    pvector<float>& incoming = incoming_pvectors_[thread_id];
+    for (NodeID u = begin; u < end; u++) {
+      auto neigh = graph_->in_neigh(u);
+      incoming[u] = gatherContrib(
+          thread_id, neigh.begin(), neigh.end() - neigh.begin());
+    }
+    return updateScores(thread_id, base_score, begin, end);
+  }
+  pvector<float>& scores = scores_pvectors_[thread_id];
+  pvector<float>& outgoing_contrib = outgoing_pvectors_[thread_id];
+  double error = 0;
+  for (NodeID u = begin; u < end; u++) {
+    float incoming_total = 0;
+    for (NodeID v : graph_->in_neigh(u)) {
+      incoming_total += outgoing_contrib[v];
+    }
+    float old_score = scores[u];
+    scores[u] = base_score + kDamp * incoming_total;
+    error += std::fabs(scores[u] - old_score);
+  }
+  return error;
+}
+
+/** Source-blocked variant of pullRange. GAPBS builders sort every
+ * neighborhood, so each destination keeps a cursor into its in-neighbors and
+ * only consumes the sources that fall into the current block before moving
+ * on to the next destination.
+ */
+double PageRank::pullBlockedRange(
+    int thread_id,
+    float base_score,
+    NodeID begin,
+    NodeID end) {
+  pvector<float>& outgoing_contrib = outgoing_pvectors_[thread_id];
+  pvector<float>& incoming = incoming_pvectors_[thread_id];
+  pvector<const NodeID*>& cursors = cursor_pvectors_[thread_id];
+
+  for (NodeID u = begin; u < end; u++) {
+    incoming[u] = 0;
+    cursors[u] = graph_->in_neigh(u).begin();
+  }
+
+  const NodeID total_nodes = static_cast<NodeID>(graph_->num_nodes());
+  for (NodeID block_start = 0; block_start < total_nodes;
+       block_start += block_nodes_) {
+    const NodeID block_end = block_start + block_nodes_;
+    for (NodeID u = begin; u < end; u++) {
+      const NodeID* it = cursors[u];
+      const NodeID* const neigh_end = graph_->in_neigh(u).end();
+      float partial = 0;
+      if (simd_ != nullptr || half_ != nullptr) {
+        const NodeID* run_end = std::lower_bound(it, neigh_end, block_end);
+        partial = gatherContrib(thread_id, it, run_end - it);
+        it = run_end;
+      } else {
+        while (it != neigh_end && *it < block_end) {
+          partial += outgoing_contrib[*it];
+          ++it;
+        }
+      }
+      cursors[u] = it;
+      incoming[u] += partial;
+    }
+  }
+  return updateScores(thread_id, base_score, begin, end);
+}
+
+/** Same sweep as pullRange, decoding every in-neighborhood into a buffer of
+ * the calling thread first. The buffer is thread local rather than per
+ * thread_id because rankOnExecutor runs several ranges of one thread_id at
+ * once.
+ */
+double PageRank::pullCompressedRange(
+    int thread_id,
+    float base_score,
+    NodeID begin,
+    NodeID end) {
+  thread_local std::vector<NodeID> neighs;
+  const size_t needed =
+      compressed_->maxDegree() + CompressedNeighbors::kDecodeSlack;
+  if (neighs.size() < needed) {
+    neighs.resize(needed);
+  }
+  if (simd_ != nullptr || half_ != nullptr) {
+    pvector<float>& incoming = incoming_pvectors_[thread_id];
+    for (NodeID u = begin; u < end; u++) {
+      const int64_t degree = compressed_->decode(u, neighs.data());
+      incoming[u] = gatherContrib(thread_id, neighs.data(), degree);
+    }
+    return updateScores(thread_id, base_score, begin, end);
+  }
+  pvector<float>& scores = scores_pvectors_[thread_id];
+  pvector<float>& outgoing_contrib = outgoing_pvectors_[thread_id];
+  double error = 0;
+  for (NodeID u = begin; u < end; u++) {
+    const int64_t degree = compressed_->decode(u, neighs.data());
+    float incoming_total = 0;
+    for (int64_t i = 0; i < degree; i++) {
+      incoming_total += outgoing_contrib[neighs[i]];
+    }
+    float old_score = scores[u];
+    scores[u] = base_score + kDamp * incoming_total;
+    error += std::fabs(scores[u] - old_score);
+  }
+  return error;
+}
+
+float
+PageRank::gatherContrib(int thread_id, const NodeID* neighs, int64_t n) {
+  if (half_ != nullptr) {
+    const float total = half_->gather_sum(
+        half_outgoing_pvectors_[thread_id].begin(), neighs, n);
+    return contrib_scale_ == 1.0f ? total : total / contrib_scale_;
+  }
+  return simd_->gather_sum(outgoing_pvectors_[thread_id].begin(), neighs, n);
+}
+
+double PageRank::updateScores(
+    int thread_id,
+    float base_score,
+    NodeID begin,
+    NodeID end) {
+  pvector<float>& scores = scores_pvectors_[thread_id];
+  pvector<float>& incoming = incoming_pvectors_[thread_id];
+  if (simd_ != nullptr) {
+    return simd_->update(
+        scores.begin() + begin,
+        incoming.begin() + begin,
+        base_score,
+        kDamp,
+        end - begin);
+  }
+  double error = 0;
+  for (NodeID u = begin; u < end; u++) {
+    float old_score = scores[u];
+    scores[u] = base_score + kDamp * incoming[u];
+    error += std::fabs(scores[u] - old_score);
+  }
+  return error;
+}
 
-    scores_pvectors_map_[i] = std::move(scores);
-    outgoing_pvectors_map_[i] = std::move(outgoing_contrib);
+double PageRank::pullKernelRange(
+    int thread_id,
+    float base_score,
+    NodeID begin,
+    NodeID end) {
+  switch (kernel_) {
+    case PageRankKernel::kBlockedPull:
+      return pullBlockedRange(thread_id, base_score, begin, end);
+    case PageRankKernel::kCompressedPull:
+      return pullCompressedRange(thread_id, base_score, begin, end);
+    case PageRankKernel::kPull:
+      break;
   }
+  return pullRange(thread_id, base_score, begin, end);
 }
 
 /** PageRank implementation taken from
@@ -95,57 +374,101 @@ int PageRank::rank(
     int rank_trials,
     int subset) {
   std::vector<int> sizes;
-  const int64_t num_nodes = subset > 0
-      ? std::min(static_cast<int64_t>(subset), graph_.num_nodes())
-      : graph_.num_nodes();
+  const Ranges ranges = chooseRanges(thread_id, subset);
 
-  std::uniform_int_distribution<int64_t> u_dist{
-      0,
-      num_nodes < graph_.num_nodes() ? graph_.num_nodes() - num_nodes
-                                     : graph_.num_nodes()};
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  NodeID start = u_dist(gen);
+  for (int t = 0; t < rank_trials; t++) {
+    const float base_score = (1.0f - kDamp) / graph_->num_nodes();
+    int iter;
+    for (iter = 0; iter < max_iters; iter++) {
+      computeContrib(thread_id, ranges.contrib_start, ranges.contrib_end);
 
-  const auto split_size = std::max(num_pvectors_entries_, 1);
-  std::uniform_int_distribution<int64_t> split_dist{
-      0, graph_.num_nodes() / split_size - 1};
-  std::mt19937 split_gen(rd());
-  NodeID split_start = split_dist(split_gen);
-  NodeID split_end = split_start + (graph_.num_nodes() / split_size) - 1;
+      double error = pullKernelRange(
+          thread_id, base_score, ranges.pull_start, ranges.pull_end);
+      if (error < epsilon) {
+        break;
+      }
+    }
+    sizes.push_back(scores_pvectors_[thread_id].size());
+  }
+  // Dummy-value
+  return sizes.size();
+}
+
+int PageRank::rankOnExecutor(
+    folly::Executor* executor,
+    int num_splits,
+    int thread_id,
+    int max_iters,
+    double epsilon,
+    int rank_trials,
+    int subset) {
+  std::vector<int> sizes;
+  const Ranges ranges = chooseRanges(thread_id, subset);
+  const int splits = std::max(num_splits, 1);
+
+  // Splits [begin, end) into `splits` contiguous chunks and returns the
+  // boundary of chunk i.
+  auto boundary = [splits](NodeID begin, NodeID end, int i) {
+    return static_cast<NodeID>(
+        begin + (static_cast<int64_t>(end - begin) * i) / splits);
+  };
 
   for (int t = 0; t < rank_trials; t++) {
-    const float base_score = (1.0f - kDamp) / graph_.num_nodes();
-    pvector<float>& scores = scores_pvectors_map_[thread_id];
-    pvector<float>& outgoing_contrib = outgoing_pvectors_map_[thread_id];
+    const float base_score = (1.0f - kDamp) / graph_->num_nodes();
     int iter;
     for (iter = 0; iter < max_iters; iter++) {
-      double error = 0;
-
-      // #pragma omp parallel for
-      for (NodeID n = split_start; n < split_end; n++) {
-        outgoing_contrib[n] = scores[n] / graph_.out_degree(n);
+      std::vector<folly::Future<folly::Unit>> contrib_futures;
+      for (int i = 0; i < splits; i++) {
+        const NodeID begin =
+            boundary(ranges.contrib_start, ranges.contrib_end, i);
+        const NodeID end =
+            boundary(ranges.contrib_start, ranges.contrib_end, i + 1);
+        contrib_futures.push_back(folly::via(executor, [=]() {
+          computeContrib(thread_id, begin, end);
+        }));
       }
+      folly::collect(contrib_futures).get();
 
-      // #pragma omp parallel for reduction(+ : error) schedule(dynamic, 64)
-      for (NodeID u = start; u < start + num_nodes; u++) {
-        float incoming_total = 0;
-        for (NodeID v : graph_.in_neigh(u)) {
-          incoming_total += outgoing_contrib[v];
-        }
-        float old_score = scores[u];
-        scores[u] = base_score + kDamp * incoming_total;
-        error += std::fabs(scores[u] - old_score);
+      std::vector<folly::Future<double>> pull_futures;
+      for (int i = 0; i < splits; i++) {
+        const NodeID begin = boundary(ranges.pull_start, ranges.pull_end, i);
+        const NodeID end = boundary(ranges.pull_start, ranges.pull_end, i + 1);
+        pull_futures.push_back(folly::via(executor, [=]() {
+          return pullKernelRange(thread_id, base_score, begin, end);
+        }));
       }
+      auto errors = folly::collect(pull_futures).get();
+      double error = std::accumulate(errors.begin(), errors.end(), 0.0);
       if (error < epsilon) {
         break;
       }
     }
-    sizes.push_back(scores.size());
+    sizes.push_back(scores_pvectors_[thread_id].size());
   }
   // Dummy-value
   return sizes.size();
 }
 
+void PageRank::forEachVector(const std::function<void(void*, size_t)>& fn) {
+  auto visit = [&fn](auto& vector) {
+    if (vector.size() > 0) {
+      fn(vector.begin(), vector.size() * sizeof(*vector.begin()));
+    }
+  };
+  visit(inv_out_degree_);
+  for (auto* vectors : {&scores_pvectors_, &outgoing_pvectors_,
+                         &incoming_pvectors_}) {
+    for (auto& vector : *vectors) {
+      visit(vector);
+    }
+  }
+  for (auto& vector : half_outgoing_pvectors_) {
+    visit(vector);
+  }
+  for (auto& vector : cursor_pvectors_) {
+    visit(vector);
+  }
+}
+
 } // namespace dwarfs
 } // namespace ranking
@@ -26,22 +26,54 @@
 #ifndef PAGERANK_H
 #define PAGERANK_H
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <vector>
 
-#include <folly/container/F14Map.h>
 #include <gapbs/src/graph.h>
 #include <gapbs/src/pvector.h>
 
+#include "compressed_neighbors.h"
+#include "graph_generator.h"
+#include "pagerank_kernels.h"
+
+namespace folly {
+class Executor;
+} // namespace folly
+
 namespace ranking {
 namespace dwarfs {
 
+/** Selects the inner loop used by PageRank::rank.
+ * kPull is the original GAPBS pull kernel, where every destination gathers
+ * from its in-neighbors over the whole contribution array.
+ * kBlockedPull splits the contribution array into source blocks sized to fit
+ * in the LLC and sweeps all destinations once per block, so the random
+ * gathers stay cache resident at the cost of extra sequential passes.
+ * kCompressedPull is kPull over CompressedNeighbors, trading decode work for
+ * fewer bytes streamed per edge.
+ */
+enum class PageRankKernel { kPull, kBlockedPull, kCompressedPull };
+
 class PageRankParams {
  public:
-  explicit PageRankParams(int scale, int degrees);
+  explicit PageRankParams(
+      int scale,
+      int degrees,
+      GraphGeneratorOptions generator = GraphGeneratorOptions());
   ~PageRankParams();
 
-  CSRGraph<int32_t> buildGraph();
+  /** Generates the graph, splitting the work into num_splits chunks that
+   * run on executor. The calling thread blocks until the graph is built and
+   * must not be one of the executor's own threads.
+   */
+  CSRGraph<int32_t> buildGraph(
+      folly::Executor* executor = nullptr,
+      int num_splits = 1);
+
+  const GraphGeneratorOptions& generatorOptions() const;
 
  private:
   struct Impl;
@@ -55,7 +87,31 @@ class PageRank {
  public:
   constexpr static const float kDamp = 0.85;
 
-  explicit PageRank(CSRGraph<int32_t> graph, int num_pvectors_entries);
+  explicit PageRank(
+      CSRGraph<int32_t> graph,
+      int num_pvectors_entries,
+      PageRankKernel kernel = PageRankKernel::kPull,
+      int64_t block_bytes = 0,
+      const PageRankSimdKernels* simd = nullptr,
+      std::shared_ptr<const CompressedNeighbors> compressed = nullptr,
+      const PageRankHalfKernels* half = nullptr);
+
+  /** Ranks over a read-only graph that may be shared with other PageRank
+   * instances. Only the score and contribution vectors are private.
+   * A non-null simd replaces the scalar contribution, gather and update
+   * loops with the given vector kernels. kCompressedPull uses compressed,
+   * which must hold the in-neighbors of graph, or compresses them itself if
+   * it is null. A non-null half stores contributions in its 16-bit format
+   * and sums them in fp32; scores stay in fp32.
+   */
+  explicit PageRank(
+      std::shared_ptr<const CSRGraph<int32_t>> graph,
+      int num_pvectors_entries,
+      PageRankKernel kernel = PageRankKernel::kPull,
+      int64_t block_bytes = 0,
+      const PageRankSimdKernels* simd = nullptr,
+      std::shared_ptr<const CompressedNeighbors> compressed = nullptr,
+      const PageRankHalfKernels* half = nullptr);
 
   int rank(
       int thread_id,
@@ -64,11 +120,92 @@ class PageRank {
       int rank_trials,
       int subset);
 
+  /** Same work as rank(), but every iteration's contribution and pull sweeps
+   * are split into num_splits ranges that run on executor. The calling
+   * thread blocks until the call completes and must not be one of the
+   * executor's own threads.
+   */
+  int rankOnExecutor(
+      folly::Executor* executor,
+      int num_splits,
+      int thread_id,
+      int max_iters,
+      double epsilon,
+      int rank_trials,
+      int subset);
+
+  /** Draws the graph window of the calls with thread_id from seed from now
+   * on, instead of from std::random_device, so that the same seed ranks the
+   * same nodes in every run.
+   */
+  void seedRanges(int thread_id, uint64_t seed);
+
+  /** Calls fn with the address and size in bytes of every non-empty private
+   * vector, e.g. to advise their page size.
+   */
+  void forEachVector(const std::function<void(void*, size_t)>& fn);
+
  private:
-  CSRGraph<int32_t> graph_;
+  struct Ranges {
+    int32_t contrib_start;
+    int32_t contrib_end;
+    int32_t pull_start;
+    int32_t pull_end;
+  };
+
+  Ranges chooseRanges(int thread_id, int subset) const;
+  void computeContrib(int thread_id, int32_t begin, int32_t end);
+  double
+  pullRange(int thread_id, float base_score, int32_t begin, int32_t end);
+  double pullBlockedRange(
+      int thread_id,
+      float base_score,
+      int32_t begin,
+      int32_t end);
+  double pullCompressedRange(
+      int thread_id,
+      float base_score,
+      int32_t begin,
+      int32_t end);
+  // Sum of the contributions of n in-neighbors for the vector and 16-bit
+  // paths
+  float gatherContrib(int thread_id, const int32_t* neighs, int64_t n);
+  // Applies incoming to the scores of [begin, end) and returns the error
+  double
+  updateScores(int thread_id, float base_score, int32_t begin, int32_t end);
+  // Runs the pull sweep of kernel_ over [begin, end)
+  double pullKernelRange(
+      int thread_id,
+      float base_score,
+      int32_t begin,
+      int32_t end);
+
+  std::shared_ptr<const CSRGraph<int32_t>> graph_;
   int num_pvectors_entries_;
-  folly::F14FastMap<int, pvector<float>> scores_pvectors_map_;
-  folly::F14FastMap<int, pvector<float>> outgoing_pvectors_map_;
+  PageRankKernel kernel_;
+  const PageRankSimdKernels* simd_;
+  int32_t block_nodes_;
+  // Only set for PageRankKernel::kCompressedPull
+  std::shared_ptr<const CompressedNeighbors> compressed_;
+  const PageRankHalfKernels* half_;
+  // fp16 contributions are stored times contrib_scale_ to stay normal
+  float contrib_scale_ = 1.0f;
+  // Only populated when simd_ or half_ is set
+  pvector<float> inv_out_degree_;
+  // Per-thread vectors, indexed by thread_id
+  std::vector<pvector<float>> scores_pvectors_;
+  // Seeds given to seedRanges, indexed by thread_id
+  std::vector<uint64_t> range_seeds_;
+  std::vector<uint8_t> range_seeded_;
+  // Only populated without half_
+  std::vector<pvector<float>> outgoing_pvectors_;
+  // Only populated with half_, one entry longer than the graph for the
+  // 32-bit gathers
+  std::vector<pvector<uint16_t>> half_outgoing_pvectors_;
+  // Populated for PageRankKernel::kBlockedPull or when simd_ or half_ is set
+  std::vector<pvector<float>> incoming_pvectors_;
+  // Only populated for PageRankKernel::kBlockedPull
+  std::vector<pvector<const int32_t*>> cursor_pvectors_;
 };
 
 } // namespace dwarfs
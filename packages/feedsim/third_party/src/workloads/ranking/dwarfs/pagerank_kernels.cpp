@@ -0,0 +1,850 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pagerank_kernels.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#if defined(__ARM_FEATURE_SVE)
+#include <arm_sve.h>
+#endif
+#endif
+
+namespace ranking {
+namespace dwarfs {
+
+namespace {
+
+void contribScalar(
+    const float* scores,
+    const float* inv_degree,
+    float* contrib,
+    int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    contrib[i] = scores[i] * inv_degree[i];
+  }
+}
+
+float gatherSumScalar(const float* contrib, const int32_t* neighs, int64_t n) {
+  float total = 0;
+  for (int64_t i = 0; i < n; i++) {
+    total += contrib[neighs[i]];
+  }
+  return total;
+}
+
+double updateScalar(
+    float* scores,
+    const float* incoming,
+    float base,
+    float damp,
+    int64_t n) {
+  double error = 0;
+  for (int64_t i = 0; i < n; i++) {
+    float old_score = scores[i];
+    scores[i] = base + damp * incoming[i];
+    error += std::fabs(scores[i] - old_score);
+  }
+  return error;
+}
+
+const PageRankSimdKernels kScalarKernels{
+    "scalar", contribScalar, gatherSumScalar, updateScalar};
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2,fma"))) void contribAvx2(
+    const float* scores,
+    const float* inv_degree,
+    float* contrib,
+    int64_t n) {
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 s = _mm256_loadu_ps(scores + i);
+    __m256 d = _mm256_loadu_ps(inv_degree + i);
+    _mm256_storeu_ps(contrib + i, _mm256_mul_ps(s, d));
+  }
+  contribScalar(scores + i, inv_degree + i, contrib + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) float
+gatherSumAvx2(const float* contrib, const int32_t* neighs, int64_t n) {
+  __m256 acc = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighs + i));
+    acc = _mm256_add_ps(acc, _mm256_i32gather_ps(contrib, idx, 4));
+  }
+  __m128 sum = _mm_add_ps(
+      _mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
+  return _mm_cvtss_f32(sum) + gatherSumScalar(contrib, neighs + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) double updateAvx2(
+    float* scores,
+    const float* incoming,
+    float base,
+    float damp,
+    int64_t n) {
+  const __m256 vbase = _mm256_set1_ps(base);
+  const __m256 vdamp = _mm256_set1_ps(damp);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256d err_lo = _mm256_setzero_pd();
+  __m256d err_hi = _mm256_setzero_pd();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 old_score = _mm256_loadu_ps(scores + i);
+    __m256 score =
+        _mm256_fmadd_ps(vdamp, _mm256_loadu_ps(incoming + i), vbase);
+    _mm256_storeu_ps(scores + i, score);
+    __m256 diff = _mm256_andnot_ps(sign, _mm256_sub_ps(score, old_score));
+    err_lo =
+        _mm256_add_pd(err_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(diff)));
+    err_hi =
+        _mm256_add_pd(err_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(diff, 1)));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(err_lo, err_hi));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+      updateScalar(scores + i, incoming + i, base, damp, n - i);
+}
+
+const PageRankSimdKernels kAvx2Kernels{
+    "avx2", contribAvx2, gatherSumAvx2, updateAvx2};
+
+__attribute__((target("avx512f"))) void contribAvx512(
+    const float* scores,
+    const float* inv_degree,
+    float* contrib,
+    int64_t n) {
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 s = _mm512_loadu_ps(scores + i);
+    __m512 d = _mm512_loadu_ps(inv_degree + i);
+    _mm512_storeu_ps(contrib + i, _mm512_mul_ps(s, d));
+  }
+  if (i < n) {
+    const __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+    __m512 s = _mm512_maskz_loadu_ps(mask, scores + i);
+    __m512 d = _mm512_maskz_loadu_ps(mask, inv_degree + i);
+    _mm512_mask_storeu_ps(contrib + i, mask, _mm512_mul_ps(s, d));
+  }
+}
+
+__attribute__((target("avx512f"))) float
+gatherSumAvx512(const float* contrib, const int32_t* neighs, int64_t n) {
+  __m512 acc = _mm512_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i idx = _mm512_loadu_si512(neighs + i);
+    acc = _mm512_add_ps(acc, _mm512_i32gather_ps(idx, contrib, 4));
+  }
+  if (i < n) {
+    const __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+    __m512i idx = _mm512_maskz_loadu_epi32(mask, neighs + i);
+    // Masked-off lanes gather nothing and stay zero
+    acc = _mm512_add_ps(
+        acc,
+        _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx, contrib, 4));
+  }
+  return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f"))) double updateAvx512(
+    float* scores,
+    const float* incoming,
+    float base,
+    float damp,
+    int64_t n) {
+  const __m512 vbase = _mm512_set1_ps(base);
+  const __m512 vdamp = _mm512_set1_ps(damp);
+  __m512d err_lo = _mm512_setzero_pd();
+  __m512d err_hi = _mm512_setzero_pd();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 old_score = _mm512_loadu_ps(scores + i);
+    __m512 score =
+        _mm512_fmadd_ps(vdamp, _mm512_loadu_ps(incoming + i), vbase);
+    _mm512_storeu_ps(scores + i, score);
+    __m512 diff = _mm512_abs_ps(_mm512_sub_ps(score, old_score));
+    err_lo =
+        _mm512_add_pd(err_lo, _mm512_cvtps_pd(_mm512_castps512_ps256(diff)));
+    err_hi = _mm512_add_pd(
+        err_hi,
+        _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(diff), 1))));
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(err_lo, err_hi)) +
+      updateScalar(scores + i, incoming + i, base, damp, n - i);
+}
+
+const PageRankSimdKernels kAvx512Kernels{
+    "avx512", contribAvx512, gatherSumAvx512, updateAvx512};
+
+#elif defined(__aarch64__)
+
+void contribNeon(
+    const float* scores,
+    const float* inv_degree,
+    float* contrib,
+    int64_t n) {
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t s = vld1q_f32(scores + i);
+    float32x4_t d = vld1q_f32(inv_degree + i);
+    vst1q_f32(contrib + i, vmulq_f32(s, d));
+  }
+  contribScalar(scores + i, inv_degree + i, contrib + i, n - i);
+}
+
+// NEON has no gather, so this keeps four independent accumulators to break
+// the floating-point add dependency chain of the scalar loop.
+float gatherSumNeon(const float* contrib, const int32_t* neighs, int64_t n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vdupq_n_f32(0);
+    v = vsetq_lane_f32(contrib[neighs[i]], v, 0);
+    v = vsetq_lane_f32(contrib[neighs[i + 1]], v, 1);
+    v = vsetq_lane_f32(contrib[neighs[i + 2]], v, 2);
+    v = vsetq_lane_f32(contrib[neighs[i + 3]], v, 3);
+    acc = vaddq_f32(acc, v);
+  }
+  return vaddvq_f32(acc) + gatherSumScalar(contrib, neighs + i, n - i);
+}
+
+double updateNeon(
+    float* scores,
+    const float* incoming,
+    float base,
+    float damp,
+    int64_t n) {
+  const float32x4_t vbase = vdupq_n_f32(base);
+  float64x2_t err = vdupq_n_f64(0);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t old_score = vld1q_f32(scores + i);
+    float32x4_t score = vfmaq_n_f32(vbase, vld1q_f32(incoming + i), damp);
+    vst1q_f32(scores + i, score);
+    float32x4_t diff = vabdq_f32(score, old_score);
+    err = vaddq_f64(err, vcvt_f64_f32(vget_low_f32(diff)));
+    err = vaddq_f64(err, vcvt_high_f64_f32(diff));
+  }
+  return vaddvq_f64(err) +
+      updateScalar(scores + i, incoming + i, base, damp, n - i);
+}
+
+const PageRankSimdKernels kNeonKernels{
+    "neon", contribNeon, gatherSumNeon, updateNeon};
+
+#if defined(__ARM_FEATURE_SVE)
+
+void contribSve(
+    const float* scores,
+    const float* inv_degree,
+    float* contrib,
+    int64_t n) {
+  for (int64_t i = 0; i < n; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, n);
+    svst1_f32(
+        pg,
+        contrib + i,
+        svmul_f32_x(
+            pg, svld1_f32(pg, scores + i), svld1_f32(pg, inv_degree + i)));
+  }
+}
+
+float gatherSumSve(const float* contrib, const int32_t* neighs, int64_t n) {
+  svfloat32_t acc = svdup_n_f32(0);
+  for (int64_t i = 0; i < n; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, n);
+    svint32_t idx = svld1_s32(pg, neighs + i);
+    acc = svadd_f32_m(pg, acc, svld1_gather_s32index_f32(pg, contrib, idx));
+  }
+  return svaddv_f32(svptrue_b32(), acc);
+}
+
+double updateSve(
+    float* scores,
+    const float* incoming,
+    float base,
+    float damp,
+    int64_t n) {
+  double error = 0;
+  for (int64_t i = 0; i < n; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, n);
+    svfloat32_t old_score = svld1_f32(pg, scores + i);
+    svfloat32_t score = svmla_n_f32_x(
+        pg, svdup_n_f32(base), svld1_f32(pg, incoming + i), damp);
+    svst1_f32(pg, scores + i, score);
+    svfloat32_t diff = svabd_f32_z(pg, score, old_score);
+    // Widen even and odd lanes separately to keep double accumulation
+    error += svaddv_f64(svptrue_b64(), svcvt_f64_f32_z(svptrue_b64(), diff));
+    svfloat32_t odd = svreinterpret_f32_u64(
+        svlsr_n_u64_x(svptrue_b64(), svreinterpret_u64_f32(diff), 32));
+    error += svaddv_f64(svptrue_b64(), svcvt_f64_f32_z(svptrue_b64(), odd));
+  }
+  return error;
+}
+
+const PageRankSimdKernels kSveKernels{
+    "sve", contribSve, gatherSumSve, updateSve};
+
+#endif // __ARM_FEATURE_SVE
+
+#endif
+
+// 16-bit contribution kernels. Conversions round to nearest even, as the
+// hardware conversions do.
+
+float bf16ToFloat(uint16_t h) {
+  const uint32_t bits = static_cast<uint32_t>(h) << 16u;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+uint16_t floatToBf16(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  bits += 0x7fffu + ((bits >> 16u) & 1u);
+  return static_cast<uint16_t>(bits >> 16u);
+}
+
+// Portable fp16 conversions for CPUs without F16C or NEON, after Fabian
+// Giesen's float_to_half_fast3_rtne and half_to_float.
+float fp16ToFloat(uint16_t h) {
+  constexpr uint32_t kShiftedExp = 0x7c00u << 13u;
+  uint32_t bits = (h & 0x7fffu) << 13u;
+  const uint32_t exp = bits & kShiftedExp;
+  bits += (127u - 15u) << 23u;
+  if (exp == kShiftedExp) {
+    bits += (128u - 16u) << 23u;
+  } else if (exp == 0) {
+    constexpr uint32_t kMagicBits = 113u << 23u;
+    float magic;
+    std::memcpy(&magic, &kMagicBits, sizeof(magic));
+    bits += 1u << 23u;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    f -= magic;
+    std::memcpy(&bits, &f, sizeof(bits));
+  }
+  bits |= static_cast<uint32_t>(h & 0x8000u) << 16u;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+uint16_t floatToFp16(float value) {
+  constexpr uint32_t kF32Infinity = 255u << 23u;
+  constexpr uint32_t kF16Max = (127u + 16u) << 23u;
+  constexpr uint32_t kDenormMagicBits = ((127u - 15u) + (23u - 10u) + 1u)
+      << 23u;
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = bits & 0x80000000u;
+  bits ^= sign;
+  uint16_t half;
+  if (bits >= kF16Max) {
+    half = bits > kF32Infinity ? 0x7e00 : 0x7c00;
+  } else if (bits < (113u << 23u)) {
+    float f;
+    float magic;
+    std::memcpy(&f, &bits, sizeof(f));
+    std::memcpy(&magic, &kDenormMagicBits, sizeof(magic));
+    f += magic;
+    std::memcpy(&bits, &f, sizeof(bits));
+    half = static_cast<uint16_t>(bits - kDenormMagicBits);
+  } else {
+    const uint32_t mant_odd = (bits >> 13u) & 1u;
+    bits += ((15u - 127u) << 23u) + 0xfffu + mant_odd;
+    half = static_cast<uint16_t>(bits >> 13u);
+  }
+  return half | static_cast<uint16_t>(sign >> 16u);
+}
+
+template <uint16_t (*ToHalf)(float)>
+void contribHalfScalar(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    contrib[i] = ToHalf(scores[i] * inv_degree[i] * scale);
+  }
+}
+
+template <float (*FromHalf)(uint16_t)>
+float gatherSumHalfScalar(
+    const uint16_t* contrib,
+    const int32_t* neighs,
+    int64_t n) {
+  float total = 0;
+  for (int64_t i = 0; i < n; i++) {
+    total += FromHalf(contrib[neighs[i]]);
+  }
+  return total;
+}
+
+const PageRankHalfKernels kBf16ScalarKernels{
+    "scalar",
+    ContribPrecision::kBf16,
+    contribHalfScalar<floatToBf16>,
+    gatherSumHalfScalar<bf16ToFloat>};
+
+const PageRankHalfKernels kFp16ScalarKernels{
+    "scalar",
+    ContribPrecision::kFp16,
+    contribHalfScalar<floatToFp16>,
+    gatherSumHalfScalar<fp16ToFloat>};
+
+#if defined(__x86_64__)
+
+// Gathers load the 32 bits at byte offset 2 * id, so every entry arrives in
+// the low half of its lane.
+
+__attribute__((target("avx2,fma"))) void contribBf16Avx2(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const __m256 vscale = _mm256_set1_ps(scale);
+  const __m256i round = _mm256_set1_epi32(0x7fff);
+  const __m256i one = _mm256_set1_epi32(1);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 c = _mm256_mul_ps(
+        _mm256_loadu_ps(scores + i), _mm256_loadu_ps(inv_degree + i));
+    c = _mm256_mul_ps(c, vscale);
+    __m256i bits = _mm256_castps_si256(c);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+    bits = _mm256_srli_epi32(
+        _mm256_add_epi32(bits, _mm256_add_epi32(round, lsb)), 16);
+    // packus interleaves the 128-bit lanes; the permute puts them back
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(bits, bits), 0x08);
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(contrib + i),
+        _mm256_castsi256_si128(packed));
+  }
+  contribHalfScalar<floatToBf16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) float
+gatherSumBf16Avx2(const uint16_t* contrib, const int32_t* neighs, int64_t n) {
+  const int* base = reinterpret_cast<const int*>(contrib);
+  __m256 acc = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighs + i));
+    __m256i v = _mm256_i32gather_epi32(base, idx, 2);
+    acc = _mm256_add_ps(
+        acc, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+  }
+  __m128 sum = _mm_add_ps(
+      _mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
+  return _mm_cvtss_f32(sum) +
+      gatherSumHalfScalar<bf16ToFloat>(contrib, neighs + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c"))) void contribFp16Avx2(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const __m256 vscale = _mm256_set1_ps(scale);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 c = _mm256_mul_ps(
+        _mm256_loadu_ps(scores + i), _mm256_loadu_ps(inv_degree + i));
+    c = _mm256_mul_ps(c, vscale);
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(contrib + i),
+        _mm256_cvtps_ph(c, _MM_FROUND_TO_NEAREST_INT));
+  }
+  contribHalfScalar<floatToFp16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c"))) float
+gatherSumFp16Avx2(const uint16_t* contrib, const int32_t* neighs, int64_t n) {
+  const int* base = reinterpret_cast<const int*>(contrib);
+  const __m256i low = _mm256_set1_epi32(0xffff);
+  __m256 acc = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighs + i));
+    __m256i v = _mm256_and_si256(_mm256_i32gather_epi32(base, idx, 2), low);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+    acc = _mm256_add_ps(
+        acc, _mm256_cvtph_ps(_mm256_castsi256_si128(packed)));
+  }
+  __m128 sum = _mm_add_ps(
+      _mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
+  float total = _mm_cvtss_f32(sum);
+  // The scalar tail is not inlined; leaving the upper halves dirty makes
+  // every SSE instruction in it pay a transition penalty
+  _mm256_zeroupper();
+  return total + gatherSumHalfScalar<fp16ToFloat>(contrib, neighs + i, n - i);
+}
+
+const PageRankHalfKernels kBf16Avx2Kernels{
+    "avx2", ContribPrecision::kBf16, contribBf16Avx2, gatherSumBf16Avx2};
+
+const PageRankHalfKernels kFp16Avx2Kernels{
+    "avx2", ContribPrecision::kFp16, contribFp16Avx2, gatherSumFp16Avx2};
+
+__attribute__((target("avx512f"))) void contribBf16Avx512(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const __m512 vscale = _mm512_set1_ps(scale);
+  const __m512i round = _mm512_set1_epi32(0x7fff);
+  const __m512i one = _mm512_set1_epi32(1);
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 c = _mm512_mul_ps(
+        _mm512_loadu_ps(scores + i), _mm512_loadu_ps(inv_degree + i));
+    c = _mm512_mul_ps(c, vscale);
+    __m512i bits = _mm512_castps_si512(c);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), one);
+    bits = _mm512_srli_epi32(
+        _mm512_add_epi32(bits, _mm512_add_epi32(round, lsb)), 16);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(contrib + i), _mm512_cvtepi32_epi16(bits));
+  }
+  contribHalfScalar<floatToBf16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bf16"))) void contribBf16Avx512Bf16(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const __m512 vscale = _mm512_set1_ps(scale);
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 c = _mm512_mul_ps(
+        _mm512_loadu_ps(scores + i), _mm512_loadu_ps(inv_degree + i));
+    c = _mm512_mul_ps(c, vscale);
+    const __m256bh halves = _mm512_cvtneps_pbh(c);
+    std::memcpy(contrib + i, &halves, sizeof(halves));
+  }
+  contribHalfScalar<floatToBf16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+__attribute__((target("avx512f"))) float
+gatherSumBf16Avx512(const uint16_t* contrib, const int32_t* neighs, int64_t n) {
+  __m512 acc = _mm512_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i idx =
+        _mm512_loadu_si512(reinterpret_cast<const __m512i*>(neighs + i));
+    __m512i v = _mm512_i32gather_epi32(idx, contrib, 2);
+    acc = _mm512_add_ps(
+        acc, _mm512_castsi512_ps(_mm512_slli_epi32(v, 16)));
+  }
+  return _mm512_reduce_add_ps(acc) +
+      gatherSumHalfScalar<bf16ToFloat>(contrib, neighs + i, n - i);
+}
+
+__attribute__((target("avx512f"))) void contribFp16Avx512(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const __m512 vscale = _mm512_set1_ps(scale);
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 c = _mm512_mul_ps(
+        _mm512_loadu_ps(scores + i), _mm512_loadu_ps(inv_degree + i));
+    c = _mm512_mul_ps(c, vscale);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(contrib + i),
+        _mm512_cvtps_ph(c, _MM_FROUND_TO_NEAREST_INT));
+  }
+  contribHalfScalar<floatToFp16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+__attribute__((target("avx512f"))) float
+gatherSumFp16Avx512(const uint16_t* contrib, const int32_t* neighs, int64_t n) {
+  __m512 acc = _mm512_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i idx =
+        _mm512_loadu_si512(reinterpret_cast<const __m512i*>(neighs + i));
+    __m512i v = _mm512_i32gather_epi32(idx, contrib, 2);
+    acc = _mm512_add_ps(acc, _mm512_cvtph_ps(_mm512_cvtepi32_epi16(v)));
+  }
+  float total = _mm512_reduce_add_ps(acc);
+  _mm256_zeroupper();
+  return total + gatherSumHalfScalar<fp16ToFloat>(contrib, neighs + i, n - i);
+}
+
+const PageRankHalfKernels kBf16Avx512Kernels{
+    "avx512", ContribPrecision::kBf16, contribBf16Avx512, gatherSumBf16Avx512};
+
+const PageRankHalfKernels kBf16Avx512Bf16Kernels{
+    "avx512bf16",
+    ContribPrecision::kBf16,
+    contribBf16Avx512Bf16,
+    gatherSumBf16Avx512};
+
+const PageRankHalfKernels kFp16Avx512Kernels{
+    "avx512", ContribPrecision::kFp16, contribFp16Avx512, gatherSumFp16Avx512};
+
+#elif defined(__aarch64__)
+
+void contribBf16Neon(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  const uint32x4_t round = vdupq_n_u32(0x7fff);
+  const uint32x4_t one = vdupq_n_u32(1);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t c = vmulq_n_f32(
+        vmulq_f32(vld1q_f32(scores + i), vld1q_f32(inv_degree + i)), scale);
+    uint32x4_t bits = vreinterpretq_u32_f32(c);
+    uint32x4_t lsb = vandq_u32(vshrq_n_u32(bits, 16), one);
+    bits = vaddq_u32(bits, vaddq_u32(round, lsb));
+    vst1_u16(contrib + i, vshrn_n_u32(bits, 16));
+  }
+  contribHalfScalar<floatToBf16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+uint16x4_t loadHalves(const uint16_t* contrib, const int32_t* neighs) {
+  uint16x4_t v = vdup_n_u16(0);
+  v = vset_lane_u16(contrib[neighs[0]], v, 0);
+  v = vset_lane_u16(contrib[neighs[1]], v, 1);
+  v = vset_lane_u16(contrib[neighs[2]], v, 2);
+  v = vset_lane_u16(contrib[neighs[3]], v, 3);
+  return v;
+}
+
+float gatherSumBf16Neon(
+    const uint16_t* contrib,
+    const int32_t* neighs,
+    int64_t n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const uint16x4_t halves = loadHalves(contrib, neighs + i);
+    acc = vaddq_f32(acc, vreinterpretq_f32_u32(vshll_n_u16(halves, 16)));
+  }
+  return vaddvq_f32(acc) +
+      gatherSumHalfScalar<bf16ToFloat>(contrib, neighs + i, n - i);
+}
+
+void contribFp16Neon(
+    const float* scores,
+    const float* inv_degree,
+    float scale,
+    uint16_t* contrib,
+    int64_t n) {
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t c = vmulq_n_f32(
+        vmulq_f32(vld1q_f32(scores + i), vld1q_f32(inv_degree + i)), scale);
+    vst1_u16(contrib + i, vreinterpret_u16_f16(vcvt_f16_f32(c)));
+  }
+  contribHalfScalar<floatToFp16>(
+      scores + i, inv_degree + i, scale, contrib + i, n - i);
+}
+
+float gatherSumFp16Neon(
+    const uint16_t* contrib,
+    const int32_t* neighs,
+    int64_t n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = vaddq_f32(
+        acc,
+        vcvt_f32_f16(vreinterpret_f16_u16(loadHalves(contrib, neighs + i))));
+  }
+  return vaddvq_f32(acc) +
+      gatherSumHalfScalar<fp16ToFloat>(contrib, neighs + i, n - i);
+}
+
+const PageRankHalfKernels kBf16NeonKernels{
+    "neon", ContribPrecision::kBf16, contribBf16Neon, gatherSumBf16Neon};
+
+const PageRankHalfKernels kFp16NeonKernels{
+    "neon", ContribPrecision::kFp16, contribFp16Neon, gatherSumFp16Neon};
+
+#endif
+
+} // namespace
+
+bool cpuSupports(const std::string& isa) {
+  if (isa == "scalar") {
+    return true;
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (isa == "avx2") {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+  if (isa == "avx512") {
+    return __builtin_cpu_supports("avx512f");
+  }
+  if (isa == "avx512bf16") {
+    return __builtin_cpu_supports("avx512bf16");
+  }
+  if (isa == "f16c") {
+    return __builtin_cpu_supports("f16c");
+  }
+#elif defined(__aarch64__)
+  if (isa == "neon") {
+    return true;
+  }
+#if defined(__ARM_FEATURE_SVE)
+  if (isa == "sve") {
+    return (getauxval(AT_HWCAP) & HWCAP_SVE) != 0;
+  }
+#endif
+#endif
+  return false;
+}
+
+namespace {
+
+const PageRankSimdKernels* kernelsFor(const std::string& isa) {
+#if defined(__x86_64__)
+  if (isa == "avx2") {
+    return &kAvx2Kernels;
+  }
+  if (isa == "avx512") {
+    return &kAvx512Kernels;
+  }
+#elif defined(__aarch64__)
+  if (isa == "neon") {
+    return &kNeonKernels;
+  }
+#if defined(__ARM_FEATURE_SVE)
+  if (isa == "sve") {
+    return &kSveKernels;
+  }
+#endif
+#endif
+  if (isa == "scalar") {
+    return &kScalarKernels;
+  }
+  return nullptr;
+}
+
+const PageRankHalfKernels* halfKernelsFor(
+    ContribPrecision precision,
+    const std::string& isa) {
+  const bool bf16 = precision == ContribPrecision::kBf16;
+#if defined(__x86_64__)
+  if (isa == "avx2") {
+    if (bf16) {
+      return &kBf16Avx2Kernels;
+    }
+    return cpuSupports("f16c") ? &kFp16Avx2Kernels : nullptr;
+  }
+  if (isa == "avx512") {
+    if (bf16) {
+      return cpuSupports("avx512bf16") ? &kBf16Avx512Bf16Kernels
+                                       : &kBf16Avx512Kernels;
+    }
+    return &kFp16Avx512Kernels;
+  }
+#elif defined(__aarch64__)
+  if (isa == "neon" || isa == "sve") {
+    return bf16 ? &kBf16NeonKernels : &kFp16NeonKernels;
+  }
+#endif
+  if (isa == "scalar") {
+    return bf16 ? &kBf16ScalarKernels : &kFp16ScalarKernels;
+  }
+  return nullptr;
+}
+
+} // namespace
+
+const PageRankSimdKernels* findPageRankSimdKernels(const std::string& isa) {
+  if (isa == "auto") {
+    for (const char* candidate : {"avx512", "avx2", "sve", "neon"}) {
+      if (cpuSupports(candidate) && kernelsFor(candidate) != nullptr) {
+        return kernelsFor(candidate);
+      }
+    }
+    return &kScalarKernels;
+  }
+  if (!cpuSupports(isa)) {
+    return nullptr;
+  }
+  return kernelsFor(isa);
+}
+
+const PageRankHalfKernels* findPageRankHalfKernels(
+    ContribPrecision precision,
+    const std::string& isa) {
+  if (precision == ContribPrecision::kFloat) {
+    return nullptr;
+  }
+  if (isa == "auto") {
+    for (const char* candidate : {"avx512", "avx2", "neon"}) {
+      if (cpuSupports(candidate)) {
+        const PageRankHalfKernels* kernels =
+            halfKernelsFor(precision, candidate);
+        if (kernels != nullptr) {
+          return kernels;
+        }
+      }
+    }
+    return halfKernelsFor(precision, "scalar");
+  }
+  if (!cpuSupports(isa)) {
+    return nullptr;
+  }
+  return halfKernelsFor(precision, isa);
+}
+
+} // namespace dwarfs
+} // namespace ranking
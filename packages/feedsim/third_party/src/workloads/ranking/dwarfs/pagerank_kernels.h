@@ -0,0 +1,100 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PAGERANK_KERNELS_H
+#define PAGERANK_KERNELS_H
+
+#include <cstdint>
+#include <string>
+
+namespace ranking {
+namespace dwarfs {
+
+/** Vectorized inner loops of PageRank for one instruction set.
+ *
+ * contrib:    contrib[i] = scores[i] * inv_degree[i]
+ * gather_sum: returns the sum of contrib[neighs[i]] over n neighbors
+ * update:     scores[i] = base + damp * incoming[i], returning the sum of
+ *             |new - old| accumulated in double precision
+ */
+struct PageRankSimdKernels {
+  const char* name;
+  void (*contrib)(
+      const float* scores,
+      const float* inv_degree,
+      float* contrib,
+      int64_t n);
+  float (*gather_sum)(const float* contrib, const int32_t* neighs, int64_t n);
+  double (*update)(
+      float* scores,
+      const float* incoming,
+      float base,
+      float damp,
+      int64_t n);
+};
+
+/** Storage format of the PageRank contribution array. */
+enum class ContribPrecision { kFloat, kBf16, kFp16 };
+
+/** Contribution loops that store contributions as 16-bit floats and
+ * accumulate them in fp32.
+ *
+ * contrib:    contrib[i] = to16(scores[i] * inv_degree[i] * scale)
+ * gather_sum: returns the fp32 sum of from16(contrib[neighs[i]]) over n
+ *             neighbors. Vector gathers load 32 bits per entry, so contrib
+ *             must have one readable entry past the largest neighbor id.
+ *
+ * Contributions of large graphs are far below the smallest normal fp16, so
+ * fp16 callers scale them up before storing and divide the sums back down.
+ */
+struct PageRankHalfKernels {
+  const char* name;
+  ContribPrecision precision;
+  void (*contrib)(
+      const float* scores,
+      const float* inv_degree,
+      float scale,
+      uint16_t* contrib,
+      int64_t n);
+  float (*gather_sum)(
+      const uint16_t* contrib,
+      const int32_t* neighs,
+      int64_t n);
+};
+
+/** Returns the kernels for isa ("scalar", "avx2", "avx512", "neon", "sve"),
+ * or the widest set the running CPU supports for "auto". Returns nullptr if
+ * the requested set was not compiled in or the CPU lacks it.
+ */
+const PageRankSimdKernels* findPageRankSimdKernels(const std::string& isa);
+
+/** Returns the 16-bit contribution kernels of precision, which must not be
+ * kFloat, for the same isa names. "avx512" bf16 kernels convert with
+ * AVX-512 BF16 instructions where the CPU has them, and "sve" uses the NEON
+ * kernels. Returns nullptr if the set was not compiled in or the CPU lacks
+ * it.
+ */
+const PageRankHalfKernels* findPageRankHalfKernels(
+    ContribPrecision precision,
+    const std::string& isa);
+
+/** Whether the running CPU has isa: "scalar", "avx2" (with FMA), "avx512"
+ * (AVX-512F), "avx512bf16", "f16c", "neon" or "sve".
+ */
+bool cpuSupports(const std::string& isa);
+
+} // namespace dwarfs
+} // namespace ranking
+
+#endif // PAGERANK_KERNELS_H
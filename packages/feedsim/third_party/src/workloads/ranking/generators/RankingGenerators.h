@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <cstdlib>
 #include <functional>
+#include <unordered_map>
 #include <vector>
 
 #include <oldisim/Util.h>
@@ -25,21 +26,6 @@
 namespace ranking {
 namespace generators {
 
-// Fast random number-generator
-// Not cryptographically-safe
-inline uint64_t xor128() {
-  thread_local static uint64_t x = 123456789;
-  thread_local static uint64_t y = 362436069;
-  thread_local static uint64_t z = 521288629;
-  thread_local static uint64_t w = 88675123;
-  uint64_t t;
-  t = x ^ (x << 11);
-  x = y;
-  y = z;
-  z = w;
-  return w = w ^ (w >> 19) ^ (t ^ (t >> 8));
-}
-
 inline ranking::Payload generateRandomPayload(size_t length) {
   ranking::Payload payload;
   payload.message = RandomString(length);
@@ -153,5 +139,60 @@ generateRandomRankingResponse(size_t ranking_stories_length) {
   return resp;
 }
 
+// Refreshes the IDs and weights of a response in place, leaving its maps,
+// lists and strings untouched.
+inline void refreshRankingResponse(ranking::RankingResponse& resp) {
+  resp.queryID = static_cast<int64_t>(xor128());
+  for (auto& story : resp.rankingStories) {
+    uint64_t rand_int = static_cast<uint64_t>(xor128());
+    story.storyID = static_cast<int64_t>(rand_int);
+    story.weight = static_cast<double>(rand_int);
+    for (auto& obj : story.objects) {
+      rand_int = static_cast<uint64_t>(xor128());
+      obj.objectID = static_cast<int64_t>(rand_int);
+      obj.weight = static_cast<double>(rand_int);
+    }
+  }
+}
+
+// Per-thread arena of pre-built responses. The first request for a size
+// builds kNumTemplates responses with generateRandomRankingResponse; later
+// requests take the next template in turn and only refresh its IDs and
+// weights, so no memory is allocated on the steady path.
+class RankingResponseArena {
+ public:
+  static constexpr size_t kNumTemplates = 4;
+
+  const ranking::RankingResponse& next(size_t ranking_stories_length) {
+    auto& templates = templates_[ranking_stories_length];
+    if (templates.responses.empty()) {
+      templates.responses.reserve(kNumTemplates);
+      for (size_t i = 0; i < kNumTemplates; i++) {
+        templates.responses.push_back(
+            generateRandomRankingResponse(ranking_stories_length));
+      }
+    }
+    auto& resp = templates.responses[templates.next];
+    templates.next = (templates.next + 1) % kNumTemplates;
+    refreshRankingResponse(resp);
+    return resp;
+  }
+
+ private:
+  struct Templates {
+    std::vector<ranking::RankingResponse> responses;
+    size_t next = 0;
+  };
+  std::unordered_map<size_t, Templates> templates_;
+};
+
+// Returns a recycled response from the calling thread's arena. The
+// reference stays valid until the thread asks for kNumTemplates more.
+inline const ranking::RankingResponse& recycledRankingResponse(
+    size_t ranking_stories_length) {
+  thread_local RankingResponseArena arena;
+  return arena.next(ranking_stories_length);
+}
+
 } // namespace generators
 } // namespace ranking
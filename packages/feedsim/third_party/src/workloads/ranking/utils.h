@@ -6,26 +6,67 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#include <sstream>
+#include <cstdlib>
+#include <string>
 #include <utility>
 
+#include "oldisim/Framing.h"
+#include "oldisim/Transport.h"
+
 namespace ranking {
 namespace utils {
+// Splits hostname[:port], where an IPv6 address is written [address]:port,
+// or on its own without a port.
 std::pair<std::string, int> parseHostnameAndPort(const std::string &address) {
-  std::stringstream s_stream{address};
-  std::string hostname;
-  if (!s_stream.good()) {
+  if (address.empty()) {
     DIE("Failed to parse %s", address.c_str());
   }
-  std::getline(s_stream, hostname, ':');
+  std::string hostname = address;
   int port = 11222;
-  if (s_stream.good()) {
-    std::string s;
-    std::getline(s_stream, s, ':');
-    port = std::strtol(s.c_str(), NULL, 10);
+  std::string::size_type port_start = std::string::npos;
+  if (address[0] == '[') {
+    const auto end = address.find(']');
+    if (end == std::string::npos) {
+      DIE("Failed to parse %s", address.c_str());
+    }
+    hostname = address.substr(1, end - 1);
+    if (end + 1 < address.size() && address[end + 1] == ':') {
+      port_start = end + 2;
+    }
+  } else if (address.find(':') == address.rfind(':')) {
+    const auto colon = address.find(':');
+    if (colon != std::string::npos) {
+      hostname = address.substr(0, colon);
+      port_start = colon + 1;
+    }
+  }
+  if (port_start != std::string::npos) {
+    port = std::strtol(address.c_str() + port_start, NULL, 10);
   }
   return std::make_pair(hostname, port);
 }
+
+// Maps a --transport style option value, already checked by gengetopt.
+oldisim::Transport parseTransport(const std::string &name) {
+  if (name == "unix") {
+    return oldisim::Transport::kUnix;
+  }
+  if (name == "shm") {
+    return oldisim::Transport::kSharedMemory;
+  }
+  return oldisim::Transport::kTcp;
+}
+
+// Maps a --framing style option value, already checked by gengetopt.
+oldisim::Framing parseFraming(const std::string &name) {
+  if (name == "compact") {
+    return oldisim::Framing::kCompact;
+  }
+  if (name == "batched") {
+    return oldisim::Framing::kCompactBatched;
+  }
+  return oldisim::Framing::kFixed;
+}
 } // namespace utils
 } // namespace ranking
 
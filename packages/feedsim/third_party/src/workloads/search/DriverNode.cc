@@ -17,7 +17,9 @@
 #include <string.h>
 #include <event2/event.h>
 
+#include <chrono>
 #include <memory>
+#include <random>
 
 #include "oldisim/ChildConnectionStats.h"
 #include "oldisim/DriverNode.h"
@@ -29,11 +31,16 @@
 
 #include "DriverNodeCmdline.h"
 #include "RequestTypes.h"
+#include "SearchQuery.h"
 #include "Util.h"
+#include "ZipfSampler.h"
 
 // Shared configuration flags
 gengetopt_args_info args;
 
+// With --query_terms, the terms of the queries sent
+static std::unique_ptr<search::ZipfSampler> term_sampler;
+
 // Program constants
 const int kMaxRequestSize = 8192;
 const int kRecomputeQPSPeriod = 5;
@@ -44,6 +51,9 @@ struct ThreadData {
   uint64_t search_request_delay;  // This is per thread
   oldisim::TestDriver* test_driver;
   event* recompute_qps_timer;
+  std::default_random_engine rng;
+  std::vector<uint32_t> query_terms;
+  std::string query;
 };
 
 // Specific timer handler to recompute inter-request delays for QPS
@@ -86,7 +96,14 @@ void ThreadStartup(oldisim::NodeThread& thread,
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
 
   // Initialize random string with random bits
+  uint64_t seed = std::chrono::system_clock::now().time_since_epoch().count() +
+                  thread.get_thread_num();
+  if (args.seed_given) {
+    seed = DeriveSeed(args.seed_arg, thread.get_thread_num());
+    SeedThreadRandom(seed);
+  }
   this_thread.random_string = RandomString(kMaxRequestSize);
+  this_thread.rng.seed(seed);
 
   // Store pointer to test_driver
   this_thread.test_driver = &test_driver;
@@ -108,6 +125,19 @@ void MakeRequest(oldisim::NodeThread& thread, oldisim::TestDriver& test_driver,
                  std::vector<ThreadData>& thread_data) {
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
 
+  if (term_sampler) {
+    std::uniform_int_distribution<int> num_terms(1, args.query_terms_arg);
+    this_thread.query_terms.resize(num_terms(this_thread.rng));
+    for (auto& term : this_thread.query_terms) {
+      term = term_sampler->Sample(this_thread.rng);
+    }
+    search::EncodeQuery(this_thread.query_terms, this_thread.query);
+    test_driver.SendRequest(search::kSearchRequestType,
+                            this_thread.query.data(), this_thread.query.size(),
+                            this_thread.search_request_delay);
+    return;
+  }
+
   test_driver.SendRequest(search::kSearchRequestType,
                           this_thread.random_string.c_str(),
                           3000, this_thread.search_request_delay);
@@ -132,6 +162,18 @@ int main(int argc, char** argv) {
     DIE("--server must be specified.");
   }
 
+  if (args.query_terms_arg < 0 ||
+      args.query_terms_arg > static_cast<int>(search::kMaxQueryTerms)) {
+    DIE("--query_terms must be between 0 and %zu", search::kMaxQueryTerms);
+  }
+  if (args.query_terms_arg > 0) {
+    if (args.index_terms_arg < 1) {
+      DIE("--index_terms must be positive");
+    }
+    term_sampler.reset(
+        new search::ZipfSampler(args.index_terms_arg, args.index_skew_arg));
+  }
+
   std::string hostname;
   int port;
   search::ParseServerAddress(args.server_arg, hostname, port);
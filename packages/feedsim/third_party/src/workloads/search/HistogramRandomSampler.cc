@@ -60,6 +60,8 @@ int HistogramRandomSampler::Sample() {
   return -1;
 }
 
+void HistogramRandomSampler::Seed(unsigned seed) { rng_.seed(seed); }
+
 void HistogramRandomSampler::InitRNG() {
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
   rng_.seed(seed);
@@ -23,6 +23,8 @@ class HistogramRandomSampler {
   explicit HistogramRandomSampler(std::string histogram_file);
   void AddBin(int start, int end, int count);
   int Sample();
+  // Restart the samples from seed instead of the clock
+  void Seed(unsigned seed);
 
  private:
   void InitRNG();
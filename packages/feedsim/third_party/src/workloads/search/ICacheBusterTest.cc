@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cstring>
 #include <iostream>
 
 #include "oldisim/Util.h"
@@ -26,8 +27,23 @@ int main(int argc, char** argv) {
     DIE("cmdline_parser failed");
   }
 
+  if (args.huge_pages_given) {
+    std::cout << "Remapped to huge pages: "
+              << ICacheBuster::RemapTextToHugePages() << " bytes" << std::endl;
+  }
+
   // Create i cache chaser
-  ICacheBuster buster(args.size_arg);
+  ICacheBusterOptions options;
+  options.num_methods = args.size_arg;
+  if (std::strcmp(args.distribution_arg, "random") == 0) {
+    options.distribution = ICacheBusterDistribution::kRandom;
+  } else if (std::strcmp(args.distribution_arg, "zipf") == 0) {
+    options.distribution = ICacheBusterDistribution::kZipf;
+  }
+  options.zipf_skew = args.zipf_skew_arg;
+  options.branch_entropy = args.branch_entropy_arg;
+  options.seed = GetTimeAccurateNano();
+  ICacheBuster buster(options);
 
   uint64_t start_time = GetTimeAccurateNano();
   for (int i = 0; i < args.iterations_arg; i++) {
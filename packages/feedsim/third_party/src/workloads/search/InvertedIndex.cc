@@ -0,0 +1,379 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "InvertedIndex.h"
+
+namespace search {
+
+const int InvertedIndex::kBlockSize;
+
+// BM25 parameters
+static const float kK1 = 1.2;
+static const float kB = 0.75;
+// Every leaf builds the same collection
+static const unsigned kIndexSeed = 20150101;
+
+static void AppendVarint(uint32_t value, std::vector<uint8_t>& out) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+// Merges two sorted lists of distinct documents
+static size_t IntersectScalar(const uint32_t* a, size_t na, const uint32_t* b,
+                              size_t nb, uint32_t* matches_a,
+                              uint32_t* matches_b) {
+  size_t i = 0, j = 0, count = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      matches_a[count] = i++;
+      matches_b[count++] = j++;
+    }
+  }
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+// Compares four documents of each list against each other at a time, then
+// moves on in the list whose fourth document is smaller, or in both. The
+// lists are finished off with the merge.
+template <typename MatchMask>
+static size_t IntersectBy4x4(const uint32_t* a, size_t na, const uint32_t* b,
+                             size_t nb, uint32_t* matches_a,
+                             uint32_t* matches_b, MatchMask match_mask) {
+  size_t i = 0, j = 0, count = 0;
+  while (i + 4 <= na && j + 4 <= nb) {
+    for (unsigned mask = match_mask(a + i, b + j); mask != 0;
+         mask &= mask - 1) {
+      size_t k = i + __builtin_ctz(mask);
+      size_t m = j;
+      while (b[m] != a[k]) {
+        m++;
+      }
+      matches_a[count] = k;
+      matches_b[count++] = m;
+    }
+    uint32_t a_max = a[i + 3];
+    uint32_t b_max = b[j + 3];
+    i += a_max <= b_max ? 4 : 0;
+    j += b_max <= a_max ? 4 : 0;
+  }
+  // Neither list has a compared match left past where the merge restarts
+  size_t tail = IntersectScalar(a + i, na - i, b + j, nb - j,
+                                matches_a + count, matches_b + count);
+  for (size_t m = count; m < count + tail; m++) {
+    matches_a[m] += i;
+    matches_b[m] += j;
+  }
+  return count + tail;
+}
+#endif
+
+#if defined(__x86_64__)
+static size_t IntersectSse2(const uint32_t* a, size_t na, const uint32_t* b,
+                            size_t nb, uint32_t* matches_a,
+                            uint32_t* matches_b) {
+  return IntersectBy4x4(
+      a, na, b, nb, matches_a, matches_b,
+      [](const uint32_t* a4, const uint32_t* b4) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a4));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b4));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+        return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+      });
+}
+#elif defined(__aarch64__)
+static size_t IntersectNeon(const uint32_t* a, size_t na, const uint32_t* b,
+                            size_t nb, uint32_t* matches_a,
+                            uint32_t* matches_b) {
+  return IntersectBy4x4(
+      a, na, b, nb, matches_a, matches_b,
+      [](const uint32_t* a4, const uint32_t* b4) {
+        static const uint32_t kLaneBits[4] = {1, 2, 4, 8};
+        uint32x4_t va = vld1q_u32(a4);
+        uint32x4_t vb = vld1q_u32(b4);
+        uint32x4_t eq = vorrq_u32(
+            vorrq_u32(vceqq_u32(va, vb), vceqq_u32(va, vextq_u32(vb, vb, 1))),
+            vorrq_u32(vceqq_u32(va, vextq_u32(vb, vb, 2)),
+                      vceqq_u32(va, vextq_u32(vb, vb, 3))));
+        return vaddvq_u32(vandq_u32(eq, vld1q_u32(kLaneBits)));
+      });
+}
+#endif
+
+InvertedIndex::InvertedIndex(const InvertedIndexOptions& options)
+    : doc_norms_(std::max<size_t>(options.num_docs, 1)),
+      num_postings_(0),
+#if defined(__x86_64__)
+      intersect_(IntersectSse2),
+      intersect_name_("sse2") {
+#elif defined(__aarch64__)
+      intersect_(IntersectNeon),
+      intersect_name_("neon") {
+#else
+      intersect_(IntersectScalar),
+      intersect_name_("scalar") {
+#endif
+  std::default_random_engine rng(kIndexSeed);
+  const size_t num_docs = doc_norms_.size();
+
+  // Document lengths in words, around 200 with a long tail
+  std::lognormal_distribution<double> length_distribution(5.3, 0.7);
+  double length_sum = 0;
+  for (auto& norm : doc_norms_) {
+    norm = std::min(std::max(length_distribution(rng), 1.0), 65535.0);
+    length_sum += norm;
+  }
+  const double average_length = length_sum / num_docs;
+  for (auto& norm : doc_norms_) {
+    norm = kK1 * (1 - kB + kB * norm / average_length);
+  }
+
+  // Each term's documents are a Bernoulli draw over the collection, taken by
+  // jumping geometric gaps so the work is in proportion to the postings
+  std::geometric_distribution<int> tf_distribution(0.6);
+  std::vector<uint32_t> docs;
+  std::vector<uint8_t> tfs;
+  const size_t num_terms = std::max<size_t>(options.num_terms, 1);
+  for (size_t term = 0; term < num_terms; term++) {
+    double df = options.max_doc_fraction * num_docs /
+        std::pow(static_cast<double>(term + 1), options.skew);
+    double p = std::min(std::max(df, 1.0) / num_docs, 1.0);
+    std::geometric_distribution<uint32_t> gap_distribution(p);
+    docs.clear();
+    tfs.clear();
+    for (uint64_t doc = gap_distribution(rng); doc < num_docs;
+         doc += gap_distribution(rng) + 1) {
+      docs.push_back(doc);
+      tfs.push_back(std::min(tf_distribution(rng) + 1, 255));
+    }
+    AddTerm(docs, tfs);
+  }
+}
+
+void InvertedIndex::AddTerm(const std::vector<uint32_t>& docs,
+                            const std::vector<uint8_t>& tfs) {
+  Term term;
+  term.first_block = blocks_.size();
+  term.num_blocks = (docs.size() + kBlockSize - 1) / kBlockSize;
+  term.num_postings = docs.size();
+  term.idf = std::log(1 + (num_docs() - docs.size() + 0.5) /
+                              (docs.size() + 0.5));
+  uint32_t previous = 0;
+  for (size_t start = 0; start < docs.size(); start += kBlockSize) {
+    size_t end = std::min<size_t>(start + kBlockSize, docs.size());
+    blocks_.push_back(
+        Block{docs[end - 1], static_cast<uint32_t>(data_.size())});
+    for (size_t i = start; i < end; i++) {
+      AppendVarint(docs[i] - previous, data_);
+      previous = docs[i];
+    }
+    data_.insert(data_.end(), tfs.begin() + start, tfs.begin() + end);
+  }
+  terms_.push_back(term);
+  num_postings_ += docs.size();
+}
+
+size_t InvertedIndex::size_bytes() const {
+  return terms_.size() * sizeof(Term) + blocks_.size() * sizeof(Block) +
+      data_.size() + doc_norms_.size() * sizeof(float);
+}
+
+float InvertedIndex::Score(const Term& term, uint32_t tf, uint32_t doc) const {
+  return term.idf * tf * (kK1 + 1) / (tf + doc_norms_[doc]);
+}
+
+void InvertedIndex::DecodeBlock(Cursor& cursor, uint32_t block) const {
+  const Term& term = terms_[cursor.term];
+  const uint8_t* in = data_.data() + blocks_[term.first_block + block].offset;
+  uint32_t doc =
+      block == 0 ? 0 : blocks_[term.first_block + block - 1].last_doc;
+  uint32_t count =
+      std::min<uint32_t>(kBlockSize, term.num_postings - block * kBlockSize);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t gap = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      byte = *in++;
+      gap |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    doc += gap;
+    cursor.docs[i] = doc;
+  }
+  cursor.tfs = in;
+  cursor.decoded_block = block;
+  cursor.num_decoded = count;
+}
+
+bool InvertedIndex::SeekBlock(Cursor& cursor, uint32_t doc) const {
+  const Term& term = terms_[cursor.term];
+  const Block* blocks = blocks_.data() + term.first_block;
+  uint32_t low = cursor.block;
+  if (low >= term.num_blocks) {
+    return false;
+  }
+  if (blocks[low].last_doc < doc) {
+    // Gallop to a block past doc, then search back between the last two
+    // steps
+    uint32_t step = 1;
+    uint32_t high = low + 1;
+    while (high < term.num_blocks && blocks[high].last_doc < doc) {
+      low = high;
+      step *= 2;
+      high = low + step;
+    }
+    high = std::min(high, term.num_blocks);
+    while (low + 1 < high) {
+      uint32_t middle = low + (high - low) / 2;
+      if (blocks[middle].last_doc < doc) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    low = high;
+  }
+  cursor.block = low;
+  if (low == term.num_blocks) {
+    return false;
+  }
+  if (cursor.decoded_block != low) {
+    DecodeBlock(cursor, low);
+  }
+  return true;
+}
+
+bool InvertedIndex::Intersect(Cursor& cursor, Scratch& scratch,
+                              size_t& num_candidates) const {
+  const Term& term = terms_[cursor.term];
+  uint32_t* candidates = scratch.candidates;
+  size_t kept = 0;
+  size_t i = 0;
+  bool more = true;
+  while (i < num_candidates) {
+    if (!SeekBlock(cursor, candidates[i])) {
+      more = false;
+      break;
+    }
+    // The candidates up to the end of the block
+    uint32_t last_doc = cursor.docs[cursor.num_decoded - 1];
+    size_t end = std::upper_bound(candidates + i, candidates + num_candidates,
+                                  last_doc) -
+        candidates;
+    size_t count = intersect_(candidates + i, end - i, cursor.docs,
+                              cursor.num_decoded, scratch.matches_a,
+                              scratch.matches_b);
+    // Matches keep their order, so compacting in place is safe
+    for (size_t m = 0; m < count; m++) {
+      size_t a = i + scratch.matches_a[m];
+      uint32_t doc = candidates[a];
+      candidates[kept] = doc;
+      scratch.scores[kept++] = scratch.scores[a] +
+          Score(term, cursor.tfs[scratch.matches_b[m]], doc);
+    }
+    i = end;
+    if (end < num_candidates) {
+      // The remaining candidates are past this block
+      cursor.block++;
+    }
+  }
+  num_candidates = kept;
+  return more;
+}
+
+size_t InvertedIndex::Search(const uint32_t* terms, size_t num_terms,
+                             size_t top_k, Scratch& scratch,
+                             SearchResult* results) const {
+  uint32_t unique_terms[kMaxQueryTerms];
+  num_terms = std::min(num_terms, kMaxQueryTerms);
+  std::copy(terms, terms + num_terms, unique_terms);
+  std::sort(unique_terms, unique_terms + num_terms);
+  num_terms = std::unique(unique_terms, unique_terms + num_terms) -
+      unique_terms;
+  if (num_terms == 0 || top_k == 0 ||
+      unique_terms[num_terms - 1] >= terms_.size()) {
+    return 0;
+  }
+
+  // The rarest term drives
+  Cursor* cursors = scratch.cursors;
+  for (size_t t = 0; t < num_terms; t++) {
+    cursors[t].term = unique_terms[t];
+    cursors[t].block = 0;
+    cursors[t].decoded_block = UINT32_MAX;
+  }
+  std::sort(cursors, cursors + num_terms, [this](const Cursor& a,
+                                                 const Cursor& b) {
+    return terms_[a.term].num_postings < terms_[b.term].num_postings;
+  });
+
+  auto worse = [](const SearchResult& a, const SearchResult& b) {
+    return a.score > b.score;
+  };
+  std::vector<SearchResult>& heap = scratch.heap;
+  heap.clear();
+  Cursor& lead = cursors[0];
+  const Term& lead_term = terms_[lead.term];
+  bool more = true;
+  for (uint32_t block = 0; more && block < lead_term.num_blocks; block++) {
+    DecodeBlock(lead, block);
+    size_t num_candidates = lead.num_decoded;
+    for (size_t i = 0; i < num_candidates; i++) {
+      scratch.candidates[i] = lead.docs[i];
+      scratch.scores[i] = Score(lead_term, lead.tfs[i], lead.docs[i]);
+    }
+    for (size_t t = 1; num_candidates > 0 && t < num_terms; t++) {
+      more &= Intersect(cursors[t], scratch, num_candidates);
+    }
+
+    for (size_t i = 0; i < num_candidates; i++) {
+      SearchResult result{scratch.candidates[i], scratch.scores[i]};
+      if (heap.size() < top_k) {
+        heap.push_back(result);
+        std::push_heap(heap.begin(), heap.end(), worse);
+      } else if (result.score > heap.front().score) {
+        std::pop_heap(heap.begin(), heap.end(), worse);
+        heap.back() = result;
+        std::push_heap(heap.begin(), heap.end(), worse);
+      }
+    }
+  }
+
+  std::sort_heap(heap.begin(), heap.end(), worse);
+  std::copy(heap.begin(), heap.end(), results);
+  return heap.size();
+}
+}  // namespace search
@@ -0,0 +1,122 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "SearchQuery.h"
+
+namespace search {
+
+struct InvertedIndexOptions {
+  size_t num_docs = 10000000;
+  // Term 0 is the most frequent one
+  size_t num_terms = 1000000;
+  // Document frequencies fall off as 1 / (term + 1)^skew
+  double skew = 1.0;
+  // Fraction of the documents that contain term 0
+  double max_doc_fraction = 0.05;
+};
+
+// A document ordered inverted index over a synthetic collection, built at
+// startup. Each posting list is cut into blocks of kBlockSize documents,
+// stored as varint coded gaps followed by the term frequencies, with a skip
+// entry per block holding its last document. Queries are conjunctive: the
+// shortest list drives, and every other list skips to the blocks that may
+// hold its candidates and intersects them with SIMD compares. Matches are
+// scored with BM25, whose document length norms are a random access into an
+// array as large as the collection.
+class InvertedIndex {
+ public:
+  static const int kBlockSize = 128;
+
+  struct Cursor {
+    uint32_t term;
+    // Next block to look at and the block held in docs, relative to the
+    // first block of the term
+    uint32_t block;
+    uint32_t decoded_block;
+    uint32_t num_decoded;
+    const uint8_t* tfs;
+    alignas(16) uint32_t docs[kBlockSize];
+  };
+
+  // Per thread buffers of Search
+  struct Scratch {
+    Cursor cursors[kMaxQueryTerms];
+    alignas(16) uint32_t candidates[kBlockSize];
+    float scores[kBlockSize];
+    // Positions of the matches in the candidates and in a block
+    uint32_t matches_a[kBlockSize];
+    uint32_t matches_b[kBlockSize];
+    std::vector<SearchResult> heap;
+  };
+
+  explicit InvertedIndex(const InvertedIndexOptions& options);
+  InvertedIndex(const InvertedIndex&) = delete;
+  InvertedIndex& operator=(const InvertedIndex&) = delete;
+
+  // Writes the top_k best scoring documents that contain all the terms to
+  // results, best first, and returns how many there are. Terms past the
+  // vocabulary match nothing and repeated terms count once.
+  size_t Search(const uint32_t* terms, size_t num_terms, size_t top_k,
+                Scratch& scratch, SearchResult* results) const;
+
+  size_t num_docs() const { return doc_norms_.size(); }
+  size_t num_terms() const { return terms_.size(); }
+  size_t num_postings() const { return num_postings_; }
+  size_t size_bytes() const;
+  // The block intersection in use: "sse2", "neon" or "scalar"
+  const char* intersect_name() const { return intersect_name_; }
+
+ private:
+  struct Term {
+    uint32_t first_block;
+    uint32_t num_blocks;
+    uint32_t num_postings;
+    float idf;
+  };
+  struct Block {
+    uint32_t last_doc;
+    uint32_t offset;
+  };
+  typedef size_t (*IntersectFunction)(const uint32_t* a, size_t na,
+                                      const uint32_t* b, size_t nb,
+                                      uint32_t* matches_a,
+                                      uint32_t* matches_b);
+
+  void AddTerm(const std::vector<uint32_t>& docs,
+               const std::vector<uint8_t>& tfs);
+  void DecodeBlock(Cursor& cursor, uint32_t block) const;
+  // Moves the cursor to the first block that may hold doc. False if no block
+  // does.
+  bool SeekBlock(Cursor& cursor, uint32_t doc) const;
+  // Keeps the candidates that the cursor's list holds, adding their scores
+  bool Intersect(Cursor& cursor, Scratch& scratch,
+                 size_t& num_candidates) const;
+  float Score(const Term& term, uint32_t tf, uint32_t doc) const;
+
+  std::vector<Term> terms_;
+  std::vector<Block> blocks_;
+  std::vector<uint8_t> data_;
+  // k1 * (1 - b + b * length / average length) of every document
+  std::vector<float> doc_norms_;
+  size_t num_postings_;
+  IntersectFunction intersect_;
+  const char* intersect_name_;
+};
+}  // namespace search
@@ -21,6 +21,7 @@
 #include <random>
 
 #include "oldisim/LeafNodeServer.h"
+#include "oldisim/Log.h"
 #include "oldisim/NodeThread.h"
 #include "oldisim/ParentConnection.h"
 #include "oldisim/QueryContext.h"
@@ -28,12 +29,20 @@
 
 #include "PointerChase.h"
 #include "ICacheBuster.h"
+#include "InvertedIndex.h"
 #include "LeafNodeCmdline.h"
 #include "RequestTypes.h"
+#include "SearchQuery.h"
+#include "ZipfSampler.h"
 
 // Shared configuration flags
 static gengetopt_args_info args;
 
+// With --index, the index all threads search and the terms of the queries
+// made up for requests that carry none
+static std::unique_ptr<search::InvertedIndex> inverted_index;
+static std::unique_ptr<search::ZipfSampler> term_sampler;
+
 // Program constants
 const int kPointerChaseSize = 10000000;
 const int kICacheBusterSize = 100000;
@@ -48,21 +57,42 @@ struct ThreadData {
   std::default_random_engine rng;
   std::gamma_distribution<double> latency_distribution;
   std::string random_string;
+  std::unique_ptr<search::InvertedIndex::Scratch> index_scratch;
+  std::vector<uint32_t> query_terms;
+  std::vector<search::SearchResult> results;
 };
 
 void ThreadStartup(oldisim::NodeThread& thread,
                    std::vector<ThreadData>& thread_data) {
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
 
+  // Initialize RNG
+  uint64_t seed = std::chrono::system_clock::now().time_since_epoch().count();
+  if (args.seed_given) {
+    seed = DeriveSeed(args.seed_arg, thread.get_thread_num());
+    SeedThreadRandom(seed);
+  }
+  this_thread.rng.seed(seed);
+
+  if (inverted_index) {
+    this_thread.index_scratch.reset(new search::InvertedIndex::Scratch());
+    this_thread.results.resize(args.index_top_k_arg);
+    return;
+  }
+
   // Initialize of I$Buster
-  this_thread.pointer_chaser.reset(new search::PointerChase(kPointerChaseSize));
+  search::PointerChaseOptions chase_options;
+  chase_options.num_elems = kPointerChaseSize;
+  chase_options.seed = seed;
+  this_thread.pointer_chaser.reset(new search::PointerChase(chase_options));
 
   // Initialize PointerChaser
-  this_thread.icache_buster.reset(new ICacheBuster(kICacheBusterSize));
+  ICacheBusterOptions icache_options;
+  icache_options.num_methods = kICacheBusterSize;
+  icache_options.seed = seed;
+  this_thread.icache_buster.reset(new ICacheBuster(icache_options));
 
-  // Initialize RNG and latency sampler
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  this_thread.rng.seed(seed);
+  // Initialize latency sampler
 
   const double alpha = 0.7;
   const double beta = 20000;
@@ -73,10 +103,35 @@ void ThreadStartup(oldisim::NodeThread& thread,
   this_thread.random_string = RandomString(kMaxResponseSize);
 }
 
+void IndexSearchRequestHandler(ThreadData& this_thread,
+                               oldisim::QueryContext& context) {
+  // Requests that carry no query get one made up the way the driver does
+  if (!search::DecodeQuery(context.GetContiguousPayload(),
+                           context.payload_length, this_thread.query_terms)) {
+    std::uniform_int_distribution<int> num_terms(1, args.query_terms_arg);
+    this_thread.query_terms.resize(num_terms(this_thread.rng));
+    for (auto& term : this_thread.query_terms) {
+      term = term_sampler->Sample(this_thread.rng);
+    }
+  }
+
+  size_t num_results = inverted_index->Search(
+      this_thread.query_terms.data(), this_thread.query_terms.size(),
+      this_thread.results.size(), *this_thread.index_scratch,
+      this_thread.results.data());
+  context.SendResponse(
+      reinterpret_cast<const uint8_t*>(this_thread.results.data()),
+      num_results * sizeof(search::SearchResult));
+}
+
 void SearchRequestHandler(oldisim::NodeThread& thread,
                           oldisim::QueryContext& context,
                           std::vector<ThreadData>& thread_data) {
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
+  if (inverted_index) {
+    IndexSearchRequestHandler(this_thread, context);
+    return;
+  }
   search::PointerChase& chaser = *this_thread.pointer_chaser;
   ICacheBuster& buster = *this_thread.icache_buster;
 
@@ -114,6 +169,28 @@ int main(int argc, char** argv) {
     log_level = QUIET;
   }
 
+  if (args.index_given) {
+    if (args.index_docs_arg < 1 || args.index_terms_arg < 1 ||
+        args.index_top_k_arg < 1) {
+      DIE("--index_docs, --index_terms and --index_top_k must be positive");
+    }
+    if (args.query_terms_arg < 1 ||
+        args.query_terms_arg > static_cast<int>(search::kMaxQueryTerms)) {
+      DIE("--query_terms must be between 1 and %zu", search::kMaxQueryTerms);
+    }
+    search::InvertedIndexOptions options;
+    options.num_docs = args.index_docs_arg;
+    options.num_terms = args.index_terms_arg;
+    options.skew = args.index_skew_arg;
+    inverted_index.reset(new search::InvertedIndex(options));
+    term_sampler.reset(
+        new search::ZipfSampler(args.index_terms_arg, args.index_skew_arg));
+    I("Built an inverted index of %zu postings in %zu bytes, intersecting "
+      "with %s",
+      inverted_index->num_postings(), inverted_index->size_bytes(),
+      inverted_index->intersect_name());
+  }
+
   // Make storage for thread variables
   std::vector<ThreadData> thread_data(args.threads_arg);
 
@@ -129,7 +206,27 @@ int main(int argc, char** argv) {
 
   server.SetNumThreads(args.threads_arg);
   server.SetThreadPinning(!args.noaffinity_given);
+  server.SetReusePortListeners(args.reuseport_given,
+                               args.reuseport_cpu_steering_given);
   server.SetThreadLoadBalancing(!args.noloadbalance_given);
+  if (args.lb_request_batch_size_given) {
+    if (args.lb_request_batch_size_arg < 1 ||
+        args.lb_connections_batch_size_arg < 1) {
+      DIE("--lb_request_batch_size and --lb_connections_batch_size must be "
+          "positive");
+    }
+    server.SetThreadLoadBalancingParams(args.lb_connections_batch_size_arg,
+                                        args.lb_request_batch_size_arg);
+  } else {
+    server.SetAdaptiveBatching(args.lb_max_batch_size_arg,
+                               args.lb_batch_budget_us_arg);
+  }
+  if (args.cork_responses_given) {
+    if (args.cork_flush_budget_arg < 0) {
+      DIE("--cork_flush_budget must not be negative");
+    }
+    server.SetResponseCorking(args.cork_flush_budget_arg);
+  }
 
   // Enable remote monitoring
   server.EnableMonitoring(args.monitor_port_arg);
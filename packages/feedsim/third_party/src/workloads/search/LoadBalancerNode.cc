@@ -19,6 +19,7 @@
 #include <chrono>
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "oldisim/FanoutManager.h"
 #include "oldisim/NodeThread.h"
@@ -28,7 +29,9 @@
 #include "oldisim/Util.h"
 
 #include "LoadBalancerNodeCmdline.h"
+#include "ParentRouter.h"
 #include "RequestTypes.h"
+#include "SearchQuery.h"
 #include "Util.h"
 
 // Shared configuration flags
@@ -40,7 +43,8 @@ const int kMaxResponseSize = 512 * 1024;
 
 struct ThreadData {
   std::default_random_engine rng;
-  std::vector<int> parent_connection_depths;
+  search::ParentRouter::ThreadState router_state;
+  std::vector<uint32_t> query_terms;
 };
 
 // Declarations of handlers
@@ -50,10 +54,12 @@ void ThreadStartup(oldisim::NodeThread& thread,
 void SearchRequestHandler(oldisim::NodeThread& thread,
                           oldisim::FanoutManager& fanout_manager,
                           oldisim::QueryContext& context,
-                          std::vector<ThreadData>& thread_data);
+                          std::vector<ThreadData>& thread_data,
+                          search::ParentRouter& router);
 void SearchRequestFanoutDone(oldisim::QueryContext& originating_query,
                              const oldisim::FanoutReplyTracker& results,
-                             ThreadData& this_thread, int parent_node_index);
+                             ThreadData& this_thread,
+                             search::ParentRouter& router);
 
 void ThreadStartup(oldisim::NodeThread& thread,
                    oldisim::FanoutManager& fanout_manager,
@@ -69,27 +75,42 @@ void ThreadStartup(oldisim::NodeThread& thread,
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count() +
                   thread.get_thread_num();
   this_thread.rng.seed(seed);
-
-  // Create # of outstanding requests structure for load balancing
-  this_thread.parent_connection_depths.resize(args.parent_given);
+  this_thread.router_state.rng.seed(seed);
+
+  // Balance requests over parents and their connections
+  oldisim::ConnectionPolicy policy =
+      oldisim::ConnectionPolicy::kLeastOutstanding;
+  if (strcmp(args.lb_policy_arg, "round_robin") == 0) {
+    policy = oldisim::ConnectionPolicy::kRoundRobin;
+  } else if (strcmp(args.lb_policy_arg, "p2c") == 0) {
+    policy = oldisim::ConnectionPolicy::kPowerOfTwoChoices;
+  } else if (strcmp(args.lb_policy_arg, "latency_ewma") == 0) {
+    policy = oldisim::ConnectionPolicy::kLatencyEwma;
+  }
+  fanout_manager.SetConnectionPolicy(policy);
 }
 
 void SearchRequestHandler(oldisim::NodeThread& thread,
                           oldisim::FanoutManager& fanout_manager,
                           oldisim::QueryContext& context,
-                          std::vector<ThreadData>& thread_data) {
+                          std::vector<ThreadData>& thread_data,
+                          search::ParentRouter& router) {
   ThreadData& this_thread = thread_data[thread.get_thread_num()];
 
-  // Find least loaded parent
-  int parent_node_index =
-      std::min_element(this_thread.parent_connection_depths.begin(),
-                       this_thread.parent_connection_depths.end()) -
-      this_thread.parent_connection_depths.begin();
-
-  // Set up fanout structure to everyone
+  // Set up fanout structure to the parent picked by the load balancing policy
   oldisim::FanoutRequest request;
-  request.child_node_id =
-      parent_node_index;  // this_thread.rng() % args.parent_given;
+  if (router.policy() == search::RoutingPolicy::kConnection) {
+    request.child_node_id = fanout_manager.SelectChildNode();
+  } else {
+    // Requests without a query are keyed on their id
+    uint64_t key = context.request_id;
+    if (search::DecodeQuery(context.GetContiguousPayload(),
+                            context.payload_length, this_thread.query_terms)) {
+      key = search::ParentRouter::QueryKey(this_thread.query_terms);
+    }
+    request.child_node_id = router.Route(key, this_thread.router_state);
+  }
+  router.Sent(request.child_node_id);
   request.request_type = search::kSearchRequestType;
   request.request_data = context.payload;
   request.request_data_length = context.payload_length;
@@ -98,17 +119,18 @@ void SearchRequestHandler(oldisim::NodeThread& thread,
                         std::bind(SearchRequestFanoutDone,
                                   std::placeholders::_1,
                                   std::placeholders::_2,
-                                  std::ref(this_thread), parent_node_index));
-  this_thread.parent_connection_depths[parent_node_index]++;
+                                  std::ref(this_thread), std::ref(router)));
 }
 
 void SearchRequestFanoutDone(oldisim::QueryContext& originating_query,
                              const oldisim::FanoutReplyTracker& results,
-                             ThreadData& this_thread, int parent_node_index) {
+                             ThreadData& this_thread,
+                             search::ParentRouter& router) {
+  router.Done(results.replies[0].child_node_id);
+
   // Finally send back the data
   originating_query.SendResponse(results.replies[0].reply_data.get(),
                                  results.replies[0].reply_data_length);
-  this_thread.parent_connection_depths[parent_node_index]--;
 }
 
 int main(int argc, char** argv) {
@@ -129,6 +151,33 @@ int main(int argc, char** argv) {
   if (args.parent_given == 0) {
     DIE("--parent must be specified.");
   }
+  if (args.parent_weight_given != 0 &&
+      args.parent_weight_given != args.parent_given) {
+    DIE("--parent_weight must be given once for each --parent.");
+  }
+
+  // Set up the routing of the shared policies
+  search::RoutingPolicy policy = search::RoutingPolicy::kConnection;
+  if (strcmp(args.lb_policy_arg, "rendezvous") == 0) {
+    policy = search::RoutingPolicy::kRendezvous;
+  } else if (strcmp(args.lb_policy_arg, "consistent_hash") == 0) {
+    policy = search::RoutingPolicy::kConsistentHash;
+  } else if (strcmp(args.lb_policy_arg, "shared_p2c") == 0) {
+    policy = search::RoutingPolicy::kSharedP2C;
+  } else if (strcmp(args.lb_policy_arg, "weighted") == 0) {
+    policy = search::RoutingPolicy::kWeighted;
+  }
+  std::vector<double> weights(args.parent_given, 1.0);
+  for (unsigned int i = 0; i < args.parent_weight_given; i++) {
+    if (args.parent_weight_arg[i] <= 0) {
+      DIE("--parent_weight must be positive.");
+    }
+    weights[i] = args.parent_weight_arg[i];
+  }
+  // Picks the parents for the shared policies, and counts what went where.
+  // It lives as long as main so that the server threads and the monitoring
+  // callback never see it torn down.
+  search::ParentRouter router(policy, weights);
 
   // Make storage for thread variables
   std::vector<ThreadData> thread_data(args.threads_arg);
@@ -142,7 +191,7 @@ int main(int argc, char** argv) {
       search::kSearchRequestType,
       std::bind(SearchRequestHandler, std::placeholders::_1,
                 std::placeholders::_2, std::placeholders::_3,
-                std::ref(thread_data)));
+                std::ref(thread_data), std::ref(router)));
   server.RegisterRequestType(search::kSearchRequestType);
 
   // Add parent nodes
@@ -156,6 +205,7 @@ int main(int argc, char** argv) {
 
   // Enable remote monitoring
   server.EnableMonitoring(args.monitor_port_arg);
+  server.SetMonitoringStatsCallback([&router]() { return router.Stats(); });
 
   server.Run(args.threads_arg, true);
 
@@ -0,0 +1,80 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <utility>
+
+#include "LoserTree.h"
+
+namespace search {
+
+bool LoserTree::Beats(uint32_t a, uint32_t b) const {
+  const Run& run_a = runs_[a];
+  const Run& run_b = runs_[b];
+  if (positions_[b] == run_b.num_results) {
+    return positions_[a] < run_a.num_results || a < b;
+  }
+  if (positions_[a] == run_a.num_results) {
+    return false;
+  }
+  float score_a = run_a.results[positions_[a]].score;
+  float score_b = run_b.results[positions_[b]].score;
+  return score_a > score_b || (score_a == score_b && a < b);
+}
+
+size_t LoserTree::Merge(const std::vector<Run>& runs, size_t top_k,
+                        MergedResult* out) {
+  const uint32_t num_runs = runs.size();
+  if (num_runs == 0) {
+    return 0;
+  }
+  runs_ = runs.data();
+  positions_.assign(num_runs, 0);
+
+  // Play the initial tournament bottom up
+  losers_.resize(num_runs);
+  winners_.resize(2 * num_runs);
+  for (uint32_t i = 0; i < num_runs; i++) {
+    winners_[num_runs + i] = i;
+  }
+  for (uint32_t n = num_runs - 1; n > 0; n--) {
+    uint32_t left = winners_[2 * n];
+    uint32_t right = winners_[2 * n + 1];
+    bool left_wins = Beats(left, right);
+    winners_[n] = left_wins ? left : right;
+    losers_[n] = left_wins ? right : left;
+  }
+  losers_[0] = num_runs > 1 ? winners_[1] : 0;
+
+  size_t count = 0;
+  while (count < top_k) {
+    uint32_t winner = losers_[0];
+    const Run& run = runs_[winner];
+    if (positions_[winner] == run.num_results) {
+      // Every run is exhausted
+      break;
+    }
+    const SearchResult& result = run.results[positions_[winner]++];
+    out[count++] = MergedResult{winner, result.doc, result.score};
+
+    // Replay the matches on the path from the winner's leaf to the root
+    for (uint32_t n = (num_runs + winner) / 2; n > 0; n /= 2) {
+      if (Beats(losers_[n], winner)) {
+        std::swap(losers_[n], winner);
+      }
+    }
+    losers_[0] = winner;
+  }
+  return count;
+}
+}  // namespace search
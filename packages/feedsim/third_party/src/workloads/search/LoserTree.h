@@ -0,0 +1,53 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "SearchQuery.h"
+
+namespace search {
+
+// Merges the result lists of several leaves, each sorted best first, with a
+// tournament tree that keeps the loser of every match at its inner node.
+// Taking the next result replays only the matches on the path of the list
+// it came from, one comparison per level, so each result costs log2 of the
+// number of lists whatever their lengths.
+class LoserTree {
+ public:
+  struct Run {
+    const SearchResult* results;
+    size_t num_results;
+  };
+
+  // Writes at most top_k of the best results of the runs to out, best
+  // first, tagging each with the index of its run. Returns how many there
+  // are. Ties go to the run with the lower index.
+  size_t Merge(const std::vector<Run>& runs, size_t top_k, MergedResult* out);
+
+ private:
+  // Whether the head of run a beats the head of run b; exhausted runs lose
+  bool Beats(uint32_t a, uint32_t b) const;
+
+  const Run* runs_;
+  // losers_[0] holds the overall winner, losers_[n] for n > 0 the loser of
+  // the match at inner node n. Run i plays from leaf num_runs + i.
+  std::vector<uint32_t> losers_;
+  std::vector<uint32_t> winners_;
+  std::vector<size_t> positions_;
+};
+}  // namespace search
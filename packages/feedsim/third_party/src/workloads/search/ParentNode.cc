@@ -26,8 +26,10 @@
 #include "oldisim/QueryContext.h"
 #include "oldisim/Util.h"
 
+#include "LoserTree.h"
 #include "ParentNodeCmdline.h"
 #include "RequestTypes.h"
+#include "SearchQuery.h"
 #include "Util.h"
 
 // Shared configuration flags
@@ -39,6 +41,11 @@ const int kMaxResponseSize = 512 * 1024;
 
 struct ThreadData {
   std::string random_string;
+  std::vector<uint32_t> query_terms;
+  std::string query;
+  search::LoserTree merger;
+  std::vector<search::LoserTree::Run> runs;
+  std::vector<search::MergedResult> merged;
 };
 
 // Declarations of handlers
@@ -65,6 +72,9 @@ void ThreadStartup(oldisim::NodeThread& thread,
 
   // Initialize random string with random bits
   this_thread.random_string = RandomString(kMaxResponseSize);
+  if (args.merge_results_given) {
+    this_thread.merged.resize(args.top_k_arg);
+  }
 }
 
 void SearchRequestHandler(oldisim::NodeThread& thread,
@@ -78,6 +88,13 @@ void SearchRequestHandler(oldisim::NodeThread& thread,
   request.request_type = search::kSearchRequestType;
   request.request_data = this_thread.random_string.c_str();
   request.request_data_length = 3500;
+  // Queries go on to the leaves as they came
+  if (search::DecodeQuery(context.GetContiguousPayload(),
+                          context.payload_length, this_thread.query_terms)) {
+    search::EncodeQuery(this_thread.query_terms, this_thread.query);
+    request.request_data = this_thread.query.data();
+    request.request_data_length = this_thread.query.size();
+  }
 
   fanout_manager.FanoutAll(
       std::move(context), request,
@@ -88,6 +105,27 @@ void SearchRequestHandler(oldisim::NodeThread& thread,
 void SearchRequestFanoutDone(oldisim::QueryContext& originating_query,
                              const oldisim::FanoutReplyTracker& results,
                              ThreadData& this_thread) {
+  if (args.merge_results_given) {
+    // Leaves that timed out or shed the query add nothing
+    this_thread.runs.clear();
+    for (const auto& reply : results.replies) {
+      search::LoserTree::Run run = {nullptr, 0};
+      if (!reply.timed_out && reply.status == oldisim::ResponseStatus::kOk) {
+        run.results = reinterpret_cast<const search::SearchResult*>(
+            reply.reply_data.get());
+        run.num_results =
+            reply.reply_data_length / sizeof(search::SearchResult);
+      }
+      this_thread.runs.push_back(run);
+    }
+    size_t num_results = this_thread.merger.Merge(
+        this_thread.runs, this_thread.merged.size(), this_thread.merged.data());
+    originating_query.SendResponse(
+        reinterpret_cast<const uint8_t*>(this_thread.merged.data()),
+        num_results * sizeof(search::MergedResult));
+    return;
+  }
+
   // Finally send back the data
   originating_query.SendResponse(
       reinterpret_cast<const uint8_t*>(this_thread.random_string.c_str()),
@@ -112,6 +150,9 @@ int main(int argc, char** argv) {
   if (args.leaf_given == 0) {
     DIE("--leaf must be specified.");
   }
+  if (args.merge_results_given && args.top_k_arg < 1) {
+    DIE("--top_k must be positive");
+  }
 
   // Make storage for thread variables
   std::vector<ThreadData> thread_data(args.threads_arg);
@@ -139,6 +180,8 @@ int main(int argc, char** argv) {
 
   // Enable remote monitoring
   server.EnableMonitoring(args.monitor_port_arg);
+  server.SetReusePortListeners(args.reuseport_given,
+                               args.reuseport_cpu_steering_given);
 
   server.Run(args.threads_arg, true);
 
@@ -0,0 +1,172 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+
+#include "ParentRouter.h"
+
+namespace search {
+
+// Virtual nodes on the consistent hash ring for a parent of average weight
+static const int kVirtualNodes = 160;
+
+// The splitmix64 finalizer
+static uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+ParentRouter::ParentRouter(RoutingPolicy policy,
+                           const std::vector<double>& weights)
+    : policy_(policy),
+      weights_(weights),
+      counters_(new ParentCounters[weights.size()]) {
+  double sum = 0;
+  for (double weight : weights_) {
+    sum += weight;
+  }
+  for (size_t i = 0; i < weights_.size(); i++) {
+    weights_[i] /= sum;
+    counters_[i].routed = 0;
+    counters_[i].outstanding = 0;
+  }
+
+  if (policy_ == RoutingPolicy::kConsistentHash) {
+    for (uint32_t parent = 0; parent < weights_.size(); parent++) {
+      int num_nodes = std::max<int>(
+          1, std::lround(kVirtualNodes * weights_[parent] * weights_.size()));
+      for (int node = 0; node < num_nodes; node++) {
+        ring_.emplace_back(Mix((static_cast<uint64_t>(parent) << 32) | node),
+                           parent);
+      }
+    }
+    std::sort(ring_.begin(), ring_.end());
+  }
+}
+
+uint64_t ParentRouter::QueryKey(std::vector<uint32_t>& terms) {
+  std::sort(terms.begin(), terms.end());
+  uint64_t key = terms.size();
+  for (uint32_t term : terms) {
+    key = Mix(key ^ term);
+  }
+  return key;
+}
+
+uint32_t ParentRouter::Route(uint64_t key, ThreadState& state) const {
+  const uint32_t num_parents = weights_.size();
+  switch (policy_) {
+    case RoutingPolicy::kRendezvous: {
+      // Weighted rendezvous: the parent maximizing -weight / ln(hash), with
+      // the hash taken to (0, 1)
+      uint32_t best = 0;
+      double best_score = -1;
+      for (uint32_t parent = 0; parent < num_parents; parent++) {
+        uint64_t hash = Mix(key ^ Mix(parent + 1));
+        double unit = ((hash >> 11) + 0.5) / 9007199254740992.0;
+        double score = -weights_[parent] / std::log(unit);
+        if (score > best_score) {
+          best = parent;
+          best_score = score;
+        }
+      }
+      return best;
+    }
+    case RoutingPolicy::kConsistentHash: {
+      auto it = std::lower_bound(ring_.begin(), ring_.end(),
+                                 std::make_pair(Mix(key), uint32_t(0)));
+      return it == ring_.end() ? ring_.front().second : it->second;
+    }
+    case RoutingPolicy::kSharedP2C: {
+      if (num_parents == 1) {
+        return 0;
+      }
+      std::uniform_int_distribution<uint32_t> pick(0, num_parents - 1);
+      uint32_t a = pick(state.rng);
+      uint32_t b = pick(state.rng);
+      while (b == a) {
+        b = pick(state.rng);
+      }
+      // Compare the loads relative to the weights
+      double load_a =
+          counters_[a].outstanding.load(std::memory_order_relaxed) /
+          weights_[a];
+      double load_b =
+          counters_[b].outstanding.load(std::memory_order_relaxed) /
+          weights_[b];
+      return load_a <= load_b ? a : b;
+    }
+    case RoutingPolicy::kWeighted: {
+      // Every pick raises each parent by its weight and lowers the one
+      // picked, the highest, by the total
+      state.current_weights.resize(num_parents);
+      uint32_t best = 0;
+      for (uint32_t parent = 0; parent < num_parents; parent++) {
+        state.current_weights[parent] += weights_[parent];
+        if (state.current_weights[parent] > state.current_weights[best]) {
+          best = parent;
+        }
+      }
+      state.current_weights[best] -= 1;
+      return best;
+    }
+    case RoutingPolicy::kConnection:
+      break;
+  }
+  return 0;
+}
+
+void ParentRouter::Sent(uint32_t parent) {
+  counters_[parent].routed.fetch_add(1, std::memory_order_relaxed);
+  counters_[parent].outstanding.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ParentRouter::Done(uint32_t parent) {
+  counters_[parent].outstanding.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::map<std::string, double> ParentRouter::Stats() const {
+  std::map<std::string, double> stats;
+  std::vector<double> routed(weights_.size());
+  double total = 0;
+  for (size_t i = 0; i < weights_.size(); i++) {
+    routed[i] = counters_[i].routed.load(std::memory_order_relaxed);
+    total += routed[i];
+    std::string prefix = "lb_parent_" + std::to_string(i);
+    stats[prefix + "_routed"] = routed[i];
+    stats[prefix + "_outstanding"] =
+        counters_[i].outstanding.load(std::memory_order_relaxed);
+  }
+
+  double max_ratio = 0;
+  double sum = 0;
+  double sum_squares = 0;
+  for (size_t i = 0; i < weights_.size(); i++) {
+    double ratio = total > 0 ? routed[i] / total / weights_[i] : 0;
+    max_ratio = std::max(max_ratio, ratio);
+    sum += ratio;
+    sum_squares += ratio * ratio;
+  }
+  double mean = sum / weights_.size();
+  double variance = std::max(sum_squares / weights_.size() - mean * mean, 0.0);
+  stats["lb_imbalance_max"] = max_ratio;
+  stats["lb_imbalance_cv"] = mean > 0 ? std::sqrt(variance) / mean : 0;
+  return stats;
+}
+}  // namespace search
@@ -0,0 +1,90 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace search {
+
+enum class RoutingPolicy {
+  // Left to the connection policy of each thread's FanoutManager
+  kConnection,
+  // On the request key, to the parent with the highest weighted hash
+  kRendezvous,
+  // On the request key, to the next parent on a ring of virtual nodes
+  kConsistentHash,
+  // To the less loaded of two random parents, counting the requests
+  // outstanding from all threads
+  kSharedP2C,
+  // Smooth weighted round robin
+  kWeighted,
+};
+
+// Picks the parent of each request for the load balancer. One router serves
+// all threads, so the key based policies send a key to the same parent from
+// every thread and kSharedP2C sees the load all threads put on the parents.
+// Every policy is weighted and counts what it routed, to measure how far
+// the load strays from the weights.
+class ParentRouter {
+ public:
+  // State a thread keeps to itself
+  struct ThreadState {
+    std::default_random_engine rng;
+    std::vector<double> current_weights;
+  };
+
+  ParentRouter(RoutingPolicy policy, const std::vector<double>& weights);
+
+  RoutingPolicy policy() const { return policy_; }
+
+  // The key of a query, the same whatever the order of its terms
+  static uint64_t QueryKey(std::vector<uint32_t>& terms);
+
+  // Not valid for kConnection
+  uint32_t Route(uint64_t key, ThreadState& state) const;
+
+  // A request went to the parent, and its reply came back
+  void Sent(uint32_t parent);
+  void Done(uint32_t parent);
+
+  // The requests routed to and outstanding at each parent, and how far the
+  // routed requests stray from the weights: the largest share of a parent
+  // over its weighted share and the coefficient of variation of that ratio
+  std::map<std::string, double> Stats() const;
+
+ private:
+  // Padded so that threads updating different parents rarely contend
+  struct ParentCounters {
+    std::atomic<uint64_t> routed;
+    std::atomic<int64_t> outstanding;
+    char padding[64 - 2 * sizeof(uint64_t)];
+  };
+
+  RoutingPolicy policy_;
+  // Normalized to sum to 1
+  std::vector<double> weights_;
+  std::unique_ptr<ParentCounters[]> counters_;
+  // Virtual nodes of kConsistentHash, sorted by hash
+  std::vector<std::pair<uint64_t, uint32_t>> ring_;
+};
+}  // namespace search
@@ -12,28 +12,134 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <chrono>
+#include <new>
 #include <numeric>
 #include <random>
+#include <vector>
 
 #include "PointerChase.h"
 
 namespace search {
 
+static const size_t kHugePageSize = 2 << 20;
+// From <numaif.h>, which would pull in libnuma for a single syscall
+static const int kMpolBind = 2;
+// From <linux/mman.h>: the log2 of the hugetlb page size goes here
+static const int kMapHugeShift = 26;
+
+constexpr int PointerChase::kMaxChains;
+
 PointerChase::PointerChase(size_t num_elems)
-    : data_(num_elems), current_index_(0) {
-  // Fill data with [0, num_elems)
-  std::iota(data_.begin(), data_.end(), 0);
+    : PointerChase([num_elems] {
+        PointerChaseOptions options;
+        options.num_elems = num_elems;
+        options.seed =
+            std::chrono::system_clock::now().time_since_epoch().count();
+        return options;
+      }()) {}
+
+PointerChase::PointerChase(const PointerChaseOptions& options)
+    : mapping_(nullptr),
+      mapping_length_(0),
+      data_(nullptr),
+      num_elems_(std::max<size_t>(options.num_elems, 1)),
+      num_chains_(std::min<int>(std::max(options.num_chains, 1),
+                                std::min<size_t>(kMaxChains, num_elems_))),
+      huge_pages_(false),
+      hugetlb_(false),
+      numa_bound_(false) {
+  size_t length = num_elems_ * sizeof(uint64_t);
+  // hugetlb mappings are always aligned to their page size
+  if (options.hugetlb_page_size > 0) {
+    size_t page = options.hugetlb_page_size;
+    mapping_length_ = (length + page - 1) / page * page;
+    mapping_ = mmap(nullptr, mapping_length_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                        (__builtin_ctzll(page) << kMapHugeShift),
+                    -1, 0);
+    hugetlb_ = mapping_ != MAP_FAILED;
+  }
+  if (hugetlb_) {
+    data_ = reinterpret_cast<uint64_t*>(mapping_);
+  } else {
+    // Over-allocate so the working set can start on a huge page boundary
+    bool advise = options.huge_pages || options.hugetlb_page_size > 0;
+    size_t alignment = advise ? kHugePageSize : 1;
+    mapping_length_ = length + alignment - 1;
+    mapping_ = mmap(nullptr, mapping_length_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping_ == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(mapping_);
+    start = (start + alignment - 1) / alignment * alignment;
+    data_ = reinterpret_cast<uint64_t*>(start);
+
+    // Placement has to be set up before the pages are first touched below
+    if (advise) {
+      huge_pages_ = madvise(data_, length, MADV_HUGEPAGE) == 0;
+    }
+  }
+  if (options.numa_node >= 0) {
+    const size_t bits = 8 * sizeof(unsigned long);  // NOLINT(runtime/int)
+    std::vector<unsigned long> nodemask(  // NOLINT(runtime/int)
+        options.numa_node / bits + 1);
+    nodemask[options.numa_node / bits] = 1UL << (options.numa_node % bits);
+    numa_bound_ = syscall(SYS_mbind, data_, length, kMpolBind, nodemask.data(),
+                          nodemask.size() * bits + 1, 0) == 0;
+  }
 
-  // Make a random permutation over data
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  std::shuffle(data_.begin(), data_.end(), std::default_random_engine(seed));
+  // Make data a single random cycle through [0, num_elems) with Sattolo's
+  // algorithm, so that no chain gets stuck in a short cycle that fits in
+  // cache
+  std::iota(data_, data_ + num_elems_, 0);
+  std::default_random_engine rng(options.seed);
+  for (size_t i = num_elems_ - 1; i > 0; i--) {
+    std::uniform_int_distribution<size_t> dist(0, i - 1);
+    std::swap(data_[i], data_[dist(rng)]);
+  }
+
+  // Chains start at distinct points of the cycle and move in lockstep, so
+  // they never meet
+  for (int i = 0; i < num_chains_; i++) {
+    current_index_[i] = i * (num_elems_ / num_chains_);
+  }
 }
 
-void PointerChase::Chase(size_t num_iterations) {
-  for (size_t i = 0; i < num_iterations; i++) {
-    current_index_ = data_[current_index_];
+PointerChase::~PointerChase() { munmap(mapping_, mapping_length_); }
+
+template <int kChains>
+void PointerChase::ChaseChains(size_t num_hops) {
+  // Keep the chains in registers so the loads are the only memory accesses
+  uint64_t index[kChains];
+  std::copy(current_index_, current_index_ + kChains, index);
+  for (size_t i = 0; i < num_hops; i++) {
+    for (int chain = 0; chain < kChains; chain++) {
+      index[chain] = data_[index[chain]];
+    }
   }
+  std::copy(index, index + kChains, current_index_);
+}
+
+void PointerChase::Chase(size_t num_iterations) {
+  typedef void (PointerChase::*ChaseFunction)(size_t);
+  static const ChaseFunction kChaseFunctions[kMaxChains] = {
+      &PointerChase::ChaseChains<1>,  &PointerChase::ChaseChains<2>,
+      &PointerChase::ChaseChains<3>,  &PointerChase::ChaseChains<4>,
+      &PointerChase::ChaseChains<5>,  &PointerChase::ChaseChains<6>,
+      &PointerChase::ChaseChains<7>,  &PointerChase::ChaseChains<8>,
+      &PointerChase::ChaseChains<9>,  &PointerChase::ChaseChains<10>,
+      &PointerChase::ChaseChains<11>, &PointerChase::ChaseChains<12>,
+      &PointerChase::ChaseChains<13>, &PointerChase::ChaseChains<14>,
+      &PointerChase::ChaseChains<15>, &PointerChase::ChaseChains<16>};
+  (this->*kChaseFunctions[num_chains_ - 1])(num_iterations / num_chains_);
+  // The hops that do not divide evenly go to the first chain
+  ChaseChains<1>(num_iterations % num_chains_);
 }
 }  // namespace search
@@ -13,19 +13,69 @@
 // limitations under the License.
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
-#include <vector>
-
 namespace search {
 
+struct PointerChaseOptions {
+  // Working set in 8 byte elements
+  size_t num_elems = 1;
+  // Independent chains walked in lockstep, i.e. the number of misses in
+  // flight at once. Between 1 and PointerChase::kMaxChains.
+  int num_chains = 1;
+  // Back the working set with 2MB transparent huge pages
+  bool huge_pages = false;
+  // Map the working set from the hugetlbfs pool of this page size, e.g. 2MB
+  // or 1GB, or 0 for normal pages. Falls back to huge_pages if the pool has
+  // too few pages reserved.
+  size_t hugetlb_page_size = 0;
+  // Bind the working set to this NUMA node, or -1 for first touch
+  int numa_node = -1;
+  // Seed of the cycle through the working set
+  uint64_t seed = 0;
+};
+
+// Walks num_chains dependent chains through a single random cycle over the
+// working set. Every hop of a chain is a load whose address depends on the
+// previous one, while the chains are independent of each other, so one chain
+// measures load-to-use latency and more chains add memory-level parallelism
+// until the walk becomes bandwidth bound.
 class PointerChase {
  public:
+  static constexpr int kMaxChains = 16;
+
   explicit PointerChase(size_t num_elems);
+  explicit PointerChase(const PointerChaseOptions& options);
+  ~PointerChase();
+  PointerChase(const PointerChase&) = delete;
+  PointerChase& operator=(const PointerChase&) = delete;
+
+  // Make num_iterations hops in total, spread evenly over the chains
   void Chase(size_t num_iterations);
 
+  int num_chains() const { return num_chains_; }
+  size_t size_bytes() const { return num_elems_ * sizeof(uint64_t); }
+  // Whether the requested placement could be applied. Failing to place the
+  // working set is not fatal; it then lives wherever the kernel put it.
+  bool huge_pages() const { return huge_pages_; }
+  bool hugetlb() const { return hugetlb_; }
+  bool numa_bound() const { return numa_bound_; }
+
  private:
-  std::vector<uint64_t> data_;
-  size_t current_index_;
+  template <int kChains>
+  void ChaseChains(size_t num_hops);
+
+  // The working set is carved out of an anonymous mapping so that it can be
+  // aligned to and advised for huge pages and bound to a node
+  void* mapping_;
+  size_t mapping_length_;
+  uint64_t* data_;
+  size_t num_elems_;
+  int num_chains_;
+  bool huge_pages_;
+  bool hugetlb_;
+  bool numa_bound_;
+  uint64_t current_index_[kMaxChains];
 };
 }  // namespace search
@@ -27,7 +27,20 @@ int main(int argc, char** argv) {
   }
 
   // Create pointer chaser
-  search::PointerChase chaser(args.size_arg);
+  search::PointerChaseOptions options;
+  options.num_elems = args.size_arg;
+  options.num_chains = args.chains_arg;
+  options.huge_pages = args.huge_pages_given;
+  options.numa_node = args.numa_node_arg;
+  options.seed = GetTimeAccurateNano();
+  search::PointerChase chaser(options);
+  if (args.huge_pages_given && !chaser.huge_pages()) {
+    std::cout << "Warning: could not use huge pages" << std::endl;
+  }
+  if (args.numa_node_arg >= 0 && !chaser.numa_bound()) {
+    std::cout << "Warning: could not bind to node " << args.numa_node_arg
+              << std::endl;
+  }
 
   uint64_t start_time = GetTimeAccurateNano();
   for (int i = 0; i < args.iterations_arg; i++) {
@@ -35,10 +48,18 @@ int main(int argc, char** argv) {
   }
   uint64_t end_time = GetTimeAccurateNano();
 
-  std::cout << "Time per access: "
-            << static_cast<double>(end_time - start_time) /
-               (static_cast<double>(args.iterations_arg) * args.length_arg)
-            << " ns" << std::endl;
+  double total_time = static_cast<double>(end_time - start_time);
+  double accesses = static_cast<double>(args.iterations_arg) * args.length_arg;
+  // Each chain makes accesses / chains dependent hops in the total time
+  std::cout << "Time per access: " << total_time / accesses << " ns"
+            << std::endl;
+  std::cout << "Latency per hop: "
+            << total_time / (accesses / chaser.num_chains()) << " ns"
+            << std::endl;
+  std::cout << "Bandwidth: " << accesses * 64 / total_time << " GB/s"
+            << " (" << chaser.num_chains() << " chains, "
+            << chaser.size_bytes() / (1 << 20) << " MB working set)"
+            << std::endl;
 
   return 0;
 }
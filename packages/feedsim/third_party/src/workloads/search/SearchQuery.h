@@ -0,0 +1,70 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+namespace search {
+
+// A search request either carries a query or, as the driver sent
+// originally, random bytes. A query is kQueryMagic, the number of terms and
+// the term IDs, all native 32-bit integers.
+static const uint32_t kQueryMagic = 0x59524551;
+static const size_t kMaxQueryTerms = 16;
+
+// A leaf run with --index answers with its results, best first
+struct SearchResult {
+  uint32_t doc;
+  float score;
+};
+
+// A parent run with --merge_results answers with the best results of all its
+// leaves, where leaf is the position of the leaf among its --leaf flags
+struct MergedResult {
+  uint32_t leaf;
+  uint32_t doc;
+  float score;
+};
+
+inline void EncodeQuery(const std::vector<uint32_t>& terms, std::string& out) {
+  uint32_t header[2] = {kQueryMagic, static_cast<uint32_t>(terms.size())};
+  out.assign(reinterpret_cast<const char*>(header), sizeof(header));
+  out.append(reinterpret_cast<const char*>(terms.data()),
+             terms.size() * sizeof(uint32_t));
+}
+
+// Returns false if the payload is not a query of at most kMaxQueryTerms
+// terms
+inline bool DecodeQuery(const void* payload, size_t length,
+                        std::vector<uint32_t>& terms) {
+  uint32_t header[2];
+  if (payload == nullptr || length < sizeof(header)) {
+    return false;
+  }
+  memcpy(header, payload, sizeof(header));
+  if (header[0] != kQueryMagic || header[1] > kMaxQueryTerms ||
+      length != sizeof(header) + header[1] * sizeof(uint32_t)) {
+    return false;
+  }
+  terms.resize(header[1]);
+  memcpy(terms.data(), static_cast<const char*>(payload) + sizeof(header),
+         header[1] * sizeof(uint32_t));
+  return true;
+}
+}  // namespace search
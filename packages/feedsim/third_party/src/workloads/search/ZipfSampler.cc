@@ -0,0 +1,40 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+
+#include "ZipfSampler.h"
+
+namespace search {
+
+ZipfSampler::ZipfSampler(size_t n, double skew)
+    : cdf_(std::max<size_t>(n, 1)) {
+  double sum = 0;
+  for (size_t i = 0; i < cdf_.size(); i++) {
+    sum += std::pow(static_cast<double>(i + 1), -skew);
+    cdf_[i] = sum;
+  }
+  for (auto& p : cdf_) {
+    p /= sum;
+  }
+}
+
+uint32_t ZipfSampler::Sample(std::default_random_engine& rng) const {
+  std::uniform_real_distribution<double> uniform(0, 1);
+  auto it = std::lower_bound(cdf_.begin(), cdf_.end(), uniform(rng));
+  // Rounding can leave the last entry just below 1
+  return std::min<size_t>(it - cdf_.begin(), cdf_.size() - 1);
+}
+}  // namespace search
@@ -0,0 +1,36 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+namespace search {
+
+// Draws ranks in [0, n) with probability proportional to 1 / (rank + 1)^skew.
+// The table is read only once built, so threads can share one sampler and
+// bring their own engines.
+class ZipfSampler {
+ public:
+  ZipfSampler(size_t n, double skew);
+
+  uint32_t Sample(std::default_random_engine& rng) const;
+
+ private:
+  std::vector<double> cdf_;
+};
+}  // namespace search
@@ -24,57 +24,217 @@ HEADER_TEMPLATE = """
 #ifndef ICACHE_BUSTER_H
 #define ICACHE_BUSTER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <vector>
 
+enum class ICacheBusterDistribution {{
+  // Walk the methods in a fixed shuffled order
+  kSequential,
+  // Call methods uniformly at random
+  kRandom,
+  // Call method k with weight 1 / (k + 1)^zipf_skew, so a few methods are hot
+  // and the rest form a long cold tail
+  kZipf,
+}};
+
+struct ICacheBusterOptions {{
+  // Number of the generated methods to run through
+  size_t num_methods = 0;
+  ICacheBusterDistribution distribution = ICacheBusterDistribution::kSequential;
+  double zipf_skew = 1.0;
+  // Probability that a call takes random paths through the branches of its
+  // method rather than always falling through. Only has an effect if the
+  // methods were generated with branches.
+  double branch_entropy = 0;
+  uint64_t seed = 0;
+}};
+
 class ICacheBuster {{
 public:
   ICacheBuster(size_t num_methods);
+  explicit ICacheBuster(const ICacheBusterOptions& options);
   void RunNextMethod();
+
+  // Number of methods that were generated, the most any buster can use
+  static size_t NumGeneratedMethods();
+
+  // Moves the 2MB-aligned part of the generated code onto transparent huge
+  // pages, so that it is mapped by a few iTLB entries. Must be called before
+  // any thread runs a method. Returns the number of bytes remapped, 0 if the
+  // code spans no full huge page or the remap failed.
+  static size_t RemapTextToHugePages();
+
 private:
-  std::vector<void (*)()> methods_;
+  uint64_t NextRandom();
+
+  std::vector<void (*)(unsigned)> methods_;
+  // Indices into methods_ to call in turn; empty for sequential access
+  std::vector<uint32_t> schedule_;
   size_t current_index_;
   size_t num_subset_methods_;
+  uint64_t rng_state_;
+  // A call uses random branch pattern bits when the low half of a random
+  // number is below this threshold
+  uint64_t branch_threshold_;
 }};
 
 #endif
 """
 
 INIT_METHOD_DECL_TEMPALTE = (
-    "extern void ICBInit_{SPLIT_NUM}" "(std::vector<void (*)()>& methods);"
+    "extern void ICBInit_{SPLIT_NUM}" "(std::vector<void (*)(unsigned)>& methods);"
 )
 
 SOURCE_TEMPLATE = """
+#include <sys/mman.h>
+#include <string.h>
+
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
 #include <numeric>
 #include <random>
 #include "ICacheBuster.h"
 
 {INIT_METHOD_DECLS}
 
+volatile unsigned icb_sink;
+
+namespace {{
+// Random and zipf busters replay a precomputed sequence of calls, which is
+// cheaper than drawing each call and keeps the dcache footprint small
+const size_t kScheduleLength = 1 << 16;
+const uintptr_t kHugePageSize = 2 << 20;
+
+void InitMethods(std::vector<void (*)(unsigned)>& methods) {{
+{INIT_METHOD_CALLS}
+}}
+}}  // namespace
+
 ICacheBuster::ICacheBuster(size_t num_methods)
+    : ICacheBuster([num_methods] {{
+        ICacheBusterOptions options;
+        options.num_methods = num_methods;
+        options.seed =
+            std::chrono::system_clock::now().time_since_epoch().count();
+        return options;
+      }}()) {{}}
+
+ICacheBuster::ICacheBuster(const ICacheBusterOptions& options)
     : methods_({NUM_METHODS}), current_index_(0),
-      num_subset_methods_(num_methods) {{
-  assert(num_methods <= {NUM_METHODS});
-{INIT_METHOD_CALLS}
+      num_subset_methods_(options.num_methods),
+      rng_state_(options.seed | 1),
+      branch_threshold_(static_cast<uint64_t>(
+          std::min(std::max(options.branch_entropy, 0.0), 1.0) * 4294967296.0)) {{
+  assert(options.num_methods > 0 && options.num_methods <= {NUM_METHODS});
+  InitMethods(methods_);
   // make a random permutation over data
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  std::shuffle(methods_.begin(), methods_.end(), std::default_random_engine(seed));
+  std::default_random_engine rng(options.seed);
+  std::shuffle(methods_.begin(), methods_.end(), rng);
+
+  if (options.distribution == ICacheBusterDistribution::kSequential) {{
+    return;
+  }}
+  schedule_.resize(kScheduleLength);
+  if (options.distribution == ICacheBusterDistribution::kRandom) {{
+    std::uniform_int_distribution<uint32_t> index(0, num_subset_methods_ - 1);
+    for (auto& i : schedule_) {{
+      i = index(rng);
+    }}
+  }} else {{
+    std::vector<double> cdf(num_subset_methods_);
+    double total = 0;
+    for (size_t k = 0; k < num_subset_methods_; k++) {{
+      total += 1.0 / std::pow(k + 1, options.zipf_skew);
+      cdf[k] = total;
+    }}
+    std::uniform_real_distribution<double> quantile(0, total);
+    for (auto& i : schedule_) {{
+      i = std::min<size_t>(
+          std::lower_bound(cdf.begin(), cdf.end(), quantile(rng)) - cdf.begin(),
+          num_subset_methods_ - 1);
+    }}
+  }}
+}}
+
+uint64_t ICacheBuster::NextRandom() {{
+  // xorshift64
+  rng_state_ ^= rng_state_ << 13;
+  rng_state_ ^= rng_state_ >> 7;
+  rng_state_ ^= rng_state_ << 17;
+  return rng_state_;
 }}
 
 void ICacheBuster::RunNextMethod() {{
-  methods_[current_index_]();
-  current_index_ = (current_index_ + 1) % num_subset_methods_;
+  unsigned pattern = 0;
+  if (branch_threshold_ != 0) {{
+    uint64_t r = NextRandom();
+    if ((r & 0xffffffff) < branch_threshold_) {{
+      pattern = static_cast<unsigned>(r >> 32);
+    }}
+  }}
+  if (schedule_.empty()) {{
+    methods_[current_index_](pattern);
+    current_index_ = (current_index_ + 1) % num_subset_methods_;
+  }} else {{
+    methods_[schedule_[current_index_]](pattern);
+    current_index_ = (current_index_ + 1) % schedule_.size();
+  }}
+}}
+
+size_t ICacheBuster::NumGeneratedMethods() {{ return {NUM_METHODS}; }}
+
+size_t ICacheBuster::RemapTextToHugePages() {{
+  std::vector<void (*)(unsigned)> methods({NUM_METHODS});
+  InitMethods(methods);
+  uintptr_t low = UINTPTR_MAX;
+  uintptr_t high = 0;
+  for (auto method : methods) {{
+    low = std::min(low, reinterpret_cast<uintptr_t>(method));
+    high = std::max(high, reinterpret_cast<uintptr_t>(method));
+  }}
+  const uintptr_t start = (low + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  const uintptr_t end = high & ~(kHugePageSize - 1);
+  // This function must keep running while the range is unmapped
+  const uintptr_t self = reinterpret_cast<uintptr_t>(&RemapTextToHugePages);
+  if (start >= end || (self >= start && self < end)) {{
+    return 0;
+  }}
+  const size_t length = end - start;
+  void* text = reinterpret_cast<void*>(start);
+
+  void* copy = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (copy == MAP_FAILED) {{
+    return 0;
+  }}
+  memcpy(copy, text, length);
+  // Replace the file-backed text with anonymous memory that THP can back
+  if (mmap(text, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {{
+    abort();
+  }}
+  madvise(text, length, MADV_HUGEPAGE);
+  memcpy(text, copy, length);
+  if (mprotect(text, length, PROT_READ | PROT_EXEC) != 0) {{
+    abort();
+  }}
+  munmap(copy, length);
+  return length;
 }}
 """
 
-INIT_METHOD_CALL_TEMPLATE = "  ICBInit_{SPLIT_NUM}(methods_);"
+INIT_METHOD_CALL_TEMPLATE = "  ICBInit_{SPLIT_NUM}(methods);"
+
+METHOD_CODE_TEMPLATE = "void ICBMethod_{METHOD_NUM}(unsigned pattern) {{{BODY}}}"
 
-METHOD_CODE_TEMPLATE = "void ICBMethod_{METHOD_NUM}() {{ }}"
+BRANCH_CODE_TEMPLATE = " if (pattern & {MASK}u) icb_sink = {VALUE}u;"
 
 INIT_METHOD_CODE_TEMPLATE = """
-void ICBInit_{SPLIT_NUM}(std::vector<void (*)()>& methods) {{
+void ICBInit_{SPLIT_NUM}(std::vector<void (*)(unsigned)>& methods) {{
 {STORE_METHODS_CODE}
 }}
 """
@@ -82,6 +242,19 @@ void ICBInit_{SPLIT_NUM}(std::vector<void (*)()>& methods) {{
 STORE_METHOD_CODE_TEMPLATE = "  methods[{METHOD_NUM}] = " "&ICBMethod_{METHOD_NUM};"
 
 
+def method_body(method_num, num_branches):
+    if num_branches == 0:
+        return " "
+    # Distinct constants keep the compiler from merging identical methods
+    branches = "".join(
+        BRANCH_CODE_TEMPLATE.format(
+            MASK=1 << b, VALUE=(method_num * num_branches + b) & 0xFFFFFFFF
+        )
+        for b in range(num_branches)
+    )
+    return branches + " "
+
+
 def grouper(n, iterable, fillvalue=None):
     args = [iter(iterable)] * n
     results = [
@@ -109,7 +282,15 @@ def main():
         type=int,
         default=1,
     )
+    parser.add_argument(
+        "--branches_per_method",
+        help="Number of data-dependent branches in each method, at most 32",
+        type=int,
+        default=0,
+    )
     args = parser.parse_args()
+    if not 0 <= args.branches_per_method <= 32:
+        parser.error("--branches_per_method must be between 0 and 32")
 
     # Generate the files
     with open(args.output_dir + "/ICacheBuster.h", "w") as f:
@@ -119,8 +300,14 @@ def main():
     for split_num in range(len(splits)):
         with open("%s/ICacheBuster.part%d.cc" % (args.output_dir, split_num), "w") as f:
             f.write("#include <vector>\n\n")
+            f.write("extern volatile unsigned icb_sink;\n\n")
             methods_code = "\n".join(
-                [METHOD_CODE_TEMPLATE.format(METHOD_NUM=i) for i in splits[split_num]]
+                [
+                    METHOD_CODE_TEMPLATE.format(
+                        METHOD_NUM=i, BODY=method_body(i, args.branches_per_method)
+                    )
+                    for i in splits[split_num]
+                ]
             )
             f.write(methods_code)
             store_methods_code = "\n".join(
@@ -0,0 +1,124 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reads the stats log a node wrote with --stats_log and prints the request
+// rate and latency percentiles of each series over a time range, whole or
+// cut into intervals, so a warm-up or a latency spike can be looked at
+// after the run without rerunning it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "oldisim/Log.h"
+#include "oldisim/StatsLog.h"
+
+#include "StatsLogToolCmdline.h"
+
+namespace {
+
+gengetopt_args_info args;
+
+bool SelectedSeries(const std::string& name) {
+  return !args.series_given ||
+         name.compare(0, strlen(args.series_arg), args.series_arg) == 0;
+}
+
+void PrintWindow(const oldisim::StatsLogWindow& window) {
+  double duration = window.duration();
+  printf("[%.3f s, %.3f s]\n", window.start_ns / 1e9, window.end_ns / 1e9);
+
+  if (args.counters_given) {
+    for (const auto& counter : window.counters) {
+      if (SelectedSeries(counter.first)) {
+        printf("  %-40s %14llu %14.1f/s\n", counter.first.c_str(),
+               static_cast<unsigned long long>(counter.second),
+               duration > 0 ? counter.second / duration : 0.0);
+      }
+    }
+  }
+
+  bool header_printed = false;
+  for (const auto& series : window.histograms) {
+    if (!SelectedSeries(series.first)) {
+      continue;
+    }
+    if (!header_printed) {
+      printf("  %-40s %10s %10s %8s %8s %8s %8s %8s %8s\n", "series", "count",
+             "qps", "avg ms", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms",
+             "max ms");
+      header_printed = true;
+    }
+    const oldisim::HdrHistogram& histogram = series.second;
+    printf("  %-40s %10llu %10.1f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+           series.first.c_str(),
+           static_cast<unsigned long long>(histogram.total()),
+           duration > 0 ? histogram.total() / duration : 0.0,
+           histogram.average() / 1000000, histogram.get_nth(50) / 1000000,
+           histogram.get_nth(90) / 1000000, histogram.get_nth(99) / 1000000,
+           histogram.get_nth(99.9) / 1000000, histogram.maximum() / 1000000);
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (cmdline_parser(argc, argv, &args) != 0) {
+    DIE("cmdline_parser failed");
+  }
+  if (args.interval_arg < 0) {
+    DIE("--interval must not be negative");
+  }
+
+  std::shared_ptr<const oldisim::StatsLog> log =
+      oldisim::StatsLog::Open(args.log_arg);
+  if (log->size() == 0) {
+    printf("%s: no windows logged\n", args.log_arg);
+    return 0;
+  }
+
+  uint64_t log_end = (*log)[log->size() - 1].end_ns;
+  uint64_t from = static_cast<uint64_t>(std::max(args.from_arg, 0.0) * 1e9);
+  uint64_t to = args.to_given
+                    ? static_cast<uint64_t>(std::max(args.to_arg, 0.0) * 1e9)
+                    : log_end;
+  to = std::min(to, log_end);
+  if (from >= to) {
+    DIE("--from must be before --to and the end of the log at %.3f s",
+        log_end / 1e9);
+  }
+
+  printf("%s: %s node, %zu windows over %.3f s, started at %.3f\n",
+         args.log_arg, log->node().c_str(), log->size(), log_end / 1e9,
+         log->start_realtime_ns() / 1e9);
+
+  // Windows are merged whole, so an interval covers the windows that end
+  // in it rather than being cut at exactly the interval bounds
+  uint64_t interval =
+      args.interval_arg > 0 ? static_cast<uint64_t>(args.interval_arg * 1e9)
+                            : to - from;
+  interval = std::max<uint64_t>(interval, 1);
+  for (uint64_t start = from; start < to; start += interval) {
+    oldisim::StatsLogWindow window =
+        log->Merge(start, std::min(start + interval, to));
+    if (window.start_ns < window.end_ns) {
+      PrintWindow(window);
+    }
+  }
+
+  return 0;
+}
@@ -6,69 +6,288 @@
 */
 
 #include <errno.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
 
-bool run_worker;
-unsigned long* worker_counters;
-long nworkers;
-struct timespec one_ns = {
-    .tv_sec = 0,
-    .tv_nsec = 100,
+// How workers go to sleep and get woken up. nanosleep and timerfd workers
+// sleep for a fixed interval on their own; the other modes pair workers up
+// and have them wake each other in turn, ping-pong style.
+enum class Mode {
+  kNanosleep,
+  kTimerfd,
+  kFutex,
+  kEventfd,
+  kEpoll,
+};
+
+const char* mode_names[] = {"nanosleep", "timerfd", "futex", "eventfd", "epoll"};
+constexpr int kNumModes = sizeof(mode_names) / sizeof(mode_names[0]);
+
+// Wakeup overshoot histogram. Values below kSubBuckets get a bucket each,
+// larger ones a bucket 1/kSubBuckets of their power of two wide.
+constexpr int kSubBuckets = 8;
+constexpr int kBuckets = 64 * kSubBuckets;
+
+struct worker_stats {
+  unsigned long count;
+  uint64_t overshoot[kBuckets];
 };
 
 struct worker_arg {
   int worker_id;
 };
 
+// State shared by the two workers of a ping-pong pair. turn says which of
+// them may run, or kStopTurn once the run is over.
+constexpr uint32_t kStopTurn = 2;
+struct pair_state {
+  std::atomic<uint32_t> turn;
+  std::atomic<uint64_t> wake_time;
+};
+
+std::atomic<bool> run_worker;
+Mode mode = Mode::kNanosleep;
+worker_stats* worker_counters;
+long nworkers;
+struct timespec one_ns = {
+    .tv_sec = 0,
+    .tv_nsec = 100,
+};
+pair_state* pairs;
+int* worker_eventfds;
+int* worker_epollfds;
+
 void user_interrupt_handler(int signal) {
   if (signal == SIGINT) {
     run_worker = false;
   }
 }
 
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int bucket_of(uint64_t ns) {
+  if (ns < kSubBuckets) {
+    return ns;
+  }
+  int log = 63 - __builtin_clzll(ns);
+  return (log - 2) * kSubBuckets + ((ns >> (log - 3)) & (kSubBuckets - 1));
+}
+
+uint64_t bucket_floor(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int log = bucket / kSubBuckets + 2;
+  return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets)
+      << (log - 3);
+}
+
+void record_wakeup(worker_stats* stats, uint64_t expected, uint64_t woken) {
+  stats->count++;
+  stats->overshoot[bucket_of(woken > expected ? woken - expected : 0)]++;
+}
+
+void futex_wait(std::atomic<uint32_t>* addr, uint32_t val) {
+  syscall(
+      SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, val,
+      nullptr, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t>* addr, int nwaiters) {
+  syscall(
+      SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+      nwaiters, nullptr, nullptr, 0);
+}
+
+void sleep_worker(worker_stats* stats) {
+  uint64_t interval = one_ns.tv_sec * 1000000000ULL + one_ns.tv_nsec;
+  int tfd = -1;
+  struct itimerspec timer = {};
+  if (mode == Mode::kTimerfd) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    timer.it_value = one_ns;
+  }
+  while (run_worker) {
+    uint64_t start = now_ns();
+    if (mode == Mode::kTimerfd) {
+      uint64_t expirations;
+      timerfd_settime(tfd, 0, &timer, nullptr);
+      if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+        continue;
+      }
+    } else {
+      nanosleep(&one_ns, nullptr);
+    }
+    record_wakeup(stats, start + interval, now_ns());
+  }
+  if (tfd >= 0) {
+    close(tfd);
+  }
+}
+
+// Wait until the partner hands over the turn; returns false once the run
+// is over
+bool wait_turn(int worker_id) {
+  uint32_t side = worker_id % 2;
+  if (mode == Mode::kFutex) {
+    std::atomic<uint32_t>* turn = &pairs[worker_id / 2].turn;
+    uint32_t current;
+    while ((current = turn->load()) != side && current != kStopTurn) {
+      futex_wait(turn, current);
+    }
+    return current != kStopTurn;
+  }
+  int efd = worker_eventfds[worker_id];
+  if (mode == Mode::kEpoll) {
+    struct epoll_event ev;
+    while (epoll_wait(worker_epollfds[worker_id], &ev, 1, -1) < 1) {
+    }
+  }
+  uint64_t value;
+  while (read(efd, &value, sizeof(value)) < 0 && errno == EINTR) {
+  }
+  return run_worker;
+}
+
+void pass_turn(int worker_id) {
+  int partner = worker_id ^ 1;
+  pairs[worker_id / 2].wake_time = now_ns();
+  if (mode == Mode::kFutex) {
+    // Once the run is stopped, the turn stays with nobody
+    uint32_t side = worker_id % 2;
+    pairs[worker_id / 2].turn.compare_exchange_strong(side, partner % 2);
+    futex_wake(&pairs[worker_id / 2].turn, 1);
+  } else {
+    uint64_t one = 1;
+    if (write(worker_eventfds[partner], &one, sizeof(one)) < 0) {
+      printf("Failed to wake worker %d - errno = %d\n", partner, errno);
+    }
+  }
+}
+
+void ping_pong_worker(int worker_id, worker_stats* stats) {
+  // The first worker of a pair starts with the turn, without being woken
+  while (wait_turn(worker_id)) {
+    uint64_t wake_time = pairs[worker_id / 2].wake_time;
+    if (wake_time != 0) {
+      record_wakeup(stats, wake_time, now_ns());
+    }
+    pass_turn(worker_id);
+  }
+}
+
 void* benchmark_worker(void* arg) {
   int worker_id = static_cast<struct worker_arg*>(arg)->worker_id;
-  unsigned long int count;
-  for (count = 0; run_worker; count++) {
-    nanosleep(&one_ns, nullptr);
+  worker_stats* stats = &worker_counters[worker_id];
+  if (mode == Mode::kNanosleep || mode == Mode::kTimerfd) {
+    sleep_worker(stats);
+  } else {
+    ping_pong_worker(worker_id, stats);
   }
-  worker_counters[worker_id] = count;
   return nullptr;
 }
 
-int main(int argc, const char** argv) {
-  if (argc < 2) {
-    printf("Usage: %s <nworkers> [test-seconds]\n", argv[0]);
-    exit(1);
+// Wake up every worker blocked waiting for its partner so that it sees the
+// end of the run
+void stop_workers() {
+  run_worker = false;
+  if (mode == Mode::kFutex) {
+    for (long i = 0; i < nworkers / 2; ++i) {
+      pairs[i].turn = kStopTurn;
+      futex_wake(&pairs[i].turn, 2);
+    }
+  } else if (mode == Mode::kEventfd || mode == Mode::kEpoll) {
+    uint64_t one = 1;
+    for (long i = 0; i < nworkers; ++i) {
+      if (write(worker_eventfds[i], &one, sizeof(one)) < 0) {
+        printf("Failed to stop worker %ld - errno = %d\n", i, errno);
+      }
+    }
   }
-  nworkers = atol(argv[1]);
-  long test_seconds = 0;
-  if (argc >= 3) {
-    test_seconds = atol(argv[2]);
+}
+
+uint64_t percentile(const uint64_t* histogram, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    total += histogram[i];
   }
-  if (argc >= 4) {
-    long sleep_ns = atol(argv[3]);
-    if (sleep_ns > 0) {
-      one_ns.tv_nsec = sleep_ns;
+  uint64_t rank = total * p;
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += histogram[i];
+    if (seen > rank) {
+      return bucket_floor(i);
     }
   }
-  worker_counters = new unsigned long[nworkers];
+  return 0;
+}
+
+void run_benchmark(long test_seconds, bool pin, const cpu_set_t& cpus) {
+  worker_counters = new worker_stats[nworkers]();
   pthread_t* workers = new pthread_t[nworkers];
   struct worker_arg* worker_args = new struct worker_arg[nworkers];
+  pairs = new pair_state[nworkers / 2];
+  for (long i = 0; i < nworkers / 2; ++i) {
+    pairs[i].turn = 0;
+    pairs[i].wake_time = 0;
+  }
+  worker_eventfds = new int[nworkers];
+  worker_epollfds = new int[nworkers];
+  for (long i = 0; i < nworkers; ++i) {
+    worker_eventfds[i] =
+        eventfd(i % 2 == 0 ? 1 : 0, mode == Mode::kEpoll ? EFD_NONBLOCK : 0);
+    worker_epollfds[i] = -1;
+    if (mode == Mode::kEpoll) {
+      worker_epollfds[i] = epoll_create1(0);
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      epoll_ctl(worker_epollfds[i], EPOLL_CTL_ADD, worker_eventfds[i], &ev);
+    }
+  }
+  std::vector<int> cpu_ids;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      cpu_ids.push_back(cpu);
+    }
+  }
   // create threads
   run_worker = true;
   for (long i = 0; i < nworkers; ++i) {
     worker_args[i].worker_id = i;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pin) {
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpu_ids[i % cpu_ids.size()], &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
     int ret =
-        pthread_create(&workers[i], nullptr, benchmark_worker, &worker_args[i]);
+        pthread_create(&workers[i], &attr, benchmark_worker, &worker_args[i]);
     if (ret != 0) {
       printf("Failed to create worker %ld - errno = %d\n", i, errno);
     }
+    pthread_attr_destroy(&attr);
   }
   // measure current time
   struct timespec start_time;
@@ -76,10 +295,13 @@ int main(int argc, const char** argv) {
   // wait
   if (test_seconds > 0) {
     sleep(test_seconds);
-    run_worker = false;
   } else {
     signal(SIGINT, user_interrupt_handler);
+    while (run_worker) {
+      sleep(1);
+    }
   }
+  stop_workers();
   for (long i = 0; i < nworkers; ++i) {
     pthread_join(workers[i], nullptr);
   }
@@ -89,12 +311,111 @@ int main(int argc, const char** argv) {
   double time_elapsed = (end_time.tv_sec - start_time.tv_sec) +
       (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
   printf("%lf seconds elapsed\n", time_elapsed);
-  unsigned long total_nanosleep_calls = 0;
+  unsigned long total_calls = 0;
+  uint64_t overshoot[kBuckets] = {};
   for (long i = 0; i < nworkers; ++i) {
-    printf("worker %ld: %lu\n", i, worker_counters[i]);
-    total_nanosleep_calls += worker_counters[i];
+    printf("worker %ld: %lu\n", i, worker_counters[i].count);
+    total_calls += worker_counters[i].count;
+    for (int j = 0; j < kBuckets; ++j) {
+      overshoot[j] += worker_counters[i].overshoot[j];
+    }
+  }
+  printf("%lu total %s calls\n", total_calls, mode_names[(int)mode]);
+  printf("wakeup overshoot p50: %lu ns\n", percentile(overshoot, 0.50));
+  printf("wakeup overshoot p99: %lu ns\n", percentile(overshoot, 0.99));
+  printf("%lf calls per second\n", 1.0 * total_calls / time_elapsed);
+
+  for (long i = 0; i < nworkers; ++i) {
+    close(worker_eventfds[i]);
+    if (worker_epollfds[i] >= 0) {
+      close(worker_epollfds[i]);
+    }
+  }
+  delete[] worker_epollfds;
+  delete[] worker_eventfds;
+  delete[] pairs;
+  delete[] worker_args;
+  delete[] workers;
+  delete[] worker_counters;
+}
+
+void usage(const char* argv0) {
+  printf(
+      "Usage: %s [-m mode] [-p] <nworkers>[,<nworkers>...] [test-seconds] "
+      "[sleep-ns]\n"
+      "  -m  nanosleep (default), timerfd, or futex, eventfd, epoll for\n"
+      "      wakeups between pairs of workers\n"
+      "  -p  pin each worker to one of the allowed CPUs\n",
+      argv0);
+  exit(1);
+}
+
+int main(int argc, char* const* argv) {
+  bool pin = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p")) != -1) {
+    if (opt == 'p') {
+      pin = true;
+    } else if (opt == 'm') {
+      int i = 0;
+      while (i < kNumModes && strcmp(optarg, mode_names[i]) != 0) {
+        ++i;
+      }
+      if (i == kNumModes) {
+        usage(argv[0]);
+      }
+      mode = static_cast<Mode>(i);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 1) {
+    usage(argv[0]);
+  }
+  std::vector<long> worker_counts;
+  std::string counts = argv[optind];
+  for (size_t pos = 0; pos <= counts.size();) {
+    size_t comma = counts.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = counts.size();
+    }
+    worker_counts.push_back(atol(counts.substr(pos, comma - pos).c_str()));
+    pos = comma + 1;
+  }
+  long test_seconds = 0;
+  if (argc - optind >= 2) {
+    test_seconds = atol(argv[optind + 1]);
+  }
+  if (argc - optind >= 3) {
+    long sleep_ns = atol(argv[optind + 2]);
+    if (sleep_ns > 0) {
+      one_ns.tv_sec = sleep_ns / 1000000000;
+      one_ns.tv_nsec = sleep_ns % 1000000000;
+    }
+  }
+  bool ping_pong = mode != Mode::kNanosleep && mode != Mode::kTimerfd;
+  for (long count : worker_counts) {
+    if (count < 1 || (ping_pong && count % 2 != 0)) {
+      printf(
+          "%s needs %s number of workers\n",
+          mode_names[(int)mode],
+          ping_pong ? "a positive, even" : "a positive");
+      exit(1);
+    }
+  }
+  cpu_set_t cpus;
+  sched_getaffinity(0, sizeof(cpus), &cpus);
+
+  for (long count : worker_counts) {
+    nworkers = count;
+    if (worker_counts.size() > 1) {
+      printf(
+          "%s with %ld workers%s\n",
+          mode_names[(int)mode],
+          nworkers,
+          pin ? ", pinned" : "");
+    }
+    run_benchmark(test_seconds, pin, cpus);
   }
-  printf("%lu total nanosleep calls\n", total_nanosleep_calls);
-  printf("%lf calls per second\n", 1.0 * total_nanosleep_calls / time_elapsed);
   return 0;
 }
@@ -87,12 +87,6 @@ def add_common_server_args(server_parser: ArgumentParser) -> List[Tuple[str, str
         default=0.75,
         help="ratio of # fast threads to # logical cores",
     )
-    server_parser.add_argument(
-        "--dispatcher-to-fast-ratio",
-        type=float,
-        default=0.25,
-        help="ratio of # dispatchers to # fast threads",
-    )
     server_parser.add_argument(
         "--slow-to-fast-ratio",
         type=float,
@@ -100,16 +94,17 @@ def add_common_server_args(server_parser: ArgumentParser) -> List[Tuple[str, str
         help="ratio of # fast threads to # slow threads",
     )
     server_parser.add_argument(
-        "--slow-threads-use-semaphore",
+        "--pin-threads",
         type=int,
         default=0,
-        help="use semaphore to wait for slow requests, set to 0 to turn off",
+        help="pin tao bench threads to dedicated cpu cores, set to nonzero to turn on",
     )
     server_parser.add_argument(
-        "--pin-threads",
+        "--numa-affinity",
         type=int,
         default=0,
-        help="pin tao bench threads to dedicated cpu cores, set to nonzero to turn on",
+        choices=[0, 1, 2],
+        help="keep slow requests on the worker's NUMA node, 0 (off), 1 (idle slow threads help other nodes) or 2 (strict)",
     )
     server_parser.add_argument(
         "--interface-name",
@@ -110,6 +110,10 @@ patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0003-tao_bench_thread_pool_naming.diff"
 patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0006-tao_bench_slow_thread_use_semaphore.diff"
 patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0007-tao_bench_smart_nanosleep.diff"
 patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0008-tao_bench_count_nanosleeps.diff"
+patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0009-tao_bench_slow_path_mpmc_rings.diff"
+patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0010-tao_bench_alias_item_sizes.diff"
+patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0011-tao_bench_latency_histograms.diff"
+patch -p1 -i "${BPKGS_TAO_BENCH_ROOT}/0012-tao_bench_numa_slow_path.diff"
 
 # Find the path to folly and fmt
 FOLLY_INSTALLED_PATH="${FOLLY_BUILD_ROOT}/installed/folly"
@@ -7,6 +7,14 @@
 
 class TaoBenchServerSnapshot:
     KEYS = ["fast_qps", "hit_rate", "slow_qps", "slow_qps_oom", "nanosleeps_per_sec"]
+    # Latency percentiles over the interval, in microseconds, only reported
+    # by servers built with the latency histograms
+    LATENCY_CLASSES = ["fast", "slow_queue", "slow_service"]
+    LATENCY_KEYS = [
+        f"{cls}_{stat}_us"
+        for cls in LATENCY_CLASSES
+        for stat in ["p50", "p90", "p99", "p999", "max"]
+    ]
 
     def __init__(self, line):
         if line.strip().startswith("OUT OF MEMORY"):
@@ -23,7 +31,7 @@ class TaoBenchServerSnapshot:
                 key, value = keyvalue.split("=", maxsplit=2)
                 key = key.strip()
                 value = value.strip()
-                if key in self.KEYS:
+                if key in self.KEYS or key in self.LATENCY_KEYS:
                     setattr(self, key, float(value))
             except ValueError:
                 continue
@@ -35,7 +43,7 @@ class TaoBenchServerSnapshot:
                 break
 
     def get(self, key):
-        if key in self.KEYS and not hasattr(self, key):
+        if (key in self.KEYS or key in self.LATENCY_KEYS) and not hasattr(self, key):
             return 0.0
         return getattr(self, key)
 
@@ -81,7 +89,9 @@ class TaoBenchParser:
     def generate_server_csv(self, server_snapshots):
         lines = []
         lines.append(
-            "seq,total_qps,fast_qps,hit_rate,slow_qps,is_oom,slow_qps_oom,nanosleeps_per_sec\n"
+            "seq,total_qps,fast_qps,hit_rate,slow_qps,is_oom,slow_qps_oom,nanosleeps_per_sec,"
+            + ",".join(TaoBenchServerSnapshot.LATENCY_KEYS)
+            + "\n"
         )
 
         seq = 0
@@ -91,10 +101,13 @@ class TaoBenchParser:
             is_oom = 1 if snapshot.is_oom else 0
             total_qps = fast_qps + slow_qps
             nanosleeps_per_sec = snapshot.get("nanosleeps_per_sec")
+            latencies = ",".join(
+                str(snapshot.get(key)) for key in TaoBenchServerSnapshot.LATENCY_KEYS
+            )
             lines.append(
                 f"{seq},{total_qps},{fast_qps},"
                 + f"{snapshot.get('hit_rate')},{slow_qps},{is_oom},"
-                + f"{snapshot.get('slow_qps_oom')},{nanosleeps_per_sec}\n"
+                + f"{snapshot.get('slow_qps_oom')},{nanosleeps_per_sec},{latencies}\n"
             )
             seq += 1
 
@@ -105,6 +118,7 @@ class TaoBenchParser:
         counter = 0
         total_fast_qps = 0
         total_slow_pqs = 0
+        total_p99_us = {cls: 0 for cls in TaoBenchServerSnapshot.LATENCY_CLASSES}
         for snapshot in reversed(server_snapshots):
             if not snapshot.valid:
                 continue
@@ -118,14 +132,20 @@ class TaoBenchParser:
                 continue
             total_fast_qps += snapshot.get("fast_qps")
             total_slow_pqs += snapshot.get("slow_qps")
+            for cls in total_p99_us:
+                total_p99_us[cls] += snapshot.get(f"{cls}_p99_us")
             if counter >= 360 / 5 - 10:
                 break
         if counter > 0:
             metrics["fast_qps"] = total_fast_qps / counter
             metrics["slow_qps"] = total_slow_pqs / counter
+            for cls, total in total_p99_us.items():
+                metrics[f"{cls}_p99_us"] = total / counter
         else:
             metrics["fast_qps"] = 0
             metrics["slow_qps"] = 0
+            for cls in total_p99_us:
+                metrics[f"{cls}_p99_us"] = 0
         metrics["total_qps"] = metrics["fast_qps"] + metrics["slow_qps"]
         if metrics["total_qps"] > 0:
             metrics["hit_ratio"] = metrics["fast_qps"] / metrics["total_qps"]
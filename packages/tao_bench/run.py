@@ -121,7 +121,6 @@ def run_server(args):
         affinitize_nic(args)
     # number of threads for various paths
     n_threads = max(int(n_cores * args.fast_threads_ratio), 1)
-    n_dispatchers = max(int(n_threads * args.dispatcher_to_fast_ratio), 1)
     n_slow_threads = max(int(n_threads * args.slow_to_fast_ratio), 1)
     # memory size
     n_mem = int(args.memsize * 1024 * args_utils.MEM_USAGE_FACTOR)
@@ -139,17 +138,14 @@ def run_server(args):
         f"tao_it_gen_file={os.path.join(TAO_BENCH_DIR, 'leader_sizes.json')}",
         "tao_max_item_size=65536",
         "tao_gen_payload=0",
-        f"tao_slow_dispatchers={n_dispatchers}",
         f"tao_num_slow_threads={n_slow_threads}",
         "tao_max_slow_reqs=1024",
         "tao_worker_sleep_ns=100",
-        "tao_dispatcher_sleep_ns=100",
-        "tao_slow_sleep_ns=100",
         "tao_slow_path_sleep_us=0",
         "tao_compress_items=1",
         f"tao_stats_sleep_ms={args.stats_interval}",
-        f"tao_slow_use_semaphore={args.slow_threads_use_semaphore}",
         f"tao_pin_threads={args.pin_threads}",
+        f"tao_numa_affinity={args.numa_affinity}",
         f"tao_smart_nanosleep={args.smart_nanosleep}",
     ]
     if not args.disable_tls:
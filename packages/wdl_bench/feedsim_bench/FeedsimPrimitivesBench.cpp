@@ -0,0 +1,326 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This source code is licensed under the MIT license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Microbenchmarks of the folly and fbthrift primitives on the hot path of the
+// feedsim ranking leaf, run on the types of feedsim's ranking.thrift in the
+// shape of the responses its leaf generates, so that a change in feedsim
+// performance across SKUs can be traced to the primitives behind it.
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <folly/Benchmark.h>
+#include <folly/compression/Compression.h>
+#include <folly/container/F14Map.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/ThreadWheelTimekeeper.h>
+#include <folly/init/Init.h>
+#include <folly/io/IOBuf.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/small_vector.h>
+#include <thrift/lib/cpp2/protocol/Serializer.h>
+
+#include "ranking/if/gen-cpp2/ranking_types.h"
+
+namespace {
+
+// Shape of the responses of the leaf's generator with the default
+// --num_objects: stories per response, objects per story, and actions and
+// entries of every payload map per object
+constexpr size_t kResponseStories = 40;
+constexpr size_t kStoryObjects = 20;
+constexpr size_t kObjectActions = 5;
+constexpr size_t kPayloadMapEntries = 5;
+constexpr size_t kMetadataSize = 200;
+// Elements of SmallListI64 kept inline
+constexpr size_t kSmallListInline = 8;
+
+// Builds a response the way the leaf's generateRandomRankingResponse does,
+// from a fixed seed so every run serializes the same bytes
+ranking::RankingResponse makeRankingResponse(std::mt19937_64& rng) {
+  ranking::RankingResponse resp;
+  resp.queryID() = static_cast<int64_t>(rng());
+  resp.rankingStories()->reserve(kResponseStories);
+  for (size_t s = 0; s < kResponseStories; s++) {
+    ranking::RankingStory story;
+    const uint64_t story_rand = rng();
+    story.storyID() = static_cast<int64_t>(story_rand);
+    story.weight() = static_cast<double>(story_rand);
+    story.storyType() = static_cast<ranking::RankingStoryType>(
+        story_rand %
+        static_cast<uint64_t>(ranking::RankingStoryType::STORY_TYPE_Z));
+    story.objects()->reserve(kStoryObjects);
+    for (size_t o = 0; o < kStoryObjects; o++) {
+      ranking::RankingObject obj;
+      const uint64_t obj_rand = rng();
+      obj.objectID() = static_cast<int64_t>(obj_rand);
+      obj.objectType() = static_cast<ranking::RankingObjectType>(
+          obj_rand %
+          static_cast<uint64_t>(ranking::RankingObjectType::OBJ_TYPE_Z));
+      obj.actorID() = static_cast<int64_t>(obj_rand);
+      obj.createTime() = static_cast<int64_t>(obj_rand);
+      obj.weight() = static_cast<double>(obj_rand);
+      for (size_t k = 0; k < kPayloadMapEntries; k++) {
+        obj.payloadIntMap()->emplace(static_cast<int16_t>(rng()), 42);
+        obj.payloadStrMap()->emplace(
+            static_cast<int16_t>(rng()), "abcdefghijklmnopqrstuvwyz");
+        obj.payloadVecMap()->emplace(
+            static_cast<int16_t>(rng()), ranking::SmallListI64());
+      }
+      for (size_t a = 0; a < kObjectActions; a++) {
+        ranking::Action action;
+        const uint64_t action_rand = rng();
+        action.type() = static_cast<int16_t>(action_rand >> 48);
+        action.timeUsec() = static_cast<int64_t>(action_rand);
+        action.timeMsec() = static_cast<int32_t>(action_rand >> 32);
+        action.actorID() = static_cast<int64_t>(action_rand);
+        obj.actions()->push_back(std::move(action));
+      }
+      story.objects()->push_back(std::move(obj));
+    }
+    resp.rankingStories()->push_back(std::move(story));
+  }
+  resp.metadata()->resize(kMetadataSize);
+  for (auto& c : *resp.metadata()) {
+    c = static_cast<char>('a' + rng() % 26);
+  }
+  return resp;
+}
+
+const ranking::RankingResponse& response() {
+  static const auto resp = [] {
+    std::mt19937_64 rng(1);
+    return makeRankingResponse(rng);
+  }();
+  return resp;
+}
+
+std::unique_ptr<folly::IOBuf> serializedResponse() {
+  folly::IOBufQueue queue;
+  apache::thrift::CompactSerializer::serialize(response(), &queue);
+  return queue.move();
+}
+
+// Every object of a response builds its payload maps one entry at a time
+void insertPayloadMaps(size_t iters, size_t entries) {
+  for (size_t i = 0; i < iters; i++) {
+    ranking::RankingPayloadIntMap int_map;
+    ranking::RankingPayloadStringMap str_map;
+    ranking::RankingPayloadVecMap vec_map;
+    int_map.reserve(entries);
+    str_map.reserve(entries);
+    vec_map.reserve(entries);
+    for (size_t k = 0; k < entries; k++) {
+      const auto key = static_cast<int16_t>(k * 7919 + i);
+      int_map.emplace(key, static_cast<int64_t>(k));
+      str_map.emplace(key, "abcdefghijklmnopqrstuvwyz");
+      vec_map.emplace(key, ranking::SmallListI64(kSmallListInline, key));
+    }
+    folly::doNotOptimizeAway(int_map);
+    folly::doNotOptimizeAway(str_map);
+    folly::doNotOptimizeAway(vec_map);
+  }
+}
+
+void iteratePayloadMaps(size_t iters, size_t entries) {
+  ranking::RankingPayloadIntMap int_map;
+  ranking::RankingPayloadVecMap vec_map;
+  BENCHMARK_SUSPEND {
+    for (size_t k = 0; k < entries; k++) {
+      const auto key = static_cast<int16_t>(k * 7919);
+      int_map.emplace(key, static_cast<int64_t>(k));
+      vec_map.emplace(key, ranking::SmallListI64(kSmallListInline, key));
+    }
+  }
+  for (size_t i = 0; i < iters; i++) {
+    int64_t sum = 0;
+    for (const auto& entry : int_map) {
+      sum += entry.second;
+    }
+    for (const auto& entry : vec_map) {
+      for (auto value : entry.second) {
+        sum += value;
+      }
+    }
+    folly::doNotOptimizeAway(sum);
+  }
+}
+
+// Up to kSmallListInline elements stay inline, more move to the heap
+void fillSmallList(size_t iters, size_t length) {
+  for (size_t i = 0; i < iters; i++) {
+    ranking::SmallListI64 list;
+    for (size_t j = 0; j < length; j++) {
+      list.push_back(static_cast<int64_t>(i + j));
+    }
+    folly::doNotOptimizeAway(list);
+  }
+}
+
+void copySmallList(size_t iters, size_t length) {
+  ranking::SmallListI64 list;
+  BENCHMARK_SUSPEND {
+    for (size_t j = 0; j < length; j++) {
+      list.push_back(static_cast<int64_t>(j));
+    }
+  }
+  for (size_t i = 0; i < iters; i++) {
+    ranking::SmallListI64 copy(list);
+    folly::doNotOptimizeAway(copy);
+  }
+}
+
+std::unique_ptr<folly::io::Codec> zstdCodec() {
+  return folly::io::getCodec(
+      folly::io::CodecType::ZSTD, folly::io::COMPRESSION_LEVEL_DEFAULT);
+}
+
+// The leaf compresses half of every serialized response
+std::unique_ptr<folly::IOBuf> compressionInput() {
+  auto buf = serializedResponse();
+  buf->coalesce();
+  buf->trimEnd(buf->length() / 2);
+  return buf;
+}
+
+// Fans num_tasks tasks out to a pool and joins them the way the leaf joins
+// its PageRank, compression and pointer chase stages
+void forkJoin(size_t iters, size_t num_tasks) {
+  std::unique_ptr<folly::CPUThreadPoolExecutor> pool;
+  BENCHMARK_SUSPEND {
+    pool = std::make_unique<folly::CPUThreadPoolExecutor>(num_tasks);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    std::vector<folly::Future<int>> futures;
+    futures.reserve(num_tasks);
+    for (size_t t = 0; t < num_tasks; t++) {
+      futures.push_back(folly::via(pool.get(), [t]() {
+        return static_cast<int>(t);
+      }));
+    }
+    int sum = 0;
+    for (auto value : folly::collect(futures).get()) {
+      sum += value;
+    }
+    folly::doNotOptimizeAway(sum);
+  }
+  BENCHMARK_SUSPEND {
+    pool.reset();
+  }
+}
+
+// Time per iteration above the requested sleep is the timer wheel's lateness
+void timekeeperSleep(size_t iters, size_t micros) {
+  std::unique_ptr<folly::ThreadWheelTimekeeper> timekeeper;
+  BENCHMARK_SUSPEND {
+    timekeeper = std::make_unique<folly::ThreadWheelTimekeeper>();
+  }
+  for (size_t i = 0; i < iters; i++) {
+    folly::futures::sleep(std::chrono::microseconds(micros), timekeeper.get())
+        .get();
+  }
+  BENCHMARK_SUSPEND {
+    timekeeper.reset();
+  }
+}
+} // namespace
+
+BENCHMARK_PARAM(insertPayloadMaps, 5)
+BENCHMARK_PARAM(insertPayloadMaps, 64)
+BENCHMARK_PARAM(iteratePayloadMaps, 5)
+BENCHMARK_PARAM(iteratePayloadMaps, 64)
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_PARAM(fillSmallList, 8)
+BENCHMARK_PARAM(fillSmallList, 16)
+BENCHMARK_PARAM(copySmallList, 8)
+BENCHMARK_PARAM(copySmallList, 16)
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(buildRankingResponse, iters) {
+  std::mt19937_64 rng(1);
+  for (size_t i = 0; i < iters; i++) {
+    auto resp = makeRankingResponse(rng);
+    folly::doNotOptimizeAway(resp);
+  }
+}
+
+BENCHMARK(compactSerializeRankingResponse, iters) {
+  const auto& resp = response();
+  for (size_t i = 0; i < iters; i++) {
+    folly::IOBufQueue queue;
+    apache::thrift::CompactSerializer::serialize(resp, &queue);
+    folly::doNotOptimizeAway(queue);
+  }
+}
+
+BENCHMARK(compactDeserializeRankingResponse, iters) {
+  std::unique_ptr<folly::IOBuf> buf;
+  BENCHMARK_SUSPEND {
+    buf = serializedResponse();
+  }
+  for (size_t i = 0; i < iters; i++) {
+    ranking::RankingResponse resp;
+    apache::thrift::CompactSerializer::deserialize(buf.get(), resp);
+    folly::doNotOptimizeAway(resp);
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(zstdCodecCreate, iters) {
+  for (size_t i = 0; i < iters; i++) {
+    auto codec = zstdCodec();
+    folly::doNotOptimizeAway(codec);
+  }
+}
+
+BENCHMARK(zstdCompressNewCodec, iters) {
+  std::unique_ptr<folly::IOBuf> input;
+  BENCHMARK_SUSPEND {
+    input = compressionInput();
+  }
+  for (size_t i = 0; i < iters; i++) {
+    auto compressed = zstdCodec()->compress(input.get());
+    folly::doNotOptimizeAway(compressed);
+  }
+}
+
+BENCHMARK_RELATIVE(zstdCompressReusedCodec, iters) {
+  std::unique_ptr<folly::IOBuf> input;
+  std::unique_ptr<folly::io::Codec> codec;
+  BENCHMARK_SUSPEND {
+    input = compressionInput();
+    codec = zstdCodec();
+  }
+  for (size_t i = 0; i < iters; i++) {
+    auto compressed = codec->compress(input.get());
+    folly::doNotOptimizeAway(compressed);
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_PARAM(forkJoin, 1)
+BENCHMARK_PARAM(forkJoin, 4)
+BENCHMARK_PARAM(forkJoin, 16)
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_PARAM(timekeeperSleep, 100)
+BENCHMARK_PARAM(timekeeperSleep, 1000)
+
+int main(int argc, char** argv) {
+  folly::Init init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
@@ -174,6 +174,22 @@ build_fbthrift()
 }
 
 
+build_feedsim_bench()
+{
+    # Primitives of the feedsim ranking leaf, on the folly and fbthrift
+    # built above
+    local prefix_path
+    prefix_path="$(find "${WDL_BUILD}/installed" -mindepth 1 -maxdepth 1 -type d | paste -sd ';')"
+    cmake -S "${BPKGS_WDL_ROOT}/feedsim_bench" -B "${WDL_BUILD}/feedsim_bench" \
+        -DCMAKE_BUILD_TYPE=Release \
+        -DCMAKE_PREFIX_PATH="${prefix_path}" \
+        -DFBTHRIFT_SOURCE_DIR="${WDL_SOURCE}/fbthrift" \
+        -DFEEDSIM_RANKING_DIR="${BENCHPRESS_ROOT}/packages/feedsim/third_party/src/workloads/ranking" || exit 1
+    cmake --build "${WDL_BUILD}/feedsim_bench" -j "$(nproc)" || exit 1
+    cp "${WDL_BUILD}/feedsim_bench/feedsim_primitives_bench" "${WDL_ROOT}/" || exit
+}
+
+
 build_lzbench()
 {
     lib='lzbench'
@@ -216,6 +232,7 @@ pushd "${WDL_ROOT}"
 
 build_folly
 build_fbthrift
+build_feedsim_bench
 build_lzbench
 build_openssl
 
@@ -33,7 +33,7 @@ folly_benchmark_list_single="hash_hash_benchmark hash_maps_bench fibers_fibers_b
 
 folly_benchmark_list_all="hash_hash_benchmark lt_hash_benchmark memcpy_benchmark memset_benchmark random_benchmark ProtocolBench"
 
-folly_benchmark_list_multi="concurrency_concurrent_hash_map_bench stats_digest_builder_benchmark small_locks_benchmark"
+folly_benchmark_list_multi="concurrency_concurrent_hash_map_bench stats_digest_builder_benchmark small_locks_benchmark feedsim_primitives_bench"
 
 run_list=""
 